@@ -0,0 +1,9 @@
+-- ops: 5000000
+-- Arithmetic in a numeric for loop: one multiply, add and subtract per iteration.
+local sum: number = 0
+
+for i: number = 1, 5000000 do
+    sum = sum + i * 2 - 1
+end
+
+print(sum)
@@ -0,0 +1,115 @@
+#!/bin/sh
+#  bench.sh - runs the benchmark corpus under luappvm and the reference Lua 5.1
+#
+#  usage: bench/bench.sh [-n runs] [program.lua ...]
+#
+#  Every program states the number of operations it performs in a `-- ops: N` header line. Each
+#  program is compiled with luappc once and then run `runs` times (default 5) by both VMs, the
+#  report shows the mean ops/sec and the relative standard deviation of each. The reference VM runs
+#  the same source with the type annotations removed. Both VMs have to print the same output,
+#  otherwise the program is reported as a mismatch. The script exits with 1 if any program is
+#  missing its header, fails to compile or run, or prints something else than the reference.
+#
+#  LUAPPC, LUAPPVM and LUA51 override the binaries (defaults: bin/luappc, bin/luappvm, bin/lua51).
+
+set -u
+
+LUAPPC=${LUAPPC:-bin/luappc}
+LUAPPVM=${LUAPPVM:-bin/luappvm}
+LUA51=${LUA51:-bin/lua51}
+RUNS=5
+FAILED=0
+
+if [ "${1:-}" = "-n" ]; then
+    RUNS=$2
+    shift 2
+fi
+
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/*.lua
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# now() -- current time in nanoseconds
+now() {
+    date +%s%N
+}
+
+# measure() -- runs a command `RUNS` times, prints "mean stddev" of ops/sec
+#     args: number of operations, output file, command...
+measure() {
+    ops=$1
+    out=$2
+    shift 2
+
+    i=0
+    times=""
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        "$@" > "$out" 2>&1 || return 1
+        end=$(now)
+        times="$times $((end - start))"
+        i=$((i + 1))
+    done
+
+    echo "$times" | awk -v ops="$ops" '{
+        for (i = 1; i <= NF; i++) {
+            rate = ops / ($i / 1e9)
+            sum += rate
+            sq += rate * rate
+        }
+        mean = sum / NF
+        var = sq / NF - mean * mean
+        printf "%.0f %.1f\n", mean, (var > 0 ? sqrt(var) : 0) / mean * 100
+    }'
+}
+
+printf "%-12s %16s %8s %16s %8s %8s\n" program "luappvm ops/s" "+-%" "lua5.1 ops/s" "+-%" ratio
+
+for program in "$@"; do
+    name=$(basename "$program" .lua)
+    ops=$(sed -n 's/^-- ops: *//p' "$program")
+
+    if [ -z "$ops" ]; then
+        printf "%-12s missing '-- ops: N' header\n" "$name"
+        FAILED=1
+        continue
+    fi
+
+    # The reference VM runs plain Lua: drop `: type` annotations
+    sed -E 's/:[[:space:]]*(number|string|boolean|any|Array<[^>]*>|Table<[^>]*>)//g' "$program" \
+        > "$TMP/$name.lua"
+
+    checked=true
+    if ! reference=$(measure "$ops" "$TMP/$name.ref" "$LUA51" "$TMP/$name.lua"); then
+        reference="- -"
+        checked=false
+    fi
+
+    if ! "$LUAPPC" -o "$TMP/$name.bin" "$program" > "$TMP/$name.log" 2>&1; then
+        printf "%-12s %16s %8s %16s %8s\n" "$name" "compile error" "-" ${reference}
+        FAILED=1
+        continue
+    fi
+
+    if ! luapp=$(measure "$ops" "$TMP/$name.out" "$LUAPPVM" "$TMP/$name.bin"); then
+        printf "%-12s %16s %8s %16s %8s\n" "$name" "runtime error" "-" ${reference}
+        FAILED=1
+        continue
+    fi
+
+    if $checked && ! cmp -s "$TMP/$name.out" "$TMP/$name.ref"; then
+        printf "%-12s %16s %8s %16s %8s\n" "$name" "output mismatch" "-" ${reference}
+        FAILED=1
+        continue
+    fi
+
+    ratio=$(awk -v a="${luapp% *}" -v b="${reference% *}" \
+        'BEGIN { if (b == "-" || b == 0) print "-"; else printf "%.2f", a / b }')
+    printf "%-12s %16s %8s %16s %8s %8s\n" "$name" "${luapp% *}" "${luapp#* }" \
+        "${reference% *}" "${reference#* }" "$ratio"
+done
+
+exit $FAILED
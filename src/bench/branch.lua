@@ -0,0 +1,17 @@
+-- ops: 3000000
+-- Conditional branches: a while loop comparing numbers with constants and with each other.
+local i: number = 0
+local low: number = 0
+local high: number = 0
+local limit: number = 1500000
+
+while i < 3000000 do
+    i = i + 1
+    if i % 3 == 0 then
+        low = low + 1
+    elseif i > limit then
+        high = high + 1
+    end
+end
+
+print(low, high)
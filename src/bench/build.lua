@@ -0,0 +1,15 @@
+-- ops: 500000
+-- String building: the inner loop only appends to a local, its length is read after the loop.
+local total: number = 0
+
+for j: number = 1, 50 do
+    local s: string = ""
+
+    for i: number = 1, 10000 do
+        s = s .. "ab" .. i
+    end
+
+    total = total + #s
+end
+
+print(total)
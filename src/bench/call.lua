@@ -0,0 +1,13 @@
+-- ops: 2000000
+-- Calls of a small Lua function with two arguments and one result.
+local function add(a: number, b: number): number
+    return a + b
+end
+
+local sum: number = 0
+
+for i: number = 1, 2000000 do
+    sum = add(sum, i)
+end
+
+print(sum)
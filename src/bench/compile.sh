@@ -0,0 +1,114 @@
+#!/bin/sh
+#  compile.sh - compares the compile time and memory of luappc on whole programs and with --stream
+#
+#  usage: bench/compile.sh [-n runs] [statements ...]
+#
+#  For every size (default: 2000 8000 20000 statements) a program of that many top-level
+#  statements is generated: assignments to a global, literal arrays and small typed functions that
+#  are called right away. It is compiled `runs` times (default 5) as a whole tree and statement by
+#  statement (--stream), the report shows the mean time the passes took and the peak RSS, both read
+#  from --stats. Both bytecode files have to print the same output under luappvm, otherwise the size
+#  is reported as a mismatch.
+#
+#  LUAPPC and LUAPPVM override the binaries (defaults: bin/luappc, bin/luappvm).
+
+set -u
+
+LUAPPC=${LUAPPC:-bin/luappc}
+LUAPPVM=${LUAPPVM:-bin/luappvm}
+RUNS=5
+
+if [ "${1:-}" = "-n" ]; then
+    RUNS=$2
+    shift 2
+fi
+
+if [ $# -eq 0 ]; then
+    set -- 2000 8000 20000
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# generate() -- writes a program of a number of top-level statements
+#     args: number of statements
+generate() {
+    awk -v n="$1" 'BEGIN {
+        print "x = 0"
+        for (i = 1; i < n - 1; i++) {
+            if (i % 10 == 0) {
+                printf "f%d = function(a: number): number\n", i
+                print "    local b: number = a * 2"
+                print "    if b > 10 then"
+                print "        b = b - 1"
+                print "    end"
+                printf "    return a + b + %d\nend\n", i
+                printf "x = f%d(x)\n", i
+                i++
+            } else if (i % 10 == 5) {
+                printf "d%d = {", i
+                for (j = 0; j < 40; j++)
+                    printf "%s%d", (j > 0 ? ", " : ""), j
+                print "}"
+            } else
+                printf "x = x + %d * 2\n", i
+        }
+        print "print(x)"
+    }'
+}
+
+# measure() -- compiles a program `RUNS` times, prints "mean-seconds peak-rss-kb"
+#     args: program, bytecode file, luappc options...
+measure() {
+    program=$1
+    out=$2
+    shift 2
+
+    : > "$TMP/stats"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        "$LUAPPC" --stats -o "$out" "$@" "$program" 2>> "$TMP/stats" > /dev/null || return 1
+        i=$((i + 1))
+    done
+
+    awk -v runs="$RUNS" '
+        /"wall"/ {
+            sub(/.*"wall": */, "")
+            wall += $1 + 0
+            sub(/.*"peak_rss_kb": */, "")
+            if ($1 + 0 > rss)
+                rss = $1 + 0
+        }
+        END { printf "%.3f %d\n", wall / runs, rss }' "$TMP/stats"
+}
+
+printf "%-12s %12s %12s %12s %12s %8s\n" statements "whole s" "whole KB" "stream s" "stream KB" speedup
+
+for size in "$@"; do
+    program="$TMP/p$size.lua"
+    generate "$size" > "$program"
+
+    if ! whole=$(measure "$program" "$TMP/whole.bin"); then
+        whole="- -"
+    fi
+
+    if ! stream=$(measure "$program" "$TMP/stream.bin" --stream); then
+        printf "%-12s %12s %12s %12s\n" "$size" ${whole} "compile error"
+        continue
+    fi
+
+    if [ "$whole" != "- -" ]; then
+        "$LUAPPVM" "$TMP/whole.bin" > "$TMP/whole.out" 2>&1
+        "$LUAPPVM" "$TMP/stream.bin" > "$TMP/stream.out" 2>&1
+
+        if ! cmp -s "$TMP/whole.out" "$TMP/stream.out"; then
+            printf "%-12s %12s\n" "$size" "output mismatch"
+            continue
+        fi
+    fi
+
+    speedup=$(awk -v a="${whole% *}" -v b="${stream% *}" \
+        'BEGIN { if (a == "-" || b == 0) print "-"; else printf "%.2f", a / b }')
+    printf "%-12s %12s %12s %12s %12s %8s\n" "$size" "${whole% *}" "${whole#* }" \
+        "${stream% *}" "${stream#* }" "$speedup"
+done
@@ -0,0 +1,15 @@
+-- ops: 500000
+-- String concatenation, the string is restarted before it gets long so every step is cheap.
+local s: string = ""
+local total: number = 0
+
+for i: number = 1, 500000 do
+    s = s .. "ab"
+
+    if #s > 64 then
+        total = total + #s
+        s = ""
+    end
+end
+
+print(total)
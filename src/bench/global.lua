@@ -0,0 +1,15 @@
+-- ops: 2000000
+-- Reads of globals from inside a loop, the program defines the globals it reads.
+step = 1
+limits = {[1] = 3}
+local count: number = 0
+
+for i: number = 1, 1000000 do
+    count = count + step
+
+    if limits[1] > 2 then
+        count = count + 1
+    end
+end
+
+print(count)
@@ -0,0 +1,18 @@
+-- ops: 1000000
+-- Table records that never escape: a point built, updated and read in every call.
+local s: number = 0
+
+offset = function(x: number, y: number): number
+    local p: Table<string, number> = {["x"] = x, ["y"] = y}
+    p.x = p.x * 2
+    p.y = p.y + 1
+    local d: number = p.x + p.y
+    return d
+end
+
+for i: number = 1, 1000000 do
+    local d: number = offset(i, 2)
+    s = s + d
+end
+
+print(s)
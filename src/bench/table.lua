@@ -0,0 +1,23 @@
+-- ops: 600000
+-- Table build and lookup: fills an array part and a hash part, then reads every element back.
+local array: Table<number, number> = {}
+local hash: Table<string, number> = {}
+local sum: number = 0
+
+for i: number = 1, 200000 do
+    array[i] = i
+end
+
+for i: number = 1, 100000 do
+    hash["k" .. i] = i
+end
+
+for i: number = 1, 200000 do
+    sum = sum + array[i]
+end
+
+for i: number = 1, 100000 do
+    sum = sum + hash["k" .. i]
+end
+
+print(sum)
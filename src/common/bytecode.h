@@ -1,16 +1,23 @@
 #ifndef _BYTECODE_H
 #define _BYTECODE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum bytecode_version
 {
     VERSION_0,
-    VERSION_1 
+    VERSION_1,
+    VERSION_2, /* VERSION_1 plus superinstructions (OP_CALLENVK) */
+    VERSION_3, /* VERSION_2 plus the children of every proto, so programs can create closures */
+    VERSION_4, /* VERSION_3 plus the source line of every instruction */
+    VERSION_5, /* VERSION_4 with the lines moved to an optional debug section, plus local names */
+    VERSION_6, /* VERSION_5 plus assignments to globals (OP_SETGLOBAL) */
+    VERSION_7  /* VERSION_6 with a section table, packed constants and 8-byte aligned code */
 } version_t;
 
 /* Max and min versions that will successfully run in the VM */
-#define MAX_VERSION VERSION_1
+#define MAX_VERSION VERSION_7
 #define MIN_VERSION VERSION_1
 
 /* Acceptable bytecode version */
@@ -22,7 +29,69 @@ typedef enum constant_type
     CONSTANT_BOOLEAN,
     CONSTANT_NUMBER,
     CONSTANT_STRING,
-    CONSTANT_ENVIRONMENT
+    CONSTANT_ENVIRONMENT,
+    CONSTANT_INTEGER /* From VERSION_7 on, a number with an integer value */
 } constant_t;
 
-#endif
\ No newline at end of file
+/* From VERSION_7 on a program starts with a header and a table of sections, all of them at offsets
+ * from the start of the bytecode:
+ *
+ *      header      version (1 byte), 3 zero bytes, number of sections (uint32)
+ *      sections    kind, offset and size of each section (3 uint32)
+ *
+ *      BYTECODE_SECTION_STRINGS    number of strings, then the size and the bytes of each one
+ *      BYTECODE_SECTION_INDEX      number of protos, index of the main one and the offset of each
+ *                                  proto (uint32), so a reader can seek to any of them
+ *      BYTECODE_SECTION_PROTOS     the protos, children first, each one starts at a multiple of
+ *                                  BYTECODE_ALIGN with its stack size, parameters, upvalues and
+ *                                  vararg flag (1 byte each) followed by its number of instructions
+ *                                  (uint32), so its instructions are aligned as well and a mapped
+ *                                  file can be run in place
+ *      BYTECODE_SECTION_DEBUG      lines and names of the protos, decoded on demand
+ *
+ * A reader skips the kinds it does not know. Sizes, counts and indices inside the sections are
+ * varints, constants are a single varint holding their tag in the low bits and their payload
+ * above it (a double follows CONSTANT_NUMBER, integers are zigzag encoded). */
+typedef enum bytecode_section
+{
+    BYTECODE_SECTION_STRINGS,
+    BYTECODE_SECTION_INDEX,
+    BYTECODE_SECTION_PROTOS,
+    BYTECODE_SECTION_DEBUG,
+    BYTECODE_SECTIONS
+} section_t;
+
+#define BYTECODE_ALIGN 8
+#define BYTECODE_HEADER_SIZE 8
+#define BYTECODE_SECTION_ENTRY_SIZE 12
+
+#define BYTECODE_CONSTANT(tag, payload) (((uint64_t)(payload) << 3) | (tag))
+#define BYTECODE_CONSTANT_TAG(value) ((constant_t)((value)&7))
+#define BYTECODE_CONSTANT_PAYLOAD(value) ((value) >> 3)
+
+/* Integer constants are exact in a double, negative zero stays a CONSTANT_NUMBER */
+#define BYTECODE_INTEGER_MAX 9007199254740992.0
+
+#define BYTECODE_ZIGZAG64(value) (((uint64_t)(value) << 1) ^ (uint64_t)((int64_t)(value) >> 63))
+#define BYTECODE_UNZIGZAG64(value) ((int64_t)((value) >> 1) ^ -(int64_t)((value)&1))
+
+/* The lines of a proto are stored as the difference with the line of the previous instruction,
+ * zigzag encoded so the small negative differences of loops stay one byte long */
+#define BYTECODE_ZIGZAG(delta) (((uint32_t)(delta) << 1) ^ (uint32_t)((int32_t)(delta) >> 31))
+#define BYTECODE_UNZIGZAG(value) ((int32_t)((value) >> 1) ^ -(int32_t)((value)&1))
+
+/* FNV-1a hash of a proto, fed its instructions and then each number constant. Native code of a
+ * proto translated ahead of time (see vm/src/aot.h) only replaces protos with the same hash. */
+#define BYTECODE_HASH_SEED 2166136261u
+
+static inline uint32_t bytecode_hash(uint32_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+#endif
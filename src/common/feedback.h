@@ -0,0 +1,85 @@
+#ifndef _FEEDBACK_FORMAT_H
+#define _FEEDBACK_FORMAT_H
+
+#include "opcodes.h"
+
+/* Profiles that luappvm -P writes once a program ran and luappc --profile reads to compile it
+ * again, text files with one entry per line:
+ *
+ *      luapp-profile 1
+ *      proto 12 4096
+ *      line 14 1024
+ *      site 12 14 index 0 512 08 01
+ *
+ * `proto' gives the instructions run by the functions defined on a line (0 for the main
+ * function), `line' the instructions run on a source line of any function, inlined calls count on
+ * the line of the call. `site' describes an instruction of one of the kinds below: the line of its
+ * function, its own line, its kind, how many instructions of that kind come before it on the line
+ * in its function, how often it ran and the types of its operands (FEEDBACK_INTEGER...) in hex.
+ *
+ * Instructions are found by their line and not by their position, so a profile taken from a
+ * program that was compiled with another profile still applies. It needs the debug section,
+ * profiles of stripped programs only have line 0. Entries may repeat (a program that ran several
+ * times), the reader adds them up. */
+#define FEEDBACK_VERSION 1
+
+/* Instructions whose operands are recorded */
+enum feedback_kind {
+    FEEDBACK_ARITH,    /* Arithmetic: the left operand, then the right one (none for constants) */
+    FEEDBACK_INDEX,    /* Table reads: the container, then the key (none for constant keys) */
+    FEEDBACK_NEWINDEX, /* Table writes: the same */
+    FEEDBACK_CALL,     /* Calls: the callee */
+    FEEDBACK_KINDS,
+    FEEDBACK_NONE = FEEDBACK_KINDS
+};
+
+/* Types of an operand, a site holds the ones it saw */
+#define FEEDBACK_INTEGER 0x01  /* A number with a whole value */
+#define FEEDBACK_NUMBER 0x02   /* Any other number */
+#define FEEDBACK_STRING 0x04   /* A string */
+#define FEEDBACK_TABLE 0x08    /* A table */
+#define FEEDBACK_ARRAY 0x10    /* A typed array */
+#define FEEDBACK_FIXED 0x20    /* A Lua function with fixed parameters, run by the interpreter */
+#define FEEDBACK_FUNCTION 0x40 /* Any other function */
+#define FEEDBACK_OTHER 0x80    /* Anything else (nil, booleans, userdata, threads) */
+
+static const char *const feedback_kind_names[FEEDBACK_KINDS] = {"arith", "index", "newindex",
+                                                                 "call"};
+
+/* feedback_kind() -- classifies an opcode for the profile
+ *      args: opcode
+ *      rets: kind of the instruction, FEEDBACK_NONE if its operands are not recorded
+ *
+ * Note: The specialized forms of an instruction are of the same kind as the generic one, so the
+ * sites of a program compiled with a profile line up with the ones of the program it came from.
+ */
+static inline enum feedback_kind feedback_kind(int op)
+{
+    switch (op) {
+        case OP_ADD ... OP_POW:
+        case OP_ADDK ... OP_POWK:
+        case OP_ADDNN ... OP_POWNK:
+            return FEEDBACK_ARITH;
+        case OP_GETTABLE:
+        case OP_GETARRAY:
+        case OP_GETARRAYI:
+        case OP_GETINDEX:
+        case OP_GETFIELD:
+            return FEEDBACK_INDEX;
+        case OP_SETTABLE:
+        case OP_SETARRAY:
+        case OP_SETARRAYI:
+        case OP_SETINDEX:
+        case OP_SETFIELD:
+            return FEEDBACK_NEWINDEX;
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_CALLENVK:
+        case OP_CALLDIRECT:
+            return FEEDBACK_CALL;
+        default:
+            return FEEDBACK_NONE;
+    }
+}
+
+#endif
@@ -7,4 +7,11 @@ const char *const opcode_names[NUM_OPCODES + 1] = {
     "POW",      "ADDK",     "SUBK",      "MULK",     "DIVK",      "MODK",     "POWK",
     "UNM",      "NOT",      "LEN",       "CONCAT",   "JMP",       "EQ",       "LT",
     "LE",       "TEST",     "TESTSET",   "CALL",     "TAILCALL",  "RETURN",   "FORLOOP",
-    "FORPREP",  "TFORLOOP", "SETLIST",   "CLOSE",    "CLOSURE",   "VARARG",   NULL};
\ No newline at end of file
+    "FORPREP",  "TFORLOOP", "SETLIST",   "CLOSE",    "CLOSURE",   "VARARGPREP", "VARARG",
+    "ADDNN",    "SUBNN",    "MULNN",     "DIVNN",    "MODNN",     "POWNN",    "ADDNK",
+    "SUBNK",    "MULNK",    "DIVNK",     "MODNK",    "POWNK",     "CALLENVK", "NEWARRAY",
+    "SETARRAYLIST", "GETARRAY", "SETARRAY", "NEWRECORD", "GETFIELD", "SETFIELD",
+    "FORLOOPINC", "FORLOOPDEC", "APPEND",   "BUILDSTRING", "GETARRAYI", "SETARRAYI",
+    "CALLDIRECT", "GETINDEX", "SETINDEX", "EQK",    "LTK",      "LEK",      "GTK",
+    "GEK",      "EQNN",     "LTNN",      "LENN",     "EQNK",      "LTNK",     "LENK",
+    "GTNK",     "GENK",     NULL};
\ No newline at end of file
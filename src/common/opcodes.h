@@ -19,6 +19,10 @@
 
 /* Main file for instruction manipulation */
 enum opcode {
+    /* OP_MOVE: copies a register into another one
+     * A: target register
+     * B: source register
+     */
     OP_MOVE,
 
     /* OP_LOADPN: sets a target register to a positive number literal
@@ -43,7 +47,17 @@ enum opcode {
     OP_LOADKX,
 
     OP_LOADBOOL,
+
+    /* OP_LOADNIL: sets a range of registers to nil
+     * A: first register
+     * B: last register
+     */
     OP_LOADNIL,
+
+    /* OP_GETUPVAL: R(A) = UpValue[B]
+     * A: target register
+     * B: index of the upvalue
+     */
     OP_GETUPVAL,
 
     /* OP_GETENV: retrieves an object defined in the environment table.
@@ -53,12 +67,38 @@ enum opcode {
     OP_GETENV,
 
     OP_GETGLOBAL,
+
+    /* OP_GETTABLE: R(A) = R(B)[R(C)]
+     * A: target register
+     * B: register of the table
+     * C: register of the key
+     */
     OP_GETTABLE,
 
+    /* OP_SETGLOBAL: assigns an object of the environment table, the counterpart of OP_GETENV
+     * A: register of the value
+     * D: index in the constant table
+     */
     OP_SETGLOBAL,
+
+    /* OP_SETUPVAL: UpValue[B] = R(A)
+     * A: register of the value
+     * B: index of the upvalue
+     */
     OP_SETUPVAL,
+
+    /* OP_SETTABLE: R(A)[R(B)] = R(C)
+     * A: register of the table
+     * B: register of the key
+     * C: register of the value
+     */
     OP_SETTABLE,
 
+    /* OP_NEWTABLE: creates a table with room for a number of elements
+     * A: target register
+     * B: size of the array part, as a 'floating point byte' (see luaO_fb2int)
+     * C: size of the hash part, as a 'floating point byte'
+     */
     OP_NEWTABLE,
 
     OP_SELF,
@@ -88,12 +128,30 @@ enum opcode {
 
     OP_CONCAT,
 
+    /* OP_JMP: pc += E
+     * E: offset of the jump (from the next instruction)
+     */
     OP_JMP,
 
+    /* Conditional branches are always followed by the OP_JMP to their target. A branch reads the
+     * offset of that jump itself and either takes it or steps over it, so a condition costs a
+     * single dispatch. Branches that jump back count as an iteration of a loop (see jit.h). */
+
+    /* OP_EQ/OP_LT/OP_LE: compares R(B) == R(C), R(B) < R(C) or R(B) <= R(C), metamethod aware
+     * A: 1 to jump when the comparison holds, 0 to jump when it does not
+     * B: register of the left operand
+     * C: register of the right operand
+     *
+     * Note: a > b and a >= b are compiled as b < a and b <= a.
+     */
     OP_EQ,
     OP_LT,
     OP_LE,
 
+    /* OP_TEST: tests whether R(A) is true (neither nil nor false)
+     * A: register of the value
+     * C: 1 to jump when it is true, 0 to jump when it is false
+     */
     OP_TEST,
     OP_TESTSET,
 
@@ -101,20 +159,232 @@ enum opcode {
     OP_TAILCALL,
     OP_RETURN,
 
+    /* OP_FORLOOP: steps a numeric for loop, R(A) += R(A + 2) and if the loop goes on it jumps back
+     * to its body with R(A + 3) = R(A)
+     * A: register of the internal index (A + 1 holds the limit, A + 2 the step and A + 3 the
+     *    control variable)
+     * D: offset of the jump (from the next instruction)
+     */
     OP_FORLOOP,
+
+    /* OP_FORPREP: converts the start, limit and step of a numeric for loop to numbers, then
+     * R(A) -= R(A + 2) and jumps to the OP_FORLOOP of the loop
+     * A: register of the internal index
+     * D: offset of the jump (from the next instruction)
+     */
     OP_FORPREP,
 
     OP_TFORLOOP,
+
+    /* OP_SETLIST: stores consecutive registers in the array part of a table,
+     * R(A)[C * FPF + i] = R(A + i) with 1 <= i <= B and FPF = ARRAY_FIELDS_PER_FLUSH
+     * A: register of the table
+     * B: number of values
+     * C: batch number
+     */
     OP_SETLIST,
 
+    /* OP_CLOSE: closes the upvalues of all registers from A up, emitted at the end of a loop body
+     * that declares locals captured by reference
+     * A: first register
+     */
     OP_CLOSE,
+
+    /* OP_CLOSURE: creates a closure of a child proto
+     * A: target register
+     * Du: index of the proto among the children
+     * SUB: one for every upvalue of the child, see CAPTURE()
+     */
     OP_CLOSURE,
 
-    /* OP_VARARGPREP: prepare stack for variadic functions
+    /* OP_VARARGPREP: marks the entry of a variadic function, fixed arity functions have none. The
+     * call already laid out the frame, the fixed parameters are only moved above the extra
+     * arguments when there are any.
      * A: number of fixed arguments
      */
     OP_VARARGPREP,
-    OP_VARARG
+
+    /* OP_VARARG: copies the extra arguments of a variadic function into registers
+     * A: first target register
+     * B: number of values + 1, 0 copies all of them and sets the top
+     */
+    OP_VARARG,
+
+    /* OP_NNs: sets a target register to an arithmetic operation of two numbers. Emitted when the
+     * type checker proved both operands to be numbers, so the VM performs no tag checks.
+     * A: target register
+     * B: register containing first arg
+     * C: register containing second arg
+     */
+    OP_ADDNN,
+    OP_SUBNN,
+    OP_MULNN,
+    OP_DIVNN,
+    OP_MODNN,
+    OP_POWNN,
+
+    /* OP_NKs: same as the OP_Ks, except the first arg is proven to be a number
+     * A: target register
+     * B: register containing first arg
+     * C: constant index (0 to 255)
+     */
+    OP_ADDNK,
+    OP_SUBNK,
+    OP_MULNK,
+    OP_DIVNK,
+    OP_MODNK,
+    OP_POWNK,
+
+    /* Superinstructions: fused forms of the most frequent opcode sequences */
+
+    /* OP_CALLENVK: calls a global with a single constant argument and no results,
+     * GETENV A B; LOADK A+1 C; CALL A 2 1
+     * A: function register (A + 1 holds the argument)
+     * B: constant index of the global name (0 to 255)
+     * C: constant index of the argument (0 to 255)
+     */
+    OP_CALLENVK,
+
+    /* Typed arrays: emitted for values the type checker proved to be an Array<number> or an
+     * Array<boolean>, the elements are stored unboxed (see vm/src/lua/larray.c) */
+
+    /* OP_NEWARRAY: creates an empty typed array
+     * A: target register
+     * B: kind of the elements (NEWARRAY_NUMBER or NEWARRAY_BOOLEAN)
+     * C: number of elements to make room for (0 to 255)
+     */
+    OP_NEWARRAY,
+
+    /* OP_SETARRAYLIST: stores consecutive registers in a typed array, R(A)[C * FPF + i] = R(A + i)
+     * with 1 <= i <= B and FPF = ARRAY_FIELDS_PER_FLUSH
+     * A: register of the array
+     * B: number of values
+     * C: batch number
+     */
+    OP_SETARRAYLIST,
+
+    /* OP_GETARRAY: R(A) = R(B)[R(C)], containers that are not typed arrays go through the regular
+     * (metamethod aware) indexing. Whole keys in the array part of a table are read directly as
+     * well, luappc --profile emits it for table reads that were only seen with such keys.
+     * A: target register
+     * B: register of the array
+     * C: register of the index
+     */
+    OP_GETARRAY,
+
+    /* OP_SETARRAY: R(A)[R(B)] = R(C), storing right past the last element appends to the array.
+     * The same as OP_GETARRAY for tables.
+     * A: register of the array
+     * B: register of the index
+     * C: register of the value
+     */
+    OP_SETARRAY,
+
+    /* Records: tables whose keys are constant strings keep them in the layout of a shape (see
+     * vm/src/lua/ltable.c), every field access has an inline cache keyed on the shape */
+
+    /* OP_NEWRECORD: creates a table laid out by shapes
+     * A: target register
+     * B: number of fields to make room for (0 to RECORD_FIELDS_MAX)
+     */
+    OP_NEWRECORD,
+
+    /* OP_GETFIELD: R(A) = R(B)[K(C)]
+     * A: target register
+     * B: register of the table
+     * C: constant index of the (string) key (0 to 255)
+     */
+    OP_GETFIELD,
+
+    /* OP_SETFIELD: R(A)[K(B)] = R(C)
+     * A: register of the table
+     * B: constant index of the (string) key (0 to 255)
+     * C: register of the value
+     */
+    OP_SETFIELD,
+
+    /* OP_FORLOOPINC/OP_FORLOOPDEC: same as OP_FORLOOP for a loop whose step the compiler knows to
+     * be a positive (INC) or negative (DEC) constant, the direction of the limit test is fixed so
+     * the step is not tested every iteration
+     * A: register of the internal index
+     * D: offset of the jump (from the next instruction)
+     */
+    OP_FORLOOPINC,
+    OP_FORLOOPDEC,
+
+    /* String builders: a local that a loop only extends with `s = s .. x' is copied into a hidden
+     * register before the loop, appended to in place and turned back into a string after it, so
+     * the loop does not copy the whole string every iteration */
+
+    /* OP_APPEND: R(A) = R(A) .. R(B), the first append of a string or number turns R(A) into a
+     * builder (a value only this instruction and OP_BUILDSTRING can see)
+     * A: register of the builder
+     * B: register of the appended value
+     */
+    OP_APPEND,
+
+    /* OP_BUILDSTRING: R(A) = the string of the builder R(B), or R(B) itself if nothing turned it
+     * into a builder
+     * A: target register
+     * B: register of the builder
+     */
+    OP_BUILDSTRING,
+
+    /* OP_GETARRAYI/OP_SETARRAYI: same as OP_GETARRAY and OP_SETARRAY for an index the compiler
+     * proved to be an integer (a whole number), the index is neither tested to be a number nor to
+     * have no fraction
+     */
+    OP_GETARRAYI,
+    OP_SETARRAYI,
+
+    /* OP_CALLDIRECT: same as OP_CALL for a local the compiler proved to always hold the closure of
+     * one Lua function with fixed parameters, R(A) is not tested to be such a function
+     * A: function register
+     * B: number of arguments + 1
+     * C: number of results + 1
+     */
+    OP_CALLDIRECT,
+
+    /* OP_GETINDEX: R(A) = R(B)[R(C)] for a table R(B) and a key the compiler proved to be an
+     * integer, keys in the array part of the table are read without hashing
+     * A: target register
+     * B: register of the table
+     * C: register of the key
+     */
+    OP_GETINDEX,
+
+    /* OP_SETINDEX: R(A)[R(B)] = R(C) for a table R(A) and a key the compiler proved to be an
+     * integer, keys in the array part of the table are written without hashing
+     * A: register of the table
+     * B: register of the key
+     * C: register of the value
+     */
+    OP_SETINDEX,
+
+    /* OP_EQK/OP_LTK/OP_LEK/OP_GTK/OP_GEK: compares R(B) with a constant, ==, <, <=, > or >=
+     * A: 1 to jump when the comparison holds, 0 to jump when it does not
+     * B: register of the left operand
+     * C: constant index of the right operand (0 to 255)
+     *
+     * Note: A constant on the left of a comparison is moved to its right, k < a is a > k.
+     */
+    OP_EQK,
+    OP_LTK,
+    OP_LEK,
+    OP_GTK,
+    OP_GEK,
+
+    /* OP_EQNN/OP_LTNN/OP_LENN and OP_EQNK/.../OP_GENK: same as OP_EQ ... OP_LE and OP_EQK ...
+     * OP_GEK for operands the compiler proved to be numbers, they are compared without tag checks
+     * or metamethods */
+    OP_EQNN,
+    OP_LTNN,
+    OP_LENN,
+    OP_EQNK,
+    OP_LTNK,
+    OP_LENK,
+    OP_GTNK,
+    OP_GENK
 };
 
 /* Retrieve the one byte instruction operation code */
@@ -129,6 +399,9 @@ enum opcode {
 #define GETARG_B(i) (((i) >> 16) & 0xFF)
 #define GETARG_C(i) (((i) >> 24) & 0xFF)
 
+#define SETARG_A(i, a) ((i) = ((i) & ~((uint32_t)0xFF << 8)) | ((uint32_t)((a)&0xFF) << 8))
+#define SETARG_B(i, b) ((i) = ((i) & ~((uint32_t)0xFF << 16)) | ((uint32_t)((b)&0xFF) << 16))
+
 /* iAD
  * A:    8 bits
  * D:    16 bits
@@ -144,9 +417,32 @@ enum opcode {
 /* iE
  * E:    24 bits
  */
-#define GETARG_E(i) ((int32_t)i >> 24)
+#define GETARG_E(i) ((int32_t)i >> 8)
+
+#define NUM_OPCODES ((int32_t)OP_GENK + 1)
+
+/* Capture of an upvalue by OP_CLOSURE, the kind is followed by a register or an upvalue index.
+ * Locals that are never reassigned are copied into a closed upvalue, the others share an open
+ * upvalue that is closed when their register goes out of scope. */
+enum capture_kind {
+    CAPTURE_REFERENCE, /* A register of the enclosing function */
+    CAPTURE_VALUE,     /* The value of a register of the enclosing function */
+    CAPTURE_UPVALUE    /* An upvalue of the enclosing function */
+};
+
+#define CAPTURE(kind, index) (((uint32_t)(kind) << 8) | ((index)&0xFF))
+#define GET_CAPTURE_KIND(i) ((i) >> 8)
+#define GET_CAPTURE_INDEX(i) ((i)&0xFF)
+
+/* Element kinds of OP_NEWARRAY, the same values as ARRAY_NUMBER and ARRAY_BOOLEAN of the VM */
+#define NEWARRAY_NUMBER 0
+#define NEWARRAY_BOOLEAN 1
+
+/* Number of values an OP_SETLIST or OP_SETARRAYLIST stores at most */
+#define ARRAY_FIELDS_PER_FLUSH 50
 
-#define NUM_OPCODES (int32_t) OP_VARARG + 1
+/* Number of fields a record keeps in its shape, the same as LUAI_MAXSHAPEKEYS of the VM */
+#define RECORD_FIELDS_MAX 16
 
 LUAI_DATA const char *const opcode_names[NUM_OPCODES + 1];
 
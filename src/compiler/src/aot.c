@@ -0,0 +1,440 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../common/bytecode.h"
+
+#include "aot.h"
+#include "ir.h"
+
+/* Arithmetic opcodes come in families of six, in the order of the TM_ADD ... TM_POW events */
+#define AOT_ARITH_COUNT 6
+
+static const char *const aot_arith_ops[AOT_ARITH_COUNT] = {
+    "luai_numadd", "luai_numsub", "luai_nummul", "luai_numdiv", "luai_nummod", "luai_numpow"};
+static const char *const aot_arith_events[AOT_ARITH_COUNT] = {"TM_ADD", "TM_SUB", "TM_MUL",
+                                                              "TM_DIV", "TM_MOD", "TM_POW"};
+
+/* aot_constants() -- gives random access to the constants of a proto
+ *      args: proto
+ *      rets: array of the constants, to be freed by the caller
+ */
+static struct ir_constant **aot_constants(struct ir_proto *proto)
+{
+    struct ir_constant **constants = malloc((proto->constant_list->size + 1) * sizeof(*constants));
+    int i = 0;
+
+    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next)
+        constants[i++] = iter;
+
+    return constants;
+}
+
+/* aot_hash() -- hashes a proto the way the VM does once it loaded it (see luapp_aot_find)
+ *      args: proto
+ *      rets: hash
+ */
+static uint32_t aot_hash(struct ir_proto *proto)
+{
+    uint32_t hash = bytecode_hash(BYTECODE_HASH_SEED, proto->code->code,
+                                  proto->code->size * sizeof(uint32_t));
+
+    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next) {
+        if (iter->type == CONSTANT_NUMBER)
+            hash = bytecode_hash(hash, &iter->data.number.value, sizeof(double));
+    }
+
+    return hash;
+}
+
+/* aot_number() -- writes a number as a C literal that reads back to the same double
+ *      args: output, number
+ *      rets: none
+ */
+static void aot_number(FILE *output, double value)
+{
+    if (isnan(value))
+        fprintf(output, "NAN");
+    else if (isinf(value))
+        fprintf(output, value > 0 ? "HUGE_VAL" : "(-HUGE_VAL)");
+    else
+        fprintf(output, "%a", value);
+}
+
+/* aot_operand() -- writes the C expression of a number operand of an arithmetic instruction
+ *      args: output, constants of the proto, operand, whether it is a constant index
+ *      rets: none
+ *
+ * Note: Number constants are written as literals so the C compiler can fold them, which is why
+ * the hash of a proto covers its number constants.
+ */
+static void aot_operand(FILE *output, struct ir_constant **constants, int operand, bool is_k)
+{
+    if (is_k && constants[operand]->type == CONSTANT_NUMBER)
+        aot_number(output, constants[operand]->data.number.value);
+    else if (is_k)
+        fprintf(output, "nvalue(&k[%d])", operand);
+    else
+        fprintf(output, "nvalue(R(%d))", operand);
+}
+
+/* aot_arith() -- writes an arithmetic instruction, the ones on proven numbers become a single C
+ * operation on doubles
+ *      args: output, constants of the proto, instruction, position of the next instruction
+ *      rets: whether the instruction was arithmetic
+ */
+static bool aot_arith(FILE *output, struct ir_constant **constants, uint32_t i, int next)
+{
+    enum opcode op = GET_OPCODE(i);
+    int a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i);
+
+    if (op >= OP_ADD && op < OP_ADD + AOT_ARITH_COUNT) {
+        fprintf(output, "    AOT_ARITH(%d, %d, R(%d), R(%d), %s, %s);\n", next, a, b, c,
+                aot_arith_ops[op - OP_ADD], aot_arith_events[op - OP_ADD]);
+    } else if (op >= OP_ADDK && op < OP_ADDK + AOT_ARITH_COUNT) {
+        fprintf(output, "    AOT_ARITH(%d, %d, R(%d), &k[%d], %s, %s);\n", next, a, b, c,
+                aot_arith_ops[op - OP_ADDK], aot_arith_events[op - OP_ADDK]);
+    } else if ((op >= OP_ADDNN && op < OP_ADDNN + AOT_ARITH_COUNT) ||
+               (op >= OP_ADDNK && op < OP_ADDNK + AOT_ARITH_COUNT)) {
+        bool is_k = op >= OP_ADDNK;
+
+        fprintf(output, "    AOT_LOADN(%d, %s(nvalue(R(%d)), ", a,
+                aot_arith_ops[op - (is_k ? OP_ADDNK : OP_ADDNN)], b);
+        aot_operand(output, constants, c, is_k);
+        fprintf(output, "));\n");
+    } else
+        return false;
+
+    return true;
+}
+
+/* aot_is_branch() -- determines whether an opcode is a conditional branch, one followed by the
+ * OP_JMP to its target
+ *      args: opcode
+ *      rets: yes or no
+ */
+static bool aot_is_branch(enum opcode op)
+{
+    return op == OP_EQ || op == OP_LT || op == OP_LE || op == OP_TEST ||
+           (op >= OP_EQK && op <= OP_GENK);
+}
+
+/* aot_branch() -- writes a conditional branch and the jump after it as a goto to its target
+ *      args: output, constants of the proto, code of the proto, position of the branch
+ *      rets: none
+ *
+ * Note: The comparisons come in the order ==, <, <=, > and >= in every family, those on proven
+ * numbers are plain C comparisons of doubles.
+ */
+static void aot_branch(FILE *output, struct ir_constant **constants, struct ir_section *code,
+                       int pc)
+{
+    static const char *const macros[] = {"AOT_EQ", "AOT_LT", "AOT_LE", "AOT_LT", "AOT_LE"};
+    static const char *const numops[] = {"luai_numeq", "luai_numlt", "luai_numle", "luai_numlt",
+                                         "luai_numle"};
+    uint32_t i = code->code[pc];
+    enum opcode op = GET_OPCODE(i);
+    int a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i), next = pc + 1;
+
+    fprintf(output, "    if (");
+
+    if (op == OP_TEST) {
+        fprintf(output, "AOT_TEST(%d)", a);
+        a = c;
+    } else if (op >= OP_EQ && op <= OP_LE) {
+        fprintf(output, "%s(%d, R(%d), R(%d))", macros[op - OP_EQ], next, b, c);
+    } else if (op >= OP_EQK && op <= OP_GEK) {
+        /* > and >= swap their operands */
+        if (op >= OP_GTK)
+            fprintf(output, "%s(%d, &k[%d], R(%d))", macros[op - OP_EQK], next, c, b);
+        else
+            fprintf(output, "%s(%d, R(%d), &k[%d])", macros[op - OP_EQK], next, b, c);
+    } else if (op >= OP_EQNN && op <= OP_LENN) {
+        fprintf(output, "%s(nvalue(R(%d)), nvalue(R(%d)))", numops[op - OP_EQNN], b, c);
+    } else {
+        fprintf(output, "%s(", numops[op - OP_EQNK]);
+
+        if (op >= OP_GTNK) {
+            aot_operand(output, constants, c, true);
+            fprintf(output, ", nvalue(R(%d)))", b);
+        } else {
+            fprintf(output, "nvalue(R(%d)), ", b);
+            aot_operand(output, constants, c, true);
+            fprintf(output, ")");
+        }
+    }
+
+    fprintf(output, " == %d)\n        goto L%d;\n", a, pc + 2 + GETARG_E(code->code[pc + 1]));
+}
+
+/* aot_fb2int() -- decodes a table size hint of OP_NEWTABLE (luaO_fb2int)
+ *      args: encoded size
+ *      rets: size
+ */
+static int aot_fb2int(int x)
+{
+    int e = (x >> 3) & 31;
+
+    return e == 0 ? x : ((x & 7) + 8) << (e - 1);
+}
+
+/* aot_write_proto() -- writes the native function of a proto
+ *      args: output, proto, index of the proto in the bytecode
+ *      rets: none
+ */
+static void aot_write_proto(FILE *output, struct ir_proto *proto, unsigned int index)
+{
+    struct ir_section *code = proto->code;
+    struct ir_constant **constants = aot_constants(proto);
+    bool *targets = calloc(code->size + 2, sizeof(bool));
+
+    /* Only the targets of jumps get a label */
+    for (int pc = 0; pc < code->size; pc++) {
+        uint32_t i = code->code[pc];
+        enum opcode op = GET_OPCODE(i);
+
+        if (code->modes[pc] == SUB)
+            continue;
+
+        if (op == OP_FORPREP || op == OP_FORLOOP || op == OP_FORLOOPINC || op == OP_FORLOOPDEC ||
+            op == OP_JMP || aot_is_branch(op)) {
+            int target = op == OP_JMP ? pc + 1 + GETARG_E(i)
+                         : aot_is_branch(op) ? pc + 2 + GETARG_E(code->code[pc + 1])
+                                             : pc + 1 + GETARG_D(i);
+
+            if (target >= 0 && target <= code->size)
+                targets[target] = true;
+        } else if (op == OP_LOADBOOL && GETARG_C(i))
+            targets[pc + 2 < code->size ? pc + 2 : code->size] = true;
+    }
+
+    fprintf(output, "static void aot_proto_%u(lua_State *L)\n{\n    AOT_ENTER();\n\n", index);
+
+    for (int pc = 0; pc < code->size; pc++) {
+        uint32_t i = code->code[pc];
+        enum opcode op = GET_OPCODE(i);
+        int a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i), next = pc + 1;
+
+        if (code->modes[pc] == SUB)
+            continue;
+
+        if (targets[pc])
+            fprintf(output, "L%d:\n", pc);
+
+        if (aot_arith(output, constants, i, next))
+            continue;
+
+        if (aot_is_branch(op)) {
+            /* The jump that follows is part of the branch */
+            aot_branch(output, constants, code, pc++);
+            continue;
+        }
+
+        switch (op) {
+            case OP_VARARGPREP:
+                break;
+            case OP_VARARG:
+                fprintf(output, "    AOT_VARARG(%d, %d, %d);\n", next, a, b);
+                break;
+            case OP_MOVE:
+                fprintf(output, "    AOT_MOVE(%d, %d);\n", a, b);
+                break;
+            case OP_LOADK:
+            case OP_LOADKX: {
+                uint32_t kx = op == OP_LOADK ? GETARG_Du(i) : code->code[pc + 1];
+
+                if (constants[kx]->type == CONSTANT_NUMBER) {
+                    fprintf(output, "    AOT_LOADN(%d, ", a);
+                    aot_number(output, constants[kx]->data.number.value);
+                    fprintf(output, ");\n");
+                } else
+                    fprintf(output, "    AOT_LOADK(%d, %u);\n", a, kx);
+                break;
+            }
+            case OP_LOADPN:
+            case OP_LOADNN:
+                fprintf(output, "    AOT_LOADN(%d, %s%u.0);\n", a, op == OP_LOADNN ? "-" : "",
+                        GETARG_Du(i));
+                break;
+            case OP_LOADBOOL:
+                fprintf(output, "    AOT_LOADBOOL(%d, %d);\n", a, b);
+
+                if (c)
+                    fprintf(output, "    goto L%d;\n", pc + 2 < code->size ? pc + 2 : code->size);
+                break;
+            case OP_LOADNIL:
+                fprintf(output, "    AOT_LOADNIL(%d, %d);\n", a, b);
+                break;
+            case OP_GETUPVAL:
+                fprintf(output, "    AOT_GETUPVAL(%d, %d);\n", a, b);
+                break;
+            case OP_SETUPVAL:
+                fprintf(output, "    AOT_SETUPVAL(%d, %d);\n", a, b);
+                break;
+            case OP_GETENV:
+                fprintf(output, "    AOT_GETENV(%d, %d, %u);\n", next, a, GETARG_Du(i));
+                break;
+            case OP_SETGLOBAL:
+                fprintf(output, "    AOT_SETGLOBAL(%d, %d, %u);\n", next, a, GETARG_Du(i));
+                break;
+            case OP_CALLENVK:
+                fprintf(output, "    AOT_CALLENVK(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_UNM:
+                fprintf(output, "    AOT_UNM(%d, %d, %d);\n", next, a, b);
+                break;
+            case OP_NOT:
+                fprintf(output, "    AOT_NOT(%d, %d);\n", a, b);
+                break;
+            case OP_LEN:
+                fprintf(output, "    AOT_LEN(%d, %d, %d);\n", next, a, b);
+                break;
+            case OP_CONCAT:
+                fprintf(output, "    AOT_CONCAT(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_CALL:
+            case OP_CALLDIRECT:
+                fprintf(output, "    AOT_CALL(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_TAILCALL:
+                /* The native frame is not reused, the OP_RETURN that follows passes the results */
+                fprintf(output, "    AOT_CALL(%d, %d, %d, 0);\n", next, a, b);
+                break;
+            case OP_RETURN:
+                fprintf(output, "    AOT_RETURN(%d, %d, %d);\n", next, a, b);
+                break;
+            case OP_GETTABLE:
+            case OP_SETTABLE:
+            case OP_GETARRAY:
+            case OP_SETARRAY:
+            case OP_GETARRAYI:
+            case OP_SETARRAYI:
+            case OP_GETINDEX:
+            case OP_SETINDEX:
+            case OP_NEWARRAY:
+            case OP_SETARRAYLIST:
+                fprintf(output, "    AOT_%s(%d, %d, %d, %d);\n", opcode_names[op], next, a, b, c);
+                break;
+            case OP_APPEND:
+            case OP_BUILDSTRING:
+                fprintf(output, "    AOT_%s(%d, %d, %d);\n", opcode_names[op], next, a, b);
+                break;
+            case OP_NEWTABLE:
+                fprintf(output, "    AOT_NEWTABLE(%d, %d, %d, %d);\n", next, a, aot_fb2int(b),
+                        aot_fb2int(c));
+                break;
+            case OP_SETLIST:
+                fprintf(output, "    AOT_SETLIST(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_NEWRECORD:
+                fprintf(output, "    AOT_NEWRECORD(%d, %d, %d);\n", next, a, b);
+                break;
+            case OP_GETFIELD:
+                fprintf(output, "    AOT_GETFIELD(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_SETFIELD:
+                fprintf(output, "    AOT_SETFIELD(%d, %d, %d, %d);\n", next, a, b, c);
+                break;
+            case OP_FORPREP:
+                fprintf(output, "    AOT_FORPREP(%d, %d);\n    goto L%d;\n", next, a,
+                        pc + 1 + GETARG_D(i));
+                break;
+            case OP_FORLOOP:
+            case OP_FORLOOPINC:
+            case OP_FORLOOPDEC:
+                fprintf(output, "    AOT_FORLOOP(%d, L%d, %s);\n", a, pc + 1 + GETARG_D(i),
+                        op == OP_FORLOOP      ? "AOT_FORTEST"
+                        : op == OP_FORLOOPINC ? "AOT_FORTESTINC"
+                                              : "AOT_FORTESTDEC");
+                break;
+            case OP_CLOSURE: {
+                static const char *const captures[] = {
+                    [CAPTURE_REFERENCE] = "REFERENCE",
+                    [CAPTURE_VALUE] = "VALUE",
+                    [CAPTURE_UPVALUE] = "UPVALUE",
+                };
+
+                fprintf(output, "    AOT_CLOSURE(%u);\n", GETARG_Du(i));
+
+                /* The sub instructions that follow describe the upvalues */
+                for (int j = 0; pc + 1 < code->size && code->modes[pc + 1] == SUB; j++, pc++) {
+                    uint32_t sub = code->code[pc + 1];
+                    unsigned int kind = GET_CAPTURE_KIND(sub);
+
+                    fprintf(output, "    AOT_CAPTURE_%s(%d, %u);\n",
+                            kind <= CAPTURE_UPVALUE ? captures[kind] : "UPVALUE", j,
+                            GET_CAPTURE_INDEX(sub));
+                }
+
+                fprintf(output, "    AOT_CLOSURE_END(%d, %d);\n", next, a);
+                break;
+            }
+            case OP_CLOSE:
+                fprintf(output, "    AOT_CLOSE(%d);\n", a);
+                break;
+            case OP_JMP:
+                fprintf(output, "    goto L%d;\n", pc + 1 + GETARG_E(i));
+                break;
+            default:
+                /* Skipped by the VM as well */
+                fprintf(output, "    /* %s is not implemented */\n", opcode_names[op]);
+                break;
+        }
+    }
+
+    /* Codegen ends every proto with an OP_RETURN, another one is only needed to jump past it */
+    bool returns = code->size > 0 && GET_OPCODE(code->code[code->size - 1]) == OP_RETURN;
+
+    if (targets[code->size] || !returns)
+        fprintf(output, "L%d:\n    AOT_RETURN(%d, 0, 1);\n", code->size, code->size);
+    fprintf(output, "}\n\n");
+
+    free(constants);
+    free(targets);
+}
+
+/* aot_write_protos() -- writes the native functions of a proto and the protos nested in it, in
+ * the order codegen writes them
+ *      args: output, proto, index of the next proto, hashes and sizes of the protos written
+ *      rets: index of the proto
+ */
+static unsigned int aot_write_protos(FILE *output, struct ir_proto *proto, unsigned int *next,
+                                     FILE *table)
+{
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        aot_write_protos(output, iter, next, table);
+
+    unsigned int index = (*next)++;
+
+    aot_write_proto(output, proto, index);
+    fprintf(table, "    {0x%08xu, %d, aot_proto_%u},\n", aot_hash(proto), proto->code->size, index);
+
+    return index;
+}
+
+/* aot_write_program() -- writes the C translation of a program
+ *      args: output, context
+ *      rets: none
+ */
+void aot_write_program(FILE *output, struct ir_context *context)
+{
+    /* The list of protos is gathered aside and written after the functions it refers to */
+    char *list = NULL;
+    size_t size = 0;
+    FILE *table = open_memstream(&list, &size);
+    unsigned int next = 0;
+
+    fprintf(output, "/* Translated ahead of time by luappc -s aot, build with\n"
+                    " *      cc -O2 -shared -fPIC -I <luapp>/src/vm/src -o module.so module.c\n"
+                    " * and run the bytecode of the same program with luappvm -N module.so */\n\n"
+                    "#define LUAPP_AOT_MODULE\n#include \"aot.h\"\n\n");
+
+    aot_write_protos(output, context->main_proto, &next, table);
+    fclose(table);
+
+    fprintf(output, "static const struct luapp_aot_proto aot_protos[] = {\n%s};\n\n", list);
+    fprintf(output, "AOT_MODULE(aot_protos)\n");
+    free(list);
+}
@@ -0,0 +1,19 @@
+/*
+ *  aot.h
+ *
+ *  Ahead-of-time backend (`luappc -s aot`). Instead of bytecode it writes a C file with one native
+ *  function per proto, built on the macros of vm/src/aot.h. Compiled into a shared object and
+ *  registered with `luappvm -N`, those functions replace the protos of the bytecode written from
+ *  the same program, matched by the hash of their instructions and number constants.
+ */
+
+#ifndef _AOT_H
+#define _AOT_H
+
+#include <stdio.h>
+
+struct ir_context;
+
+void aot_write_program(FILE *output, struct ir_context *context);
+
+#endif
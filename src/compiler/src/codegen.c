@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,20 +11,21 @@
 #include "ir.h"
 #include "symbol.h"
 #include "type.h"
+#include "util/buffer.h"
 
-void codegen_write_byte(FILE *output, unsigned char value)
+static void codegen_write_byte(buffer_t *output, unsigned char value) { buf_addch(output, value); }
+
+static void codegen_write_int(buffer_t *output, unsigned int value)
 {
-    fwrite(&value, sizeof(value), 1, output);
+    buf_addmem(output, &value, sizeof(value));
 }
 
-void codegen_write_int(FILE *output, unsigned int value)
+static void codegen_write_double(buffer_t *output, double value)
 {
-    fwrite(&value, sizeof(value), 1, output);
+    buf_addmem(output, &value, sizeof(value));
 }
 
-void codegen_write_double(FILE *output, double value) { fwrite(&value, sizeof(value), 1, output); }
-
-void codegen_write_size(FILE *output, unsigned int value)
+static void codegen_write_size(buffer_t *output, uint64_t value)
 {
     do {
         codegen_write_byte(output, (value & 127) | ((value > 127) << 7));
@@ -31,17 +33,26 @@ void codegen_write_size(FILE *output, unsigned int value)
     } while (value);
 }
 
-void codegen_write_string(FILE *output, char *value)
+/* codegen_write_padding() -- pads a buffer with zeros up to a multiple of BYTECODE_ALIGN
+ *      args: buffer
+ *      rets: none
+ */
+static void codegen_write_padding(buffer_t *output)
+{
+    while (output->b_used % BYTECODE_ALIGN != 0)
+        codegen_write_byte(output, 0);
+}
+
+static void codegen_write_string(buffer_t *output, char *value)
 {
     int size = strlen(value);
     codegen_write_size(output, size);
 
-    /* Write each character individually */
-    for (int i = 0; i < size; i++)
-        codegen_write_byte(output, value[i]);
+    /* Write all the characters at once */
+    buf_addmem(output, value, size);
 }
 
-void codegen_write_symbol_table(FILE *output, struct symbol_table *table)
+static void codegen_write_symbol_table(buffer_t *output, struct symbol_table *table)
 {
     codegen_write_size(output, table->size);
 
@@ -49,60 +60,286 @@ void codegen_write_symbol_table(FILE *output, struct symbol_table *table)
         codegen_write_string(output, iter->symbol.name);
 }
 
-void codegen_write_proto(FILE *output, struct ir_proto *proto)
+/* codegen_write_debug() -- writes the lines and the names of a proto to the debug section
+ *      args: debug section, proto
+ *      rets: none
+ *
+ * Note: Each instruction stores the difference between its line and the line of the instruction
+ * before it, most of them fit in a byte. The scope of a local is its first instruction and the
+ * number of instructions it spans.
+ */
+static void codegen_write_debug(buffer_t *debug, struct ir_proto *proto)
+{
+    codegen_write_size(debug, proto->line_defined);
+    codegen_write_size(debug, proto->last_line_defined);
+    codegen_write_size(debug, proto->code->size);
+
+    int line = proto->line_defined;
+    for (int i = 0; i < proto->code->size; i++) {
+        codegen_write_size(debug, BYTECODE_ZIGZAG(proto->code->lines[i] - line));
+        line = proto->code->lines[i];
+    }
+
+    /* Hidden locals have no name, they are left out */
+    int count = 0;
+    for (int i = 0; i < proto->ranges_size; i++)
+        count += proto->ranges[i].symbol != NULL;
+
+    codegen_write_size(debug, count);
+
+    for (int i = 0; i < proto->ranges_size; i++) {
+        struct ir_local_range *range = &proto->ranges[i];
+        int end = range->end >= 0 ? range->end : proto->code->size;
+
+        if (range->symbol == NULL)
+            continue;
+
+        codegen_write_string(debug, range->symbol->name);
+        codegen_write_size(debug, range->start);
+        codegen_write_size(debug, end - range->start);
+    }
+
+    codegen_write_size(debug, proto->upvalues_size);
+
+    for (int i = 0; i < proto->upvalues_size; i++) {
+        struct symbol *symbol = proto->upvalues[i].symbol;
+        codegen_write_string(debug, symbol != NULL ? symbol->name : "?");
+    }
+}
+
+/* codegen_write_constant() -- writes a constant as a varint, with its tag in the low bits
+ *      args: buffer, constant
+ *      rets: none
+ */
+static void codegen_write_constant(buffer_t *output, struct ir_constant *constant)
 {
-    /* Write the important information about the function */
+    double value = constant->data.number.value;
+
+    switch (constant->type) {
+        case CONSTANT_STRING:
+            codegen_write_size(output,
+                               BYTECODE_CONSTANT(CONSTANT_STRING, constant->data.symbol.symbol_id));
+            break;
+        case CONSTANT_ENVIRONMENT:
+            codegen_write_size(output,
+                               BYTECODE_CONSTANT(CONSTANT_ENVIRONMENT, constant->data.env.index));
+            break;
+        case CONSTANT_NUMBER:
+            /* Most numbers in programs are small integers, they take a byte or two */
+            if (fabs(value) <= BYTECODE_INTEGER_MAX && value == (double)(int64_t)value &&
+                !(value == 0 && signbit(value))) {
+                codegen_write_size(output, BYTECODE_CONSTANT(CONSTANT_INTEGER,
+                                                             BYTECODE_ZIGZAG64((int64_t)value)));
+                break;
+            }
+
+            codegen_write_size(output, BYTECODE_CONSTANT(CONSTANT_NUMBER, 0));
+            codegen_write_double(output, value);
+            break;
+        default:
+            codegen_write_size(output, BYTECODE_CONSTANT(constant->type, 0));
+            break;
+    }
+}
+
+static void codegen_write_proto(buffer_t *output, struct ir_proto *proto, unsigned int *children,
+                                buffer_t *debug)
+{
+    /* Write the important information about the function, the instructions that follow it are
+     * aligned since the proto is */
     codegen_write_byte(output, proto->max_stack_size);
     codegen_write_byte(output, proto->parameters_size);
     codegen_write_byte(output, proto->upvalues_size);
     codegen_write_byte(output, proto->is_vararg);
 
-    codegen_write_size(output, proto->code->size);
+    codegen_write_int(output, proto->code->size);
 
     /* Write all of the instructions to the stream */
-    for (struct ir_instruction *iter = proto->code->first; iter != NULL; iter = iter->next)
-        codegen_write_int(output, iter->value);
+    buf_addmem(output, proto->code->code, proto->code->size * sizeof(uint32_t));
 
     codegen_write_size(output, proto->constant_list->size);
 
-    int id = 0;
-    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next) {
-        codegen_write_byte(output, iter->type);
-        /* Write individual constants */
-        switch (iter->type) {
-            case CONSTANT_STRING:
-                codegen_write_size(output, iter->data.symbol.symbol_id + 1);
-                break;
-            case CONSTANT_ENVIRONMENT:
-                codegen_write_int(output, iter->data.env.index);
-                break;
-            case CONSTANT_NUMBER:
-                codegen_write_double(output, iter->data.number.value);
-                break;
-        }
+    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next)
+        codegen_write_constant(output, iter);
+
+    /* Indices of the children in the proto list, in the order OP_CLOSURE refers to them */
+    codegen_write_size(output, proto->protos->size);
+
+    for (int i = 0; i < proto->protos->size; i++)
+        codegen_write_size(output, children[i]);
+
+    /* Where the debug information of the proto starts in the debug section, 0 if there is none */
+    codegen_write_size(output, debug != NULL ? debug->b_used + 1 : 0);
+
+    if (debug != NULL)
+        codegen_write_debug(debug, proto);
+
+    codegen_write_padding(output);
+}
+
+/* codegen_count_protos() -- counts a proto and all of the protos nested in it
+ *      args: proto
+ *      rets: number of protos
+ */
+static unsigned int codegen_count_protos(struct ir_proto *proto)
+{
+    unsigned int count = 1;
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        count += codegen_count_protos(iter);
+
+    return count;
+}
+
+/* A proto in the order it is written, see codegen_write_protos() */
+struct codegen_slot {
+    struct ir_proto *proto;
+    unsigned int index;
+    unsigned int *children; /* Indices of the protos nested in it */
+};
+
+/* codegen_index_protos() -- numbers a proto after all of the protos nested in it, so the loader has
+ * read the children of a proto by the time it reads their indices
+ *      args: proto, index of the next proto numbered, slot of each index
+ *      rets: index of the proto
+ */
+static unsigned int codegen_index_protos(struct ir_proto *proto, unsigned int *next,
+                                         struct codegen_slot *slots)
+{
+    unsigned int *children = malloc(proto->protos->size * sizeof(unsigned int));
+    int i = 0;
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        children[i++] = codegen_index_protos(iter, next, slots);
+
+    slots[*next] = (struct codegen_slot){proto, *next, children};
+    return (*next)++;
+}
+
+/* codegen_compare_slots() -- orders the protos by the instructions they ran, then by index
+ *      args: two slots
+ *      rets: negative, zero or positive
+ */
+static int codegen_compare_slots(const void *first, const void *second)
+{
+    const struct codegen_slot *a = first, *b = second;
+
+    if (a->proto->heat != b->proto->heat)
+        return a->proto->heat < b->proto->heat ? 1 : -1;
+
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+/* codegen_write_protos() -- writes every proto of a program
+ *      args: buffer, main proto, number of protos, offset of each proto in the buffer, debug
+ *            section (NULL when stripped)
+ *      rets: index of the main proto
+ *
+ * Note: The loader finds the protos by their offsets, so the indices follow the nesting and the
+ * order they are written in is free. The protos that ran the most come first (see feedback.h), a
+ * program compiled without a profile is written in the order of its indices.
+ */
+static unsigned int codegen_write_protos(buffer_t *output, struct ir_proto *proto,
+                                         unsigned int count, uint32_t *offsets, buffer_t *debug)
+{
+    struct codegen_slot *slots = malloc(count * sizeof(struct codegen_slot));
+    unsigned int next = 0;
+    unsigned int main = codegen_index_protos(proto, &next, slots);
+
+    qsort(slots, count, sizeof(struct codegen_slot), codegen_compare_slots);
+
+    for (unsigned int i = 0; i < count; i++) {
+        offsets[slots[i].index] = output->b_used;
+        codegen_write_proto(output, slots[i].proto, slots[i].children, debug);
+        free(slots[i].children);
     }
 
-    /* TODO: List of function prototype indexes */
+    free(slots);
+    return main;
 }
 
-void codegen_write_program(FILE *output, struct ir_context *context)
+/* codegen_write_section() -- appends a section to the bytecode at the offset the table gives it
+ *      args: bytecode, contents of the section
+ *      rets: none
+ */
+static void codegen_write_section(buffer_t *output, buffer_t *section)
 {
-    /* Write bytecode size */
-    codegen_write_byte(output, VERSION_1);
+    codegen_write_padding(output);
+    buf_addmem(output, section->b_data, section->b_used);
+}
 
-    codegen_write_symbol_table(output, context->table);
+/* codegen_emit_program() -- serializes a program into an in-memory buffer
+ *      args: buffer, context
+ *      rets: none
+ */
+void codegen_emit_program(buffer_t *output, struct ir_context *context)
+{
+    buffer_t sections[BYTECODE_SECTIONS];
+
+    for (int i = 0; i < BYTECODE_SECTIONS; i++)
+        buf_init(&sections[i], 0);
+
+    codegen_write_symbol_table(&sections[BYTECODE_SECTION_STRINGS], context->table);
+
+    /* The debug information of the protos is gathered on the side and written after them, the VM
+     * only reads it back when an error or the debug library needs it */
+    unsigned int count = codegen_count_protos(context->main_proto);
+    uint32_t *offsets = malloc(count * sizeof(uint32_t));
+
+    unsigned int main =
+        codegen_write_protos(&sections[BYTECODE_SECTION_PROTOS], context->main_proto, count,
+                             offsets, context->strip ? NULL : &sections[BYTECODE_SECTION_DEBUG]);
+
+    /* Every section starts aligned, the header and the table take a multiple of the alignment */
+    uint32_t offset[BYTECODE_SECTIONS];
+    uint32_t end = BYTECODE_HEADER_SIZE + BYTECODE_SECTIONS * BYTECODE_SECTION_ENTRY_SIZE;
+    uint32_t index_size = (2 + count) * sizeof(uint32_t);
+
+    for (int i = 0; i < BYTECODE_SECTIONS; i++) {
+        end = (end + BYTECODE_ALIGN - 1) & ~(uint32_t)(BYTECODE_ALIGN - 1);
+        offset[i] = end;
+        end += i == BYTECODE_SECTION_INDEX ? index_size : sections[i].b_used;
+    }
+
+    /* The main function contains every other one, so it is the last in the list */
+    buffer_t *index = &sections[BYTECODE_SECTION_INDEX];
+    codegen_write_int(index, count);
+    codegen_write_int(index, main);
 
-    /* Collect the protos */
-    struct ir_proto_list *protos = ir_collect_protos(context->main_proto);
+    for (unsigned int i = 0; i < count; i++)
+        codegen_write_int(index, offset[BYTECODE_SECTION_PROTOS] + offsets[i]);
 
-    /* Write the proto list to the stream */
-    codegen_write_size(output, protos->size);
+    codegen_write_byte(output, VERSION_7);
+    codegen_write_byte(output, 0);
+    codegen_write_byte(output, 0);
+    codegen_write_byte(output, 0);
+    codegen_write_int(output, BYTECODE_SECTIONS);
 
-    for (struct ir_proto *iter = protos->first; iter != NULL; iter = iter->next)
-        codegen_write_proto(output, iter);
+    for (int i = 0; i < BYTECODE_SECTIONS; i++) {
+        codegen_write_int(output, i);
+        codegen_write_int(output, offset[i]);
+        codegen_write_int(output, sections[i].b_used);
+    }
 
-    /* The main function is always the first in the list */
-    codegen_write_size(output, 0);
+    for (int i = 0; i < BYTECODE_SECTIONS; i++) {
+        codegen_write_section(output, &sections[i]);
+        buf_free(&sections[i]);
+    }
 
-    fprintf(output, "\n\n");
-}
\ No newline at end of file
+    free(offsets);
+}
+
+/* codegen_write_program() -- serializes a program and writes it to a stream in a single write
+ *      args: stream, context
+ *      rets: none
+ */
+void codegen_write_program(FILE *output, struct ir_context *context)
+{
+    buffer_t buffer;
+    buf_init(&buffer, 0);
+
+    codegen_emit_program(&buffer, context);
+    buf_flush(&buffer, output);
+
+    buf_free(&buffer);
+}
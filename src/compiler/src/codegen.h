@@ -3,8 +3,11 @@
 
 #include <stdio.h>
 
+#include "util/buffer.h"
+
 struct ir_context;
 
+void codegen_emit_program(buffer_t *output, struct ir_context *context);
 void codegen_write_program(FILE *output, struct ir_context *context);
 
 #endif
\ No newline at end of file
@@ -4,32 +4,76 @@
 
 #include "compiler.h"
 
-/*  compiler_error - prints a compiler error to stdout based on params
+/* Name of the file the calling thread compiles, NULL when there is a single input */
+static _Thread_local const char *current_file = NULL;
+
+/* Stream the errors of the calling thread go to, NULL for stdout */
+static _Thread_local FILE *current_output = NULL;
+
+/*  compiler_set_file - sets the file name that errors of the calling thread are reported with
+ *      args: file name (NULL for none)
+ *      rets: none
+ */
+void compiler_set_file(const char *name) { current_file = name; }
+
+/*  compiler_file - gets the file name errors of the calling thread are reported with
+ *      args: none
+ *      rets: file name or NULL
+ */
+const char *compiler_file(void) { return current_file; }
+
+/*  compiler_set_output - sets the stream errors of the calling thread are written to, so they can
+ *  be held back until it is known whether they stand
+ *      args: stream (NULL for stdout)
+ *      rets: none
+ */
+void compiler_set_output(FILE *stream) { current_output = stream; }
+
+/*  compiler_output - gets the stream errors of the calling thread are written to
+ *      args: none
+ *      rets: stream
+ */
+FILE *compiler_output(void) { return current_output != NULL ? current_output : stdout; }
+
+/*  compiler_error - prints a compiler error to the error stream based on params
  *      args: location of error, format, args
  *      rets: none
  */
 void compiler_error(YYLTYPE location, const char *format, ...)
 {
     va_list ap;
-    printf("Error (%d, %d): ", location.first_line, location.first_column);
+    FILE *output = compiler_output();
+
+    /* Keep the lines of threads compiling other files apart */
+    flockfile(output);
+    if (current_file != NULL)
+        fprintf(output, "%s: ", current_file);
+    fprintf(output, "Error (%d, %d): ", location.first_line, location.first_column);
     va_start(ap, format);
-    vprintf(format, ap);
+    vfprintf(output, format, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(output, "\n");
+    funlockfile(output);
 }
 
-/*  unhandled_compiler_error - prints a compiler error to stdout based on params (no location)
+/*  unhandled_compiler_error - prints a compiler error based on params (no location)
  *      args: format, args
  *      rets: none
  */
 void unhandled_compiler_error(const char *format, ...)
 {
     va_list ap;
-    printf("Error: ");
+    FILE *output = compiler_output();
+
+    flockfile(output);
+    if (current_file != NULL)
+        fprintf(output, "%s: ", current_file);
+    fprintf(output, "Error: ");
     va_start(ap, format);
-    vprintf(format, ap);
+    vfprintf(output, format, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(output, "\n");
+    funlockfile(output);
 }
 
 /*  clear - clears the given string
@@ -49,9 +93,24 @@ void clear(char arr[])
  */
 void usage()
 {
-    printf("luappc -s [lexer|parser|type|symbol|ir|codgen] -o [outputfile] [inputfile]\n\n");
+    printf("luappc -s [lexer|parser|type|fold|symbol|ir|opt|aot|codgen] -o [outputfile] "
+           "-f [[no-]rule] [--stats] [--strip] [--incremental] [--stream] "
+           "[--profile file] -j [threads] [inputfile...]\n\n");
     printf(" -s : indicates the name of the stage to stop after.\n");
-    printf("      Defaults to the last stage.\n");
-    printf(" -o : name of the output file. Defaults to \"output.s\"\n\n");
-    printf("You should pass the name of the file to compile.\n");
+    printf("      Defaults to the last stage, aot writes a C module instead of bytecode.\n");
+    printf(" -o : name of the output file. Defaults to \"output.s\"\n");
+    printf("      With several inputs it names the directory the outputs go to.\n");
+    printf(" -f : enables or disables (no-) an optimizer rule, \"all\" toggles every rule.\n");
+    printf("      Rules: move, dead-load, arithk, fold, dead-code, callenvk.\n");
+    printf(" -j : threads used to compile several inputs. Defaults to the number of processors.\n");
+    printf(" --stats : writes per pass timings, memory and proto sizes as JSON to stderr.\n");
+    printf(" --strip : leaves the source lines and local names out of the bytecode.\n");
+    printf(" --incremental : keeps a type summary (.types) next to every output and only\n");
+    printf("      compiles the inputs that changed and those using globals that changed type.\n");
+    printf(" --stream : compiles the program statement by statement, without a tree of all of\n");
+    printf("      it. -s then needs the symbol stage or a later one.\n");
+    printf(" --profile : compiles the program with the profile luappvm -P wrote when it ran.\n");
+    printf("      Table accesses are specialized, hot calls inlined, hot protos come first.\n\n");
+    printf("You should pass the name of the file to compile. Several files are compiled in\n");
+    printf("parallel, each one into a file with the same name and a .bin extension.\n");
 }
\ No newline at end of file
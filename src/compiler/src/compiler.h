@@ -28,6 +28,10 @@ struct YYLTYPE {
 #define YYLTYPE_IS_TRIVIAL 1
 #endif
 
+void compiler_set_file(const char *name);
+const char *compiler_file(void);
+void compiler_set_output(FILE *stream);
+FILE *compiler_output(void);
 void compiler_error(YYLTYPE location, const char *format, ...);
 void unhandled_compiler_error(const char *format, ...);
 
@@ -0,0 +1,501 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "escape.h"
+#include "node.h"
+#include "type.h"
+#include "util/arena.h"
+
+/* Bigger tables would take too many registers once every field is a local */
+#define ESCAPE_MAXFIELDS 16
+
+/* A field of a candidate table that is read or assigned, rewritten into an identifier */
+struct escape_access {
+    struct node *index; /* Name or expression index node */
+    int field;          /* Position of its key in the constructor */
+    struct escape_access *next;
+};
+
+/* A local initialized with a table constructor that might not escape */
+struct escape_local {
+    struct node *local;       /* Declaring local statement */
+    struct node *identifier;  /* Declaring identifier */
+    struct node *constructor; /* Table constructor it is initialized with */
+    int depth;                /* Function depth of the declaration */
+    bool escapes;
+    struct escape_access *accesses;
+    struct escape_local *next;
+};
+
+static void escape_traversal(struct escape_context *context, struct node *node);
+
+/* escape_init() -- initializes the escape context
+ *      args: context
+ *      returns: none
+ */
+void escape_init(struct escape_context *context)
+{
+    context->scope = NULL;
+    context->depth = 0;
+    context->locals = NULL;
+    context->replaced = 0;
+    context->fields = 0;
+}
+
+/* escape_name() -- gets the identifier of a name, type annotations included
+ *      args: identifier or type annotation node
+ *      returns: identifier node
+ */
+static struct node *escape_name(struct node *name)
+{
+    if (name->type == NODE_TYPE_ANNOTATION)
+        name = name->data.type_annotation.identifier;
+
+    assert(name->type == NODE_IDENTIFIER);
+    return name;
+}
+
+/* escape_pair() -- takes the first key-value pair off a pair list
+ *      args: pair list, pointer to the rest of the list
+ *      returns: key-value pair node
+ */
+static struct node *escape_pair(struct node *pairs, struct node **rest)
+{
+    if (pairs->type == NODE_EXPRESSION_LIST) {
+        *rest = pairs->data.expression_list.init;
+        return pairs->data.expression_list.expression;
+    }
+
+    *rest = NULL;
+    return pairs;
+}
+
+/* escape_field() -- finds the position of a key in the constructor of a candidate
+ *      args: candidate, key
+ *      returns: position of the key, -1 when the constructor does not have it
+ */
+static int escape_field(struct escape_local *local, const char *key)
+{
+    struct node *pairs = local->constructor->data.table_constructor.pairlist;
+
+    for (int field = 0; pairs != NULL; field++) {
+        struct node *pair = escape_pair(pairs, &pairs);
+
+        if (strcmp(pair->data.key_value_pair.key->data.string.value, key) == 0)
+            return field;
+    }
+
+    return -1;
+}
+
+/* escape_constructor() -- checks that a table constructor could be replaced by locals: it has at
+ * least one pair and all of its keys are distinct constant strings
+ *      args: table constructor node
+ *      returns: whether the constructor is a candidate
+ */
+static bool escape_constructor(struct node *constructor)
+{
+    struct node *pairs = constructor->data.table_constructor.pairlist;
+    struct node *keys[ESCAPE_MAXFIELDS];
+    int size = 0;
+
+    if (pairs == NULL)
+        return false;
+
+    while (pairs != NULL) {
+        struct node *pair = escape_pair(pairs, &pairs);
+
+        if (pair->type != NODE_KEY_VALUE_PAIR || size == ESCAPE_MAXFIELDS)
+            return false;
+
+        struct node *key = pair->data.key_value_pair.key;
+        if (key->type != NODE_STRING)
+            return false;
+
+        for (int i = 0; i < size; i++)
+            if (strcmp(keys[i]->data.string.value, key->data.string.value) == 0)
+                return false;
+
+        keys[size++] = key;
+    }
+
+    return true;
+}
+
+/* escape_declare() -- brings a local into the current scope
+ *      args: context, identifier or type annotation node, candidate or NULL when the local is not
+ *            one
+ *      returns: none
+ */
+static void escape_declare(struct escape_context *context, struct node *name,
+                           struct escape_local *local)
+{
+    int res = hashmap_put(context->scope, escape_name(name)->data.identifier.name, local);
+    assert(res == MAP_OK);
+}
+
+/* escape_lookup() -- finds the candidate a name refers to
+ *      args: context, identifier node
+ *      returns: the candidate, NULL for globals and other locals
+ */
+static struct escape_local *escape_lookup(struct escape_context *context, struct node *identifier)
+{
+    void *local;
+
+    if (hashmap_get(context->scope, identifier->data.identifier.name, &local) != MAP_OK)
+        return NULL;
+
+    return local;
+}
+
+/* escape_declare_list() -- declares every name of a name or parameter list as a plain local
+ *      args: context, list node
+ *      returns: none
+ */
+static void escape_declare_list(struct escape_context *context, struct node *names)
+{
+    if (names != NULL && names->type == NODE_PARAMETER_LIST)
+        names = names->data.parameter_list.namelist;
+
+    while (names != NULL) {
+        if (names->type == NODE_NAME_LIST) {
+            escape_declare(context, names->data.name_list.name, NULL);
+            names = names->data.name_list.init;
+        } else {
+            escape_declare(context, names, NULL);
+            names = NULL;
+        }
+    }
+}
+
+/* escape_statements() -- visits the statements of a block in the current scope
+ *      args: context, block node
+ *      returns: none
+ */
+static void escape_statements(struct escape_context *context, struct node *block)
+{
+    if (block == NULL || block->type != NODE_BLOCK) {
+        escape_traversal(context, block);
+        return;
+    }
+
+    for (int i = 0; i < block->data.block.size; i++)
+        escape_traversal(context, block->data.block.statements[i]);
+}
+
+/* escape_scope() -- visits the statements of a block in a new scope layered on top of the current
+ * one
+ *      args: context, block node
+ *      returns: none
+ */
+static void escape_scope(struct escape_context *context, struct node *block)
+{
+    map_t parent = context->scope;
+
+    context->scope = hashmap_scope(parent);
+    escape_statements(context, block);
+
+    hashmap_free(context->scope);
+    context->scope = parent;
+}
+
+/* escape_local() -- visits the values of a local statement and declares its names, a single name
+ * bound to a candidate constructor inside a function becomes a candidate
+ *      args: context, local node
+ *      returns: none
+ */
+static void escape_local(struct escape_context *context, struct node *node)
+{
+    struct node *names = node->data.local.namelist;
+    struct node *values = node->data.local.exprlist;
+
+    /* local function f() ... end: the function can call itself */
+    if (values != NULL && values->type == NODE_FUNCTION_BODY) {
+        escape_declare_list(context, names);
+        escape_traversal(context, values);
+        return;
+    }
+
+    escape_traversal(context, values);
+
+    /* Streamed statements are not wrapped in a function, their locals outlive the statement */
+    if (names->type == NODE_NAME_LIST || values == NULL ||
+        values->type != NODE_TABLE_CONSTRUCTOR || context->depth == 0 ||
+        !escape_constructor(values)) {
+        escape_declare_list(context, names);
+        return;
+    }
+
+    struct escape_local *local = amalloc(sizeof(struct escape_local));
+
+    local->local = node;
+    local->identifier = escape_name(names);
+    local->constructor = values;
+    local->depth = context->depth;
+    local->escapes = false;
+    local->accesses = NULL;
+    local->next = context->locals;
+    context->locals = local;
+
+    escape_declare(context, names, local);
+}
+
+/* escape_index() -- visits an index, a constant key of a candidate accessed from the function
+ * declaring it is recorded to be rewritten, in any other case the table is read as a value
+ *      args: context, name or expression index node
+ *      returns: none
+ */
+static void escape_index(struct escape_context *context, struct node *index)
+{
+    struct node *expression;
+    const char *key = NULL;
+
+    if (index->type == NODE_NAME_INDEX) {
+        expression = index->data.name_index.expression;
+        /* `t:f()´ passes t itself */
+        if (!index->data.name_index.self_index)
+            key = index->data.name_index.index->data.identifier.name;
+    } else {
+        expression = index->data.expression_index.expression;
+        if (index->data.expression_index.index->type == NODE_STRING)
+            key = index->data.expression_index.index->data.string.value;
+        escape_traversal(context, index->data.expression_index.index);
+    }
+
+    struct escape_local *local = NULL;
+    if (expression->type == NODE_NAME_REFERENCE &&
+        expression->data.name_reference.identifier->type == NODE_IDENTIFIER)
+        local = escape_lookup(context, expression->data.name_reference.identifier);
+
+    if (local == NULL || local->escapes || local->depth != context->depth || key == NULL) {
+        escape_traversal(context, expression);
+        return;
+    }
+
+    int field = escape_field(local, key);
+    if (field < 0) {
+        local->escapes = true;
+        return;
+    }
+
+    struct escape_access *access = amalloc(sizeof(struct escape_access));
+
+    access->index = index;
+    access->field = field;
+    access->next = local->accesses;
+    local->accesses = access;
+}
+
+/* escape_replace() -- turns a candidate that does not escape into one local per field and its
+ * accesses into references to those locals
+ *      args: context, candidate
+ *      returns: none
+ */
+static void escape_replace(struct escape_context *context, struct escape_local *local)
+{
+    struct node *node = local->local;
+    struct type *table = local->identifier->node_type;
+    struct type *type = table != NULL && table->kind == TYPE_TABLE ? table->data.table.value
+                                                                   : type_basic(TYPE_BASIC_ANY);
+    const char *prefix = local->identifier->data.identifier.name;
+    struct node *pairs = local->constructor->data.table_constructor.pairlist;
+    struct node *fields[ESCAPE_MAXFIELDS], *values[ESCAPE_MAXFIELDS];
+    int size = 0;
+
+    /* `t.x´ can not be the name of a local in the source, so the new names do not clash */
+    while (pairs != NULL) {
+        struct node *pair = escape_pair(pairs, &pairs);
+        const char *key = pair->data.key_value_pair.key->data.string.value;
+        size_t length = strlen(prefix) + strlen(key) + 1;
+        char *name = amalloc(length + 1);
+
+        snprintf(name, length + 1, "%s.%s", prefix, key);
+        fields[size] = node_identifier(node->location, name, length);
+        fields[size]->node_type = type;
+        values[size++] = pair->data.key_value_pair.value;
+    }
+
+    /* Lists are stored first element first, the last one is not wrapped */
+    struct node *names = fields[size - 1], *exprlist = values[size - 1];
+    for (int i = size - 2; i >= 0; i--) {
+        names = node_name_list(node->location, names, fields[i]);
+        exprlist = node_expression_list(node->location, exprlist, values[i]);
+    }
+
+    node->data.local.namelist = names;
+    node->data.local.exprlist = exprlist;
+
+    for (struct escape_access *access = local->accesses; access != NULL; access = access->next) {
+        struct node *index = access->index;
+
+        index->type = NODE_IDENTIFIER;
+        memset(&index->data, 0, sizeof(index->data));
+        index->data.identifier.name = fields[access->field]->data.identifier.name;
+        index->node_type = type;
+    }
+
+    context->replaced++;
+    context->fields += size;
+}
+
+/* escape_traversal() -- walks the AST keeping track of the locals in scope, every candidate that is
+ * read as a value escapes
+ *      args: context, node
+ *      returns: none
+ */
+static void escape_traversal(struct escape_context *context, struct node *node)
+{
+    if (!node)
+        return;
+
+    switch (node->type) {
+        case NODE_IDENTIFIER: {
+            struct escape_local *local = escape_lookup(context, node);
+            if (local != NULL)
+                local->escapes = true;
+            break;
+        }
+        case NODE_NAME_REFERENCE:
+            escape_traversal(context, node->data.name_reference.identifier);
+            break;
+        case NODE_EXPRESSION_INDEX:
+        case NODE_NAME_INDEX:
+            escape_index(context, node);
+            break;
+        case NODE_BINARY_OPERATION:
+            escape_traversal(context, node->data.binary_operation.left);
+            escape_traversal(context, node->data.binary_operation.right);
+            break;
+        case NODE_UNARY_OPERATION:
+            escape_traversal(context, node->data.unary_operation.expression);
+            break;
+        case NODE_EXPRESSION_GROUP:
+            escape_traversal(context, node->data.expression_group.expression);
+            break;
+        case NODE_EXPRESSION_LIST:
+            escape_traversal(context, node->data.expression_list.expression);
+            escape_traversal(context, node->data.expression_list.init);
+            break;
+        case NODE_VARIABLE_LIST:
+            escape_traversal(context, node->data.variable_list.variable);
+            escape_traversal(context, node->data.variable_list.init);
+            break;
+        case NODE_CALL:
+            escape_traversal(context, node->data.call.prefix_expression);
+            escape_traversal(context, node->data.call.args);
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+            escape_traversal(context, node->data.expression_statement.expression);
+            break;
+        case NODE_RETURN:
+            escape_traversal(context, node->data.return_statement.exprlist);
+            break;
+        case NODE_ARRAY_CONSTRUCTOR:
+            escape_traversal(context, node->data.array_constructor.exprlist);
+            break;
+        case NODE_TABLE_CONSTRUCTOR:
+            escape_traversal(context, node->data.table_constructor.pairlist);
+            break;
+        case NODE_KEY_VALUE_PAIR:
+            escape_traversal(context, node->data.key_value_pair.key);
+            escape_traversal(context, node->data.key_value_pair.value);
+            break;
+        case NODE_LOCAL:
+            escape_local(context, node);
+            break;
+        case NODE_ASSIGNMENT:
+            /* Assigning a candidate makes it escape like reading it, its fields are indexes */
+            escape_traversal(context, node->data.assignment.values);
+            escape_traversal(context, node->data.assignment.variables);
+            break;
+        case NODE_BLOCK:
+            escape_scope(context, node);
+            break;
+        case NODE_IF:
+            escape_traversal(context, node->data.if_statement.condition);
+            escape_scope(context, node->data.if_statement.body);
+            escape_scope(context, node->data.if_statement.else_body);
+            break;
+        case NODE_WHILELOOP:
+            escape_traversal(context, node->data.while_loop.condition);
+            escape_scope(context, node->data.while_loop.body);
+            break;
+        case NODE_REPEATLOOP: {
+            map_t parent = context->scope;
+            /* Locals of the body are visible in the condition */
+            context->scope = hashmap_scope(parent);
+            escape_statements(context, node->data.repeat_loop.body);
+            escape_traversal(context, node->data.repeat_loop.condition);
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_NUMERICFORLOOP: {
+            struct node *init = node->data.numerical_for_loop.init;
+            struct node *variable = init->data.assignment.variables;
+            map_t parent = context->scope;
+            escape_traversal(context, init->data.assignment.values);
+            escape_traversal(context, node->data.numerical_for_loop.target);
+            escape_traversal(context, node->data.numerical_for_loop.increment);
+            /* The control variable is written by the loop, a candidate it names escapes */
+            if (variable->type != NODE_TYPE_ANNOTATION)
+                escape_traversal(context, variable);
+            context->scope = hashmap_scope(parent);
+            escape_declare(context,
+                           variable->type == NODE_NAME_REFERENCE
+                               ? variable->data.name_reference.identifier
+                               : variable,
+                           NULL);
+            escape_statements(context, node->data.numerical_for_loop.body);
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_GENERICFORLOOP: {
+            struct node *local = node->data.generic_for_loop.local;
+            map_t parent = context->scope;
+            escape_traversal(context, local->data.local.exprlist);
+            context->scope = hashmap_scope(parent);
+            escape_declare_list(context, local->data.local.namelist);
+            escape_statements(context, node->data.generic_for_loop.body);
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_FUNCTION_BODY: {
+            map_t parent = context->scope;
+            context->scope = hashmap_scope(parent);
+            context->depth++;
+            escape_declare_list(context, node->data.function_body.exprlist);
+            escape_statements(context, node->data.function_body.body);
+            context->depth--;
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* escape_ast() -- replaces the tables that do not escape by locals throughout the tree
+ *      args: context, AST
+ *      returns: none
+ */
+void escape_ast(struct escape_context *context, struct node *tree)
+{
+    context->scope = hashmap_new();
+    context->locals = NULL;
+    escape_traversal(context, tree);
+    hashmap_free(context->scope);
+    context->scope = NULL;
+
+    for (struct escape_local *local = context->locals; local != NULL; local = local->next)
+        if (!local->escapes)
+            escape_replace(context, local);
+
+    context->locals = NULL;
+}
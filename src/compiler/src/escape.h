@@ -0,0 +1,37 @@
+/*
+ *  escape.h
+ *
+ *  Scalar replacement runs on the typed AST, right before constant folding. A local of a function
+ *  that is initialized with a table constructor of constant string keys, `local p = {["x"] = 1,
+ *  ["y"] = 2}`, and that is only ever used as `p.x` or `p["x"]` with one of those keys, read or
+ *  assigned, never escapes: no other code can see the table. Such a table is not built at all,
+ *  each of its fields becomes a local of its own and every access a reference to that local, so
+ *  the fields live in registers and folding can propagate the ones that are never assigned.
+ *
+ *  Any other use makes the table escape: reading it as a value (passing it to a function,
+ *  returning it, storing it), assigning the local, calling a method on it, a key that is not one
+ *  of the constructor's or not a constant, or an access from a nested function. The pass walks the
+ *  tree once to find the tables that do not escape and rewrites them afterwards.
+ */
+
+#ifndef _ESCAPE_H
+#define _ESCAPE_H
+
+#include "util/hashmap.h"
+
+struct node;
+struct escape_local;
+
+struct escape_context {
+    map_t scope;                 /* Locals in scope, maps their name to an escape_local or NULL */
+    int depth;                   /* Number of function bodies around the node being visited */
+    struct escape_local *locals; /* Every candidate table, the last one declared first */
+
+    int replaced; /* Number of tables replaced by locals */
+    int fields;   /* Number of locals the fields of those tables became */
+};
+
+void escape_init(struct escape_context *context);
+void escape_ast(struct escape_context *context, struct node *tree);
+
+#endif
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "feedback.h"
+#include "ir.h"
+#include "util/flexstr.h"
+
+/* Entries a list starts with, it doubles whenever it is full */
+#define FEEDBACK_LIST_SIZE 64
+
+/* feedback_compare_counts() -- orders counts by their line
+ *      args: two counts
+ *      rets: difference of their lines
+ */
+static int feedback_compare_counts(const void *first, const void *second)
+{
+    const struct feedback_count *a = first, *b = second;
+
+    return (a->line > b->line) - (a->line < b->line);
+}
+
+/* feedback_compare_sites() -- orders sites by their function, line, kind and ordinal
+ *      args: two sites
+ *      rets: negative, zero or positive
+ */
+static int feedback_compare_sites(const void *first, const void *second)
+{
+    const struct feedback_site *a = first, *b = second;
+
+    if (a->function != b->function)
+        return (a->function > b->function) - (a->function < b->function);
+    if (a->line != b->line)
+        return (a->line > b->line) - (a->line < b->line);
+    if (a->kind != b->kind)
+        return (a->kind > b->kind) - (a->kind < b->kind);
+
+    return (a->ordinal > b->ordinal) - (a->ordinal < b->ordinal);
+}
+
+/* feedback_merge_counts() -- sorts a list of counts and adds up those of the same line
+ *      args: list, size of the list
+ *      rets: size of the merged list
+ */
+static int feedback_merge_counts(struct feedback_count *counts, int size)
+{
+    int merged = 0;
+
+    qsort(counts, size, sizeof(struct feedback_count), feedback_compare_counts);
+
+    for (int i = 0; i < size; i++) {
+        if (merged > 0 && counts[merged - 1].line == counts[i].line)
+            counts[merged - 1].count += counts[i].count;
+        else
+            counts[merged++] = counts[i];
+    }
+
+    return merged;
+}
+
+/* feedback_merge_sites() -- sorts the sites and adds up the counts and the types of the same site
+ *      args: profile
+ *      rets: none
+ */
+static void feedback_merge_sites(struct feedback *feedback)
+{
+    struct feedback_site *sites = feedback->sites;
+    int merged = 0;
+
+    qsort(sites, feedback->sites_size, sizeof(struct feedback_site), feedback_compare_sites);
+
+    for (int i = 0; i < feedback->sites_size; i++) {
+        struct feedback_site *last = merged > 0 ? &sites[merged - 1] : NULL;
+
+        if (last != NULL && !feedback_compare_sites(last, &sites[i])) {
+            last->count += sites[i].count;
+            last->types[0] |= sites[i].types[0];
+            last->types[1] |= sites[i].types[1];
+        } else
+            sites[merged++] = sites[i];
+    }
+
+    feedback->sites_size = merged;
+}
+
+/* feedback_add_count() -- appends a count to a list
+ *      args: list, size, space, line, count
+ *      rets: none
+ */
+static void feedback_add_count(struct feedback_count **list, int *size, int *space, int line,
+                               uint64_t count)
+{
+    if (*size == *space) {
+        *space = *space > 0 ? *space * 2 : FEEDBACK_LIST_SIZE;
+        *list = srealloc(*list, *space * sizeof(struct feedback_count));
+    }
+
+    (*list)[(*size)++] = (struct feedback_count){line, count};
+}
+
+/* feedback_parse_kind() -- looks up a kind by the name the profile gives it
+ *      args: name
+ *      rets: kind, FEEDBACK_NONE if there is none with this name
+ */
+static enum feedback_kind feedback_parse_kind(const char *name)
+{
+    for (int kind = 0; kind < FEEDBACK_KINDS; kind++)
+        if (!strcmp(name, feedback_kind_names[kind]))
+            return kind;
+
+    return FEEDBACK_NONE;
+}
+
+/* feedback_read() -- reads the profile luappvm -P wrote
+ *      args: path, profile to fill
+ *      rets: 0 on success, -1 if the file can not be read or is not a profile
+ *
+ * Note: Lines that are not understood are skipped, so are the kinds of a newer VM.
+ */
+int feedback_read(const char *path, struct feedback *feedback)
+{
+    FILE *input = fopen(path, "r");
+    char *line = NULL;
+    size_t space = 0;
+    int version = 0, lines_space = 0, protos_space = 0, sites_space = 0;
+
+    memset(feedback, 0, sizeof(*feedback));
+
+    if (input == NULL)
+        return -1;
+
+    if (getline(&line, &space, input) < 0 || sscanf(line, "luapp-profile %d", &version) != 1 ||
+        version != FEEDBACK_VERSION) {
+        free(line);
+        fclose(input);
+        return -1;
+    }
+
+    while (getline(&line, &space, input) > 0) {
+        char kind[16];
+        unsigned long long count;
+        unsigned int first, second;
+        int at, function, ordinal;
+
+        if (sscanf(line, "line %d %llu", &at, &count) == 2) {
+            feedback_add_count(&feedback->lines, &feedback->lines_size, &lines_space, at, count);
+            feedback->has_lines |= at > 0;
+        } else if (sscanf(line, "proto %d %llu", &at, &count) == 2) {
+            feedback_add_count(&feedback->protos, &feedback->protos_size, &protos_space, at, count);
+            feedback->total += count;
+        } else if (sscanf(line, "site %d %d %15s %d %llu %x %x", &function, &at, kind, &ordinal,
+                          &count, &first, &second) == 7) {
+            enum feedback_kind parsed = feedback_parse_kind(kind);
+
+            if (parsed == FEEDBACK_NONE)
+                continue;
+
+            if (feedback->sites_size == sites_space) {
+                sites_space = sites_space > 0 ? sites_space * 2 : FEEDBACK_LIST_SIZE;
+                feedback->sites =
+                    srealloc(feedback->sites, sites_space * sizeof(struct feedback_site));
+            }
+
+            feedback->sites[feedback->sites_size++] = (struct feedback_site){
+                function, at, parsed, ordinal, count, {(uint8_t)first, (uint8_t)second}};
+        }
+    }
+
+    free(line);
+    fclose(input);
+
+    feedback->lines_size = feedback_merge_counts(feedback->lines, feedback->lines_size);
+    feedback->protos_size = feedback_merge_counts(feedback->protos, feedback->protos_size);
+    feedback_merge_sites(feedback);
+    return 0;
+}
+
+/* feedback_free() -- deallocates a profile
+ *      args: profile
+ *      rets: none
+ */
+void feedback_free(struct feedback *feedback)
+{
+    free(feedback->lines);
+    free(feedback->protos);
+    free(feedback->sites);
+    memset(feedback, 0, sizeof(*feedback));
+}
+
+/* feedback_init() -- initializes the context of a compilation
+ *      args: context, profile (NULL for none)
+ *      rets: none
+ */
+void feedback_init(struct feedback_context *context, const struct feedback *profile)
+{
+    memset(context, 0, sizeof(*context));
+    context->profile = profile;
+}
+
+/* feedback_count() -- looks up the instructions a line ran
+ *      args: sorted list, size, line
+ *      rets: count, 0 if the line is not in the list
+ */
+static uint64_t feedback_count(const struct feedback_count *list, int size, int line)
+{
+    struct feedback_count key = {line, 0};
+    const struct feedback_count *found =
+        bsearch(&key, list, size, sizeof(struct feedback_count), feedback_compare_counts);
+
+    return found != NULL ? found->count : 0;
+}
+
+/* feedback_inline_nodes() -- decides how large the functions inlined by a call may be
+ *      args: context (NULL without a profile), line of the call
+ *      rets: most nodes of the body, 0 to call the function
+ */
+int feedback_inline_nodes(const struct feedback_context *context, int line)
+{
+    /* Without lines every call would look cold */
+    if (context == NULL || context->profile == NULL || !context->profile->has_lines)
+        return IR_INLINE_NODES;
+
+    const struct feedback *profile = context->profile;
+    uint64_t count = feedback_count(profile->lines, profile->lines_size, line);
+
+    /* A call that never ran only makes the code larger when it is inlined */
+    if (count == 0)
+        return 0;
+
+    return count >= profile->total / FEEDBACK_HOT_SHARE ? IR_INLINE_HOT_NODES : IR_INLINE_NODES;
+}
+
+/* feedback_site() -- looks up a site of the profile
+ *      args: profile, line of the function, line, kind and ordinal of the site
+ *      rets: site, NULL if it never ran
+ */
+static const struct feedback_site *feedback_site(const struct feedback *profile, int function,
+                                                 int line, enum feedback_kind kind, int ordinal)
+{
+    struct feedback_site key = {function, line, kind, ordinal, 0, {0, 0}};
+
+    return bsearch(&key, profile->sites, profile->sites_size, sizeof(struct feedback_site),
+                   feedback_compare_sites);
+}
+
+/* feedback_whole_index() -- determines whether a site only indexed tables or typed arrays with
+ * whole numbers
+ *      args: site
+ *      rets: yes or no
+ */
+static bool feedback_whole_index(const struct feedback_site *site)
+{
+    uint8_t containers = FEEDBACK_TABLE | FEEDBACK_ARRAY;
+
+    return site->types[0] != 0 && (site->types[0] & ~containers) == 0 &&
+           site->types[1] == FEEDBACK_INTEGER;
+}
+
+/* feedback_compare_keys() -- orders the keys of feedback_proto()
+ *      args: two keys
+ *      rets: negative, zero or positive
+ */
+static int feedback_compare_keys(const void *first, const void *second)
+{
+    uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+
+    return (a > b) - (a < b);
+}
+
+/* feedback_proto() -- specializes the table accesses of a proto and its children, and gives each
+ * of them its heat
+ *      args: context, ir proto
+ *      rets: none
+ *
+ * Note: The sites are keyed the way luapp_profile_feedback() keys them, the line, the kind and the
+ * position of an instruction sorted together give the ordinals.
+ */
+static void feedback_proto(struct feedback_context *context, struct ir_proto *proto)
+{
+    const struct feedback *profile = context->profile;
+    struct ir_section *code = proto->code;
+    uint64_t *keys = smalloc((code->size > 0 ? code->size : 1) * sizeof(uint64_t));
+    int size = 0;
+
+    proto->heat = feedback_count(profile->protos, profile->protos_size, proto->line_defined);
+    context->protos += proto->heat > 0;
+
+    for (int pc = 0; pc < code->size; pc++) {
+        enum feedback_kind kind = feedback_kind(GET_OPCODE(code->code[pc]));
+
+        if (code->modes[pc] != SUB && kind != FEEDBACK_NONE)
+            keys[size++] = (uint64_t)(uint32_t)code->lines[pc] << 35 | (uint64_t)kind << 32 |
+                           (uint32_t)pc;
+    }
+
+    qsort(keys, size, sizeof(uint64_t), feedback_compare_keys);
+
+    for (int i = 0, ordinal = 0; i < size; i++) {
+        int pc = (uint32_t)keys[i];
+        uint32_t instruction = code->code[pc];
+        enum feedback_kind kind = feedback_kind(GET_OPCODE(instruction));
+
+        ordinal = i > 0 && keys[i] >> 32 == keys[i - 1] >> 32 ? ordinal + 1 : 0;
+
+        if (GET_OPCODE(instruction) != OP_GETTABLE && GET_OPCODE(instruction) != OP_SETTABLE)
+            continue;
+
+        const struct feedback_site *site =
+            feedback_site(profile, proto->line_defined, code->lines[pc], kind, ordinal);
+
+        if (site == NULL || !feedback_whole_index(site))
+            continue;
+
+        enum opcode op = GET_OPCODE(instruction) == OP_GETTABLE ? OP_GETARRAY : OP_SETARRAY;
+
+        code->code[pc] = ir_instruction_ABC(op, GETARG_A(instruction), GETARG_B(instruction),
+                                            GETARG_C(instruction))
+                             .value;
+        context->indexes++;
+    }
+
+    free(keys);
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        feedback_proto(context, iter);
+}
+
+/* feedback_run() -- applies the profile to every proto of a program once it is optimized
+ *      args: context, ir context
+ *      rets: none
+ */
+void feedback_run(struct feedback_context *context, struct ir_context *ir)
+{
+    if (context->profile != NULL)
+        feedback_proto(context, ir->main_proto);
+}
+
+/* feedback_print_summary() -- prints what the profile changed
+ *      args: output stream, context
+ *      rets: none
+ */
+void feedback_print_summary(FILE *output, struct feedback_context *context)
+{
+    if (context->profile == NULL)
+        return;
+
+    fprintf(output, "profile:\n  %d table accesses specialized, %d protos ran\n\n",
+            context->indexes, context->protos);
+}
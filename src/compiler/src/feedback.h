@@ -0,0 +1,85 @@
+/*
+ *  feedback.h
+ *
+ *  Profile guided compilation for `luappc --profile`. A profiling VM (luappvm -P) counts how
+ *  often every instruction of a program ran and which types the operands of its arithmetic,
+ *  table accesses and calls had (see common/feedback.h). Compiling the program again with that
+ *  profile:
+ *
+ *   - turns the table reads and writes that type.c could not prove to have whole keys, but that
+ *     only ever saw whole keys on tables or typed arrays, into OP_GETARRAY and OP_SETARRAY. Those
+ *     read and write the array part without a call and take the regular path for anything else.
+ *   - inlines larger functions (IR_INLINE_HOT_NODES) on the lines that ran a good part of the
+ *     program, and none on the lines that never ran.
+ *   - writes the protos that ran the most instructions first in the bytecode, the hot code of a
+ *     mapped program is packed together and the protos that never ran come last.
+ *
+ *  Every instruction it emits keeps its own checks, a profile that does not match the program
+ *  (another input, an older source) only costs speed. Arithmetic is left as it is: the generic
+ *  instructions try numbers first already and the number forms (OP_ADDNN...) do not check their
+ *  operands, so they are only emitted for types type.c proved. Calls are not rewritten either,
+ *  OP_CALL takes the same path as OP_CALLDIRECT for Lua functions with fixed parameters, and the
+ *  OP_CALLENVK superinstruction is at least as fast as the instructions it replaces whatever the
+ *  callee, there is no choice for the profile to make.
+ *
+ *  The profile is read once and shared by the compilations of a run, each compilation counts what
+ *  it did in a feedback_context of its own.
+ */
+
+#ifndef _FEEDBACK_H
+#define _FEEDBACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../../common/feedback.h"
+
+struct ir_context;
+
+/* Lines that ran at least one in FEEDBACK_HOT_SHARE of the instructions of the program are hot */
+#define FEEDBACK_HOT_SHARE 100
+
+/* Instructions run by a line or by the functions defined on a line */
+struct feedback_count {
+    int line;
+    uint64_t count;
+};
+
+/* A site of the profile, see common/feedback.h */
+struct feedback_site {
+    int function; /* Line the function is defined on */
+    int line;
+    enum feedback_kind kind;
+    int ordinal; /* Instructions of the kind before it on the line in its function */
+    uint64_t count;
+    uint8_t types[2];
+};
+
+/* A profile as read from the file, entries of the same line or site are added up */
+struct feedback {
+    struct feedback_count *lines, *protos;
+    int lines_size, protos_size;
+    struct feedback_site *sites;
+    int sites_size;
+
+    uint64_t total; /* Instructions the program ran */
+    bool has_lines; /* The program had a debug section, without one every line is 0 */
+};
+
+struct feedback_context {
+    const struct feedback *profile; /* NULL without --profile */
+
+    int indexes; /* Table accesses turned into OP_GETARRAY or OP_SETARRAY */
+    int protos;  /* Protos that ran, they are written before the others */
+};
+
+int feedback_read(const char *path, struct feedback *feedback);
+void feedback_free(struct feedback *feedback);
+
+void feedback_init(struct feedback_context *context, const struct feedback *profile);
+int feedback_inline_nodes(const struct feedback_context *context, int line);
+void feedback_run(struct feedback_context *context, struct ir_context *ir);
+void feedback_print_summary(FILE *output, struct feedback_context *context);
+
+#endif
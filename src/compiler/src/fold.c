@@ -0,0 +1,392 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "fold.h"
+#include "node.h"
+
+static void fold_traversal(struct fold_context *context, struct node *node);
+
+/* fold_init() -- initializes the fold context
+ *      args: context
+ *      returns: none
+ */
+void fold_init(struct fold_context *context)
+{
+    context->propagate = false;
+    context->scope = NULL;
+    context->folded = 0;
+    context->propagated = 0;
+}
+
+/* fold_name() -- gets the identifier of a name, type annotations included
+ *      args: identifier or type annotation node
+ *      returns: identifier node
+ */
+static struct node *fold_name(struct node *name)
+{
+    if (name->type == NODE_TYPE_ANNOTATION)
+        name = name->data.type_annotation.identifier;
+
+    assert(name->type == NODE_IDENTIFIER);
+    return name;
+}
+
+/* fold_declare() -- brings a local into the current scope
+ *      args: context, identifier or type annotation node
+ *      returns: declaring identifier node
+ */
+static struct node *fold_declare(struct fold_context *context, struct node *name)
+{
+    struct node *identifier = fold_name(name);
+    int res = hashmap_put(context->scope, identifier->data.identifier.name, identifier);
+    assert(res == MAP_OK);
+
+    return identifier;
+}
+
+/* fold_lookup() -- finds the declaration of the local a name refers to
+ *      args: context, identifier node
+ *      returns: the declaring identifier node, NULL for globals
+ */
+static struct node *fold_lookup(struct fold_context *context, struct node *identifier)
+{
+    void *declaration;
+
+    if (hashmap_get(context->scope, identifier->data.identifier.name, &declaration) != MAP_OK)
+        return NULL;
+
+    return declaration;
+}
+
+/* fold_declare_list() -- declares every name of a name or parameter list as a non-constant local
+ *      args: context, list node
+ *      returns: none
+ */
+static void fold_declare_list(struct fold_context *context, struct node *names)
+{
+    if (names != NULL && names->type == NODE_PARAMETER_LIST)
+        names = names->data.parameter_list.namelist;
+
+    while (names != NULL) {
+        if (names->type == NODE_NAME_LIST) {
+            fold_declare(context, names->data.name_list.name);
+            names = names->data.name_list.init;
+        } else {
+            fold_declare(context, names);
+            names = NULL;
+        }
+    }
+}
+
+/* fold_statements() -- visits the statements of a block in the current scope
+ *      args: context, block node
+ *      returns: none
+ */
+static void fold_statements(struct fold_context *context, struct node *block)
+{
+    if (block == NULL || block->type != NODE_BLOCK) {
+        fold_traversal(context, block);
+        return;
+    }
+
+    for (int i = 0; i < block->data.block.size; i++)
+        fold_traversal(context, block->data.block.statements[i]);
+}
+
+/* fold_scope() -- visits the statements of a block in a new scope layered on top of the current
+ * one
+ *      args: context, block node
+ *      returns: none
+ */
+static void fold_scope(struct fold_context *context, struct node *block)
+{
+    map_t parent = context->scope;
+
+    context->scope = hashmap_scope(parent);
+    fold_statements(context, block);
+
+    hashmap_free(context->scope);
+    context->scope = parent;
+}
+
+/* fold_local() -- visits the values of a local statement and declares its names, in the second
+ * walk every name that is bound to a literal and never assigned afterwards becomes a constant
+ *      args: context, local node
+ *      returns: none
+ */
+static void fold_local(struct fold_context *context, struct node *local)
+{
+    struct node *names = local->data.local.namelist;
+    struct node *values = local->data.local.exprlist;
+
+    /* local function f() ... end: the function can call itself */
+    if (values != NULL && values->type == NODE_FUNCTION_BODY) {
+        fold_declare_list(context, names);
+        fold_traversal(context, values);
+        return;
+    }
+
+    fold_traversal(context, values);
+
+    /* Names and values are both stored first element first */
+    while (names != NULL) {
+        struct node *name = names, *value = values;
+
+        if (names->type == NODE_NAME_LIST) {
+            name = names->data.name_list.name;
+            names = names->data.name_list.init;
+        } else
+            names = NULL;
+
+        if (values != NULL && values->type == NODE_EXPRESSION_LIST) {
+            value = values->data.expression_list.expression;
+            values = values->data.expression_list.init;
+        } else
+            values = NULL;
+
+        struct node *identifier = fold_declare(context, name);
+
+        if (context->propagate && !identifier->data.identifier.is_assigned &&
+            node_is_literal(value))
+            identifier->data.identifier.constant = value;
+    }
+}
+
+/* fold_assignment_target() -- visits the target of an assignment, locals assigned here can not
+ * be propagated
+ *      args: context, variable node
+ *      returns: none
+ */
+static void fold_assignment_target(struct fold_context *context, struct node *variable)
+{
+    struct node *identifier = variable;
+
+    if (variable->type == NODE_NAME_REFERENCE)
+        identifier = variable->data.name_reference.identifier;
+
+    if (identifier->type != NODE_IDENTIFIER) {
+        /* Indexing: the table and key are read */
+        fold_traversal(context, identifier);
+        return;
+    }
+
+    struct node *declaration = fold_lookup(context, identifier);
+
+    if (declaration != NULL)
+        declaration->data.identifier.is_assigned = true;
+}
+
+/* fold_assignment() -- visits the values and targets of an assignment
+ *      args: context, assignment node
+ *      returns: none
+ */
+static void fold_assignment(struct fold_context *context, struct node *assignment)
+{
+    struct node *variables = assignment->data.assignment.variables;
+
+    fold_traversal(context, assignment->data.assignment.values);
+
+    while (variables != NULL && variables->type == NODE_VARIABLE_LIST) {
+        fold_assignment_target(context, variables->data.variable_list.variable);
+        variables = variables->data.variable_list.init;
+    }
+
+    if (variables != NULL)
+        fold_assignment_target(context, variables);
+}
+
+/* fold_reference() -- replaces the read of a constant local by its value
+ *      args: context, name reference node
+ *      returns: none
+ */
+static void fold_reference(struct fold_context *context, struct node *reference)
+{
+    struct node *identifier = reference->data.name_reference.identifier;
+
+    if (identifier->type != NODE_IDENTIFIER) {
+        fold_traversal(context, identifier);
+        return;
+    }
+
+    struct node *declaration = fold_lookup(context, identifier);
+
+    if (context->propagate && declaration != NULL && declaration->data.identifier.constant) {
+        node_replace(reference, declaration->data.identifier.constant);
+        context->propagated++;
+    }
+}
+
+/* fold_traversal() -- walks the AST keeping track of the locals in scope
+ *      args: context, node
+ *      returns: none
+ */
+static void fold_traversal(struct fold_context *context, struct node *node)
+{
+    if (!node)
+        return;
+
+    switch (node->type) {
+        case NODE_NAME_REFERENCE:
+            fold_reference(context, node);
+            break;
+        case NODE_EXPRESSION_INDEX:
+            fold_traversal(context, node->data.expression_index.expression);
+            fold_traversal(context, node->data.expression_index.index);
+            break;
+        case NODE_NAME_INDEX:
+            /* The index is a field name, not a variable */
+            fold_traversal(context, node->data.name_index.expression);
+            break;
+        case NODE_BINARY_OPERATION:
+            fold_traversal(context, node->data.binary_operation.left);
+            fold_traversal(context, node->data.binary_operation.right);
+
+            if (context->propagate && node_fold(node))
+                context->folded++;
+            break;
+        case NODE_UNARY_OPERATION:
+            fold_traversal(context, node->data.unary_operation.expression);
+
+            if (context->propagate && node_fold(node))
+                context->folded++;
+            break;
+        case NODE_EXPRESSION_GROUP:
+            fold_traversal(context, node->data.expression_group.expression);
+
+            /* A literal is a single value, so the parentheses do not change anything */
+            if (context->propagate && node_is_literal(node->data.expression_group.expression))
+                node_replace(node, node->data.expression_group.expression);
+            break;
+        case NODE_EXPRESSION_LIST:
+            fold_traversal(context, node->data.expression_list.expression);
+            fold_traversal(context, node->data.expression_list.init);
+            break;
+        case NODE_CALL:
+            fold_traversal(context, node->data.call.prefix_expression);
+            fold_traversal(context, node->data.call.args);
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+            fold_traversal(context, node->data.expression_statement.expression);
+            break;
+        case NODE_RETURN:
+            fold_traversal(context, node->data.return_statement.exprlist);
+            break;
+        case NODE_ARRAY_CONSTRUCTOR:
+            fold_traversal(context, node->data.array_constructor.exprlist);
+            break;
+        case NODE_TABLE_CONSTRUCTOR:
+            fold_traversal(context, node->data.table_constructor.pairlist);
+            break;
+        case NODE_KEY_VALUE_PAIR:
+            fold_traversal(context, node->data.key_value_pair.key);
+            fold_traversal(context, node->data.key_value_pair.value);
+            break;
+        case NODE_LOCAL:
+            fold_local(context, node);
+            break;
+        case NODE_ASSIGNMENT:
+            fold_assignment(context, node);
+            break;
+        case NODE_BLOCK:
+            fold_scope(context, node);
+            break;
+        case NODE_IF:
+            fold_traversal(context, node->data.if_statement.condition);
+            fold_scope(context, node->data.if_statement.body);
+            fold_scope(context, node->data.if_statement.else_body);
+            break;
+        case NODE_WHILELOOP:
+            fold_traversal(context, node->data.while_loop.condition);
+            fold_scope(context, node->data.while_loop.body);
+            break;
+        case NODE_REPEATLOOP: {
+            map_t parent = context->scope;
+
+            /* Locals of the body are visible in the condition */
+            context->scope = hashmap_scope(parent);
+            fold_statements(context, node->data.repeat_loop.body);
+            fold_traversal(context, node->data.repeat_loop.condition);
+
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_NUMERICFORLOOP: {
+            struct node *init = node->data.numerical_for_loop.init;
+            struct node *variable = init->data.assignment.variables;
+            map_t parent = context->scope;
+
+            fold_traversal(context, init->data.assignment.values);
+            fold_traversal(context, node->data.numerical_for_loop.target);
+            fold_traversal(context, node->data.numerical_for_loop.increment);
+
+            /* The control variable is written by the loop itself, when it names an existing
+             * local that one is assigned as well */
+            fold_assignment_target(context, variable);
+
+            context->scope = hashmap_scope(parent);
+            fold_declare(context, variable->type == NODE_NAME_REFERENCE
+                                      ? variable->data.name_reference.identifier
+                                      : variable);
+
+            fold_statements(context, node->data.numerical_for_loop.body);
+
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_GENERICFORLOOP: {
+            struct node *local = node->data.generic_for_loop.local;
+            map_t parent = context->scope;
+
+            fold_traversal(context, local->data.local.exprlist);
+
+            context->scope = hashmap_scope(parent);
+            fold_declare_list(context, local->data.local.namelist);
+            fold_statements(context, node->data.generic_for_loop.body);
+
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        case NODE_FUNCTION_BODY: {
+            map_t parent = context->scope;
+
+            context->scope = hashmap_scope(parent);
+            fold_declare_list(context, node->data.function_body.exprlist);
+            fold_statements(context, node->data.function_body.body);
+
+            hashmap_free(context->scope);
+            context->scope = parent;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* fold_ast() -- folds constant expressions and propagates constant locals through the tree
+ *      args: context, AST
+ *      returns: none
+ */
+void fold_ast(struct fold_context *context, struct node *tree)
+{
+    context->scope = hashmap_new();
+
+    /* Find the locals that are assigned after their declaration */
+    context->propagate = false;
+    fold_traversal(context, tree);
+
+    hashmap_free(context->scope);
+    context->scope = hashmap_new();
+
+    /* Propagate the others and fold whatever became constant */
+    context->propagate = true;
+    fold_traversal(context, tree);
+
+    hashmap_free(context->scope);
+    context->scope = NULL;
+}
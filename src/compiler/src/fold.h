@@ -0,0 +1,31 @@
+/*
+ *  fold.h
+ *
+ *  Constant folding runs on the typed AST, right before the symbol table is built. Operations on
+ *  literals are replaced by their result and locals that are initialized with a literal and never
+ *  assigned again are replaced by that literal wherever they are read, so `60 * 60 * 24` reaches
+ *  the IR as a single number. The pass walks the tree twice: the first walk finds every local that
+ *  is assigned after its declaration, the second one propagates and folds.
+ */
+
+#ifndef _FOLD_H
+#define _FOLD_H
+
+#include <stdbool.h>
+
+#include "util/hashmap.h"
+
+struct node;
+
+struct fold_context {
+    bool propagate; /* Only true during the second walk */
+    map_t scope;    /* Locals in scope, maps their name to the declaring identifier */
+
+    int folded;     /* Number of operations replaced by their result */
+    int propagated; /* Number of reads of a local replaced by its value */
+};
+
+void fold_init(struct fold_context *context);
+void fold_ast(struct fold_context *context, struct node *tree);
+
+#endif
@@ -1,115 +1,121 @@
+#include <assert.h>
 #include <math.h>
 #include <stdint.h>
 
+#include "feedback.h"
 #include "ir.h"
 #include "limits.h"
 #include "node.h"
 #include "symbol.h"
 #include "type.h"
+#include "util/arena.h"
 #include "util/flexstr.h"
 
-/* ir_section() -- create a new list of IR instructions
- *      args: first instruction of the list, last instruction of the list
+/* ir_section() -- create a new, empty list of IR instructions
+ *      args: none
  *      rets: the new list
  *
- * Note: An IR section is just a list of ir instructions. Each node in the AST has a section
- * associated with it if there are any instructions for that node. If there aren't, it will simply
- * be NULL.
+ * Note: An IR section stores the instructions of a function prototype in a contiguous array, the
+ * mode of every instruction is kept in a second array alongside it.
  */
-static struct ir_section *ir_section(struct ir_instruction *first, struct ir_instruction *last)
+static struct ir_section *ir_section()
 {
     struct ir_section *code;
-    code = smalloc(sizeof(struct ir_section));
-
-    code->first = first;
-    code->last = last;
-    code->size = 1;
+    code = amalloc(sizeof(struct ir_section));
+
+    code->code = NULL;
+    code->modes = NULL;
+    code->lines = NULL;
+    code->size = 0;
+    code->space = 0;
+    code->line = 0;
     return code;
 }
 
-/* ir_duplicate() -- duplicates an existing IR section
- *      args: original section
- *      rets: new section
+/* ir_reserve() -- makes sure a section has room for a number of additional instructions
+ *      args: section, number of instructions
+ *      rets: none
+ *
+ * Note: The arrays live in the arena, so growing them leaves the old copy behind until the arena is
+ * released. Doubling keeps that overhead below the final size of the section.
  */
-static struct ir_section *ir_duplicate(struct ir_section *original)
+static void ir_reserve(struct ir_section *section, int count)
 {
-    return ir_section(original->first, original->last);
-}
+    if (section->size + count <= section->space)
+        return;
 
-/* ir_join() -- joins two IR sections together to form a new IR section
- *      args: first section, second section
- *      rets: new section
- */
-static struct ir_section *ir_join(struct ir_section *first, struct ir_section *second)
-{
-    if (first == NULL)
-        return second;
+    int space = section->space > 0 ? section->space * 2 : IR_SECTION_SIZE;
+    while (section->size + count > space)
+        space *= 2;
+
+    uint32_t *code = amalloc(space * sizeof(uint32_t));
+    enum opcode_mode *modes = amalloc(space * sizeof(enum opcode_mode));
+    int *lines = amalloc(space * sizeof(int));
 
-    /* Link the sections together */
-    first->last->next = second->first;
-    second->first->prev = first->last;
+    if (section->size > 0) {
+        memcpy(code, section->code, section->size * sizeof(uint32_t));
+        memcpy(modes, section->modes, section->size * sizeof(enum opcode_mode));
+        memcpy(lines, section->lines, section->size * sizeof(int));
+    }
 
-    struct ir_section *section = ir_section(first->first, second->last);
-    section->size = first->size + second->size;
-    return section;
+    section->code = code;
+    section->modes = modes;
+    section->lines = lines;
+    section->space = space;
 }
 
 /* ir_append() -- appends an IR instruction onto an IR section
- *      args: first section, the instruction
- *      rets: new section
+ *      args: section, the instruction
+ *      rets: index of the instruction within the section
  */
-static struct ir_section *ir_append(struct ir_section *section, struct ir_instruction *instruction)
+static int ir_append(struct ir_section *section, struct ir_instruction instruction)
 {
-    /* section is empty */
-    if (section == NULL)
-        section = ir_section(instruction, instruction);
-    else if (section->first == NULL && section->last == NULL) {
-        section->first = instruction;
-        section->last = instruction;
-        section->size++;
-
-        instruction->prev = NULL;
-        instruction->next = NULL;
-    } else {
-        instruction->next = section->last->next;
-        if (instruction->next != NULL)
-            instruction->next->prev = instruction;
-        section->last->next = instruction;
-
-        instruction->prev = section->last;
-        section->last = instruction;
-        section->size++;
-    }
+    ir_reserve(section, 1);
 
-    return section;
+    section->code[section->size] = instruction.value;
+    section->modes[section->size] = instruction.mode;
+    section->lines[section->size] = section->line;
+    return section->size++;
 }
 
-/* ir_instruction() -- creates a new ir_instruction
- *      args: none
- *      rets: new ir instruction
+/* ir_remove() -- removes a range of instructions from the code of a proto
+ *      args: proto, index of the first instruction, number of instructions
+ *      rets: none
  */
-static struct ir_instruction *ir_instruction()
+void ir_remove(struct ir_proto *proto, int index, int count)
 {
-    struct ir_instruction *instruction = smalloc(sizeof(struct ir_instruction));
-
-    instruction->next = NULL;
-    instruction->prev = NULL;
-
-    return instruction;
+    struct ir_section *section = proto->code;
+    int tail = section->size - index - count;
+
+    memmove(&section->code[index], &section->code[index + count], tail * sizeof(uint32_t));
+    memmove(&section->modes[index], &section->modes[index + count],
+            tail * sizeof(enum opcode_mode));
+    memmove(&section->lines[index], &section->lines[index + count], tail * sizeof(int));
+    section->size -= count;
+
+    /* The scopes of the locals move along with the instructions */
+    for (int i = 0; i < proto->ranges_size; i++) {
+        struct ir_local_range *range = &proto->ranges[i];
+
+        if (range->start > index)
+            range->start = range->start - count > index ? range->start - count : index;
+        if (range->end > index)
+            range->end = range->end - count > index ? range->end - count : index;
+    }
 }
 
 /* ir_instruction_ABC() -- creates a new ir_instruction with a given operation code and registers
  *      args: operation code, a register, b register, and c register
  *      rets: new ir instruction
  */
-static struct ir_instruction *ir_instruction_ABC(enum opcode op, uint8_t a, uint8_t b, uint8_t c)
+struct ir_instruction ir_instruction_ABC(enum opcode op, uint8_t a, uint8_t b, uint8_t c)
 {
-    struct ir_instruction *instruction = ir_instruction();
+    struct ir_instruction instruction;
 
     /* Set IR instruction */
-    instruction->value = (uint32_t)op | (a << 8) | (b << 16) | (c << 24);
+    instruction.value = (uint32_t)op | (a << 8) | (b << 16) | (c << 24);
 
-    instruction->mode = iABC;
+    instruction.mode = iABC;
 
     return instruction;
 }
@@ -118,14 +124,14 @@ static struct ir_instruction *ir_instruction_ABC(enum opcode op, uint8_t a, uint
  *      args: operation code, a register, d register
  *      rets: new ir instruction
  */
-static struct ir_instruction *ir_instruction_AD(enum opcode op, uint8_t a, int16_t d)
+struct ir_instruction ir_instruction_AD(enum opcode op, uint8_t a, int16_t d)
 {
-    struct ir_instruction *instruction = ir_instruction();
+    struct ir_instruction instruction;
 
     /* Set IR operands */
-    instruction->value = (uint32_t)op | (a << 8) | ((uint16_t)d << 16);
+    instruction.value = (uint32_t)op | (a << 8) | ((uint16_t)d << 16);
 
-    instruction->mode = iAD;
+    instruction.mode = iAD;
 
     return instruction;
 }
@@ -134,14 +140,14 @@ static struct ir_instruction *ir_instruction_AD(enum opcode op, uint8_t a, int16
  *      args: operation code, a register, du register
  *      rets: new ir instruction
  */
-static struct ir_instruction *ir_instruction_ADu(enum opcode op, uint8_t a, uint16_t du)
+struct ir_instruction ir_instruction_ADu(enum opcode op, uint8_t a, uint16_t du)
 {
-    struct ir_instruction *instruction = ir_instruction();
+    struct ir_instruction instruction;
 
     /* Set IR operands */
-    instruction->value = (uint32_t)op | (a << 8) | ((int16_t)du << 16);
+    instruction.value = (uint32_t)op | (a << 8) | ((int16_t)du << 16);
 
-    instruction->mode = iADu;
+    instruction.mode = iADu;
 
     return instruction;
 }
@@ -150,14 +156,14 @@ static struct ir_instruction *ir_instruction_ADu(enum opcode op, uint8_t a, uint
  *      args: operation code, e register
  *      rets: new ir instruction
  */
-static struct ir_instruction *ir_instruction_E(enum opcode op, int32_t e)
+static struct ir_instruction ir_instruction_E(enum opcode op, int32_t e)
 {
-    struct ir_instruction *instruction = ir_instruction();
+    struct ir_instruction instruction;
 
     /* Set IR operands */
-    instruction->value = (uint32_t)op | ((uint32_t)e << 8);
+    instruction.value = (uint32_t)op | ((uint32_t)e << 8);
 
-    instruction->mode = iE;
+    instruction.mode = iE;
 
     return instruction;
 }
@@ -166,14 +172,14 @@ static struct ir_instruction *ir_instruction_E(enum opcode op, int32_t e)
  *      args: value
  *      rets: new ir instruction
  */
-static struct ir_instruction *ir_instruction_sub(unsigned int value)
+static struct ir_instruction ir_instruction_sub(unsigned int value)
 {
-    struct ir_instruction *instruction = ir_instruction();
+    struct ir_instruction instruction;
 
     /* Set IR operands */
-    instruction->value = value;
+    instruction.value = value;
 
-    instruction->mode = SUB;
+    instruction.mode = SUB;
 
     return instruction;
 }
@@ -225,11 +231,17 @@ static void ir_free_register(struct ir_context *context, struct ir_proto *proto,
 static struct ir_constant_list *ir_constant_list(struct ir_constant *first,
                                                  struct ir_constant *last)
 {
-    struct ir_constant_list *list = smalloc(sizeof(struct ir_constant_list));
+    struct ir_constant_list *list = amalloc(sizeof(struct ir_constant_list));
 
     /* Set members */
     list->first = first;
     list->last = last;
+    list->size = 0;
+
+    /* The hash index is created on the first insertion */
+    list->slots = NULL;
+    list->count = 0;
+    list->capacity = 0;
 
     return list;
 }
@@ -265,7 +277,7 @@ static void ir_constant_list_add(struct ir_constant_list *list, struct ir_consta
  */
 static struct ir_constant *ir_constant(constant_t type)
 {
-    struct ir_constant *c = smalloc(sizeof(struct ir_constant));
+    struct ir_constant *c = amalloc(sizeof(struct ir_constant));
 
     c->type = type;
 
@@ -275,44 +287,107 @@ static struct ir_constant *ir_constant(constant_t type)
     return c;
 }
 
-static unsigned int ir_find_symbol_constant(struct ir_constant_list *list, struct symbol *symbol,
-                                            constant_t type)
+/* ir_constant_hash() -- hashes the key of a constant
+ *      args: type of constant, key (symbol id, string constant index or bits of a number)
+ *      rets: hash
+ */
+static uint32_t ir_constant_hash(constant_t type, uint64_t key)
 {
-    int index = 0;
+    /* 64-bit finalizer from MurmurHash3 */
+    key ^= (uint64_t)type << 56;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
 
-    for (struct ir_constant *iter = list->first; iter != NULL; iter = iter->next) {
-        if (iter->type == type && iter->data.symbol.symbol_id == symbol->id)
-            return index;
-        ++index;
-    }
+    return (uint32_t)key;
+}
 
-    return -1;
+/* ir_constant_lookup() -- finds a constant in the hash index of a constant list
+ *      args: list of constants, type of constant, key
+ *      rets: index in the constant list or -1 if the constant does not exist yet
+ */
+static int32_t ir_constant_lookup(struct ir_constant_list *list, constant_t type, uint64_t key)
+{
+    if (list->capacity == 0)
+        return -1;
+
+    uint32_t mask = list->capacity - 1;
+    for (uint32_t i = ir_constant_hash(type, key) & mask;; i = (i + 1) & mask) {
+        struct ir_constant_slot *slot = &list->slots[i];
+
+        if (slot->index < 0)
+            return -1;
+        if (slot->type == type && slot->key == key)
+            return slot->index;
+    }
 }
 
-static unsigned int ir_find_number_constant(struct ir_constant_list *list, double number)
+/* ir_constant_index() -- adds a constant to the hash index of a constant list
+ *      args: list of constants, type of constant, key, index in the constant list
+ *      rets: none
+ *
+ * Note: The index is kept at most half full, it doubles in size whenever it reaches that.
+ */
+static void ir_constant_index(struct ir_constant_list *list, constant_t type, uint64_t key,
+                              int32_t index)
 {
-    int index = 0;
+    if ((list->count + 1) * 2 > list->capacity) {
+        struct ir_constant_slot *old = list->slots;
+        int old_capacity = list->capacity;
+
+        list->capacity = old_capacity > 0 ? old_capacity * 2 : IR_CONSTANT_INDEX_SIZE;
+        list->slots = amalloc(list->capacity * sizeof(struct ir_constant_slot));
+        list->count = 0;
 
-    for (struct ir_constant *iter = list->first; iter != NULL; iter = iter->next) {
-        if (iter->type == CONSTANT_NUMBER && iter->data.number.value == number)
-            return index;
-        ++index;
+        for (int i = 0; i < list->capacity; i++)
+            list->slots[i].index = -1;
+
+        /* Re-insert the existing entries */
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i].index >= 0)
+                ir_constant_index(list, old[i].type, old[i].key, old[i].index);
     }
 
-    return -1;
+    uint32_t mask = list->capacity - 1;
+    uint32_t i = ir_constant_hash(type, key) & mask;
+
+    while (list->slots[i].index >= 0)
+        i = (i + 1) & mask;
+
+    list->slots[i].type = type;
+    list->slots[i].key = key;
+    list->slots[i].index = index;
+    list->count++;
 }
 
-static unsigned int ir_find_env_constant(struct ir_constant_list *list, unsigned int id)
+/* ir_number_key() -- converts a number into the key used by the constant index
+ *      args: number
+ *      rets: key
+ *
+ * Note: The bits are compared, so 0 and -0 stay separate constants.
+ */
+static uint64_t ir_number_key(double number)
 {
-    int index = 0;
+    uint64_t key;
+    memcpy(&key, &number, sizeof(key));
 
-    for (struct ir_constant *iter = list->first; iter != NULL; iter = iter->next) {
-        if (iter->type == CONSTANT_ENVIRONMENT && iter->data.env.index == index)
-            return index;
-        ++index;
-    }
+    return key;
+}
 
-    return -1;
+static unsigned int ir_find_symbol_constant(struct ir_constant_list *list, struct symbol *symbol,
+                                            constant_t type)
+{
+    return ir_constant_lookup(list, type, symbol->id);
+}
+
+static unsigned int ir_find_number_constant(struct ir_constant_list *list, double number)
+{
+    return ir_constant_lookup(list, CONSTANT_NUMBER, ir_number_key(number));
+}
+
+static unsigned int ir_find_env_constant(struct ir_constant_list *list, unsigned int id)
+{
+    return ir_constant_lookup(list, CONSTANT_ENVIRONMENT, id);
 }
 
 /* ir_constant_symbol() -- allocate memory for a new constant using the symbol value
@@ -330,6 +405,7 @@ static unsigned int ir_constant_symbol(struct ir_proto *proto, struct symbol *sy
         c->data.symbol.symbol_id = symbol->id;
 
         ir_constant_list_add(proto->constant_list, c);
+        ir_constant_index(proto->constant_list, type, symbol->id, proto->constant_list->size);
 
         return proto->constant_list->size++;
     } else
@@ -349,7 +425,7 @@ static unsigned int ir_constant_string(struct ir_proto *proto, struct symbol *sy
  *      args: number value
  *      rets: constant
  */
-static unsigned int ir_constant_number(struct ir_proto *proto, double value)
+unsigned int ir_constant_number(struct ir_proto *proto, double value)
 {
     unsigned int index;
     if ((index = ir_find_number_constant(proto->constant_list, value)) == -1) {
@@ -358,6 +434,8 @@ static unsigned int ir_constant_number(struct ir_proto *proto, double value)
 
         c->data.number.value = value;
         ir_constant_list_add(proto->constant_list, c);
+        ir_constant_index(proto->constant_list, CONSTANT_NUMBER, ir_number_key(value),
+                          proto->constant_list->size);
 
         return proto->constant_list->size++;
     } else
@@ -380,6 +458,8 @@ static unsigned int ir_constant_env(struct ir_proto *proto, struct symbol *symbo
         c->data.env.index = id;
 
         ir_constant_list_add(proto->constant_list, c);
+        ir_constant_index(proto->constant_list, CONSTANT_ENVIRONMENT, id,
+                          proto->constant_list->size);
 
         return proto->constant_list->size++;
     } else
@@ -394,18 +474,18 @@ static int32_t ir_get_constant_number(struct ir_proto *proto, struct node *node)
     return ir_constant_number(proto, node->data.number.value);
 }
 
-/* ir_constant_number() -- allocate memory for a new function prototype list
+/* ir_proto_list() -- allocate memory for a new function prototype list
  *      args: first proto, last proto
  *      rets: new list
  */
 static struct ir_proto_list *ir_proto_list(struct ir_proto *first, struct ir_proto *last)
 {
-    struct ir_proto_list *list = smalloc(sizeof(struct ir_proto_list));
+    struct ir_proto_list *list = amalloc(sizeof(struct ir_proto_list));
 
     list->first = first;
     list->last = last;
 
-    list->size = 1;
+    list->size = first != NULL;
 
     return list;
 }
@@ -416,19 +496,44 @@ static struct ir_proto_list *ir_proto_list(struct ir_proto *first, struct ir_pro
  */
 static struct ir_proto *ir_proto()
 {
-    struct ir_proto *p = smalloc(sizeof(struct ir_proto));
+    struct ir_proto *p = amalloc(sizeof(struct ir_proto));
 
     p->constant_list = ir_constant_list(NULL, NULL);
+    p->code = ir_section();
     p->is_vararg = false;
     p->max_stack_size = 0;
     p->parameters_size = 0;
     p->top_register = 0;
     p->upvalues_size = 0;
+    p->line_defined = 0;
+    p->last_line_defined = 0;
+    p->heat = 0;
+
+    p->locals = NULL;
+    p->captured = NULL;
+    p->builders = NULL;
+    p->functions = NULL;
+    p->locals_size = 0;
+    p->locals_space = 0;
+    p->pending_local = -1;
+    p->ranges = NULL;
+    p->ranges_size = 0;
+    p->ranges_space = 0;
+    p->bindings = NULL;
+    p->bindings_size = 0;
+    p->loop = NULL;
+    p->label = 0;
+
+    p->parent = NULL;
+    p->upvalues = NULL;
+    p->upvalues_space = 0;
 
     p->protos = ir_proto_list(NULL, NULL);
 
     p->prev = NULL;
     p->next = NULL;
+
+    return p;
 }
 
 /* ir_proto_append() -- appends a new function prototype to the proto list
@@ -458,44 +563,92 @@ static struct ir_proto_list *ir_proto_append(struct ir_proto_list *list, struct
     return list;
 }
 
-static enum opcode get_arith_opcode(enum node_binary_operation op, bool is_k)
+/* get_arith_opcode() -- determines the operation code of an arithmetic binary operation
+ *      args: binary operation, constant operand flag, numeric operands flag
+ *      rets: operation code
+ *
+ * Note: When the type checker proved every operand to be a number the specialized variant is
+ * returned. They follow the exact same order as their generic counterparts.
+ */
+static enum opcode get_arith_opcode(enum node_binary_operation op, bool is_k, bool is_number)
 {
+    enum opcode code = 0;
+
     switch (op) {
         case BINOP_ADD:
-            return is_k ? OP_ADDK : OP_ADD;
+            code = is_k ? OP_ADDK : OP_ADD;
+            break;
         case BINOP_SUB:
-            return is_k ? OP_SUBK : OP_SUB;
+            code = is_k ? OP_SUBK : OP_SUB;
+            break;
         case BINOP_MUL:
-            return is_k ? OP_MULK : OP_MUL;
+            code = is_k ? OP_MULK : OP_MUL;
+            break;
         case BINOP_DIV:
-            return is_k ? OP_DIVK : OP_DIV;
+            code = is_k ? OP_DIVK : OP_DIV;
+            break;
         case BINOP_POW:
-            return is_k ? OP_POWK : OP_POW;
+            code = is_k ? OP_POWK : OP_POW;
+            break;
         case BINOP_MOD:
-            return is_k ? OP_MODK : OP_MOD;
+            code = is_k ? OP_MODK : OP_MOD;
+            break;
+        default:
+            return 0;
     }
 
-    return 0;
+    if (is_number)
+        code += is_k ? OP_ADDNK - OP_ADDK : OP_ADDNN - OP_ADD;
+
+    return code;
+}
+
+/* ir_is_number() -- determines whether the type checker proved an expression to be a number
+ *      args: expression node
+ *      rets: yes or no
+ */
+static bool ir_is_number(struct node *node)
+{
+    return node->node_type != NULL && type_is_number(node->node_type);
+}
+
+/* ir_is_string() -- determines whether the type checker proved an expression to be a string
+ *      args: expression node
+ *      rets: yes or no
+ */
+static bool ir_is_string(struct node *node)
+{
+    return node->node_type != NULL && type_is_primitive(node->node_type, TYPE_BASIC_STRING);
 }
 
-/* ir_join() -- joins two IR proto lists together to shape a new list of protos
- *      args: first proto, second proto
- *      rets: new proto list
+/* ir_array_kind() -- determines whether the type checker proved an expression to be a typed array,
+ * an Array<number> (or Array<integer>) or an Array<boolean> has its elements stored unboxed by the
+ * VM
+ *      args: expression node
+ *      rets: NEWARRAY_NUMBER, NEWARRAY_BOOLEAN or -1 for anything else
  */
-static struct ir_proto_list *ir_proto_join(struct ir_proto_list *first,
-                                           struct ir_proto_list *second)
+static int ir_array_kind(struct node *node)
 {
-    if (first == NULL)
-        return second;
+    struct type *type = node->node_type;
+
+    if (type == NULL || type->kind != TYPE_ARRAY)
+        return -1;
 
-    /* Link the sections together */
-    first->last->next = second->first;
-    second->first->prev = first->last;
+    if (type_is_number(type->data.array.type))
+        return NEWARRAY_NUMBER;
+    if (type_is_primitive(type->data.array.type, TYPE_BASIC_BOOLEAN))
+        return NEWARRAY_BOOLEAN;
 
-    struct ir_proto_list *proto_list = ir_proto_list(first->first, second->last);
-    proto_list->size = first->size + second->size;
+    return -1;
+}
 
-    return proto_list;
+/* ir_is_table() -- determines whether the type checker proved an expression to be a table
+ *      args: expression node
+ *      rets: yes or no
+ */
+static bool ir_is_table(struct node *node)
+{
+    return node->node_type != NULL && node->node_type->kind == TYPE_TABLE;
 }
 
 /* ir_init() -- initializes the member variables of the IR context
@@ -504,298 +657,2322 @@ static struct ir_proto_list *ir_proto_join(struct ir_proto_list *first,
  */
 void ir_init(struct ir_context *context) { context->main_proto = ir_proto(); }
 
-struct ir_proto *ir_build_proto(struct ir_context *context, struct ir_proto *proto,
-                                struct node *node)
+/* ir_local() -- declares a local variable in the next register of a proto
+ *      args: ir context, ir proto, symbol of the local
+ *      rets: register of the local
+ *
+ * Note: Locals always live at the bottom of the register stack, so the register of a local is its
+ * index in the locals list and a new local takes the register at the top of the stack.
+ */
+static uint8_t ir_local(struct ir_context *context, struct ir_proto *proto, struct symbol *symbol)
 {
-    if (!node)
-        return NULL;
-
-    switch (node->type) {
-        case NODE_EXPRESSION_STATEMENT: {
-            ir_build_proto(context, proto, node->data.expression_statement.expression);
-            break;
+    if (proto->locals_size == proto->locals_space) {
+        int space = proto->locals_space > 0 ? proto->locals_space * 2 : IR_LOCALS_SIZE;
+        struct symbol **locals = amalloc(space * sizeof(struct symbol *));
+        bool *captured = amalloc(space * sizeof(bool));
+        uint8_t *builders = amalloc(space * sizeof(uint8_t));
+        struct node **functions = amalloc(space * sizeof(struct node *));
+
+        if (proto->locals_size > 0) {
+            memcpy(locals, proto->locals, proto->locals_size * sizeof(struct symbol *));
+            memcpy(captured, proto->captured, proto->locals_size * sizeof(bool));
+            memcpy(builders, proto->builders, proto->locals_size * sizeof(uint8_t));
+            memcpy(functions, proto->functions, proto->locals_size * sizeof(struct node *));
         }
-        case NODE_CALL: {
-            struct ir_instruction *instruction;
-            struct node *function = node->data.call.prefix_expression;
-            struct node *args = node->data.call.args;
 
-            int size = 0;
+        proto->locals = locals;
+        proto->captured = captured;
+        proto->builders = builders;
+        proto->functions = functions;
+        proto->locals_space = space;
+    }
 
-            /* Set the size of the args list */
-            if (args)
-                if (args->type != NODE_EXPRESSION_LIST)
-                    size = 1;
-                else
-                    size = args->data.expression_list.size;
+    if (proto->ranges_size == proto->ranges_space) {
+        int space = proto->ranges_space > 0 ? proto->ranges_space * 2 : IR_LOCALS_SIZE;
+        struct ir_local_range *ranges = amalloc(space * sizeof(struct ir_local_range));
 
-            /* Save the old register for later use */
-            int old = proto->top_register;
+        if (proto->ranges_size > 0)
+            memcpy(ranges, proto->ranges, proto->ranges_size * sizeof(struct ir_local_range));
 
-            ir_build_proto(context, proto, function);
-            ir_build_proto(context, proto, args);
+        proto->ranges = ranges;
+        proto->ranges_space = space;
+    }
 
-            instruction = ir_instruction_ABC(OP_CALL, old, size + 1, 1);
+    proto->ranges[proto->ranges_size++] = (struct ir_local_range){symbol, proto->code->size, -1};
 
-            ir_free_register(context, proto, size + 1);
+    proto->locals[proto->locals_size] = symbol;
+    proto->captured[proto->locals_size] = false;
+    proto->builders[proto->locals_size] = 0;
+    proto->functions[proto->locals_size] = NULL;
+    return proto->locals_size++;
+}
 
-            ir_append(proto->code, instruction);
-            break;
-        }
-        case NODE_BINARY_OPERATION: {
-            /* ir build proto will alloc */
-            uint8_t target = proto->top_register;
+/* ir_close_locals() -- ends the scope of the innermost locals of a proto
+ *      args: ir proto, number of locals left in scope
+ *      rets: none
+ */
+static void ir_close_locals(struct ir_proto *proto, int locals)
+{
+    int count = proto->locals_size - locals;
 
-            /* Determine operation code for binary operation */
-            switch (node->data.binary_operation.operation) {
-                case BINOP_ADD:
-                case BINOP_SUB:
-                case BINOP_MUL:
-                case BINOP_DIV:
-                case BINOP_POW:
-                case BINOP_MOD: {
-                    const int32_t constant =
-                        ir_get_constant_number(proto, node->data.binary_operation.right);
-
-                    if (constant >= 0 && constant <= 255) {
-                        enum opcode code =
-                            get_arith_opcode(node->data.binary_operation.operation, true);
-
-                        ir_build_proto(context, proto, node->data.binary_operation.left);
-
-                        struct ir_instruction *instruction =
-                            ir_instruction_ABC(code, target, target, constant);
-
-                        ir_append(proto->code, instruction);
-                    } else {
-                        enum opcode code =
-                            get_arith_opcode(node->data.binary_operation.operation, false);
-
-                        ir_build_proto(context, proto, node->data.binary_operation.left);
-                        ir_build_proto(context, proto, node->data.binary_operation.right);
-
-                        struct ir_instruction *instruction =
-                            ir_instruction_ABC(code, target, target, target + 1);
-
-                        /* Pop the two expressions off the stack */
-                        ir_free_register(context, proto, 1);
-
-                        ir_append(proto->code, instruction);
-                    }
-                    break;
-                }
-                case BINOP_CONCAT: {
-                    ir_build_proto(context, proto, node->data.binary_operation.left);
-                    ir_build_proto(context, proto, node->data.binary_operation.right);
-
-                    /* top_register contains the next availible register so -1 to get previous */
-                    const uint8_t end = proto->top_register - 1;
-
-                    struct ir_instruction *instruction =
-                        ir_instruction_ABC(OP_CONCAT, target, target, end);
-
-                    /* Pop all experssions from the stack */
-                    ir_free_register(context, proto, end - target);
-
-                    ir_append(proto->code, instruction);
-                    break;
-                }
-                default:
-                    break;
-            }
-            break;
+    /* Scopes nest, so the locals still in scope are the last ranges without an end */
+    for (int i = proto->ranges_size - 1; i >= 0 && count > 0; i--) {
+        if (proto->ranges[i].end < 0) {
+            proto->ranges[i].end = proto->code->size;
+            count--;
         }
-        case NODE_STRING: {
-            struct ir_instruction *instruction;
-            unsigned int index = ir_constant_string(proto, node->data.string.s);
+    }
 
-            instruction =
-                ir_instruction_AD(OP_LOADK, ir_allocate_register(context, proto, 1), index);
+    proto->locals_size = locals;
+}
 
-            ir_append(proto->code, instruction);
-            break;
-        }
-        case NODE_NAME_REFERENCE: {
-            ir_build_proto(context, proto, node->data.name_reference.identifier);
-            break;
-        }
-        case NODE_NUMBER: {
-            struct ir_instruction *instruction, *sub;
+/* ir_is_captured() -- determines whether a closure captured one of the innermost locals of a
+ * proto by reference
+ *      args: ir proto, first local
+ *      rets: yes or no
+ */
+static bool ir_is_captured(struct ir_proto *proto, int first)
+{
+    for (int i = first; i < proto->locals_size; i++)
+        if (proto->captured[i])
+            return true;
 
-            if (node->data.number.value <= USHRT_MAX && node->data.number.value >= -USHRT_MAX &&
-                floor(node->data.number.value) == node->data.number.value) {
-                /* Determine whether we have a negative or positive value */
-                const bool is_positive = node->data.number.value >= 0;
+    return false;
+}
 
-                /* We have a whole number that is large enough to fit in the Du operand */
-                instruction = ir_instruction_ADu(is_positive ? OP_LOADPN : OP_LOADNN,
-                                                 ir_allocate_register(context, proto, 1),
-                                                 node->data.number.value);
-                ir_append(proto->code, instruction);
-                break;
-            }
+/* ir_close_captured() -- closes the upvalues of the innermost locals of a proto, if there are
+ * any, before their registers are reused
+ *      args: ir proto, first local
+ *      rets: none
+ */
+static void ir_close_captured(struct ir_proto *proto, int first)
+{
+    if (ir_is_captured(proto, first))
+        ir_append(proto->code, ir_instruction_ABC(OP_CLOSE, first, 0, 0));
+}
 
-            uint32_t index = ir_constant_number(proto, node->data.number.value);
-            /* Each Lua++ instruction (like Lua) must strictly be 32-bits in size, so we need to
-             * account for extremely large programs with massive constant pools */
-            if (index <= UINT16_MAX) {
-                instruction =
-                    ir_instruction_AD(OP_LOADK, ir_allocate_register(context, proto, 1), index);
+/* ir_find_local() -- finds the register of a local variable
+ *      args: ir proto, identifier node
+ *      rets: register or -1 if the identifier is not a local of this proto
+ */
+static int ir_find_local(struct ir_proto *proto, struct node *identifier)
+{
+    if (identifier->type != NODE_IDENTIFIER || identifier->data.identifier.is_global)
+        return -1;
 
-                ir_append(proto->code, instruction);
-                break;
-            } else {
-                /* Here we use a sub instruction. An operation less instruction that simply stores a
-                 * singular value */
-                instruction =
-                    ir_instruction_AD(OP_LOADKX, ir_allocate_register(context, proto, 1), 0);
-                sub = ir_instruction_sub(index);
+    /* The parameters of an inlined call are not locals, but they are read like them */
+    for (int i = proto->bindings_size - 1; i >= 0; i--)
+        if (proto->bindings[i].symbol == identifier->data.identifier.s)
+            return proto->bindings[i].reg;
 
-                ir_append(proto->code, instruction);
-                ir_append(proto->code, sub);
-                break;
-            }
-        }
-        case NODE_BOOLEAN: {
-            struct ir_instruction *instruction = ir_instruction_ABC(OP_LOADBOOL, ir_allocate_register(context, proto, 1), 
-                                                                    node->data.boolean.value, 0);
-            
-            ir_append(proto->code, instruction);
-            break;
-        }
-        case NODE_IDENTIFIER: {
-            struct ir_instruction *instruction;
+    /* Search backwards so the innermost declaration wins */
+    for (int i = proto->locals_size - 1; i >= 0; i--)
+        if (proto->locals[i] == identifier->data.identifier.s)
+            return i;
 
-            if (node->data.identifier.is_global) {
-                unsigned int index = ir_constant_env(proto, node->data.identifier.s);
+    return -1;
+}
 
-                instruction =
-                    ir_instruction_AD(OP_GETENV, ir_allocate_register(context, proto, 1), index);
-            }
+/* ir_find_upvalue() -- finds the upvalue of a proto an identifier refers to, the locals and
+ * upvalues of the enclosing protos become new upvalues on their first use
+ *      args: ir context, ir proto, identifier node
+ *      rets: index of the upvalue or -1 if the identifier is not a local of any enclosing proto
+ *
+ * Note: A local that no assignment writes to keeps the value it was declared with, so closures copy
+ * it (CAPTURE_VALUE) instead of sharing an open upvalue that would have to be closed.
+ */
+static int ir_find_upvalue(struct ir_context *context, struct ir_proto *proto,
+                           struct node *identifier)
+{
+    if (identifier->type != NODE_IDENTIFIER || identifier->data.identifier.is_global ||
+        proto->parent == NULL)
+        return -1;
 
-            ir_append(proto->code, instruction);
-            break;
-        }
-        case NODE_BLOCK: {
-            struct ir_instruction *vararg_instr, *return_instr;
-            struct node *init = node->data.block.init;
-            struct node *statement = node->data.block.statement;
+    struct symbol *symbol = identifier->data.identifier.s;
 
-            if (statement == NULL)
-                ir_build_proto(context, proto, init);
-            else {
-                ir_build_proto(context, proto, init);
-                ir_build_proto(context, proto, statement);
-            }
-            break;
-        }
-        case NODE_FUNCTION_BODY: {
-            struct node *params = node->data.function_body.exprlist;
-            struct node *namelist = params->data.parameter_list.namelist;
+    for (int i = 0; i < proto->upvalues_size; i++)
+        if (proto->upvalues[i].symbol == symbol)
+            return i;
+
+    struct ir_proto *parent = proto->parent;
+    struct ir_upvalue upvalue = {symbol, CAPTURE_UPVALUE, 0};
+    int index = ir_find_local(parent, identifier);
+
+    if (index >= 0) {
+        /* A local function refers to itself before the closure is stored into its local, the
+         * statements after a streamed one are not known yet */
+        bool shared = symbol->is_assigned || index == parent->pending_local ||
+                      (context->stream && parent->parent == NULL);
+
+        upvalue.kind = shared ? CAPTURE_REFERENCE : CAPTURE_VALUE;
+        parent->captured[index] |= shared;
+    } else if ((index = ir_find_upvalue(context, parent, identifier)) < 0)
+        return -1;
+
+    if (proto->upvalues_size == UCHAR_MAX) {
+        unhandled_compiler_error("function has more than %d upvalues", UCHAR_MAX);
+        context->error_count++;
+        return -1;
+    }
+
+    if (proto->upvalues_size == proto->upvalues_space) {
+        int space = proto->upvalues_space > 0 ? proto->upvalues_space * 2 : IR_LOCALS_SIZE;
+        struct ir_upvalue *upvalues = amalloc(space * sizeof(struct ir_upvalue));
+
+        if (proto->upvalues_size > 0)
+            memcpy(upvalues, proto->upvalues, proto->upvalues_size * sizeof(struct ir_upvalue));
+
+        proto->upvalues = upvalues;
+        proto->upvalues_space = space;
+    }
+
+    upvalue.index = index;
+    proto->upvalues[proto->upvalues_size] = upvalue;
+    return proto->upvalues_size++;
+}
+
+/* ir_reference_local() -- finds the register of the local an expression refers to
+ *      args: ir proto, expression node
+ *      rets: register or -1 if the expression is something else
+ */
+static int ir_reference_local(struct ir_proto *proto, struct node *node)
+{
+    if (node->type == NODE_NAME_REFERENCE)
+        node = node->data.name_reference.identifier;
+
+    return ir_find_local(proto, node);
+}
+
+/* ir_reference_upvalue() -- finds the upvalue an expression refers to
+ *      args: ir context, ir proto, expression node
+ *      rets: index of the upvalue or -1 if the expression is something else
+ */
+static int ir_reference_upvalue(struct ir_context *context, struct ir_proto *proto,
+                                struct node *node)
+{
+    if (node->type == NODE_NAME_REFERENCE)
+        node = node->data.name_reference.identifier;
+
+    return ir_find_upvalue(context, proto, node);
+}
 
-            struct ir_proto *p = ir_proto();
-            p->is_vararg = params->data.parameter_list.vararg != NULL;
-            p->parameters_size = namelist->data.name_list.size;
+/* ir_reference_global() -- finds the environment constant of a global an expression refers to
+ *      args: ir proto, expression node (neither a local nor an upvalue)
+ *      rets: index of the constant or -1 if the expression is not a name
+ */
+static int ir_reference_global(struct ir_proto *proto, struct node *node)
+{
+    if (node->type == NODE_NAME_REFERENCE)
+        node = node->data.name_reference.identifier;
+
+    if (node->type != NODE_IDENTIFIER)
+        return -1;
 
-            struct ir_instruction *arg_instr = ir_instruction_ABC(
-                OP_VARARGPREP, (namelist != NULL ? namelist->data.name_list.size : 0), 0, 0);
+    return ir_constant_env(proto, node->data.identifier.s);
+}
 
-            struct ir_section *section = ir_section(arg_instr, arg_instr);
+/* ir_build_operand() -- builds an operand of an instruction, locals are used in place
+ *      args: ir context, ir proto, expression node
+ *      rets: register holding the operand
+ */
+static uint8_t ir_build_operand(struct ir_context *context, struct ir_proto *proto,
+                                struct node *node)
+{
+    int local = ir_reference_local(proto, node);
 
-            ir_build_proto(context, proto, node->data.function_body.body);
+    if (local >= 0)
+        return local;
 
-            struct ir_instruction *return_instr = ir_instruction_ABC(OP_RETURN, 0, 1, 0);
-            ir_append(proto->code, return_instr);
+    /* Everything else is evaluated into a temporary at the top of the stack */
+    uint8_t target = proto->top_register;
+    ir_build_proto(context, proto, node);
 
-            ir_proto_append(proto->protos, p);
+    return target;
+}
 
-            struct ir_instruction *closure = ir_instruction_AD(
-                OP_CLOSURE, ir_allocate_register(context, proto, 1), proto->protos->size - 1);
-            ir_append(proto->code, closure);
+/* ir_retarget() -- makes the last instruction of a proto write into another register
+ *      args: ir proto, register the instruction writes to, register it should write to
+ *      rets: whether the instruction could be changed, if not the caller has to emit a move
+ */
+static bool ir_retarget(struct ir_proto *proto, uint8_t from, uint8_t to)
+{
+    int last = proto->code->size - 1;
+
+    /* LOADKX is followed by its sub instruction */
+    if (last > 0 && proto->code->modes[last] == SUB)
+        last--;
+
+    /* An instruction before a label is not the only one that may run before the next one */
+    if (last < 0 || last < proto->label)
+        return false;
+
+    uint32_t *value = &proto->code->code[last];
+
+    switch (GET_OPCODE(*value)) {
+        case OP_MOVE:
+        case OP_LOADPN:
+        case OP_LOADNN:
+        case OP_LOADK:
+        case OP_LOADKX:
+        case OP_LOADBOOL:
+        case OP_GETENV:
+        case OP_GETUPVAL:
+        case OP_CONCAT:
+        case OP_GETARRAY:
+        case OP_GETARRAYI:
+        case OP_GETTABLE:
+        case OP_GETINDEX:
+        case OP_GETFIELD:
+        case OP_ADD ... OP_MODK:
+        case OP_UNM ... OP_LEN:
+        case OP_ADDNN ... OP_POWNK:
             break;
-        }
-        case NODE_EXPRESSION_LIST: {
-            struct node *init = node->data.expression_list.init;
-            struct node *expression = node->data.expression_list.expression;
+        case OP_LOADNIL:
+            /* Only single register loads can be moved */
+            if (GETARG_B(*value) != from)
+                return false;
 
-            if (expression == NULL)
-                ir_build_proto(context, proto, init);
-            else {
-                ir_build_proto(context, proto, init);
-                ir_build_proto(context, proto, expression);
-            }
+            SETARG_B(*value, to);
             break;
-        }
+        default:
+            return false;
     }
+
+    if (GETARG_A(*value) != from)
+        return false;
+
+    SETARG_A(*value, to);
+    return true;
 }
 
-/* ir_build() -- will build a new IR proto based on an AST
- *      args: context, AST node
- *      rets: new ir section
+/* ir_list_size() -- counts the expressions of an expression list
+ *      args: expression (list) node, NULL for an empty list
+ *      rets: number of expressions
  */
-struct ir_proto *ir_build(struct ir_context *context, struct node *node)
+static int ir_list_size(struct node *node)
 {
-    struct ir_proto *proto = ir_proto();
-
-    /* Mark this function as a vararg function */
-    proto->is_vararg = true;
-
-    /* Build the initial argument preparation instruction */
-    struct ir_instruction *instruction = ir_instruction_ABC(OP_VARARGPREP, 0, 0, 0);
-    proto->code = ir_append(proto->code, instruction);
+    if (node == NULL)
+        return 0;
 
-    /* Build the content of the main block */
-    ir_build_proto(context, proto, node->data.function_body.body);
+    return node->type == NODE_EXPRESSION_LIST ? node->data.expression_list.size : 1;
+}
 
-    /* Build the function exit instruction (return) */
-    instruction = ir_instruction_ABC(OP_RETURN, 0, 1, 0);
-    proto->code = ir_append(proto->code, instruction);
+/* ir_list_open() -- determines whether the last expression of a list gives all of its values, a
+ * call or `...'
+ *      args: expression (list) node, NULL for an empty list
+ *      rets: yes or no
+ */
+static bool ir_list_open(struct node *node)
+{
+    while (node != NULL && node->type == NODE_EXPRESSION_LIST)
+        node = node->data.expression_list.init;
 
-    return proto;
+    return node != NULL && (node->type == NODE_CALL || node->type == NODE_VARARG);
 }
 
-/* ir_collect_protos() -- will collect all protos and shove them into a list
- *      args: main/core proto
- *      rets: new ir proto list
+/* ir_build_list() -- builds every expression of an expression list in source order
+ *      args: ir context, ir proto, expression (list) node
+ *      rets: none
  */
-struct ir_proto_list *ir_collect_protos(struct ir_proto *main)
+static void ir_build_list(struct ir_context *context, struct ir_proto *proto, struct node *node)
 {
-    struct ir_proto_list *list = NULL;
+    while (node != NULL && node->type == NODE_EXPRESSION_LIST) {
+        ir_build_proto(context, proto, node->data.expression_list.expression);
+        node = node->data.expression_list.init;
+    }
 
-    /* recursively reach all function prototypes */
-    for (struct ir_proto *iter = main->protos->first; iter != NULL; iter = iter->next)
-        list = ir_proto_join(list, ir_collect_protos(iter));
+    ir_build_proto(context, proto, node);
+}
 
-    if (!list)
-        return ir_proto_list(main, main);
+/* ir_label() -- marks the next instruction of a proto as the target of a jump
+ *      args: ir proto
+ *      rets: position of the instruction
+ *
+ * Note: Code that jumps to a label may run before it instead of the instructions in front of it,
+ * so ir_retarget() no longer changes those.
+ */
+static int ir_label(struct ir_proto *proto)
+{
+    proto->label = proto->code->size;
+    return proto->label;
+}
 
-    return ir_proto_append(list, main);
+/* ir_build_jump() -- appends a jump whose target is not known yet to a list of jumps
+ *      args: ir context, ir proto, list of jumps
+ *      rets: none
+ */
+static void ir_build_jump(struct ir_context *context, struct ir_proto *proto, int *list)
+{
+    if (proto->code->size > IR_JUMP_MAX) {
+        unhandled_compiler_error("jumps do not reach past instruction %d", IR_JUMP_MAX);
+        context->error_count++;
+    }
+
+    *list = ir_append(proto->code, ir_instruction_E(OP_JMP, *list));
+}
+
+/* ir_patch_jumps() -- points every jump of a list to a target
+ *      args: ir context, ir proto, list of jumps, position of the target
+ *      rets: none
+ */
+static void ir_patch_jumps(struct ir_context *context, struct ir_proto *proto, int list,
+                           int target)
+{
+    while (list != IR_NO_JUMP) {
+        uint32_t *value = &proto->code->code[list];
+        int next = GETARG_E(*value);
+        int offset = target - (list + 1);
+
+        if (offset < -IR_JUMP_MAX || offset > IR_JUMP_MAX) {
+            unhandled_compiler_error("jump of %d instructions does not fit in an instruction",
+                                     offset);
+            context->error_count++;
+        }
+
+        *value = ir_instruction_E(OP_JMP, offset).value;
+        list = next;
+    }
+}
+
+/* ir_build_compare() -- builds a comparison into a conditional branch and the jump after it
+ *      args: ir context, ir proto, operation, left operand, right operand, whether to jump when
+ *            the comparison holds (or when it does not), list of jumps
+ *      rets: none
+ *
+ * Note: The branches come in the order ==, <, <=, > and >= in every family. A constant operand
+ * is moved to the right, so it can be the C operand, and two registers compare > and >= the
+ * other way around once both were evaluated.
+ */
+static void ir_build_compare(struct ir_context *context, struct ir_proto *proto,
+                             enum node_binary_operation operation, struct node *left,
+                             struct node *right, bool jump, int *list)
+{
+    static const int mirrored[] = {0, 3, 4, 1, 2};
+    uint8_t base = proto->top_register;
+    int kind = 0, constant = -1;
+    enum opcode code;
+    uint8_t b, c;
+
+    switch (operation) {
+        case BINOP_NE:
+            jump = !jump;
+            break;
+        case BINOP_LT:
+            kind = 1;
+            break;
+        case BINOP_LE:
+            kind = 2;
+            break;
+        case BINOP_GT:
+            kind = 3;
+            break;
+        case BINOP_GE:
+            kind = 4;
+            break;
+        default:
+            break;
+    }
+
+    bool left_constant = left->type == NODE_NUMBER || left->type == NODE_STRING;
+
+    if (left_constant && right->type != NODE_NUMBER && right->type != NODE_STRING) {
+        struct node *swap = left;
+
+        left = right;
+        right = swap;
+        kind = mirrored[kind];
+    }
+
+    if (right->type == NODE_NUMBER)
+        constant = ir_constant_number(proto, right->data.number.value);
+    else if (right->type == NODE_STRING)
+        constant = ir_constant_string(proto, right->data.string.s);
+
+    if (constant >= 0 && constant <= 255) {
+        bool number = ir_is_number(left) && right->type == NODE_NUMBER;
+
+        code = (number ? OP_EQNK : OP_EQK) + kind;
+        b = ir_build_operand(context, proto, left);
+        c = constant;
+    } else {
+        bool number = ir_is_number(left) && ir_is_number(right);
+
+        b = ir_build_operand(context, proto, left);
+        c = ir_build_operand(context, proto, right);
+
+        if (kind > 2) {
+            uint8_t swap = b;
+
+            b = c;
+            c = swap;
+            kind -= 2;
+        }
+
+        code = (number ? OP_EQNN : OP_EQ) + kind;
+    }
+
+    ir_free_register(context, proto, proto->top_register - base);
+    ir_append(proto->code, ir_instruction_ABC(code, jump, b, c));
+    ir_build_jump(context, proto, list);
+}
+
+/* ir_build_condition() -- builds a condition into branches, they jump when it is true (or false)
+ * and fall through otherwise
+ *      args: ir context, ir proto, expression node, whether to jump when the condition is true,
+ *            list the jumps are appended to
+ *      rets: none
+ *
+ * Note: Comparisons become a single branch and `and', `or' and `not' only decide where the
+ * branches of their operands jump, no boolean is ever put in a register.
+ */
+static void ir_build_condition(struct ir_context *context, struct ir_proto *proto,
+                               struct node *node, bool jump, int *list)
+{
+    uint8_t base = proto->top_register;
+
+    switch (node->type) {
+        case NODE_EXPRESSION_GROUP:
+            ir_build_condition(context, proto, node->data.expression_group.expression, jump, list);
+            return;
+        case NODE_NIL:
+        case NODE_BOOLEAN:
+        case NODE_NUMBER:
+        case NODE_STRING: {
+            /* A constant condition either always jumps or never does */
+            bool value = node->type != NODE_NIL &&
+                         (node->type != NODE_BOOLEAN || node->data.boolean.value);
+
+            if (value == jump)
+                ir_build_jump(context, proto, list);
+            return;
+        }
+        case NODE_UNARY_OPERATION:
+            if (node->data.unary_operation.operation != UNOP_NOT)
+                break;
+
+            ir_build_condition(context, proto, node->data.unary_operation.expression, !jump,
+                               list);
+            return;
+        case NODE_BINARY_OPERATION: {
+            enum node_binary_operation operation = node->data.binary_operation.operation;
+            struct node *left = node->data.binary_operation.left;
+            struct node *right = node->data.binary_operation.right;
+
+            if (operation >= BINOP_GT && operation <= BINOP_NE) {
+                ir_build_compare(context, proto, operation, left, right, jump, list);
+                return;
+            }
+
+            if (operation != BINOP_AND && operation != BINOP_OR)
+                break;
+
+            /* `a and b' is false as soon as a is, `a or b' is true as soon as a is */
+            if ((operation == BINOP_AND) != jump) {
+                ir_build_condition(context, proto, left, jump, list);
+                ir_build_condition(context, proto, right, jump, list);
+            } else {
+                int skip = IR_NO_JUMP;
+
+                ir_build_condition(context, proto, left, !jump, &skip);
+                ir_build_condition(context, proto, right, jump, list);
+                ir_patch_jumps(context, proto, skip, ir_label(proto));
+            }
+            return;
+        }
+        default:
+            break;
+    }
+
+    /* Any other value is true unless it is nil or false */
+    uint8_t reg = ir_build_operand(context, proto, node);
+
+    ir_free_register(context, proto, proto->top_register - base);
+    ir_append(proto->code, ir_instruction_ABC(OP_TEST, reg, 0, jump));
+    ir_build_jump(context, proto, list);
+}
+
+/* ir_build_binary() -- builds a binary operation into a new register at the top of the stack
+ *      args: ir context, ir proto, operation, left operand, right operand
+ *      rets: none
+ */
+static void ir_build_binary(struct ir_context *context, struct ir_proto *proto,
+                            enum node_binary_operation operation, struct node *left,
+                            struct node *right)
+{
+    /* Temporaries of the operands start here, the result replaces them */
+    uint8_t target = proto->top_register;
+
+    switch (operation) {
+        case BINOP_ADD:
+        case BINOP_SUB:
+        case BINOP_MUL:
+        case BINOP_DIV:
+        case BINOP_POW:
+        case BINOP_MOD: {
+            struct ir_instruction instruction;
+            const int32_t constant = ir_get_constant_number(proto, right);
+
+            if (constant >= 0 && constant <= 255) {
+                /* Constants are always numbers, only the left operand has to be checked */
+                enum opcode code = get_arith_opcode(operation, true, ir_is_number(left));
+                uint8_t b = ir_build_operand(context, proto, left);
+
+                ir_free_register(context, proto, proto->top_register - target);
+                instruction =
+                    ir_instruction_ABC(code, ir_allocate_register(context, proto, 1), b, constant);
+            } else {
+                enum opcode code =
+                    get_arith_opcode(operation, false, ir_is_number(left) && ir_is_number(right));
+                uint8_t b = ir_build_operand(context, proto, left);
+                uint8_t c = ir_build_operand(context, proto, right);
+
+                /* Pop the operands off the stack */
+                ir_free_register(context, proto, proto->top_register - target);
+                instruction =
+                    ir_instruction_ABC(code, ir_allocate_register(context, proto, 1), b, c);
+            }
+
+            ir_append(proto->code, instruction);
+            break;
+        }
+        case BINOP_GT ... BINOP_NE: {
+            /* A comparison as a value branches over the load of true */
+            int skip = IR_NO_JUMP;
+
+            ir_build_compare(context, proto, operation, left, right, false, &skip);
+            ir_allocate_register(context, proto, 1);
+            ir_append(proto->code, ir_instruction_ABC(OP_LOADBOOL, target, 1, 1));
+            ir_patch_jumps(context, proto, skip, ir_label(proto));
+            ir_append(proto->code, ir_instruction_ABC(OP_LOADBOOL, target, 0, 0));
+
+            /* Both loads write the result, neither can be retargeted on its own */
+            ir_label(proto);
+            break;
+        }
+        case BINOP_CONCAT: {
+            /* The operands of a concatenation have to be consecutive registers */
+            ir_build_proto(context, proto, left);
+            ir_build_proto(context, proto, right);
+
+            /* top_register contains the next availible register so -1 to get previous */
+            const uint8_t end = proto->top_register - 1;
+
+            struct ir_instruction instruction = ir_instruction_ABC(OP_CONCAT, target, target, end);
+
+            /* Pop all experssions from the stack */
+            ir_free_register(context, proto, end - target);
+
+            ir_append(proto->code, instruction);
+            break;
+        }
+        case BINOP_AND:
+        case BINOP_OR: {
+            /* The left operand is the result unless it decides nothing (true for `and', false
+             * for `or'), the right one is then evaluated into the same register */
+            int skip = IR_NO_JUMP;
+
+            ir_build_proto(context, proto, left);
+            ir_free_register(context, proto, proto->top_register - target - 1);
+            ir_append(proto->code, ir_instruction_ABC(OP_TEST, target, 0, operation == BINOP_OR));
+            ir_build_jump(context, proto, &skip);
+            ir_free_register(context, proto, 1);
+            ir_build_proto(context, proto, right);
+            ir_free_register(context, proto, proto->top_register - target - 1);
+            ir_patch_jumps(context, proto, skip, ir_label(proto));
+
+            /* Both operands write the result, neither can be retargeted on its own */
+            ir_label(proto);
+            break;
+        }
+    }
+}
+
+/* ir_size_hint() -- encodes a table size hint of OP_NEWTABLE as a 'floating point byte', the
+ * same encoding as luaO_int2fb() of the VM
+ *      args: size
+ *      rets: encoded size (eeeeexxx, (1xxx) * 2^(eeeee - 1) when eeeee is not 0)
+ */
+static uint8_t ir_size_hint(unsigned int size)
+{
+    int exponent = 0;
+
+    while (size >= 16) {
+        size = (size + 1) >> 1;
+        exponent++;
+    }
+
+    if (size < 8)
+        return size;
+
+    return ((exponent + 1) << 3) | (size - 8);
+}
+
+/* ir_build_array() -- builds an array constructor into a new register at the top of the stack,
+ * the elements are evaluated above it and stored in batches. Typed arrays are created with their
+ * element kind, anything else becomes a table with a presized array part.
+ *      args: ir context, ir proto, array constructor node
+ *      rets: none
+ */
+static void ir_build_array(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *elements = node->data.array_constructor.exprlist;
+    int size = ir_list_size(elements);
+    int kind = ir_array_kind(node);
+    uint8_t target = ir_allocate_register(context, proto, 1);
+    int pending = 0, batch = 0;
+
+    if (kind >= 0)
+        ir_append(proto->code, ir_instruction_ABC(OP_NEWARRAY, target, kind,
+                                                  size < UCHAR_MAX ? size : UCHAR_MAX));
+    else
+        ir_append(proto->code, ir_instruction_ABC(OP_NEWTABLE, target, ir_size_hint(size), 0));
+
+    while (elements != NULL) {
+        struct node *element = elements;
+
+        if (elements->type == NODE_EXPRESSION_LIST) {
+            element = elements->data.expression_list.expression;
+            elements = elements->data.expression_list.init;
+        } else
+            elements = NULL;
+
+        ir_build_proto(context, proto, element);
+
+        if (++pending < ARRAY_FIELDS_PER_FLUSH && elements != NULL)
+            continue;
+
+        if (batch > UCHAR_MAX) {
+            unhandled_compiler_error("array constructor with more than %d elements",
+                                     (UCHAR_MAX + 1) * ARRAY_FIELDS_PER_FLUSH);
+            context->error_count++;
+        }
+
+        ir_append(proto->code, ir_instruction_ABC(kind >= 0 ? OP_SETARRAYLIST : OP_SETLIST, target,
+                                                  pending, batch++));
+        ir_free_register(context, proto, pending);
+        pending = 0;
+    }
+}
+
+/* ir_field_key() -- finds the constant of a string literal key, fields with one are accessed
+ * through GETFIELD and SETFIELD
+ *      args: ir proto, key node
+ *      rets: constant index or -1 if the key is no string literal or its constant does not fit C
+ */
+static int ir_field_key(struct ir_proto *proto, struct node *key)
+{
+    if (key->type != NODE_STRING)
+        return -1;
+
+    unsigned int index = ir_constant_string(proto, key->data.string.s);
+
+    return index <= UCHAR_MAX ? (int)index : -1;
+}
+
+/* ir_index_parts() -- splits an index of a table or a typed array into the indexed expression and
+ * its key
+ *      args: index node (t[key] or t.name), container node to fill
+ *      rets: key node, the identifier of the name for t.name
+ */
+static struct node *ir_index_parts(struct node *node, struct node **container)
+{
+    if (node->type == NODE_NAME_INDEX) {
+        *container = node->data.name_index.expression;
+        return node->data.name_index.index;
+    }
+
+    *container = node->data.expression_index.expression;
+    return node->data.expression_index.index;
+}
+
+/* ir_index_field() -- finds the constant of the key of a table index that is a string, t.name is
+ * accessed like t["name"]
+ *      args: ir proto, index node
+ *      rets: constant index or -1 if the key is no string or its constant does not fit C
+ */
+static int ir_index_field(struct ir_proto *proto, struct node *node)
+{
+    if (node->type != NODE_NAME_INDEX)
+        return ir_field_key(proto, node->data.expression_index.index);
+
+    unsigned int index = ir_constant_string(proto, node->data.name_index.index->data.identifier.s);
+
+    return index <= UCHAR_MAX ? (int)index : -1;
+}
+
+/* ir_build_key() -- builds the key of an index that is no field into a register
+ *      args: ir context, ir proto, index node
+ *      rets: register holding the key
+ */
+static uint8_t ir_build_key(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    if (node->type != NODE_NAME_INDEX)
+        return ir_build_operand(context, proto, node->data.expression_index.index);
+
+    /* A name whose constant does not fit C is loaded like a string literal */
+    unsigned int index = ir_constant_string(proto, node->data.name_index.index->data.identifier.s);
+    uint8_t target = ir_allocate_register(context, proto, 1);
+
+    ir_append(proto->code, ir_instruction_AD(OP_LOADK, target, index));
+    return target;
+}
+
+/* ir_index_opcode() -- selects the instruction reading or writing an element of a table or a
+ * typed array whose key is in a register
+ *      args: index node, whether the element is written
+ *      rets: opcode
+ */
+static enum opcode ir_index_opcode(struct node *node, bool store)
+{
+    struct node *container;
+    struct node *key = ir_index_parts(node, &container);
+
+    /* Keys proven whole skip the conversion checks, see OP_GETARRAYI and OP_GETINDEX */
+    if (ir_array_kind(container) >= 0) {
+        if (type_is_integer(key))
+            return store ? OP_SETARRAYI : OP_GETARRAYI;
+
+        return store ? OP_SETARRAY : OP_GETARRAY;
+    }
+
+    if (node->type == NODE_EXPRESSION_INDEX && type_is_integer(key))
+        return store ? OP_SETINDEX : OP_GETINDEX;
+
+    return store ? OP_SETTABLE : OP_GETTABLE;
+}
+
+/* ir_is_record() -- determines whether a table constructor only has string literal keys, these
+ * become records laid out by shapes
+ *      args: table constructor node
+ *      rets: yes or no
+ */
+static bool ir_is_record(struct node *node)
+{
+    struct node *pairs = node->data.table_constructor.pairlist;
+    int size = ir_list_size(pairs);
+
+    if (size == 0 || size > RECORD_FIELDS_MAX)
+        return false;
+
+    for (struct node *iter = pairs; iter != NULL;) {
+        struct node *pair = iter;
+
+        if (iter->type == NODE_EXPRESSION_LIST) {
+            pair = iter->data.expression_list.expression;
+            iter = iter->data.expression_list.init;
+        } else
+            iter = NULL;
+
+        if (pair->data.key_value_pair.key->type != NODE_STRING)
+            return false;
+    }
+
+    return true;
+}
+
+/* ir_build_table() -- builds a table constructor into a new register at the top of the stack, the
+ * table is created with room for all of its pairs, constructors of records store them as fields
+ *      args: ir context, ir proto, table constructor node
+ *      rets: none
+ */
+static void ir_build_table(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *pairs = node->data.table_constructor.pairlist;
+    uint8_t target = ir_allocate_register(context, proto, 1);
+    int size = ir_list_size(pairs), integers = 0;
+    bool record = ir_is_record(node);
+    bool *present = amalloc(size + 1);
+
+    memset(present, 0, size + 1);
+
+    /* The keys 1 .. n that are all present go to the array part */
+    for (struct node *iter = pairs; iter != NULL;) {
+        struct node *pair = iter;
+
+        if (iter->type == NODE_EXPRESSION_LIST) {
+            pair = iter->data.expression_list.expression;
+            iter = iter->data.expression_list.init;
+        } else
+            iter = NULL;
+
+        struct node *key = pair->data.key_value_pair.key;
+        if (key->type == NODE_NUMBER && key->data.number.value >= 1 &&
+            key->data.number.value <= size && floor(key->data.number.value) == key->data.number.value)
+            present[(int)key->data.number.value] = true;
+    }
+
+    while (integers < size && present[integers + 1])
+        integers++;
+
+    /* An empty {} the type checker made a typed array (see type_fill_empty()) */
+    if (ir_array_kind(node) >= 0) {
+        ir_append(proto->code, ir_instruction_ABC(OP_NEWARRAY, target, ir_array_kind(node), 0));
+        return;
+    }
+
+    if (record)
+        ir_append(proto->code, ir_instruction_ABC(OP_NEWRECORD, target, size, 0));
+    else
+        ir_append(proto->code, ir_instruction_ABC(OP_NEWTABLE, target, ir_size_hint(integers),
+                                                  ir_size_hint(size - integers)));
+
+    while (pairs != NULL) {
+        struct node *pair = pairs;
+
+        if (pairs->type == NODE_EXPRESSION_LIST) {
+            pair = pairs->data.expression_list.expression;
+            pairs = pairs->data.expression_list.init;
+        } else
+            pairs = NULL;
+
+        int field = record ? ir_field_key(proto, pair->data.key_value_pair.key) : -1;
+
+        if (field >= 0) {
+            uint8_t value = ir_build_operand(context, proto, pair->data.key_value_pair.value);
+
+            ir_append(proto->code, ir_instruction_ABC(OP_SETFIELD, target, field, value));
+            ir_free_register(context, proto, proto->top_register - target - 1);
+            continue;
+        }
+
+        uint8_t key = ir_build_operand(context, proto, pair->data.key_value_pair.key);
+        uint8_t value = ir_build_operand(context, proto, pair->data.key_value_pair.value);
+
+        ir_append(proto->code, ir_instruction_ABC(OP_SETTABLE, target, key, value));
+        ir_free_register(context, proto, proto->top_register - target - 1);
+    }
+}
+
+/* ir_index_target() -- finds the index expression a variable refers to, typed arrays are written
+ * by their own instructions and every other container like a table
+ *      args: variable node
+ *      rets: index node (t[key] or t.name) or NULL if the variable is something else
+ */
+static struct node *ir_index_target(struct node *node)
+{
+    if (node->type == NODE_NAME_REFERENCE)
+        node = node->data.name_reference.identifier;
+
+    if (node->type == NODE_NAME_INDEX && !node->data.name_index.self_index)
+        return node;
+
+    return node->type == NODE_EXPRESSION_INDEX ? node : NULL;
+}
+
+/* ir_is_pure() -- determines whether an operand can be evaluated twice, compound assignments to an
+ * array element or a table field read the element again
+ *      args: ir proto, expression node
+ *      rets: yes or no
+ */
+static bool ir_is_pure(struct ir_proto *proto, struct node *node)
+{
+    return ir_reference_local(proto, node) >= 0 || node->type == NODE_NUMBER ||
+           node->type == NODE_STRING;
+}
+
+/* ir_build_local() -- builds a local statement, the values are evaluated straight into the
+ * registers of the new locals
+ *      args: ir context, ir proto, local node
+ *      rets: none
+ */
+static void ir_build_local(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *names = node->data.local.namelist;
+    uint8_t base = proto->top_register;
+    int count = names->type == NODE_NAME_LIST ? names->data.name_list.size : 1;
+
+    /* The new locals go right above the existing ones */
+    assert(base == proto->locals_size);
+
+    /* local function f() ... end: the function can call itself, so f is declared first */
+    if (count == 1 && node->data.local.exprlist != NULL &&
+        node->data.local.exprlist->type == NODE_FUNCTION_BODY) {
+        struct node *name = names->type == NODE_TYPE_ANNOTATION
+                                ? names->data.type_annotation.identifier
+                                : names;
+        int pending = proto->pending_local;
+
+        struct node *function = node->data.local.exprlist;
+        struct node *params = function->data.function_body.exprlist;
+
+        proto->pending_local = ir_local(context, proto, name->data.identifier.s);
+
+        /* Its calls are resolved statically, unless the local is assigned or a later streamed
+         * statement could assign it */
+        if (!name->data.identifier.s->is_assigned &&
+            (params == NULL || params->data.parameter_list.vararg == NULL) &&
+            !(context->stream && proto->parent == NULL))
+            proto->functions[proto->pending_local] = function;
+
+        ir_build_proto(context, proto, function);
+        proto->pending_local = pending;
+        return;
+    }
+
+    ir_build_list(context, proto, node->data.local.exprlist);
+
+    int values = proto->top_register - base;
+
+    if (values < count) {
+        /* Locals without a value start as nil */
+        uint8_t first = ir_allocate_register(context, proto, count - values);
+        ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, first, base + count - 1, 0));
+    } else if (values > count)
+        /* Extra values are evaluated but thrown away */
+        ir_free_register(context, proto, values - count);
+
+    /* Declare the locals only now, so the values can not refer to them */
+    while (names != NULL) {
+        struct node *name = names;
+
+        if (names->type == NODE_NAME_LIST) {
+            name = names->data.name_list.name;
+            names = names->data.name_list.init;
+        } else
+            names = NULL;
+
+        if (name->type == NODE_TYPE_ANNOTATION)
+            name = name->data.type_annotation.identifier;
+
+        ir_local(context, proto, name->data.identifier.s);
+    }
+}
+
+/* ir_visit() -- calls a function on every node of a subtree, parents before their children
+ *      args: node, function, data passed to the function
+ *      rets: none
+ */
+static void ir_visit(struct node *node, void (*visit)(struct node *, void *), void *data)
+{
+    struct node *children[4] = {NULL, NULL, NULL, NULL};
+
+    if (node == NULL)
+        return;
+
+    visit(node, data);
+
+    switch (node->type) {
+        case NODE_TYPE_ANNOTATION:
+            children[0] = node->data.type_annotation.identifier;
+            break;
+        case NODE_BINARY_OPERATION:
+            children[0] = node->data.binary_operation.left;
+            children[1] = node->data.binary_operation.right;
+            break;
+        case NODE_UNARY_OPERATION:
+            children[0] = node->data.unary_operation.expression;
+            break;
+        case NODE_EXPRESSION_LIST:
+            children[0] = node->data.expression_list.init;
+            children[1] = node->data.expression_list.expression;
+            break;
+        case NODE_NAME_LIST:
+            children[0] = node->data.name_list.init;
+            children[1] = node->data.name_list.name;
+            break;
+        case NODE_VARIABLE_LIST:
+            children[0] = node->data.variable_list.init;
+            children[1] = node->data.variable_list.variable;
+            break;
+        case NODE_PARAMETER_LIST:
+            children[0] = node->data.parameter_list.namelist;
+            break;
+        case NODE_CALL:
+            children[0] = node->data.call.prefix_expression;
+            children[1] = node->data.call.args;
+            break;
+        case NODE_EXPRESSION_GROUP:
+            children[0] = node->data.expression_group.expression;
+            break;
+        case NODE_NAME_INDEX:
+            /* The index is a field name, not a variable */
+            children[0] = node->data.name_index.expression;
+            break;
+        case NODE_EXPRESSION_INDEX:
+            children[0] = node->data.expression_index.expression;
+            children[1] = node->data.expression_index.index;
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+            children[0] = node->data.expression_statement.expression;
+            break;
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.size; i++)
+                ir_visit(node->data.block.statements[i], visit, data);
+            break;
+        case NODE_ASSIGNMENT:
+            children[0] = node->data.assignment.variables;
+            children[1] = node->data.assignment.values;
+            break;
+        case NODE_WHILELOOP:
+            children[0] = node->data.while_loop.condition;
+            children[1] = node->data.while_loop.body;
+            break;
+        case NODE_REPEATLOOP:
+            children[0] = node->data.repeat_loop.body;
+            children[1] = node->data.repeat_loop.condition;
+            break;
+        case NODE_IF:
+            children[0] = node->data.if_statement.condition;
+            children[1] = node->data.if_statement.body;
+            children[2] = node->data.if_statement.else_body;
+            break;
+        case NODE_NUMERICFORLOOP:
+            children[0] = node->data.numerical_for_loop.init;
+            children[1] = node->data.numerical_for_loop.target;
+            children[2] = node->data.numerical_for_loop.increment;
+            children[3] = node->data.numerical_for_loop.body;
+            break;
+        case NODE_GENERICFORLOOP:
+            children[0] = node->data.generic_for_loop.local;
+            children[1] = node->data.generic_for_loop.body;
+            break;
+        case NODE_LOCAL:
+            children[0] = node->data.local.namelist;
+            children[1] = node->data.local.exprlist;
+            break;
+        case NODE_RETURN:
+            children[0] = node->data.return_statement.exprlist;
+            break;
+        case NODE_FUNCTION_BODY:
+            children[0] = node->data.function_body.exprlist;
+            children[1] = node->data.function_body.body;
+            break;
+        case NODE_NAME_REFERENCE:
+            children[0] = node->data.name_reference.identifier;
+            break;
+        case NODE_ARRAY_CONSTRUCTOR:
+            children[0] = node->data.array_constructor.exprlist;
+            break;
+        case NODE_KEY_VALUE_PAIR:
+            children[0] = node->data.key_value_pair.key;
+            children[1] = node->data.key_value_pair.value;
+            break;
+        case NODE_TABLE_CONSTRUCTOR:
+            children[0] = node->data.table_constructor.pairlist;
+            break;
+        default:
+            break;
+    }
+
+    for (int i = 0; i < 4; i++)
+        ir_visit(children[i], visit, data);
+}
+
+/* ir_find_function() -- finds the function a callee always is, a local function that no
+ * assignment writes to keeps the closure it was declared with
+ *      args: ir proto, expression node, symbol of the function to fill
+ *      rets: function body node or NULL if the callee is something else
+ */
+static struct node *ir_find_function(struct ir_proto *proto, struct node *node,
+                                     struct symbol **symbol)
+{
+    if (node->type == NODE_NAME_REFERENCE)
+        node = node->data.name_reference.identifier;
+
+    if (node->type != NODE_IDENTIFIER || node->data.identifier.is_global)
+        return NULL;
+
+    *symbol = node->data.identifier.s;
+
+    /* The locals of the enclosing protos are reached through upvalues */
+    for (; proto != NULL; proto = proto->parent) {
+        for (int i = 0; i < proto->bindings_size; i++)
+            if (proto->bindings[i].symbol == *symbol)
+                return NULL;
+
+        for (int i = proto->locals_size - 1; i >= 0; i--)
+            if (proto->locals[i] == *symbol)
+                return proto->functions[i];
+    }
+
+    return NULL;
+}
+
+/* Nodes of a function body looked at by ir_inline_expression() */
+struct ir_inline_scan {
+    struct symbol *function;
+    int nodes;
+    bool rejected; /* The body creates a closure, uses `...' or calls the function itself */
+};
+
+/* ir_scan_inline() -- counts a node of an expression to inline, rejects the ones it can not have
+ *      args: node, scan
+ *      rets: none
+ */
+static void ir_scan_inline(struct node *node, void *data)
+{
+    struct ir_inline_scan *scan = data;
+
+    scan->nodes++;
+
+    if (node->type == NODE_FUNCTION_BODY || node->type == NODE_VARARG ||
+        (node->type == NODE_IDENTIFIER && node->data.identifier.s == scan->function))
+        scan->rejected = true;
+}
+
+/* ir_inline_expression() -- determines whether a call of a function is built in place, its body
+ * has to be a small `return <expression>'
+ *      args: ir context, function body node, symbol of the function, most nodes of the body
+ *      rets: the returned expression, NULL if the function is called
+ */
+static struct node *ir_inline_expression(struct ir_context *context, struct node *function,
+                                         struct symbol *symbol, int nodes)
+{
+    struct node *params = function->data.function_body.exprlist;
+    struct node *body = function->data.function_body.body;
+
+    if (context->inlining == IR_INLINE_DEPTH ||
+        (params != NULL && params->data.parameter_list.size > IR_INLINE_PARAMS))
+        return NULL;
+
+    if (body == NULL || body->type != NODE_BLOCK || body->data.block.size != 1 ||
+        body->data.block.statements[0]->type != NODE_RETURN)
+        return NULL;
+
+    struct node *expression = body->data.block.statements[0]->data.return_statement.exprlist;
+
+    /* A single value, the caller keeps one result at most */
+    if (expression->type == NODE_NIL || expression->type == NODE_EXPRESSION_LIST)
+        return NULL;
+
+    struct ir_inline_scan scan = {symbol, 0, false};
+    ir_visit(expression, ir_scan_inline, &scan);
+
+    return !scan.rejected && scan.nodes <= nodes ? expression : NULL;
+}
+
+/* ir_build_inline() -- builds a call of a function by evaluating its returned expression in place,
+ * the parameters are bound to the registers of the arguments
+ *      args: ir context, ir proto, function body node, expression, args (list) node, number of
+ *            results
+ *      rets: none
+ *
+ * Note: The instructions keep the line of the call, the frame of the function does not show up in
+ * tracebacks and hooks.
+ */
+static void ir_build_inline(struct ir_context *context, struct ir_proto *proto,
+                            struct node *function, struct node *expression, struct node *args,
+                            int results)
+{
+    struct node *params = function->data.function_body.exprlist;
+    struct node *names = params != NULL ? params->data.parameter_list.namelist : NULL;
+    uint8_t base = proto->top_register;
+    int bindings = proto->bindings_size;
+    int count = 0;
+
+    ir_build_list(context, proto, args);
+
+    if (proto->bindings == NULL)
+        proto->bindings = amalloc(IR_INLINE_DEPTH * IR_INLINE_PARAMS * sizeof(struct ir_binding));
+
+    /* The parameters in source order, like ir_build_function() declares them */
+    while (names != NULL) {
+        struct node *name = names;
+
+        if (names->type == NODE_NAME_LIST) {
+            name = names->data.name_list.name;
+            names = names->data.name_list.init;
+        } else
+            names = NULL;
+
+        if (name->type == NODE_TYPE_ANNOTATION)
+            name = name->data.type_annotation.identifier;
+
+        proto->bindings[proto->bindings_size++] = (struct ir_binding){name->data.identifier.s,
+                                                                      base + count++};
+    }
+
+    /* Missing arguments are nil, extra ones were only evaluated */
+    if (proto->top_register < base + count) {
+        int missing = base + count - proto->top_register;
+        uint8_t first = ir_allocate_register(context, proto, missing);
+
+        ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, first, base + count - 1, 0));
+    }
+
+    uint8_t target = proto->top_register;
+
+    context->inlining++;
+    ir_build_proto(context, proto, expression);
+    context->inlining--;
+
+    if (proto->top_register == target) {
+        ir_allocate_register(context, proto, 1);
+        ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, target, target, 0));
+    }
+
+    if (results > 0 && !ir_retarget(proto, target, base))
+        ir_append(proto->code, ir_instruction_ABC(OP_MOVE, base, target, 0));
+
+    proto->bindings_size = bindings;
+    ir_free_register(context, proto, proto->top_register - (base + results));
+}
+
+static bool ir_build_call(struct ir_context *context, struct ir_proto *proto, struct node *node,
+                          int results);
+
+/* ir_build_arguments() -- builds the arguments of a call above its function, a call or `...' as
+ * the last argument passes all of its values
+ *      args: ir context, ir proto, args (list) node
+ *      rets: B of the call, the number of arguments + 1 or 0 when they end at the top of the stack
+ */
+static int ir_build_arguments(struct ir_context *context, struct ir_proto *proto, struct node *args)
+{
+    int size = 0;
+
+    while (args != NULL && args->type == NODE_EXPRESSION_LIST) {
+        ir_build_proto(context, proto, args->data.expression_list.expression);
+        args = args->data.expression_list.init;
+        size++;
+    }
+
+    if (args == NULL)
+        return size + 1;
+
+    if (args->type != NODE_CALL && args->type != NODE_VARARG) {
+        ir_build_proto(context, proto, args);
+        return size + 2;
+    }
+
+    /* The line the way ir_build_proto() gives it */
+    int line = proto->code->line;
+    bool open = true;
+
+    if (args->location.first_line > 0 && context->inlining == 0)
+        proto->code->line = args->location.first_line;
+
+    if (args->type == NODE_VARARG) {
+        /* The first value needs a register of the frame, the VM grows the stack for the others */
+        uint8_t target = ir_allocate_register(context, proto, 1);
+
+        ir_append(proto->code, ir_instruction_ABC(OP_VARARG, target, 0, 0));
+        ir_free_register(context, proto, 1);
+    } else
+        open = ir_build_call(context, proto, args, IR_MULTRET);
+
+    proto->code->line = line;
+    return open ? 0 : size + 2;
+}
+
+/* ir_build_call() -- builds a call leaving its results on the top of the stack
+ *      args: ir context, ir proto, call node, number of results (IR_MULTRET for all of them)
+ *      rets: whether the results end at the top of the stack, an inlined call of IR_MULTRET
+ *            leaves its single value in a register instead
+ *
+ * Note: Calls of a known local function skip the checks of the callee (OP_CALLDIRECT) or build
+ * its body in place when it is small, see ir_inline_expression().
+ */
+static bool ir_build_call(struct ir_context *context, struct ir_proto *proto, struct node *node,
+                          int results)
+{
+    struct node *function = node->data.call.prefix_expression;
+    struct node *args = node->data.call.args;
+    struct symbol *symbol;
+    struct node *known = ir_find_function(proto, function, &symbol);
+    struct node *expression = NULL;
+
+    /* The parameters of an inlined body are bound to one value per argument */
+    if (known != NULL && !ir_list_open(args)) {
+        int nodes = feedback_inline_nodes(context->feedback, proto->code->line);
+        expression = ir_inline_expression(context, known, symbol, nodes);
+    }
+
+    /* A body returning a call would return a single value of it in place */
+    if (results == IR_MULTRET && ir_list_open(expression))
+        expression = NULL;
+
+    if (expression != NULL) {
+        ir_build_inline(context, proto, known, expression, args, results < 0 ? 1 : results);
+        return false;
+    }
+
+    /* Save the old register for later use */
+    int old = proto->top_register;
+
+    ir_build_proto(context, proto, function);
+    int b = ir_build_arguments(context, proto, args);
+
+    /* OP_CALLDIRECT always takes B - 1 arguments */
+    enum opcode op = known != NULL && b != 0 ? OP_CALLDIRECT : OP_CALL;
+    struct ir_instruction instruction = ir_instruction_ABC(op, old, b, results + 1);
+
+    /* Only the results stay in registers, with IR_MULTRET they all end at the top instead */
+    ir_free_register(context, proto, proto->top_register - old - (results < 0 ? 0 : results));
+
+    ir_append(proto->code, instruction);
+    return results < 0;
+}
+
+/* ir_appended_value() -- recognizes the statements a string builder can run, `s = s .. x' and
+ * `s ..= x' on a local s
+ *      args: statement node, symbol of s to fill
+ *      rets: the appended expression x, NULL for any other statement
+ */
+static struct node *ir_appended_value(struct node *node, struct symbol **symbol)
+{
+    if (node->type != NODE_ASSIGNMENT)
+        return NULL;
+
+    struct node *variable = node->data.assignment.variables;
+    struct node *value = node->data.assignment.values;
+
+    if (variable->type == NODE_NAME_REFERENCE)
+        variable = variable->data.name_reference.identifier;
+
+    if (variable->type != NODE_IDENTIFIER || variable->data.identifier.is_global ||
+        value->type == NODE_EXPRESSION_LIST)
+        return NULL;
+
+    *symbol = variable->data.identifier.s;
+
+    if (node->data.assignment.type == ASSIGN_CON)
+        return value;
+    if (node->data.assignment.type != ASSIGN || value->type != NODE_BINARY_OPERATION ||
+        value->data.binary_operation.operation != BINOP_CONCAT)
+        return NULL;
+
+    /* The concatenation is right nested, s .. a .. b is s .. (a .. b) */
+    struct node *left = value->data.binary_operation.left;
+
+    if (left->type == NODE_NAME_REFERENCE)
+        left = left->data.name_reference.identifier;
+
+    if (left->type != NODE_IDENTIFIER || left->data.identifier.s != *symbol)
+        return NULL;
+
+    return value->data.binary_operation.right;
+}
+
+/* Locals of the statements a string builder can run in a loop body, see ir_find_builders() */
+struct ir_builder_scan {
+    struct symbol *symbols[IR_BUILDERS_MAX];
+    int size;
+
+    /* References to one of them, in total and from those statements */
+    int uses, appends;
+};
+
+/* ir_collect_appended() -- remembers the local a statement a string builder can run appends to
+ *      args: node, scan
+ *      rets: none
+ */
+static void ir_collect_appended(struct node *node, void *data)
+{
+    struct ir_builder_scan *scan = data;
+    struct symbol *symbol;
+
+    if (scan->size == IR_BUILDERS_MAX || ir_appended_value(node, &symbol) == NULL)
+        return;
+
+    for (int i = 0; i < scan->size; i++)
+        if (scan->symbols[i] == symbol)
+            return;
+
+    scan->symbols[scan->size++] = symbol;
+}
+
+/* ir_count_appended() -- counts the references to the first local of a scan, and the ones made by
+ * the statements a string builder can run
+ *      args: node, scan
+ *      rets: none
+ */
+static void ir_count_appended(struct node *node, void *data)
+{
+    struct ir_builder_scan *scan = data;
+    struct symbol *symbol;
+
+    if (node->type == NODE_IDENTIFIER && node->data.identifier.s == scan->symbols[0])
+        scan->uses++;
+    else if (ir_appended_value(node, &symbol) != NULL && symbol == scan->symbols[0])
+        scan->appends += node->data.assignment.type == ASSIGN ? 2 : 1;
+}
+
+/* ir_find_builders() -- finds the locals a loop body only ever appends to, they are collected in a
+ * string builder during the loop instead of creating a new string every iteration
+ *      args: ir proto, loop body, registers of the locals to fill
+ *      rets: number of locals found
+ *
+ * Note: Symbols are shared by every variable of a name, so a local is only picked when its name
+ * appears nowhere else in the body (not even in a nested function or another declaration). Locals
+ * a closure shares could be read while the loop runs.
+ */
+static int ir_find_builders(struct ir_proto *proto, struct node *body, uint8_t *locals)
+{
+    struct ir_builder_scan scan = {.size = 0};
+    int count = 0;
+
+    ir_visit(body, ir_collect_appended, &scan);
+
+    for (int i = 0; i < scan.size; i++) {
+        struct ir_builder_scan uses = {.symbols = {scan.symbols[i]}, .size = 1};
+        int local = -1;
+
+        for (int j = proto->locals_size - 1; j >= 0 && local < 0; j--)
+            if (proto->locals[j] == scan.symbols[i])
+                local = j;
+
+        if (local < 0 || proto->captured[local] || proto->builders[local] != 0)
+            continue;
+
+        ir_visit(body, ir_count_appended, &uses);
+
+        if (uses.uses == uses.appends)
+            locals[count++] = local;
+    }
+
+    return count;
+}
+
+/* ir_build_append() -- appends a value to a string builder, a concatenation of strings and numbers
+ * is appended one operand at a time
+ *      args: ir context, ir proto, register of the builder, expression node
+ *      rets: none
+ */
+static void ir_build_append(struct ir_context *context, struct ir_proto *proto, uint8_t builder,
+                            struct node *node)
+{
+    if (node->type == NODE_BINARY_OPERATION &&
+        node->data.binary_operation.operation == BINOP_CONCAT) {
+        struct node *left = node->data.binary_operation.left;
+        struct node *right = node->data.binary_operation.right;
+
+        /* Only operands without metamethods can skip the intermediate string */
+        if ((ir_is_string(left) || ir_is_number(left)) &&
+            (ir_is_string(right) || ir_is_number(right))) {
+            ir_build_append(context, proto, builder, left);
+            ir_build_append(context, proto, builder, right);
+            return;
+        }
+    }
+
+    uint8_t top = proto->top_register;
+    uint8_t value = ir_build_operand(context, proto, node);
+
+    ir_append(proto->code, ir_instruction_ABC(OP_APPEND, builder, value, 0));
+    ir_free_register(context, proto, proto->top_register - top);
+}
+
+/* ir_build_assignment() -- builds an assignment to local variables, the last instruction of a value
+ * writes into the local directly whenever possible
+ *      args: ir context, ir proto, assignment node
+ *      rets: none
+ *
+ * Note: Typed array elements are stored with SETARRAY, table fields (t.name or t["name"]) with
+ * SETFIELD, integer keys of tables with SETINDEX and other keys with SETTABLE, locals of enclosing
+ * functions with SETUPVAL and globals with SETGLOBAL. Other targets (name indices of values that
+ * are no table) are not supported by the VM yet and are skipped.
+ */
+static void ir_build_assignment(struct ir_context *context, struct ir_proto *proto,
+                                struct node *node)
+{
+    static const enum node_binary_operation operations[] = {
+        [ASSIGN_ADD] = BINOP_ADD, [ASSIGN_SUB] = BINOP_SUB, [ASSIGN_MUL] = BINOP_MUL,
+        [ASSIGN_DIV] = BINOP_DIV, [ASSIGN_MOD] = BINOP_MOD, [ASSIGN_POW] = BINOP_POW,
+        [ASSIGN_CON] = BINOP_CONCAT};
+
+    struct node *variables = node->data.assignment.variables;
+    struct node *values = node->data.assignment.values;
+    struct node *indices[UCHAR_MAX];
+    int targets[UCHAR_MAX], keys[UCHAR_MAX], upvalues[UCHAR_MAX], globals[UCHAR_MAX];
+    enum opcode stores[UCHAR_MAX];
+    int count = 0;
+
+    /* Loops collect some locals in a string builder, see ir_find_builders() */
+    struct symbol *symbol;
+    struct node *appended = ir_appended_value(node, &symbol);
+    int local = appended != NULL ? ir_reference_local(proto, variables) : -1;
+
+    if (local >= 0 && proto->builders[local] != 0) {
+        ir_build_append(context, proto, proto->builders[local], appended);
+        return;
+    }
+
+    /* Collect the registers of the assigned locals in source order */
+    for (struct node *iter = variables; iter != NULL; count++) {
+        struct node *variable = iter;
+
+        if (iter->type == NODE_VARIABLE_LIST) {
+            variable = iter->data.variable_list.variable;
+            iter = iter->data.variable_list.init;
+        } else
+            iter = NULL;
+
+        if (count == UCHAR_MAX)
+            return;
+
+        targets[count] = ir_reference_local(proto, variable);
+        indices[count] = targets[count] < 0 ? ir_index_target(variable) : NULL;
+        upvalues[count] = targets[count] < 0 && indices[count] == NULL
+                              ? ir_reference_upvalue(context, proto, variable)
+                              : -1;
+        globals[count] = targets[count] < 0 && indices[count] == NULL && upvalues[count] < 0
+                             ? ir_reference_global(proto, variable)
+                             : -1;
+
+        if (targets[count] < 0 && indices[count] == NULL && upvalues[count] < 0 &&
+            globals[count] < 0)
+            return;
+    }
+
+    if (node->data.assignment.type != ASSIGN) {
+        /* Compound assignments have a single target and value */
+        if (count != 1 || values->type == NODE_EXPRESSION_LIST)
+            return;
+
+        /* The element is read again by the operation */
+        struct node *container;
+        struct node *key = indices[0] != NULL ? ir_index_parts(indices[0], &container) : NULL;
+
+        if (key != NULL && (!ir_is_pure(proto, container) ||
+                            (indices[0]->type != NODE_NAME_INDEX && !ir_is_pure(proto, key))))
+            return;
+    }
+
+    /* The arrays and indices of the assigned elements are evaluated before the values */
+    uint8_t first = proto->top_register;
+
+    for (int i = 0; i < count; i++) {
+        if (indices[i] == NULL)
+            continue;
+
+        struct node *container;
+
+        ir_index_parts(indices[i], &container);
+        targets[i] = ir_build_operand(context, proto, container);
+
+        if (ir_array_kind(container) < 0 && (keys[i] = ir_index_field(proto, indices[i])) >= 0) {
+            stores[i] = OP_SETFIELD;
+            continue;
+        }
+
+        keys[i] = ir_build_key(context, proto, indices[i]);
+        stores[i] = ir_index_opcode(indices[i], true);
+    }
+
+    uint8_t base = proto->top_register;
+
+    if (node->data.assignment.type != ASSIGN) {
+        ir_build_binary(context, proto, operations[node->data.assignment.type],
+                        node->data.assignment.variables, values);
+    } else
+        ir_build_list(context, proto, values);
+
+    int produced = proto->top_register - base;
+
+    /* A single value is written into its local by its own instruction */
+    if (count == 1 && targets[0] >= 0 && indices[0] == NULL && produced == 1 &&
+        ir_retarget(proto, base, targets[0])) {
+        ir_free_register(context, proto, 1);
+        return;
+    }
+
+    /* Otherwise all values are evaluated first and then moved into place */
+    for (int i = count - 1; i >= 0; i--) {
+        uint8_t value = base + i;
+
+        if (i >= produced) {
+            /* Missing values are nil, typed arrays reject them */
+            value = targets[i] >= 0 && indices[i] == NULL ? targets[i]
+                                                          : ir_allocate_register(context, proto, 1);
+            ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, value, value, 0));
+        }
+
+        if (indices[i] != NULL)
+            ir_append(proto->code, ir_instruction_ABC(stores[i], targets[i], keys[i], value));
+        else if (upvalues[i] >= 0)
+            ir_append(proto->code, ir_instruction_ABC(OP_SETUPVAL, value, upvalues[i], 0));
+        else if (globals[i] >= 0)
+            ir_append(proto->code, ir_instruction_AD(OP_SETGLOBAL, value, globals[i]));
+        else if (i < produced)
+            ir_append(proto->code, ir_instruction_ABC(OP_MOVE, targets[i], value, 0));
+    }
+
+    ir_free_register(context, proto, proto->top_register - first);
+}
+
+/* ir_constant_step() -- determines the step of a numeric for loop when it is known at compile time
+ *      args: step expression
+ *      rets: the step, 0 if it is not a constant
+ */
+static double ir_constant_step(struct node *node)
+{
+    if (node->type == NODE_NUMBER)
+        return node->data.number.value;
+
+    /* Negative literals stay unary operations unless they were folded */
+    if (node->type == NODE_UNARY_OPERATION && node->data.unary_operation.operation == UNOP_NEG &&
+        node->data.unary_operation.expression->type == NODE_NUMBER)
+        return -node->data.unary_operation.expression->data.number.value;
+
+    return 0;
+}
+
+/* ir_jump() -- points the jump of an instruction at another instruction
+ *      args: ir context, ir proto, index of the jumping instruction, index of its target
+ *      rets: none
+ */
+static void ir_jump(struct ir_context *context, struct ir_proto *proto, int index, int target)
+{
+    uint32_t *value = &proto->code->code[index];
+    int offset = target - (index + 1);
+
+    if (offset < INT16_MIN || offset > INT16_MAX) {
+        unhandled_compiler_error("jump of %d instructions does not fit in an instruction", offset);
+        context->error_count++;
+    }
+
+    *value = ir_instruction_AD(GET_OPCODE(*value), GETARG_A(*value), offset).value;
+}
+
+/* ir_build_numeric_for() -- builds a numeric for loop, its start, limit and step are kept in three
+ * hidden locals followed by the control variable
+ *      args: ir context, ir proto, numeric for loop node
+ *      rets: none
+ *
+ * Note: A constant step fixes the direction of the loop, OP_FORLOOPINC and OP_FORLOOPDEC spare the
+ * VM from testing the sign of the step every iteration.
+ */
+static void ir_build_numeric_for(struct ir_context *context, struct ir_proto *proto,
+                                 struct node *node)
+{
+    struct node *init = node->data.numerical_for_loop.init;
+    struct node *variable = init->data.assignment.variables;
+    struct node *step = node->data.numerical_for_loop.increment;
+    struct node *values[] = {init->data.assignment.values, node->data.numerical_for_loop.target,
+                             step};
+    uint8_t first = proto->top_register;
+    int locals = proto->locals_size;
+    uint8_t built[IR_BUILDERS_MAX];
+
+    /* The hidden locals go right above the existing ones */
+    assert(first == proto->locals_size);
+
+    if (variable->type == NODE_TYPE_ANNOTATION)
+        variable = variable->data.type_annotation.identifier;
+    else if (variable->type == NODE_NAME_REFERENCE)
+        variable = variable->data.name_reference.identifier;
+
+    if (variable->type != NODE_IDENTIFIER)
+        return;
+
+    /* Locals the body only appends to get a builder, a hidden local that starts as a copy */
+    int builders = ir_find_builders(proto, node->data.numerical_for_loop.body, built);
+
+    for (int i = 0; i < builders; i++) {
+        uint8_t builder = ir_local(context, proto, NULL);
+
+        ir_allocate_register(context, proto, 1);
+        ir_append(proto->code, ir_instruction_ABC(OP_MOVE, builder, built[i], 0));
+        proto->builders[built[i]] = builder;
+    }
+
+    uint8_t base = proto->top_register;
+
+    for (int i = 0; i < 3; i++) {
+        ir_build_proto(context, proto, values[i]);
+
+        /* Expressions the IR can not build yet leave a nil behind, OP_FORPREP rejects it */
+        if (proto->top_register == base + i) {
+            uint8_t target = ir_allocate_register(context, proto, 1);
+            ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, target, target, 0));
+        }
+
+        ir_local(context, proto, NULL);
+    }
+
+    /* The control variable is a fresh local of the body, even if it shadows another one */
+    ir_local(context, proto, variable->data.identifier.s);
+    ir_allocate_register(context, proto, 1);
+
+    double constant = ir_constant_step(step);
+    enum opcode loop = constant > 0 ? OP_FORLOOPINC : constant < 0 ? OP_FORLOOPDEC : OP_FORLOOP;
+
+    struct ir_loop scope = {IR_NO_JUMP, locals, proto->loop};
+
+    int prep = ir_append(proto->code, ir_instruction_AD(OP_FORPREP, base, 0));
+    proto->loop = &scope;
+    ir_build_proto(context, proto, node->data.numerical_for_loop.body);
+    proto->loop = scope.parent;
+
+    /* Every iteration has its own control variable and body locals, closures that captured them by
+     * reference keep the values of their iteration */
+    ir_close_captured(proto, base + 3);
+
+    int back = ir_append(proto->code, ir_instruction_AD(loop, base, 0));
+
+    ir_jump(context, proto, prep, back);
+    ir_jump(context, proto, back, prep + 1);
+    ir_patch_jumps(context, proto, scope.breaks, ir_label(proto));
+
+    for (int i = 0; i < builders; i++) {
+        uint8_t local = built[i];
+
+        uint8_t builder = proto->builders[local];
+
+        ir_append(proto->code, ir_instruction_ABC(OP_BUILDSTRING, local, builder, 0));
+        proto->builders[local] = 0;
+    }
+
+    /* The hidden locals, the control variable and the locals of the body go out of scope */
+    ir_close_locals(proto, locals);
+    ir_free_register(context, proto, proto->top_register - first);
+}
+
+/* ir_build_block() -- builds a block, its locals go out of scope at its end
+ *      args: ir context, ir proto, block node (NULL for an empty block)
+ *      rets: none
+ */
+static void ir_build_block(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    int locals = proto->locals_size;
+    uint8_t top = proto->top_register;
+
+    ir_build_proto(context, proto, node);
+
+    ir_close_captured(proto, locals);
+    ir_close_locals(proto, locals);
+    ir_free_register(context, proto, proto->top_register - top);
+}
+
+/* ir_build_if() -- builds an if statement, an elseif is the if statement of the else body
+ *      args: ir context, ir proto, if statement node
+ *      rets: none
+ */
+static void ir_build_if(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *else_body = node->data.if_statement.else_body;
+    int next = IR_NO_JUMP;
+
+    ir_build_condition(context, proto, node->data.if_statement.condition, false, &next);
+    ir_build_block(context, proto, node->data.if_statement.body);
+
+    if (else_body != NULL) {
+        int end = IR_NO_JUMP;
+
+        ir_build_jump(context, proto, &end);
+        ir_patch_jumps(context, proto, next, ir_label(proto));
+        ir_build_block(context, proto, else_body);
+        next = end;
+    }
+
+    ir_patch_jumps(context, proto, next, ir_label(proto));
+}
+
+/* ir_build_while() -- builds a while loop
+ *      args: ir context, ir proto, while loop node
+ *      rets: none
+ *
+ * Note: The condition is tested at the bottom of the loop, the loop is entered with a jump to it
+ * and every iteration takes a single branch back to the body.
+ */
+static void ir_build_while(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct ir_loop scope = {IR_NO_JUMP, proto->locals_size, proto->loop};
+    int entry = IR_NO_JUMP, back = IR_NO_JUMP;
+
+    ir_build_jump(context, proto, &entry);
+    int body = ir_label(proto);
+
+    proto->loop = &scope;
+    ir_build_block(context, proto, node->data.while_loop.body);
+    proto->loop = scope.parent;
+
+    ir_patch_jumps(context, proto, entry, ir_label(proto));
+    ir_build_condition(context, proto, node->data.while_loop.condition, true, &back);
+    ir_patch_jumps(context, proto, back, body);
+    ir_patch_jumps(context, proto, scope.breaks, ir_label(proto));
+}
+
+/* ir_build_repeat() -- builds a repeat loop, the locals of its body are in scope in its condition
+ *      args: ir context, ir proto, repeat loop node
+ *      rets: none
+ */
+static void ir_build_repeat(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *condition = node->data.repeat_loop.condition;
+    struct ir_loop scope = {IR_NO_JUMP, proto->locals_size, proto->loop};
+    uint8_t top = proto->top_register;
+    int back = IR_NO_JUMP;
+    int body = ir_label(proto);
+
+    proto->loop = &scope;
+    ir_build_proto(context, proto, node->data.repeat_loop.body);
+    proto->loop = scope.parent;
+
+    /* Captured locals are closed after every iteration, whether the loop goes on or not */
+    if (ir_is_captured(proto, scope.locals)) {
+        int exit = IR_NO_JUMP;
+
+        ir_build_condition(context, proto, condition, true, &exit);
+        ir_close_captured(proto, scope.locals);
+        ir_build_jump(context, proto, &back);
+        ir_patch_jumps(context, proto, exit, ir_label(proto));
+        ir_close_captured(proto, scope.locals);
+    } else
+        ir_build_condition(context, proto, condition, false, &back);
+
+    ir_patch_jumps(context, proto, back, body);
+    ir_close_locals(proto, scope.locals);
+    ir_free_register(context, proto, proto->top_register - top);
+    ir_patch_jumps(context, proto, scope.breaks, ir_label(proto));
+}
+
+/* ir_build_break() -- builds a break statement, a jump past the end of the innermost loop
+ *      args: ir context, ir proto
+ *      rets: none
+ */
+static void ir_build_break(struct ir_context *context, struct ir_proto *proto)
+{
+    struct ir_loop *loop = proto->loop;
+
+    if (loop == NULL)
+        return;
+
+    /* The locals of the loop go out of scope */
+    ir_close_captured(proto, loop->locals);
+    ir_build_jump(context, proto, &loop->breaks);
+}
+
+/* ir_build_function() -- builds a function body into a new child proto and creates a closure of
+ * it in a new register at the top of the stack
+ *      args: ir context, ir proto, function body node
+ *      rets: none
+ *
+ * Note: The parameters are the first locals of the child, so the arguments the caller pushed are
+ * already in place and fixed arity functions need no OP_VARARGPREP.
+ */
+static void ir_build_function(struct ir_context *context, struct ir_proto *proto,
+                              struct node *node)
+{
+    struct node *params = node->data.function_body.exprlist;
+    struct node *names = params != NULL ? params->data.parameter_list.namelist : NULL;
+    struct ir_proto *p = ir_proto();
+    int count = 0;
+
+    p->parent = proto;
+    p->is_vararg = params != NULL && params->data.parameter_list.vararg != NULL;
+    p->line_defined = node->location.first_line;
+    p->last_line_defined = node->location.last_line;
+    p->code->line = p->line_defined;
+
+    /* Declare the parameters in source order */
+    while (names != NULL) {
+        struct node *name = names;
+
+        if (names->type == NODE_NAME_LIST) {
+            name = names->data.name_list.name;
+            names = names->data.name_list.init;
+        } else
+            names = NULL;
+
+        if (name->type == NODE_TYPE_ANNOTATION)
+            name = name->data.type_annotation.identifier;
+
+        ir_local(context, p, name->data.identifier.s);
+        count++;
+    }
+
+    p->parameters_size = count;
+    ir_allocate_register(context, p, count);
+
+    if (p->is_vararg)
+        ir_append(p->code, ir_instruction_ABC(OP_VARARGPREP, count, 0, 0));
+
+    ir_build_proto(context, p, node->data.function_body.body);
+
+    /* The implicit return belongs to the end of the function */
+    p->code->line = node->location.last_line;
+    ir_append(p->code, ir_instruction_ABC(OP_RETURN, 0, 1, 0));
+
+    ir_proto_append(proto->protos, p);
+    ir_append(proto->code, ir_instruction_AD(OP_CLOSURE, ir_allocate_register(context, proto, 1),
+                                             proto->protos->size - 1));
+
+    /* The upvalues are only known once the body is built */
+    for (int i = 0; i < p->upvalues_size; i++) {
+        struct ir_upvalue *upvalue = &p->upvalues[i];
+        ir_append(proto->code, ir_instruction_sub(CAPTURE(upvalue->kind, upvalue->index)));
+    }
+}
+
+/* ir_build_return() -- builds a return statement, returning a single call becomes a tail call
+ *      args: ir context, ir proto, return statement node
+ *      rets: none
+ */
+static void ir_build_return(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    struct node *values = node->data.return_statement.exprlist;
+    uint8_t base = proto->top_register;
+
+    if (values->type == NODE_NIL) {
+        /* A bare return */
+        ir_append(proto->code, ir_instruction_ABC(OP_RETURN, 0, 1, 0));
+        return;
+    }
+
+    struct symbol *symbol;
+    struct node *known = values->type == NODE_CALL
+                             ? ir_find_function(proto, values->data.call.prefix_expression, &symbol)
+                             : NULL;
+    struct node *inlined = NULL;
+
+    if (known != NULL && !ir_list_open(values->data.call.args)) {
+        int nodes = feedback_inline_nodes(context->feedback, proto->code->line);
+        inlined = ir_inline_expression(context, known, symbol, nodes);
+    }
+
+    /* Returning an inlined call returns its single value, unless that is a call itself */
+    if (values->type == NODE_CALL && (inlined == NULL || inlined->type == NODE_CALL)) {
+        struct node *args = values->data.call.args;
+
+        ir_build_proto(context, proto, values->data.call.prefix_expression);
+        int b = ir_build_arguments(context, proto, args);
+
+        /* The callee takes over the frame and returns all of its results to our caller */
+        ir_append(proto->code, ir_instruction_ABC(OP_TAILCALL, base, b, 0));
+        ir_append(proto->code, ir_instruction_ABC(OP_RETURN, base, 0, 0));
+        ir_free_register(context, proto, proto->top_register - base);
+        return;
+    }
+
+    int local = ir_reference_local(proto, values);
+
+    if (local >= 0) {
+        /* A local is returned in place */
+        ir_append(proto->code, ir_instruction_ABC(OP_RETURN, local, 2, 0));
+        return;
+    }
+
+    /* A call or `...' last returns all of its values, the same way they are passed */
+    int b = ir_build_arguments(context, proto, values);
+
+    ir_append(proto->code, ir_instruction_ABC(OP_RETURN, base, b, 0));
+    ir_free_register(context, proto, proto->top_register - base);
+}
+
+static void ir_build_node(struct ir_context *context, struct ir_proto *proto, struct node *node)
+{
+    switch (node->type) {
+        case NODE_EXPRESSION_STATEMENT: {
+            struct node *expression = node->data.expression_statement.expression;
+            uint8_t base = proto->top_register;
+
+            /* The results of a statement are not used */
+            if (expression->type == NODE_CALL)
+                ir_build_call(context, proto, expression, 0);
+            else
+                ir_build_proto(context, proto, expression);
+
+            ir_free_register(context, proto, proto->top_register - base);
+            break;
+        }
+        case NODE_CALL: {
+            ir_build_call(context, proto, node, 1);
+            break;
+        }
+        case NODE_LOCAL: {
+            ir_build_local(context, proto, node);
+            break;
+        }
+        case NODE_ASSIGNMENT: {
+            ir_build_assignment(context, proto, node);
+            break;
+        }
+        case NODE_NUMERICFORLOOP: {
+            ir_build_numeric_for(context, proto, node);
+            break;
+        }
+        case NODE_IF: {
+            ir_build_if(context, proto, node);
+            break;
+        }
+        case NODE_WHILELOOP: {
+            ir_build_while(context, proto, node);
+            break;
+        }
+        case NODE_REPEATLOOP: {
+            ir_build_repeat(context, proto, node);
+            break;
+        }
+        case NODE_BREAK: {
+            ir_build_break(context, proto);
+            break;
+        }
+        case NODE_BINARY_OPERATION: {
+            ir_build_binary(context, proto, node->data.binary_operation.operation,
+                            node->data.binary_operation.left, node->data.binary_operation.right);
+            break;
+        }
+        case NODE_NIL: {
+            uint8_t target = ir_allocate_register(context, proto, 1);
+
+            ir_append(proto->code, ir_instruction_ABC(OP_LOADNIL, target, target, 0));
+            break;
+        }
+        case NODE_STRING: {
+            struct ir_instruction instruction;
+            unsigned int index = ir_constant_string(proto, node->data.string.s);
+
+            instruction =
+                ir_instruction_AD(OP_LOADK, ir_allocate_register(context, proto, 1), index);
+
+            ir_append(proto->code, instruction);
+            break;
+        }
+        case NODE_NAME_REFERENCE: {
+            ir_build_proto(context, proto, node->data.name_reference.identifier);
+            break;
+        }
+        case NODE_NUMBER: {
+            struct ir_instruction instruction, sub;
+
+            if (node->data.number.value <= USHRT_MAX && node->data.number.value >= -USHRT_MAX &&
+                floor(node->data.number.value) == node->data.number.value) {
+                /* Determine whether we have a negative or positive value */
+                const bool is_positive = !signbit(node->data.number.value);
+
+                /* We have a whole number that is large enough to fit in the Du operand */
+                instruction = ir_instruction_ADu(is_positive ? OP_LOADPN : OP_LOADNN,
+                                                 ir_allocate_register(context, proto, 1),
+                                                 fabs(node->data.number.value));
+                ir_append(proto->code, instruction);
+                break;
+            }
+
+            uint32_t index = ir_constant_number(proto, node->data.number.value);
+            /* Each Lua++ instruction (like Lua) must strictly be 32-bits in size, so we need to
+             * account for extremely large programs with massive constant pools */
+            if (index <= UINT16_MAX) {
+                instruction =
+                    ir_instruction_AD(OP_LOADK, ir_allocate_register(context, proto, 1), index);
+
+                ir_append(proto->code, instruction);
+                break;
+            } else {
+                /* Here we use a sub instruction. An operation less instruction that simply stores a
+                 * singular value */
+                instruction =
+                    ir_instruction_AD(OP_LOADKX, ir_allocate_register(context, proto, 1), 0);
+                sub = ir_instruction_sub(index);
+
+                ir_append(proto->code, instruction);
+                ir_append(proto->code, sub);
+                break;
+            }
+        }
+        case NODE_BOOLEAN: {
+            struct ir_instruction instruction = ir_instruction_ABC(OP_LOADBOOL, ir_allocate_register(context, proto, 1), 
+                                                                    node->data.boolean.value, 0);
+            
+            ir_append(proto->code, instruction);
+            break;
+        }
+        case NODE_IDENTIFIER: {
+            struct ir_instruction instruction;
+            int local = ir_find_local(proto, node);
+
+            int upvalue = local < 0 ? ir_find_upvalue(context, proto, node) : -1;
+
+            if (local >= 0) {
+                /* The value of a local is needed in a fresh register (call arguments, etc.) */
+                instruction =
+                    ir_instruction_ABC(OP_MOVE, ir_allocate_register(context, proto, 1), local, 0);
+            } else if (upvalue >= 0) {
+                instruction = ir_instruction_ABC(
+                    OP_GETUPVAL, ir_allocate_register(context, proto, 1), upvalue, 0);
+            } else {
+                /* Anything that is not a local is looked up in the environment */
+                unsigned int index = ir_constant_env(proto, node->data.identifier.s);
+
+                instruction =
+                    ir_instruction_AD(OP_GETENV, ir_allocate_register(context, proto, 1), index);
+            }
+
+            ir_append(proto->code, instruction);
+            break;
+        }
+        case NODE_UNARY_OPERATION: {
+            static const enum opcode opcodes[] = {
+                [UNOP_NEG] = OP_UNM, [UNOP_NOT] = OP_NOT, [UNOP_LEN] = OP_LEN};
+            uint8_t target = proto->top_register;
+            uint8_t b = ir_build_operand(context, proto, node->data.unary_operation.expression);
+
+            ir_free_register(context, proto, proto->top_register - target);
+            ir_append(proto->code,
+                      ir_instruction_ABC(opcodes[node->data.unary_operation.operation],
+                                         ir_allocate_register(context, proto, 1), b, 0));
+            break;
+        }
+        case NODE_EXPRESSION_GROUP: {
+            /* (f()) and (...) keep their first value only */
+            struct node *expression = node->data.expression_group.expression;
+
+            if (expression->type == NODE_CALL)
+                ir_build_call(context, proto, expression, 1);
+            else
+                ir_build_proto(context, proto, expression);
+            break;
+        }
+        case NODE_VARARG: {
+            /* A single value, ir_build_arguments() passes and returns all of them */
+            uint8_t target = ir_allocate_register(context, proto, 1);
+
+            ir_append(proto->code, ir_instruction_ABC(OP_VARARG, target, 2, 0));
+            break;
+        }
+        case NODE_BLOCK:
+            for (int i = 0; i < node->data.block.size; i++)
+                ir_build_proto(context, proto, node->data.block.statements[i]);
+            break;
+        case NODE_FUNCTION_BODY: {
+            ir_build_function(context, proto, node);
+            break;
+        }
+        case NODE_RETURN: {
+            ir_build_return(context, proto, node);
+            break;
+        }
+        case NODE_EXPRESSION_LIST: {
+            ir_build_list(context, proto, node);
+            break;
+        }
+        case NODE_ARRAY_CONSTRUCTOR: {
+            ir_build_array(context, proto, node);
+            break;
+        }
+        case NODE_TABLE_CONSTRUCTOR: {
+            ir_build_table(context, proto, node);
+            break;
+        }
+        case NODE_NAME_INDEX:
+        case NODE_EXPRESSION_INDEX: {
+            struct node *container;
+            bool array;
+
+            ir_index_parts(node, &container);
+
+            /* t.name is looked up like t["name"], typed arrays have no fields */
+            array = node->type == NODE_EXPRESSION_INDEX && ir_array_kind(container) >= 0;
+
+            uint8_t target = proto->top_register;
+            uint8_t b = ir_build_operand(context, proto, container);
+            int field = array ? -1 : ir_index_field(proto, node);
+            enum opcode op = field >= 0 ? OP_GETFIELD : ir_index_opcode(node, false);
+            uint8_t c = field >= 0 ? field : ir_build_key(context, proto, node);
+
+            ir_free_register(context, proto, proto->top_register - target);
+            ir_append(proto->code,
+                      ir_instruction_ABC(op, ir_allocate_register(context, proto, 1), b, c));
+            break;
+        }
+    }
+}
+
+/* ir_build_proto() -- builds a node into a proto
+ *      args: ir context, ir proto, node
+ *      rets: the proto, NULL without a node
+ *
+ * Note: The instructions are given the line of the innermost node that has one, so statements
+ * keep their own line while the nodes the parser makes up without a location inherit it. An
+ * inlined function body takes the line of its call.
+ */
+struct ir_proto *ir_build_proto(struct ir_context *context, struct ir_proto *proto,
+                                struct node *node)
+{
+    if (!node)
+        return NULL;
+
+    int line = proto->code->line;
+    if (node->location.first_line > 0 && context->inlining == 0)
+        proto->code->line = node->location.first_line;
+
+    ir_build_node(context, proto, node);
+
+    proto->code->line = line;
+    return proto;
+}
+
+/* ir_build_main() -- starts the main proto, streaming compilation builds its statements one by
+ * one before ending it (see stream.h)
+ *      args: context
+ *      rets: the main proto
+ */
+struct ir_proto *ir_build_main(struct ir_context *context)
+{
+    struct ir_proto *proto = ir_proto();
+
+    /* Mark this function as a vararg function */
+    proto->is_vararg = true;
+
+    /* Build the initial argument preparation instruction */
+    struct ir_instruction instruction = ir_instruction_ABC(OP_VARARGPREP, 0, 0, 0);
+    ir_append(proto->code, instruction);
+
+    context->main_proto = proto;
+    return proto;
+}
+
+/* ir_build_statement() -- builds a statement at the top level into the main proto
+ *      args: context, statement node
+ *      rets: none
+ */
+void ir_build_statement(struct ir_context *context, struct node *statement)
+{
+    ir_build_proto(context, context->main_proto, statement);
+}
+
+/* ir_build_end() -- ends the main proto
+ *      args: context, last line of the program
+ *      rets: none
+ */
+void ir_build_end(struct ir_context *context, int line)
+{
+    struct ir_proto *proto = context->main_proto;
+
+    /* Build the function exit instruction (return) */
+    proto->code->line = line;
+    ir_append(proto->code, ir_instruction_ABC(OP_RETURN, 0, 1, 0));
+}
+
+/* ir_build() -- will build a new IR proto based on an AST
+ *      args: context, AST node
+ *      rets: new ir section
+ */
+struct ir_proto *ir_build(struct ir_context *context, struct node *node)
+{
+    struct ir_proto *proto = ir_build_main(context);
+
+    /* Build the content of the main block */
+    ir_build_proto(context, proto, node->data.function_body.body);
+
+    ir_build_end(context, node->location.last_line);
+    return proto;
 }
 
-static void ir_print_instruction(FILE *output, struct ir_instruction *instruction)
+static void ir_print_instruction(FILE *output, uint32_t value, enum opcode_mode mode)
 {
-    if (instruction->mode == SUB)
+    if (mode == SUB)
         fprintf(output, "%-10s", " ");
     else
-        fprintf(output, "%-10s", opcode_names[GET_OPCODE(instruction->value)]);
+        fprintf(output, "%-10s", opcode_names[GET_OPCODE(value)]);
 
-    switch (instruction->mode) {
+    switch (mode) {
         case iABC:
-            fprintf(output, "%10d %d %d", GETARG_A(instruction->value),
-                    GETARG_B(instruction->value), GETARG_C(instruction->value));
+            fprintf(output, "%10d %d %d", GETARG_A(value),
+                    GETARG_B(value), GETARG_C(value));
             break;
         case iAD:
-            fprintf(output, "%10d %hu", GETARG_A(instruction->value), GETARG_D(instruction->value));
+            fprintf(output, "%10d %d", GETARG_A(value), GETARG_D(value));
             break;
         case iADu:
-            fprintf(output, "%10d %hu", GETARG_A(instruction->value),
-                    GETARG_Du(instruction->value));
+            fprintf(output, "%10d %hu", GETARG_A(value),
+                    GETARG_Du(value));
             break;
         case iE:
-            fprintf(output, "%10d", GETARG_E(instruction->value));
+            fprintf(output, "%10d", GETARG_E(value));
             break;
         default:
-            fprintf(output, "%10d", instruction->value);
+            fprintf(output, "%10d", value);
             break;
     }
 }
@@ -818,10 +2995,9 @@ void ir_print_proto(FILE *output, struct ir_proto *proto)
     fputc('\n', output);
 
     /* Dump all of the instructions */
-    int count = 1;
-    for (struct ir_instruction *iter = proto->code->first; iter != NULL; iter = iter->next) {
-        fprintf(output, "[%04d]     ", count++);
-        ir_print_instruction(output, iter);
+    for (int i = 0; i < proto->code->size; i++) {
+        fprintf(output, "[%04d]     ", i + 1);
+        ir_print_instruction(output, proto->code->code[i], proto->code->modes[i]);
         fputc('\n', output);
     }
 
@@ -10,17 +10,26 @@
 struct node;
 struct symbol;
 struct symbol_table;
+struct feedback_context;
+
+/* Initial amount of instructions a section has room for */
+#define IR_SECTION_SIZE 16
 
 struct ir_instruction {
     uint32_t value;
 
     enum opcode_mode mode;
-    struct ir_instruction *prev, *next;
 };
 
+/* Contiguous list of instructions, the modes and source lines are stored alongside the
+ * instructions */
 struct ir_section {
-    struct ir_instruction *first, *last;
-    int size;
+    uint32_t *code;
+    enum opcode_mode *modes;
+    int *lines;
+    int size, space;
+
+    int line; /* Line of the node being built, given to the instructions appended */
 };
 
 struct ir_constant {
@@ -40,13 +49,76 @@ struct ir_constant {
     struct ir_constant *prev, *next;
 };
 
+/* Initial amount of slots in the hash index of a constant list */
+#define IR_CONSTANT_INDEX_SIZE 16
+
+/* Entry of the hash index of a constant list. The key is the symbol id of strings, the index of the
+ * name for environment constants and the bits of numbers. */
+struct ir_constant_slot {
+    uint64_t key;
+    int32_t index; /* Index in the constant list, -1 if the slot is empty */
+    constant_t type;
+};
+
 struct ir_constant_list {
     struct ir_constant *first, *last;
     int size;
+
+    /* Open addressing hash index used to deduplicate constants */
+    struct ir_constant_slot *slots;
+    int count, capacity;
 };
 
 struct ir_proto_list;
 
+/* Initial amount of locals a proto has space for */
+#define IR_LOCALS_SIZE 8
+
+/* Most locals a single loop collects in string builders */
+#define IR_BUILDERS_MAX 8
+
+/* Local functions whose body is `return <expression>' with at most IR_INLINE_NODES nodes and
+ * IR_INLINE_PARAMS parameters are inlined, calls nest up to IR_INLINE_DEPTH of them. With a
+ * profile, calls on hot lines take bodies up to IR_INLINE_HOT_NODES (see feedback.h). */
+#define IR_INLINE_NODES 24
+#define IR_INLINE_HOT_NODES 96
+#define IR_INLINE_PARAMS 8
+#define IR_INLINE_DEPTH 4
+
+/* Upvalue of a proto, how OP_CLOSURE captures it from the enclosing proto (see CAPTURE()) */
+struct ir_upvalue {
+    struct symbol *symbol;
+    enum capture_kind kind;
+    uint8_t index; /* Register or upvalue of the enclosing proto */
+};
+
+/* Results of a call that keeps all of them, they end at the top of the stack (C = 0) */
+#define IR_MULTRET (-1)
+
+/* Parameter of a call being inlined, its argument was evaluated into a temporary */
+struct ir_binding {
+    struct symbol *symbol;
+    uint8_t reg;
+};
+
+/* Jumps that are not patched yet form a list through their E operands, each holds the position
+ * of the next one and the last holds IR_NO_JUMP. Offsets and positions have at most 24 bits. */
+#define IR_NO_JUMP (-1)
+#define IR_JUMP_MAX ((1 << 23) - 1)
+
+/* Loop being built, its break statements jump past its end */
+struct ir_loop {
+    int breaks; /* List of the jumps of the break statements */
+    int locals; /* Locals in scope before the loop */
+    struct ir_loop *parent;
+};
+
+/* Instructions a local is in scope for, written to the debug section */
+struct ir_local_range {
+    struct symbol *symbol; /* NULL for hidden locals */
+    int start, end;        /* First instruction and the one after the last, end is -1 in scope */
+};
+
 /* IR function prototypes */
 struct ir_proto {
     /* Information variables */
@@ -54,6 +126,8 @@ struct ir_proto {
     uint8_t parameters_size;
     uint8_t upvalues_size;
     bool is_vararg;
+    int line_defined, last_line_defined; /* Lines of the function, 0 for the main function */
+    uint64_t heat; /* Instructions it ran according to the profile, 0 without one (feedback.h) */
 
     struct ir_proto_list *protos;
     struct ir_constant_list *constant_list;
@@ -61,6 +135,22 @@ struct ir_proto {
 
     /* Variables used within the IR */
     uint8_t top_register;
+    struct symbol **locals;  /* Active locals, the register of a local is its index */
+    bool *captured;          /* Whether a closure captured the local by reference */
+    uint8_t *builders;       /* Register of the string builder of the local in a loop, 0 if none */
+    struct node **functions; /* Body of the local function a local always holds, NULL if none */
+    int locals_size, locals_space;
+    int pending_local; /* Local whose value is the closure being built (local function), or -1 */
+    struct ir_local_range *ranges; /* Every local declared, in order */
+    int ranges_size, ranges_space;
+    struct ir_binding *bindings; /* Parameters of the calls being inlined, innermost last */
+    int bindings_size;
+    struct ir_loop *loop; /* Innermost loop being built, NULL outside of loops */
+    int label;            /* Last instruction a jump lands on, see ir_label() */
+
+    struct ir_proto *parent; /* Enclosing proto, NULL for the main function */
+    struct ir_upvalue *upvalues;
+    int upvalues_space;
     struct ir_proto *prev, *next;
 };
 
@@ -76,12 +166,26 @@ struct ir_context {
     /* What will be serialized */
     struct symbol_table *table;
     struct ir_proto *main_proto;
+    bool strip; /* Leave the debug section (lines and names) out of the bytecode */
+    bool stream; /* Statements are built one by one, a later one may assign any main local */
+    int inlining; /* Calls being inlined into one another */
+    struct feedback_context *feedback; /* Profile of the program, NULL without one */
 };
 
 struct ir_proto *ir_build(struct ir_context *context, struct node *node);
+struct ir_proto *ir_build_main(struct ir_context *context);
+void ir_build_statement(struct ir_context *context, struct node *statement);
+void ir_build_end(struct ir_context *context, int line);
+unsigned int ir_constant_number(struct ir_proto *proto, double value);
+
+struct ir_instruction ir_instruction_ABC(enum opcode op, uint8_t a, uint8_t b, uint8_t c);
+struct ir_instruction ir_instruction_AD(enum opcode op, uint8_t a, int16_t d);
+struct ir_instruction ir_instruction_ADu(enum opcode op, uint8_t a, uint16_t du);
+void ir_remove(struct ir_proto *proto, int index, int count);
+struct ir_proto *ir_build_proto(struct ir_context *context, struct ir_proto *proto,
+                                struct node *node);
 void ir_init(struct ir_context *context);
 
 void ir_print_context(FILE *output, struct ir_context *context);
-struct ir_proto_list *ir_collect_protos(struct ir_proto *main);
 
 #endif
\ No newline at end of file
@@ -3,98 +3,156 @@
  */
 
 #include <assert.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "compiler.h"
+#include "escape.h"
+#include "feedback.h"
+#include "fold.h"
 #include "ir.h"
 #include "lexer.h"
 #include "node.h"
 #include "parser.h"
 #include "symbol.h"
 #include "type.h"
+#include "aot.h"
 #include "codegen.h"
+#include "opt.h"
+#include "stats.h"
+#include "stream.h"
+#include "summary.h"
+#include "util/arena.h"
+#include "util/flexstr.h"
+
+/* Settings shared by every compilation of one luappc run */
+struct options {
+    const char *stage;
+    bool print_stats;
+    bool strip;       /* Leave the debug section out of the bytecode */
+    bool incremental; /* Keep type summaries and skip the inputs that are up to date */
+    bool stream;      /* Compile the program statement by statement, see stream.h */
+    struct opt_context opt;
+    const struct feedback *profile; /* Read from --profile, NULL without one */
+};
+
+/* A single input of a run with several inputs */
+struct job {
+    const char *input;
+    char output[PATH_MAX];
+
+    /* With --incremental, see summary.h */
+    char types[PATH_MAX];   /* Path of the type summary, next to the output */
+    struct summary summary; /* Of the last compilation, the other inputs are checked against it */
+    struct summary next;    /* Filled by the compilation that is running */
+    bool stale;             /* Has to be compiled in the current round */
+    bool failed;            /* The last compilation reported errors */
+    uint64_t hash;          /* summary_hash_file() of the input */
+    char *errors;           /* Errors of the last compilation, held back until they stand */
+    size_t errors_size;
+};
+
+/* Inputs that the worker threads take from, in order */
+struct job_queue {
+    struct options *options;
+    struct job *jobs;
+    int size;
+    atomic_int next;
+    atomic_int failed;
+};
 
 /*  print_summary - prints a quick summary of a pass (elapsed time and number of
  *  errors)
  *      args: pass name, numer of errors, start time
  *      rets: none
  */
-static void print_summary(char *pass, int error_count, clock_t start)
+static void print_summary(const char *pass, int error_count, clock_t start)
 {
     /* Calculate the total time that the pass took (seconds) */
-    double sec = ((clock() - start) * 1000);
+    double sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+    const char *file = compiler_file();
 
-    printf("\n%s encountered %d %s, elapsed time: %lf second(s).\n", pass, error_count,
-           (error_count == 1 ? "error" : "errors"), (sec / 1000000) / 1000);
+    fprintf(compiler_output(), "\n%s%s%s encountered %d %s, elapsed time: %lf second(s).\n",
+            file ? file : "", file ? ": " : "", pass, error_count,
+            (error_count == 1 ? "error" : "errors"), sec);
 }
 
-/*
- * Entrypoint for the compiler.
- *
- * luapp -s [lexer|parser|type|ir|codgen] -o [outputfile] [inputfile]
- *
- * -s : indicates the name of the stage to stop after.
- *      Defaults to the last stage.
- * -o : name of the output file. Defaults to "output.s"
- *
- * You should pass the name of the file to compile.
+/* Long options, --stats has no short form */
+static const struct option long_options[] = {
+    {"stats", no_argument, NULL, 'S'},
+    {"strip", no_argument, NULL, 'D'},
+    {"incremental", no_argument, NULL, 'I'},
+    {"stream", no_argument, NULL, 'T'},
+    {"profile", required_argument, NULL, 'P'},
+    {NULL, 0, NULL, 0},
+};
+
+/*  type_setup - initializes the type checker of a program, the globals of the other inputs are
+ *  known from their summaries and this one gets a new one
+ *      args: options, type context, inputs of the run and the one compiled (NULL for a single
+ *            program)
+ *      rets: 0 on success, -1 if a summary is malformed (the context is destroyed then)
  */
-int main(int argc, char **argv)
+static int type_setup(struct options *options, struct type_context *type_context,
+                      const struct job_queue *queue, struct job *job)
 {
-    int opt, error_count;
-    char *stage, *dot;
-    FILE *input, *output;
-    struct symbol_table symbol_table;
-    yyscan_t lexer;
-    time_t start;
-    struct node *tree;
+    type_init(type_context);
 
-    stage = "codegen";
-    output = stdout;
-    /* Parse the command line args and store them in their corresponding vars */
-    while ((opt = getopt(argc, argv, "o:s:")) != -1) {
-        switch (opt) {
-            case 'o':
-                if (!(output = fopen(optarg, "w"))) {
-                    fprintf(stdout, "Error: Unable to open output file %s: %s\n", optarg,
-                            strerror(errno));
-                    return 1;
-                }
-                break;
-            case 's':
-                stage = optarg;
-                break;
-            case ':':
-            default:
-                putchar('\n');
-                usage();
-                return 0;
-        }
-    }
+    if (job == NULL || !options->incremental)
+        return 0;
 
-    /* Determine if we are using stdin or file in. */
-    if (optind == argc - 1) {
-        /* Check if the input file is a .lpp or .lua file */
-        dot = strrchr(argv[optind], '.');
+    for (int i = 0; i < queue->size; i++) {
+        struct job *other = &queue->jobs[i];
 
-        /* If the given file is of the correct type, init the lexer */
-        if (dot && !strcmp(dot, ".lpp") || !strcmp(dot, ".lua")) {
-            lex_init(&lexer, fopen(argv[optind], "r"));
-        } else {
-            printf("Incorrect file type.\n");
-            return 1;
+        if (other != job && type_import(type_context, &other->summary)) {
+            unhandled_compiler_error("malformed type summary %s", other->types);
+            type_destroy(type_context);
+            return -1;
         }
-    } else if (optind >= argc)
-        lex_init(&lexer, stdin);
-    else {
-        printf("Expected 1 input file, found %d.\n", argc - optind);
-        return 1;
     }
 
+    type_context->summary = &job->next;
+    return 0;
+}
+
+/*  compile_stream - runs every pass up to the requested stage on one program
+ *      args: options, lexer of the program (destroyed), output stream, inputs of the run and the
+ *            one compiled (NULL for a single program)
+ *      rets: 0 on success, 1 if a pass reported errors
+ */
+static int compile_stream(struct options *options, yyscan_t lexer, FILE *output,
+                          const struct job_queue *queue, struct job *job)
+{
+    int error_count;
+    const char *stage = options->stage;
+    struct symbol_table symbol_table;
+    struct ir_context ir_context = {0, &symbol_table};
+    clock_t start;
+    struct node *tree;
+    int status = 1;
+
+    /* The optimizer counts what its rules did for this program only */
+    struct opt_context opt_context = options->opt;
+
+    /* So does the profile, which steers inlining while the IR is built */
+    struct feedback_context feedback_context;
+    feedback_init(&feedback_context, options->profile);
+    ir_context.feedback = &feedback_context;
+
+    struct stats stats;
+    stats_init(&stats);
+
+    /* Every pass allocates the objects of this compilation from a single arena */
+    arena_t arena;
+    arena_init(&arena);
+    arena_use(&arena);
+
     /* Only enable lexer pass */
     if (!strcmp(stage, "lexer")) {
         error_count = 0;
@@ -103,39 +161,89 @@ int main(int argc, char **argv)
         lex_destroy(&lexer);
 
         print_summary("Lexer", error_count, start);
-        return (error_count > 0) ? 1 : 0;
+        status = (error_count > 0) ? 1 : 0;
+        goto done;
     }
 
     error_count = 0;
     start = clock();
-    /* Run the parser, it's needed for all later passes */
+
+    /* The passes up to the IR run on every statement once it is parsed, there is no tree */
+    if (options->stream) {
+        struct type_context type_context = {true, 0};
+        struct fold_context fold_context;
+        struct symbol_context context = {&symbol_table, 0};
+        struct stream_context stream;
+        bool symbols_only = !strcmp("symbol", stage);
+
+        if (type_setup(options, &type_context, queue, job)) {
+            lex_destroy(&lexer);
+            goto done;
+        }
+
+        fold_init(&fold_context);
+        symbol_initialize_table(&symbol_table);
+        ir_context.strip = options->strip;
+        stream_init(&stream, &type_context, &fold_context, &context,
+                    symbols_only ? NULL : &ir_context);
+
+        stats_begin(&stats, "stream");
+        error_count = stream_compile(&stream, lexer);
+        lex_destroy(&lexer);
+        stats_end(&stats);
+        type_destroy(&type_context);
+
+        if (error_count) {
+            print_summary(stream.failed, error_count, start);
+            goto done;
+        }
+
+        if (symbols_only) {
+            symbol_print_table(output, &symbol_table);
+            print_summary("Symbol table", error_count, start);
+            status = 0;
+            goto done;
+        }
+
+        goto built;
+    }
+
+    /* Run the parser, it's needed for all later passes. It pulls its tokens from the lexer, so
+     * both are measured together */
+    stats_begin(&stats, "parser");
     tree = parser_parse(&error_count, lexer);
     lex_destroy(&lexer);
+    stats_end(&stats);
 
     /* Make sure the parser did not return any errors */
     if (tree == NULL) {
         print_summary("Parser", error_count, start);
-        return 1;
+        goto done;
     }
 
     /* If the stage is "parser" print the AST */
     if (!strcmp("parser", stage)) {
         print_ast(output, tree, true);
         print_summary("Parser", error_count, start);
-        return 0;
+        status = 0;
+        goto done;
     }
 
     struct type_context type_context = {true, 0};
-    type_init(&type_context);
 
-    /* Run the parser, it's needed for all later passes */
+    if (type_setup(options, &type_context, queue, job))
+        goto done;
+
+    /* Run the type checker, it's needed for all later passes */
+    stats_begin(&stats, "type");
     type_ast_traversal(&type_context, tree, true);
+    stats_end(&stats);
     error_count = type_context.error_count;
 
     if (error_count) {
         print_summary("Type checker", error_count, start);
         type_destroy(&type_context);
-        return 1;
+        goto done;
     }
 
     /* If the stage is "type" print the type tree */
@@ -143,48 +251,620 @@ int main(int argc, char **argv)
         print_ast(output, tree, true);
         print_summary("Type checker", error_count, start);
         type_destroy(&type_context);
-        return 0;
+        status = 0;
+        goto done;
     }
 
     type_destroy(&type_context);
 
+    struct escape_context escape_context;
+    escape_init(&escape_context);
+
+    /* Keep the fields of tables that never escape in locals, folding can then propagate them */
+    stats_begin(&stats, "escape");
+    escape_ast(&escape_context, tree);
+    stats_end(&stats);
+
+    struct fold_context fold_context;
+    fold_init(&fold_context);
+
+    /* Evaluate constant expressions before anything is turned into instructions */
+    stats_begin(&stats, "fold");
+    fold_ast(&fold_context, tree);
+    stats_end(&stats);
+
+    /* If the stage is "fold" print the folded tree */
+    if (!strcmp("fold", stage)) {
+        print_ast(output, tree, true);
+        printf("\n%d tables replaced by %d locals\n", escape_context.replaced,
+               escape_context.fields);
+        printf("%d operations folded, %d constant locals propagated\n", fold_context.folded,
+               fold_context.propagated);
+        print_summary("Constant folding", 0, start);
+        status = 0;
+        goto done;
+    }
+
     symbol_initialize_table(&symbol_table);
     struct symbol_context context = {&symbol_table, error_count};
 
+    stats_begin(&stats, "symbol");
     symbol_ast_traversal(&context, tree);
+    stats_end(&stats);
     error_count = context.error_count;
 
     if (error_count) {
         print_summary("Symbol table", error_count, start);
-        return 1;
+        goto done;
     }
 
     /* If the stage is "symbol" print the table */
     if (!strcmp("symbol", stage)) {
         symbol_print_table(output, &symbol_table);
         print_summary("Symbol table", error_count, start);
-        return 0;
+        status = 0;
+        goto done;
     }
 
-    struct ir_context ir_context = {0, &symbol_table};
+    ir_context.strip = options->strip;
     ir_init(&ir_context);
 
+    stats_begin(&stats, "ir");
     ir_context.main_proto = ir_build(&ir_context, tree);
+    stats_end(&stats);
     error_count = context.error_count;
 
     if (error_count) {
         print_summary("IR", error_count, start);
-        return 1;
+        goto done;
     }
 
+built:
     /* If the stage is "ir" then print the instructions */
     if (!strcmp("ir", stage)) {
         ir_print_context(output, &ir_context);
         print_summary("IR", error_count, start);
-        return 0;
+        status = 0;
+        goto done;
     }
 
+    start = clock();
+    stats_begin(&stats, "opt");
+    opt_run(&opt_context, &ir_context);
+    stats_end(&stats);
+
+    /* The profile was taken from optimized code, its sites are found in optimized code */
+    stats_begin(&stats, "feedback");
+    feedback_run(&feedback_context, &ir_context);
+    stats_end(&stats);
+
+    /* If the stage is "opt" then print the optimized instructions and what each rule did */
+    if (!strcmp("opt", stage)) {
+        ir_print_context(output, &ir_context);
+        opt_print_summary(output, &opt_context);
+        feedback_print_summary(output, &feedback_context);
+        print_summary("Optimizer", 0, start);
+        status = 0;
+        goto done;
+    }
+
+    /* If the stage is "aot" then write the C translation instead of the bytecode */
+    if (!strcmp("aot", stage)) {
+        aot_write_program(output, &ir_context);
+        status = 0;
+        goto done;
+    }
+
+    stats_begin(&stats, "codegen");
     codegen_write_program(output, &ir_context);
-    fclose(output);
-    return 0;
-}
\ No newline at end of file
+    stats_end(&stats);
+
+    if (options->print_stats)
+        stats_print(stderr, &stats, &ir_context);
+
+    status = 0;
+
+done:
+    /* Release the AST, types, symbols and IR in one go */
+    arena_use(NULL);
+    arena_free(&arena);
+    return status;
+}
+
+/*  is_source_file - checks if a file name has the extension of a lua++ program
+ *      args: file name
+ *      rets: true for .lpp and .lua files
+ */
+static bool is_source_file(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    return dot && (!strcmp(dot, ".lpp") || !strcmp(dot, ".lua"));
+}
+
+/*  job_output_path - builds the output path of an input, its extension is replaced by .bin and
+ *  it's placed in the output directory if one is given. The type summary goes next to it.
+ *      args: job, output directory (NULL to write next to the input)
+ *      rets: 0 on success, -1 if the path is too long
+ */
+static int job_output_path(struct job *job, const char *directory)
+{
+    const char *name = job->input;
+    int len, types;
+
+    if (directory != NULL) {
+        const char *slash = strrchr(name, '/');
+        name = slash ? slash + 1 : name;
+    }
+
+    /* is_source_file() made sure there is an extension */
+    int stem = strrchr(name, '.') - name;
+
+    if (directory != NULL) {
+        len = snprintf(job->output, sizeof(job->output), "%s/%.*s.bin", directory, stem, name);
+        types = snprintf(job->types, sizeof(job->types), "%s/%.*s.types", directory, stem, name);
+    } else {
+        len = snprintf(job->output, sizeof(job->output), "%.*s.bin", stem, name);
+        types = snprintf(job->types, sizeof(job->types), "%.*s.types", stem, name);
+    }
+
+    if (len < 0 || len >= (int)sizeof(job->output))
+        return -1;
+
+    return types < 0 || types >= (int)sizeof(job->types) ? -1 : 0;
+}
+
+/*  compile_input - compiles the input of a job into its output
+ *      args: inputs of the run, job
+ *      rets: 0 on success
+ */
+static int compile_input(const struct job_queue *queue, struct job *job)
+{
+    FILE *input, *output;
+    yyscan_t lexer;
+
+    if (!(input = fopen(job->input, "r"))) {
+        unhandled_compiler_error("unable to open file: %s", strerror(errno));
+        return 1;
+    }
+
+    if (!(output = fopen(job->output, "w"))) {
+        unhandled_compiler_error("unable to open output file %s: %s", job->output,
+                                 strerror(errno));
+        fclose(input);
+        return 1;
+    }
+
+    lex_init(&lexer, input);
+    int status = compile_stream(queue->options, lexer, output, queue, job);
+
+    fclose(input);
+    status |= fclose(output) != 0;
+
+    /* Never leave a partial program behind for the build to pick up */
+    if (status)
+        remove(job->output);
+
+    return status;
+}
+
+/*  compile_job - compiles a single input of a run with several inputs
+ *      args: inputs of the run, job
+ *      rets: 0 on success
+ */
+static int compile_job(const struct job_queue *queue, struct job *job)
+{
+    FILE *errors = NULL;
+
+    compiler_set_file(job->input);
+
+    /* Incremental runs may compile the input again once the inputs it uses were, its errors are
+     * only printed when they stand (see compile_incremental) */
+    if (queue->options->incremental) {
+        free(job->errors);
+        job->errors = NULL;
+        job->errors_size = 0;
+
+        if ((errors = open_memstream(&job->errors, &job->errors_size)) != NULL)
+            compiler_set_output(errors);
+
+        summary_free(&job->next);
+        job->next.hash = job->hash;
+    }
+
+    int status = compile_input(queue, job);
+
+    if (errors != NULL) {
+        compiler_set_output(NULL);
+        fclose(errors);
+    }
+
+    compiler_set_file(NULL);
+    return status;
+}
+
+/*  compile_worker - thread that compiles inputs until the queue is empty
+ *      args: job queue
+ *      rets: NULL
+ */
+static void *compile_worker(void *arg)
+{
+    struct job_queue *queue = arg;
+    int index;
+
+    while ((index = atomic_fetch_add(&queue->next, 1)) < queue->size) {
+        struct job *job = &queue->jobs[index];
+
+        /* Inputs that are up to date are left alone */
+        if (!job->stale)
+            continue;
+
+        if ((job->failed = compile_job(queue, job) != 0))
+            atomic_store(&queue->failed, 1);
+    }
+
+    return NULL;
+}
+
+/*  compile_round - compiles the stale inputs of a run on a pool of threads
+ *      args: job queue, number of threads
+ *      rets: none
+ */
+static void compile_round(struct job_queue *queue, int threads)
+{
+    pthread_t *workers = smalloc(threads * sizeof(pthread_t));
+    int started = 0;
+
+    atomic_store(&queue->next, 0);
+
+    /* The calling thread compiles as well, so a failed pthread_create only costs parallelism */
+    while (started < threads - 1 &&
+           !pthread_create(&workers[started], NULL, compile_worker, queue))
+        started++;
+
+    compile_worker(queue);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+}
+
+/*  job_outdated - checks the globals an input took from the others against what they define now
+ *      args: job queue, job
+ *      rets: true if one of them changed type or is no longer defined
+ */
+static bool job_outdated(const struct job_queue *queue, const struct job *job)
+{
+    for (int i = 0; i < job->summary.imports.size; i++) {
+        const struct summary_entry *import = &job->summary.imports.entries[i];
+        const char *type = NULL;
+
+        /* The first input defining a global provides it, as in type_import() */
+        for (int j = 0; j < queue->size && type == NULL; j++) {
+            if (&queue->jobs[j] != job)
+                type = summary_find(&queue->jobs[j].summary.exports, import->name);
+        }
+
+        if (type == NULL || strcmp(type, import->type))
+            return true;
+    }
+
+    return false;
+}
+
+/*  job_flush - prints the errors the last compilation of an input held back
+ *      args: job
+ *      rets: none
+ */
+static void job_flush(struct job *job)
+{
+    if (job->errors_size > 0)
+        fwrite(job->errors, 1, job->errors_size, stdout);
+
+    free(job->errors);
+    job->errors = NULL;
+    job->errors_size = 0;
+}
+
+/*  compile_incremental - compiles the inputs whose source or imports changed since their summaries
+ *  were written. It goes in rounds: after a round, the inputs using a global that changed type
+ *  are compiled again, and so are those that failed while the globals of another input changed
+ *  (they may have used a global that was not known yet, which happens on the first run).
+ *      args: job queue, number of threads
+ *      rets: 0 if every input compiled
+ */
+static int compile_incremental(struct job_queue *queue, int threads)
+{
+    int status = 0;
+
+    for (int i = 0; i < queue->size; i++) {
+        struct job *job = &queue->jobs[i];
+
+        job->hash = summary_hash_file(job->input);
+        job->stale = summary_read(job->types, &job->summary) || job->summary.hash != job->hash ||
+                     access(job->output, F_OK);
+    }
+
+    /* Every round changes the globals of an input or settles, a cycle of inputs whose types keep
+     * changing ends after as many rounds as there are inputs */
+    for (int round = 0; round <= queue->size; round++) {
+        bool pending = false, changed = false;
+
+        for (int i = 0; i < queue->size; i++) {
+            struct job *job = &queue->jobs[i];
+
+            if (!job->stale && !job->failed && job_outdated(queue, job))
+                job->stale = true;
+
+            pending |= job->stale;
+        }
+
+        if (!pending)
+            break;
+
+        compile_round(queue, threads);
+
+        /* The new summaries replace the old ones once every input of the round is done */
+        for (int i = 0; i < queue->size; i++) {
+            struct job *job = &queue->jobs[i];
+
+            if (!job->stale)
+                continue;
+
+            changed |= !summary_same_exports(&job->summary, &job->next);
+            summary_free(&job->summary);
+            job->summary = job->next;
+            summary_init(&job->next);
+
+            /* A failed input has no summary, so the next run compiles it again */
+            if (job->failed)
+                remove(job->types);
+            else if (summary_write(job->types, &job->summary)) {
+                printf("%s: Error: unable to write type summary %s\n", job->input, job->types);
+                job->failed = true;
+            }
+        }
+
+        for (int i = 0; i < queue->size; i++) {
+            struct job *job = &queue->jobs[i];
+
+            if (!job->stale)
+                continue;
+
+            job->stale = job->failed && changed && round < queue->size;
+            job->failed &= !job->stale;
+
+            if (!job->stale)
+                job_flush(job);
+        }
+    }
+
+    for (int i = 0; i < queue->size; i++) {
+        struct job *job = &queue->jobs[i];
+
+        if (job->stale) {
+            printf("%s: Error: the types of the globals it uses do not settle\n", job->input);
+            remove(job->output);
+            remove(job->types);
+            job->failed = true;
+        }
+
+        status |= job->failed;
+        summary_free(&job->summary);
+        summary_free(&job->next);
+        job_flush(job);
+    }
+
+    return status;
+}
+
+/*  compile_parallel - compiles several inputs on a pool of threads, one output per input
+ *      args: options, inputs, number of inputs, output directory (NULL for none), number of threads
+ *      rets: 0 if every input compiled
+ */
+static int compile_parallel(struct options *options, char **inputs, int size,
+                            const char *directory, int threads)
+{
+    struct job *jobs = smalloc(size * sizeof(struct job));
+    struct job_queue queue = {options, jobs, size};
+    int status;
+
+    memset(jobs, 0, size * sizeof(struct job));
+
+    for (int i = 0; i < size; i++) {
+        jobs[i].input = inputs[i];
+        jobs[i].stale = true;
+
+        if (!is_source_file(inputs[i])) {
+            printf("Incorrect file type: %s\n", inputs[i]);
+            free(jobs);
+            return 1;
+        }
+
+        if (job_output_path(&jobs[i], directory)) {
+            printf("Error: output path of %s is too long\n", inputs[i]);
+            free(jobs);
+            return 1;
+        }
+    }
+
+    if (threads > size)
+        threads = size;
+
+    if (options->incremental)
+        status = compile_incremental(&queue, threads);
+    else {
+        compile_round(&queue, threads);
+        status = atomic_load(&queue.failed);
+    }
+
+    free(jobs);
+    return status;
+}
+
+/*
+ * Entrypoint for the compiler.
+ *
+ * luapp -s [lexer|parser|type|fold|ir|opt|aot|codgen] -o [outputfile] -f [[no-]rule] [--stats]
+ *      [--strip] [--incremental] [--stream] -j [threads] [inputfile...]
+ *
+ * -s : indicates the name of the stage to stop after.
+ *      Defaults to the last stage. "aot" writes C source to build a native module of the
+ *      program with instead of bytecode, see aot.h.
+ * -o : name of the output file. Defaults to "output.s". With several inputs it names the
+ *      directory the outputs go to.
+ * -f : enables or disables (no-) an optimizer rule, "all" toggles every rule.
+ * -j : number of threads used to compile several inputs, defaults to the number of processors.
+ * --stats : writes the time, peak memory and allocations of every pass and the size of every
+ *      proto as JSON to stderr once the program was compiled.
+ * --strip : leaves the debug section (source lines and names of locals and upvalues) out of the
+ *      bytecode, errors then have no line.
+ * --incremental : writes the type summary of every input (summary.h) next to its output, the
+ *      other inputs are checked against it. An input is only compiled again when its source
+ *      changed or a global it uses changed type.
+ * --stream : compiles the program statement by statement instead of parsing it into a single
+ *      tree first, so the memory the tree takes is bounded by the largest statement (see stream.h).
+ *      There is no tree to print, -s needs the symbol stage or a later one.
+ * --profile : compiles the program with the profile luappvm -P wrote for it (see feedback.h):
+ *      table accesses that only saw whole keys read the array part directly, hot lines inline
+ *      larger functions and cold ones none, and the protos that ran come first in the bytecode.
+ *
+ * You should pass the name of the file to compile. Several files are compiled in parallel, each
+ * one into a file with the same name and a .bin extension.
+ */
+int main(int argc, char **argv)
+{
+    int opt;
+    char *output_name = NULL;
+    FILE *output;
+    yyscan_t lexer;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *profile_name = NULL;
+    struct feedback profile;
+
+    struct options options = {"codegen", false, false};
+    opt_init(&options.opt);
+
+    /* Parse the command line args and store them in their corresponding vars */
+    while ((opt = getopt_long(argc, argv, "o:s:f:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                output_name = optarg;
+                break;
+            case 's':
+                options.stage = optarg;
+                break;
+            case 'f': {
+                bool enabled = strncmp(optarg, "no-", 3) != 0;
+
+                if (!opt_toggle(&options.opt, enabled ? optarg : optarg + 3, enabled)) {
+                    printf("Error: unknown optimizer rule %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'j': {
+                char *end;
+                threads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || threads < 1) {
+                    printf("Error: invalid number of threads %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'S':
+                options.print_stats = true;
+                break;
+            case 'D':
+                options.strip = true;
+                break;
+            case 'I':
+                options.incremental = true;
+                break;
+            case 'T':
+                options.stream = true;
+                break;
+            case 'P':
+                profile_name = optarg;
+                break;
+            case ':':
+            default:
+                putchar('\n');
+                usage();
+                return 0;
+        }
+    }
+
+    if (options.stream && (!strcmp(options.stage, "parser") || !strcmp(options.stage, "type") ||
+                           !strcmp(options.stage, "fold"))) {
+        printf("Error: --stream has no tree to print, -s needs the symbol stage or a later one.\n");
+        return 1;
+    }
+
+    /* A profile describes the one program it was taken from */
+    if (profile_name != NULL) {
+        if (argc - optind > 1) {
+            printf("Error: --profile needs a single input file.\n");
+            return 1;
+        }
+
+        if (feedback_read(profile_name, &profile)) {
+            printf("Error: unable to read profile %s\n", profile_name);
+            return 1;
+        }
+
+        options.profile = &profile;
+    }
+
+    /* Several inputs are compiled all the way, printing a stage would mix the programs. So are
+     * incremental runs, which write a summary next to every output. */
+    if (argc - optind > 1 || (options.incremental && argc - optind == 1)) {
+        if (strcmp(options.stage, "codegen") || options.print_stats) {
+            printf("Error: -s and --stats need a single input file without --incremental.\n");
+            return 1;
+        }
+
+        return compile_parallel(&options, argv + optind, argc - optind, output_name,
+                                threads > 0 ? threads : 1);
+    }
+
+    if (output_name == NULL)
+        output = stdout;
+    else if (!(output = fopen(output_name, "w"))) {
+        fprintf(stdout, "Error: Unable to open output file %s: %s\n", output_name,
+                strerror(errno));
+        return 1;
+    }
+
+    /* Determine if we are using stdin or file in. */
+    if (optind == argc - 1) {
+        FILE *input;
+
+        /* If the given file is of the correct type, init the lexer */
+        if (!is_source_file(argv[optind])) {
+            printf("Incorrect file type.\n");
+            return 1;
+        }
+
+        if (!(input = fopen(argv[optind], "r"))) {
+            printf("Error: unable to open file '%s'\n", argv[optind]);
+            return 1;
+        }
+
+        lex_init(&lexer, input);
+    } else
+        lex_init(&lexer, stdin);
+
+    int status = compile_stream(&options, lexer, output, NULL, NULL);
+
+    /* Stages before codegen print to the output as well */
+    if (output != stdout)
+        fclose(output);
+
+    if (options.profile != NULL)
+        feedback_free(&profile);
+
+    return status;
+}
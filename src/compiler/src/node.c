@@ -2,13 +2,60 @@
  *       methods that construct the tree
  */
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "node.h"
 #include "type.h"
+#include "util/arena.h"
 #include "util/flexstr.h"
 
-/* Used for graphviz */
-static int parent_id = 0;
-static int id = 0;
+/* Used for graphviz, every compiler thread numbers its own nodes */
+static _Thread_local int parent_id = 0;
+static _Thread_local int id = 0;
+
+/* Number of nodes created so far by this thread */
+static _Thread_local unsigned int node_total = 0;
+
+/* Arena the nodes and their strings are allocated from, NULL for the arena of the compilation */
+static _Thread_local arena_t *node_arena = NULL;
+
+/*  node_use_arena - selects the arena new nodes are allocated from, streaming compilation gives
+ *  every statement its own so it can be released once it was compiled (see stream.h)
+ *      args: arena (NULL for the arena of the compilation)
+ *      rets: arena selected before
+ */
+arena_t *node_use_arena(arena_t *arena)
+{
+    arena_t *previous = node_arena;
+
+    node_arena = arena;
+    return previous;
+}
+
+/*  node_alloc - allocates memory for a node or one of its strings
+ *      args: number of bytes
+ *      rets: newly allocated memory
+ */
+static void *node_alloc(size_t n)
+{
+    return node_arena != NULL ? arena_alloc(node_arena, n) : amalloc(n);
+}
+
+/*  node_strndup - copies a slice of a string next to the nodes
+ *      args: characters (need not be terminated), number of characters
+ *      rets: the terminated copy
+ */
+static char *node_strndup(const char *s, size_t n)
+{
+    char *res = node_alloc(n + 1);
+
+    memcpy(res, s, n);
+    res[n] = '\0';
+    return res;
+}
 
 /*  node_create - allocate and initialize a generic node
  *      args: location, node type
@@ -18,10 +65,14 @@ static struct node *node_create(YYLTYPE location, enum node_type type)
 {
     struct node *node;
 
-    node = malloc(sizeof(struct node));
+    node = node_alloc(sizeof(struct node));
     /* Ensure that we were able to allocate a new node */
     assert(node != NULL);
 
+    /* Arena memory is not cleared, so make sure unused children are NULL */
+    memset(node, 0, sizeof(struct node));
+    node_total++;
+
     /* Assign the member vars of node struct */
     node->type = type;
     node->location = location;
@@ -57,66 +108,65 @@ struct node *node_number(YYLTYPE location, char *value)
  *      args: location, name of identifier, length of name
  *      rets: identifier node
  */
-struct node *node_identifier(YYLTYPE location, char *value)
+struct node *node_identifier(YYLTYPE location, const char *value, int length)
 {
     struct node *node = node_create(location, NODE_IDENTIFIER);
 
-    /* Set the name by appending all of the characters in value */
-    node->data.identifier.name = strdup(value);
+    /* The name is a slice of the lexer's buffer, copy it once into the arena */
+    node->data.identifier.name = node_strndup(value, length);
 
     return node;
 }
 
 /*  node_string - allocate a node to represent a string
- *      args: location, name of identifier, length of name
+ *      args: location, characters of the string (without quotes), number of characters
  *      rets: string node
  */
-struct node *node_string(YYLTYPE location, char *value)
+struct node *node_string(YYLTYPE location, const char *value, int length)
 {
     struct node *node = node_create(location, NODE_STRING);
-    flexstr_t f;
-
-    /* Initialize the string */
-    fs_init(&f, 0);
+    char *str = node_alloc(length + 1);
+    int used = 0;
 
-    for (int i = 0; value[i] != '\0'; i++) {
+    /* Escape sequences only ever shrink the string, so it is decoded right into its copy */
+    for (int i = 0; i < length; i++) {
         /* Is regular character? */
         if (value[i] != '\\') {
-            fs_addch(&f, value[i]);
+            str[used++] = value[i];
             continue;
         }
         i++;
         /* Handle all escape sequences */
-        switch (value[i]) {
+        switch (i < length ? value[i] : '\0') {
             case 't':
-                fs_addch(&f, '\t');
+                str[used++] = '\t';
                 break;
             case 'n':
-                fs_addch(&f, '\n');
+                str[used++] = '\n';
                 break;
             case 'a':
-                fs_addch(&f, '\a');
+                str[used++] = '\a';
                 break;
             case 'b':
-                fs_addch(&f, '\b');
+                str[used++] = '\b';
                 break;
             case 'f':
-                fs_addch(&f, '\f');
+                str[used++] = '\f';
                 break;
             case 'r':
-                fs_addch(&f, '\r');
+                str[used++] = '\r';
                 break;
             case 'v':
-                fs_addch(&f, '\v');
+                str[used++] = '\v';
                 break;
             case '\\':
-                fs_addch(&f, '\\');
+                str[used++] = '\\';
                 break;
         }
     }
 
-    /* Set the name by appending all of the characters in value */
-    node->data.string.value = fs_getstr(&f);
+    str[used] = '\0';
+    node->data.string.value = str;
     node->node_type = type_basic(TYPE_BASIC_STRING);
 
     return node;
@@ -400,18 +450,48 @@ struct node *node_expression_statement(YYLTYPE location, struct node *expression
     return node;
 }
 
-/*  node_statement_list - allocate a node to represent a statement list
- *      args: location, first statement, next statement
+/*  node_block - allocate a node to represent a statement list
+ *      args: location, first statement (NULL for an empty block)
  *      rets: statement list node
  */
-struct node *node_block(YYLTYPE location, struct node *init, struct node *statement)
+struct node *node_block(YYLTYPE location, struct node *statement)
 {
     struct node *node = node_create(location, NODE_BLOCK);
 
-    node->data.block.init = init;
-    node->data.block.statement = statement;
+    node->data.block.statements = NULL;
+    node->data.block.size = 0;
+    node->data.block.space = 0;
 
-    return node;
+    return statement != NULL ? node_block_append(location, node, statement) : node;
+}
+
+/*  node_block_append - add a statement to the end of a statement list
+ *      args: location of the whole list, statement list node, statement
+ *      rets: statement list node
+ *
+ *  The statements are kept in one array, so the passes iterate a block instead of recursing once
+ *  per statement. The array doubles when it is full, the one it outgrew stays with the nodes.
+ */
+struct node *node_block_append(YYLTYPE location, struct node *block, struct node *statement)
+{
+    assert(block->type == NODE_BLOCK);
+
+    if (block->data.block.size == block->data.block.space) {
+        int space = block->data.block.space > 0 ? block->data.block.space * 2 : 4;
+        struct node **statements = node_alloc(space * sizeof(struct node *));
+
+        if (block->data.block.size > 0)
+            memcpy(statements, block->data.block.statements,
+                   block->data.block.size * sizeof(struct node *));
+
+        block->data.block.statements = statements;
+        block->data.block.space = space;
+    }
+
+    block->data.block.statements[block->data.block.size++] = statement;
+    block->location = location;
+
+    return block;
 }
 
 /*  node_assignment - allocate a node to represent an assignment node
@@ -672,6 +752,249 @@ struct node *node_vararg(YYLTYPE location)
     return node;
 }
 
+/*  node_count - gets the number of nodes created so far
+ *      args: none
+ *      rets: number of nodes
+ */
+unsigned int node_count(void) { return node_total; }
+
+/*  node_is_literal - checks whether a node is a literal that can be copied around freely
+ *      args: node
+ *      rets: true for number, string and boolean literals
+ */
+bool node_is_literal(struct node *node)
+{
+    return node != NULL &&
+           (node->type == NODE_NUMBER || node->type == NODE_STRING || node->type == NODE_BOOLEAN);
+}
+
+/*  node_replace - turns a node into a copy of a literal, the node keeps its location
+ *      args: node to overwrite, literal
+ *      rets: none
+ */
+void node_replace(struct node *node, struct node *literal)
+{
+    assert(node_is_literal(literal));
+
+    node->type = literal->type;
+    node->node_type = literal->node_type;
+    node->data = literal->data;
+}
+
+/*  node_number2str - formats a number like luaO_number2str does in the VM: the fewest digits that
+ *  read back as it, in exponent form when the exponent is below -4 or above 16
+ *      args: buffer of at least 32 bytes, number
+ *      rets: none
+ */
+static void node_number2str(char *s, double d)
+{
+    char buff[32], digits[20];
+    int precision, n = 0, k, exponent;
+    char *p = buff;
+
+    if (signbit(d)) {
+        *s++ = '-';
+        d = -d;
+    }
+    if (d != d || d == HUGE_VAL) {
+        strcpy(s, d != d ? "nan" : "inf");
+        return;
+    }
+
+    for (precision = 0; precision < 16; precision++) {
+        snprintf(buff, sizeof(buff), "%.*e", precision, d);
+        if (strtod(buff, NULL) == d)
+            break;
+    }
+    if (precision == 16)
+        snprintf(buff, sizeof(buff), "%.16e", d);
+    for (; *p != 'e'; p++) {
+        if (*p != '.')
+            digits[n++] = *p;
+    }
+    while (n > 1 && digits[n - 1] == '0')
+        n--;
+    exponent = atoi(p + 1);
+    k = exponent - n + 1;
+
+    if (exponent < -4 || exponent > 16) {
+        *s++ = digits[0];
+        if (n > 1) {
+            *s++ = '.';
+            memcpy(s, digits + 1, n - 1);
+            s += n - 1;
+        }
+        sprintf(s, "e%c%02d", exponent < 0 ? '-' : '+', exponent < 0 ? -exponent : exponent);
+        return;
+    }
+    if (k >= 0) {
+        memcpy(s, digits, n);
+        memset(s + n, '0', k);
+        s += n + k;
+    } else if (exponent >= 0) {
+        memcpy(s, digits, exponent + 1);
+        s[exponent + 1] = '.';
+        memcpy(s + exponent + 2, digits + exponent + 1, n - exponent - 1);
+        s += n + 1;
+    } else {
+        *s++ = '0';
+        *s++ = '.';
+        memset(s, '0', -exponent - 1);
+        s += -exponent - 1;
+        memcpy(s, digits, n);
+        s += n;
+    }
+    *s = '\0';
+}
+
+/*  node_concat_operand - appends a literal operand of `..´ the way the VM converts it
+ *      args: string, number or string node
+ *      rets: none
+ */
+static void node_concat_operand(flexstr_t *f, struct node *node)
+{
+    char buff[32];
+
+    if (node->type == NODE_STRING) {
+        fs_addstr(f, node->data.string.value);
+        return;
+    }
+
+    node_number2str(buff, node->data.number.value);
+    fs_addstr(f, buff);
+}
+
+/*  node_fold_binary - evaluates a binary operation on two literals
+ *      args: binary operation node
+ *      rets: true if the node was replaced by its result
+ */
+static bool node_fold_binary(struct node *node)
+{
+    struct node *left = node->data.binary_operation.left;
+    struct node *right = node->data.binary_operation.right;
+    enum node_binary_operation operation = node->data.binary_operation.operation;
+    double a, b, result;
+    flexstr_t f;
+
+    if (operation == BINOP_CONCAT) {
+        if ((left->type != NODE_STRING && left->type != NODE_NUMBER) ||
+            (right->type != NODE_STRING && right->type != NODE_NUMBER))
+            return false;
+
+        fs_init(&f, 0);
+        node_concat_operand(&f, left);
+        node_concat_operand(&f, right);
+
+        node->type = NODE_STRING;
+        node->data.string.value = node_strndup(fs_getstr(&f), f.fs_used);
+        node->data.string.s = NULL;
+        node->node_type = type_basic(TYPE_BASIC_STRING);
+        fs_free(&f);
+        return true;
+    }
+
+    if (left->type != NODE_NUMBER || right->type != NODE_NUMBER)
+        return false;
+
+    a = left->data.number.value;
+    b = right->data.number.value;
+
+    switch (operation) {
+        case BINOP_ADD:
+            result = a + b;
+            break;
+        case BINOP_SUB:
+            result = a - b;
+            break;
+        case BINOP_MUL:
+            result = a * b;
+            break;
+        case BINOP_DIV:
+            /* Like luac, division by zero is left for the VM */
+            if (b == 0)
+                return false;
+            result = a / b;
+            break;
+        case BINOP_MOD:
+            if (b == 0)
+                return false;
+            result = a - floor(a / b) * b;
+            break;
+        case BINOP_POW:
+            result = pow(a, b);
+            break;
+        default:
+            return false;
+    }
+
+    if (isnan(result))
+        return false;
+
+    node->type = NODE_NUMBER;
+    node->data.number.value = result;
+    node->data.number.overflow = false;
+    node->node_type = type_basic(TYPE_BASIC_NUMBER);
+    return true;
+}
+
+/*  node_fold_unary - evaluates a unary operation on a literal
+ *      args: unary operation node
+ *      rets: true if the node was replaced by its result
+ */
+static bool node_fold_unary(struct node *node)
+{
+    struct node *expression = node->data.unary_operation.expression;
+
+    switch (node->data.unary_operation.operation) {
+        case UNOP_NEG:
+            if (expression->type != NODE_NUMBER)
+                return false;
+
+            node->type = NODE_NUMBER;
+            node->data.number.value = -expression->data.number.value;
+            node->data.number.overflow = false;
+            node->node_type = type_basic(TYPE_BASIC_NUMBER);
+            return true;
+        case UNOP_NOT:
+            if (!node_is_literal(expression))
+                return false;
+
+            /* Only nil and false are falsy, every number and string literal is truthy */
+            node->type = NODE_BOOLEAN;
+            node->data.boolean.value =
+                expression->type == NODE_BOOLEAN && !expression->data.boolean.value;
+            node->node_type = type_basic(TYPE_BASIC_BOOLEAN);
+            return true;
+        case UNOP_LEN:
+            if (expression->type != NODE_STRING)
+                return false;
+
+            node->type = NODE_NUMBER;
+            node->data.number.value = strlen(expression->data.string.value);
+            node->data.number.overflow = false;
+            node->node_type = type_basic(TYPE_BASIC_NUMBER);
+            return true;
+    }
+
+    return false;
+}
+
+/*  node_fold - replaces an operation on literals by its result
+ *      args: binary or unary operation node
+ *      rets: true if the node was folded into a literal
+ */
+bool node_fold(struct node *node)
+{
+    switch (node->type) {
+        case NODE_BINARY_OPERATION:
+            return node_fold_binary(node);
+        case NODE_UNARY_OPERATION:
+            return node_fold_unary(node);
+        default:
+            return false;
+    }
+}
+
 /*  write_node - writes a node to a file in graphviz format
  *      args: output file, name of the node
  *      rets: none
@@ -947,10 +1270,8 @@ void print_ast(FILE *output, struct node *node, bool first)
             previous = parent_id;
             id++;
 
-            print_ast(output, node->data.block.init, false);
-
-            if (node->data.block.statement != NULL)
-                print_ast(output, node->data.block.statement, false);
+            for (int i = 0; i < node->data.block.size; i++)
+                print_ast(output, node->data.block.statements[i], false);
 
             /* Reset parent ID for next node */
             parent_id = previous;
@@ -1221,6 +1542,11 @@ int node_get_size(struct node *node)
             case NODE_EXPRESSION_LIST:
                 node = node->data.expression_list.init;
                 break;
+            default:
+                /* A single element that is not a list */
+                return ++size;
         }
     }
+
+    return size;
 }
\ No newline at end of file
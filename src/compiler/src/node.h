@@ -12,6 +12,7 @@ typedef void *yyscan_t;
 
 #include "compiler.h"
 #include "symbol.h"
+#include "util/arena.h"
 
 struct type;
 
@@ -107,6 +108,8 @@ struct node {
             char *name;
             struct symbol *s;
             bool is_global;
+            bool is_assigned;      /* Local that is assigned after its declaration */
+            struct node *constant; /* Literal value of a local that is never assigned */
         } identifier;
         struct {
             char *value;
@@ -169,8 +172,9 @@ struct node {
             struct node *index;
         } expression_index;
         struct {
-            struct node *init;      /* First statement */
-            struct node *statement; /* Next statement */
+            struct node **statements; /* In source order */
+            int size;
+            int space; /* Number of statements there is room for */
         } block;
         struct {
             struct node *variables;
@@ -248,8 +252,8 @@ static struct node *node_create(YYLTYPE location, enum node_type type);
 
 /* Node expression constructors */
 struct node *node_number(YYLTYPE location, char *value);
-struct node *node_identifier(YYLTYPE location, char *value);
-struct node *node_string(YYLTYPE location, char *value);
+struct node *node_identifier(YYLTYPE location, const char *value, int length);
+struct node *node_string(YYLTYPE location, const char *value, int length);
 struct node *node_boolean(YYLTYPE location, bool value);
 struct node *node_nil(YYLTYPE location);
 struct node *node_type_annotation(YYLTYPE location, struct node *identifier, struct node *type);
@@ -282,7 +286,8 @@ struct node *node_table_constructor(YYLTYPE location, struct node *pairlist);
 
 /* Node statement constructors */
 struct node *node_expression_statement(YYLTYPE location, struct node *expression);
-struct node *node_block(YYLTYPE location, struct node *init, struct node *statement);
+struct node *node_block(YYLTYPE location, struct node *statement);
+struct node *node_block_append(YYLTYPE location, struct node *block, struct node *statement);
 struct node *node_assignment(YYLTYPE location, struct node *variables,
                              enum node_assignment_type type, struct node *values);
 struct node *node_while_loop(YYLTYPE location, struct node *condition, struct node *body);
@@ -305,5 +310,12 @@ void print_ast(FILE *output, struct node *node, bool first);
 /* Helper functions used in other code */
 char *node_to_string(struct node *node);
 int node_get_size(struct node *node);
+unsigned int node_count(void);
+arena_t *node_use_arena(arena_t *arena);
+
+/* Constant folding helpers */
+bool node_is_literal(struct node *node);
+void node_replace(struct node *node, struct node *literal);
+bool node_fold(struct node *node);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,634 @@
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ir.h"
+#include "opt.h"
+#include "util/arena.h"
+
+/* A rule tries to rewrite the code of a proto at a given instruction, it returns whether it did */
+typedef bool (*opt_apply_t)(struct ir_proto *proto, int pc);
+
+struct opt_rule {
+    const char *name;
+    const char *description;
+    opt_apply_t apply;
+};
+
+/* Arithmetic opcodes come in families of six (ADD, SUB, MUL, DIV, MOD, POW) */
+#define OPT_ARITH_COUNT 6
+#define OPT_IN_FAMILY(op, first) ((op) >= (first) && (op) < (first) + OPT_ARITH_COUNT)
+
+/* Random access to the constants of the proto that is being optimized. The constant list only ever
+ * grows while optimizing, so new constants are picked up from where the cache stopped. Every
+ * compiler thread has its own cache. */
+static _Thread_local struct {
+    struct ir_proto *proto;
+    struct ir_constant **constants;
+    int size, space;
+} opt_constants;
+
+/* opt_constant() -- retrieves a constant of a proto by its index
+ *      args: ir proto, index in the constant list
+ *      rets: constant
+ */
+static struct ir_constant *opt_constant(struct ir_proto *proto, int index)
+{
+    struct ir_constant_list *list = proto->constant_list;
+
+    if (opt_constants.proto != proto) {
+        opt_constants.proto = proto;
+        opt_constants.size = 0;
+    }
+
+    if (opt_constants.size < list->size) {
+        if (list->size > opt_constants.space) {
+            int space = list->size * 2;
+            struct ir_constant **constants = amalloc(space * sizeof(struct ir_constant *));
+
+            memcpy(constants, opt_constants.constants,
+                   opt_constants.size * sizeof(struct ir_constant *));
+            opt_constants.constants = constants;
+            opt_constants.space = space;
+        }
+
+        struct ir_constant *iter = opt_constants.size > 0
+                                       ? opt_constants.constants[opt_constants.size - 1]->next
+                                       : list->first;
+
+        for (; iter != NULL; iter = iter->next)
+            opt_constants.constants[opt_constants.size++] = iter;
+    }
+
+    return opt_constants.constants[index];
+}
+
+/* opt_reads() -- determines whether an instruction may read a register
+ *      args: instruction, mode, register
+ *      rets: yes or no (yes for instructions the optimizer does not know)
+ */
+static bool opt_reads(uint32_t i, enum opcode_mode mode, int reg)
+{
+    enum opcode op = GET_OPCODE(i);
+
+    if (mode == SUB)
+        return false;
+
+    if (OPT_IN_FAMILY(op, OP_ADD) || OPT_IN_FAMILY(op, OP_ADDNN))
+        return GETARG_B(i) == reg || GETARG_C(i) == reg;
+    if (OPT_IN_FAMILY(op, OP_ADDK) || OPT_IN_FAMILY(op, OP_ADDNK))
+        return GETARG_B(i) == reg;
+
+    switch (op) {
+        case OP_MOVE:
+        case OP_UNM ... OP_LEN:
+            return GETARG_B(i) == reg;
+        case OP_LOADPN:
+        case OP_LOADNN:
+        case OP_LOADK:
+        case OP_LOADKX:
+        case OP_LOADBOOL:
+        case OP_LOADNIL:
+        case OP_GETENV:
+        case OP_VARARGPREP:
+        case OP_NEWTABLE:
+        case OP_NEWARRAY:
+        case OP_NEWRECORD:
+            return false;
+        case OP_CONCAT:
+            return GETARG_B(i) <= reg && reg <= GETARG_C(i);
+        case OP_SETLIST:
+        case OP_SETARRAYLIST:
+            return GETARG_A(i) <= reg && reg <= GETARG_A(i) + GETARG_B(i);
+        case OP_GETARRAY:
+        case OP_GETARRAYI:
+        case OP_GETTABLE:
+        case OP_GETINDEX:
+            return GETARG_B(i) == reg || GETARG_C(i) == reg;
+        case OP_GETFIELD:
+        case OP_BUILDSTRING:
+            return GETARG_B(i) == reg;
+        case OP_APPEND:
+            return GETARG_A(i) == reg || GETARG_B(i) == reg;
+        case OP_SETFIELD:
+            return GETARG_A(i) == reg || GETARG_C(i) == reg;
+        case OP_SETTABLE:
+        case OP_SETARRAY:
+        case OP_SETARRAYI:
+        case OP_SETINDEX:
+            return GETARG_A(i) == reg || GETARG_B(i) == reg || GETARG_C(i) == reg;
+        case OP_CALL:
+        case OP_CALLDIRECT:
+            /* The function and its arguments, or everything above it with B = 0 */
+            return reg >= GETARG_A(i) && (GETARG_B(i) == 0 || reg < GETARG_A(i) + GETARG_B(i));
+        case OP_RETURN:
+            return reg >= GETARG_A(i) && (GETARG_B(i) == 0 || reg < GETARG_A(i) + GETARG_B(i) - 1);
+        default:
+            return true;
+    }
+}
+
+/* opt_writes() -- determines whether an instruction overwrites a register without depending on
+ * its old value
+ *      args: instruction, mode, register
+ *      rets: yes or no (no for instructions the optimizer does not know)
+ */
+static bool opt_writes(uint32_t i, enum opcode_mode mode, int reg)
+{
+    enum opcode op = GET_OPCODE(i);
+
+    if (mode == SUB)
+        return false;
+
+    if (OPT_IN_FAMILY(op, OP_ADD) || OPT_IN_FAMILY(op, OP_ADDNN) || OPT_IN_FAMILY(op, OP_ADDK) ||
+        OPT_IN_FAMILY(op, OP_ADDNK))
+        return GETARG_A(i) == reg;
+
+    switch (op) {
+        case OP_MOVE:
+        case OP_UNM ... OP_LEN:
+        case OP_LOADPN:
+        case OP_LOADNN:
+        case OP_LOADK:
+        case OP_LOADKX:
+        case OP_LOADBOOL:
+        case OP_GETENV:
+        case OP_CONCAT:
+        case OP_NEWTABLE:
+        case OP_NEWARRAY:
+        case OP_GETARRAY:
+        case OP_GETARRAYI:
+        case OP_NEWRECORD:
+        case OP_GETTABLE:
+        case OP_GETINDEX:
+        case OP_GETFIELD:
+        case OP_BUILDSTRING:
+            return GETARG_A(i) == reg;
+        case OP_LOADNIL:
+            return GETARG_A(i) <= reg && reg <= GETARG_B(i);
+        default:
+            return false;
+    }
+}
+
+/* opt_is_dead() -- determines whether the value of a register is never read from an instruction on
+ *      args: ir proto, first instruction, register
+ *      rets: yes or no
+ *
+ * Note: The optimizer only runs over straight-line code (see opt_has_branches), so a value that
+ * is not read before it is overwritten or the code ends is dead.
+ */
+static bool opt_is_dead(struct ir_proto *proto, int pc, int reg)
+{
+    struct ir_section *code = proto->code;
+
+    for (; pc < code->size; pc++) {
+        if (opt_reads(code->code[pc], code->modes[pc], reg))
+            return false;
+        if (opt_writes(code->code[pc], code->modes[pc], reg))
+            return true;
+    }
+
+    return true;
+}
+
+/* opt_number() -- determines whether an instruction loads a literal number
+ *      args: ir proto, instruction, the number
+ *      rets: yes or no
+ */
+static bool opt_number(struct ir_proto *proto, uint32_t i, double *value)
+{
+    switch (GET_OPCODE(i)) {
+        case OP_LOADPN:
+            *value = (double)GETARG_Du(i);
+            return true;
+        case OP_LOADNN:
+            *value = -(double)GETARG_Du(i);
+            return true;
+        case OP_LOADK: {
+            if (GETARG_D(i) < 0)
+                return false;
+
+            struct ir_constant *constant = opt_constant(proto, GETARG_D(i));
+
+            if (constant->type != CONSTANT_NUMBER)
+                return false;
+
+            *value = constant->data.number.value;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/* opt_set() -- replaces an instruction
+ *      args: ir proto, index of the instruction, new instruction
+ *      rets: none
+ */
+static void opt_set(struct ir_proto *proto, int pc, struct ir_instruction instruction)
+{
+    proto->code->code[pc] = instruction.value;
+    proto->code->modes[pc] = instruction.mode;
+}
+
+/* opt_load_number() -- replaces an instruction by a load of a number
+ *      args: ir proto, index of the instruction, target register, number
+ *      rets: whether the number could be loaded by a single instruction
+ */
+static bool opt_load_number(struct ir_proto *proto, int pc, uint8_t target, double value)
+{
+    if (floor(value) == value && fabs(value) <= USHRT_MAX) {
+        /* -0 has to keep its sign, so it is loaded as a negative number */
+        if (signbit(value))
+            opt_set(proto, pc, ir_instruction_ADu(OP_LOADNN, target, -value));
+        else
+            opt_set(proto, pc, ir_instruction_ADu(OP_LOADPN, target, value));
+
+        return true;
+    }
+
+    unsigned int index = ir_constant_number(proto, value);
+    if (index > INT16_MAX)
+        return false;
+
+    opt_set(proto, pc, ir_instruction_AD(OP_LOADK, target, index));
+    return true;
+}
+
+/* opt_move() -- removes `MOVE A A`
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_move(struct ir_proto *proto, int pc)
+{
+    uint32_t i = proto->code->code[pc];
+
+    if (proto->code->modes[pc] == SUB || GET_OPCODE(i) != OP_MOVE || GETARG_A(i) != GETARG_B(i))
+        return false;
+
+    ir_remove(proto, pc, 1);
+    return true;
+}
+
+/* opt_dead_load() -- removes a load whose register is overwritten by the next instruction
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_dead_load(struct ir_proto *proto, int pc)
+{
+    struct ir_section *code = proto->code;
+    uint32_t i = code->code[pc];
+    int size = 1;
+
+    if (code->modes[pc] == SUB)
+        return false;
+
+    /* Only loads without side effects can go (GETENV may run an __index metamethod) */
+    switch (GET_OPCODE(i)) {
+        case OP_LOADKX:
+            size = 2;
+            /* fallthrough */
+        case OP_MOVE:
+        case OP_LOADPN:
+        case OP_LOADNN:
+        case OP_LOADK:
+        case OP_LOADBOOL:
+            break;
+        case OP_LOADNIL:
+            if (GETARG_A(i) != GETARG_B(i))
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    int next = pc + size;
+    if (next >= code->size)
+        return false;
+
+    int reg = GETARG_A(i);
+    if (opt_reads(code->code[next], code->modes[next], reg) ||
+        !opt_writes(code->code[next], code->modes[next], reg))
+        return false;
+
+    ir_remove(proto, pc, size);
+    return true;
+}
+
+/* opt_arithk() -- turns `LOAD t, literal; ARITH A B t` into `ARITHK A B k`
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_arithk(struct ir_proto *proto, int pc)
+{
+    struct ir_section *code = proto->code;
+
+    if (pc + 1 >= code->size || code->modes[pc] == SUB)
+        return false;
+
+    uint32_t load = code->code[pc], arith = code->code[pc + 1];
+    enum opcode op = GET_OPCODE(arith);
+    enum opcode fused;
+
+    if (OPT_IN_FAMILY(op, OP_ADD))
+        fused = op - OP_ADD + OP_ADDK;
+    else if (OPT_IN_FAMILY(op, OP_ADDNN))
+        fused = op - OP_ADDNN + OP_ADDNK;
+    else
+        return false;
+
+    int t = GETARG_A(load);
+    int b = GETARG_B(arith), c = GETARG_C(arith);
+
+    /* The constant has to be the right operand, addition and multiplication may swap operands */
+    if (c != t) {
+        bool commutative = op == OP_ADD || op == OP_MUL || op == OP_ADDNN || op == OP_MULNN;
+
+        if (!commutative || b != t)
+            return false;
+
+        b = c;
+    } else if (b == t)
+        return false;
+
+    /* Find the constant index of the loaded literal */
+    unsigned int k;
+    double value;
+
+    switch (GET_OPCODE(load)) {
+        case OP_LOADK:
+            k = GETARG_D(load);
+            break;
+        case OP_LOADPN:
+        case OP_LOADNN:
+            opt_number(proto, load, &value);
+            k = ir_constant_number(proto, value);
+            break;
+        default:
+            return false;
+    }
+
+    if (k > UCHAR_MAX)
+        return false;
+
+    /* The loaded register must not be needed afterwards */
+    if (GETARG_A(arith) != t && !opt_is_dead(proto, pc + 2, t))
+        return false;
+
+    opt_set(proto, pc + 1, ir_instruction_ABC(fused, GETARG_A(arith), b, k));
+    ir_remove(proto, pc, 1);
+    return true;
+}
+
+/* opt_fold() -- turns `LOAD t, literal; ARITHK A t k` into a load of the result
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_fold(struct ir_proto *proto, int pc)
+{
+    struct ir_section *code = proto->code;
+
+    if (pc + 1 >= code->size || code->modes[pc] == SUB)
+        return false;
+
+    uint32_t load = code->code[pc], arith = code->code[pc + 1];
+    enum opcode op = GET_OPCODE(arith);
+    int family;
+
+    if (OPT_IN_FAMILY(op, OP_ADDK))
+        family = op - OP_ADDK;
+    else if (OPT_IN_FAMILY(op, OP_ADDNK))
+        family = op - OP_ADDNK;
+    else
+        return false;
+
+    int t = GETARG_A(load);
+    struct ir_constant *constant = opt_constant(proto, GETARG_C(arith));
+    double left, right, result;
+
+    if (GETARG_B(arith) != t || !opt_number(proto, load, &left) ||
+        constant->type != CONSTANT_NUMBER)
+        return false;
+
+    if (GETARG_A(arith) != t && !opt_is_dead(proto, pc + 2, t))
+        return false;
+
+    right = constant->data.number.value;
+
+    /* Same semantics as the VM (luai_num* in luaconf.h) */
+    switch (family) {
+        case 0:
+            result = left + right;
+            break;
+        case 1:
+            result = left - right;
+            break;
+        case 2:
+            result = left * right;
+            break;
+        case 3:
+            result = left / right;
+            break;
+        case 4:
+            result = left - floor(left / right) * right;
+            break;
+        default:
+            result = pow(left, right);
+            break;
+    }
+
+    if (!opt_load_number(proto, pc + 1, GETARG_A(arith), result))
+        return false;
+
+    ir_remove(proto, pc, 1);
+    return true;
+}
+
+/* opt_dead_code() -- removes everything after a return
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_dead_code(struct ir_proto *proto, int pc)
+{
+    struct ir_section *code = proto->code;
+
+    if (code->modes[pc] == SUB || GET_OPCODE(code->code[pc]) != OP_RETURN || pc + 1 >= code->size)
+        return false;
+
+    ir_remove(proto, pc + 1, code->size - pc - 1);
+    return true;
+}
+
+/* opt_callenvk() -- turns `GETENV A b; LOAD A+1 literal; CALL A 2 1` into `CALLENVK A b c`
+ *      args: ir proto, index of the instruction
+ *      rets: whether the code changed
+ */
+static bool opt_callenvk(struct ir_proto *proto, int pc)
+{
+    struct ir_section *code = proto->code;
+
+    if (pc + 2 >= code->size || code->modes[pc] == SUB || code->modes[pc + 1] == SUB ||
+        code->modes[pc + 2] == SUB)
+        return false;
+
+    uint32_t getenv = code->code[pc], load = code->code[pc + 1], call = code->code[pc + 2];
+    int a = GETARG_A(getenv);
+
+    if (GET_OPCODE(getenv) != OP_GETENV || GET_OPCODE(call) != OP_CALL)
+        return false;
+
+    /* A single argument right above the function and no results */
+    if (GETARG_A(load) != a + 1 || GETARG_A(call) != a || GETARG_B(call) != 2 ||
+        GETARG_C(call) != 1)
+        return false;
+
+    int b = GETARG_D(getenv), c;
+    double value;
+
+    /* Literal numbers are moved into the constant list */
+    switch (GET_OPCODE(load)) {
+        case OP_LOADK:
+            c = GETARG_D(load);
+            break;
+        case OP_LOADPN:
+        case OP_LOADNN:
+            opt_number(proto, load, &value);
+            c = ir_constant_number(proto, value);
+            break;
+        default:
+            return false;
+    }
+
+    if (b < 0 || b > UCHAR_MAX || c < 0 || c > UCHAR_MAX)
+        return false;
+
+    opt_set(proto, pc, ir_instruction_ABC(OP_CALLENVK, a, b, c));
+    ir_remove(proto, pc + 1, 2);
+    return true;
+}
+
+static const struct opt_rule opt_rules[OPT_RULE_COUNT] = {
+    [OPT_MOVE] = {"move", "remove moves of a register onto itself", opt_move},
+    [OPT_DEAD_LOAD] = {"dead-load", "remove loads overwritten before use", opt_dead_load},
+    [OPT_ARITHK] = {"arithk", "fuse literal loads into arithmetic", opt_arithk},
+    [OPT_FOLD] = {"fold", "evaluate arithmetic on literals", opt_fold},
+    [OPT_DEAD_CODE] = {"dead-code", "remove instructions after a return", opt_dead_code},
+    [OPT_CALLENVK] = {"callenvk", "fuse global calls with a constant argument", opt_callenvk},
+};
+
+/* opt_init() -- initializes an optimizer context with every rule enabled
+ *      args: context
+ *      rets: none
+ */
+void opt_init(struct opt_context *context)
+{
+    for (int i = 0; i < OPT_RULE_COUNT; i++) {
+        context->enabled[i] = true;
+        context->count[i] = 0;
+    }
+}
+
+/* opt_toggle() -- enables or disables a rule by its name ("all" for every rule)
+ *      args: context, name of the rule, whether it should run
+ *      rets: false if there is no rule with this name
+ */
+bool opt_toggle(struct opt_context *context, const char *name, bool enabled)
+{
+    bool all = !strcmp(name, "all"), found = all;
+
+    for (int i = 0; i < OPT_RULE_COUNT; i++)
+        if (all || !strcmp(name, opt_rules[i].name)) {
+            context->enabled[i] = enabled;
+            found = true;
+        }
+
+    return found;
+}
+
+/* opt_has_branches() -- determines whether a proto contains instructions that jump
+ *      args: ir proto
+ *      rets: yes or no
+ */
+static bool opt_has_branches(struct ir_proto *proto)
+{
+    for (int pc = 0; pc < proto->code->size; pc++) {
+        if (proto->code->modes[pc] == SUB)
+            continue;
+
+        switch (GET_OPCODE(proto->code->code[pc])) {
+            case OP_JMP:
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_TEST:
+            case OP_TESTSET:
+            case OP_FORLOOP:
+            case OP_FORPREP:
+            case OP_TFORLOOP:
+            case OP_FORLOOPINC:
+            case OP_FORLOOPDEC:
+            case OP_EQK ... OP_GENK:
+                return true;
+            default:
+                break;
+        }
+    }
+
+    return false;
+}
+
+/* opt_proto() -- applies the enabled rules to a proto and its children until nothing changes
+ *      args: context, ir proto
+ *      rets: none
+ */
+static void opt_proto(struct opt_context *context, struct ir_proto *proto)
+{
+    /* Removing instructions would break jump offsets, those protos are left alone for now */
+    if (!opt_has_branches(proto)) {
+        bool changed;
+
+        do {
+            changed = false;
+
+            for (int pc = 0; pc < proto->code->size; pc++)
+                for (int i = 0; i < OPT_RULE_COUNT && pc < proto->code->size; i++)
+                    if (context->enabled[i] && opt_rules[i].apply(proto, pc)) {
+                        context->count[i]++;
+                        changed = true;
+                    }
+        } while (changed);
+    }
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        opt_proto(context, iter);
+}
+
+/* opt_run() -- optimizes every proto of a program
+ *      args: context, ir context
+ *      rets: none
+ */
+void opt_run(struct opt_context *context, struct ir_context *ir)
+{
+    opt_proto(context, ir->main_proto);
+
+    /* The constant cache points into the arena of this compilation */
+    memset(&opt_constants, 0, sizeof(opt_constants));
+}
+
+/* opt_print_summary() -- prints how often each rule fired
+ *      args: output stream, context
+ *      rets: none
+ */
+void opt_print_summary(FILE *output, struct opt_context *context)
+{
+    fputs("optimizations:\n", output);
+
+    for (int i = 0; i < OPT_RULE_COUNT; i++)
+        fprintf(output, "  %-10s %8s %6d   %s\n", opt_rules[i].name,
+                context->enabled[i] ? "" : "disabled", context->count[i],
+                opt_rules[i].description);
+
+    fputc('\n', output);
+}
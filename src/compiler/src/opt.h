@@ -0,0 +1,39 @@
+/*
+ *  opt.h
+ *
+ *  Peephole optimizer that runs between the IR builder and code generation. Every rule looks at a
+ *  small window of instructions of a proto and rewrites it in place, the optimizer keeps applying
+ *  the enabled rules until none of them fire anymore. Each rule counts how often it fired so the
+ *  effect of a single rule can be measured (see `luappc -s opt`).
+ */
+
+#ifndef _OPT_H
+#define _OPT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct ir_context;
+
+enum opt_rule_id {
+    OPT_MOVE,      /* removes moves of a register onto itself */
+    OPT_DEAD_LOAD, /* removes loads that are overwritten before they are read */
+    OPT_ARITHK,    /* fuses a load of a constant into the arithmetic that uses it */
+    OPT_FOLD,      /* evaluates arithmetic on literal numbers at compile time */
+    OPT_DEAD_CODE, /* removes instructions after a return */
+    OPT_CALLENVK,  /* fuses calls of globals with a single constant argument (superinstruction) */
+    OPT_RULE_COUNT
+};
+
+struct opt_context {
+    bool enabled[OPT_RULE_COUNT];
+    int count[OPT_RULE_COUNT]; /* Number of times each rule fired */
+};
+
+void opt_init(struct opt_context *context);
+bool opt_toggle(struct opt_context *context, const char *name, bool enabled);
+
+void opt_run(struct opt_context *context, struct ir_context *ir);
+void opt_print_summary(FILE *output, struct opt_context *context);
+
+#endif
@@ -3,6 +3,12 @@
 
 #include "lexer.yy.h"
 
+/* Receives the statements of the main chunk one by one, see stream.h */
+struct parser_stream {
+    void (*statement)(struct parser_stream *stream, struct node *statement);
+};
+
 struct node *parser_parse(int *error_count, yyscan_t lexer);
+struct node *parser_parse_stream(int *error_count, yyscan_t lexer, struct parser_stream *stream);
 
 #endif
\ No newline at end of file
@@ -9,8 +9,13 @@
 %parse-param {YYSTYPE *root}
 %parse-param {int *error_count}
 %parse-param {yyscan_t lexer}
+%parse-param {struct parser_stream *stream}
 %token-table
 
+%code requires {
+    struct parser_stream;
+}
+
 %{
     #include <stdio.h>
 
@@ -25,11 +30,14 @@
 
     #include "parser.tab.h"
     #include "lexer.yy.h"
+    #include "parser.h"
 
     #define YYERROR_VERBOSE
     static void yyerror(YYLTYPE *loc, YYSTYPE *root,
                       int *error_count, yyscan_t scanner,
+                      struct parser_stream *stream,
                       char const *s);
+    static struct node *parser_stream(struct parser_stream *stream, struct node *statement);
 %}
 
 /* Values */
@@ -62,6 +70,7 @@
 
 /* Type annotations */
 %token TNUMBER_T
+%token TINTEGER_T
 %token TSTRING_T
 %token TBOOLEAN_T
 %token TANY_T
@@ -107,10 +116,15 @@
 
 %start program
 
-%left LESS_THAN_T GREATER_THAN_T GREATER_EQUAL_T LESS_EQUAL_T NOT_EQUAL_T DOUBLE_EQUAL_T AND_T OR_T
+/* The precedence of the operators of Lua, lowest first */
+%left OR_T
+%left AND_T
+%left LESS_THAN_T GREATER_THAN_T GREATER_EQUAL_T LESS_EQUAL_T NOT_EQUAL_T DOUBLE_EQUAL_T
+%right CONCAT_T
 %left PLUS_T MINUS_T
-%left ASTERISK_T SLASH_T
-%left CARROT_T PERCENT_T
+%left ASTERISK_T SLASH_T PERCENT_T
+%nonassoc UNARY
+%right CARROT_T
 
 %%
 
@@ -149,11 +163,11 @@ binary_operation
 
 
 unary_operation
-  : MINUS_T expression
+  : MINUS_T expression %prec UNARY
       { $$ = node_unary_operation(@$, UNOP_NEG, $2); }
-  | NOT_T expression
+  | NOT_T expression %prec UNARY
       { $$ = node_unary_operation(@$, UNOP_NOT, $2); }
-  | POUND_T expression
+  | POUND_T expression %prec UNARY
       { $$ = node_unary_operation(@$, UNOP_LEN, $2); }
 ;
 
@@ -187,6 +201,8 @@ type_list
 type 
     : TNUMBER_T
         { $$ = node_type(@$, type_basic(TYPE_BASIC_NUMBER)); }
+    | TINTEGER_T
+        { $$ = node_type(@$, type_basic(TYPE_BASIC_INTEGER)); }
     | TSTRING_T
         { $$ = node_type(@$, type_basic(TYPE_BASIC_STRING)); }
     | TBOOLEAN_T
@@ -226,7 +242,7 @@ pair_list
         { $$ = NULL; }
     | pair
     | pair COMMA_T pair_list
-        { $$ = node_expression_list(@$, $1, $3); }
+        { $$ = node_expression_list(@$, $3, $1); }
 ;
 
 table_constructor 
@@ -274,7 +290,7 @@ expression
 ;
 
 program 
-    : block
+    : chunk
         { 
             // *root = node_function_body(@$, node_parameter_list(@$, NULL, node_vararg(@$)), node_type(@$, type_basic(TYPE_BASIC_ANY)), $1);
             //*root = $1;
@@ -356,7 +372,7 @@ statement
     | call 
         { $$ = node_expression_statement(@$, $1); }
     | DO_T block END_T
-        { $$ = node_block(@$, $2, NULL); }
+        { $$ = node_block(@$, $2); }
     | WHILE_T expression DO_T block END_T
         { $$ = node_while_loop(@$, $2, $4); }
     | REPEAT_T block UNTIL_T expression END_T
@@ -382,13 +398,23 @@ statement
 
 ;
 
+/* The statements of the main chunk, handed over one by one when streaming */
+chunk
+    : %empty
+        { $$ = NULL; }
+    | statement
+        { $$ = stream ? parser_stream(stream, $1) : node_block(@$, $1); }
+    | chunk statement
+        { $$ = stream ? parser_stream(stream, $2) : node_block_append(@$, $1, $2); }
+;
+
 block 
     : %empty
         { $$ = NULL; }
     | statement
-        { $$ = node_block(@$, $1, NULL); }
+        { $$ = node_block(@$, $1); }
     | block statement
-        { $$ = node_block(@$, $1, $2); }
+        { $$ = node_block_append(@$, $1, $2); }
 ;
 
 last_statement 
@@ -406,21 +432,42 @@ static void yyerror(YYLTYPE *loc,
                     YYSTYPE *root __attribute__((unused)),
                     int *error_count,
                     yyscan_t scanner __attribute__((unused)),
+                    struct parser_stream *stream __attribute__((unused)),
                     char const *s)
 {
   compiler_error(*loc, s);
   (*error_count)++;
 }
 
+/*  parser_stream - hands a statement of the main chunk over, it is not kept in the tree
+ *      args: stream, statement
+ *      rets: NULL
+ */
+static struct node *parser_stream(struct parser_stream *stream, struct node *statement)
+{
+    stream->statement(stream, statement);
+    return NULL;
+}
+
 /*  parser_parse - creates a tree of nodes
  *      args: pointer to error count, lexer instance
  *      rets: token name
  */
 struct node *parser_parse(int *error_count, yyscan_t lexer)
+{
+    return parser_parse_stream(error_count, lexer, NULL);
+}
+
+/*  parser_parse_stream - creates a tree of nodes, the statements of the main chunk are left out
+ *  of it and handed to the stream as soon as each one is parsed
+ *      args: pointer to error count, lexer instance, stream (NULL to keep every statement)
+ *      rets: tree
+ */
+struct node *parser_parse_stream(int *error_count, yyscan_t lexer, struct parser_stream *stream)
 {
     struct node *tree;
 
-    int result = yyparse(&tree, error_count, lexer);
+    int result = yyparse(&tree, error_count, lexer, stream);
 
     /* Handle any errors that came up in the pass */
     if (result == 1 || *error_count > 0) 
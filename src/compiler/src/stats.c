@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <sys/resource.h>
+
+#include "ir.h"
+#include "node.h"
+#include "stats.h"
+
+/* stats_init() -- initializes an empty set of statistics
+ *      args: stats
+ *      returns: none
+ */
+void stats_init(struct stats *stats) { stats->size = 0; }
+
+/* stats_begin() -- starts measuring a pass
+ *      args: stats, name of the pass
+ *      returns: none
+ */
+void stats_begin(struct stats *stats, const char *name)
+{
+    arena_t *arena = arena_current();
+
+    assert(stats->size < STATS_MAX_PASSES);
+    stats->passes[stats->size].name = name;
+
+    stats->allocs = arena ? arena->a_allocs : 0;
+    stats->bytes = arena ? arena->a_bytes : 0;
+    clock_gettime(CLOCK_MONOTONIC, &stats->start);
+}
+
+/* stats_end() -- finishes measuring the pass started last
+ *      args: stats
+ *      returns: none
+ */
+void stats_end(struct stats *stats)
+{
+    struct stats_pass *pass = &stats->passes[stats->size++];
+    arena_t *arena = arena_current();
+    struct timespec end;
+    struct rusage usage;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage);
+
+    pass->wall = (end.tv_sec - stats->start.tv_sec) + (end.tv_nsec - stats->start.tv_nsec) / 1e9;
+    pass->peak_rss = usage.ru_maxrss;
+    pass->allocs = arena ? arena->a_allocs - stats->allocs : 0;
+    pass->bytes = arena ? arena->a_bytes - stats->bytes : 0;
+}
+
+/* stats_print_proto() -- writes the sizes of a proto and its children in depth first order
+ *      args: output stream, ir proto, index of the next proto
+ *      returns: none
+ */
+static void stats_print_proto(FILE *output, struct ir_proto *proto, int *index)
+{
+    int children = 0;
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        children++;
+
+    fprintf(output,
+            "%s        {\"index\": %d, \"instructions\": %d, \"constants\": %d, "
+            "\"max_stack\": %d, \"protos\": %d}",
+            *index ? ",\n" : "\n", *index, proto->code->size, proto->constant_list->size,
+            proto->max_stack_size, children);
+    (*index)++;
+
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        stats_print_proto(output, iter, index);
+}
+
+/* stats_print() -- writes every measured pass and the size of the program as JSON
+ *      args: output stream, stats, ir context (NULL if the IR was not built)
+ *      returns: none
+ */
+void stats_print(FILE *output, struct stats *stats, struct ir_context *ir)
+{
+    fputs("{\n    \"passes\": [", output);
+
+    for (int i = 0; i < stats->size; i++) {
+        struct stats_pass *pass = &stats->passes[i];
+
+        fprintf(output,
+                "%s        {\"name\": \"%s\", \"wall\": %.9f, \"peak_rss_kb\": %ld, "
+                "\"allocations\": %zu, \"bytes\": %zu}",
+                i ? ",\n" : "\n", pass->name, pass->wall, pass->peak_rss, pass->allocs,
+                pass->bytes);
+    }
+
+    fprintf(output, "\n    ],\n    \"nodes\": %u,\n    \"protos\": [", node_count());
+
+    if (ir != NULL && ir->main_proto != NULL) {
+        int index = 0;
+        stats_print_proto(output, ir->main_proto, &index);
+    }
+
+    fputs("\n    ]\n}\n", output);
+}
@@ -0,0 +1,47 @@
+/*
+ *  stats.h
+ *
+ *  Compile statistics for `luappc --stats`. Every pass is wrapped in stats_begin() and stats_end(),
+ *  which record its wall time, the peak RSS of the process once it finished and the arena
+ *  allocations it made. stats_print() writes those together with the node count and the size of
+ *  every proto as JSON, so compile times can be tracked over a corpus.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "util/arena.h"
+
+struct ir_context;
+
+/* Enough for every pass of luappc */
+#define STATS_MAX_PASSES 16
+
+struct stats_pass {
+    const char *name;
+    double wall;     /* Seconds */
+    long peak_rss;   /* Kilobytes, for the whole process */
+    size_t allocs;   /* Arena allocations made by the pass */
+    size_t bytes;    /* Bytes of those allocations */
+};
+
+struct stats {
+    struct stats_pass passes[STATS_MAX_PASSES];
+    int size;
+
+    /* State of the pass that is running */
+    struct timespec start;
+    size_t allocs, bytes;
+};
+
+void stats_init(struct stats *stats);
+void stats_begin(struct stats *stats, const char *name);
+void stats_end(struct stats *stats);
+
+void stats_print(FILE *output, struct stats *stats, struct ir_context *ir);
+
+#endif
@@ -0,0 +1,131 @@
+#include "stream.h"
+#include "escape.h"
+#include "fold.h"
+#include "ir.h"
+#include "node.h"
+#include "symbol.h"
+#include "type.h"
+
+/* stream_release() -- releases the nodes of the statements compiled so far
+ *      args: stream
+ *      returns: none
+ *
+ * Note: The parser may have read the token after a statement before handing it over, that token
+ * is part of the next statement. So the nodes go into two arenas in turns: once a statement was
+ * compiled, the other arena holds the statement before it and the first token of this one.
+ */
+static void stream_release(struct stream_context *stream)
+{
+    int other = 1 - stream->current;
+
+    arena_reset(&stream->nodes[other]);
+
+    stream->current = other;
+    node_use_arena(&stream->nodes[other]);
+}
+
+/* stream_fail() -- records the pass that reported the first error, the passes after it no longer
+ * run
+ *      args: stream, name of the pass, its error count
+ *      returns: none
+ */
+static void stream_fail(struct stream_context *stream, const char *pass, int *error_count)
+{
+    if (stream->failed != NULL)
+        return;
+
+    stream->failed = pass;
+    stream->error_count = error_count;
+}
+
+/* stream_statement() -- compiles a statement of the main chunk, every pass the whole program
+ * would go through runs on it
+ *      args: stream, statement node
+ *      returns: none
+ */
+static void stream_statement(struct parser_stream *parser, struct node *statement)
+{
+    struct stream_context *stream = (struct stream_context *)parser;
+
+    stream->statements++;
+
+    /* The types of every statement are checked, as they are for a whole program */
+    type_ast_traversal(stream->type, statement, false);
+
+    if (stream->type->error_count > 0)
+        stream_fail(stream, "Type checker", &stream->type->error_count);
+
+    if (stream->failed == NULL) {
+        struct escape_context escape;
+
+        escape_init(&escape);
+        escape_ast(&escape, statement);
+        fold_ast(stream->fold, statement);
+        symbol_ast_traversal(stream->symbol, statement);
+
+        /* Like for a whole program, the IR reports its own errors without stopping */
+        if (stream->symbol->error_count > 0)
+            stream_fail(stream, "Symbol table", &stream->symbol->error_count);
+        else if (stream->ir != NULL)
+            ir_build_statement(stream->ir, statement);
+    }
+
+    stream_release(stream);
+}
+
+/* stream_init() -- initializes a stream, the contexts of the passes have to be initialized
+ *      args: stream, contexts of the passes (ir is NULL to leave the IR out)
+ *      returns: none
+ */
+void stream_init(struct stream_context *stream, struct type_context *type,
+                 struct fold_context *fold, struct symbol_context *symbol, struct ir_context *ir)
+{
+    stream->parser.statement = stream_statement;
+    stream->type = type;
+    stream->fold = fold;
+    stream->symbol = symbol;
+    stream->ir = ir;
+
+    stream->failed = NULL;
+    stream->error_count = NULL;
+    stream->statements = 0;
+
+    arena_init(&stream->nodes[0]);
+    arena_init(&stream->nodes[1]);
+    stream->current = 0;
+
+    type->stream = true;
+
+    if (ir != NULL)
+        ir->stream = true;
+}
+
+/* stream_compile() -- parses and compiles a program statement by statement
+ *      args: stream, lexer of the program
+ *      returns: number of errors of the pass named by stream->failed, 0 on success
+ */
+int stream_compile(struct stream_context *stream, yyscan_t lexer)
+{
+    int error_count = 0;
+    arena_t *previous = node_use_arena(&stream->nodes[stream->current]);
+
+    if (stream->ir != NULL)
+        ir_build_main(stream->ir);
+
+    struct node *tree = parser_parse_stream(&error_count, lexer, &stream->parser);
+
+    if (tree == NULL) {
+        stream->failed = "Parser";
+        error_count = error_count > 0 ? error_count : 1;
+    } else if (stream->failed == NULL && stream->ir != NULL)
+        ir_build_end(stream->ir, tree->location.last_line);
+
+    node_use_arena(previous);
+    arena_free(&stream->nodes[0]);
+    arena_free(&stream->nodes[1]);
+
+    if (tree == NULL)
+        return error_count;
+
+    return stream->failed != NULL ? *stream->error_count : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ *  stream.h
+ *
+ *  Streaming compilation for `luappc --stream` and the large programs luapp runs. Instead of a tree
+ *  of the whole program, the parser hands over every statement of the main chunk as soon as it was
+ *  parsed (parser_parse_stream). The statement is type checked, folded, its names are added to the
+ *  symbol table and it is built into the main proto right away, then its nodes are released. The
+ *  memory the nodes take is bounded by the largest statement instead of the size of the program.
+ *
+ *  The types of the names a statement defines are copied out of its nodes for the statements after
+ *  it, the symbols and the IR never refer to nodes. Some facts about a local of the main chunk are
+ *  only known once every statement was seen, so a streamed program gives them up:
+ *      - its literal value is not propagated into the statements after its declaration
+ *      - closures capture it by reference, a later statement may assign it
+ *      - a table it is initialized with is built even if it never escapes (see escape.h)
+ */
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include "lexer.h"
+#include "parser.h"
+#include "util/arena.h"
+
+struct fold_context;
+struct ir_context;
+struct symbol_context;
+struct type_context;
+
+struct stream_context {
+    struct parser_stream parser; /* First, the parser hands the statements to it */
+
+    struct type_context *type;
+    struct fold_context *fold;
+    struct symbol_context *symbol;
+    struct ir_context *ir; /* NULL to stop once the symbol table is complete */
+
+    const char *failed; /* Pass that reported the first error, NULL while there is none */
+    int *error_count;   /* Errors of that pass */
+    int statements;     /* Statements of the main chunk compiled so far */
+
+    /* Nodes of the statement being parsed and of the one before it, see stream_release() */
+    arena_t nodes[2];
+    int current;
+};
+
+void stream_init(struct stream_context *stream, struct type_context *type,
+                 struct fold_context *fold, struct symbol_context *symbol, struct ir_context *ir);
+int stream_compile(struct stream_context *stream, yyscan_t lexer);
+
+#endif
@@ -0,0 +1,357 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "node.h"
+#include "summary.h"
+#include "type.h"
+#include "util/flexstr.h"
+
+/* Entries a list starts with, it doubles whenever it is full */
+#define SUMMARY_LIST_SIZE 8
+
+/* summary_init() -- initializes an empty summary
+ *      args: summary
+ *      returns: none
+ */
+void summary_init(struct summary *summary) { memset(summary, 0, sizeof(*summary)); }
+
+static void summary_free_list(struct summary_list *list)
+{
+    for (int i = 0; i < list->size; i++) {
+        free(list->entries[i].name);
+        free(list->entries[i].type);
+    }
+
+    free(list->entries);
+}
+
+/* summary_free() -- deallocates the entries of a summary, it is empty afterwards
+ *      args: summary
+ *      returns: none
+ */
+void summary_free(struct summary *summary)
+{
+    summary_free_list(&summary->exports);
+    summary_free_list(&summary->imports);
+    summary_init(summary);
+}
+
+/* summary_add() -- adds a global to a list, a global that is listed already keeps its entry
+ *      args: list, name, type string
+ *      returns: none
+ */
+void summary_add(struct summary_list *list, const char *name, const char *type)
+{
+    if (summary_find(list, name) != NULL)
+        return;
+
+    if (list->size == list->space) {
+        list->space = list->space > 0 ? list->space * 2 : SUMMARY_LIST_SIZE;
+        list->entries = srealloc(list->entries, list->space * sizeof(struct summary_entry));
+    }
+
+    list->entries[list->size].name = strdup(name);
+    list->entries[list->size++].type = strdup(type);
+}
+
+/* summary_find() -- looks a global up in a list
+ *      args: list, name
+ *      returns: its type string or NULL if it is not listed
+ */
+const char *summary_find(const struct summary_list *list, const char *name)
+{
+    for (int i = 0; i < list->size; i++) {
+        if (!strcmp(list->entries[i].name, name))
+            return list->entries[i].type;
+    }
+
+    return NULL;
+}
+
+/* summary_same_exports() -- compares the globals two summaries define
+ *      args: summaries
+ *      returns: true if they define the same globals with the same types
+ */
+bool summary_same_exports(const struct summary *first, const struct summary *second)
+{
+    if (first->exports.size != second->exports.size)
+        return false;
+
+    for (int i = 0; i < first->exports.size; i++) {
+        const struct summary_entry *entry = &first->exports.entries[i];
+        const char *type = summary_find(&second->exports, entry->name);
+
+        if (type == NULL || strcmp(type, entry->type))
+            return false;
+    }
+
+    return true;
+}
+
+/* summary_read() -- reads the summary a previous compilation wrote
+ *      args: path, summary (initialized, filled on success)
+ *      returns: 0 on success, -1 if the file is missing or was not written by this compiler
+ */
+int summary_read(const char *path, struct summary *summary)
+{
+    FILE *input = fopen(path, "r");
+    char *line = NULL;
+    size_t space = 0;
+    ssize_t length;
+    int version = 0;
+
+    if (input == NULL)
+        return -1;
+
+    if (getline(&line, &space, input) < 0 || sscanf(line, "luapp-types %d", &version) != 1 ||
+        version != SUMMARY_VERSION) {
+        free(line);
+        fclose(input);
+        return -1;
+    }
+
+    while ((length = getline(&line, &space, input)) > 0) {
+        char *name, *type;
+
+        if (line[length - 1] == '\n')
+            line[length - 1] = '\0';
+
+        if (!strncmp(line, "source ", 7)) {
+            summary->hash = strtoull(line + 7, NULL, 16);
+            continue;
+        }
+
+        /* `export name type' or `import name type', the type takes the rest of the line */
+        if ((name = strchr(line, ' ')) == NULL || (type = strchr(name + 1, ' ')) == NULL)
+            continue;
+
+        *name++ = *type++ = '\0';
+
+        if (!strcmp(line, "export"))
+            summary_add(&summary->exports, name, type);
+        else if (!strcmp(line, "import"))
+            summary_add(&summary->imports, name, type);
+    }
+
+    free(line);
+    fclose(input);
+    return 0;
+}
+
+/* summary_write() -- writes a summary for the next compilation
+ *      args: path, summary
+ *      returns: 0 on success, -1 if the file could not be written
+ */
+int summary_write(const char *path, const struct summary *summary)
+{
+    FILE *output = fopen(path, "w");
+
+    if (output == NULL)
+        return -1;
+
+    fprintf(output, "luapp-types %d\nsource %016llx\n", SUMMARY_VERSION,
+            (unsigned long long)summary->hash);
+
+    for (int i = 0; i < summary->exports.size; i++)
+        fprintf(output, "export %s %s\n", summary->exports.entries[i].name,
+                summary->exports.entries[i].type);
+
+    for (int i = 0; i < summary->imports.size; i++)
+        fprintf(output, "import %s %s\n", summary->imports.entries[i].name,
+                summary->imports.entries[i].type);
+
+    return fclose(output) ? -1 : 0;
+}
+
+/* summary_hash_file() -- 64-bit FNV-1a hash of the contents of a file
+ *      args: path
+ *      returns: hash, 0 if the file could not be read
+ */
+uint64_t summary_hash_file(const char *path)
+{
+    FILE *input = fopen(path, "rb");
+    uint64_t hash = 14695981039346656037ull;
+    unsigned char buffer[BUFSIZ];
+    size_t size;
+
+    if (input == NULL)
+        return 0;
+
+    while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ buffer[i]) * 1099511628211ull;
+    }
+
+    fclose(input);
+    return hash;
+}
+
+static void summary_add_type(flexstr_t *str, struct type *type);
+
+/* summary_add_list() -- writes the types of a parameter or return list, in the order
+ * type_node_is() compares them
+ *      args: string, list node (NULL for an empty list)
+ *      returns: none
+ */
+static void summary_add_list(flexstr_t *str, struct node *list)
+{
+    while (list != NULL) {
+        if (list->type != NODE_TYPE_LIST) {
+            summary_add_type(str, list->node_type);
+            return;
+        }
+
+        summary_add_type(str, list->data.type_list.type->node_type);
+
+        if ((list = list->data.type_list.init) != NULL)
+            fs_addstr(str, ", ");
+    }
+}
+
+static void summary_add_type(flexstr_t *str, struct type *type)
+{
+    switch (type->kind) {
+        case TYPE_ARRAY:
+            fs_addstr(str, "Array<");
+            summary_add_type(str, type->data.array.type);
+            fs_addch(str, '>');
+            break;
+        case TYPE_TABLE:
+            fs_addstr(str, "Table<");
+            summary_add_type(str, type->data.table.key);
+            fs_addstr(str, ", ");
+            summary_add_type(str, type->data.table.value);
+            fs_addch(str, '>');
+            break;
+        case TYPE_FUNCTION:
+            /* The returns are parenthesized so function types can be nested in lists */
+            fs_addstr(str, "Function(");
+            summary_add_list(str, type->data.function.args_list);
+            fs_addstr(str, "): (");
+            summary_add_list(str, type->data.function.rets_list);
+            fs_addch(str, ')');
+            break;
+        default:
+            fs_addstr(str, type_to_string(type));
+            break;
+    }
+}
+
+/* summary_type_string() -- converts a type to the string summaries store, two types have the same
+ * string when type_is() finds them equal without an any in either of them
+ *      args: type
+ *      returns: string (to be freed)
+ */
+char *summary_type_string(struct type *type)
+{
+    flexstr_t str;
+    fs_init(&str, 0);
+
+    summary_add_type(&str, type);
+    return fs_getstr(&str);
+}
+
+static struct type *summary_parse(const char **text);
+
+static bool summary_accept(const char **text, const char *token)
+{
+    size_t length = strlen(token);
+
+    while (isspace((unsigned char)**text))
+        (*text)++;
+
+    if (strncmp(*text, token, length))
+        return false;
+
+    *text += length;
+    return true;
+}
+
+/* summary_parse_list() -- reads a list written by summary_add_list() back into type nodes
+ *      args: text after the opening parenthesis, location of the nodes, set if it is malformed
+ *      returns: list node, NULL if it is empty or malformed
+ */
+static struct node *summary_parse_list(const char **text, YYLTYPE location, bool *error)
+{
+    struct type *type;
+
+    if (summary_accept(text, ")"))
+        return NULL;
+
+    if ((type = summary_parse(text)) == NULL) {
+        *error = true;
+        return NULL;
+    }
+
+    struct node *node = node_type(location, type);
+
+    if (summary_accept(text, ")"))
+        return node;
+
+    if (!summary_accept(text, ",")) {
+        *error = true;
+        return NULL;
+    }
+
+    return node_type_list(location, summary_parse_list(text, location, error), node);
+}
+
+static struct type *summary_parse(const char **text)
+{
+    static const struct {
+        const char *name;
+        enum type_primitive_kind kind;
+    } primitives[] = {{"number", TYPE_BASIC_NUMBER}, {"integer", TYPE_BASIC_INTEGER},
+                      {"string", TYPE_BASIC_STRING}, {"boolean", TYPE_BASIC_BOOLEAN},
+                      {"vararg", TYPE_BASIC_VARARG}, {"nil", TYPE_BASIC_NIL},
+                      {"any", TYPE_BASIC_ANY}};
+    YYLTYPE location = {0};
+    bool error = false;
+
+    for (size_t i = 0; i < sizeof(primitives) / sizeof(primitives[0]); i++) {
+        if (summary_accept(text, primitives[i].name))
+            return type_basic(primitives[i].kind);
+    }
+
+    if (summary_accept(text, "Array<")) {
+        struct type *element = summary_parse(text);
+
+        return element != NULL && summary_accept(text, ">") ? type_array(element) : NULL;
+    }
+
+    if (summary_accept(text, "Table<")) {
+        struct type *key = summary_parse(text);
+        struct type *value = key != NULL && summary_accept(text, ",") ? summary_parse(text) : NULL;
+
+        return value != NULL && summary_accept(text, ">") ? type_table(key, value) : NULL;
+    }
+
+    if (summary_accept(text, "Function(")) {
+        struct node *args = summary_parse_list(text, location, &error), *rets = NULL;
+
+        if (!error && summary_accept(text, ":") && summary_accept(text, "("))
+            rets = summary_parse_list(text, location, &error);
+        else
+            error = true;
+
+        return !error ? type_function(args, rets) : NULL;
+    }
+
+    return NULL;
+}
+
+/* summary_parse_type() -- reads a type string of a summary, the type is allocated in the arena of
+ * the compilation
+ *      args: type string
+ *      returns: type or NULL if the string is malformed
+ */
+struct type *summary_parse_type(const char *text)
+{
+    struct type *type = summary_parse(&text);
+
+    /* Nothing but spaces may follow the type */
+    return type != NULL && summary_accept(&text, "") && *text == '\0' ? type : NULL;
+}
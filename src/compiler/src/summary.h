@@ -0,0 +1,58 @@
+/*
+ *  summary.h
+ *
+ *  Type summaries for `luappc --incremental`. The summary of a module lists the globals it defines
+ *  at its top level (its exports) and the globals of other modules it uses (its imports) with their
+ *  types, together with a hash of its source. A module is checked against the exports of the other
+ *  modules instead of their sources, and it only has to be compiled again when its source changed
+ *  or when one of its imports changed type.
+ *
+ *  Summaries are text files, one entry per line:
+ *
+ *      luapp-types 1
+ *      source 0123456789abcdef
+ *      export name Function(number, string): (boolean)
+ *      import name Array<number>
+ */
+
+#ifndef _SUMMARY_H
+#define _SUMMARY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct type;
+
+#define SUMMARY_VERSION 1
+
+struct summary_entry {
+    char *name;
+    char *type; /* As written by summary_type_string() */
+};
+
+struct summary_list {
+    struct summary_entry *entries;
+    int size, space;
+};
+
+struct summary {
+    uint64_t hash; /* summary_hash_file() of the source */
+    struct summary_list exports;
+    struct summary_list imports;
+};
+
+void summary_init(struct summary *summary);
+void summary_free(struct summary *summary);
+
+void summary_add(struct summary_list *list, const char *name, const char *type);
+const char *summary_find(const struct summary_list *list, const char *name);
+bool summary_same_exports(const struct summary *first, const struct summary *second);
+
+int summary_read(const char *path, struct summary *summary);
+int summary_write(const char *path, const struct summary *summary);
+uint64_t summary_hash_file(const char *path);
+
+char *summary_type_string(struct type *type);
+struct type *summary_parse_type(const char *text);
+
+#endif
@@ -6,10 +6,9 @@
 #include "compiler.h"
 #include "node.h"
 #include "symbol.h"
+#include "util/arena.h"
 #include "util/flexstr.h"
 
-static unsigned int nextSymbolId;
-
 /* symbol_initialize_table() -- initializes the symbol table
  *      args: table that we will init
  *      returns: none
@@ -18,20 +17,72 @@ void symbol_initialize_table(struct symbol_table *table)
 {
     table->first = NULL;
     table->last = NULL;
+    table->size = 0;
+
+    /* The index is created on the first insertion */
+    table->slots = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+/* symbol_hash() -- hashes the name of a symbol (FNV-1a)
+ *      args: name of the symbol
+ *      returns: hash
+ */
+static uint32_t symbol_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* symbol_grow() -- doubles the hash index of the symbol table
+ *      args: table
+ *      returns: none
+ */
+static void symbol_grow(struct symbol_table *table)
+{
+    unsigned int capacity = table->capacity > 0 ? table->capacity * 2 : SYMBOL_INDEX_SIZE;
+    struct symbol_list **slots = amalloc(capacity * sizeof(struct symbol_list *));
+
+    memset(slots, 0, capacity * sizeof(struct symbol_list *));
+
+    /* Re-insert every symbol with its cached hash */
+    for (struct symbol_list *iter = table->first; NULL != iter; iter = iter->next) {
+        unsigned int i = iter->hash & (capacity - 1);
+
+        while (slots[i] != NULL)
+            i = (i + 1) & (capacity - 1);
+
+        slots[i] = iter;
+    }
+
+    table->slots = slots;
+    table->capacity = capacity;
 }
 
 /* symbol_get() -- get a symbol from the symbol table
- *      args: table, the name of the symbol
- *      returns: new symbol
+ *      args: table, the name of the symbol, hash of the name
+ *      returns: symbol or NULL if it does not exist
  */
-static struct symbol *symbol_get(struct symbol_table *table, char *name)
+static struct symbol *symbol_get(struct symbol_table *table, char *name, uint32_t hash)
 {
-    struct symbol_list *iter;
-    for (iter = table->first; NULL != iter; iter = iter->next) {
-        if (!strcmp(name, iter->symbol.name)) {
+    if (table->capacity == 0)
+        return NULL;
+
+    unsigned int mask = table->capacity - 1;
+    for (unsigned int i = hash & mask; NULL != table->slots[i]; i = (i + 1) & mask) {
+        struct symbol_list *iter = table->slots[i];
+
+        if (iter->hash == hash && !strcmp(name, iter->symbol.name))
             return &iter->symbol;
-        }
     }
+
     return NULL;
 }
 
@@ -42,15 +93,19 @@ static struct symbol *symbol_get(struct symbol_table *table, char *name)
 static struct symbol *symbol_put(struct symbol_table *table, char *name)
 {
     struct symbol *s;
-    if ((s = symbol_get(table, name)))
+    uint32_t hash = symbol_hash(name);
+
+    if ((s = symbol_get(table, name, hash)))
         return s;
 
     struct symbol_list *symbol_list;
 
-    symbol_list = smalloc(sizeof(struct symbol_list));
+    symbol_list = amalloc(sizeof(struct symbol_list));
 
-    symbol_list->symbol.name = strdup(name);
-    symbol_list->symbol.id = nextSymbolId++;
+    symbol_list->symbol.name = astrdup(name);
+    symbol_list->symbol.id = table->size++;
+    symbol_list->symbol.is_assigned = false;
+    symbol_list->hash = hash;
 
     if (table->first == NULL && table->last == NULL) {
         table->first = symbol_list;
@@ -68,11 +123,47 @@ static struct symbol *symbol_put(struct symbol_table *table, char *name)
         table->last = symbol_list;
     }
 
-    table->size = nextSymbolId;
+    /* Keep the index at most half full */
+    if ((table->count + 1) * 2 > table->capacity)
+        symbol_grow(table);
+    else {
+        unsigned int i = hash & (table->capacity - 1);
+
+        while (table->slots[i] != NULL)
+            i = (i + 1) & (table->capacity - 1);
+
+        table->slots[i] = symbol_list;
+    }
+
+    table->count++;
 
     return &symbol_list->symbol;
 }
 
+/* symbol_mark_assigned() -- marks the names an assignment writes to, the IR captures the other
+ * locals by value
+ *      args: variable (list) node of the assignment
+ *      returns: none
+ */
+static void symbol_mark_assigned(struct node *variables)
+{
+    while (variables != NULL) {
+        struct node *variable = variables;
+
+        if (variables->type == NODE_VARIABLE_LIST) {
+            variable = variables->data.variable_list.variable;
+            variables = variables->data.variable_list.init;
+        } else
+            variables = NULL;
+
+        if (variable->type == NODE_NAME_REFERENCE)
+            variable = variable->data.name_reference.identifier;
+
+        if (variable->type == NODE_IDENTIFIER)
+            variable->data.identifier.s->is_assigned = true;
+    }
+}
+
 /* symbol_ast_traversal() -- traverse through the AST and build symbol tree
  *      args: context, and AST
  *      returns: none
@@ -94,8 +185,8 @@ void symbol_ast_traversal(struct symbol_context *context, struct node *node)
             node->data.string.s = symbol_put(context->table, node->data.string.value);
             break;
         case NODE_BLOCK:
-            symbol_ast_traversal(context, node->data.block.init);
-            symbol_ast_traversal(context, node->data.block.statement);
+            for (int i = 0; i < node->data.block.size; i++)
+                symbol_ast_traversal(context, node->data.block.statements[i]);
             break;
         case NODE_TYPE_ANNOTATION:
             symbol_ast_traversal(context, node->data.type_annotation.identifier);
@@ -145,6 +236,7 @@ void symbol_ast_traversal(struct symbol_context *context, struct node *node)
         case NODE_ASSIGNMENT:
             symbol_ast_traversal(context, node->data.assignment.values);
             symbol_ast_traversal(context, node->data.assignment.variables);
+            symbol_mark_assigned(node->data.assignment.variables);
             break;
         case NODE_WHILELOOP:
             symbol_ast_traversal(context, node->data.while_loop.body);
@@ -159,11 +251,17 @@ void symbol_ast_traversal(struct symbol_context *context, struct node *node)
             symbol_ast_traversal(context, node->data.if_statement.condition);
             symbol_ast_traversal(context, node->data.if_statement.else_body);
             break;
-        case NODE_NUMERICFORLOOP:
+        case NODE_NUMERICFORLOOP: {
+            /* The control variable is declared by the loop, not assigned */
+            struct node *init = node->data.numerical_for_loop.init;
+
             symbol_ast_traversal(context, node->data.numerical_for_loop.body);
             symbol_ast_traversal(context, node->data.numerical_for_loop.increment);
-            symbol_ast_traversal(context, node->data.numerical_for_loop.init);
+            symbol_ast_traversal(context, node->data.numerical_for_loop.target);
+            symbol_ast_traversal(context, init->data.assignment.values);
+            symbol_ast_traversal(context, init->data.assignment.variables);
             break;
+        }
         case NODE_GENERICFORLOOP:
             symbol_ast_traversal(context, node->data.generic_for_loop.body);
             symbol_ast_traversal(context, node->data.generic_for_loop.local);
@@ -187,6 +285,12 @@ void symbol_ast_traversal(struct symbol_context *context, struct node *node)
             symbol_ast_traversal(context, node->data.key_value_pair.key);
             symbol_ast_traversal(context, node->data.key_value_pair.value);
             break;
+        case NODE_ARRAY_CONSTRUCTOR:
+            symbol_ast_traversal(context, node->data.array_constructor.exprlist);
+            break;
+        case NODE_TABLE_CONSTRUCTOR:
+            symbol_ast_traversal(context, node->data.table_constructor.pairlist);
+            break;
     }
 }
 
@@ -11,6 +11,8 @@
 #ifndef _SYMBOL_H
 #define _SYMBOL_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "compiler.h"
@@ -20,16 +22,26 @@ struct type;
 struct symbol {
     char *name;
     unsigned int id;
+    bool is_assigned; /* Some assignment writes a variable of this name */
 };
 
 struct symbol_list {
     struct symbol symbol;
     struct symbol_list *next, *prev;
+    uint32_t hash; /* Hash of the name, kept so the index can grow without rehashing names */
 };
 
+/* Initial amount of slots in the hash index of a symbol table */
+#define SYMBOL_INDEX_SIZE 64
+
+/* The list keeps the symbols in insertion order (the order codegen writes them in), the open
+ * addressing index on top of it is only used to look up names. */
 struct symbol_table {
     struct symbol_list *first, *last;
     unsigned int size;
+
+    struct symbol_list **slots;
+    unsigned int count, capacity;
 };
 
 struct symbol_context {
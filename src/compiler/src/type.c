@@ -1,61 +1,176 @@
 #include <assert.h>
+#include <string.h>
 
 #include "node.h"
+#include "summary.h"
 #include "type.h"
+#include "util/arena.h"
 #include "util/flexstr.h"
 
 #define KEY_MAX_LENGTH (256)
 #define KEY_COUNT (1024 * 1024)
 
-/* type_basic() -- creates a basic data type
+/* Literals up to 2^53 are whole numbers doubles represent exactly */
+#define TYPE_INTEGER_MAX 9007199254740992.0
+
+/* Initial amount of slots of the table of composite types, it doubles whenever it is half full */
+#define TYPE_INTERN_SIZE 64
+
+/* The primitive types, shared by every compilation. Any matches every type, so it is not exact. */
+#define TYPE_PRIMITIVE_INIT(k)                                                                     \
+    {                                                                                              \
+        .kind = TYPE_PRIMITIVE, .id = (k) + 1, .exact = (k) != TYPE_BASIC_ANY,                     \
+        .data.primitive.kind = (k)                                                                 \
+    }
+
+static struct type type_primitives[] = {
+    TYPE_PRIMITIVE_INIT(TYPE_BASIC_NUMBER), TYPE_PRIMITIVE_INIT(TYPE_BASIC_INTEGER),
+    TYPE_PRIMITIVE_INIT(TYPE_BASIC_STRING), TYPE_PRIMITIVE_INIT(TYPE_BASIC_BOOLEAN),
+    TYPE_PRIMITIVE_INIT(TYPE_BASIC_NIL), TYPE_PRIMITIVE_INIT(TYPE_BASIC_VARARG),
+    TYPE_PRIMITIVE_INIT(TYPE_BASIC_ANY),
+};
+
+/* Arrays and tables of the current compilation, they live in its arena */
+static _Thread_local struct {
+    unsigned int generation; /* arena_generation() the table was filled in */
+    struct type **slots;
+    unsigned int size, used;
+    unsigned int next_id;
+} type_interned;
+
+/* type_basic() -- gets a basic data type
  *      args: kind of data type
- *      returns: created type
+ *      returns: the type
  */
-struct type *type_basic(enum type_primitive_kind kind)
+struct type *type_basic(enum type_primitive_kind kind) { return &type_primitives[kind]; }
+
+/* type_hash() -- hashes a composite type on its kind and the ids of its components
+ *      args: kind, id of the first component, id of the second one (0 for arrays)
+ *      returns: hash
+ */
+static unsigned int type_hash(enum type_kind kind, unsigned int first, unsigned int second)
 {
-    struct type *t;
+    unsigned int hash = (kind * 31u + first) * 2654435761u;
+    return (hash ^ second) * 2654435761u;
+}
 
-    t = smalloc(sizeof(struct type));
+/* type_slot() -- finds the slot of a composite type, or the empty slot it goes into
+ *      args: kind, first component, second component (NULL for arrays)
+ *      returns: slot
+ */
+static struct type **type_slot(enum type_kind kind, struct type *first, struct type *second)
+{
+    unsigned int mask = type_interned.size - 1;
+    unsigned int i = type_hash(kind, first->id, second != NULL ? second->id : 0) & mask;
 
-    t->kind = TYPE_PRIMITIVE;
-    t->data.primitive.kind = kind;
+    for (struct type *t; (t = type_interned.slots[i]) != NULL; i = (i + 1) & mask) {
+        if (t->kind != kind)
+            continue;
+        if (kind == TYPE_ARRAY && t->data.array.type == first)
+            break;
+        if (kind == TYPE_TABLE && t->data.table.key == first && t->data.table.value == second)
+            break;
+    }
 
-    return t;
+    return &type_interned.slots[i];
 }
 
-/* type_array() -- creates an array data type
- *      args: array type
- *      returns: created array
+/* type_reserve() -- makes room for one more composite type, starting over when the compilation
+ * changed
+ *      args: none
+ *      returns: none
  */
-struct type *type_array(struct type *type)
+static void type_reserve(void)
 {
-    struct type *t;
+    if (type_interned.generation != arena_generation()) {
+        type_interned.generation = arena_generation();
+        type_interned.slots = NULL;
+        type_interned.size = type_interned.used = 0;
+        type_interned.next_id = TYPE_BASIC_ANY + 2;
+    }
 
-    t = smalloc(sizeof(struct type));
+    if (2 * (type_interned.used + 1) <= type_interned.size)
+        return;
 
-    t->kind = TYPE_ARRAY;
-    t->data.array.type = type;
+    struct type **old = type_interned.slots;
+    unsigned int size = type_interned.size;
 
-    return t;
+    type_interned.size = size > 0 ? size * 2 : TYPE_INTERN_SIZE;
+    type_interned.slots = amalloc(type_interned.size * sizeof(struct type *));
+    memset(type_interned.slots, 0, type_interned.size * sizeof(struct type *));
+
+    for (unsigned int i = 0; i < size; i++) {
+        struct type *t = old[i];
+
+        if (t != NULL && t->kind == TYPE_ARRAY)
+            *type_slot(t->kind, t->data.array.type, NULL) = t;
+        else if (t != NULL)
+            *type_slot(t->kind, t->data.table.key, t->data.table.value) = t;
+    }
 }
 
-/* type_table() -- creates a table type
- *      args: array type
- *      returns: created array
+/* type_composite() -- allocates an array or table type
+ *      args: kind, first component, second component (NULL for arrays)
+ *      returns: the type
  */
-struct type *type_table(struct type *key, struct type *value)
+static struct type *type_composite(enum type_kind kind, struct type *first, struct type *second)
 {
-    struct type *t;
+    struct type *t = amalloc(sizeof(struct type));
 
-    t = smalloc(sizeof(struct type));
+    t->kind = kind;
+    t->id = 0;
+    t->exact = false;
 
-    t->kind = TYPE_TABLE;
-    t->data.table.key = key;
-    t->data.table.value = value;
+    if (kind == TYPE_ARRAY)
+        t->data.array.type = first;
+    else {
+        t->data.table.key = first;
+        t->data.table.value = second;
+    }
 
     return t;
 }
 
+/* type_intern() -- gets the canonical array or table type of some components
+ *      args: kind, first component, second component (NULL for arrays)
+ *      returns: the type
+ */
+static struct type *type_intern(enum type_kind kind, struct type *first, struct type *second)
+{
+    /* Function types are not canonical, neither are the types holding one */
+    if (first->id == 0 || (second != NULL && second->id == 0))
+        return type_composite(kind, first, second);
+
+    type_reserve();
+
+    struct type **slot = type_slot(kind, first, second);
+    if (*slot != NULL)
+        return *slot;
+
+    struct type *t = type_composite(kind, first, second);
+
+    t->id = type_interned.next_id++;
+    t->exact = first->exact && (second == NULL || second->exact);
+
+    type_interned.used++;
+    return *slot = t;
+}
+
+/* type_array() -- gets an array data type
+ *      args: array type
+ *      returns: the array type
+ */
+struct type *type_array(struct type *type) { return type_intern(TYPE_ARRAY, type, NULL); }
+
+/* type_table() -- gets a table type
+ *      args: key type, value type
+ *      returns: the table type
+ */
+struct type *type_table(struct type *key, struct type *value)
+{
+    return type_intern(TYPE_TABLE, key, value);
+}
+
 /* type_function() -- creates a function type
  *      args: args type list, rets type list
  *      returns: function type
@@ -64,9 +179,11 @@ struct type *type_function(struct node *args_list, struct node *rets_list)
 {
     struct type *t;
 
-    t = smalloc(sizeof(struct type));
+    t = amalloc(sizeof(struct type));
 
     t->kind = TYPE_FUNCTION;
+    t->id = 0;
+    t->exact = false;
     t->data.function.args_list = args_list;
     t->data.function.rets_list = rets_list;
 
@@ -79,13 +196,15 @@ struct type *type_function(struct node *args_list, struct node *rets_list)
  */
 char *type_to_string(struct type *type)
 {
-    static char buf[BUFSIZ];
+    static _Thread_local char buf[BUFSIZ];
     bzero(buf, BUFSIZ); /* buffer needs to be empty */
 
     if (type->kind == TYPE_PRIMITIVE) {
         switch (type->data.primitive.kind) {
             case TYPE_BASIC_NUMBER:
                 return "number";
+            case TYPE_BASIC_INTEGER:
+                return "integer";
             case TYPE_BASIC_STRING:
                 return "string";
             case TYPE_BASIC_BOOLEAN:
@@ -128,6 +247,52 @@ bool type_is_primitive(struct type *type, enum type_primitive_kind kind)
     return type->kind == TYPE_PRIMITIVE && type->data.primitive.kind == kind;
 }
 
+/* type_is_number() -- determines whether a type is a number, integers are numbers as well
+ *      args: type
+ *      returns: yes or no
+ */
+bool type_is_number(struct type *type)
+{
+    return type_is_primitive(type, TYPE_BASIC_NUMBER) ||
+           type_is_primitive(type, TYPE_BASIC_INTEGER);
+}
+
+/* type_is_integer() -- determines whether an expression is proven to be a whole number, it is an
+ * integer or a number literal without a fraction
+ *      args: expression node
+ *      returns: yes or no
+ *
+ * Note: Integers are doubles like every other number, the sum, difference, product and remainder
+ * of two of them are whole again (or not a number, which no array index matches).
+ */
+bool type_is_integer(const struct node *node)
+{
+    if (node == NULL || node->node_type == NULL)
+        return false;
+
+    if (type_is_primitive(node->node_type, TYPE_BASIC_INTEGER))
+        return true;
+
+    if (node->type != NODE_NUMBER || node->data.number.overflow)
+        return false;
+
+    double value = node->data.number.value;
+    return value >= -TYPE_INTEGER_MAX && value <= TYPE_INTEGER_MAX && value == (long long)value;
+}
+
+/* type_widen() -- gives the type a variable infers from its value, a variable initialized with an
+ * integer may still be assigned any number later
+ *      args: type of the value
+ *      returns: type of the variable
+ */
+static struct type *type_widen(struct type *type)
+{
+    if (type != NULL && type_is_primitive(type, TYPE_BASIC_INTEGER))
+        return type_basic(TYPE_BASIC_NUMBER);
+
+    return type;
+}
+
 /* type_node_is() -- determines whether two node type lists are equal
  *      args: first list, second list
  *      returns: yes or no
@@ -166,6 +331,16 @@ bool type_is(struct type *first, struct type *second)
     if (!first || !second)
         return false;
 
+    /* Canonical types without any inside are only equal to themselves */
+    if (first == second)
+        return true;
+
+    /* Integers are numbers, assignments are checked in the other direction by type_accepts() */
+    if (type_is_number(first) && type_is_number(second))
+        return true;
+    if (first->exact && second->exact)
+        return false;
+
     /* If either options are ANY then return true */
     if (type_is_primitive(first, TYPE_BASIC_ANY) || type_is_primitive(second, TYPE_BASIC_ANY))
         return true;
@@ -191,6 +366,78 @@ bool type_is(struct type *first, struct type *second)
     return false;
 }
 
+/* type_accepts() -- determines whether a variable of a type can be assigned a value, an integer
+ * only takes whole numbers (or a value of type any, which is trusted like for every other type)
+ *      args: type of the variable, value node
+ *      returns: yes or no
+ */
+static bool type_accepts(struct type *type, struct node *value)
+{
+    if (!type_is(type, value->node_type))
+        return false;
+
+    return !type_is_primitive(type, TYPE_BASIC_INTEGER) ||
+           type_is_primitive(value->node_type, TYPE_BASIC_ANY) || type_is_integer(value);
+}
+
+static struct type *type_keep(struct type *type);
+
+/* type_keep_list() -- copies a parameter or return list out of the nodes of a statement
+ *      args: list node (NULL for an empty list)
+ *      returns: the copy
+ */
+static struct node *type_keep_list(struct node *list)
+{
+    if (list == NULL)
+        return NULL;
+
+    struct node *copy = amalloc(sizeof(struct node));
+
+    memset(copy, 0, sizeof(struct node));
+    copy->location = list->location;
+    copy->node_type = type_keep(list->node_type);
+
+    /* Only the type of an element is ever looked at */
+    if (list->type == NODE_TYPE_LIST) {
+        copy->type = NODE_TYPE_LIST;
+        copy->data.type_list.type = type_keep_list(list->data.type_list.type);
+        copy->data.type_list.init = type_keep_list(list->data.type_list.init);
+    } else
+        copy->type = NODE_TYPE;
+
+    return copy;
+}
+
+/* type_keep() -- makes a type outlive the nodes of the statement it was found in, function types
+ * refer to the nodes of their lists
+ *      args: type
+ *      returns: the type
+ */
+static struct type *type_keep(struct type *type)
+{
+    /* Exact types hold no function type */
+    if (type == NULL || type->exact)
+        return type;
+
+    switch (type->kind) {
+        case TYPE_ARRAY:
+            type->data.array.type = type_keep(type->data.array.type);
+            break;
+        case TYPE_TABLE:
+            type->data.table.key = type_keep(type->data.table.key);
+            type->data.table.value = type_keep(type->data.table.value);
+            break;
+        case TYPE_FUNCTION:
+            type->data.function.args_list = type_keep_list(type->data.function.args_list);
+            type->data.function.rets_list = type_keep_list(type->data.function.rets_list);
+            break;
+        default:
+            break;
+    }
+
+    return type;
+}
+
 static void type_add_name(map_t map, char *name, struct type *t)
 {
     int res = hashmap_put(map, name, t);
@@ -219,14 +466,19 @@ bool type_name_exists(struct type_context *context, char *name)
 static void type_add(struct type_context *context, struct node *identifier, struct type *t)
 {
     void *s;
-    if (type_name_exists(context, identifier->data.identifier.name)) {
+    /* A local can shadow a global (the libraries take common names like `array') */
+    if (hashmap_get(context->type_map, identifier->data.identifier.name, &s) == MAP_OK) {
         compiler_error(identifier->location, "this variable has already been defined");
         hashmap_print(context->type_map);
         context->error_count++;
         return;
     }
 
-    type_add_name(context->type_map, identifier->data.identifier.name, t);
+    /* The names of the main chunk are used by the statements after this one */
+    if (context->stream && !context->nested)
+        type_add_name(context->type_map, astrdup(identifier->data.identifier.name), type_keep(t));
+    else
+        type_add_name(context->type_map, identifier->data.identifier.name, t);
 }
 
 /* type_init() -- initializes the type context by creating the type_map
@@ -244,6 +496,17 @@ void type_init(struct type_context *context)
     type_add_name(context->global_type_map, "print",
                   type_function(node_type(loc, type_basic(TYPE_BASIC_VARARG)),
                                 node_type(loc, type_basic(TYPE_BASIC_NIL))));
+
+    /* The libraries of the VM that work on typed arrays and Lua++ functions, their functions take
+     * any arguments and their results are not typed */
+    struct type *library =
+        type_table(type_basic(TYPE_BASIC_STRING),
+                   type_function(node_type(loc, type_basic(TYPE_BASIC_VARARG)),
+                                 node_type(loc, type_basic(TYPE_BASIC_ANY))));
+
+    type_add_name(context->global_type_map, "array", library);
+    type_add_name(context->global_type_map, "parallel", library);
+    type_add_name(context->global_type_map, "sched", library);
 }
 
 /* type_destroy() -- deallocates space for the type context
@@ -254,57 +517,107 @@ void type_destroy(struct type_context *context)
 {
     hashmap_free(context->type_map);
     hashmap_free(context->global_type_map);
+
+    if (context->imported != NULL)
+        hashmap_free(context->imported);
+}
+
+/* type_import() -- makes the exports of another module known as globals, a global that is defined
+ * already keeps its type
+ *      args: context, summary of the module (kept until the context is destroyed)
+ *      returns: 0 on success, -1 if a type of the summary is malformed
+ */
+int type_import(struct type_context *context, const struct summary *module)
+{
+    if (context->imported == NULL)
+        context->imported = hashmap_new();
+
+    for (int i = 0; i < module->exports.size; i++) {
+        struct summary_entry *entry = &module->exports.entries[i];
+        struct type *type = summary_parse_type(entry->type);
+
+        if (type == NULL)
+            return -1;
+
+        if (type_name_exists(context, entry->name))
+            continue;
+
+        type_add_name(context->global_type_map, entry->name, type);
+        hashmap_put(context->imported, entry->name, entry->type);
+    }
+
+    return 0;
+}
+
+/* type_fill_empty() -- gives an empty {} the type of the array or table variable it is assigned
+ * to, it has no element to go by
+ *      args: type of the variable, value node
+ *      returns: none
+ */
+static void type_fill_empty(struct type *type, struct node *value)
+{
+    bool empty =
+        (value->type == NODE_ARRAY_CONSTRUCTOR && value->data.array_constructor.exprlist == NULL) ||
+        (value->type == NODE_TABLE_CONSTRUCTOR && value->data.table_constructor.pairlist == NULL);
+
+    if (empty && type != NULL && (type->kind == TYPE_ARRAY || type->kind == TYPE_TABLE))
+        value->node_type = type;
 }
 
 static void type_handle_local_assignment(struct type_context *context, struct node *name,
                                          struct node *expr)
 {
-    struct node *identifier;
+    struct node *identifier = name;
+    struct type *annotation = NULL;
 
-    if (name && expr) {
-        if (name->data.type_annotation.type->node_type == NULL) {
-            free(name->node_type);
-            name->node_type = expr->node_type;
-            name->data.type_annotation.type->node_type = expr->node_type;
-        } else if (name->type != NODE_TYPE_ANNOTATION) {
-            free(name->node_type);
-            name->node_type = expr->node_type;
+    if (!name) {
+        if (expr) {
+            compiler_error(expr->location, "expression is not assigned to a variable");
+            context->error_count++;
+        }
+        return;
+    }
+
+    /* Annotated names carry the identifier and the (possibly inferred) type */
+    if (name->type == NODE_TYPE_ANNOTATION) {
+        identifier = name->data.type_annotation.identifier;
+        annotation = name->data.type_annotation.type->node_type;
+    }
 
+    if (expr) {
+        if (annotation == NULL) {
             if (context->is_strict && name->type != NODE_TYPE_ANNOTATION) {
                 compiler_error(name->location,
                                "expected type annotation; compiler is in \"strict\" mode");
                 context->error_count++;
             }
-        }
 
-        identifier = name;
-    } else if (name)
-        identifier = name->data.type_annotation.identifier;
+            /* Infer the type from the value */
+            name->node_type = type_widen(expr->node_type);
+            if (name->type == NODE_TYPE_ANNOTATION)
+                name->data.type_annotation.type->node_type = name->node_type;
+        } else {
+            name->node_type = annotation;
+            type_fill_empty(annotation, expr);
 
-    if (name && expr) {
-        if (!type_is(name->node_type, expr->node_type)) {
-            if (name->node_type) {
+            if (!type_accepts(annotation, expr)) {
                 compiler_error(name->location,
                                "type mismatch: unable to assign variable with type \"%s\" a value "
                                "of type \"%s\"",
-                               type_to_string(name->node_type), type_to_string(expr->node_type));
+                               type_to_string(annotation), type_to_string(expr->node_type));
                 context->error_count++;
-            } else
-                name->node_type = expr->node_type;
+            }
         }
-        type_add(context, identifier, name->node_type);
-    } else if (name) {
+    } else {
         if (context->is_strict) {
             compiler_error(name->location, "variable is inherently \"nil\"");
             context->error_count++;
         }
-        free(name->node_type);
-        name->node_type = type_basic(TYPE_BASIC_NIL);
-        type_add(context, identifier, name->node_type);
-    } else if (expr) {
-        compiler_error(expr->location, "expression is not assigned to a variable");
-        context->error_count++;
+        name->node_type = annotation ? annotation : type_basic(TYPE_BASIC_NIL);
     }
+
+    identifier->node_type = name->node_type;
+    type_add(context, identifier, name->node_type);
 }
 
 static void type_handle_local(struct type_context *context, struct node *local)
@@ -315,7 +628,7 @@ static void type_handle_local(struct type_context *context, struct node *local)
     while (true) {
 
         /* Both are lists -> check first values of each */
-        if ((vars && values) && vars->type == NODE_VARIABLE_LIST &&
+        if ((vars && values) && vars->type == NODE_NAME_LIST &&
             values->type == NODE_EXPRESSION_LIST) {
 
             type_handle_local_assignment(context, vars->data.name_list.name,
@@ -325,10 +638,10 @@ static void type_handle_local(struct type_context *context, struct node *local)
             values = values->data.expression_list.init;
         }
         /* first is list second is NULL -> continue first */
-        else if ((vars) && vars->type == NODE_VARIABLE_LIST) {
+        else if ((vars) && vars->type == NODE_NAME_LIST) {
             type_handle_local_assignment(context, vars->data.name_list.name, values);
 
-            vars = vars->data.variable_list.init;
+            vars = vars->data.name_list.init;
             values = NULL;
         }
         /* first is NULL second is list -> continue second */
@@ -346,6 +659,18 @@ static void type_handle_local(struct type_context *context, struct node *local)
     }
 }
 
+/* type_record_import() -- lists a global in the imports of the module if another module defines it
+ *      args: context, name of the global
+ *      returns: none
+ */
+static void type_record_import(struct type_context *context, char *name)
+{
+    char *type;
+
+    if (context->imported != NULL && hashmap_get(context->imported, name, (void **)&type) == MAP_OK)
+        summary_add(&context->summary->imports, name, type);
+}
+
 static void type_handle_name_reference(struct type_context *context, struct node *name_reference)
 {
     struct node *value = name_reference->data.name_reference.identifier;
@@ -369,6 +694,10 @@ static void type_handle_name_reference(struct type_context *context, struct node
                 value->node_type = t;
                 value->data.identifier.is_global = res;
                 name_reference->node_type = t;
+
+                /* Globals of other modules are part of the summary, with the type they had */
+                if (res && context->summary != NULL)
+                    type_record_import(context, value->data.identifier.name);
             }
             break;
         case NODE_EXPRESSION_INDEX:
@@ -389,7 +718,7 @@ static void type_handle_name_reference(struct type_context *context, struct node
                 case TYPE_ARRAY:
                     types_equal =
                         expression->node_type->kind == TYPE_ARRAY
-                            ? type_is_primitive(index->node_type, TYPE_BASIC_NUMBER)
+                            ? type_is_number(index->node_type)
                             : type_is(index->node_type, expression->node_type->data.table.key);
 
                     if (!types_equal) {
@@ -400,7 +729,6 @@ static void type_handle_name_reference(struct type_context *context, struct node
                             type_to_string(index->node_type));
                         context->error_count++;
                     }
-                    free(name_reference->node_type);
                     name_reference->node_type = expression->node_type->kind == TYPE_ARRAY
                                                     ? expression->node_type->data.array.type
                                                     : expression->node_type->data.table.value;
@@ -408,7 +736,22 @@ static void type_handle_name_reference(struct type_context *context, struct node
             }
             break;
         case NODE_NAME_INDEX:
-            /* later, for classes */
+            expression = value->data.name_index.expression;
+
+            type_ast_traversal(context, expression, false);
+
+            /* On a table t.name is t["name"], other types are left for classes */
+            if (expression->node_type == NULL || expression->node_type->kind != TYPE_TABLE)
+                break;
+
+            if (!type_is(type_basic(TYPE_BASIC_STRING), expression->node_type->data.table.key)) {
+                compiler_error(expression->location,
+                               "incorrect type usage: unable to index type \"%s\" with type \"%s\"",
+                               type_to_string(expression->node_type),
+                               type_to_string(type_basic(TYPE_BASIC_STRING)));
+                context->error_count++;
+            }
+            name_reference->node_type = expression->node_type->data.table.value;
             break;
     }
 }
@@ -426,18 +769,20 @@ static void type_handle_binary_operation(struct type_context *context,
         case BINOP_DIV:
         case BINOP_MOD:
         case BINOP_POW:
-            /* Free the default type assigned */
-            free(binary_operation->node_type);
-
-            if (!type_is_primitive(right->node_type, TYPE_BASIC_NUMBER) ||
-                !type_is_primitive(left->node_type, TYPE_BASIC_NUMBER)) {
+            if (!type_is_number(right->node_type) || !type_is_number(left->node_type)) {
                 compiler_error(binary_operation->location,
                                "unable to perform '%c' on values of type \"%s\" and \"%s\"",
                                binary_operations[binary_operation->data.binary_operation.operation],
                                type_to_string(right->node_type), type_to_string(left->node_type));
                 context->error_count++;
             } else {
-                binary_operation->node_type = type_basic(TYPE_BASIC_NUMBER);
+                /* Only a quotient or a power of two integers may have a fraction */
+                bool whole = binary_operation->data.binary_operation.operation != BINOP_DIV &&
+                             binary_operation->data.binary_operation.operation != BINOP_POW &&
+                             type_is_integer(left) && type_is_integer(right);
+
+                binary_operation->node_type =
+                    type_basic(whole ? TYPE_BASIC_INTEGER : TYPE_BASIC_NUMBER);
             }
             break;
         case BINOP_GE:
@@ -453,19 +798,19 @@ static void type_handle_binary_operation(struct type_context *context,
         case BINOP_CONCAT:
         case BINOP_EQ:
         case BINOP_NE:
-            free(binary_operation->node_type);
             binary_operation->node_type =
                 type_basic(binary_operation->data.binary_operation.operation == BINOP_CONCAT
                                ? TYPE_BASIC_STRING
                                : TYPE_BASIC_BOOLEAN);
             break;
-        /* Lua has some weird 'and' and 'or' operations */
+        /* Lua has some weird 'and' and 'or' operations, `nil and b' is nil and `nil or b' is b */
         case BINOP_AND:
         case BINOP_OR:
-            free(binary_operation->node_type);
             binary_operation->node_type =
-                binary_operation->data.binary_operation.operation == BINOP_AND ? right->node_type
-                                                                               : left->node_type;
+                (binary_operation->data.binary_operation.operation == BINOP_AND) !=
+                        type_is_primitive(left->node_type, TYPE_BASIC_NIL)
+                    ? right->node_type
+                    : left->node_type;
             break;
     }
 }
@@ -476,22 +821,26 @@ static void type_handle_array_constructor(struct type_context *context,
     struct node *expr = array_constructor->data.array_constructor.exprlist;
     struct type *type = NULL;
 
+    /* An empty {} holds no element to go by, the variable it is assigned to gives its type */
+    if (expr == NULL) {
+        array_constructor->node_type = type_basic(TYPE_BASIC_ANY);
+        return;
+    }
+
     while (true) {
         switch (expr->type) {
             case NODE_EXPRESSION_LIST:
                 if (type) {
                     if (!type_is(expr->data.expression_list.expression->node_type, type)) {
-                        free(array_constructor->node_type);
                         array_constructor->node_type = type_array(type_basic(TYPE_BASIC_ANY));
                         return;
                     }
                 } else
-                    type = expr->data.expression_list.expression->node_type;
+                    type = type_widen(expr->data.expression_list.expression->node_type);
 
                 expr = expr->data.expression_list.init;
                 break;
             default:
-                free(array_constructor->node_type);
                 if (type) {
                     if (!type_is(expr->node_type, type)) {
                         array_constructor->node_type = type_array(type_basic(TYPE_BASIC_ANY));
@@ -499,7 +848,7 @@ static void type_handle_array_constructor(struct type_context *context,
                     }
                     array_constructor->node_type = type_array(type);
                 } else
-                    array_constructor->node_type = type_array(expr->node_type);
+                    array_constructor->node_type = type_array(type_widen(expr->node_type));
                 return;
         }
     }
@@ -513,6 +862,11 @@ static void type_handle_table_constructor(struct type_context *context,
     struct type *valuetype = NULL;
     struct node *pair = NULL;
 
+    if (expr == NULL) {
+        table_constructor->node_type = type_basic(TYPE_BASIC_ANY);
+        return;
+    }
+
     while (true) {
         switch (expr->type) {
             case NODE_EXPRESSION_LIST:
@@ -520,41 +874,31 @@ static void type_handle_table_constructor(struct type_context *context,
 
                 if (keytype && valuetype) {
                     if (!type_is(pair->data.key_value_pair.key->node_type, keytype)) {
-                        free(keytype);
                         keytype = type_basic(TYPE_BASIC_ANY);
                     }
                     if (!type_is(pair->data.key_value_pair.value->node_type, valuetype)) {
-                        free(valuetype);
                         valuetype = type_basic(TYPE_BASIC_ANY);
                     }
                 } else {
-                    keytype = pair->data.key_value_pair.key->node_type;
-                    valuetype = pair->data.key_value_pair.value->node_type;
+                    keytype = type_widen(pair->data.key_value_pair.key->node_type);
+                    valuetype = type_widen(pair->data.key_value_pair.value->node_type);
                 }
 
                 expr = expr->data.expression_list.init;
                 break;
             default:
                 if (keytype && valuetype) {
-                    // Free existing type, as we will override it
-                    free(table_constructor->node_type);
-
                     if (!type_is(expr->data.key_value_pair.key->node_type, keytype)) {
-                        free(keytype);
                         keytype = type_basic(TYPE_BASIC_ANY);
                     }
                     if (!type_is(expr->data.key_value_pair.value->node_type, valuetype)) {
-                        free(valuetype);
                         valuetype = type_basic(TYPE_BASIC_ANY);
                     }
                     table_constructor->node_type = type_table(keytype, valuetype);
                 } else {
-                    // Free existing type, as we will override it
-                    free(table_constructor->node_type);
-
                     table_constructor->node_type =
-                        type_table(expr->data.key_value_pair.key->node_type,
-                                   expr->data.key_value_pair.value->node_type);
+                        type_table(type_widen(expr->data.key_value_pair.key->node_type),
+                                   type_widen(expr->data.key_value_pair.value->node_type));
                 }
                 return;
         }
@@ -565,7 +909,9 @@ static void type_handle_single_assignment(struct type_context *context, struct n
                                           struct node *value)
 {
     if (variable && value) {
-        if (!type_is(variable->node_type, value->node_type)) {
+        type_fill_empty(variable->node_type, value);
+
+        if (!type_accepts(variable->node_type, value)) {
             compiler_error(
                 variable->location,
                 "type mismatch: unable to assign variable with type \"%s\" a value of type \"%s\"",
@@ -581,6 +927,68 @@ static void type_handle_single_assignment(struct type_context *context, struct n
     }
 }
 
+/* type_define_global() -- defines the global a variable names if it is not defined yet, it takes
+ * the type of its value and is exported by the module
+ *      args: context, variable, value (NULL if the assignment has no value for it)
+ *      returns: none
+ */
+static void type_define_global(struct type_context *context, struct node *variable,
+                               struct node *value)
+{
+    if (variable->type != NODE_NAME_REFERENCE || value == NULL || value->node_type == NULL)
+        return;
+
+    struct node *identifier = variable->data.name_reference.identifier;
+
+    if (identifier->type != NODE_IDENTIFIER ||
+        type_name_exists(context, identifier->data.identifier.name))
+        return;
+
+    struct type *type = type_widen(value->node_type);
+
+    if (context->stream)
+        type_add_name(context->global_type_map, astrdup(identifier->data.identifier.name),
+                      type_keep(type));
+    else
+        type_add_name(context->global_type_map, identifier->data.identifier.name, type);
+
+    if (context->summary != NULL) {
+        char *string = summary_type_string(type);
+
+        summary_add(&context->summary->exports, identifier->data.identifier.name, string);
+        free(string);
+    }
+}
+
+/* type_define_globals() -- defines the globals an assignment at the top level of the main chunk
+ * introduces, its values have been checked already
+ *      args: context, assignment node
+ *      returns: none
+ */
+static void type_define_globals(struct type_context *context, struct node *assignment)
+{
+    struct node *vars = assignment->data.assignment.variables;
+    struct node *values = assignment->data.assignment.values;
+
+    while (vars != NULL) {
+        struct node *variable = vars, *value = values;
+
+        if (vars->type == NODE_VARIABLE_LIST) {
+            variable = vars->data.variable_list.variable;
+            vars = vars->data.variable_list.init;
+        } else
+            vars = NULL;
+
+        if (values != NULL && values->type == NODE_EXPRESSION_LIST) {
+            value = values->data.expression_list.expression;
+            values = values->data.expression_list.init;
+        } else
+            values = NULL;
+
+        type_define_global(context, variable, value);
+    }
+}
+
 static void type_handle_assignment(struct type_context *context, struct node *assignment)
 {
     struct node *vars = assignment->data.assignment.variables;
@@ -648,7 +1056,10 @@ static void type_handle_generic_for_assign(struct type_context *context, struct
                 context->error_count++;
                 return;
         }
-        if (!type_is(variable->node_type, t)) {
+        /* The elements of an Array<number> may have a fraction, an integer can not take them */
+        if (!type_is(variable->node_type, t) ||
+            (type_is_primitive(variable->node_type, TYPE_BASIC_INTEGER) &&
+             type_is_primitive(t, TYPE_BASIC_NUMBER))) {
             compiler_error(variable->location,
                            "type mismatch: unable to iterate \"%s\" with \"%s\"",
                            type_to_string(variable->node_type), type_to_string(value->node_type));
@@ -713,7 +1124,7 @@ static void type_handle_numeric_for_loop(struct type_context *context, struct no
 
     if (var->type == NODE_TYPE_ANNOTATION) {
         /* Check if types are equal */
-        if (!type_is(var->node_type, val->node_type)) {
+        if (!type_accepts(var->node_type, val)) {
             compiler_error(
                 init->location,
                 "type mismatch: unable to assign variable or type \"%s\" a value of type \"%s\"",
@@ -721,6 +1132,12 @@ static void type_handle_numeric_for_loop(struct type_context *context, struct no
             context->error_count++;
         }
 
+        /* An integer stays whole only if it is stepped by a whole number */
+        if (type_is_primitive(var->node_type, TYPE_BASIC_INTEGER) && !type_is_integer(increment)) {
+            compiler_error(increment->location, "'for' step of an \"integer\" must be an integer");
+            context->error_count++;
+        }
+
         type_add(context, var->data.type_annotation.identifier, var->node_type);
         return;
     } else if (var->type == NODE_IDENTIFIER) {
@@ -735,7 +1152,6 @@ static void type_handle_numeric_for_loop(struct type_context *context, struct no
                 context->error_count++;
             }
 
-            free(var->node_type);
             var->node_type = val->node_type;
 
             type_add(context, var, var->node_type);
@@ -747,17 +1163,17 @@ static void type_handle_numeric_for_loop(struct type_context *context, struct no
     type_ast_traversal(context, init, false);
 
     /* Ensure that all types are numbers or else we have a problem! */
-    if (!type_is_primitive(var->node_type, TYPE_BASIC_NUMBER)) {
+    if (!type_is_number(var->node_type)) {
         compiler_error(var->location, "'for' variable must be a \"number\"");
         context->error_count++;
     }
 
-    if (!type_is_primitive(target->node_type, TYPE_BASIC_NUMBER)) {
+    if (!type_is_number(target->node_type)) {
         compiler_error(target->location, "'for' target value must be a \"number\"");
         context->error_count++;
     }
 
-    if (!type_is_primitive(increment->node_type, TYPE_BASIC_NUMBER)) {
+    if (!type_is_number(increment->node_type)) {
         compiler_error(increment->location, "'for' step must be a \"number\"");
         context->error_count++;
     }
@@ -778,23 +1194,22 @@ static void type_handle_unary(struct type_context *context, struct node *unary)
                 context->error_count++;
             }
 
-            free(unary->node_type);
-            unary->node_type = expr->node_type;
+            /* The length of anything is a whole number */
+            unary->node_type = type_basic(TYPE_BASIC_INTEGER);
             break;
         case UNOP_NEG:
             /* Can only be number */
-            if (!type_is_primitive(expr->node_type, TYPE_BASIC_NUMBER)) {
+            if (!type_is_number(expr->node_type)) {
                 compiler_error(unary->location,
                                "unable to perform arithmetic on value of \"%s\" type",
                                type_to_string(expr->node_type));
                 context->error_count++;
             }
 
-            free(unary->node_type);
-            unary->node_type = expr->node_type;
+            unary->node_type = type_is_integer(expr) ? type_basic(TYPE_BASIC_INTEGER)
+                                                     : expr->node_type;
             break;
         case UNOP_NOT:
-            free(unary->node_type);
             unary->node_type = type_basic(TYPE_BASIC_BOOLEAN);
             break;
     }
@@ -808,6 +1223,10 @@ static struct node *type_build_type_list(struct type_context *context, struct no
     if (namelist == NULL && vararg)
         return node_type(vararg->location, vararg->node_type);
 
+    /* A function without parameters */
+    if (namelist == NULL)
+        return NULL;
+
     if (namelist->type == NODE_NAME_LIST)
         t = namelist->data.name_list.name;
     else
@@ -837,11 +1256,10 @@ static void type_handle_function_body(struct type_context *context, struct node
     struct node *typelist = funcbody->data.function_body.type_list;
     struct node *parameters = funcbody->data.function_body.exprlist;
 
-    struct node *vararg = parameters->data.parameter_list.vararg;
-    struct node *namelist = parameters->data.parameter_list.namelist;
+    struct node *vararg = parameters != NULL ? parameters->data.parameter_list.vararg : NULL;
+    struct node *namelist = parameters != NULL ? parameters->data.parameter_list.namelist : NULL;
 
     if (funcbody->node_type)
-        free(funcbody->node_type);
 
     funcbody->node_type = type_function(type_build_type_list(context, namelist, vararg), typelist);
 
@@ -877,7 +1295,7 @@ static void type_handle_single_call(struct type_context *context, struct node *a
                                     struct node *type, YYLTYPE location)
 {
     if (arg && type) {
-        if (!type_is(arg->node_type, type->node_type) &&
+        if (!type_accepts(type->node_type, arg) &&
             !type_is_primitive(type->node_type, TYPE_BASIC_VARARG)) {
             compiler_error(arg->location,
                            "type mismatch: argument of type \"%s\" is incompatible with parameter "
@@ -947,8 +1365,10 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
 
     int last_count;
 
+    /* Scopes opened below are nested, except for the body of the main chunk */
     struct type_context new_context = {context->is_strict, context->error_count, NULL,
-                                       context->global_type_map};
+                                       context->global_type_map, true, context->summary,
+                                       context->imported, context->stream};
 
     switch (node->type) {
         case NODE_EXPRESSION_STATEMENT:
@@ -971,8 +1391,15 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
             type_handle_local(context, node);
             break;
         case NODE_ASSIGNMENT:
-            type_ast_traversal(context, node->data.assignment.variables, false);
-            type_ast_traversal(context, node->data.assignment.values, false);
+            /* The values come first, the names the assignment defines take their types */
+            if (!context->nested && node->data.assignment.type == ASSIGN) {
+                type_ast_traversal(context, node->data.assignment.values, false);
+                type_define_globals(context, node);
+                type_ast_traversal(context, node->data.assignment.variables, false);
+            } else {
+                type_ast_traversal(context, node->data.assignment.variables, false);
+                type_ast_traversal(context, node->data.assignment.values, false);
+            }
 
             type_handle_assignment(context, node);
             break;
@@ -980,6 +1407,10 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
             type_ast_traversal(context, node->data.variable_list.init, false);
             type_ast_traversal(context, node->data.variable_list.variable, false);
             break;
+        case NODE_EXPRESSION_LIST:
+            type_ast_traversal(context, node->data.expression_list.expression, false);
+            type_ast_traversal(context, node->data.expression_list.init, false);
+            break;
         case NODE_ARRAY_CONSTRUCTOR:
             type_ast_traversal(context, node->data.array_constructor.exprlist, false);
 
@@ -1002,15 +1433,15 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
             break;
         case NODE_BLOCK:
             if (main) {
-                type_ast_traversal(context, node->data.block.init, true);
-                type_ast_traversal(context, node->data.block.statement, false);
+                for (int i = 0; i < node->data.block.size; i++)
+                    type_ast_traversal(context, node->data.block.statements[i], false);
             } else {
-                new_context.type_map = hashmap_duplicate(context->type_map);
+                new_context.type_map = hashmap_scope(context->type_map);
 
-                type_ast_traversal(&new_context, node->data.block.init, true);
-                type_ast_traversal(&new_context, node->data.block.statement, false);
+                for (int i = 0; i < node->data.block.size; i++)
+                    type_ast_traversal(&new_context, node->data.block.statements[i], false);
 
-                free(new_context.type_map);
+                hashmap_free(new_context.type_map);
                 context->error_count = new_context.error_count;
             }
             break;
@@ -1025,22 +1456,27 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
 
             /* Check if everything is legal */
             type_handle_call(context, node);
+            break;
         case NODE_IF:
             type_ast_traversal(context, node->data.if_statement.condition, false);
             type_ast_traversal(context, node->data.if_statement.body, false);
             type_ast_traversal(context, node->data.if_statement.else_body, false);
             break;
         case NODE_REPEATLOOP:
-            type_ast_traversal(context, node->data.repeat_loop.body,
+            new_context.type_map = context->type_map;
+
+            type_ast_traversal(&new_context, node->data.repeat_loop.body,
                                true); // Variables defined in the body can be used in the condition.
-            type_ast_traversal(context, node->data.repeat_loop.condition, false);
+            type_ast_traversal(&new_context, node->data.repeat_loop.condition, false);
+
+            context->error_count = new_context.error_count;
             break;
         case NODE_WHILELOOP:
             type_ast_traversal(context, node->data.while_loop.condition, false);
             type_ast_traversal(context, node->data.while_loop.body, false);
             break;
         case NODE_NUMERICFORLOOP:
-            new_context.type_map = hashmap_duplicate(context->type_map);
+            new_context.type_map = hashmap_scope(context->type_map);
 
             type_ast_traversal(&new_context, node->data.numerical_for_loop.increment, false);
             type_ast_traversal(&new_context, node->data.numerical_for_loop.target, false);
@@ -1049,12 +1485,12 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
 
             type_ast_traversal(&new_context, node->data.numerical_for_loop.body, true);
 
-            free(new_context.type_map);
+            hashmap_free(new_context.type_map);
             context->error_count = new_context.error_count;
             break;
         case NODE_GENERICFORLOOP:
-            /* Copy the old context (find better way to do this, the current way eats your ram) */
-            new_context.type_map = hashmap_duplicate(context->type_map);
+            /* Layer a new scope on top of the old context */
+            new_context.type_map = hashmap_scope(context->type_map);
 
             type_ast_traversal(&new_context, node->data.generic_for_loop.local->data.local.namelist,
                                false);
@@ -1065,19 +1501,25 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
 
             type_ast_traversal(&new_context, node->data.generic_for_loop.body, true);
 
-            free(new_context.type_map);
+            hashmap_free(new_context.type_map);
             context->error_count = new_context.error_count;
             break;
+        case NODE_EXPRESSION_GROUP:
+            type_ast_traversal(context, node->data.expression_group.expression, false);
+
+            node->node_type = node->data.expression_group.expression->node_type;
+            break;
         case NODE_UNARY_OPERATION:
             type_ast_traversal(context, node->data.unary_operation.expression, false);
 
             type_handle_unary(context, node);
             break;
         case NODE_FUNCTION_BODY:
-            if (main)
+            if (main) {
                 new_context.type_map = context->type_map;
-            else
-                new_context.type_map = hashmap_duplicate(context->type_map);
+                new_context.nested = context->nested;
+            } else
+                new_context.type_map = hashmap_scope(context->type_map);
 
             type_ast_traversal(&new_context, node->data.function_body.exprlist, false);
             type_ast_traversal(&new_context, node->data.function_body.type_list, false);
@@ -1087,7 +1529,7 @@ void type_ast_traversal(struct type_context *context, struct node *node, bool ma
             type_ast_traversal(&new_context, node->data.function_body.body, true);
 
             if (!main)
-                free(new_context.type_map);
+                hashmap_free(new_context.type_map);
 
             context->error_count = new_context.error_count;
             break;
@@ -7,12 +7,14 @@
 #include "util/hashmap.h"
 
 struct node;
+struct summary;
 
 enum type_kind { TYPE_PRIMITIVE, TYPE_ARRAY, TYPE_TABLE, TYPE_FUNCTION, TYPE_CUSTOM };
 
 /* Maybe add other types..? */
 enum type_primitive_kind {
     TYPE_BASIC_NUMBER,
+    TYPE_BASIC_INTEGER, /* A number the type checker proved to be whole, see type_is_integer() */
     TYPE_BASIC_STRING,
     TYPE_BASIC_BOOLEAN,
     TYPE_BASIC_NIL,
@@ -28,8 +30,12 @@ enum type_primitive_kind {
     TYPE_BASIC_ANY
 };
 
+/* Primitive types are singletons and arrays and tables are hash-consed on their components, so two
+ * exact types are equal if and only if they are the same object */
 struct type {
     enum type_kind kind;
+    unsigned int id; /* Identifies the canonical type, 0 for function types */
+    bool exact;      /* No any and no function type inside, equality is identity */
 
     /* Data stored below */
     union {
@@ -59,10 +65,18 @@ struct type_context {
 
     map_t type_map;        /* Hashmap of all identifiers and types */
     map_t global_type_map; /* Hashmap of all globals and their types */
+
+    bool nested; /* Inside a block or function, assignments no longer define globals */
+
+    struct summary *summary; /* Collects the exports and imports of the module, NULL if unused */
+    map_t imported;          /* Globals of other modules and their type strings, NULL if none */
+
+    bool stream; /* Statements come one by one and their nodes are released (see stream.h) */
 };
 
 void type_init(struct type_context *context);
 void type_destroy(struct type_context *context);
+int type_import(struct type_context *context, const struct summary *module);
 
 struct type *type_basic(enum type_primitive_kind kind);
 struct type *type_array(struct type *type);
@@ -70,6 +84,9 @@ struct type *type_table(struct type *key, struct type *value);
 struct type *type_function(struct node *args_list, struct node *rets_list);
 
 bool type_is(struct type *first, struct type *second);
+bool type_is_primitive(struct type *type, enum type_primitive_kind kind);
+bool type_is_number(struct type *type);
+bool type_is_integer(const struct node *node);
 void type_ast_traversal(struct type_context *context, struct node *node, bool main);
 
 char *type_to_string(struct type *type);
@@ -0,0 +1,169 @@
+/*  arena.c - 1.0
+ *      bump allocator used for the objects of a single compilation
+ */
+
+#include "arena.h"
+#include "flexstr.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every allocation is aligned for any object type */
+#define ARENA_ALIGN (alignof(max_align_t))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Size of the block header, rounded so that the data following it is aligned */
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct arena_block))
+
+/* Arena that amalloc() and astrdup() allocate from, each compiler thread has its own */
+static _Thread_local arena_t *current = NULL;
+
+/* Bumped whenever another arena is selected */
+static _Thread_local unsigned int generation = 0;
+
+/* arena_init() -- initializes a new arena instance
+ *      args: instance
+ */
+void arena_init(arena_t *p)
+{
+    p->a_head = NULL;
+    p->a_allocs = 0;
+    p->a_bytes = 0;
+}
+
+/* arena_free() -- releases every object allocated from the arena at once
+ *      args: instance
+ */
+void arena_free(arena_t *p)
+{
+    struct arena_block *block = p->a_head;
+
+    while (block != NULL) {
+        struct arena_block *next = block->ab_next;
+        free(block);
+        block = next;
+    }
+
+    p->a_head = NULL;
+}
+
+/* arena_reset() -- releases every object allocated from the arena, but keeps a block for the
+ * objects allocated next
+ *      args: instance
+ *
+ * Note: For arenas that are emptied over and over, like the one of the statement being compiled by
+ * stream_compile(). Only the head block is kept, unless it was made for a single large request.
+ */
+void arena_reset(arena_t *p)
+{
+    struct arena_block *keep = p->a_head;
+
+    if (keep != NULL && keep->ab_space == ARENA_BLOCKSIZE - ARENA_HEADER) {
+        p->a_head = keep->ab_next;
+        arena_free(p);
+
+        keep->ab_next = NULL;
+        keep->ab_used = 0;
+        p->a_head = keep;
+    } else
+        arena_free(p);
+}
+
+/* arena_alloc() -- allocates memory from the arena
+ *      args: instance, number of bytes
+ *      returns: newly allocated memory
+ *
+ * Note: Memory is handed out from ARENA_BLOCKSIZE blocks. Requests that would not fit in a fresh
+ * block get a block of their own.
+ */
+void *arena_alloc(arena_t *p, size_t n)
+{
+    struct arena_block *block = p->a_head;
+    n = ARENA_ROUND(n > 0 ? n : 1);
+
+    if (block == NULL || block->ab_used + n > block->ab_space) {
+        size_t space = n > ARENA_BLOCKSIZE - ARENA_HEADER ? n : ARENA_BLOCKSIZE - ARENA_HEADER;
+
+        block = smalloc(ARENA_HEADER + space);
+        block->ab_used = 0;
+        block->ab_space = space;
+
+        /* Keep filling the current block when the new one was made for a single large request */
+        if (p->a_head != NULL && space == n &&
+            p->a_head->ab_space - p->a_head->ab_used > ARENA_BLOCKSIZE / 8) {
+            block->ab_next = p->a_head->ab_next;
+            p->a_head->ab_next = block;
+        } else {
+            block->ab_next = p->a_head;
+            p->a_head = block;
+        }
+    }
+
+    void *res = (char *)block + ARENA_HEADER + block->ab_used;
+    block->ab_used += n;
+
+    p->a_allocs++;
+    p->a_bytes += n;
+    return res;
+}
+
+/* arena_strdup() -- copies a string into the arena
+ *      args: instance, string
+ *      returns: the copy
+ */
+char *arena_strdup(arena_t *p, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(p, len), s, len);
+}
+
+/* arena_use() -- selects the arena the compiler passes allocate from
+ *      args: instance (or NULL to go back to the heap)
+ */
+void arena_use(arena_t *p)
+{
+    current = p;
+    generation++;
+}
+
+/* arena_current() -- gets the arena the compiler passes allocate from
+ *      returns: instance (NULL when allocating from the heap)
+ */
+arena_t *arena_current(void) { return current; }
+
+/* arena_generation() -- tells caches of objects from the current arena whether they are stale, a
+ * new arena can live at the address of a released one
+ *      returns: number that changes whenever arena_use() is called
+ */
+unsigned int arena_generation(void) { return generation; }
+
+/* amalloc() -- allocates memory for an object of the current compilation
+ *      args: number of bytes
+ *      returns: newly allocated memory
+ *
+ * Note: Falls back to smalloc() when no arena has been selected.
+ */
+void *amalloc(size_t n) { return current != NULL ? arena_alloc(current, n) : smalloc(n); }
+
+/* astrdup() -- copies a string for the current compilation
+ *      args: string
+ *      returns: the copy
+ */
+char *astrdup(const char *s)
+{
+    return current != NULL ? arena_strdup(current, s) : strcpy(smalloc(strlen(s) + 1), s);
+}
+
+/* astrndup() -- copies a slice of a string for the current compilation
+ *      args: characters (need not be terminated), number of characters
+ *      returns: the terminated copy
+ */
+char *astrndup(const char *s, size_t n)
+{
+    char *res = amalloc(n + 1);
+
+    memcpy(res, s, n);
+    res[n] = '\0';
+    return res;
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCKSIZE (64 * 1024)
+
+struct arena_block {
+    struct arena_block *ab_next; /* Previously filled block */
+    size_t ab_used;              /* Total space used */
+    size_t ab_space;             /* Total space allocated after the header */
+};
+
+struct arena {
+    struct arena_block *a_head; /* Block that is currently being filled */
+
+    size_t a_allocs; /* Number of allocations made from the arena */
+    size_t a_bytes;  /* Bytes handed out, including alignment padding */
+};
+
+typedef struct arena arena_t;
+
+/* Construction and destruction methods */
+void arena_init(arena_t *p);
+void arena_free(arena_t *p);
+
+/* Other methods */
+void *arena_alloc(arena_t *p, size_t n);
+void arena_reset(arena_t *p);
+char *arena_strdup(arena_t *p, const char *s);
+
+/* Allocation from the arena of the current compilation */
+void arena_use(arena_t *p);
+arena_t *arena_current(void);
+unsigned int arena_generation(void);
+void *amalloc(size_t n);
+char *astrdup(const char *s);
+char *astrndup(const char *s, size_t n);
+
+#endif
@@ -0,0 +1,82 @@
+/*  buffer.c - 1.0
+ *      growable byte buffer library
+ */
+
+#include "buffer.h"
+#include "flexstr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* buf_init() -- initializes a new buffer instance
+ *      args: instance, initial amount of space
+ *
+ * Note: If `amt` is 0 then the buffer will start out with BUFFER_CHUNKSIZE bytes
+ */
+void buf_init(buffer_t *p, size_t amt)
+{
+    p->b_used = 0;
+    p->b_space = (amt > 0 ? amt : BUFFER_CHUNKSIZE);
+    p->b_data = smalloc(p->b_space);
+}
+
+/* buf_free() -- free a buffer instance
+ *      args: instance
+ */
+void buf_free(buffer_t *p)
+{
+    free(p->b_data);
+
+    p->b_data = NULL;
+    p->b_used = p->b_space = 0;
+}
+
+/* buf_reserve() -- makes sure there is room for a number of additional bytes
+ *      args: instance, number of bytes
+ *
+ * Note: The buffer at least doubles every time it has to grow, so appending is amortized O(1).
+ */
+void buf_reserve(buffer_t *p, size_t amt)
+{
+    if (p->b_used + amt <= p->b_space)
+        return;
+
+    size_t space = p->b_space > 0 ? p->b_space : BUFFER_CHUNKSIZE;
+    while (p->b_used + amt > space)
+        space *= 2;
+
+    p->b_data = srealloc(p->b_data, space);
+    p->b_space = space;
+}
+
+/* buf_addch() -- adds a single byte to the buffer
+ *      args: instance, byte
+ */
+void buf_addch(buffer_t *p, unsigned char c)
+{
+    buf_reserve(p, 1);
+    p->b_data[p->b_used++] = c;
+}
+
+/* buf_addmem() -- adds a block of bytes to the buffer
+ *      args: instance, bytes, number of bytes
+ */
+void buf_addmem(buffer_t *p, const void *data, size_t amt)
+{
+    buf_reserve(p, amt);
+    memcpy(p->b_data + p->b_used, data, amt);
+    p->b_used += amt;
+}
+
+/* buf_flush() -- writes the contents of the buffer to a stream with a single write and empties it
+ *      args: instance, stream
+ *      returns: 0 on success, 1 when the stream could not take every byte
+ */
+int buf_flush(buffer_t *p, FILE *output)
+{
+    size_t written = fwrite(p->b_data, 1, p->b_used, output);
+    int status = written != p->b_used;
+
+    p->b_used = 0;
+    return status;
+}
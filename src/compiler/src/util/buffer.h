@@ -0,0 +1,27 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define BUFFER_CHUNKSIZE 4096
+
+struct buffer {
+    unsigned char *b_data; /* Bytes written so far */
+    size_t b_used;         /* Total space used */
+    size_t b_space;        /* Total space allocated */
+};
+
+typedef struct buffer buffer_t;
+
+/* Construction and destruction methods */
+void buf_init(buffer_t *p, size_t amt);
+void buf_free(buffer_t *p);
+
+/* Other methods */
+void buf_reserve(buffer_t *p, size_t amt);
+void buf_addch(buffer_t *p, unsigned char c);
+void buf_addmem(buffer_t *p, const void *data, size_t amt);
+int buf_flush(buffer_t *p, FILE *output);
+
+#endif
@@ -24,6 +24,26 @@ void fs_init(flexstr_t *p, int amt)
  */
 void fs_free(flexstr_t *p) { free(p->fs_str); }
 
+/* fs_reserve() -- makes room for more characters and the terminating '\0'
+ *      args: flex string, number of characters
+ *
+ * Note: The space at least doubles every time it grows, so appending n characters one at a time
+ *       costs O(n) copies in total.
+ */
+static void fs_reserve(flexstr_t *p, int n)
+{
+    int space = p->fs_space > 0 ? p->fs_space : p->fs_growby;
+
+    if (p->fs_used + n < p->fs_space) /* +1 for \0 */
+        return;
+
+    while (p->fs_used + n >= space)
+        space *= 2;
+
+    p->fs_str = srealloc(p->fs_str, space);
+    p->fs_space = space;
+}
+
 /* fs_getstr() -- returns the string in the flex string instance
  *      args: instance
  *      returns: the string
@@ -33,9 +53,7 @@ void fs_free(flexstr_t *p) { free(p->fs_str); }
 char *fs_getstr(flexstr_t *p)
 {
     /* First make sure there's room for the '\0' */
-    if (p->fs_used == p->fs_space) { /* string is full, add room for one more char */
-        p->fs_str = srealloc(p->fs_str, ++p->fs_space);
-    }
+    fs_reserve(p, 0);
 
     /* Add terminating '\0'.  Don't increment fs_used -- the '\0' is not part of
      * the string, and shouldn't be counted if someone wants to continue adding
@@ -47,34 +65,37 @@ char *fs_getstr(flexstr_t *p)
     return p->fs_str;
 }
 
+/* fs_clear() -- empties the flex string, keeping its space for the next string
+ *      args: instance
+ */
+void fs_clear(flexstr_t *p) { p->fs_used = 0; }
+
 /* fs_addch() -- adds a character to the flex string
  *      args: flex string, character
  *
- * Note: Invokes smalloc() if fs_str hasn't been alloced yet. Invokes srealloc to resize fs_str.
+ * Note: Invokes srealloc to allocate or resize fs_str.
  */
 void fs_addch(flexstr_t *p, char c)
 {
-    /* Call smalloc() if we haven't allocated any memory yet */
-    if (p->fs_space == 0) {
-        p->fs_str = smalloc(p->fs_growby);
-        p->fs_used = 0;
-        p->fs_space = p->fs_growby;
-    } else if (p->fs_used + 1 >= p->fs_space) { /* +1 for \0 */
-        p->fs_space += p->fs_growby;
-        p->fs_str = srealloc(p->fs_str, p->fs_space);
-    }
+    fs_reserve(p, 1);
     p->fs_str[p->fs_used++] = c;
 }
 
-void fs_addstr(flexstr_t *p, char *s)
+/* fs_addmem() -- adds a run of characters to the flex string at once
+ *      args: flex string, characters (need not be terminated), number of characters
+ */
+void fs_addmem(flexstr_t *p, const char *s, int n)
 {
-    int c;
-
-    /* Add each character individually */
-    while ((c = *s++) != '\0')
-        fs_addch(p, c);
+    fs_reserve(p, n);
+    memcpy(p->fs_str + p->fs_used, s, n);
+    p->fs_used += n;
 }
 
+/* fs_addstr() -- adds a terminated string to the flex string
+ *      args: flex string, string
+ */
+void fs_addstr(flexstr_t *p, const char *s) { fs_addmem(p, s, strlen(s)); }
+
 /* smalloc() -- safely allocates memory for an object
  *      args: number of bytes
  *      returns: newly allocated memory
@@ -9,7 +9,7 @@ struct flexstring {
     int fs_space;  /* Total space allocated */
     int fs_used;   /* Total space used */
     char *fs_str;  /* String */
-    int fs_growby; /* Amount of byted fs_str will increase by */
+    int fs_growby; /* Smallest amount fs_str grows by, it doubles after that */
 };
 
 typedef struct flexstring flexstr_t;
@@ -20,8 +20,10 @@ void fs_free(flexstr_t *p);
 
 /* Other methods */
 char *fs_getstr(flexstr_t *p);
+void fs_clear(flexstr_t *p);
 void fs_addch(flexstr_t *p, char c);
-void fs_addstr(flexstr_t *p, char *s);
+void fs_addmem(flexstr_t *p, const char *s, int n);
+void fs_addstr(flexstr_t *p, const char *s);
 
 /* Safe malloc and realloc */
 void *smalloc(size_t n);
@@ -38,6 +38,12 @@ typedef any_t map_t;
  */
 extern map_t hashmap_new();
 
+/*
+ * Return an empty hashmap layered on top of parent. Lookups that miss fall through to the parent
+ * (which has to outlive the new map), insertions and removals only affect the new map.
+ */
+extern map_t hashmap_scope(map_t parent);
+
 /*
  * Iteratively call f with argument (item, data) for
  * each element data in the hashmap. The function must
@@ -73,6 +79,9 @@ extern int hashmap_get_one(map_t in, any_t *arg, int remove);
  */
 extern void hashmap_free(map_t in);
 
+/*
+ * Copy the innermost layer of a hashmap, the copy is layered on the same parent.
+ */
 extern map_t hashmap_duplicate(map_t src);
 extern void hashmap_print(map_t map);
 
@@ -0,0 +1,124 @@
+/*  scan.c - 1.0
+ *      vectorized searches over the source text, for the runs the lexer skips without its DFA
+ *
+ *  Comments, the bodies of long strings and whitespace are skipped 16 bytes at a time: a vector of
+ *  the text is compared with the bytes searched for and the comparison is reduced to a mask, one bit
+ *  (SSE2) or four bits (NEON) per byte, whose trailing zeros locate the first match. Both are part
+ *  of the base instruction set of their architecture, so no special compiler flags are needed.
+ *  Anything else, and the tail of the text shorter than a vector, is searched a byte at a time.
+ */
+
+#include "scan.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VBYTES 16
+#define VBITS 1
+#define VALL 0xffff /* mask of a vector whose bytes all matched */
+#define vbytes __m128i
+#define vset(c) _mm_set1_epi8(c)
+#define vload(p) _mm_loadu_si128((const __m128i *)(p))
+#define veq(a, b) _mm_cmpeq_epi8(a, b)
+#define vor(a, b) _mm_or_si128(a, b)
+#define vsub(a, b) _mm_sub_epi8(a, b)
+#define vle(a, b) _mm_cmpeq_epi8(_mm_min_epu8(a, b), a) /* unsigned a <= b */
+#define vmask(v) ((uint64_t)_mm_movemask_epi8(v))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VBYTES 16
+#define VBITS 4
+#define VALL UINT64_MAX
+#define vbytes uint8x16_t
+#define vset(c) vdupq_n_u8((uint8_t)(c))
+#define vload(p) vld1q_u8((const uint8_t *)(p))
+#define veq(a, b) vceqq_u8(a, b)
+#define vor(a, b) vorrq_u8(a, b)
+#define vsub(a, b) vsubq_u8(a, b)
+#define vle(a, b) vcleq_u8(a, b)
+/* Narrowing every 16 bits to 8 keeps four bits of each byte of the comparison */
+#define vmask(v) vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+#else
+#define VBYTES 0
+#endif
+
+/* A byte the lexer skips as whitespace: a space, \t, \n, \v or \f */
+#define isspace_lex(c) ((c) == ' ' || (unsigned char)((c) - '\t') <= '\f' - '\t')
+
+/* scan_find() -- finds the first of two bytes in the text
+ *      args: text, end of the text, bytes searched for (the same byte twice searches for one)
+ *      rets: first byte of the text equal to one of them, the end of the text if there is none
+ */
+const char *scan_find(const char *p, const char *end, char a, char b)
+{
+#if VBYTES
+    vbytes va = vset(a), vb = vset(b);
+
+    for (; end - p >= VBYTES; p += VBYTES) {
+        vbytes v = vload(p);
+        uint64_t mask = vmask(vor(veq(v, va), veq(v, vb)));
+
+        if (mask != 0)
+            return p + __builtin_ctzll(mask) / VBITS;
+    }
+#endif
+    while (p < end && *p != a && *p != b)
+        p++;
+
+    return p;
+}
+
+/* scan_space() -- skips the whitespace at the start of the text, newlines included
+ *      args: text, end of the text
+ *      rets: first byte of the text that is not whitespace, the end of the text if there is none
+ */
+const char *scan_space(const char *p, const char *end)
+{
+#if VBYTES
+    vbytes space = vset(' '), tab = vset('\t'), range = vset('\f' - '\t');
+
+    for (; end - p >= VBYTES; p += VBYTES) {
+        vbytes v = vload(p);
+        uint64_t mask = vmask(vor(veq(v, space), vle(vsub(v, tab), range))) ^ VALL;
+
+        if (mask != 0)
+            return p + __builtin_ctzll(mask) / VBITS;
+    }
+#endif
+    while (p < end && isspace_lex(*p))
+        p++;
+
+    return p;
+}
+
+/* scan_lines() -- counts the newlines of the text
+ *      args: text, end of the text, pointer set to the byte after the last newline (left alone
+ *            when there is none)
+ *      rets: number of newlines
+ */
+int scan_lines(const char *p, const char *end, const char **line)
+{
+    int lines = 0;
+
+#if VBYTES
+    vbytes newline = vset('\n');
+
+    for (; end - p >= VBYTES; p += VBYTES) {
+        uint64_t mask = vmask(veq(vload(p), newline));
+
+        if (mask != 0) {
+            lines += __builtin_popcountll(mask) / VBITS;
+            *line = p + (63 - __builtin_clzll(mask)) / VBITS + 1;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            lines++;
+            *line = p + 1;
+        }
+    }
+
+    return lines;
+}
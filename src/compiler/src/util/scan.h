@@ -0,0 +1,11 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* Runs of the source text the lexer skips without its DFA */
+const char *scan_find(const char *p, const char *end, char a, char b);
+const char *scan_space(const char *p, const char *end);
+int scan_lines(const char *p, const char *end, const char **line);
+
+#endif
@@ -0,0 +1,144 @@
+/*  cache.c - only version
+ *      on-disk cache of compiled programs, so running an unchanged script skips the compiler
+ *
+ *  Entries live in $LUAPP_CACHE_DIR, $XDG_CACHE_HOME/luapp or ~/.cache/luapp and are named after a
+ *  hash of the source, the bytecode version and the build of the interpreter, so a rebuilt
+ *  compiler never picks up stale bytecode. Setting LUAPP_NO_CACHE disables the cache.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/bytecode.h"
+#include "../compiler/src/compiler.h"
+
+#include "cache.h"
+
+/* cache_hash() -- continues a 64-bit FNV-1a hash over a block of memory
+ *      args: hash so far, memory, size
+ *      rets: new hash
+ */
+static uint64_t cache_hash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* cache_build() -- continues a hash with what identifies the build of the interpreter,
+ * COMPILER_VERSION is not bumped when the code generation changes
+ *      args: hash so far
+ *      rets: new hash
+ *
+ * Note: The size and the modification time of the executable change with every build, without
+ * /proc the time this file was compiled stands in for them.
+ */
+static uint64_t cache_build(uint64_t hash)
+{
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st)) {
+        const char stamp[] = __DATE__ " " __TIME__;
+
+        return cache_hash(hash, stamp, sizeof(stamp));
+    }
+
+    int64_t identity[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+
+    return cache_hash(hash, identity, sizeof(identity));
+}
+
+/* cache_mkdirs() -- creates a directory and its missing parents
+ *      args: path (modified while walking it, but restored)
+ *      rets: 0 if the directory exists afterwards
+ */
+static int cache_mkdirs(char *path)
+{
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+
+        *p = '\0';
+        int res = mkdir(path, 0700);
+        *p = '/';
+
+        if (res && errno != EEXIST)
+            return -1;
+    }
+
+    return mkdir(path, 0700) && errno != EEXIST ? -1 : 0;
+}
+
+/* cache_path() -- builds the path of the cache entry of a program, creating the cache directory
+ *      args: buffer of CACHE_PATH_SIZE bytes, source code, size of the source code
+ *      rets: 0 on success, -1 if the cache is disabled or can not be created
+ */
+int cache_path(char *path, const char *source, size_t size)
+{
+    const char *dir = getenv("LUAPP_CACHE_DIR");
+    const char *base;
+    int len;
+
+    if (getenv("LUAPP_NO_CACHE"))
+        return -1;
+
+    if (dir && *dir)
+        len = snprintf(path, CACHE_PATH_SIZE, "%s", dir);
+    else if ((base = getenv("XDG_CACHE_HOME")) && *base)
+        len = snprintf(path, CACHE_PATH_SIZE, "%s/luapp", base);
+    else if ((base = getenv("HOME")) && *base)
+        len = snprintf(path, CACHE_PATH_SIZE, "%s/.cache/luapp", base);
+    else
+        return -1;
+
+    if (len <= 0 || len >= CACHE_PATH_SIZE - 32 || cache_mkdirs(path))
+        return -1;
+
+    /* The key covers everything that changes the generated bytecode */
+    const unsigned char version = MAX_VERSION;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = cache_hash(hash, COMPILER_VERSION, sizeof(COMPILER_VERSION));
+    hash = cache_hash(hash, &version, 1);
+    hash = cache_build(hash);
+    hash = cache_hash(hash, source, size);
+
+    snprintf(path + len, CACHE_PATH_SIZE - len, "/%016llx.bin", (unsigned long long)hash);
+    return 0;
+}
+
+/* cache_store() -- writes a cache entry atomically, readers either see the old state or the
+ * complete file
+ *      args: path of the entry, bytecode, size of the bytecode
+ *      rets: 0 on success
+ */
+int cache_store(const char *path, const void *bytecode, size_t size)
+{
+    char temp[CACHE_PATH_SIZE + 32];
+    FILE *output;
+
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+
+    if (!(output = fopen(temp, "wb")))
+        return -1;
+
+    int failed = fwrite(bytecode, 1, size, output) != size;
+    failed |= fclose(output) != 0;
+
+    if (failed || rename(temp, path)) {
+        remove(temp);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+
+/* Large enough for any cache path the interpreter builds */
+#define CACHE_PATH_SIZE 4096
+
+int cache_path(char *path, const char *source, size_t size);
+int cache_store(const char *path, const void *bytecode, size_t size);
+
+#endif
@@ -0,0 +1,130 @@
+/*  loadir.c - only version
+ *      builds VM function prototypes straight from the compiler's IR, so the interpreter does not
+ *      have to serialize the program to bytecode and parse it back
+ */
+
+#define LUA_CORE
+
+#include "../vm/src/load.h"
+#include "../vm/src/lua/lfunc.h"
+#include "../vm/src/lua/lmem.h"
+#include "../vm/src/lua/lstate.h"
+#include "../vm/src/lua/lstring.h"
+#include "../vm/src/lua/lvm.h"
+
+#include "../compiler/src/ir.h"
+#include "../compiler/src/symbol.h"
+
+#include "loadir.h"
+
+/* loadir_strings() -- interns every symbol of the symbol table
+ *      args: state, symbol table
+ *      rets: vector of strings indexed by symbol id
+ */
+static TString **loadir_strings(lua_State *L, struct symbol_table *table)
+{
+    TString **strings = luaM_newvector(L, table->size, TString *);
+
+    for (struct symbol_list *iter = table->first; iter != NULL; iter = iter->next)
+        strings[iter->symbol.id] = luaS_new(L, iter->symbol.name);
+
+    return strings;
+}
+
+static Proto *loadir_proto(lua_State *L, struct ir_proto *proto, TString **strings,
+                           TString *source)
+{
+    Proto *p = luaF_newproto(L);
+    int32_t count;
+
+    /* Copy important proto information */
+    p->source = source;
+    p->maxstacksize = proto->max_stack_size;
+    p->numparams = proto->parameters_size;
+    p->nups = proto->upvalues_size;
+    p->is_vararg = proto->is_vararg;
+
+    /* Copy the instruction array */
+    p->sizecode = proto->code->size;
+    p->code = luaM_newvector(L, p->sizecode, Instruction);
+    memcpy(p->code, proto->code->code, p->sizecode * sizeof(Instruction));
+
+    /* And the source line of every instruction */
+    p->linedefined = proto->line_defined;
+    p->lastlinedefined = proto->last_line_defined;
+    p->sizelineinfo = p->sizecode;
+    p->lineinfo = luaM_newvector(L, p->sizelineinfo, int);
+    memcpy(p->lineinfo, proto->code->lines, p->sizelineinfo * sizeof(int));
+
+    /* Create the constant pool */
+    count = 0;
+    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next)
+        count++;
+
+    p->sizek = count;
+    p->k = luaM_newvector(L, p->sizek, TValue);
+
+    /* Process all the constants in the pool */
+    count = 0;
+    for (struct ir_constant *iter = proto->constant_list->first; iter != NULL; iter = iter->next) {
+        TValue *k = &p->k[count++];
+
+        switch (iter->type) {
+            case CONSTANT_NIL:
+                setnilvalue(k);
+                break;
+            case CONSTANT_NUMBER:
+                setnvalue(k, iter->data.number.value);
+                break;
+            case CONSTANT_STRING:
+                setsvalue(L, k, strings[iter->data.symbol.symbol_id]);
+                break;
+            case CONSTANT_ENVIRONMENT:
+                /* Same as the bytecode loader, the name is resolved by OP_GETENV */
+                setobj(L, k, &p->k[iter->data.env.index]);
+                break;
+            default:
+                setnilvalue(k);
+                break;
+        }
+    }
+
+    /* The caches, the native code and the JIT counter, as for a proto of a bytecode file */
+    luapp_finish_proto(L, p);
+
+    /* Build all of the function prototypes within this one */
+    count = 0;
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        count++;
+
+    p->sizep = count;
+    p->p = luaM_newvector(L, p->sizep, Proto *);
+
+    count = 0;
+    for (struct ir_proto *iter = proto->protos->first; iter != NULL; iter = iter->next)
+        p->p[count++] = loadir_proto(L, iter, strings, source);
+
+    return p;
+}
+
+/* luapp_loadir() -- builds the program held by an IR context and pushes its main closure
+ *      args: state, name of the chunk, IR context
+ *      rets: 0 on success
+ */
+int luapp_loadir(lua_State *L, const char *chunkname, struct ir_context *context)
+{
+    TString *source = luaS_new(L, chunkname);
+    TString **strings = loadir_strings(L, context->table);
+
+    Proto *main = loadir_proto(L, context->main_proto, strings, source);
+
+    /* Create and push a closure onto the stack */
+    Closure *cl = luaF_newLclosure(L, 0, hvalue(gt(L)));
+    cl->l.p = main;
+    setclvalue(L, L->top, cl);
+    incr_top(L);
+
+    /* Dispose of the string array as we don't need it anymore */
+    luaM_freearray(L, strings, context->table->size, TString *);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef _LOADIR_H
+#define _LOADIR_H
+
+#include "../vm/src/lua/lua.h"
+
+struct ir_context;
+
+int luapp_loadir(lua_State *L, const char *chunkname, struct ir_context *context);
+
+#endif
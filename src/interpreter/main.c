@@ -1,36 +1,105 @@
 /*  main.c - entrypoint for the interpreter (combines VM and compiler)
  */
 
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
 /* compiler dependencies */
 #include "../compiler/src/codegen.h"
 #include "../compiler/src/compiler.h"
+#include "../compiler/src/escape.h"
+#include "../compiler/src/fold.h"
 #include "../compiler/src/ir.h"
 #include "../compiler/src/lexer.h"
 #include "../compiler/src/node.h"
+#include "../compiler/src/opt.h"
 #include "../compiler/src/parser.h"
+#include "../compiler/src/stream.h"
 #include "../compiler/src/symbol.h"
 #include "../compiler/src/type.h"
+#include "../compiler/src/util/arena.h"
+#include "../compiler/src/util/buffer.h"
 
 #include "../vm/src/lua/lauxlib.h"
 #include "../vm/src/lua/lua.h"
 #include "../vm/src/lua/lualib.h"
 
+#include "cache.h"
+#include "loadir.h"
+
+/* Programs from this size on are compiled statement by statement, see stream.h */
+#define STREAM_SOURCE_SIZE (1024 * 1024)
+
 /*  print_summary - prints a quick summary of a pass (elapsed time and number of
  *  errors)
  *      args: pass name, numer of errors, start time
  *      rets: none
  */
-static void print_summary(char *pass, int error_count)
+static void print_summary(const char *pass, int error_count)
 {
     printf("\n%s encountered %d %s.\n", pass, error_count, (error_count == 1 ? "error" : "errors"));
 }
 
-int compile(FILE *input, FILE *output)
+/*  read_source - reads a whole program into memory
+ *      args: input stream, buffer to fill
+ *      rets: 0 on success
+ */
+static int read_source(FILE *input, buffer_t *source)
+{
+    char chunk[BUFFER_CHUNKSIZE];
+    size_t size;
+
+    while ((size = fread(chunk, 1, sizeof(chunk), input)) > 0)
+        buf_addmem(source, chunk, size);
+
+    return ferror(input);
+}
+
+/*  compile_statements - compiles a program statement by statement, without a tree of all of it
+ *      args: input stream, symbol table and IR context to fill
+ *      rets: 0 on success
+ */
+static int compile_statements(FILE *input, struct symbol_table *symbol_table,
+                              struct ir_context *ir_context)
+{
+    yyscan_t lexer;
+    struct type_context type_context = {true, 0};
+    struct fold_context fold_context;
+    struct symbol_context context = {symbol_table, 0};
+    struct stream_context stream;
+
+    type_init(&type_context);
+    fold_init(&fold_context);
+    symbol_initialize_table(symbol_table);
+
+    ir_context->error_count = 0;
+    ir_context->table = symbol_table;
+    stream_init(&stream, &type_context, &fold_context, &context, ir_context);
+
+    lex_init(&lexer, input);
+    int error_count = stream_compile(&stream, lexer);
+    lex_destroy(&lexer);
+    type_destroy(&type_context);
+
+    if (error_count) {
+        print_summary(stream.failed, error_count);
+        return 1;
+    }
+
+    struct opt_context opt_context;
+    opt_init(&opt_context);
+    opt_run(&opt_context, ir_context);
+
+    return 0;
+}
+
+int compile(FILE *input, struct symbol_table *symbol_table, struct ir_context *ir_context)
 {
     yyscan_t lexer;
     int error_count = 0;
     struct node *tree;
-    struct symbol_table symbol_table;
 
     lex_init(&lexer, input);
 
@@ -59,8 +128,16 @@ int compile(FILE *input, FILE *output)
 
     type_destroy(&type_context);
 
-    symbol_initialize_table(&symbol_table);
-    struct symbol_context context = {&symbol_table, error_count};
+    struct escape_context escape_context;
+    escape_init(&escape_context);
+    escape_ast(&escape_context, tree);
+
+    struct fold_context fold_context;
+    fold_init(&fold_context);
+    fold_ast(&fold_context, tree);
+
+    symbol_initialize_table(symbol_table);
+    struct symbol_context context = {symbol_table, error_count};
 
     symbol_ast_traversal(&context, tree);
     error_count = context.error_count;
@@ -70,10 +147,11 @@ int compile(FILE *input, FILE *output)
         return 1;
     }
 
-    struct ir_context ir_context = {0, &symbol_table};
-    ir_init(&ir_context);
+    ir_context->error_count = 0;
+    ir_context->table = symbol_table;
+    ir_init(ir_context);
 
-    ir_context.main_proto = ir_build(&ir_context, tree);
+    ir_context->main_proto = ir_build(ir_context, tree);
     error_count = context.error_count;
 
     if (error_count) {
@@ -81,20 +159,71 @@ int compile(FILE *input, FILE *output)
         return 1;
     }
 
-    codegen_write_program(output, &ir_context);
+    struct opt_context opt_context;
+    opt_init(&opt_context);
+    opt_run(&opt_context, ir_context);
+
     return 0;
 }
 
-int main(int argc, char **argv)
+/*  load_program - compiles a program and loads it into the VM, the bytecode is stored in the
+ *  cache when a cache path is given
+ *      args: state, source code, cache entry path (NULL to skip the cache)
+ *      rets: status of the load (0 on success), -1 if the compiler failed
+ */
+static int load_program(lua_State *L, buffer_t *source, const char *cache)
 {
-    int opt, error_count;
-    size_t bufsize;
-    char *stage, *dot, *buff;
-    FILE *input, *output;
     struct symbol_table symbol_table;
+    struct ir_context ir_context = {0};
+    int status;
 
-    time_t start;
-    struct node *tree;
+    FILE *input = fmemopen(source->b_data, source->b_used, "r");
+    if (input == NULL) {
+        printf("Error: unable to read the program: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Every pass allocates the objects of this compilation from a single arena */
+    arena_t arena;
+    arena_init(&arena);
+    arena_use(&arena);
+
+    int failed = source->b_used >= STREAM_SOURCE_SIZE
+                     ? compile_statements(input, &symbol_table, &ir_context)
+                     : compile(input, &symbol_table, &ir_context);
+    fclose(input);
+
+    if (failed) {
+        arena_use(NULL);
+        arena_free(&arena);
+        return -1;
+    }
+
+    if (cache != NULL) {
+        buffer_t bytecode;
+        buf_init(&bytecode, 0);
+
+        /* Run exactly what is cached, a failed store only costs the next run its cache hit */
+        codegen_emit_program(&bytecode, &ir_context);
+        cache_store(cache, bytecode.b_data, bytecode.b_used);
+        status = luapp_loadbuffer(L, "=lua++", (const char *)bytecode.b_data, bytecode.b_used);
+
+        buf_free(&bytecode);
+    } else
+        status = luapp_loadir(L, "=lua++", &ir_context);
+
+    /* The VM has its own copy of the program, the compiler objects can go */
+    arena_use(NULL);
+    arena_free(&arena);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    char *dot;
+    FILE *input;
+    char cache[CACHE_PATH_SIZE];
+    bool cached = false;
 
     /* Determine if we are using stdin or file in. */
     if (optind == argc - 1) {
@@ -118,25 +247,43 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if (!(output = open_memstream(&buff, &bufsize))) {
-        printf("Error: unable to write to memory stream.\n");
+    buffer_t source;
+    buf_init(&source, 0);
+
+    if (read_source(input, &source)) {
+        printf("Error: unable to read the program: %s\n", strerror(errno));
         return 1;
     }
 
-    if (compile(input, output))
-        return 1;
+    if (input != stdin)
+        fclose(input);
 
-    fclose(output);
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
 
-    if (!(input = fmemopen(buff, bufsize, "r"))) {
-        printf("Error: unable to read memory stream.\n");
-        return 1;
+    /* Programs piped through stdin are not cached */
+    bool use_cache = input != stdin && !cache_path(cache, (char *)source.b_data, source.b_used);
+
+    if (use_cache && !access(cache, R_OK)) {
+        if (!luapp_loadpath(L, "=lua++", cache))
+            cached = true;
+        else
+            /* A broken entry is simply replaced */
+            lua_pop(L, 1);
     }
 
-    lua_State *L = luaL_newstate();
-    luaL_openlibs(L);
+    int status = 0;
+    if (!cached)
+        status = load_program(L, &source, use_cache ? cache : NULL);
+
+    buf_free(&source);
 
-    if (luapp_loadfile(L, "=lua++", input)) {
+    if (status == -1) {
+        lua_close(L);
+        return 1;
+    }
+
+    if (status) {
         /* An error occured, display it and pop it from the stack */
         printf("Error: %s\n", lua_tostring(L, -1));
         lua_pop(L, 1);
@@ -146,10 +293,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    /* Run the closure at L->top + 0 */
-    lua_resume(L, 0);
+    /* Run the closure at L->top + 0, a program that yields is done as well */
+    status = lua_resume(L, 0);
+
+    if (status != 0 && status != LUA_YIELD)
+        printf("Error: %s\n", lua_tostring(L, -1));
+
     lua_close(L);
-    fclose(input);
-    free(buff);
-    return 0;
-}
\ No newline at end of file
+    return status != 0 && status != LUA_YIELD;
+}
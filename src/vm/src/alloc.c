@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+/* Size class of a small block, blocks of a class are ALLOC_ALIGN * (class + 1) bytes */
+#define alloc_class(size) (((size) - 1) / ALLOC_ALIGN)
+#define alloc_round(size) (((size) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1))
+
+/* Block headers are padded so the data following them stays aligned */
+#define ALLOC_HEADER alloc_round(sizeof(struct alloc_block))
+
+/* alloc_block_new() -- allocates a slab or arena block from the system and links it in
+ *      args: list of blocks, size of the data
+ *      rets: data of the block or NULL if the system is out of memory
+ */
+static char *alloc_block_new(struct alloc_block **list, size_t size)
+{
+    struct alloc_block *block = aligned_alloc(ALLOC_ALIGN, alloc_round(ALLOC_HEADER + size));
+
+    if (block == NULL)
+        return NULL;
+
+    block->next = *list;
+    block->size = size;
+    *list = block;
+    return (char *)block + ALLOC_HEADER;
+}
+
+/* alloc_blocks_free() -- releases a list of slab or arena blocks
+ *      args: list of blocks
+ *      rets: none
+ */
+static void alloc_blocks_free(struct alloc_block *list)
+{
+    while (list != NULL) {
+        struct alloc_block *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+/* alloc_in_arena() -- checks if a block was bumped out of the load arena
+ *      args: allocator, block
+ *      rets: 1 if it was, 0 otherwise
+ */
+static int alloc_in_arena(struct luapp_alloc *a, void *ptr)
+{
+    for (struct alloc_block *iter = a->arenas; iter != NULL; iter = iter->next) {
+        char *data = (char *)iter + ALLOC_HEADER;
+
+        if ((char *)ptr >= data && (char *)ptr < data + iter->size)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* alloc_arena() -- bumps a block out of the load arena
+ *      args: allocator, size
+ *      rets: block or NULL if the system is out of memory
+ */
+static void *alloc_arena(struct luapp_alloc *a, size_t size)
+{
+    size = alloc_round(size);
+
+    if (size > a->arena_left) {
+        size_t space = size > ALLOC_SLAB_SIZE ? size : ALLOC_SLAB_SIZE;
+
+        if (alloc_block_new(&a->arenas, space) == NULL)
+            return NULL;
+        a->arena_left = space;
+    }
+
+    char *block = (char *)a->arenas + ALLOC_HEADER + (a->arenas->size - a->arena_left);
+    a->arena_left -= size;
+    a->stats.arena += size;
+    return block;
+}
+
+/* alloc_small() -- takes a block from the free list of its class, or carves it out of a slab
+ *      args: allocator, size (at most ALLOC_SMALL_MAX)
+ *      rets: block or NULL if the system is out of memory
+ */
+static void *alloc_small(struct luapp_alloc *a, size_t size)
+{
+    int class = alloc_class(size);
+    void *block = a->free[class];
+
+    if (block != NULL) {
+        a->free[class] = *(void **)block;
+        return block;
+    }
+
+    size = alloc_round(size);
+
+    /* The rest of the old slab is given up, it is always smaller than the largest class */
+    if (size > a->slab_left) {
+        if ((a->slab_next = alloc_block_new(&a->slabs, ALLOC_SLAB_SIZE)) == NULL)
+            return NULL;
+
+        a->slab_left = ALLOC_SLAB_SIZE;
+        a->stats.slabs++;
+    }
+
+    block = a->slab_next;
+    a->slab_next += size;
+    a->slab_left -= size;
+    return block;
+}
+
+/* alloc_new() -- allocates a block of any size
+ *      args: allocator, size
+ *      rets: block or NULL if the system is out of memory
+ */
+static void *alloc_new(struct luapp_alloc *a, size_t size)
+{
+    if (a->loading)
+        return alloc_arena(a, size);
+
+    if (size <= ALLOC_SMALL_MAX)
+        return alloc_small(a, size);
+
+    a->stats.large++;
+    return malloc(size);
+}
+
+/* alloc_release() -- gives a block back, small blocks (even if they came from the arena) go to the
+ * free list of their class
+ *      args: allocator, block, size
+ *      rets: none
+ */
+static void alloc_release(struct luapp_alloc *a, void *ptr, size_t size)
+{
+    if (size <= ALLOC_SMALL_MAX) {
+        int class = alloc_class(size);
+
+        *(void **)ptr = a->free[class];
+        a->free[class] = ptr;
+    } else if (a->arenas == NULL || !alloc_in_arena(a, ptr))
+        free(ptr);
+}
+
+/* alloc_f() -- lua_Alloc of every state created by luapp_newstate
+ *      args: allocator, block, old size, new size
+ *      rets: new block, NULL when freeing or out of memory
+ */
+static void *alloc_f(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    struct luapp_alloc *a = ud;
+    void *block;
+
+    if (ptr == NULL) {
+        if (nsize == 0)
+            return NULL;
+        osize = 0;
+    }
+
+    if (a->kind == LUAPP_ALLOC_SYSTEM) {
+        if (nsize == 0) {
+            free(ptr);
+            block = NULL;
+        } else if ((block = realloc(ptr, nsize)) == NULL)
+            return NULL;
+    } else if (nsize == 0) {
+        alloc_release(a, ptr, osize);
+        block = NULL;
+    } else if (ptr != NULL && !a->loading && osize <= ALLOC_SMALL_MAX &&
+               nsize <= ALLOC_SMALL_MAX && alloc_class(osize) == alloc_class(nsize)) {
+        /* Still fits its class */
+        a->stats.bytes += nsize - osize;
+        return ptr;
+    } else if (ptr != NULL && !a->loading && osize > ALLOC_SMALL_MAX &&
+               nsize > ALLOC_SMALL_MAX && (a->arenas == NULL || !alloc_in_arena(a, ptr))) {
+        if ((block = realloc(ptr, nsize)) == NULL)
+            return NULL;
+    } else {
+        if ((block = alloc_new(a, nsize)) == NULL)
+            return NULL;
+
+        if (ptr != NULL) {
+            memcpy(block, ptr, osize < nsize ? osize : nsize);
+            alloc_release(a, ptr, osize);
+        }
+    }
+
+    /* Counters */
+    if (ptr != NULL)
+        a->stats.frees++;
+    if (block != NULL)
+        a->stats.allocs++;
+
+    a->stats.bytes += nsize - osize;
+    if (a->stats.bytes > a->stats.peak)
+        a->stats.peak = a->stats.bytes;
+
+    return block;
+}
+
+static int panic(lua_State *L)
+{
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+    return 0;
+}
+
+/* luapp_newstate() -- creates a state that allocates through one of the built-in allocators
+ *      args: kind of allocator
+ *      rets: state or NULL if memory ran out, it has to be closed with luapp_close()
+ */
+lua_State *luapp_newstate(enum luapp_alloc_kind kind)
+{
+    struct luapp_alloc *a = calloc(1, sizeof(struct luapp_alloc));
+
+    if (a == NULL)
+        return NULL;
+
+    a->kind = kind;
+    lua_State *L = lua_newstate(alloc_f, a);
+
+    if (L == NULL) {
+        free(a);
+        return NULL;
+    }
+
+    lua_atpanic(L, &panic);
+    return L;
+}
+
+/* luapp_close() -- closes a state and releases its allocator, works for any state
+ *      args: state
+ *      rets: none
+ */
+void luapp_close(lua_State *L)
+{
+    struct luapp_alloc *a = luapp_alloc_get(L);
+
+    lua_close(L);
+
+    if (a != NULL) {
+        alloc_blocks_free(a->slabs);
+        alloc_blocks_free(a->arenas);
+        free(a);
+    }
+}
+
+/* luapp_alloc_kind() -- looks up an allocator by name (system, pool or arena)
+ *      args: name, kind to fill
+ *      rets: 0 on success, -1 for unknown names
+ */
+int luapp_alloc_kind(const char *name, enum luapp_alloc_kind *kind)
+{
+    static const char *const names[] = {"system", "pool", "arena"};
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (!strcmp(name, names[i])) {
+            *kind = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* luapp_alloc_get() -- gets the built-in allocator of a state
+ *      args: state
+ *      rets: allocator or NULL if the state was not created by luapp_newstate()
+ */
+struct luapp_alloc *luapp_alloc_get(lua_State *L)
+{
+    void *ud;
+
+    return lua_getallocf(L, &ud) == alloc_f ? ud : NULL;
+}
+
+/* luapp_alloc_loading() -- tells the allocator of a state that a program is being loaded, an
+ * arena allocator serves everything from its arena until loading is over
+ *      args: state, 1 before loading and 0 after
+ *      rets: none
+ */
+void luapp_alloc_loading(lua_State *L, int loading)
+{
+    struct luapp_alloc *a = luapp_alloc_get(L);
+
+    if (a != NULL && a->kind == LUAPP_ALLOC_ARENA)
+        a->loading = loading;
+}
+
+/* luapp_alloc_print() -- writes the counters of the allocator of a state as JSON
+ *      args: output stream, state
+ *      rets: none
+ */
+void luapp_alloc_print(FILE *output, lua_State *L)
+{
+    struct luapp_alloc *a = luapp_alloc_get(L);
+
+    if (a == NULL)
+        return;
+
+    fprintf(output,
+            "{\"allocs\": %zu, \"frees\": %zu, \"large\": %zu, \"bytes\": %zu, \"peak\": %zu, "
+            "\"slabs\": %zu, \"arena\": %zu}\n",
+            a->stats.allocs, a->stats.frees, a->stats.large, a->stats.bytes, a->stats.peak,
+            a->stats.slabs, a->stats.arena);
+}
@@ -0,0 +1,73 @@
+/*  alloc.h - only version
+ *      allocators that can be picked when a state is created
+ *
+ *  LUAPP_ALLOC_SYSTEM is the plain realloc/free of luaL_newstate. LUAPP_ALLOC_POOL serves every
+ *  block of up to ALLOC_SMALL_MAX bytes from free lists of size classes, carved out of slabs of
+ *  ALLOC_SLAB_SIZE bytes, which fits the many small objects of the GC (strings, tables, closures,
+ *  upvalues). Lua always passes the old size of a block, so the blocks carry no header.
+ *  LUAPP_ALLOC_ARENA works like the pool, but everything allocated while a program is loaded (the
+ *  protos, their code and constants) is bumped out of an arena that is only released with the
+ *  state.
+ *
+ *  The allocator of a state is not locked, like the state itself.
+ */
+
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lua/lua.h"
+
+#define ALLOC_ALIGN 16
+#define ALLOC_SMALL_MAX 512
+#define ALLOC_CLASSES (ALLOC_SMALL_MAX / ALLOC_ALIGN)
+#define ALLOC_SLAB_SIZE (64 * 1024)
+
+enum luapp_alloc_kind {
+    LUAPP_ALLOC_SYSTEM,
+    LUAPP_ALLOC_POOL,
+    LUAPP_ALLOC_ARENA,
+};
+
+struct luapp_alloc_stats {
+    size_t allocs;  /* Blocks handed out (a block moved by a reallocation counts again) */
+    size_t frees;   /* Blocks given back */
+    size_t large;   /* Allocations above ALLOC_SMALL_MAX, served by the system */
+    size_t bytes;   /* Bytes in use */
+    size_t peak;    /* Largest value of `bytes' */
+    size_t slabs;   /* Slabs carved into small blocks */
+    size_t arena;   /* Bytes bumped out of the load arena */
+};
+
+/* Memory block owned by the allocator, the data follows the header */
+struct alloc_block {
+    struct alloc_block *next;
+    size_t size;
+};
+
+struct luapp_alloc {
+    enum luapp_alloc_kind kind;
+    void *free[ALLOC_CLASSES]; /* Free blocks of each size class, linked through their first word */
+
+    struct alloc_block *slabs;
+    char *slab_next; /* Unused part of the newest slab */
+    size_t slab_left;
+
+    struct alloc_block *arenas; /* Newest first, only filled while loading */
+    size_t arena_left;
+    int loading;
+
+    struct luapp_alloc_stats stats;
+};
+
+lua_State *luapp_newstate(enum luapp_alloc_kind kind);
+void luapp_close(lua_State *L);
+
+int luapp_alloc_kind(const char *name, enum luapp_alloc_kind *kind);
+struct luapp_alloc *luapp_alloc_get(lua_State *L);
+void luapp_alloc_loading(lua_State *L, int loading);
+void luapp_alloc_print(FILE *output, lua_State *L);
+
+#endif
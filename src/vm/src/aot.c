@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lua/ldebug.h"
+#include "lua/luaconf.h"
+
+#include "aot.h"
+
+#if defined(LUA_USE_DLOPEN)
+#include <dlfcn.h>
+#endif
+
+/* Most modules a process can register */
+#define AOT_MODULES_MAX 16
+
+static const struct luapp_aot_module *aot_modules[AOT_MODULES_MAX];
+static int aot_module_count;
+
+/* Helpers handed to every module, see struct luapp_aot_api */
+static const struct luapp_aot_api aot_api = {
+    LUAPP_AOT_VERSION,
+
+    luaV_arith,
+    luaV_objlen,
+    luaV_concat,
+    luaV_append,
+    luaV_buildstring,
+    luaV_tonumber,
+    luaV_lessthan,
+    luaV_lessequal,
+    luaV_equalval,
+
+    luaV_gettable,
+    luaV_settable,
+    luaV_getenv,
+    luaV_getfield,
+    luaV_setfield,
+
+    luaH_new,
+    luaH_newrecord,
+    luaH_resizearray,
+    luaH_setnum,
+    luaR_new,
+    luaR_setlist,
+
+    luaF_newLclosure,
+    luaF_findupval,
+    luaF_newupval,
+    luaF_close,
+
+    luaD_call,
+    luaD_poscall,
+    luaD_growstack,
+    luaG_runerror,
+
+    luaC_step,
+    luaC_barrierf,
+    luaC_barrierback,
+};
+
+/* luapp_aot_register() -- makes the native functions of a module available to every state loaded
+ * from now on
+ *      args: module
+ *      rets: 0 on success, -1 if it was built for another VM or too many modules are registered
+ */
+int luapp_aot_register(const struct luapp_aot_module *module)
+{
+    if (module == NULL || module->version != LUAPP_AOT_VERSION ||
+        aot_module_count == AOT_MODULES_MAX)
+        return -1;
+
+    aot_modules[aot_module_count++] = module;
+    return 0;
+}
+
+/* luapp_aot_open() -- loads a shared object written by luappc -s aot and registers its module
+ *      args: path of the shared object
+ *      rets: 0 on success, -1 with a message on stderr otherwise
+ */
+int luapp_aot_open(const char *path)
+{
+#if defined(LUA_USE_DLOPEN)
+    /* The module stays loaded for the rest of the process, protos may point into it */
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    luapp_aot_init_t init = NULL;
+
+    if (library != NULL)
+        init = (luapp_aot_init_t)dlsym(library, LUAPP_AOT_INIT);
+
+    if (init == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    if (luapp_aot_register(init(&aot_api))) {
+        fprintf(stderr, "%s: module was built for another VM\n", path);
+        return -1;
+    }
+
+    return 0;
+#else
+    fprintf(stderr, "%s: native modules are not supported on this platform\n", path);
+    return -1;
+#endif
+}
+
+/* luapp_aot_find() -- finds the native function translated from a proto
+ *      args: proto (its code and constants loaded)
+ *      rets: function or NULL if no registered module has one
+ */
+luapp_native_t luapp_aot_find(const Proto *p)
+{
+    if (aot_module_count == 0)
+        return NULL;
+
+    uint32_t hash = bytecode_hash(BYTECODE_HASH_SEED, p->code, p->sizecode * sizeof(Instruction));
+
+    for (int i = 0; i < p->sizek; i++) {
+        if (ttisnumber(&p->k[i])) {
+            lua_Number value = nvalue(&p->k[i]);
+            hash = bytecode_hash(hash, &value, sizeof(value));
+        }
+    }
+
+    for (int i = 0; i < aot_module_count; i++) {
+        const struct luapp_aot_module *module = aot_modules[i];
+
+        for (uint32_t j = 0; j < module->count; j++) {
+            if (module->protos[j].hash == hash && module->protos[j].sizecode == p->sizecode)
+                return module->protos[j].function;
+        }
+    }
+
+    return NULL;
+}
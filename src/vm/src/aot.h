@@ -0,0 +1,573 @@
+/*  aot.h - only version
+ *      native code translated ahead of time from bytecode (luappc -s aot)
+ *
+ *  luappc -s aot writes a C file with one function per proto of a program, built as a shared
+ *  object it is registered with luapp_aot_open() (luappvm -N module.so) before the program is
+ *  loaded. Every proto whose instructions and number constants hash to the ones a function was
+ *  translated from (see bytecode_hash) runs that function instead of being interpreted.
+ *
+ *  The functions keep the registers on the Lua stack and follow luapp_execute instruction by
+ *  instruction, operations the compiler proved to be on numbers (OP_ADDNN, OP_FORLOOPINC, ...)
+ *  become plain C arithmetic on doubles. A module does not link against the VM: the helpers it
+ *  calls come from the luapp_aot_api the VM hands it, so it only has to be built against the same
+ *  headers (checked with LUAPP_AOT_VERSION).
+ *
+ *  A native frame is a C frame: a coroutine can not yield across it, hooks see no lines and every
+ *  call it makes nests luaD_call, so native recursion is limited to LUAI_MAXCCALLS levels.
+ *
+ *  Generated modules include this header, so everything below the API is for them only.
+ */
+
+#ifndef _AOT_H
+#define _AOT_H
+
+#if !defined(LUA_CORE)
+#define LUA_CORE
+#endif
+
+#include <math.h>
+#include <stdint.h>
+
+#include "../../common/bytecode.h"
+#include "../../common/opcodes.h"
+#include "lua/larray.h"
+#include "lua/ldo.h"
+#include "lua/lfunc.h"
+#include "lua/lgc.h"
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/ltable.h"
+#include "lua/lvm.h"
+
+/* Changes whenever the API or the layout of the VM structures a module touches changes, modules
+ * built for the other value layout (LUA_NANBOX) are refused too */
+#if defined(LUA_NANBOX)
+#define LUAPP_AOT_VERSION 0x104
+#else
+#define LUAPP_AOT_VERSION 4
+#endif
+
+/* Helpers of the VM that native code calls */
+struct luapp_aot_api {
+    int version;
+
+    void (*arith)(lua_State *L, StkId ra, const TValue *rb, const TValue *rc, TMS op);
+    void (*objlen)(lua_State *L, StkId ra, const TValue *rb);
+    void (*concat)(lua_State *L, int total, int last);
+    void (*append)(lua_State *L, StkId ra, StkId rb);
+    void (*buildstring)(lua_State *L, StkId ra, const TValue *rb);
+    const TValue *(*tonumber)(const TValue *obj, TValue *n);
+    int (*lessthan)(lua_State *L, const TValue *l, const TValue *r);
+    int (*lessequal)(lua_State *L, const TValue *l, const TValue *r);
+    int (*equalval)(lua_State *L, const TValue *t1, const TValue *t2);
+
+    void (*gettable)(lua_State *L, const TValue *t, TValue *key, StkId val);
+    void (*settable)(lua_State *L, const TValue *t, TValue *key, StkId val);
+    void (*getenv)(lua_State *L, Table *env, TValue *key, GlobalCache *c, StkId ra);
+    void (*getfield)(lua_State *L, const TValue *t, TValue *key, FieldCache *c, StkId ra);
+    void (*setfield)(lua_State *L, const TValue *t, TValue *key, StkId val, FieldCache *c);
+
+    Table *(*newtable)(lua_State *L, int narray, int lnhash);
+    Table *(*newrecord)(lua_State *L, int narray, int nfields);
+    void (*resizearray)(lua_State *L, Table *t, int nasize);
+    TValue *(*setnum)(lua_State *L, Table *t, int key);
+    Array *(*newarray)(lua_State *L, int kind, int space);
+    void (*setarraylist)(lua_State *L, Array *a, int first, StkId values, int n);
+
+    Closure *(*newclosure)(lua_State *L, int nelems, Table *e);
+    UpVal *(*findupval)(lua_State *L, StkId level);
+    UpVal *(*newupval)(lua_State *L);
+    void (*close)(lua_State *L, StkId level);
+
+    void (*call)(lua_State *L, StkId func, int nresults);
+    int (*poscall)(lua_State *L, StkId firstResult);
+    void (*growstack)(lua_State *L, int n);
+    void (*runerror)(lua_State *L, const char *fmt, ...);
+
+    void (*step)(lua_State *L);
+    void (*barrierf)(lua_State *L, GCObject *o, GCObject *v);
+    void (*barrierback)(lua_State *L, Table *t);
+};
+
+/* Native function of a proto, entered with the frame laid out by luaD_precall */
+typedef void (*luapp_native_t)(lua_State *L);
+
+struct luapp_aot_proto {
+    uint32_t hash;     /* Of the instructions and number constants it was translated from */
+    uint32_t sizecode; /* Number of instructions */
+    luapp_native_t function;
+};
+
+struct luapp_aot_module {
+    int version; /* LUAPP_AOT_VERSION of the headers the module was built with */
+    const struct luapp_aot_proto *protos;
+    uint32_t count;
+};
+
+/* Entry point every module exports, called once when it is registered */
+typedef const struct luapp_aot_module *(*luapp_aot_init_t)(const struct luapp_aot_api *api);
+#define LUAPP_AOT_INIT "luapp_aot_init"
+
+/* Registration of modules (aot.c), modules have to be registered before a state loads a program
+ * that uses them and stay registered for the rest of the process */
+int luapp_aot_register(const struct luapp_aot_module *module);
+int luapp_aot_open(const char *path);
+luapp_native_t luapp_aot_find(const Proto *p);
+
+/* What follows is only used by generated modules */
+#if defined(LUAPP_AOT_MODULE)
+
+static const struct luapp_aot_api *aot_api;
+
+/* The stock macros of the core (luaC_checkGC, luaC_barrier, luaD_checkstack, tonumber) expand to
+ * these names, they are routed through the API */
+#define luaC_step(L) aot_api->step(L)
+#define luaC_barrierf(L, o, v) aot_api->barrierf(L, o, v)
+#define luaC_barrierback(L, t) aot_api->barrierback(L, t)
+#define luaD_growstack(L, n) aot_api->growstack(L, n)
+#define luaV_tonumber(o, n) aot_api->tonumber(o, n)
+
+/* Defines the entry point of a module translated from a list of protos */
+#define AOT_MODULE(list)                                                                           \
+    const struct luapp_aot_module *luapp_aot_init(const struct luapp_aot_api *api)                 \
+    {                                                                                              \
+        static const struct luapp_aot_module module = {LUAPP_AOT_VERSION, list,                    \
+                                                       sizeof(list) / sizeof(list[0])};            \
+                                                                                                   \
+        aot_api = api;                                                                             \
+        return &module;                                                                            \
+    }
+
+/* Every native function starts with the closure of its frame, the base is read from the state
+ * each time because any call may move the stack */
+#define AOT_ENTER()                                                                                \
+    LClosure *cl = &clvalue(L->ci->func)->l;                                                       \
+    TValue *k = cl->p->k;                                                                          \
+    const Instruction *code = cl->p->code;                                                         \
+    (void)k;                                                                                       \
+    (void)code
+
+#define R(x) (L->base + (x))
+
+/* Position of the instruction after the one running, for error messages and hooks */
+#define AOT_SAVEPC(n) (L->savedpc = code + (n))
+
+#define AOT_MOVE(a, b) setobjs2s(L, R(a), R(b))
+#define AOT_LOADK(a, kx) setobj2s(L, R(a), &k[kx])
+#define AOT_LOADN(a, v) setnvalue(R(a), v)
+#define AOT_LOADBOOL(a, b) setbvalue(R(a), b)
+
+#define AOT_LOADNIL(a, b)                                                                          \
+    {                                                                                              \
+        for (int j_ = (a); j_ <= (b); j_++)                                                        \
+            setnilvalue(R(j_));                                                                    \
+    }
+
+#define AOT_GETUPVAL(a, b) setobj2s(L, R(a), cl->upvals[b]->v)
+
+#define AOT_SETUPVAL(a, b)                                                                         \
+    {                                                                                              \
+        UpVal *uv_ = cl->upvals[b];                                                                \
+        setobj(L, uv_->v, R(a));                                                                   \
+        luaC_barrier(L, uv_, R(a));                                                                \
+    }
+
+/* Arithmetic on operands of unknown types, `rb' and `rc' are registers or constants */
+#define AOT_ARITH(n, a, rb, rc, op, tm)                                                            \
+    {                                                                                              \
+        const TValue *rb_ = (rb), *rc_ = (rc);                                                     \
+        if (ttisnumber(rb_) && ttisnumber(rc_)) {                                                  \
+            setnvalue(R(a), op(nvalue(rb_), nvalue(rc_)));                                         \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->arith(L, R(a), rb_, rc_, tm);                                                 \
+        }                                                                                          \
+    }
+
+#define AOT_UNM(n, a, b)                                                                           \
+    {                                                                                              \
+        if (ttisnumber(R(b))) {                                                                    \
+            setnvalue(R(a), luai_numunm(nvalue(R(b))));                                            \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->arith(L, R(a), R(b), R(b), TM_UNM);                                           \
+        }                                                                                          \
+    }
+
+#define AOT_NOT(a, b)                                                                              \
+    {                                                                                              \
+        int res_ = l_isfalse(R(b));                                                                \
+        setbvalue(R(a), res_);                                                                     \
+    }
+
+#define AOT_LEN(n, a, b)                                                                           \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->objlen(L, R(a), R(b));                                                            \
+    }
+
+#define AOT_GETENV(n, a, kx)                                                                       \
+    {                                                                                              \
+        GlobalCache *c_ = &cl->p->gcache[kx];                                                      \
+        Table *env_ = cl->env;                                                                     \
+        if (c_->table == env_ && c_->stamp == env_->stamp && !ttisnil(c_->slot)) {                 \
+            setobj2s(L, R(a), c_->slot);                                                           \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->getenv(L, env_, &k[kx], c_, R(a));                                            \
+        }                                                                                          \
+    }
+
+#define AOT_SETGLOBAL(n, a, kx)                                                                    \
+    {                                                                                              \
+        TValue env_;                                                                               \
+        sethvalue(L, &env_, cl->env);                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->settable(L, &env_, &k[kx], R(a));                                                 \
+    }
+
+#define AOT_CONCAT(n, a, b, c)                                                                     \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->concat(L, (c) - (b) + 1, c);                                                      \
+        luaC_checkGC(L);                                                                           \
+        setobjs2s(L, R(a), R(b));                                                                  \
+    }
+
+/* Calls go through luaD_call, `b' and `c' are encoded like in OP_CALL */
+#define AOT_CALL(n, a, b, c)                                                                       \
+    {                                                                                              \
+        if ((b) != 0)                                                                              \
+            L->top = R(a) + (b);                                                                   \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->call(L, R(a), (c) - 1);                                                           \
+        if ((c) != 0)                                                                              \
+            L->top = L->ci->top;                                                                   \
+    }
+
+#define AOT_CALLENVK(n, a, kname, karg)                                                            \
+    {                                                                                              \
+        AOT_GETENV(n, a, kname);                                                                   \
+        setobj2s(L, R(a) + 1, &k[karg]);                                                           \
+        L->top = R(a) + 2;                                                                         \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->call(L, R(a), 0);                                                                 \
+        L->top = L->ci->top;                                                                       \
+    }
+
+#define AOT_RETURN(n, a, b)                                                                        \
+    {                                                                                              \
+        if ((b) != 0)                                                                              \
+            L->top = R(a) + (b) - 1;                                                               \
+        if (L->openupval)                                                                          \
+            aot_api->close(L, L->base);                                                            \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->poscall(L, R(a));                                                                 \
+        return;                                                                                    \
+    }
+
+#define AOT_VARARG(n, a, b)                                                                        \
+    {                                                                                              \
+        int b_ = (b) - 1;                                                                          \
+        int n_ = cast_int(L->base - L->ci->func) - cl->p->numparams - 1;                           \
+        if (n_ < 0)                                                                                \
+            n_ = 0;                                                                                \
+        if (b_ == LUA_MULTRET) {                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            luaD_checkstack(L, n_);                                                                \
+            b_ = n_;                                                                               \
+            L->top = R(a) + n_;                                                                    \
+        }                                                                                          \
+        for (int j_ = 0; j_ < b_; j_++) {                                                          \
+            if (j_ < n_) {                                                                         \
+                setobjs2s(L, R(a) + j_, L->base - n_ + j_);                                        \
+            } else                                                                                 \
+                setnilvalue(R(a) + j_);                                                            \
+        }                                                                                          \
+    }
+
+#define AOT_GETTABLE(n, a, b, c) (AOT_SAVEPC(n), aot_api->gettable(L, R(b), R(c), R(a)))
+#define AOT_SETTABLE(n, a, b, c) (AOT_SAVEPC(n), aot_api->settable(L, R(a), R(b), R(c)))
+
+#define AOT_NEWTABLE(n, a, narray, nhash)                                                          \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        sethvalue(L, R(a), aot_api->newtable(L, narray, nhash));                                   \
+        luaC_checkGC(L);                                                                           \
+    }
+
+#define AOT_NEWRECORD(n, a, b)                                                                     \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        sethvalue(L, R(a), aot_api->newrecord(L, 0, b));                                           \
+        luaC_checkGC(L);                                                                           \
+    }
+
+/* The metatable of `h' is known to have no metamethod `e', native code only reads the flags the
+ * VM caches the missing ones in */
+#define AOT_NOTM(h, e) ((h)->metatable == NULL || ((h)->metatable->flags & (1u << (e))))
+
+/* Field accesses use the inline cache of their instruction, `n' - 1 */
+#define AOT_GETFIELD(n, a, b, kx)                                                                  \
+    {                                                                                              \
+        FieldCache *c_ = &cl->p->fcache[(n) - 1];                                                  \
+        StkId rb_ = R(b);                                                                          \
+        Table *h_ = ttistable(rb_) ? hvalue(rb_) : NULL;                                           \
+        if (h_ != NULL && h_->shape != NULL && h_->shape->id == c_->shape &&                       \
+            (!ttisnil(&h_->fields[c_->index]) || AOT_NOTM(h_, TM_INDEX))) {                        \
+            setobj2s(L, R(a), &h_->fields[c_->index]);                                             \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->getfield(L, rb_, &k[kx], c_, R(a));                                           \
+        }                                                                                          \
+    }
+
+#define AOT_SETFIELD(n, a, kx, c)                                                                  \
+    {                                                                                              \
+        FieldCache *c_ = &cl->p->fcache[(n) - 1];                                                  \
+        StkId ra_ = R(a);                                                                          \
+        Table *h_ = ttistable(ra_) ? hvalue(ra_) : NULL;                                           \
+        if (h_ != NULL && h_->shape != NULL && h_->shape->id == c_->shape &&                       \
+            (c_->next == NULL                                                                      \
+                 ? !ttisnil(&h_->fields[c_->index]) || AOT_NOTM(h_, TM_NEWINDEX)                   \
+                 : AOT_NOTM(h_, TM_NEWINDEX) && c_->next->nkeys <= h_->sizefields)) {              \
+            if (c_->next != NULL)                                                                  \
+                h_->shape = c_->next;                                                              \
+            setobj2t(L, &h_->fields[c_->index], R(c));                                             \
+            h_->flags = 0;                                                                         \
+            luaC_barriert(L, h_, R(c));                                                            \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->setfield(L, ra_, &k[kx], R(c), c_);                                           \
+        }                                                                                          \
+    }
+
+#define AOT_SETLIST(n, a, b, c)                                                                    \
+    {                                                                                              \
+        Table *h_ = hvalue(R(a));                                                                  \
+        int last_ = (c) * ARRAY_FIELDS_PER_FLUSH + (b);                                            \
+        if (last_ > h_->sizearray) {                                                               \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->resizearray(L, h_, last_);                                                    \
+        }                                                                                          \
+        for (int j_ = (b); j_ > 0; j_--) {                                                         \
+            TValue *value_ = R(a) + j_;                                                            \
+            setobj2t(L, aot_api->setnum(L, h_, last_--), value_);                                  \
+            luaC_barriert(L, h_, value_);                                                          \
+        }                                                                                          \
+    }
+
+#define AOT_NEWARRAY(n, a, b, c)                                                                   \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        setarrvalue(L, R(a), aot_api->newarray(L, b, c));                                          \
+        luaC_checkGC(L);                                                                           \
+    }
+
+#define AOT_SETARRAYLIST(n, a, b, c)                                                               \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->setarraylist(L, arrvalue(R(a)), (c)*ARRAY_FIELDS_PER_FLUSH, R(a) + 1, b);         \
+    }
+
+/* The elements of typed arrays, spelled out of the macros below whose parameters are `n' and `b' */
+#define AOT_ARRNUM(x) ((x)->u.n)
+#define AOT_ARRBOOL(x) ((x)->u.b)
+
+/* In bounds accesses of typed arrays with an integral index need no call */
+#define AOT_GETARRAY(n, a, b, c)                                                                   \
+    {                                                                                              \
+        StkId rb_ = R(b), rc_ = R(c);                                                              \
+        int index_ = 0;                                                                            \
+        if (ttisarray(rb_) && ttisnumber(rc_))                                                     \
+            lua_number2int(index_, nvalue(rc_));                                                   \
+        if (index_ != 0 && cast_num(index_) == nvalue(rc_) &&                                      \
+            (unsigned int)(index_ - 1) < (unsigned int)arrvalue(rb_)->size) {                      \
+            Array *x_ = arrvalue(rb_);                                                             \
+            if (x_->kind == ARRAY_NUMBER) {                                                        \
+                setnvalue(R(a), AOT_ARRNUM(x_)[index_ - 1]);                                       \
+            } else                                                                                 \
+                setbvalue(R(a), AOT_ARRBOOL(x_)[index_ - 1]);                                      \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->gettable(L, rb_, rc_, R(a));                                                  \
+        }                                                                                          \
+    }
+
+#define AOT_SETARRAY(n, a, b, c)                                                                   \
+    {                                                                                              \
+        StkId ra_ = R(a), rb_ = R(b), rc_ = R(c);                                                  \
+        int index_ = 0, done_ = 0;                                                                 \
+        if (ttisarray(ra_) && ttisnumber(rb_))                                                     \
+            lua_number2int(index_, nvalue(rb_));                                                   \
+        if (index_ != 0 && cast_num(index_) == nvalue(rb_) &&                                      \
+            (unsigned int)(index_ - 1) < (unsigned int)arrvalue(ra_)->size) {                      \
+            Array *x_ = arrvalue(ra_);                                                             \
+            if (x_->kind == ARRAY_NUMBER && ttisnumber(rc_)) {                                     \
+                AOT_ARRNUM(x_)[index_ - 1] = nvalue(rc_);                                          \
+                done_ = 1;                                                                         \
+            } else if (x_->kind == ARRAY_BOOLEAN && ttisboolean(rc_)) {                            \
+                AOT_ARRBOOL(x_)[index_ - 1] = cast_byte(bvalue(rc_) != 0);                         \
+                done_ = 1;                                                                         \
+            }                                                                                      \
+        }                                                                                          \
+        if (!done_) {                                                                              \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->settable(L, ra_, rb_, rc_);                                                   \
+        }                                                                                          \
+    }
+
+/* The same for an index the compiler proved to be whole, see OP_GETARRAYI */
+#define AOT_INDEXI(x, rc) (luai_numle(1, nvalue(rc)) && luai_numle(nvalue(rc), cast_num((x)->size)))
+
+#define AOT_GETARRAYI(n, a, b, c)                                                                  \
+    {                                                                                              \
+        StkId rb_ = R(b), rc_ = R(c);                                                              \
+        if (ttisarray(rb_) && AOT_INDEXI(arrvalue(rb_), rc_)) {                                    \
+            Array *x_ = arrvalue(rb_);                                                             \
+            int index_ = cast_int(nvalue(rc_));                                                    \
+            if (x_->kind == ARRAY_NUMBER) {                                                        \
+                setnvalue(R(a), AOT_ARRNUM(x_)[index_ - 1]);                                       \
+            } else                                                                                 \
+                setbvalue(R(a), AOT_ARRBOOL(x_)[index_ - 1]);                                      \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->gettable(L, rb_, rc_, R(a));                                                  \
+        }                                                                                          \
+    }
+
+#define AOT_SETARRAYI(n, a, b, c)                                                                  \
+    {                                                                                              \
+        StkId ra_ = R(a), rb_ = R(b), rc_ = R(c);                                                  \
+        int done_ = 0;                                                                             \
+        if (ttisarray(ra_) && AOT_INDEXI(arrvalue(ra_), rb_)) {                                    \
+            Array *x_ = arrvalue(ra_);                                                             \
+            int index_ = cast_int(nvalue(rb_));                                                    \
+            if (x_->kind == ARRAY_NUMBER && ttisnumber(rc_)) {                                     \
+                AOT_ARRNUM(x_)[index_ - 1] = nvalue(rc_);                                          \
+                done_ = 1;                                                                         \
+            } else if (x_->kind == ARRAY_BOOLEAN && ttisboolean(rc_)) {                            \
+                AOT_ARRBOOL(x_)[index_ - 1] = cast_byte(bvalue(rc_) != 0);                         \
+                done_ = 1;                                                                         \
+            }                                                                                      \
+        }                                                                                          \
+        if (!done_) {                                                                              \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->settable(L, ra_, rb_, rc_);                                                   \
+        }                                                                                          \
+    }
+
+/* Integer keys of tables in the array part, see OP_GETINDEX */
+#define AOT_INDEXT(h, rc)                                                                          \
+    (luai_numle(1, nvalue(rc)) && luai_numle(nvalue(rc), cast_num((h)->sizearray)))
+
+#define AOT_GETINDEX(n, a, b, c)                                                                   \
+    {                                                                                              \
+        StkId rb_ = R(b), rc_ = R(c);                                                              \
+        Table *h_ = ttistable(rb_) ? hvalue(rb_) : NULL;                                           \
+        if (h_ != NULL && AOT_INDEXT(h_, rc_) &&                                                   \
+            (!ttisnil(&h_->array[cast_int(nvalue(rc_)) - 1]) || AOT_NOTM(h_, TM_INDEX))) {         \
+            setobj2s(L, R(a), &h_->array[cast_int(nvalue(rc_)) - 1]);                              \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->gettable(L, rb_, rc_, R(a));                                                  \
+        }                                                                                          \
+    }
+
+#define AOT_SETINDEX(n, a, b, c)                                                                   \
+    {                                                                                              \
+        StkId ra_ = R(a), rb_ = R(b), rc_ = R(c);                                                  \
+        Table *h_ = ttistable(ra_) ? hvalue(ra_) : NULL;                                           \
+        if (h_ != NULL && AOT_INDEXT(h_, rb_) &&                                                   \
+            (!ttisnil(&h_->array[cast_int(nvalue(rb_)) - 1]) || AOT_NOTM(h_, TM_NEWINDEX))) {      \
+            setobj2t(L, &h_->array[cast_int(nvalue(rb_)) - 1], rc_);                               \
+            luaC_barriert(L, h_, rc_);                                                             \
+        } else {                                                                                   \
+            AOT_SAVEPC(n);                                                                         \
+            aot_api->settable(L, ra_, rb_, rc_);                                                   \
+        }                                                                                          \
+    }
+
+/* Numeric for loops, the jumps are emitted as gotos around these */
+#define AOT_FORPREP(n, a)                                                                          \
+    {                                                                                              \
+        StkId ra_ = R(a);                                                                          \
+        const TValue *init_ = ra_, *plimit_ = ra_ + 1, *pstep_ = ra_ + 2;                          \
+        AOT_SAVEPC(n);                                                                             \
+        if (!tonumber(init_, ra_))                                                                 \
+            aot_api->runerror(L, LUA_QL("for") " initial value must be a number");                 \
+        else if (!tonumber(plimit_, ra_ + 1))                                                      \
+            aot_api->runerror(L, LUA_QL("for") " limit must be a number");                         \
+        else if (!tonumber(pstep_, ra_ + 2))                                                       \
+            aot_api->runerror(L, LUA_QL("for") " step must be a number");                          \
+        setnvalue(ra_, luai_numsub(nvalue(ra_), nvalue(pstep_)));                                  \
+    }
+
+#define AOT_FORLOOP(a, label, test)                                                                \
+    {                                                                                              \
+        StkId ra_ = R(a);                                                                          \
+        lua_Number step_ = nvalue(ra_ + 2);                                                        \
+        lua_Number idx_ = luai_numadd(nvalue(ra_), step_);                                         \
+        lua_Number limit_ = nvalue(ra_ + 1);                                                       \
+        (void)step_;                                                                               \
+        if (test) {                                                                                \
+            setnvalue(ra_, idx_);                                                                  \
+            setnvalue(ra_ + 3, idx_);                                                              \
+            goto label;                                                                            \
+        }                                                                                          \
+    }
+
+#define AOT_FORTEST (luai_numlt(0, step_) ? luai_numle(idx_, limit_) : luai_numle(limit_, idx_))
+#define AOT_FORTESTINC luai_numle(idx_, limit_)
+#define AOT_FORTESTDEC luai_numle(limit_, idx_)
+
+/* Conditional branches, the translation takes the jump after one with a goto when the result is
+ * the expected one */
+#define AOT_COMPARE(n, numop, vmop, x, y)                                                          \
+    (ttisnumber(x) && ttisnumber(y) ? numop(nvalue(x), nvalue(y))                                  \
+                                    : (AOT_SAVEPC(n), aot_api->vmop(L, x, y)))
+
+#define AOT_EQ(n, x, y) (ttype(x) == ttype(y) && (AOT_SAVEPC(n), aot_api->equalval(L, x, y)))
+#define AOT_LT(n, x, y) AOT_COMPARE(n, luai_numlt, lessthan, x, y)
+#define AOT_LE(n, x, y) AOT_COMPARE(n, luai_numle, lessequal, x, y)
+#define AOT_TEST(a) (!l_isfalse(R(a)))
+
+#define AOT_APPEND(n, a, b)                                                                        \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->append(L, R(a), R(b));                                                            \
+        luaC_checkGC(L);                                                                           \
+    }
+
+#define AOT_BUILDSTRING(n, a, b)                                                                   \
+    {                                                                                              \
+        AOT_SAVEPC(n);                                                                             \
+        aot_api->buildstring(L, R(a), R(b));                                                       \
+        luaC_checkGC(L);                                                                           \
+    }
+
+/* A closure is created by an AOT_CLOSURE, one capture per upvalue and an AOT_CLOSURE_END */
+#define AOT_CLOSURE(index)                                                                         \
+    {                                                                                              \
+        Proto *p_ = cl->p->p[index];                                                               \
+        Closure *ncl_ = aot_api->newclosure(L, p_->nups, cl->env);                                 \
+        ncl_->l.p = p_
+
+#define AOT_CAPTURE_REFERENCE(j, index) ncl_->l.upvals[j] = aot_api->findupval(L, R(index))
+#define AOT_CAPTURE_UPVALUE(j, index) ncl_->l.upvals[j] = cl->upvals[index]
+
+#define AOT_CAPTURE_VALUE(j, index)                                                                \
+    ncl_->l.upvals[j] = aot_api->newupval(L);                                                      \
+    setobj(L, ncl_->l.upvals[j]->v, R(index))
+
+#define AOT_CLOSURE_END(n, a)                                                                      \
+    setclvalue(L, R(a), ncl_);                                                                     \
+    AOT_SAVEPC(n);                                                                                 \
+    luaC_checkGC(L);                                                                               \
+    }
+
+#define AOT_CLOSE(a) aot_api->close(L, R(a))
+
+#endif
+
+#endif
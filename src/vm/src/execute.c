@@ -1,8 +1,46 @@
 #define LUA_CORE
+#include "lua/larray.h"
+#include "lua/ldebug.h"
+#include "lua/lfunc.h"
 #include "lua/lgc.h"
+#include "lua/ltable.h"
 #include "lua/lvm.h"
 
 #include "../../common/opcodes.h"
+#include "jit.h"
+#include "profile.h"
+#include "sample.h"
+
+/* Computed-goto dispatch is used whenever the compiler supports it (GCC and clang). Build with
+ * -DLUAPP_USE_JUMPTABLE=0 to force the portable switch based dispatch. */
+#if !defined(LUAPP_USE_JUMPTABLE)
+#if defined(__GNUC__)
+#define LUAPP_USE_JUMPTABLE 1
+#else
+#define LUAPP_USE_JUMPTABLE 0
+#endif
+#endif
+
+/* Fetch the next instruction to be executed, profiling builds record every dispatch */
+#if LUAPP_PROFILE
+#define vmfetch()                                                                                  \
+    (i = *pc++, luapp_profile_step(GET_OPCODE(i)), luapp_profile_site(L, cl, pc - 1, base))
+#else
+#define vmfetch() (i = *pc++)
+#endif
+
+/* Stops the profiler clock whenever luapp_execute is left */
+#if LUAPP_PROFILE
+#define vmleave() luapp_profile_pause()
+#else
+#define vmleave() ((void)0)
+#endif
+
+/* Portable dispatch, replaced in jumptab.h when computed gotos are enabled */
+#define vmdispatch(o) switch (o)
+#define vmcase(l) case l:
+#define vmdefault default:
+#define vmbreak continue
 
 /* Protects the stack pointer from any external Lua calls that could reallocate the stack. */
 #define PROTECT(x)                                                                                 \
@@ -42,6 +80,73 @@
         DO_ARITH(op, ra, rb, rk, tm);                                                              \
     }
 
+/* Arithmetic on operands the compiler proved to be numbers, no tag checks are needed */
+#define ARITHNN(op) setnvalue(RA(i), op(nvalue(RB(i)), nvalue(RC(i))))
+#define ARITHNK(op) setnvalue(RA(i), op(nvalue(RB(i)), nvalue(KC(i))))
+
+/* Jumps from the next instruction, a jump back is an iteration of a loop */
+#define DO_JUMP(offset)                                                                            \
+    {                                                                                              \
+        int32_t offset_ = (offset);                                                                \
+                                                                                                   \
+        pc += offset_;                                                                             \
+        if (offset_ < 0) {                                                                         \
+            luapp_jit_count(L, cl->p);                                                             \
+            luapp_sample_check(L, pc);                                                             \
+        }                                                                                          \
+    }
+
+/* A conditional branch takes the OP_JMP that follows it when the result is the expected one and
+ * steps over it otherwise */
+#define BRANCH(res, expected)                                                                      \
+    {                                                                                              \
+        if ((res) == (expected))                                                                   \
+            DO_JUMP(GETARG_E(*pc) + 1)                                                             \
+        else                                                                                       \
+            pc++;                                                                                  \
+    }
+
+/* Compares two values, numbers directly and everything else through the (metamethod aware) VM */
+#define COMPARE(numop, vmop, x, y)                                                                 \
+    {                                                                                              \
+        const TValue *x_ = (x), *y_ = (y);                                                         \
+        int res_;                                                                                  \
+                                                                                                   \
+        if (ttisnumber(x_) && ttisnumber(y_))                                                      \
+            res_ = numop(nvalue(x_), nvalue(y_));                                                  \
+        else                                                                                       \
+            PROTECT(res_ = vmop(L, x_, y_));                                                       \
+        BRANCH(res_, GETARG_A(i));                                                                 \
+    }
+
+/* Comparisons of operands the compiler proved to be numbers */
+#define COMPARENN(numop) BRANCH(numop(nvalue(RB(i)), nvalue(RC(i))), GETARG_A(i))
+#define COMPARENK(numop, x, y) BRANCH(numop(x, y), GETARG_A(i))
+
+/* Calls the function at ra with the arguments up to L->top, continues with the next instruction
+ * once a C function returned or restarts the main loop over a Lua function */
+#define DO_CALL(ra, nresults)                                                                      \
+    {                                                                                              \
+        L->savedpc = pc;                                                                           \
+        switch (luaD_precall(L, ra, nresults)) {                                                   \
+            case PCRLUA: {                                                                         \
+                nexeccalls++;                                                                      \
+                goto reentry; /* restart over new Lua function */                                  \
+            }                                                                                      \
+            case PCRC: {                                                                           \
+                /* it was a C function (`precall' called it); adjust results */                    \
+                if ((nresults) >= 0)                                                               \
+                    L->top = L->ci->top;                                                           \
+                base = L->base;                                                                    \
+                vmbreak;                                                                           \
+            }                                                                                      \
+            default: {                                                                             \
+                vmleave();                                                                         \
+                return; /* yield */                                                                \
+            }                                                                                      \
+        }                                                                                          \
+    }
+
 /* Register manipulation */
 #define RA(i) (lua_assert(GETARG_A(i) < L->top - base), (&base[GETARG_A(i)]))
 #define RB(i) (lua_assert(GETARG_B(i) < L->top - base), (&base[GETARG_B(i)]))
@@ -66,130 +171,254 @@ reentry:
     cl = &clvalue(L->ci->func)->l;
     base = L->base;
     k = cl->p->k;
+    luapp_sample_check(L, pc);
+
+#if LUAPP_USE_JUMPTABLE
+#include "jumptab.h"
+#endif
 
     /* Main loop for the vm */
     for (;;) {
+        Instruction i;
+
         /* Prep instruction for execution */
-        const Instruction i = *pc++;
+        vmfetch();
 
         /* Handle each opcode */
-        switch (GET_OPCODE(i)) {
-            case OP_VARARGPREP: {
-                /* Prepare the stack for any possible varargs */
-                int32_t numparams = GETARG_A(i);
-
-                /* Get more stack space as each argument is copied over */
-                PROTECT(luaD_checkstack(L, cl->p->maxstacksize + numparams));
-
-                lua_assert(cast_int(L->top - base) >= numparams);
-
-                StkId fixed = base;
-                base = L->top;
+        vmdispatch(GET_OPCODE(i)) {
+            vmcase(OP_VARARGPREP) {
+                /* luaD_precall already laid out the frame, it only moves the fixed parameters
+                 * above the extra arguments when there are some */
+                vmbreak;
+            }
+            vmcase(OP_VARARG) {
+                StkId ra = RA(i);
+                int32_t b = GETARG_B(i) - 1;
+                CallInfo *ci = L->ci;
 
-                for (int32_t i = 0; i < numparams; ++i)
-                    setobj2s(L, base + i, fixed + i);
-                setnilvalue(fixed + i);
+                /* The extra arguments are right below the base, if there are any */
+                int32_t n = cast_int(base - ci->func) - cl->p->numparams - 1;
+                if (n < 0)
+                    n = 0;
 
-                /* Rewire our stack frame to point to the new base */
-                L->ci->base = base;
-                L->ci->top = base + cl->p->maxstacksize;
+                if (b == LUA_MULTRET) {
+                    PROTECT(luaD_checkstack(L, n));
+                    ra = RA(i); /* previous call may change the stack */
+                    b = n;
+                    L->top = ra + n;
+                }
 
-                L->base = base;
-                L->top = L->ci->top;
-                continue;
+                for (int32_t j = 0; j < b; j++) {
+                    if (j < n) {
+                        setobjs2s(L, ra + j, base - n + j);
+                    } else
+                        setnilvalue(ra + j);
+                }
+                vmbreak;
+            }
+            vmcase(OP_MOVE) {
+                setobjs2s(L, RA(i), RB(i));
+                vmbreak;
             }
-            case OP_LOADK: {
+            vmcase(OP_LOADK) {
                 setobj2s(L, RA(i), KD(i));
-                continue;
+                vmbreak;
             }
-            case OP_LOADKX: {
+            vmcase(OP_GETUPVAL) {
+                setobj2s(L, RA(i), cl->upvals[GETARG_B(i)]->v);
+                vmbreak;
+            }
+            vmcase(OP_SETUPVAL) {
+                UpVal *uv = cl->upvals[GETARG_B(i)];
+
+                setobj(L, uv->v, RA(i));
+                luaC_barrier(L, uv, RA(i));
+                vmbreak;
+            }
+            vmcase(OP_LOADKX) {
                 /* Constant is stored in the sub instruction */
                 const Instruction sub = *pc++;
 
                 setobj2s(L, RA(i), K(sub));
-                continue;
+                vmbreak;
             }
-            case OP_LOADBOOL: {
+            vmcase(OP_LOADBOOL) {
                 setbvalue(RA(i), GETARG_B(i));
 
                 if (GETARG_C(i))
                     pc++;
-                continue;
+                vmbreak;
+            }
+            vmcase(OP_LOADNIL) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+
+                do {
+                    setnilvalue(rb--);
+                } while (rb >= ra);
+                vmbreak;
             }
-            case OP_LOADNN: {
+            vmcase(OP_LOADNN) {
                 setnvalue(RA(i), -(double)(GETARG_Du(i)));
-                continue;
+                vmbreak;
             }
-            case OP_LOADPN: {
+            vmcase(OP_LOADPN) {
                 setnvalue(RA(i), (double)(GETARG_Du(i)));
-                continue;
+                vmbreak;
             }
-            case OP_ADD: {
+            vmcase(OP_ADD) {
                 ARITH(luai_numadd, TM_ADD);
-                break;
+                vmbreak;
             }
-            case OP_SUB: {
+            vmcase(OP_SUB) {
                 ARITH(luai_numsub, TM_SUB);
-                break;
+                vmbreak;
             }
-            case OP_MUL: {
+            vmcase(OP_MUL) {
                 ARITH(luai_nummul, TM_MUL);
-                break;
+                vmbreak;
             }
-            case OP_DIV: {
+            vmcase(OP_DIV) {
                 ARITH(luai_numdiv, TM_DIV);
-                break;
+                vmbreak;
             }
-            case OP_POW: {
+            vmcase(OP_POW) {
                 ARITH(luai_numpow, TM_POW);
-                break;
+                vmbreak;
             }
-            case OP_MOD: {
+            vmcase(OP_MOD) {
                 ARITH(luai_nummod, TM_MOD);
-                break;
+                vmbreak;
             }
-            case OP_ADDK: {
+            vmcase(OP_ADDK) {
                 ARITHK(luai_numadd, TM_ADD);
-                break;
+                vmbreak;
             }
-            case OP_SUBK: {
+            vmcase(OP_SUBK) {
                 ARITHK(luai_numsub, TM_SUB);
-                break;
+                vmbreak;
             }
-            case OP_MULK: {
+            vmcase(OP_MULK) {
                 ARITHK(luai_nummul, TM_MUL);
-                break;
+                vmbreak;
             }
-            case OP_DIVK: {
+            vmcase(OP_DIVK) {
                 ARITHK(luai_numdiv, TM_DIV);
-                break;
+                vmbreak;
             }
-            case OP_POWK: {
+            vmcase(OP_POWK) {
                 ARITHK(luai_numpow, TM_POW);
-                break;
+                vmbreak;
             }
-            case OP_MODK: {
+            vmcase(OP_MODK) {
                 ARITHK(luai_nummod, TM_MOD);
-                break;
+                vmbreak;
+            }
+            vmcase(OP_UNM) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+
+                if (ttisnumber(rb)) {
+                    setnvalue(ra, luai_numunm(nvalue(rb)));
+                } else
+                    PROTECT(luaV_arith(L, ra, rb, rb, TM_UNM));
+                vmbreak;
+            }
+            vmcase(OP_NOT) {
+                int32_t res = l_isfalse(RB(i)); /* the assignment may overwrite R(B) */
+
+                setbvalue(RA(i), res);
+                vmbreak;
+            }
+            vmcase(OP_LEN) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+
+                if (ttisstring(rb)) {
+                    setnvalue(ra, cast_num(tsvalue(rb)->len));
+                } else
+                    PROTECT(luaV_objlen(L, ra, rb));
+                vmbreak;
+            }
+            vmcase(OP_ADDNN) {
+                ARITHNN(luai_numadd);
+                vmbreak;
+            }
+            vmcase(OP_SUBNN) {
+                ARITHNN(luai_numsub);
+                vmbreak;
+            }
+            vmcase(OP_MULNN) {
+                ARITHNN(luai_nummul);
+                vmbreak;
+            }
+            vmcase(OP_DIVNN) {
+                ARITHNN(luai_numdiv);
+                vmbreak;
+            }
+            vmcase(OP_MODNN) {
+                ARITHNN(luai_nummod);
+                vmbreak;
+            }
+            vmcase(OP_POWNN) {
+                ARITHNN(luai_numpow);
+                vmbreak;
+            }
+            vmcase(OP_ADDNK) {
+                ARITHNK(luai_numadd);
+                vmbreak;
+            }
+            vmcase(OP_SUBNK) {
+                ARITHNK(luai_numsub);
+                vmbreak;
+            }
+            vmcase(OP_MULNK) {
+                ARITHNK(luai_nummul);
+                vmbreak;
+            }
+            vmcase(OP_DIVNK) {
+                ARITHNK(luai_numdiv);
+                vmbreak;
+            }
+            vmcase(OP_MODNK) {
+                ARITHNK(luai_nummod);
+                vmbreak;
+            }
+            vmcase(OP_POWNK) {
+                ARITHNK(luai_numpow);
+                vmbreak;
             }
-            case OP_GETENV: {
-                TValue *kv = KD(i);
+            vmcase(OP_GETENV) {
+                GlobalCache *c = &cl->p->gcache[GETARG_D(i)];
+                Table *env = cl->env;
 
-                /* Make sure we were able to successfully retrieve the value from our environment */
-                if (!ttisnil(kv))
-                    setobj2s(L, RA(i), kv);
-                continue;
+                /* The cached slot is valid as long as the table kept its stamp, a nil value means
+                 * the global was removed (its node may be reused for another key) */
+                if (c->table == env && c->stamp == env->stamp && !ttisnil(c->slot)) {
+                    setobj2s(L, RA(i), c->slot);
+                } else
+                    PROTECT(luaV_getenv(L, env, KD(i), c, RA(i)));
+                vmbreak;
             }
-            case OP_CONCAT: {
+            vmcase(OP_SETGLOBAL) {
+                TValue env;
+
+                /* Assigning a global that exists keeps its node, so the caches of OP_GETENV that
+                 * point at it see the new value */
+                sethvalue(L, &env, cl->env);
+                PROTECT(luaV_settable(L, &env, KD(i), RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_CONCAT) {
                 int32_t b = GETARG_B(i);
                 int32_t c = GETARG_C(i);
 
                 PROTECT(luaV_concat(L, c - b + 1, c); luaC_checkGC(L));
 
                 setobjs2s(L, RA(i), base + b);
-                continue;
+                vmbreak;
             }
-            case OP_CALL: {
+            vmcase(OP_CALL) {
                 StkId ra = RA(i);
 
                 /* Retrieve information from the instruction */
@@ -199,28 +428,614 @@ reentry:
                 if (nparams != LUA_MULTRET)
                     L->top = ra + 1 + nparams;
 
+                /* Interpreted Lua functions with fixed parameters skip the generic checks of
+                 * luaD_precall */
+                if (ttisfunction(ra) && !clvalue(ra)->c.isC && !clvalue(ra)->l.p->is_vararg &&
+                    clvalue(ra)->l.p->native == NULL && !(L->hookmask & LUA_MASKCALL)) {
+                    L->savedpc = pc;
+                    luapp_precall(L, ra, nresults);
+                    nexeccalls++;
+                    goto reentry;
+                }
+
+                DO_CALL(ra, nresults);
+            }
+            vmcase(OP_CALLDIRECT) {
+                StkId ra = RA(i);
+                int32_t nresults = GETARG_C(i) - 1;
+
+                L->top = ra + GETARG_B(i);
+
+                /* The compiler proved R(A) to be an interpreted Lua function with fixed
+                 * parameters, which the verifier can not see in the bytecode (see load.c). Any
+                 * other value, native code and call hooks take the generic path. */
+                if (ttisfunction(ra) && !clvalue(ra)->c.isC && !clvalue(ra)->l.p->is_vararg &&
+                    clvalue(ra)->l.p->native == NULL && !(L->hookmask & LUA_MASKCALL)) {
+                    L->savedpc = pc;
+                    luapp_precall(L, ra, nresults);
+                    nexeccalls++;
+                    goto reentry;
+                }
+
+                DO_CALL(ra, nresults);
+            }
+            vmcase(OP_TAILCALL) {
+                StkId ra = RA(i);
+                int32_t b = GETARG_B(i);
+
+                if (b != 0)
+                    L->top = ra + b; /* else previous instruction set top */
+
                 L->savedpc = pc;
-                switch (luaD_precall(L, ra, nresults)) {
+                lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
+
+                switch (luaD_precall(L, ra, LUA_MULTRET)) {
                     case PCRLUA: {
-                        nexeccalls++;
-                        goto reentry; /* restart over new Lua function */
+                        /* tail call: put new frame in place of previous one */
+                        CallInfo *ci = L->ci - 1; /* previous frame */
+                        StkId func = ci->func;
+                        StkId pfunc = (ci + 1)->func; /* previous function index */
+                        int aux;
+
+                        if (L->openupval)
+                            luaF_close(L, ci->base);
+
+                        L->base = ci->base = ci->func + ((ci + 1)->base - pfunc);
+                        for (aux = 0; pfunc + aux < L->top; aux++) /* move frame down */
+                            setobjs2s(L, func + aux, pfunc + aux);
+
+                        ci->top = L->top = func + aux; /* correct top */
+                        ci->savedpc = L->savedpc;
+                        ci->tailcalls++; /* one more call lost */
+                        L->ci--;         /* remove new frame */
+                        goto reentry;
                     }
                     case PCRC: {
-                        /* it was a C function (`precall' called it); adjust results */
-                        if (nresults >= 0)
-                            L->top = L->ci->top;
+                        /* it was a C function, its results are followed by OP_RETURN */
                         base = L->base;
-                        continue;
+                        vmbreak;
                     }
                     default: {
+                        vmleave();
                         return; /* yield */
                     }
                 }
             }
-            case OP_RETURN:
-                goto exit;
+            vmcase(OP_CALLENVK) {
+                GlobalCache *c = &cl->p->gcache[GETARG_B(i)];
+                Table *env = cl->env;
+                StkId ra = RA(i);
+
+                if (c->table == env && c->stamp == env->stamp && !ttisnil(c->slot)) {
+                    setobj2s(L, ra, c->slot);
+                } else {
+                    PROTECT(luaV_getenv(L, env, K(GETARG_B(i)), c, ra));
+                    ra = RA(i);
+                }
+
+                setobj2s(L, ra + 1, KC(i));
+                L->top = ra + 2;
+
+                DO_CALL(ra, 0);
+            }
+            vmcase(OP_GETTABLE) {
+                PROTECT(luaV_gettable(L, RB(i), RC(i), RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_SETTABLE) {
+                PROTECT(luaV_settable(L, RA(i), RB(i), RC(i)));
+                vmbreak;
+            }
+            vmcase(OP_GETINDEX) {
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+
+                /* A whole key in the array part converts exactly, NaN fails both comparisons */
+                if (ttistable(rb)) {
+                    Table *h = hvalue(rb);
+                    lua_Number n = nvalue(rc);
+
+                    if (luai_numle(1, n) && luai_numle(n, cast_num(h->sizearray))) {
+                        const TValue *v = &h->array[cast_int(n) - 1];
+
+                        if (!ttisnil(v) || fasttm(L, h->metatable, TM_INDEX) == NULL) {
+                            setobj2s(L, RA(i), v);
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_gettable(L, rb, rc, RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_SETINDEX) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+
+                /* Integer keys are never the name of a metamethod, h->flags stays valid */
+                if (ttistable(ra)) {
+                    Table *h = hvalue(ra);
+                    lua_Number n = nvalue(rb);
+
+                    if (luai_numle(1, n) && luai_numle(n, cast_num(h->sizearray))) {
+                        TValue *slot = &h->array[cast_int(n) - 1];
+
+                        if (!ttisnil(slot) || fasttm(L, h->metatable, TM_NEWINDEX) == NULL) {
+                            setobj2t(L, slot, RC(i));
+                            luaC_barriert(L, h, RC(i));
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_settable(L, ra, rb, RC(i)));
+                vmbreak;
+            }
+            vmcase(OP_NEWRECORD) {
+                PROTECT(sethvalue(L, RA(i), luaH_newrecord(L, 0, GETARG_B(i))); luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_GETFIELD) {
+                StkId rb = RB(i);
+                FieldCache *c = &cl->p->fcache[pc - cl->p->code - 1];
+
+                /* Every table of the cached shape has the key in the cached field, a nil value
+                 * may still have to go through __index */
+                if (ttistable(rb)) {
+                    Table *h = hvalue(rb);
+
+                    if (h->shape != NULL && h->shape->id == c->shape &&
+                        (!ttisnil(&h->fields[c->index]) ||
+                         fasttm(L, h->metatable, TM_INDEX) == NULL)) {
+                        setobj2s(L, RA(i), &h->fields[c->index]);
+                        vmbreak;
+                    }
+
+                    /* Hash tables are looked up with the hash the key string keeps */
+                    if (h->shape == NULL) {
+                        const TValue *v = luaH_getstr(h, rawtsvalue(KC(i)));
+
+                        if (!ttisnil(v) || fasttm(L, h->metatable, TM_INDEX) == NULL) {
+                            setobj2s(L, RA(i), v);
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_getfield(L, rb, KC(i), c, RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_SETFIELD) {
+                StkId ra = RA(i);
+                FieldCache *c = &cl->p->fcache[pc - cl->p->code - 1];
+
+                if (ttistable(ra)) {
+                    Table *h = hvalue(ra);
+                    int raw = fasttm(L, h->metatable, TM_NEWINDEX) == NULL;
+
+                    /* A cached key of the shape is overwritten in place, a cached missing key is
+                     * added by moving the table to the next shape when its fields have room */
+                    if (h->shape != NULL && h->shape->id == c->shape &&
+                        (c->next == NULL ? !ttisnil(&h->fields[c->index]) || raw
+                                         : raw && c->next->nkeys <= h->sizefields)) {
+                        TValue *value = RC(i);
+
+                        if (c->next != NULL)
+                            h->shape = c->next;
+
+                        setobj2t(L, &h->fields[c->index], value);
+                        h->flags = 0;
+                        luaC_barriert(L, h, value);
+                        vmbreak;
+                    }
+
+                    /* A key a hash table already has is overwritten in its node */
+                    if (h->shape == NULL) {
+                        TValue *slot = cast(TValue *, luaH_getstr(h, rawtsvalue(K(GETARG_B(i)))));
+
+                        if (slot != luaO_nilobject && (!ttisnil(slot) || raw)) {
+                            setobj2t(L, slot, RC(i));
+                            h->flags = 0;
+                            luaC_barriert(L, h, RC(i));
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_setfield(L, ra, K(GETARG_B(i)), RC(i), c));
+                vmbreak;
+            }
+            vmcase(OP_NEWTABLE) {
+                int32_t b = GETARG_B(i);
+                int32_t c = GETARG_C(i);
+
+                PROTECT(sethvalue(L, RA(i), luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
+                        luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_SETLIST) {
+                StkId ra = RA(i);
+
+                /* Only a constructor fills the table, bytecode that was not compiled may not */
+                if (!ttistable(ra))
+                    PROTECT(luaG_typeerror(L, ra, "index"));
+
+                Table *h = hvalue(ra);
+                int32_t n = GETARG_B(i);
+                int32_t last = GETARG_C(i) * ARRAY_FIELDS_PER_FLUSH + n;
+
+                /* Constructors larger than their size hint grow the array part once per batch */
+                if (last > h->sizearray) {
+                    PROTECT(luaH_resizearray(L, h, last));
+                    ra = RA(i);
+                }
+
+                for (; n > 0; n--) {
+                    TValue *value = ra + n;
+
+                    setobj2t(L, luaH_setnum(L, h, last--), value);
+                    luaC_barriert(L, h, value);
+                }
+                vmbreak;
+            }
+            vmcase(OP_NEWARRAY) {
+                PROTECT(setarrvalue(L, RA(i), luaR_new(L, GETARG_B(i), GETARG_C(i)));
+                        luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_SETARRAYLIST) {
+                StkId ra = RA(i);
+
+                if (!ttisarray(ra))
+                    PROTECT(luaG_typeerror(L, ra, "index"));
+
+                PROTECT(luaR_setlist(L, arrvalue(ra), GETARG_C(i) * ARRAY_FIELDS_PER_FLUSH, ra + 1,
+                                     GETARG_B(i)));
+                vmbreak;
+            }
+            vmcase(OP_GETARRAY) {
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+
+                /* In bounds reads of a typed array with an integral index need no call */
+                if (ttisarray(rb) && ttisnumber(rc)) {
+                    Array *a = arrvalue(rb);
+                    lua_Number n = nvalue(rc);
+                    int index;
+
+                    lua_number2int(index, n);
+                    if (cast_num(index) == n && (unsigned int)(index - 1) < (unsigned int)a->size) {
+                        if (a->kind == ARRAY_NUMBER) {
+                            setnvalue(RA(i), a->u.n[index - 1]);
+                        } else
+                            setbvalue(RA(i), a->u.b[index - 1]);
+                        vmbreak;
+                    }
+                } else if (ttistable(rb) && ttisnumber(rc)) {
+                    /* And of the array part of tables, luappc --profile speculates on those */
+                    Table *h = hvalue(rb);
+                    lua_Number n = nvalue(rc);
+                    int index;
+
+                    lua_number2int(index, n);
+                    if (cast_num(index) == n &&
+                        (unsigned int)(index - 1) < (unsigned int)h->sizearray) {
+                        const TValue *v = &h->array[index - 1];
+
+                        if (!ttisnil(v) || fasttm(L, h->metatable, TM_INDEX) == NULL) {
+                            setobj2s(L, RA(i), v);
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_gettable(L, rb, rc, RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_SETARRAY) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+
+                /* Same for writes of a value of the element type */
+                if (ttisarray(ra) && ttisnumber(rb)) {
+                    Array *a = arrvalue(ra);
+                    lua_Number n = nvalue(rb);
+                    int index;
+
+                    lua_number2int(index, n);
+                    if (cast_num(index) == n && (unsigned int)(index - 1) < (unsigned int)a->size) {
+                        if (a->kind == ARRAY_NUMBER && ttisnumber(rc)) {
+                            a->u.n[index - 1] = nvalue(rc);
+                            vmbreak;
+                        } else if (a->kind == ARRAY_BOOLEAN && ttisboolean(rc)) {
+                            a->u.b[index - 1] = cast_byte(bvalue(rc) != 0);
+                            vmbreak;
+                        }
+                    }
+                } else if (ttistable(ra) && ttisnumber(rb)) {
+                    Table *h = hvalue(ra);
+                    lua_Number n = nvalue(rb);
+                    int index;
+
+                    lua_number2int(index, n);
+                    if (cast_num(index) == n &&
+                        (unsigned int)(index - 1) < (unsigned int)h->sizearray) {
+                        TValue *slot = &h->array[index - 1];
+
+                        if (!ttisnil(slot) || fasttm(L, h->metatable, TM_NEWINDEX) == NULL) {
+                            setobj2t(L, slot, rc);
+                            luaC_barriert(L, h, rc);
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_settable(L, ra, rb, rc));
+                vmbreak;
+            }
+            vmcase(OP_GETARRAYI) {
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+
+                /* A whole index in bounds converts exactly, NaN fails both comparisons */
+                if (ttisarray(rb)) {
+                    Array *a = arrvalue(rb);
+                    lua_Number n = nvalue(rc);
+
+                    if (luai_numle(1, n) && luai_numle(n, cast_num(a->size))) {
+                        int index = cast_int(n);
+
+                        if (a->kind == ARRAY_NUMBER) {
+                            setnvalue(RA(i), a->u.n[index - 1]);
+                        } else
+                            setbvalue(RA(i), a->u.b[index - 1]);
+                        vmbreak;
+                    }
+                }
+
+                PROTECT(luaV_gettable(L, rb, rc, RA(i)));
+                vmbreak;
+            }
+            vmcase(OP_SETARRAYI) {
+                StkId ra = RA(i);
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+
+                if (ttisarray(ra)) {
+                    Array *a = arrvalue(ra);
+                    lua_Number n = nvalue(rb);
+
+                    if (luai_numle(1, n) && luai_numle(n, cast_num(a->size))) {
+                        int index = cast_int(n);
+
+                        if (a->kind == ARRAY_NUMBER && ttisnumber(rc)) {
+                            a->u.n[index - 1] = nvalue(rc);
+                            vmbreak;
+                        } else if (a->kind == ARRAY_BOOLEAN && ttisboolean(rc)) {
+                            a->u.b[index - 1] = cast_byte(bvalue(rc) != 0);
+                            vmbreak;
+                        }
+                    }
+                }
+
+                PROTECT(luaV_settable(L, ra, rb, rc));
+                vmbreak;
+            }
+            vmcase(OP_FORPREP) {
+                StkId ra = RA(i);
+                const TValue *init = ra;
+                const TValue *plimit = ra + 1;
+                const TValue *pstep = ra + 2;
+
+                L->savedpc = pc; /* next steps may throw errors */
+                if (!tonumber(init, ra))
+                    luaG_runerror(L, LUA_QL("for") " initial value must be a number");
+                else if (!tonumber(plimit, ra + 1))
+                    luaG_runerror(L, LUA_QL("for") " limit must be a number");
+                else if (!tonumber(pstep, ra + 2))
+                    luaG_runerror(L, LUA_QL("for") " step must be a number");
+
+                setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+                pc += GETARG_D(i);
+                vmbreak;
+            }
+            vmcase(OP_FORLOOP) {
+                StkId ra = RA(i);
+                lua_Number step = nvalue(ra + 2);
+                lua_Number idx = luai_numadd(nvalue(ra), step);
+                lua_Number limit = nvalue(ra + 1);
+
+                if (luai_numlt(0, step) ? luai_numle(idx, limit) : luai_numle(limit, idx)) {
+                    pc += GETARG_D(i); /* jump back */
+                    setnvalue(ra, idx);
+                    setnvalue(ra + 3, idx);
+                    luapp_jit_count(L, cl->p);
+                    luapp_sample_check(L, pc);
+                }
+                vmbreak;
+            }
+            vmcase(OP_FORLOOPINC) {
+                /* OP_FORPREP made sure the registers hold numbers, only the limit is compared */
+                StkId ra = RA(i);
+                lua_Number idx = luai_numadd(nvalue(ra), nvalue(ra + 2));
+
+                if (luai_numle(idx, nvalue(ra + 1))) {
+                    pc += GETARG_D(i);
+                    setnvalue(ra, idx);
+                    setnvalue(ra + 3, idx);
+                    luapp_jit_count(L, cl->p);
+                    luapp_sample_check(L, pc);
+                }
+                vmbreak;
+            }
+            vmcase(OP_FORLOOPDEC) {
+                StkId ra = RA(i);
+                lua_Number idx = luai_numadd(nvalue(ra), nvalue(ra + 2));
+
+                if (luai_numle(nvalue(ra + 1), idx)) {
+                    pc += GETARG_D(i);
+                    setnvalue(ra, idx);
+                    setnvalue(ra + 3, idx);
+                    luapp_jit_count(L, cl->p);
+                    luapp_sample_check(L, pc);
+                }
+                vmbreak;
+            }
+            vmcase(OP_JMP) {
+                DO_JUMP(GETARG_E(i));
+                vmbreak;
+            }
+            vmcase(OP_EQ) {
+                StkId rb = RB(i);
+                StkId rc = RC(i);
+                int res;
+
+                PROTECT(res = equalobj(L, rb, rc));
+                BRANCH(res, GETARG_A(i));
+                vmbreak;
+            }
+            vmcase(OP_LT) {
+                COMPARE(luai_numlt, luaV_lessthan, RB(i), RC(i));
+                vmbreak;
+            }
+            vmcase(OP_LE) {
+                COMPARE(luai_numle, luaV_lessequal, RB(i), RC(i));
+                vmbreak;
+            }
+            vmcase(OP_EQK) {
+                /* Constants are numbers and strings, they are compared without metamethods */
+                BRANCH(equalobj(L, RB(i), KC(i)), GETARG_A(i));
+                vmbreak;
+            }
+            vmcase(OP_LTK) {
+                COMPARE(luai_numlt, luaV_lessthan, RB(i), KC(i));
+                vmbreak;
+            }
+            vmcase(OP_LEK) {
+                COMPARE(luai_numle, luaV_lessequal, RB(i), KC(i));
+                vmbreak;
+            }
+            vmcase(OP_GTK) {
+                COMPARE(luai_numlt, luaV_lessthan, KC(i), RB(i));
+                vmbreak;
+            }
+            vmcase(OP_GEK) {
+                COMPARE(luai_numle, luaV_lessequal, KC(i), RB(i));
+                vmbreak;
+            }
+            vmcase(OP_EQNN) {
+                COMPARENN(luai_numeq);
+                vmbreak;
+            }
+            vmcase(OP_LTNN) {
+                COMPARENN(luai_numlt);
+                vmbreak;
+            }
+            vmcase(OP_LENN) {
+                COMPARENN(luai_numle);
+                vmbreak;
+            }
+            vmcase(OP_EQNK) {
+                COMPARENK(luai_numeq, nvalue(RB(i)), nvalue(KC(i)));
+                vmbreak;
+            }
+            vmcase(OP_LTNK) {
+                COMPARENK(luai_numlt, nvalue(RB(i)), nvalue(KC(i)));
+                vmbreak;
+            }
+            vmcase(OP_LENK) {
+                COMPARENK(luai_numle, nvalue(RB(i)), nvalue(KC(i)));
+                vmbreak;
+            }
+            vmcase(OP_GTNK) {
+                COMPARENK(luai_numlt, nvalue(KC(i)), nvalue(RB(i)));
+                vmbreak;
+            }
+            vmcase(OP_GENK) {
+                COMPARENK(luai_numle, nvalue(KC(i)), nvalue(RB(i)));
+                vmbreak;
+            }
+            vmcase(OP_TEST) {
+                BRANCH(!l_isfalse(RA(i)), GETARG_C(i));
+                vmbreak;
+            }
+            vmcase(OP_APPEND) {
+                PROTECT(luaV_append(L, RA(i), RB(i)); luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_BUILDSTRING) {
+                PROTECT(luaV_buildstring(L, RA(i), RB(i)); luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_CLOSURE) {
+                Proto *p = cl->p->p[GETARG_Du(i)];
+                Closure *ncl = luaF_newLclosure(L, p->nups, cl->env);
+
+                ncl->l.p = p;
+
+                /* Every upvalue is described by a sub instruction */
+                for (int32_t j = 0; j < p->nups; j++) {
+                    const Instruction sub = *pc++;
+                    const uint32_t index = GET_CAPTURE_INDEX(sub);
+
+                    switch (GET_CAPTURE_KIND(sub)) {
+                        case CAPTURE_REFERENCE:
+                            ncl->l.upvals[j] = luaF_findupval(L, base + index);
+                            break;
+                        case CAPTURE_VALUE: {
+                            /* A closed upvalue from the start, never on the open list */
+                            UpVal *uv = luaF_newupval(L);
+                            setobj(L, uv->v, base + index);
+                            ncl->l.upvals[j] = uv;
+                            break;
+                        }
+                        default:
+                            ncl->l.upvals[j] = cl->upvals[index];
+                            break;
+                    }
+                }
+
+                setclvalue(L, RA(i), ncl);
+                PROTECT(luaC_checkGC(L));
+                vmbreak;
+            }
+            vmcase(OP_CLOSE) {
+                luaF_close(L, RA(i));
+                vmbreak;
+            }
+            vmcase(OP_RETURN) {
+                StkId ra = RA(i);
+                int32_t b = GETARG_B(i);
+
+                if (b != 0)
+                    L->top = ra + b - 1;
+                if (L->openupval)
+                    luaF_close(L, base);
+
+                L->savedpc = pc;
+                b = luaD_poscall(L, ra);
+
+                if (--nexeccalls == 0) /* was it called again by luapp_execute? */
+                    goto exit;
+
+                /* continue the caller */
+                if (b)
+                    L->top = L->ci->top;
+                lua_assert(isLua(L->ci));
+                goto reentry;
+            }
+            vmcase(OP_GETGLOBAL)
+            vmcase(OP_SELF)
+            vmcase(OP_TESTSET)
+            vmcase(OP_TFORLOOP)
+            vmdefault {
+                /* Opcodes the VM does not implement yet are skipped */
+                vmbreak;
+            }
         }
     }
 /* exit point */
 exit:
+    vmleave();
 }
\ No newline at end of file
@@ -0,0 +1,895 @@
+#define LUA_CORE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../common/opcodes.h"
+
+#include "lua/ldebug.h"
+#include "lua/ldo.h"
+#include "lua/lfunc.h"
+#include "lua/lgc.h"
+#include "lua/ltm.h"
+#include "lua/lvm.h"
+
+#include "jit.h"
+
+/* The templates read and write the tags of stock 16-byte values */
+#if (defined(__x86_64__) || defined(__aarch64__)) && (defined(__linux__) || defined(__unix__)) &&  \
+    !defined(LUA_NANBOX)
+#define LUAPP_JIT 1
+#include <sys/mman.h>
+#else
+#define LUAPP_JIT 0
+#endif
+
+int luapp_jit_threshold = 0;
+
+/* luapp_jit_enable() -- makes the protos loaded from now on compile once they ran `threshold'
+ * times (calls and loop iterations)
+ *      args: threshold, 0 turns the JIT off again
+ *      rets: 0 on success, -1 if this platform has no JIT
+ */
+int luapp_jit_enable(int threshold)
+{
+    if (!LUAPP_JIT && threshold > 0)
+        return -1;
+
+    luapp_jit_threshold = threshold > 0 ? threshold : 0;
+    return 0;
+}
+
+#if LUAPP_JIT
+
+/*
+ * Helpers, one per template. Each gets the address of its instruction, reads the frame from the
+ * state (a call may have moved the stack) and returns whether the instruction jumps.
+ */
+
+#define JIT_CLOSURE(L) (&clvalue((L)->ci->func)->l)
+#define JIT_RA(L, i) ((L)->base + GETARG_A(i))
+#define JIT_SAVEPC(L, pc) ((L)->savedpc = (pc) + 1)
+
+static int jit_move(lua_State *L, const Instruction *pc)
+{
+    setobjs2s(L, JIT_RA(L, *pc), L->base + GETARG_B(*pc));
+    return 0;
+}
+
+static int jit_loadk(lua_State *L, const Instruction *pc)
+{
+    uint32_t index = GET_OPCODE(*pc) == OP_LOADKX ? pc[1] : GETARG_Du(*pc);
+
+    setobj2s(L, JIT_RA(L, *pc), &JIT_CLOSURE(L)->p->k[index]);
+    return 0;
+}
+
+static int jit_loadn(lua_State *L, const Instruction *pc)
+{
+    lua_Number n = GETARG_Du(*pc);
+
+    setnvalue(JIT_RA(L, *pc), GET_OPCODE(*pc) == OP_LOADNN ? -n : n);
+    return 0;
+}
+
+static int jit_loadbool(lua_State *L, const Instruction *pc)
+{
+    setbvalue(JIT_RA(L, *pc), GETARG_B(*pc));
+    return GETARG_C(*pc) != 0;
+}
+
+static int jit_loadnil(lua_State *L, const Instruction *pc)
+{
+    for (StkId ra = JIT_RA(L, *pc), rb = L->base + GETARG_B(*pc); ra <= rb; ra++)
+        setnilvalue(ra);
+    return 0;
+}
+
+static int jit_getupval(lua_State *L, const Instruction *pc)
+{
+    setobj2s(L, JIT_RA(L, *pc), JIT_CLOSURE(L)->upvals[GETARG_B(*pc)]->v);
+    return 0;
+}
+
+static int jit_arith(lua_State *L, const Instruction *pc)
+{
+    Instruction i = *pc;
+    enum opcode op = GET_OPCODE(i);
+    TValue *k = JIT_CLOSURE(L)->p->k;
+    StkId ra = JIT_RA(L, i);
+    const TValue *rb = L->base + GETARG_B(i), *rc;
+    int event;
+
+    /* The families have their operations in the order of the events */
+    if (op >= OP_ADD && op <= OP_POW) {
+        event = op - OP_ADD;
+        rc = L->base + GETARG_C(i);
+    } else if (op >= OP_ADDK && op <= OP_POWK) {
+        event = op - OP_ADDK;
+        rc = k + GETARG_C(i);
+    } else if (op >= OP_ADDNN && op <= OP_POWNN) {
+        event = op - OP_ADDNN;
+        rc = L->base + GETARG_C(i);
+    } else {
+        event = op - OP_ADDNK;
+        rc = k + GETARG_C(i);
+    }
+
+    if (ttisnumber(rb) && ttisnumber(rc)) {
+        lua_Number nb = nvalue(rb), nc = nvalue(rc);
+
+        switch (event + TM_ADD) {
+            case TM_ADD:
+                setnvalue(ra, luai_numadd(nb, nc));
+                break;
+            case TM_SUB:
+                setnvalue(ra, luai_numsub(nb, nc));
+                break;
+            case TM_MUL:
+                setnvalue(ra, luai_nummul(nb, nc));
+                break;
+            case TM_DIV:
+                setnvalue(ra, luai_numdiv(nb, nc));
+                break;
+            case TM_MOD:
+                setnvalue(ra, luai_nummod(nb, nc));
+                break;
+            default:
+                setnvalue(ra, luai_numpow(nb, nc));
+                break;
+        }
+    } else {
+        JIT_SAVEPC(L, pc);
+        luaV_arith(L, ra, rb, rc, (TMS)(event + TM_ADD));
+    }
+
+    return 0;
+}
+
+/* Reads a global through the inline cache of its constant */
+static void jit_global(lua_State *L, const Instruction *pc, int index, StkId ra)
+{
+    LClosure *cl = JIT_CLOSURE(L);
+    GlobalCache *c = &cl->p->gcache[index];
+    Table *env = cl->env;
+
+    if (c->table == env && c->stamp == env->stamp && !ttisnil(c->slot)) {
+        setobj2s(L, ra, c->slot);
+    } else {
+        JIT_SAVEPC(L, pc);
+        luaV_getenv(L, env, &cl->p->k[index], c, ra);
+    }
+}
+
+static int jit_getenv(lua_State *L, const Instruction *pc)
+{
+    jit_global(L, pc, GETARG_D(*pc), JIT_RA(L, *pc));
+    return 0;
+}
+
+static int jit_callenvk(lua_State *L, const Instruction *pc)
+{
+    jit_global(L, pc, GETARG_B(*pc), JIT_RA(L, *pc));
+
+    StkId ra = JIT_RA(L, *pc);
+
+    setobj2s(L, ra + 1, &JIT_CLOSURE(L)->p->k[GETARG_C(*pc)]);
+    L->top = ra + 2;
+    JIT_SAVEPC(L, pc);
+    luaD_call(L, ra, 0);
+    L->top = L->ci->top;
+    return 0;
+}
+
+static int jit_concat(lua_State *L, const Instruction *pc)
+{
+    int b = GETARG_B(*pc), c = GETARG_C(*pc);
+
+    JIT_SAVEPC(L, pc);
+    luaV_concat(L, c - b + 1, c);
+    luaC_checkGC(L);
+    setobjs2s(L, JIT_RA(L, *pc), L->base + b);
+    return 0;
+}
+
+/* Calls nest luaD_call. Tail calls have no template: nesting them would grow the C stack with
+ * every call of a tail recursion, which the interpreter runs in a single frame. */
+static int jit_call(lua_State *L, const Instruction *pc)
+{
+    StkId ra = JIT_RA(L, *pc);
+    int b = GETARG_B(*pc);
+    int nresults = GETARG_C(*pc) - 1;
+
+    if (b != 0)
+        L->top = ra + b;
+
+    JIT_SAVEPC(L, pc);
+    luaD_call(L, ra, nresults);
+
+    if (nresults >= 0)
+        L->top = L->ci->top;
+    return 0;
+}
+
+static int jit_return(lua_State *L, const Instruction *pc)
+{
+    StkId ra = JIT_RA(L, *pc);
+    int b = GETARG_B(*pc);
+
+    if (b != 0)
+        L->top = ra + b - 1;
+    if (L->openupval)
+        luaF_close(L, L->base);
+
+    JIT_SAVEPC(L, pc);
+    luaD_poscall(L, ra);
+    return 0;
+}
+
+static int jit_forprep(lua_State *L, const Instruction *pc)
+{
+    StkId ra = JIT_RA(L, *pc);
+    const TValue *init = ra, *plimit = ra + 1, *pstep = ra + 2;
+
+    JIT_SAVEPC(L, pc);
+    if (!tonumber(init, ra))
+        luaG_runerror(L, LUA_QL("for") " initial value must be a number");
+    else if (!tonumber(plimit, ra + 1))
+        luaG_runerror(L, LUA_QL("for") " limit must be a number");
+    else if (!tonumber(pstep, ra + 2))
+        luaG_runerror(L, LUA_QL("for") " step must be a number");
+
+    setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+    return 1;
+}
+
+static int jit_forloop(lua_State *L, const Instruction *pc)
+{
+    StkId ra = JIT_RA(L, *pc);
+    enum opcode op = GET_OPCODE(*pc);
+    lua_Number step = nvalue(ra + 2);
+    lua_Number idx = luai_numadd(nvalue(ra), step);
+    lua_Number limit = nvalue(ra + 1);
+    int up = op == OP_FORLOOP ? luai_numlt(0, step) : op == OP_FORLOOPINC;
+
+    if (!(up ? luai_numle(idx, limit) : luai_numle(limit, idx)))
+        return 0;
+
+    setnvalue(ra, idx);
+    setnvalue(ra + 3, idx);
+    return 1;
+}
+
+/* Conditional branches return whether they take the OP_JMP that follows them */
+static int jit_branch(lua_State *L, const Instruction *pc)
+{
+    Instruction i = *pc;
+    enum opcode op = GET_OPCODE(i);
+    TValue *k = JIT_CLOSURE(L)->p->k;
+    const TValue *rb = L->base + GETARG_B(i);
+    const TValue *rc = op >= OP_EQK && op != OP_EQNN && op != OP_LTNN && op != OP_LENN
+                           ? k + GETARG_C(i)
+                           : L->base + GETARG_C(i);
+    int res;
+
+    JIT_SAVEPC(L, pc);
+
+    switch (op) {
+        case OP_TEST:
+            return l_isfalse(JIT_RA(L, i)) != GETARG_C(i);
+        case OP_EQ:
+        case OP_EQK:
+        case OP_EQNN:
+        case OP_EQNK:
+            res = equalobj(L, rb, rc);
+            break;
+        case OP_LT:
+        case OP_LTK:
+        case OP_LTNN:
+        case OP_LTNK:
+            res = luaV_lessthan(L, rb, rc);
+            break;
+        case OP_LE:
+        case OP_LEK:
+        case OP_LENN:
+        case OP_LENK:
+            res = luaV_lessequal(L, rb, rc);
+            break;
+        case OP_GTK:
+        case OP_GTNK:
+            res = luaV_lessthan(L, rc, rb);
+            break;
+        default:
+            res = luaV_lessequal(L, rc, rb);
+            break;
+    }
+
+    return res == GETARG_A(i);
+}
+
+typedef int (*jit_helper_t)(lua_State *L, const Instruction *pc);
+
+/* jit_template() -- finds the helper of an instruction
+ *      args: opcode
+ *      rets: helper or NULL if the JIT has no template for the opcode
+ */
+static jit_helper_t jit_template(enum opcode op)
+{
+    if ((op >= OP_ADD && op <= OP_POW) || (op >= OP_ADDK && op <= OP_POWK) ||
+        (op >= OP_ADDNN && op <= OP_POWNK))
+        return jit_arith;
+
+    switch (op) {
+        case OP_MOVE:
+            return jit_move;
+        case OP_LOADK:
+        case OP_LOADKX:
+            return jit_loadk;
+        case OP_LOADPN:
+        case OP_LOADNN:
+            return jit_loadn;
+        case OP_LOADBOOL:
+            return jit_loadbool;
+        case OP_LOADNIL:
+            return jit_loadnil;
+        case OP_GETUPVAL:
+            return jit_getupval;
+        case OP_GETENV:
+            return jit_getenv;
+        case OP_CALLENVK:
+            return jit_callenvk;
+        case OP_CONCAT:
+            return jit_concat;
+        case OP_CALL:
+        case OP_CALLDIRECT:
+            return jit_call;
+        case OP_RETURN:
+            return jit_return;
+        case OP_FORPREP:
+            return jit_forprep;
+        case OP_FORLOOP:
+        case OP_FORLOOPINC:
+        case OP_FORLOOPDEC:
+            return jit_forloop;
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        case OP_TEST:
+        case OP_EQK ... OP_GENK:
+            return jit_branch;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Emitter. The code is assembled into a growable buffer first, jumps between instructions are
+ * patched once every instruction has its offset and the result is copied to executable pages.
+ */
+
+/* Initial size of the buffer the code is assembled into */
+#define JIT_BUFFER_SIZE 1024
+
+struct jit_fixup {
+    size_t at;  /* Offset of the branch */
+    int target; /* Instruction it jumps to */
+};
+
+struct jit_state {
+    const Proto *p;
+    uint8_t *code;
+    size_t size, space;
+    size_t *labels; /* Offset of every instruction, labels[sizecode] is the end */
+    struct jit_fixup *fixups;
+    int nfixups, sizefixups;
+    int failed; /* Memory ran out */
+};
+
+static void jit_emit(struct jit_state *J, const void *bytes, size_t size)
+{
+    if (J->size + size > J->space) {
+        size_t space = J->space ? J->space * 2 : JIT_BUFFER_SIZE;
+        uint8_t *grown;
+
+        while (space < J->size + size)
+            space *= 2;
+
+        if (J->failed || !(grown = realloc(J->code, space))) {
+            J->failed = 1;
+            return;
+        }
+
+        J->code = grown;
+        J->space = space;
+    }
+
+    memcpy(J->code + J->size, bytes, size);
+    J->size += size;
+}
+
+static void jit_emit_u32(struct jit_state *J, uint32_t value)
+{
+    jit_emit(J, &value, sizeof(value));
+}
+
+static void jit_emit_u64(struct jit_state *J, uint64_t value)
+{
+    jit_emit(J, &value, sizeof(value));
+}
+
+/* Remembers a branch to an instruction, its offset gets patched by jit_patch */
+static void jit_fixup(struct jit_state *J, size_t at, int target)
+{
+    if (J->nfixups == J->sizefixups) {
+        int size = J->sizefixups ? J->sizefixups * 2 : 16;
+        struct jit_fixup *grown = realloc(J->fixups, size * sizeof(struct jit_fixup));
+
+        if (grown == NULL) {
+            J->failed = 1;
+            return;
+        }
+
+        J->fixups = grown;
+        J->sizefixups = size;
+    }
+
+    J->fixups[J->nfixups].at = at;
+    J->fixups[J->nfixups++].target = target;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * x86-64: rbx holds the state and r12 the base of the frame, reloaded after every call. The
+ * registers are addressed as [r12 + disp32].
+ */
+
+#define X86_SLOT(r) ((uint32_t)((r) * sizeof(TValue)))
+#define X86_TAG(r) (X86_SLOT(r) + (uint32_t)offsetof(TValue, tt))
+
+/* Emits an instruction with a [r12 + disp32] operand, `reg' goes into the ModRM byte */
+static void x86_r12(struct jit_state *J, const uint8_t *opcode, size_t size, int reg, uint32_t disp)
+{
+    uint8_t modrm[2] = {(uint8_t)(0x84 | (reg << 3)), 0x24};
+
+    jit_emit(J, opcode, size);
+    jit_emit(J, modrm, sizeof(modrm));
+    jit_emit_u32(J, disp);
+}
+
+static void x86_reload_base(struct jit_state *J)
+{
+    static const uint8_t mov[] = {0x4c, 0x8b, 0xa3}; /* mov r12, [rbx + disp32] */
+
+    jit_emit(J, mov, sizeof(mov));
+    jit_emit_u32(J, (uint32_t)offsetof(lua_State, base));
+}
+
+static void jit_prologue(struct jit_state *J)
+{
+    /* push rbx; push r12; push r13 (keeps the stack aligned); mov rbx, rdi */
+    static const uint8_t prologue[] = {0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xfb};
+
+    jit_emit(J, prologue, sizeof(prologue));
+    x86_reload_base(J);
+}
+
+static void jit_epilogue(struct jit_state *J)
+{
+    static const uint8_t epilogue[] = {0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3};
+
+    jit_emit(J, epilogue, sizeof(epilogue));
+}
+
+static void jit_call_helper(struct jit_state *J, jit_helper_t helper, const Instruction *pc)
+{
+    static const uint8_t mov_rdi[] = {0x48, 0x89, 0xdf}, mov_rsi[] = {0x48, 0xbe};
+    static const uint8_t mov_rax[] = {0x48, 0xb8}, call_rax[] = {0xff, 0xd0};
+
+    jit_emit(J, mov_rdi, sizeof(mov_rdi));
+    jit_emit(J, mov_rsi, sizeof(mov_rsi));
+    jit_emit_u64(J, (uint64_t)(uintptr_t)pc);
+    jit_emit(J, mov_rax, sizeof(mov_rax));
+    jit_emit_u64(J, (uint64_t)(uintptr_t)helper);
+    jit_emit(J, call_rax, sizeof(call_rax));
+    x86_reload_base(J);
+}
+
+/* Emits a jump with a 32 bit displacement, `opcode' is 0xe9 or 0x0f 0x8x */
+static size_t x86_jump(struct jit_state *J, const uint8_t *opcode, size_t size)
+{
+    jit_emit(J, opcode, size);
+    jit_emit_u32(J, 0);
+    return J->size - 4;
+}
+
+/* Points the displacement of a jump emitted by x86_jump to an offset */
+static void x86_land(struct jit_state *J, size_t at, size_t offset)
+{
+    if (!J->failed) {
+        int32_t rel = (int32_t)(offset - (at + 4));
+        memcpy(J->code + at, &rel, sizeof(rel));
+    }
+}
+
+static const uint8_t x86_jmp[] = {0xe9}, x86_jne[] = {0x0f, 0x85}, x86_jb[] = {0x0f, 0x82};
+
+static void jit_jump(struct jit_state *J, int target)
+{
+    jit_fixup(J, x86_jump(J, x86_jmp, sizeof(x86_jmp)), target);
+}
+
+static void jit_jump_if(struct jit_state *J, int target)
+{
+    static const uint8_t test[] = {0x85, 0xc0}; /* test eax, eax */
+
+    jit_emit(J, test, sizeof(test));
+    jit_fixup(J, x86_jump(J, x86_jne, sizeof(x86_jne)), target);
+}
+
+static void jit_patch(struct jit_state *J)
+{
+    for (int i = 0; i < J->nfixups; i++)
+        x86_land(J, J->fixups[i].at, J->labels[J->fixups[i].target]);
+}
+
+/* Stores a number (its bits in rax, or xmm0) into a register and tags it */
+static void x86_setn(struct jit_state *J, int r, int from_xmm)
+{
+    static const uint8_t mov_rax[] = {0x49, 0x89}, movsd[] = {0xf2, 0x41, 0x0f, 0x11};
+    static const uint8_t movl[] = {0x41, 0xc7};
+
+    if (from_xmm)
+        x86_r12(J, movsd, sizeof(movsd), 0, X86_SLOT(r));
+    else
+        x86_r12(J, mov_rax, sizeof(mov_rax), 0, X86_SLOT(r));
+
+    x86_r12(J, movl, sizeof(movl), 0, X86_TAG(r));
+    jit_emit_u32(J, LUA_TNUMBER);
+}
+
+static void x86_loadn(struct jit_state *J, int r, lua_Number n)
+{
+    static const uint8_t mov_rax[] = {0x48, 0xb8};
+    uint64_t bits;
+
+    memcpy(&bits, &n, sizeof(bits));
+    jit_emit(J, mov_rax, sizeof(mov_rax));
+    jit_emit_u64(J, bits);
+    x86_setn(J, r, 0);
+}
+
+/* Jumps to the returned displacement unless a register holds a number */
+static size_t x86_check_number(struct jit_state *J, int r)
+{
+    static const uint8_t cmpl[] = {0x41, 0x81};
+
+    x86_r12(J, cmpl, sizeof(cmpl), 7, X86_TAG(r));
+    jit_emit_u32(J, LUA_TNUMBER);
+    return x86_jump(J, x86_jne, sizeof(x86_jne));
+}
+
+/* jit_inline() -- emits the instructions x86-64 runs without a helper call
+ *      args: state, instruction, its position
+ *      rets: whether the instruction was emitted
+ */
+static int jit_inline(struct jit_state *J, const Instruction *pc, int index)
+{
+    /* addsd, subsd, mulsd and divsd, indexed by the event */
+    static const uint8_t sse[] = {0x58, 0x5c, 0x59, 0x5e};
+    Instruction i = *pc;
+    enum opcode op = GET_OPCODE(i);
+    int a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i);
+    const TValue *k = J->p->k;
+
+    switch (op) {
+        case OP_LOADPN:
+        case OP_LOADNN:
+            x86_loadn(J, a, op == OP_LOADNN ? -(lua_Number)GETARG_Du(i) : GETARG_Du(i));
+            return 1;
+        case OP_LOADK:
+        case OP_LOADKX: {
+            const TValue *kx = &k[op == OP_LOADK ? GETARG_Du(i) : pc[1]];
+
+            if (!ttisnumber(kx))
+                return 0;
+
+            x86_loadn(J, a, nvalue(kx));
+            return 1;
+        }
+        case OP_MOVE: {
+            static const uint8_t load[] = {0x41, 0x0f, 0x10}, store[] = {0x41, 0x0f, 0x11};
+
+            if (sizeof(TValue) != 16)
+                return 0;
+
+            /* movups xmm0, [rb]; movups [ra], xmm0 */
+            x86_r12(J, load, sizeof(load), 0, X86_SLOT(b));
+            x86_r12(J, store, sizeof(store), 0, X86_SLOT(a));
+            return 1;
+        }
+        case OP_FORLOOPINC:
+        case OP_FORLOOPDEC: {
+            static const uint8_t movsd[] = {0xf2, 0x41, 0x0f, 0x10};
+            static const uint8_t addsd[] = {0xf2, 0x41, 0x0f, 0x58};
+            static const uint8_t ucomisd_inc[] = {0x66, 0x0f, 0x2e, 0xc8}; /* limit, idx */
+            static const uint8_t ucomisd_dec[] = {0x66, 0x0f, 0x2e, 0xc1}; /* idx, limit */
+
+            x86_r12(J, movsd, sizeof(movsd), 0, X86_SLOT(a));
+            x86_r12(J, addsd, sizeof(addsd), 0, X86_SLOT(a + 2));
+            x86_r12(J, movsd, sizeof(movsd), 1, X86_SLOT(a + 1));
+
+            /* Below (or unordered, a NaN never continues the loop) leaves it */
+            if (op == OP_FORLOOPINC)
+                jit_emit(J, ucomisd_inc, sizeof(ucomisd_inc));
+            else
+                jit_emit(J, ucomisd_dec, sizeof(ucomisd_dec));
+            size_t exit = x86_jump(J, x86_jb, sizeof(x86_jb));
+
+            x86_setn(J, a, 1);
+            x86_setn(J, a + 3, 1);
+            jit_jump(J, index + 1 + GETARG_D(i));
+            x86_land(J, exit, J->size);
+            return 1;
+        }
+        default:
+            break;
+    }
+
+    /* Additions, subtractions, multiplications and divisions, the others call jit_arith */
+    int event, checks = 1;
+    const TValue *kc = NULL;
+
+    if (op >= OP_ADD && op <= OP_DIV)
+        event = op - OP_ADD, checks = 2;
+    else if (op >= OP_ADDK && op <= OP_DIVK)
+        event = op - OP_ADDK, kc = &k[c];
+    else if (op >= OP_ADDNN && op <= OP_DIVNN)
+        event = op - OP_ADDNN, checks = 0;
+    else if (op >= OP_ADDNK && op <= OP_DIVNK)
+        event = op - OP_ADDNK, kc = &k[c], checks = 0;
+    else
+        return 0;
+
+    if (kc != NULL && !ttisnumber(kc))
+        return 0;
+
+    static const uint8_t movsd[] = {0xf2, 0x41, 0x0f, 0x10};
+    uint8_t op_mem[] = {0xf2, 0x41, 0x0f, sse[event]};
+    size_t slow[2];
+
+    for (int j = 0; j < checks; j++)
+        slow[j] = x86_check_number(J, j == 0 ? b : c);
+
+    x86_r12(J, movsd, sizeof(movsd), 0, X86_SLOT(b));
+
+    if (kc != NULL) {
+        /* mov rax, imm64; movq xmm1, rax; op xmm0, xmm1 */
+        static const uint8_t mov_rax[] = {0x48, 0xb8}, movq[] = {0x66, 0x48, 0x0f, 0x6e, 0xc8};
+        uint8_t op_reg[] = {0xf2, 0x0f, sse[event], 0xc1};
+        lua_Number n = nvalue(kc);
+        uint64_t bits;
+
+        memcpy(&bits, &n, sizeof(bits));
+        jit_emit(J, mov_rax, sizeof(mov_rax));
+        jit_emit_u64(J, bits);
+        jit_emit(J, movq, sizeof(movq));
+        jit_emit(J, op_reg, sizeof(op_reg));
+    } else
+        x86_r12(J, op_mem, sizeof(op_mem), 0, X86_SLOT(c));
+
+    x86_setn(J, a, 1);
+
+    if (checks > 0) {
+        size_t done = x86_jump(J, x86_jmp, sizeof(x86_jmp));
+
+        for (int j = 0; j < checks; j++)
+            x86_land(J, slow[j], J->size);
+
+        jit_call_helper(J, jit_arith, pc);
+        x86_land(J, done, J->size);
+    }
+
+    return 1;
+}
+
+#else
+
+/*
+ * AArch64: x19 holds the state, everything goes through the helpers. Addresses are built with
+ * movz/movk, the helper is called through x16.
+ */
+
+static void a64_mov64(struct jit_state *J, int reg, uint64_t value)
+{
+    jit_emit_u32(J, 0xd2800000u | (uint32_t)(value & 0xffff) << 5 | reg); /* movz */
+
+    for (int hw = 1; hw < 4; hw++) /* movk */
+        jit_emit_u32(J, 0xf2800000u | (uint32_t)hw << 21 |
+                            (uint32_t)((value >> (hw * 16)) & 0xffff) << 5 | reg);
+}
+
+static void jit_prologue(struct jit_state *J)
+{
+    jit_emit_u32(J, 0xa9be7bfdu); /* stp x29, x30, [sp, #-32]! */
+    jit_emit_u32(J, 0x910003fdu); /* mov x29, sp */
+    jit_emit_u32(J, 0xa90153f3u); /* stp x19, x20, [sp, #16] */
+    jit_emit_u32(J, 0xaa0003f3u); /* mov x19, x0 */
+}
+
+static void jit_epilogue(struct jit_state *J)
+{
+    jit_emit_u32(J, 0xa94153f3u); /* ldp x19, x20, [sp, #16] */
+    jit_emit_u32(J, 0xa8c27bfdu); /* ldp x29, x30, [sp], #32 */
+    jit_emit_u32(J, 0xd65f03c0u); /* ret */
+}
+
+static void jit_call_helper(struct jit_state *J, jit_helper_t helper, const Instruction *pc)
+{
+    jit_emit_u32(J, 0xaa1303e0u); /* mov x0, x19 */
+    a64_mov64(J, 1, (uint64_t)(uintptr_t)pc);
+    a64_mov64(J, 16, (uint64_t)(uintptr_t)helper);
+    jit_emit_u32(J, 0xd63f0200u); /* blr x16 */
+}
+
+static void jit_jump(struct jit_state *J, int target)
+{
+    jit_fixup(J, J->size, target);
+    jit_emit_u32(J, 0x14000000u); /* b */
+}
+
+static void jit_jump_if(struct jit_state *J, int target)
+{
+    jit_fixup(J, J->size, target);
+    jit_emit_u32(J, 0x35000000u); /* cbnz w0 */
+}
+
+static void jit_patch(struct jit_state *J)
+{
+    for (int i = 0; i < J->nfixups && !J->failed; i++) {
+        uint32_t instruction;
+        size_t at = J->fixups[i].at;
+        int32_t words = (int32_t)(J->labels[J->fixups[i].target] - at) / 4;
+
+        memcpy(&instruction, J->code + at, sizeof(instruction));
+        if (instruction == 0x14000000u)
+            instruction |= (uint32_t)words & 0x3ffffff;
+        else
+            instruction |= ((uint32_t)words & 0x7ffff) << 5;
+        memcpy(J->code + at, &instruction, sizeof(instruction));
+    }
+}
+
+static int jit_inline(struct jit_state *J, const Instruction *pc, int index)
+{
+    (void)J, (void)pc, (void)index;
+    return 0;
+}
+
+#endif
+
+/* jit_supported() -- checks whether every instruction of a proto has a template
+ *      args: proto
+ *      rets: whether it can be compiled
+ */
+static int jit_supported(const Proto *p)
+{
+    /* There is no template for the vararg prologue. That includes the main chunk, which runs a
+     * single time and so would never enter its compiled code anyway. */
+    if (p->is_vararg)
+        return 0;
+
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        enum opcode op = GET_OPCODE(p->code[pc]);
+
+        /* Jumps are emitted without a helper */
+        if (op != OP_JMP && jit_template(op) == NULL)
+            return 0;
+        if (op == OP_LOADKX) /* skip the index */
+            pc++;
+    }
+
+    return 1;
+}
+
+/* luapp_jit_compile() -- compiles a hot proto, it runs natively from its next call on
+ *      args: state, proto
+ *      rets: none, protos that can not be compiled stay interpreted
+ */
+void luapp_jit_compile(lua_State *L, Proto *p)
+{
+    struct jit_state J = {p, NULL, 0, 0, NULL, NULL, 0, 0, 0};
+    (void)L;
+
+    if (p->native != NULL || !jit_supported(p))
+        return;
+
+    J.labels = malloc((p->sizecode + 1) * sizeof(size_t));
+    if (J.labels == NULL)
+        return;
+
+    jit_prologue(&J);
+
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        const Instruction *i = &p->code[pc];
+        enum opcode op = GET_OPCODE(*i);
+
+        J.labels[pc] = J.size;
+
+        if (op == OP_JMP)
+            jit_jump(&J, pc + 1 + GETARG_E(*i));
+        else if (jit_template(op) == jit_branch) {
+            /* The branch takes the jump after it, or goes on past it */
+            jit_call_helper(&J, jit_branch, i);
+            jit_jump_if(&J, pc + 2 + GETARG_E(i[1]));
+            J.labels[++pc] = J.size;
+        } else if (!jit_inline(&J, i, pc)) {
+            /* Unoptimized code may continue after the final OP_RETURN, keep its jumps valid */
+            jit_call_helper(&J, jit_template(op), i);
+
+            if (op == OP_RETURN)
+                jit_epilogue(&J);
+            else if (op == OP_FORPREP)
+                jit_jump(&J, pc + 1 + GETARG_D(*i));
+            else if (op == OP_FORLOOP || op == OP_FORLOOPINC || op == OP_FORLOOPDEC)
+                jit_jump_if(&J, pc + 1 + GETARG_D(*i));
+            else if (op == OP_LOADBOOL && GETARG_C(*i))
+                jit_jump_if(&J, pc + 2 <= p->sizecode ? pc + 2 : p->sizecode);
+        }
+
+        if (op == OP_LOADKX)
+            J.labels[++pc] = J.size;
+    }
+
+    /* Falling off the end returns nothing, like an OP_RETURN A 1 */
+    J.labels[p->sizecode] = J.size;
+    jit_epilogue(&J);
+    jit_patch(&J);
+
+    size_t size = J.size;
+    void *mcode = J.failed ? MAP_FAILED
+                           : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1, 0);
+
+    if (mcode != MAP_FAILED) {
+        memcpy(mcode, J.code, size);
+        __builtin___clear_cache((char *)mcode, (char *)mcode + size);
+
+        if (mprotect(mcode, size, PROT_READ | PROT_EXEC) == 0) {
+            p->mcode = mcode;
+            p->sizemcode = size;
+            p->native = (void (*)(lua_State *))mcode;
+        } else
+            munmap(mcode, size);
+    }
+
+    free(J.code);
+    free(J.labels);
+    free(J.fixups);
+}
+
+/* luapp_jit_free() -- releases the machine code of a proto
+ *      args: proto
+ *      rets: none
+ */
+void luapp_jit_free(Proto *p)
+{
+    munmap(p->mcode, p->sizemcode);
+    p->mcode = NULL;
+    p->native = NULL;
+}
+
+#else
+
+void luapp_jit_compile(lua_State *L, Proto *p)
+{
+    (void)L, (void)p;
+}
+
+void luapp_jit_free(Proto *p)
+{
+    (void)p;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*  jit.h - only version
+ *      baseline template JIT for hot protos (x86-64 and AArch64)
+ *
+ *  Off unless luapp_jit_enable() (luappvm -J threshold) was called before a program is loaded.
+ *  Every proto loaded from then on counts its calls and the backward jumps of its loops in
+ *  Proto.hotcount, the proto is compiled once the count reaches the threshold and its next calls
+ *  run the machine code through Proto.native, like a module translated ahead of time (aot.h).
+ *  Loops already running stay in the interpreter, there is no on-stack replacement.
+ *
+ *  The code calls one helper per instruction with the state and the address of the instruction
+ *  (subroutine threading), on x86-64 the loads, the arithmetic on numbers and the numeric for
+ *  loops are emitted inline instead. Protos with an opcode outside of the templates (or with
+ *  varargs) keep being interpreted. Compiled frames are C frames with the limits of aot.h.
+ */
+
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+
+/* Threshold of the protos loaded from now on, 0 (the default) turns the JIT off */
+extern int luapp_jit_threshold;
+
+int luapp_jit_enable(int threshold);
+void luapp_jit_compile(lua_State *L, Proto *p);
+void luapp_jit_free(Proto *p);
+
+/* Counts a call or an iteration of a proto, compiling it when it became hot */
+#define luapp_jit_count(L, p)                                                                      \
+    {                                                                                              \
+        if ((p)->hotcount > 0 && --(p)->hotcount == 0)                                             \
+            luapp_jit_compile(L, p);                                                               \
+    }
+
+#endif
@@ -0,0 +1,36 @@
+/*  jumptab.h - only version
+ *      dispatch table used by luapp_execute when computed gotos are enabled
+ *
+ *  Every slot of the table is keyed by `enum opcode` from common/opcodes.h. The slots are written
+ *  to jumptab.inc by the Makefile, one for every opcode of the enum, so an opcode without a
+ *  vmcase() in luapp_execute does not build. Opcodes that the VM does not implement yet have their
+ *  vmcase() in front of vmdefault, which mirrors the behaviour of the portable switch (the
+ *  instruction is simply skipped). No slot can reach vmdefault itself, so it is no label here.
+ */
+
+#ifndef _JUMPTAB_H
+#define _JUMPTAB_H
+
+#undef vmdispatch
+#undef vmcase
+#undef vmbreak
+#undef vmdefault
+
+#define vmdispatch(o) goto *disptab[o];
+#define vmcase(l) L_##l:
+#define vmdefault
+#define vmbreak                                                                                    \
+    {                                                                                              \
+        vmfetch();                                                                                 \
+        vmdispatch(GET_OPCODE(i));                                                                 \
+    }
+
+/* One slot per opcode, generated from `enum opcode` by the Makefile */
+static const void *const disptab[] = {
+#include "jumptab.inc"
+};
+
+_Static_assert(sizeof(disptab) / sizeof(disptab[0]) == NUM_OPCODES,
+               "jumptab.inc is out of date, rebuild it from common/opcodes.h");
+
+#endif
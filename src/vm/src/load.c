@@ -1,29 +1,155 @@
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../../common/bytecode.h"
+#include "../../common/opcodes.h"
 
 #include "lua/ldebug.h"
 #include "lua/lfunc.h"
+#include "lua/lgc.h"
 #include "lua/lstate.h"
 #include "lua/lstring.h"
 #include "lua/luaconf.h"
 #include "lua/lvm.h"
+#include "lua/lzio.h"
 
-/* Use global offset as we will need for Lua functions (luaS_newlstr) */
-static size_t offset = 0;
+#include "alloc.h"
+#include "aot.h"
+#include "jit.h"
+#include "load.h"
+#include "pool.h"
 
+/* Files are mapped into memory whenever the platform supports it. Build with -DLUAPP_USE_MMAP=0 to
+ * always read them through the buffered FILE* path. */
+#if !defined(LUAPP_USE_MMAP)
+#if defined(LUA_USE_POSIX)
+#define LUAPP_USE_MMAP 1
+#else
+#define LUAPP_USE_MMAP 0
+#endif
+#endif
+
+#if LUAPP_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* The code of every proto is verified before it first runs, luapp_execute() does not check the
+ * operands of an instruction. Build with -DLUAPP_VERIFY=0 to trust the bytecode that is loaded. */
+#if !defined(LUAPP_VERIFY)
+#define LUAPP_VERIFY 1
+#endif
+
+/* Bytes missing at the end of the stream are read as zero */
 #define read_type(data, type)                                                                      \
     ({                                                                                             \
-        type value;                                                                                \
-        fread(&value, sizeof(value), 1, data);                                                     \
+        type value = 0;                                                                            \
+        luaZ_read(data, &value, sizeof(value));                                                    \
                                                                                                    \
         value;                                                                                     \
     })
 
-static uint32_t read_size(FILE *data)
+/* Source of a caller-owned (or memory mapped) buffer, handed to the stream as a single chunk */
+struct load_buffer {
+    const char *data;
+    size_t size;
+};
+
+/* Source of a FILE*, read in chunks of LUAL_BUFFERSIZE bytes */
+struct load_file {
+    FILE *input;
+    char buffer[LUAL_BUFFERSIZE];
+};
+
+/* Where the sections of a program of version 7 or later are */
+struct load_sections {
+    uint32_t offset[BYTECODE_SECTIONS];
+    uint32_t size[BYTECODE_SECTIONS];
+    uint32_t count, main; /* Number of protos and index of the main one */
+};
+
+/* Where a string of the string table is, it is interned the first time a constant refers to it */
+struct load_string {
+    uint32_t offset;
+    uint32_t size;
+};
+
+/* How the bytes of an image are released with it */
+enum load_image_kind
+{
+    IMAGE_MAPPED,  /* mmap of the bytecode file */
+    IMAGE_OWNED,   /* malloc'ed copy */
+    IMAGE_BORROWED /* bytecode of a luapp_program, which outlives the states loading it */
+};
+
+/* A program of version 7 or later. Its protos start out as stubs that only know where they are in
+ * it, luapp_loadproto() decodes one the first time it is called and its code is run in place. The
+ * image lives as long as a proto uses it. */
+struct luapp_image {
+    const char *data;
+    size_t size;
+    _Atomic uint32_t refs; /* The protos using it (in any state), plus one while it is loaded */
+    enum load_image_kind kind;
+    struct load_sections sections;
+    struct load_string *strings;
+    uint32_t string_count;
+    const struct luapp_code *shared; /* Instructions shared by the states loading it, or NULL */
+};
+
+/* buffer_reader() -- lua_Reader providing the whole buffer at once
+ *      args: state, load_buffer, size of the chunk
+ *      rets: chunk or NULL when the buffer was already consumed
+ */
+static const char *buffer_reader(lua_State *L, void *data, size_t *size)
+{
+    struct load_buffer *buffer = data;
+    UNUSED(L);
+
+    if (buffer->size == 0)
+        return NULL;
+
+    *size = buffer->size;
+    buffer->size = 0;
+    return buffer->data;
+}
+
+/* file_reader() -- lua_Reader providing the next chunk of a file
+ *      args: state, load_file, size of the chunk
+ *      rets: chunk or NULL at the end of the file
+ */
+static const char *file_reader(lua_State *L, void *data, size_t *size)
+{
+    struct load_file *file = data;
+    UNUSED(L);
+
+    if (feof(file->input))
+        return NULL;
+
+    *size = fread(file->buffer, 1, sizeof(file->buffer), file->input);
+    return file->buffer;
+}
+
+/* skip_bytes() -- advances a stream without copying what it skips
+ *      args: stream, number of bytes
+ *      rets: none
+ */
+static void skip_bytes(ZIO *input, size_t count)
+{
+    while (count > 0 && luaZ_lookahead(input) != EOZ) {
+        size_t size = count < input->n ? count : input->n;
+
+        input->p += size;
+        input->n -= size;
+        count -= size;
+    }
+}
+
+static uint32_t read_size(ZIO *data)
 {
     uint32_t result = 0, shift = 0;
     uint8_t byte;
@@ -37,31 +163,517 @@ static uint32_t read_size(FILE *data)
     return result;
 }
 
-static TString *read_string(lua_State *L, FILE *input)
+static uint64_t read_varint(ZIO *data)
+{
+    uint64_t result = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = read_type(data, uint8_t);
+        if (shift < 64)
+            result |= (uint64_t)(byte & 127) << shift;
+        shift += 7;
+    } while (byte & 128);
+
+    return result;
+}
+
+static uint32_t read_uint32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+static TString *read_string(lua_State *L, ZIO *input, Mbuffer *buffer)
 {
     uint32_t count = read_size(input);
 
-    /* Very hacky but it works! */
-    char str[LUAL_BUFFERSIZE];
+    /* Intern straight out of the chunk when the whole string is in it (always the case for buffers
+     * and mapped files), otherwise gather the pieces first */
+    if (count > 0 && luaZ_lookahead(input) != EOZ && input->n >= count) {
+        TString *s = luaS_newlstr(L, input->p, count);
 
-    for (int32_t i = 0; i < count; i++)
-        str[i] = read_type(input, uint8_t);
+        input->p += count;
+        input->n -= count;
+        return s;
+    }
+
+    char *str = luaZ_openspace(L, buffer, count);
+    luaZ_read(input, str, count);
 
     return luaS_newlstr(L, str, count);
 }
 
-static TString **read_strings(lua_State *L, FILE *input, uint32_t count)
+static TString **read_strings(lua_State *L, ZIO *input, uint32_t count)
 {
+    Mbuffer buffer;
+    luaZ_initbuffer(L, &buffer);
+
     /* Create new strings vector */
     TString **strings = luaM_newvector(L, count, TString *);
 
     for (int32_t i = 0; i < count; i++)
-        strings[i] = read_string(L, input);
+        strings[i] = read_string(L, input, &buffer);
 
+    luaZ_freebuffer(L, &buffer);
     return strings;
 }
 
-static Proto *read_proto(lua_State *L, FILE *input, TString **strings, TString *source)
+/* read_lines() -- reads the lines a proto is defined on and the line of each of its instructions
+ *      args: state, stream, proto
+ *      rets: none
+ */
+static void read_lines(lua_State *L, ZIO *input, Proto *p)
+{
+    p->linedefined = read_size(input);
+    p->lastlinedefined = read_size(input);
+
+    uint32_t sizelineinfo = read_size(input);
+    int32_t line = p->linedefined;
+
+    /* A table that does not match the code is skipped, no line beats a wrong one */
+    if (sizelineinfo == (uint32_t)p->sizecode) {
+        p->lineinfo = luaM_newvector(L, sizelineinfo, int);
+        p->sizelineinfo = sizelineinfo;
+    }
+
+    for (uint32_t i = 0; i < sizelineinfo; i++) {
+        uint32_t delta = read_size(input);
+        line += BYTECODE_UNZIGZAG(delta);
+
+        if (p->lineinfo != NULL)
+            p->lineinfo[i] = line;
+    }
+}
+
+/* read_constant() -- reads a constant of a version before 7, a tag byte and its payload
+ *      args: state, stream, interned strings, number of strings, proto, index of the constant
+ *      rets: none
+ */
+static void read_constant(lua_State *L, ZIO *input, TString **strings, uint32_t string_count,
+                          Proto *p, int32_t i)
+{
+    constant_t c = read_type(input, uint8_t);
+    /* Handle each type individually */
+    switch (c) {
+        case CONSTANT_NIL:
+            setnilvalue(&p->k[i]);
+            break;
+        case CONSTANT_BOOLEAN: {
+            uint8_t value = read_type(input, uint8_t);
+            setbvalue(&p->k[i], value);
+            break;
+        }
+        case CONSTANT_NUMBER: {
+            double value = read_type(input, double);
+            setnvalue(&p->k[i], value);
+            break;
+        }
+        case CONSTANT_STRING: {
+            uint32_t index = read_size(input);
+
+            /* Indexes start at 1, a string that is not in the table reads as nil */
+            if (index >= 1 && index <= string_count) {
+                setsvalue(L, &p->k[i], strings[index - 1]);
+            } else
+                setnilvalue(&p->k[i]);
+            break;
+        }
+        case CONSTANT_ENVIRONMENT: {
+            /* Environment constants hold the name of the global, OP_GETENV resolves it at run time
+             * through the inline cache of the constant (so later assignments are seen). */
+            uint32_t index = read_type(input, uint32_t);
+
+            /* The name is one of the constants read before */
+            if (index < (uint32_t)i) {
+                setobj(L, &p->k[i], &p->k[index]);
+            } else
+                setnilvalue(&p->k[i]);
+            break;
+        }
+        default:
+            setnilvalue(&p->k[i]);
+            break;
+    }
+}
+
+/* image_string() -- interns a string of the string table of an image
+ *      args: state, image, index of the string
+ *      rets: string or NULL if there is no such string
+ */
+static TString *image_string(lua_State *L, struct luapp_image *image, uint64_t index)
+{
+    if (index >= image->string_count)
+        return NULL;
+
+    const struct load_string *string = &image->strings[index];
+    return luaS_newlstr(L, image->data + string->offset, string->size);
+}
+
+/* read_packed_constant() -- reads a constant of version 7 or later, a varint with the tag in its
+ * low bits (see BYTECODE_CONSTANT)
+ *      args: state, stream, image, proto, index of the constant
+ *      rets: none
+ */
+static void read_packed_constant(lua_State *L, ZIO *input, struct luapp_image *image, Proto *p,
+                                 int32_t i)
+{
+    uint64_t value = read_varint(input);
+    uint64_t payload = BYTECODE_CONSTANT_PAYLOAD(value);
+
+    switch (BYTECODE_CONSTANT_TAG(value)) {
+        case CONSTANT_BOOLEAN:
+            setbvalue(&p->k[i], payload != 0);
+            break;
+        case CONSTANT_NUMBER: {
+            double number = read_type(input, double);
+            setnvalue(&p->k[i], number);
+            break;
+        }
+        case CONSTANT_INTEGER:
+            setnvalue(&p->k[i], (lua_Number)BYTECODE_UNZIGZAG64(payload));
+            break;
+        case CONSTANT_STRING: {
+            TString *string = image_string(L, image, payload);
+
+            if (string != NULL)
+                setsvalue(L, &p->k[i], string);
+            break;
+        }
+        case CONSTANT_ENVIRONMENT:
+            /* Environment constants hold the name of the global, like with older versions */
+            if (payload < (uint64_t)p->sizek)
+                setobj(L, &p->k[i], &p->k[payload]);
+            break;
+        default:
+            break;
+    }
+
+    luaC_barrier(L, p, &p->k[i]);
+}
+
+#if LUAPP_VERIFY
+/* Fails the verification of the instruction being looked at unless the condition holds */
+#define verify_check(c, reason)                                                                    \
+    {                                                                                              \
+        if (!(c))                                                                                  \
+            return (reason);                                                                       \
+    }
+
+#define verify_register(r) verify_check((r) < p->maxstacksize, "register out of range")
+#define verify_constant(x) verify_check((x) < p->sizek, "constant out of range")
+#define verify_target(t)                                                                           \
+    verify_check((t) >= 0 && (t) < p->sizecode && !subs[t], "jump out of range")
+
+/* A conditional branch reads the offset of the OP_JMP that follows it or steps over that jump */
+#define verify_branch()                                                                            \
+    {                                                                                              \
+        verify_check(pc + 1 < p->sizecode && GET_OPCODE(p->code[pc + 1]) == OP_JMP,                \
+                     "branch without a jump");                                                     \
+        verify_target(pc + 2);                                                                     \
+    }
+
+/* verify_sub() -- marks the sub instructions of the code, the operands of OP_LOADKX and
+ * OP_CLOSURE that are never run (or jumped to) themselves
+ *      args: proto, a flag per instruction (cleared), index of the failing instruction
+ *      rets: NULL or the reason the code was rejected
+ */
+static const char *verify_sub(const Proto *p, lu_byte *subs, int32_t *at)
+{
+    for (int32_t pc = 0; pc < p->sizecode; pc++) {
+        Instruction i = p->code[pc];
+        int32_t count = 0;
+
+        *at = pc;
+        verify_check(GET_OPCODE(i) < NUM_OPCODES, "invalid opcode");
+
+        if (GET_OPCODE(i) == OP_LOADKX)
+            count = 1;
+        else if (GET_OPCODE(i) == OP_CLOSURE) {
+            verify_check(GETARG_Du(i) < (uint32_t)p->sizep && p->p[GETARG_Du(i)] != NULL,
+                         "child proto out of range");
+            count = p->p[GETARG_Du(i)]->nups;
+        }
+
+        verify_check(count < p->sizecode - pc, "missing sub instruction");
+        for (; count > 0; count--)
+            subs[++pc] = 1;
+    }
+
+    return NULL;
+}
+
+/* verify_code() -- proves that running the code stays within the frame, the constants, the
+ * upvalues and the children of its proto: registers are below maxstacksize, constant indexes
+ * below sizek and jumps land on an instruction, which is what luapp_execute() relies on
+ *      args: proto, sub instruction flags (see verify_sub), index of the failing instruction
+ *      rets: NULL or the reason the code was rejected
+ *
+ * Note: What the compiler proved about the contents of a register (OP_CALLDIRECT, OP_SETLIST and
+ * OP_SETARRAYLIST) can not be seen here, those instructions check it when they run.
+ */
+static const char *verify_code(const Proto *p, const lu_byte *subs, int32_t *at)
+{
+    *at = 0;
+    verify_check(p->numparams <= p->maxstacksize, "too many parameters");
+
+    for (int32_t pc = 0; pc < p->sizecode; pc++) {
+        Instruction i = p->code[pc];
+        uint32_t a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i);
+        int32_t next = pc + 1;
+
+        if (subs[pc])
+            continue;
+        *at = pc;
+
+        switch (GET_OPCODE(i)) {
+            case OP_MOVE:
+            case OP_UNM:
+            case OP_NOT:
+            case OP_LEN:
+            case OP_LOADNIL:
+            case OP_APPEND:
+            case OP_BUILDSTRING:
+                verify_register(a);
+                verify_register(b);
+                break;
+            case OP_LOADPN:
+            case OP_LOADNN:
+            case OP_NEWTABLE:
+            case OP_NEWRECORD:
+            case OP_CLOSE:
+                verify_register(a);
+                break;
+            case OP_LOADK:
+            case OP_GETENV:
+            case OP_SETGLOBAL:
+                verify_register(a);
+                verify_check(GETARG_D(i) >= 0, "constant out of range");
+                verify_constant(GETARG_D(i));
+                break;
+            case OP_LOADKX:
+                verify_register(a);
+                verify_constant(p->code[pc + 1]);
+                next = pc + 2;
+                break;
+            case OP_LOADBOOL:
+                verify_register(a);
+                if (c != 0)
+                    verify_target(pc + 2);
+                break;
+            case OP_GETUPVAL:
+            case OP_SETUPVAL:
+                verify_register(a);
+                verify_check(b < p->nups, "upvalue out of range");
+                break;
+            case OP_GETTABLE:
+            case OP_SETTABLE:
+            case OP_GETINDEX:
+            case OP_SETINDEX:
+            case OP_GETARRAY:
+            case OP_SETARRAY:
+            case OP_GETARRAYI:
+            case OP_SETARRAYI:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_POW:
+            case OP_ADDNN:
+            case OP_SUBNN:
+            case OP_MULNN:
+            case OP_DIVNN:
+            case OP_MODNN:
+            case OP_POWNN:
+                verify_register(a);
+                verify_register(b);
+                verify_register(c);
+                break;
+            case OP_ADDK:
+            case OP_SUBK:
+            case OP_MULK:
+            case OP_DIVK:
+            case OP_MODK:
+            case OP_POWK:
+            case OP_ADDNK:
+            case OP_SUBNK:
+            case OP_MULNK:
+            case OP_DIVNK:
+            case OP_MODNK:
+            case OP_POWNK:
+                verify_register(a);
+                verify_register(b);
+                verify_constant(c);
+                break;
+            case OP_GETFIELD:
+                verify_register(a);
+                verify_register(b);
+                verify_constant(c);
+                verify_check(ttisstring(&p->k[c]), "field key is not a string");
+                break;
+            case OP_SETFIELD:
+                verify_register(a);
+                verify_constant(b);
+                verify_check(ttisstring(&p->k[b]), "field key is not a string");
+                verify_register(c);
+                break;
+            case OP_CONCAT:
+                verify_register(a);
+                verify_check(b < c, "register out of range");
+                verify_register(c);
+                break;
+            case OP_JMP:
+                verify_target(pc + 1 + GETARG_E(i));
+                break;
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_EQNN:
+            case OP_LTNN:
+            case OP_LENN:
+                verify_register(b);
+                verify_register(c);
+                verify_branch();
+                break;
+            case OP_EQK:
+            case OP_LTK:
+            case OP_LEK:
+            case OP_GTK:
+            case OP_GEK:
+            case OP_EQNK:
+            case OP_LTNK:
+            case OP_LENK:
+            case OP_GTNK:
+            case OP_GENK:
+                verify_register(b);
+                verify_constant(c);
+                verify_branch();
+                break;
+            case OP_TEST:
+                verify_register(a);
+                verify_branch();
+                break;
+            case OP_CALL:
+            case OP_CALLDIRECT:
+            case OP_TAILCALL:
+                verify_register(a);
+                verify_check(a + b <= p->maxstacksize, "register out of range");
+                verify_check(c == 0 || a + c - 1 <= p->maxstacksize, "register out of range");
+                break;
+            case OP_RETURN:
+                /* A function returning nothing may have an empty frame */
+                verify_check(a + (b == 0 ? 0 : b - 1) <= p->maxstacksize, "register out of range");
+                break;
+            case OP_VARARG:
+                verify_register(a);
+                verify_check(b == 0 || a + b - 1 <= p->maxstacksize, "register out of range");
+                break;
+            case OP_CALLENVK:
+                verify_register(a + 1);
+                verify_constant(b);
+                verify_constant(c);
+                break;
+            case OP_FORPREP:
+            case OP_FORLOOP:
+            case OP_FORLOOPINC:
+            case OP_FORLOOPDEC:
+                verify_register(a + 3);
+                verify_target(pc + 1 + GETARG_D(i));
+                break;
+            case OP_SETLIST:
+            case OP_SETARRAYLIST:
+                verify_register(a + b);
+                break;
+            case OP_NEWARRAY:
+                verify_register(a);
+                verify_check(b <= NEWARRAY_BOOLEAN, "invalid array kind");
+                break;
+            case OP_CLOSURE: {
+                const Proto *child = p->p[GETARG_Du(i)];
+
+                verify_register(a);
+                for (int32_t j = 1; j <= child->nups; j++) {
+                    Instruction sub = p->code[pc + j];
+
+                    /* Any other kind is read as an upvalue of the enclosing function */
+                    if (GET_CAPTURE_KIND(sub) == CAPTURE_REFERENCE ||
+                        GET_CAPTURE_KIND(sub) == CAPTURE_VALUE) {
+                        verify_register(GET_CAPTURE_INDEX(sub));
+                    } else
+                        verify_check(GET_CAPTURE_INDEX(sub) < p->nups, "upvalue out of range");
+                }
+
+                next = pc + 1 + child->nups;
+                break;
+            }
+            default:
+                /* Opcodes the VM does not implement are skipped */
+                break;
+        }
+
+        /* Only returns and unconditional jumps end the code */
+        if (GET_OPCODE(i) != OP_RETURN && GET_OPCODE(i) != OP_JMP && GET_OPCODE(i) != OP_FORPREP)
+            verify_check(next < p->sizecode, "code falls off its end");
+    }
+
+    return NULL;
+}
+#endif
+
+/* verify_proto() -- verifies the code of a decoded proto, see verify_code()
+ *      args: state, proto, index of the failing instruction
+ *      rets: NULL or the reason the code was rejected
+ */
+static const char *verify_proto(lua_State *L, const Proto *p, int32_t *at)
+{
+#if LUAPP_VERIFY
+    lu_byte *subs = luaM_newvector(L, p->sizecode, lu_byte);
+    const char *reason;
+
+    if (p->sizecode > 0)
+        memset(subs, 0, p->sizecode);
+    if ((reason = verify_sub(p, subs, at)) == NULL)
+        reason = verify_code(p, subs, at);
+
+    luaM_freearray(L, subs, p->sizecode, lu_byte);
+    return reason;
+#else
+    (void)L, (void)p, (void)at;
+    return NULL;
+#endif
+}
+
+/* luapp_finish_proto() -- gives a decoded proto its caches and looks its native code up, before
+ * it first runs
+ *      args: state, proto
+ *      rets: none
+ */
+void luapp_finish_proto(lua_State *L, Proto *p)
+{
+    /* Every constant gets an (empty) inline cache, only environment constants use them */
+    luaF_newgcache(L, p);
+
+    /* Field accesses have a cache per instruction, protos without any get none */
+    for (int32_t i = 0; i < p->sizecode; i++) {
+        enum opcode op = GET_OPCODE(p->code[i]);
+
+        if (op == OP_GETFIELD || op == OP_SETFIELD) {
+            luaF_newfcache(L, p);
+            break;
+        }
+    }
+
+    p->native = luapp_aot_find(p);
+    p->hotcount = p->native == NULL ? luapp_jit_threshold : 0;
+}
+
+static Proto *read_proto(lua_State *L, ZIO *input, version_t version, TString **strings,
+                         uint32_t string_count, Proto **protos, TString *source,
+                         const struct luapp_code *shared, uint32_t index)
 {
     Proto *p = luaF_newproto(L);
 
@@ -74,70 +686,446 @@ static Proto *read_proto(lua_State *L, FILE *input, TString **strings, TString *
 
     /* Create our new instruction array */
     p->sizecode = read_size(input);
-    p->code = luaM_newvector(L, p->sizecode, Instruction);
 
-    /* Read the instruction array */
-    for (int i = 0; i < p->sizecode; i++)
-        p->code[i] = read_type(input, uint32_t);
+    if (shared != NULL && index < shared->count && shared->sizes[index] == p->sizecode) {
+        /* The instructions are never written to, every state loading the program uses the copy
+         * made by luapp_code_init() */
+        p->code = shared->code[index];
+        p->sharedcode = 1;
+        skip_bytes(input, p->sizecode * sizeof(Instruction));
+    } else {
+        p->code = luaM_newvector(L, p->sizecode, Instruction);
+
+        /* Copy the instruction array in one go. The proto owns its code (luaF_freeproto frees it),
+         * so it can not alias the input. */
+        if (luaZ_read(input, p->code, p->sizecode * sizeof(Instruction)) != 0)
+            memset(p->code, 0, p->sizecode * sizeof(Instruction));
+    }
 
     /* Read the constant pool */
     p->sizek = read_size(input);
     p->k = luaM_newvector(L, p->sizek, TValue);
 
     /* Process all the constants in the pool */
-    for (int32_t i = 0; i < p->sizek; i++) {
-        constant_t c = read_type(input, uint8_t);
-        /* Handle each type individually */
-        switch (c) {
-            case CONSTANT_NIL:
-                setnilvalue(&p->k[i]);
-                break;
-            case CONSTANT_BOOLEAN: {
-                uint8_t value = read_type(input, uint8_t);
-                setbvalue(&p->k[i], value);
-                break;
-            }
-            case CONSTANT_NUMBER: {
-                double value = read_type(input, double);
-                setnvalue(&p->k[i], value);
-                break;
-            }
-            case CONSTANT_STRING: {
-                uint32_t index = read_size(input);
-                setsvalue(L, &p->k[i], strings[index - 1]);
-                break;
-            }
-            case CONSTANT_ENVIRONMENT: {
-                /* For environment constants we need to load them before execution (so invoke
-                 * luaV_gettable, etc.). This will make execution speeds much faster as these
-                 * hashtable lookups don't need to be done during execution. */
-                uint32_t index = read_type(input, uint32_t);
+    for (int32_t i = 0; i < p->sizek; i++)
+        read_constant(L, input, strings, string_count, p, i);
 
-                luaV_getenv(L, hvalue(gt(L)), &p->k[index]);
-                setobj(L, &p->k[i], L->top - 1);
-                L->top--;
-                break;
-            }
+    /* The children of a proto come before it in the list, OP_CLOSURE refers to them by their
+     * position among the children */
+    if (version >= VERSION_3) {
+        p->sizep = read_size(input);
+        p->p = luaM_newvector(L, p->sizep, Proto *);
+
+        for (int32_t i = 0; i < p->sizep; i++) {
+            uint32_t child = read_size(input);
+            p->p[i] = child < index ? protos[child] : NULL;
         }
     }
 
+    /* Source lines of the instructions, version 5 moved them to the debug section */
+    if (version == VERSION_4)
+        read_lines(L, input, p);
+    else if (version >= VERSION_5)
+        p->debugoffset = read_size(input);
+
+    luapp_finish_proto(L, p);
     return p;
 }
 
-static Proto **read_protos(lua_State *L, FILE *input, uint32_t count, TString **strings,
-                           TString *source)
+static Proto **read_protos(lua_State *L, ZIO *input, version_t version, uint32_t count,
+                           TString **strings, uint32_t string_count, TString *source,
+                           const struct luapp_code *shared)
 {
     /* Create new protos vector */
     Proto **protos = luaM_newvector(L, count, Proto *);
 
     for (int32_t i = 0; i < count; i++) {
-        protos[i] = read_proto(L, input, strings, source);
+        protos[i] =
+            read_proto(L, input, version, strings, string_count, protos, source, shared, i);
     }
 
     return protos;
 }
 
-int32_t luapp_loadfile(lua_State *L, const char *chunkname, FILE *input)
+/* attach_debug() -- gives the protos that have debug information the debug section, the part of a
+ * proto is decoded by luapp_loaddebug()
+ *      args: protos, number of protos, debug section
+ *      rets: none
+ */
+static void attach_debug(Proto **protos, uint32_t count, TString *debug)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (protos[i]->debugoffset > 0 && protos[i]->debugoffset <= debug->tsv.len)
+            protos[i]->debug = debug;
+    }
+}
+
+/* push_main() -- pushes a closure of the main proto of a program
+ *      args: state, main proto
+ *      rets: none
+ */
+static void push_main(lua_State *L, Proto *p)
+{
+    Closure *cl = luaF_newLclosure(L, 0, hvalue(gt(L)));
+    cl->l.p = p;
+    setclvalue(L, L->top, cl);
+    incr_top(L);
+}
+
+/* read_sections() -- reads the section table of a program of version 7 or later and checks that
+ * every section and the header of every proto the index lists are inside the bytecode
+ *      args: bytecode, its size, sections (filled)
+ *      rets: 0 on success, 1 if the bytecode is malformed
+ */
+static int read_sections(const char *data, size_t size, struct load_sections *sections)
+{
+    memset(sections, 0, sizeof(*sections));
+
+    if (size < BYTECODE_HEADER_SIZE)
+        return 1;
+
+    uint32_t count = read_uint32(data + 4);
+    if (count > (size - BYTECODE_HEADER_SIZE) / BYTECODE_SECTION_ENTRY_SIZE)
+        return 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const char *entry = data + BYTECODE_HEADER_SIZE + i * BYTECODE_SECTION_ENTRY_SIZE;
+        uint32_t kind = read_uint32(entry), offset = read_uint32(entry + 4);
+        uint32_t length = read_uint32(entry + 8);
+
+        if (offset > size || length > size - offset)
+            return 1;
+
+        /* Sections added by later versions are skipped */
+        if (kind < BYTECODE_SECTIONS) {
+            sections->offset[kind] = offset;
+            sections->size[kind] = length;
+        }
+    }
+
+    /* The index is read in place, one offset at the time */
+    const char *index = data + sections->offset[BYTECODE_SECTION_INDEX];
+    uint32_t length = sections->size[BYTECODE_SECTION_INDEX];
+
+    if (length < 2 * sizeof(uint32_t))
+        return 1;
+
+    sections->count = read_uint32(index);
+    sections->main = read_uint32(index + 4);
+
+    if (sections->count > length / sizeof(uint32_t) - 2)
+        return 1;
+
+    uint32_t start = sections->offset[BYTECODE_SECTION_PROTOS];
+    uint32_t end = start + sections->size[BYTECODE_SECTION_PROTOS];
+
+    for (uint32_t i = 0; i < sections->count; i++) {
+        uint32_t offset = read_uint32(index + (2 + i) * sizeof(uint32_t));
+
+        if (offset < start || offset > end - 8 || end < 8 || offset % BYTECODE_ALIGN != 0)
+            return 1;
+    }
+
+    return sections->count == 0;
+}
+
+/* image_new() -- wraps the bytecode of a program of version 7 or later
+ *      args: bytecode, its size, how it is released, shared instructions of the program (or NULL)
+ *      rets: image holding a reference for the caller, or NULL if memory ran out
+ */
+static struct luapp_image *image_new(const char *data, size_t size, enum load_image_kind kind,
+                                     const struct luapp_code *shared)
+{
+    struct luapp_image *image = malloc(sizeof(*image));
+
+    if (image == NULL)
+        return NULL;
+
+    image->data = data;
+    image->size = size;
+    image->refs = 1;
+    image->kind = kind;
+    image->strings = NULL;
+    image->string_count = 0;
+    image->shared = shared;
+    return image;
+}
+
+/* read_string_table() -- finds the strings of an image, without interning them
+ *      args: image (its sections read)
+ *      rets: 0 on success, 1 if the table is malformed or memory ran out
+ */
+static int read_string_table(struct luapp_image *image)
+{
+    struct load_buffer chunk = {image->data + image->sections.offset[BYTECODE_SECTION_STRINGS],
+                                image->sections.size[BYTECODE_SECTION_STRINGS]};
+    ZIO input;
+
+    size_t length = chunk.size;
+
+    luaZ_init(NULL, &input, buffer_reader, &chunk);
+    uint32_t count = read_size(&input);
+
+    /* Every string takes at least the byte of its size */
+    if (count > length)
+        return 1;
+
+    if (count > 0 && (image->strings = malloc(count * sizeof(*image->strings))) == NULL)
+        return 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t size = read_size(&input);
+
+        if (size > 0 && (luaZ_lookahead(&input) == EOZ || input.n < size))
+            return 1;
+
+        image->strings[i].offset = size > 0 ? input.p - image->data : 0;
+        image->strings[i].size = size;
+        image->string_count++;
+        skip_bytes(&input, size);
+    }
+
+    return 0;
+}
+
+/* image_offset() -- reads the offset of a proto from the index of an image
+ *      args: image, index of the proto
+ *      rets: offset of the proto in the bytecode
+ */
+static uint32_t image_offset(const struct luapp_image *image, uint32_t index)
+{
+    return read_uint32(image->data + image->sections.offset[BYTECODE_SECTION_INDEX] +
+                       (2 + index) * sizeof(uint32_t));
+}
+
+/* new_stub() -- creates a proto that is only decoded when it is first called
+ *      args: state, image, index of the proto
+ *      rets: proto, its source and debug section are set by the caller
+ *
+ * Note: OP_CLOSURE needs the number of upvalues before the call, so the fixed header is read.
+ */
+static Proto *new_stub(lua_State *L, struct luapp_image *image, uint32_t index)
+{
+    const char *header = image->data + image_offset(image, index);
+    Proto *p = luaF_newproto(L);
+
+    p->maxstacksize = header[0];
+    p->numparams = header[1];
+    p->nups = header[2];
+    p->is_vararg = header[3];
+    p->lazy = 1;
+    p->imageindex = index;
+    p->image = image;
+    image->refs++;
+    return p;
+}
+
+/* load_program() -- loads a program of version 7 or later, only its main proto is created and it
+ * is a stub like all of the others
+ *      args: state, name of the chunk, image
+ *      rets: 0 on success, 1 with an error message pushed otherwise
+ */
+static int32_t load_program(lua_State *L, const char *chunkname, struct luapp_image *image)
+{
+    const struct load_sections *sections = &image->sections;
+
+    if (read_sections(image->data, image->size, &image->sections) || read_string_table(image)) {
+        lua_pushliteral(L, "malformed bytecode");
+        return 1;
+    }
+
+    /* Everything read from here on lives as long as the program, see LUAPP_ALLOC_ARENA */
+    luapp_alloc_loading(L, 1);
+
+    Proto *p = new_stub(L, image, sections->main < sections->count ? sections->main : 0);
+
+    /* The main closure has no upvalues to refer to, the collector takes the stub */
+    if (p->nups != 0) {
+        luapp_alloc_loading(L, 0);
+        lua_pushliteral(L, "malformed bytecode: upvalues in the main function");
+        return 1;
+    }
+
+    push_main(L, p);
+
+    /* The closure on the stack keeps the proto and through it the strings */
+    p->source = luaS_new(L, chunkname);
+
+    if (sections->size[BYTECODE_SECTION_DEBUG] > 0)
+        p->debug = luaS_newlstr(L, image->data + sections->offset[BYTECODE_SECTION_DEBUG],
+                                sections->size[BYTECODE_SECTION_DEBUG]);
+
+    luapp_alloc_loading(L, 0);
+    return 0;
+}
+
+/* luapp_loadproto() -- decodes the code, the constants and the children of a stub, called by
+ * luaD_precall and the debug interface the first time they need them (see luaG_loadproto)
+ *      args: state, proto (a stub)
+ *      rets: none
+ *
+ * Note: The proto may already have been marked by the collector, so what it refers to gets a
+ * barrier. The children are stubs as well, they share its source and debug section.
+ */
+void luapp_loadproto(lua_State *L, Proto *p)
+{
+    struct luapp_image *image = p->image;
+    const struct luapp_code *shared = image->shared;
+    uint32_t index = p->imageindex, offset = image_offset(image, index);
+    const struct load_sections *sections = &image->sections;
+    uint32_t end = sections->offset[BYTECODE_SECTION_PROTOS];
+
+    end += sections->size[BYTECODE_SECTION_PROTOS];
+    const char *code = image->data + offset + 8;
+
+    /* A count past the section is cut down to the instructions that are there */
+    uint32_t sizecode = read_uint32(code - 4);
+    if (sizecode > (end - offset - 8) / sizeof(Instruction))
+        sizecode = (end - offset - 8) / sizeof(Instruction);
+
+    if (shared != NULL && index < shared->count && shared->sizes[index] == sizecode) {
+        p->code = shared->code[index];
+        p->sharedcode = 1;
+    } else if ((uintptr_t)code % sizeof(Instruction) == 0) {
+        /* Images are aligned, the instructions are run where they are */
+        p->code = (Instruction *)code;
+        p->sharedcode = 1;
+    } else {
+        p->code = luaM_newvector(L, sizecode, Instruction);
+        memcpy(p->code, code, sizecode * sizeof(Instruction));
+    }
+
+    p->sizecode = sizecode;
+
+    size_t length = end - offset - 8 - sizecode * sizeof(Instruction);
+    struct load_buffer chunk = {code + sizecode * sizeof(Instruction), length};
+    ZIO input;
+
+    luaZ_init(L, &input, buffer_reader, &chunk);
+
+    /* Every constant takes at least a byte, larger counts are corrupted */
+    uint32_t sizek = read_size(&input);
+    if (sizek > length)
+        sizek = 0;
+
+    TValue *k = luaM_newvector(L, sizek, TValue);
+    for (uint32_t i = 0; i < sizek; i++)
+        setnilvalue(&k[i]);
+
+    p->k = k;
+    p->sizek = sizek;
+
+    for (uint32_t i = 0; i < sizek; i++)
+        read_packed_constant(L, &input, image, p, i);
+
+    /* The children come before their parent in the index */
+    uint32_t sizep = read_size(&input);
+    if (sizep > length)
+        sizep = 0;
+
+    Proto **children = luaM_newvector(L, sizep, Proto *);
+    for (uint32_t i = 0; i < sizep; i++)
+        children[i] = NULL;
+
+    p->p = children;
+    p->sizep = sizep;
+
+    for (uint32_t i = 0; i < sizep; i++) {
+        uint32_t child = read_size(&input);
+
+        if (child >= index)
+            continue;
+
+        Proto *stub = new_stub(L, image, child);
+        stub->source = p->source;
+        stub->debug = p->debug;
+        p->p[i] = stub;
+        luaC_objbarrier(L, p, stub);
+    }
+
+    /* Where the debug information of the proto starts, it has none if it is not in the section */
+    p->debugoffset = read_size(&input);
+    if (p->debug != NULL && (p->debugoffset == 0 || p->debugoffset > p->debug->tsv.len))
+        p->debug = NULL;
+
+    int32_t at;
+    const char *reason = verify_proto(L, p, &at);
+
+    /* A proto that fails stays a stub, it is rejected again by the next call */
+    if (reason != NULL) {
+        if (!p->sharedcode)
+            luaM_freearray(L, p->code, p->sizecode, Instruction);
+        luaM_freearray(L, p->k, p->sizek, TValue);
+        luaM_freearray(L, p->p, p->sizep, Proto *);
+        p->code = NULL;
+        p->k = NULL;
+        p->p = NULL;
+        p->sizecode = p->sizek = p->sizep = 0;
+        p->sharedcode = 0;
+        luaG_runerror(L, "malformed bytecode: %s at instruction %d", reason, at + 1);
+    }
+
+    luapp_finish_proto(L, p);
+    p->lazy = 0;
+}
+
+/* read_image() -- makes an image of a program of version 7 or later out of a stream, whose
+ * version was read already. The bytecode of a program is borrowed, other buffers are copied since
+ * the protos are decoded later on, files are read whole.
+ *      args: stream, version, shared instructions of the program (or NULL)
+ *      rets: image or NULL if memory ran out
+ */
+static struct luapp_image *read_image(ZIO *input, version_t version,
+                                      const struct luapp_code *shared)
+{
+    size_t size = 1, space = LUAL_BUFFERSIZE;
+    char *copy;
+
+    if (input->reader == buffer_reader && shared != NULL)
+        return image_new(input->p - 1, input->n + 1, IMAGE_BORROWED, shared);
+
+    if (input->reader == buffer_reader)
+        space = input->n + 1;
+
+    if ((copy = malloc(space)) == NULL)
+        return NULL;
+
+    copy[0] = version;
+
+    while (luaZ_lookahead(input) != EOZ) {
+        if (size + input->n > space) {
+            char *grown;
+
+            while (size + input->n > space)
+                space *= 2;
+
+            if ((grown = realloc(copy, space)) == NULL) {
+                free(copy);
+                return NULL;
+            }
+            copy = grown;
+        }
+
+        memcpy(copy + size, input->p, input->n);
+        size += input->n;
+        input->p += input->n;
+        input->n = 0;
+    }
+
+    struct luapp_image *image = image_new(copy, size, IMAGE_OWNED, NULL);
+
+    if (image == NULL)
+        free(copy);
+    return image;
+}
+
+/* luapp_load() -- loads a bytecode program from a stream and pushes its main closure
+ *      args: state, name of the chunk, stream, shared instructions of the program (or NULL),
+ *            mapped file the stream reads (or NULL)
+ *      rets: 0 on success, 1 with an error message pushed otherwise
+ */
+static int32_t luapp_load(lua_State *L, const char *chunkname, ZIO *input,
+                          const struct luapp_code *shared, struct luapp_image *image)
 {
     /* Read version number */
     version_t version = read_type(input, uint8_t);
@@ -149,6 +1137,24 @@ int32_t luapp_loadfile(lua_State *L, const char *chunkname, FILE *input)
         return 1;
     }
 
+    /* Version 7 seeks to its sections, so it needs the whole bytecode in memory */
+    if (version >= VERSION_7) {
+        struct luapp_image *own = image == NULL ? read_image(input, version, shared) : NULL;
+
+        if (image == NULL && (image = own) == NULL) {
+            lua_pushliteral(L, "not enough memory");
+            return 1;
+        }
+
+        int32_t status = load_program(L, chunkname, image);
+        if (own != NULL)
+            luapp_image_release(own);
+        return status;
+    }
+
+    /* Everything read from here on lives as long as the program, see LUAPP_ALLOC_ARENA */
+    luapp_alloc_loading(L, 1);
+
     TString *source = luaS_new(L, chunkname);
 
     /* Read the string table */
@@ -157,15 +1163,458 @@ int32_t luapp_loadfile(lua_State *L, const char *chunkname, FILE *input)
 
     /* Read function prototypes */
     uint32_t proto_count = read_size(input);
-    Proto **protos = read_protos(L, input, proto_count, strings, source);
+    Proto **protos =
+        read_protos(L, input, version, proto_count, strings, string_count, source, shared);
+
+    /* The index of the main function follows the protos, older versions put it first */
+    uint32_t main = version >= VERSION_3 ? read_size(input) : 0;
+
+    /* Nothing runs before every proto was verified, the main one has no upvalues to refer to */
+    const char *reason = proto_count == 0 ? "no functions" : NULL;
+    int32_t at = 0;
+
+    for (uint32_t i = 0; i < proto_count && reason == NULL; i++)
+        reason = verify_proto(L, protos[i], &at);
+
+    if (reason == NULL && protos[main < proto_count ? main : 0]->nups != 0)
+        reason = "upvalues in the main function";
+
+    if (reason != NULL) {
+        luapp_alloc_loading(L, 0);
+        luaM_freearray(L, protos, proto_count, Proto *);
+        luaM_free(L, strings);
+        lua_pushfstring(L, "malformed bytecode: %s at instruction %d", reason, at + 1);
+        return 1;
+    }
+
+    /* The debug section is kept as it is, the part of a proto is decoded by luapp_loaddebug() */
+    if (version >= VERSION_5) {
+        Mbuffer buffer;
+        luaZ_initbuffer(L, &buffer);
+
+        TString *debug = read_string(L, input, &buffer);
+        luaZ_freebuffer(L, &buffer);
+
+        attach_debug(protos, proto_count, debug);
+    }
 
     /* Create and push a closure onto the stack */
-    Closure *cl = luaF_newLclosure(L, 0, hvalue(gt(L)));
-    cl->l.p = protos[0];
-    setclvalue(L, L->top, cl);
-    incr_top(L);
+    push_main(L, protos[main < proto_count ? main : 0]);
 
-    /* Dispose of the string array as we don't need it anymore */
+    luapp_alloc_loading(L, 0);
+
+    /* Dispose of the string and proto arrays as we don't need them anymore */
+    luaM_freearray(L, protos, proto_count, Proto *);
     luaM_free(L, strings);
     return 0;
-}
\ No newline at end of file
+}
+
+/* luapp_loaddebug() -- decodes the lines and the names of the locals and upvalues of a proto from
+ * the debug section of its program, called by ldebug.c the first time they are needed
+ *      args: state, proto (its `debug' set)
+ *      rets: none
+ *
+ * Note: The proto may already have been marked by the collector, so the names get a barrier.
+ */
+void luapp_loaddebug(lua_State *L, Proto *p)
+{
+    TString *debug = p->debug;
+    struct load_buffer data = {getstr(debug) + p->debugoffset - 1,
+                               debug->tsv.len - (p->debugoffset - 1)};
+    ZIO input;
+    Mbuffer buffer;
+
+    size_t size = data.size;
+
+    p->debug = NULL;
+    luaZ_init(L, &input, buffer_reader, &data);
+    luaZ_initbuffer(L, &buffer);
+
+    read_lines(L, &input, p);
+
+    /* Every local takes at least three bytes, larger counts are corrupted */
+    uint32_t sizelocvars = read_size(&input);
+    if (sizelocvars > size)
+        sizelocvars = 0;
+
+    p->locvars = luaM_newvector(L, sizelocvars, LocVar);
+    for (uint32_t i = 0; i < sizelocvars; i++)
+        p->locvars[i].varname = NULL;
+    p->sizelocvars = sizelocvars;
+
+    for (uint32_t i = 0; i < sizelocvars; i++) {
+        LocVar *local = &p->locvars[i];
+
+        local->varname = read_string(L, &input, &buffer);
+        luaC_objbarrier(L, p, local->varname);
+        local->startpc = read_size(&input);
+        local->endpc = local->startpc + read_size(&input);
+    }
+
+    /* Upvalue names are only kept if there is one for each upvalue */
+    uint32_t sizeupvalues = read_size(&input);
+
+    if (sizeupvalues == p->nups) {
+        p->upvalues = luaM_newvector(L, sizeupvalues, TString *);
+        for (uint32_t i = 0; i < sizeupvalues; i++)
+            p->upvalues[i] = NULL;
+        p->sizeupvalues = sizeupvalues;
+
+        for (uint32_t i = 0; i < sizeupvalues; i++) {
+            p->upvalues[i] = read_string(L, &input, &buffer);
+            luaC_objbarrier(L, p, p->upvalues[i]);
+        }
+    }
+
+    luaZ_freebuffer(L, &buffer);
+}
+
+int32_t luapp_loadfile(lua_State *L, const char *chunkname, FILE *input)
+{
+    ZIO z;
+    struct load_file file = {input};
+
+    luaZ_init(L, &z, file_reader, &file);
+    return luapp_load(L, chunkname, &z, NULL, NULL);
+}
+
+int32_t luapp_loadbuffer(lua_State *L, const char *chunkname, const char *buffer, size_t size)
+{
+    ZIO z;
+    struct load_buffer data = {buffer, size};
+
+    luaZ_init(L, &z, buffer_reader, &data);
+    return luapp_load(L, chunkname, &z, NULL, NULL);
+}
+
+/* luapp_loadshared() -- loads a program whose instructions were copied by luapp_code_init(), the
+ * protos use that copy instead of their own
+ *      args: state, name of the chunk, bytecode, size of the bytecode, shared instructions
+ *      rets: 0 on success, 1 with an error message pushed otherwise
+ */
+int32_t luapp_loadshared(lua_State *L, const char *chunkname, const char *buffer, size_t size,
+                         const struct luapp_code *shared)
+{
+    ZIO z;
+    struct load_buffer data = {buffer, size};
+
+    luaZ_init(L, &z, buffer_reader, &data);
+    return luapp_load(L, chunkname, &z, shared, NULL);
+}
+
+/* code_init_sections() -- points the shared instructions of a program of version 7 or later at
+ * the bytecode, or copies them out of it when the buffer is not aligned
+ *      args: shared instructions, bytecode, size of the bytecode
+ *      rets: 0 on success, 1 if the bytecode is malformed or memory ran out
+ */
+static int32_t code_init_sections(struct luapp_code *shared, const char *buffer, size_t size)
+{
+    struct load_sections sections;
+
+    if (read_sections(buffer, size, &sections))
+        return 1;
+
+    const char *index = buffer + sections.offset[BYTECODE_SECTION_INDEX] + 2 * sizeof(uint32_t);
+    uint32_t end =
+        sections.offset[BYTECODE_SECTION_PROTOS] + sections.size[BYTECODE_SECTION_PROTOS];
+
+    shared->aliased = (uintptr_t)buffer % BYTECODE_ALIGN == 0;
+    shared->code = calloc(sections.count, sizeof(Instruction *));
+    shared->sizes = calloc(sections.count, sizeof(uint32_t));
+
+    if (sections.count > 0 && (shared->code == NULL || shared->sizes == NULL)) {
+        luapp_code_free(shared);
+        return 1;
+    }
+
+    /* The instructions follow the stack size, parameters, upvalues, vararg flag and their count */
+    for (uint32_t i = 0; i < sections.count; i++) {
+        uint32_t offset = read_uint32(index + i * sizeof(uint32_t));
+        uint32_t sizecode = end - offset >= 8 ? read_uint32(buffer + offset + 4) : 0;
+        const char *code = buffer + offset + 8;
+
+        if (sizecode > (end - offset - 8) / sizeof(Instruction)) {
+            luapp_code_free(shared);
+            return 1;
+        }
+
+        if (shared->aliased)
+            shared->code[i] = (Instruction *)code;
+        else if ((shared->code[i] = malloc(sizecode * sizeof(Instruction) + 1)) != NULL)
+            memcpy(shared->code[i], code, sizecode * sizeof(Instruction));
+        else {
+            luapp_code_free(shared);
+            return 1;
+        }
+
+        shared->sizes[i] = sizecode;
+        shared->count++;
+    }
+
+    return 0;
+}
+
+/* luapp_code_init() -- copies the instructions of every proto of a program out of its bytecode,
+ * outside of any state, so that all states loading it with luapp_loadshared() share one copy. From
+ * version 7 on they are used in place instead, the bytecode has to outlive them.
+ *      args: shared instructions, bytecode, size of the bytecode
+ *      rets: 0 on success, 1 if the version is not supported or memory ran out
+ */
+int32_t luapp_code_init(struct luapp_code *shared, const char *buffer, size_t size)
+{
+    ZIO z;
+    struct load_buffer data = {buffer, size};
+
+    shared->count = 0;
+    shared->code = NULL;
+    shared->sizes = NULL;
+    shared->aliased = 0;
+
+    /* Nothing is allocated from a state, the buffer reader does not need one */
+    luaZ_init(NULL, &z, buffer_reader, &data);
+
+    version_t version = read_type(&z, uint8_t);
+    if (!VERSION_ACCEPTABLE(version))
+        return 1;
+
+    if (version >= VERSION_7)
+        return code_init_sections(shared, buffer, size);
+    /* The strings belong to each state, they are interned there */
+    uint32_t string_count = read_size(&z);
+    for (uint32_t i = 0; i < string_count; i++)
+        skip_bytes(&z, read_size(&z));
+
+    uint32_t proto_count = read_size(&z);
+    shared->code = calloc(proto_count, sizeof(Instruction *));
+    shared->sizes = calloc(proto_count, sizeof(uint32_t));
+
+    if (proto_count > 0 && (shared->code == NULL || shared->sizes == NULL)) {
+        luapp_code_free(shared);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < proto_count; i++) {
+        /* Stack size, parameters, upvalues and the vararg flag */
+        skip_bytes(&z, 4);
+
+        uint32_t sizecode = read_size(&z);
+        Instruction *code = malloc(sizecode * sizeof(Instruction) + 1);
+
+        if (code == NULL) {
+            luapp_code_free(shared);
+            return 1;
+        }
+
+        if (luaZ_read(&z, code, sizecode * sizeof(Instruction)) != 0)
+            memset(code, 0, sizecode * sizeof(Instruction));
+
+        shared->code[i] = code;
+        shared->sizes[i] = sizecode;
+        shared->count++;
+
+        /* Skip the constant pool, it is read by every state */
+        uint32_t sizek = read_size(&z);
+        for (uint32_t j = 0; j < sizek; j++) {
+            switch (read_type(&z, uint8_t)) {
+                case CONSTANT_BOOLEAN:
+                    skip_bytes(&z, sizeof(uint8_t));
+                    break;
+                case CONSTANT_NUMBER:
+                    skip_bytes(&z, sizeof(double));
+                    break;
+                case CONSTANT_STRING:
+                    read_size(&z);
+                    break;
+                case CONSTANT_ENVIRONMENT:
+                    skip_bytes(&z, sizeof(uint32_t));
+                    break;
+            }
+        }
+
+        /* And the indices of the children */
+        if (version >= VERSION_3) {
+            uint32_t sizep = read_size(&z);
+            for (uint32_t j = 0; j < sizep; j++)
+                read_size(&z);
+        }
+
+        /* And the source lines, or from version 5 on their offset in the debug section */
+        if (version == VERSION_4) {
+            read_size(&z);
+            read_size(&z);
+
+            uint32_t sizelineinfo = read_size(&z);
+            for (uint32_t j = 0; j < sizelineinfo; j++)
+                read_size(&z);
+        } else if (version >= VERSION_5)
+            read_size(&z);
+    }
+
+    return 0;
+}
+
+/* luapp_code_free() -- releases the instructions copied by luapp_code_init(), no state using them
+ * may be left (the bytecode they point into may be released afterwards)
+ *      args: shared instructions
+ *      rets: none
+ */
+void luapp_code_free(struct luapp_code *shared)
+{
+    for (uint32_t i = 0; i < shared->count && !shared->aliased; i++)
+        free(shared->code[i]);
+
+    free(shared->code);
+    free(shared->sizes);
+    shared->code = NULL;
+    shared->sizes = NULL;
+    shared->count = 0;
+}
+
+/* luapp_image_release() -- drops a reference to an image, releasing it with the last one, called by
+ * luaF_freeproto() for the protos of the image
+ *      args: image
+ *      rets: none
+ */
+void luapp_image_release(struct luapp_image *image)
+{
+    if (--image->refs > 0)
+        return;
+
+#if LUAPP_USE_MMAP
+    if (image->kind == IMAGE_MAPPED)
+        munmap((void *)image->data, image->size);
+#endif
+    if (image->kind == IMAGE_OWNED)
+        free((void *)image->data);
+
+    free(image->strings);
+    free(image);
+}
+
+/* luapp_image_bytes() -- the bytecode of an image, snapshots embed it (see snapshot.h)
+ *      args: image, size of the bytecode (set)
+ *      rets: bytecode
+ */
+const char *luapp_image_bytes(const struct luapp_image *image, size_t *size)
+{
+    *size = image->size;
+    return image->data;
+}
+
+/* luapp_image_copy() -- makes an image out of a copy of the bytecode of a program of version 7 or
+ * later, its protos are created with luapp_image_stub()
+ *      args: bytecode, its size
+ *      rets: image holding a reference for the caller, or NULL if the bytecode is malformed or
+ *            memory ran out
+ */
+struct luapp_image *luapp_image_copy(const char *data, size_t size)
+{
+    version_t version = size > 0 ? (uint8_t)data[0] : 0;
+
+    if (version < VERSION_7 || !VERSION_ACCEPTABLE(version))
+        return NULL;
+
+    char *copy = malloc(size);
+    struct luapp_image *image = copy != NULL ? image_new(copy, size, IMAGE_OWNED, NULL) : NULL;
+
+    if (image == NULL) {
+        free(copy);
+        return NULL;
+    }
+
+    memcpy(copy, data, size);
+
+    if (read_sections(image->data, image->size, &image->sections) || read_string_table(image)) {
+        luapp_image_release(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/* luapp_image_stub() -- creates a stub of a proto of an image, like the ones of a loaded program
+ *      args: state, image, index of the proto, source of the program, its debug section (or NULL)
+ *      rets: proto or NULL if the image has no such proto
+ */
+Proto *luapp_image_stub(lua_State *L, struct luapp_image *image, lu_int32 index, TString *source,
+                        TString *debug)
+{
+    if (index >= image->sections.count)
+        return NULL;
+
+    Proto *p = new_stub(L, image, index);
+    p->source = source;
+    p->debug = debug;
+    return p;
+}
+
+/* luapp_image_debug() -- interns the debug section of an image, its stubs share it
+ *      args: state, image
+ *      rets: debug section or NULL if the program has none
+ */
+TString *luapp_image_debug(lua_State *L, const struct luapp_image *image)
+{
+    const struct load_sections *sections = &image->sections;
+
+    if (sections->size[BYTECODE_SECTION_DEBUG] == 0)
+        return NULL;
+
+    return luaS_newlstr(L, image->data + sections->offset[BYTECODE_SECTION_DEBUG],
+                        sections->size[BYTECODE_SECTION_DEBUG]);
+}
+
+/* luapp_image_count() -- the number of protos of an image
+ *      args: image
+ *      rets: number of protos
+ */
+lu_int32 luapp_image_count(const struct luapp_image *image)
+{
+    return image->sections.count;
+}
+
+int32_t luapp_loadpath(lua_State *L, const char *chunkname, const char *path)
+{
+#if LUAPP_USE_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        struct luapp_image *image =
+            map != MAP_FAILED ? image_new(map, st.st_size, IMAGE_MAPPED, NULL) : NULL;
+
+        if (image != NULL) {
+            ZIO z;
+            struct load_buffer data = {map, st.st_size};
+
+            close(fd);
+
+            /* Older versions copy everything out of the mapping, it goes as soon as it is loaded.
+             * The protos of later ones run from it and keep it. */
+            luaZ_init(L, &z, buffer_reader, &data);
+            int32_t status = luapp_load(L, chunkname, &z, NULL, image);
+            luapp_image_release(image);
+            return status;
+        }
+
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+    }
+
+    /* Fall back to reading the file (pipes, empty files, failed mappings, etc.) */
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    FILE *input = fopen(path, "rb");
+
+    if (input == NULL) {
+        lua_pushfstring(L, "cannot open %s", path);
+        return 1;
+    }
+
+    int32_t status = luapp_loadfile(L, chunkname, input);
+    fclose(input);
+    return status;
+}
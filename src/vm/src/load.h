@@ -0,0 +1,14 @@
+/*  load.h - only version
+ *      parts of the bytecode loader (load.c) that the other loaders of protos share, the
+ *      interpreter builds its protos from the IR (interpreter/loadir.c)
+ */
+
+#ifndef _LOAD_H
+#define _LOAD_H
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+
+void luapp_finish_proto(lua_State *L, Proto *p);
+
+#endif
@@ -15,6 +15,7 @@
 #include "lua.h"
 
 #include "lapi.h"
+#include "larray.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -354,6 +355,8 @@ LUA_API size_t lua_objlen(lua_State *L, int idx)
             return uvalue(o)->len;
         case LUA_TTABLE:
             return luaH_getn(hvalue(o));
+        case LUA_TARRAY:
+            return arrvalue(o)->size;
         case LUA_TNUMBER: {
             size_t l;
             lua_lock(L); /* `luaV_tostring' may create a new string */
@@ -401,6 +404,8 @@ LUA_API const void *lua_topointer(lua_State *L, int idx)
             return clvalue(o);
         case LUA_TTHREAD:
             return thvalue(o);
+        case LUA_TARRAY:
+            return arrvalue(o);
         case LUA_TUSERDATA:
         case LUA_TLIGHTUSERDATA:
             return lua_touserdata(L, idx);
@@ -409,6 +414,18 @@ LUA_API const void *lua_topointer(lua_State *L, int idx)
     }
 }
 
+LUA_API void *lua_toarray(lua_State *L, int idx, int *kind, int *size)
+{
+    StkId o = index2adr(L, idx);
+    if (!ttisarray(o))
+        return NULL;
+    if (kind)
+        *kind = arrvalue(o)->kind;
+    if (size)
+        *size = arrvalue(o)->size;
+    return arrvalue(o)->u.n; /* elements stay in place until the array grows */
+}
+
 /*
 ** push functions (C -> stack)
 */
@@ -576,6 +593,22 @@ LUA_API void lua_createtable(lua_State *L, int narray, int nrec)
     lua_unlock(L);
 }
 
+LUA_API void *lua_newarray(lua_State *L, int kind, int size)
+{
+    Array *a;
+    lua_lock(L);
+    api_check(L, (kind == LUA_ARRNUMBER || kind == LUA_ARRBOOLEAN) && size >= 0);
+    luaC_checkGC(L);
+    a = luaR_new(L, kind, size);
+    setarrvalue(L, L->top, a);
+    api_incr_top(L);
+    a->size = size;
+    if (size > 0) /* elements start as 0 or false */
+        memset(a->u.n, 0, size * arrayelemsize(kind));
+    lua_unlock(L);
+    return a->u.n;
+}
+
 LUA_API int lua_getmetatable(lua_State *L, int objindex)
 {
     const TValue *obj;
@@ -860,6 +893,43 @@ LUA_API int lua_cpcall(lua_State *L, lua_CFunction func, void *ud)
 //     return status;
 // }
 
+LUA_API const void *lua_toimage(lua_State *L, int idx, int *index)
+{
+    StkId o = index2adr(L, idx);
+    Proto *p;
+    if (!ttisfunction(o) || clvalue(o)->c.isC)
+        return NULL;
+    p = clvalue(o)->l.p;
+    if (p->image == NULL) /* bytecode before version 7 */
+        return NULL;
+    if (index)
+        *index = p->imageindex;
+    return p->image;
+}
+
+LUA_API int lua_pushimage(lua_State *L, const void *image, int index, const char *chunkname)
+{
+    struct luapp_image *img = (struct luapp_image *)image;
+    Closure *cl;
+    Proto *p;
+    int i;
+    lua_lock(L);
+    luaC_checkGC(L);
+    p = luapp_image_stub(L, img, index, luaS_new(L, chunkname), luapp_image_debug(L, img));
+    if (p == NULL) {
+        lua_unlock(L);
+        return 1;
+    }
+    cl = luaF_newLclosure(L, p->nups, hvalue(gt(L)));
+    cl->l.p = p;
+    for (i = 0; i < p->nups; i++) /* upvalues start closed, see lua_setupvalue */
+        cl->l.upvals[i] = luaF_newupval(L);
+    setclvalue(L, L->top, cl);
+    api_incr_top(L);
+    lua_unlock(L);
+    return 0;
+}
+
 LUA_API int lua_status(lua_State *L) { return L->status; }
 
 /*
@@ -919,6 +989,29 @@ LUA_API int lua_gc(lua_State *L, int what, int data)
             g->gcstepmul = data;
             break;
         }
+        case LUA_GCGEN:
+        case LUA_GCINC: {
+            /* data is the size of the young generation, in percent of the heap (0 keeps it) */
+            res = isgenerational(g) ? LUA_GCGEN : LUA_GCINC;
+            if (what == LUA_GCGEN && data > 0)
+                g->gcgenminor = data;
+            luaC_changemode(L, what == LUA_GCGEN ? KGC_GEN : KGC_NORMAL);
+            break;
+        }
+        case LUA_GCSWEEPER: { /* previous setting */
+            res = luaC_setsweeper(L, data);
+            break;
+        }
+        case LUA_GCLIMIT:
+        case LUA_GCSOFTLIMIT: { /* previous limit */
+            lu_mem *limit = what == LUA_GCLIMIT ? &g->memlimit : &g->memsoft;
+            res = cast_int(*limit >> 10);
+            if (data >= 0) {
+                *limit = cast(lu_mem, data) << 10;
+                luaM_setlimits(L, 1);
+            }
+            break;
+        }
         default:
             res = -1; /* invalid option */
     }
@@ -926,6 +1019,130 @@ LUA_API int lua_gc(lua_State *L, int what, int data)
     return res;
 }
 
+LUA_API void lua_gcstats(lua_State *L, lua_GCStats *stats, int reset)
+{
+    global_State *g;
+    lua_lock(L);
+    g = G(L);
+    if (stats != NULL)
+        *stats = g->gcstats;
+    if (reset)
+        memset(&g->gcstats, 0, sizeof(g->gcstats));
+    lua_unlock(L);
+}
+
+LUA_API void lua_gcusage(lua_State *L, lua_GCUsage *usage)
+{
+    lu_mem bytes[LUA_TUPVAL + 1];
+    lu_mem counted = 0;
+    int i;
+    lua_lock(L);
+    luaC_usage(L, bytes);
+    for (i = 0; i <= LUA_TUPVAL; i++)
+        counted += bytes[i];
+    usage->strings = bytes[LUA_TSTRING];
+    usage->tables = bytes[LUA_TTABLE];
+    usage->closures = bytes[LUA_TFUNCTION];
+    usage->protos = bytes[LUA_TPROTO];
+    usage->upvalues = bytes[LUA_TUPVAL];
+    usage->userdata = bytes[LUA_TUSERDATA];
+    usage->threads = bytes[LUA_TTHREAD];
+    usage->arrays = bytes[LUA_TARRAY];
+    usage->other = G(L)->totalbytes > counted ? G(L)->totalbytes - counted : 0;
+    lua_unlock(L);
+}
+
+/*
+** pseudo-random numbers: xoshiro256** (Blackman and Vigna), the upper 53
+** bits of an output make a number in [0, 1)
+*/
+
+#define rotl(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+#define tounit(x) (cast_num((x) >> 11) * (1.0 / 9007199254740992.0))
+
+static uint64_t nextrandom(uint64_t *s)
+{
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+LUA_API void lua_randomseed(lua_State *L, lua_Number seed)
+{
+    lua_lock(L);
+    luaE_seedrandom(G(L), seed);
+    lua_unlock(L);
+}
+
+LUA_API lua_Number lua_random(lua_State *L)
+{
+    lua_Number r;
+    lua_lock(L);
+    r = tounit(nextrandom(G(L)->random));
+    lua_unlock(L);
+    return r;
+}
+
+/* the generator state is kept in locals for the whole loop */
+LUA_API void lua_randomfill(lua_State *L, lua_Number *v, size_t n)
+{
+    uint64_t s[4];
+    size_t i;
+    lua_lock(L);
+    memcpy(s, G(L)->random, sizeof(s));
+    for (i = 0; i < n; i++)
+        v[i] = tounit(nextrandom(s));
+    memcpy(G(L)->random, s, sizeof(s));
+    lua_unlock(L);
+}
+
+/*
+** buffered standard output
+*/
+
+LUA_API void lua_writeoutput(lua_State *L, const char *s, size_t l)
+{
+    Mbuffer *b;
+    if (l == 0) /* `s' may be NULL then */
+        return;
+    lua_lock(L);
+    b = &G(L)->output;
+    if (luaZ_bufflen(b) + l > luaZ_sizebuffer(b)) {
+        size_t size = luaZ_sizebuffer(b) * 2;
+        if (size < LUAI_OUTPUTSIZE)
+            size = LUAI_OUTPUTSIZE;
+        if (size < luaZ_bufflen(b) + l)
+            size = luaZ_bufflen(b) + l;
+        luaZ_resizebuffer(L, b, size);
+    }
+    memcpy(luaZ_buffer(b) + luaZ_bufflen(b), s, l);
+    b->n += l;
+    lua_unlock(L);
+}
+
+/*
+** write the gathered output unless `force' is 0, less than LUAI_OUTPUTSIZE
+** bytes were gathered and stdout is not a terminal; returns 0 if writing
+** failed
+*/
+LUA_API int lua_flushoutput(lua_State *L, int force)
+{
+    global_State *g;
+    int res = 1;
+    lua_lock(L);
+    g = G(L);
+    if (force || g->outputtty || luaZ_bufflen(&g->output) >= LUAI_OUTPUTSIZE)
+        res = luaE_flushoutput(L);
+    lua_unlock(L);
+    return res;
+}
+
 /*
 ** miscellaneous functions
 */
@@ -939,6 +1156,22 @@ LUA_API int lua_error(lua_State *L)
     return 0; /* to avoid warnings */
 }
 
+/*
+** sort t[1..n] of the table at `idx' with the function at `comp' (0 for
+** `<'); returns 0 without touching it if they are not all in its array part
+*/
+LUA_API int lua_sort(lua_State *L, int idx, int n, int comp)
+{
+    StkId t;
+    int done;
+    lua_lock(L);
+    t = index2adr(L, idx);
+    api_check(L, ttistable(t));
+    done = luaH_sort(L, hvalue(t), n, comp != 0 ? index2adr(L, comp) : NULL);
+    lua_unlock(L);
+    return done;
+}
+
 LUA_API int lua_next(lua_State *L, int idx)
 {
     StkId t;
@@ -984,9 +1217,12 @@ LUA_API lua_Alloc lua_getallocf(lua_State *L, void **ud)
 
 LUA_API void lua_setallocf(lua_State *L, lua_Alloc f, void *ud)
 {
+    int sweeper;
     lua_lock(L);
+    sweeper = luaC_setsweeper(L, 0); /* the objects it was given go back to the old allocator */
     G(L)->ud = ud;
     G(L)->frealloc = f;
+    luaC_setsweeper(L, sweeper);
     lua_unlock(L);
 }
 
@@ -1002,7 +1238,7 @@ LUA_API void *lua_newuserdata(lua_State *L, size_t size)
     return u + 1;
 }
 
-static const char *aux_upvalue(StkId fi, int n, TValue **val)
+static const char *aux_upvalue(lua_State *L, StkId fi, int n, TValue **val)
 {
     Closure *f;
     if (!ttisfunction(fi))
@@ -1015,6 +1251,7 @@ static const char *aux_upvalue(StkId fi, int n, TValue **val)
         return "";
     } else {
         Proto *p = f->l.p;
+        luaG_loaddebug(L, p);
         if (!(1 <= n && n <= p->sizeupvalues))
             return NULL;
         *val = f->l.upvals[n - 1]->v;
@@ -1027,7 +1264,7 @@ LUA_API const char *lua_getupvalue(lua_State *L, int funcindex, int n)
     const char *name;
     TValue *val;
     lua_lock(L);
-    name = aux_upvalue(index2adr(L, funcindex), n, &val);
+    name = aux_upvalue(L, index2adr(L, funcindex), n, &val);
     if (name) {
         setobj2s(L, L->top, val);
         api_incr_top(L);
@@ -1044,7 +1281,7 @@ LUA_API const char *lua_setupvalue(lua_State *L, int funcindex, int n)
     lua_lock(L);
     fi = index2adr(L, funcindex);
     api_checknelems(L, 1);
-    name = aux_upvalue(fi, n, &val);
+    name = aux_upvalue(L, fi, n, &val);
     if (name) {
         L->top--;
         setobj(L, val, L->top);
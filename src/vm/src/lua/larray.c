@@ -0,0 +1,127 @@
+/*
+** Typed arrays
+** See Copyright Notice in lua.h
+*/
+
+/*
+** An array keeps the values of a statically typed Array<number> or
+** Array<boolean> unboxed and contiguous: 8 bytes per number instead of
+** the 16 of a TValue in the array part of a table, 1 byte per boolean.
+** Indices go from 1 to `size', storing right after the last element
+** appends to the array, every other index outside of it is an error.
+*/
+
+#define larray_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "larray.h"
+#include "ldebug.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "ltm.h"
+
+#define MINARRAYSIZE 4
+
+static const char *const kindnames[] = {"numbers", "booleans"};
+
+Array *luaR_new(lua_State *L, int kind, int space)
+{
+    Array *a = luaM_new(L, Array);
+    luaC_link(L, obj2gco(a), LUA_TARRAY);
+    a->kind = cast_byte(kind);
+    a->size = 0;
+    a->space = 0;
+    a->u.n = NULL;
+    if (space > 0)
+        luaR_resize(L, a, space);
+    return a;
+}
+
+void luaR_free(lua_State *L, Array *a)
+{
+    if (a->kind == ARRAY_NUMBER)
+        luaM_freearray(L, a->u.n, a->space, lua_Number);
+    else
+        luaM_freearray(L, a->u.b, a->space, lu_byte);
+    luaM_free(L, a);
+}
+
+void luaR_resize(lua_State *L, Array *a, int space)
+{
+    if (a->kind == ARRAY_NUMBER)
+        luaM_reallocvector(L, a->u.n, a->space, space, lua_Number);
+    else
+        luaM_reallocvector(L, a->u.b, a->space, space, lu_byte);
+    a->space = space;
+    if (a->size > space)
+        a->size = space;
+}
+
+/* 0-based position of `key', which has to be an integer from 1 to `limit' */
+static int arrayindex(lua_State *L, const Array *a, const TValue *key, int limit)
+{
+    lua_Number n;
+    int i;
+    if (!ttisnumber(key))
+        luaG_runerror(L, "attempt to index an array with a %s value", luaT_typenames[ttype(key)]);
+    n = nvalue(key);
+    lua_number2int(i, n);
+    if (cast_num(i) != n)
+        luaG_runerror(L, "array index " LUA_NUMBER_FMT " is not an integer", n);
+    if (i < 1 || i > limit)
+        luaG_runerror(L, "array index %d out of bounds (size %d)", i, a->size);
+    return i - 1;
+}
+
+/* stores a value at a 0-based position that is already part of the array */
+static void store(lua_State *L, Array *a, int i, const TValue *val)
+{
+    if (a->kind == ARRAY_NUMBER && ttisnumber(val))
+        a->u.n[i] = nvalue(val);
+    else if (a->kind == ARRAY_BOOLEAN && ttisboolean(val))
+        a->u.b[i] = cast_byte(bvalue(val) != 0);
+    else
+        luaG_runerror(L, "attempt to store a %s value in an array of %s",
+                      luaT_typenames[ttype(val)], kindnames[a->kind]);
+}
+
+void luaR_get(lua_State *L, const Array *a, const TValue *key, StkId val)
+{
+    int i = arrayindex(L, a, key, a->size);
+    if (a->kind == ARRAY_NUMBER) {
+        setnvalue(val, a->u.n[i]);
+    } else {
+        setbvalue(val, a->u.b[i]);
+    }
+}
+
+void luaR_set(lua_State *L, Array *a, const TValue *key, const TValue *val)
+{
+    int i = arrayindex(L, a, key, a->size + 1); /* one past the end appends */
+    if (i == a->size) {
+        if (a->size == a->space)
+            luaR_resize(L, a, a->space < MINARRAYSIZE ? MINARRAYSIZE : 2 * a->space);
+        store(L, a, i, val); /* checks the value before the array grows */
+        a->size++;
+    } else
+        store(L, a, i, val);
+}
+
+/* stores `n' values starting at the 0-based position `first', at most at the end of the array */
+void luaR_setlist(lua_State *L, Array *a, int first, StkId values, int n)
+{
+    int i;
+    if (first > a->size)
+        luaG_runerror(L, "array index %d out of bounds (size %d)", first + 1, a->size);
+    if (first + n > a->space)
+        luaR_resize(L, a, first + n);
+    for (i = 0; i < n; i++) {
+        store(L, a, first + i, values + i);
+        if (first + i == a->size)
+            a->size++;
+    }
+}
@@ -0,0 +1,21 @@
+/*
+** Typed arrays
+** See Copyright Notice in lua.h
+*/
+
+#ifndef larray_h
+#define larray_h
+
+#include "lobject.h"
+
+/* size in bytes of an element of an array of the given kind */
+#define arrayelemsize(kind) ((kind) == ARRAY_NUMBER ? sizeof(lua_Number) : sizeof(lu_byte))
+
+LUAI_FUNC Array *luaR_new(lua_State *L, int kind, int space);
+LUAI_FUNC void luaR_free(lua_State *L, Array *a);
+LUAI_FUNC void luaR_resize(lua_State *L, Array *a, int space);
+LUAI_FUNC void luaR_get(lua_State *L, const Array *a, const TValue *key, StkId val);
+LUAI_FUNC void luaR_set(lua_State *L, Array *a, const TValue *key, const TValue *val);
+LUAI_FUNC void luaR_setlist(lua_State *L, Array *a, int first, StkId values, int n);
+
+#endif
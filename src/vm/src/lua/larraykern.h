@@ -0,0 +1,116 @@
+/*
+** Kernels of the array library
+** See Copyright Notice in lua.h
+*/
+
+/*
+** Included by larraylib.c once for every instruction set, with
+**   vnumber        a vector of VLANES lua_Numbers
+**   vset(x)        a vector with every lane set to x
+**   vload(p)       load of VLANES unaligned numbers
+**   vstore(p, v)   store of VLANES unaligned numbers
+**   vadd, vmul     lane wise operations
+**   vmin(v, m)     lane wise `v < m ? v : m', NaNs in `v' are skipped
+**   vmax(v, m)     lane wise `v > m ? v : m'
+**   KERNEL(name)   name of a kernel for the instruction set
+**   KATTR          attributes of the kernels
+** The loops run two vectors at a time, so the sums and dot products are
+** made of 2*VLANES partial sums, added up at the end.
+*/
+
+KATTR static lua_Number KERNEL(sum)(const lua_Number *x, int n)
+{
+    vnumber s0 = vset(0), s1 = vset(0);
+    lua_Number lane[VLANES], s = 0;
+    int i;
+    for (i = 0; i + 2 * VLANES <= n; i += 2 * VLANES) {
+        s0 = vadd(s0, vload(x + i));
+        s1 = vadd(s1, vload(x + i + VLANES));
+    }
+    vstore(lane, vadd(s0, s1));
+    for (n -= i, x += i, i = 0; i < VLANES; i++)
+        s += lane[i];
+    for (i = 0; i < n; i++)
+        s += x[i];
+    return s;
+}
+
+KATTR static lua_Number KERNEL(dot)(const lua_Number *x, const lua_Number *y, int n)
+{
+    vnumber s0 = vset(0), s1 = vset(0);
+    lua_Number lane[VLANES], s = 0;
+    int i;
+    for (i = 0; i + 2 * VLANES <= n; i += 2 * VLANES) {
+        s0 = vadd(s0, vmul(vload(x + i), vload(y + i)));
+        s1 = vadd(s1, vmul(vload(x + i + VLANES), vload(y + i + VLANES)));
+    }
+    vstore(lane, vadd(s0, s1));
+    for (n -= i, x += i, y += i, i = 0; i < VLANES; i++)
+        s += lane[i];
+    for (i = 0; i < n; i++)
+        s += x[i] * y[i];
+    return s;
+}
+
+KATTR static lua_Number KERNEL(min)(const lua_Number *x, int n)
+{
+    vnumber m0 = vset(HUGE_VAL), m1 = vset(HUGE_VAL);
+    lua_Number lane[VLANES], m = HUGE_VAL;
+    int i;
+    for (i = 0; i + 2 * VLANES <= n; i += 2 * VLANES) {
+        m0 = vmin(vload(x + i), m0);
+        m1 = vmin(vload(x + i + VLANES), m1);
+    }
+    vstore(lane, vmin(m0, m1));
+    for (n -= i, x += i, i = 0; i < VLANES; i++)
+        m = lane[i] < m ? lane[i] : m;
+    for (i = 0; i < n; i++)
+        m = x[i] < m ? x[i] : m;
+    return m;
+}
+
+KATTR static lua_Number KERNEL(max)(const lua_Number *x, int n)
+{
+    vnumber m0 = vset(-HUGE_VAL), m1 = vset(-HUGE_VAL);
+    lua_Number lane[VLANES], m = -HUGE_VAL;
+    int i;
+    for (i = 0; i + 2 * VLANES <= n; i += 2 * VLANES) {
+        m0 = vmax(vload(x + i), m0);
+        m1 = vmax(vload(x + i + VLANES), m1);
+    }
+    vstore(lane, vmax(m0, m1));
+    for (n -= i, x += i, i = 0; i < VLANES; i++)
+        m = lane[i] > m ? lane[i] : m;
+    for (i = 0; i < n; i++)
+        m = x[i] > m ? x[i] : m;
+    return m;
+}
+
+KATTR static void KERNEL(scale)(lua_Number *x, lua_Number k, int n)
+{
+    vnumber vk = vset(k);
+    int i;
+    for (i = 0; i + VLANES <= n; i += VLANES)
+        vstore(x + i, vmul(vload(x + i), vk));
+    for (; i < n; i++)
+        x[i] *= k;
+}
+
+KATTR static void KERNEL(add)(lua_Number *x, const lua_Number *y, int n)
+{
+    int i;
+    for (i = 0; i + VLANES <= n; i += VLANES)
+        vstore(x + i, vadd(vload(x + i), vload(y + i)));
+    for (; i < n; i++)
+        x[i] += y[i];
+}
+
+KATTR static void KERNEL(fill)(lua_Number *x, lua_Number v, int n)
+{
+    vnumber vv = vset(v);
+    int i;
+    for (i = 0; i + VLANES <= n; i += VLANES)
+        vstore(x + i, vv);
+    for (; i < n; i++)
+        x[i] = v;
+}
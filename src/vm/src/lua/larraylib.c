@@ -0,0 +1,316 @@
+/*
+** Bulk operations over typed arrays
+** See Copyright Notice in lua.h
+*/
+
+#include <math.h>
+#include <string.h>
+
+#define larraylib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+/*
+** The kernels are compiled for the vector unit the build targets: SSE2
+** (always there on x86-64) or NEON (AArch64), 2 numbers per vector.  On
+** x86-64 with GCC or clang they are compiled for AVX2 as well, 4 numbers
+** per vector, and that version is picked at run time when the processor
+** has it, so the library needs no special compiler flags.  Anything else
+** (or numbers that are not doubles) gets the plain C version.
+*/
+#if defined(LUA_NUMBER_DOUBLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define ARRAY_BASE "sse2"
+#define vnumber __m128d
+#define VLANES 2
+#define vset(x) _mm_set1_pd(x)
+#define vload(p) _mm_loadu_pd(p)
+#define vstore(p, v) _mm_storeu_pd(p, v)
+#define vadd(a, b) _mm_add_pd(a, b)
+#define vmul(a, b) _mm_mul_pd(a, b)
+#define vmin(v, m) _mm_min_pd(v, m)
+#define vmax(v, m) _mm_max_pd(v, m)
+#elif defined(LUA_NUMBER_DOUBLE) && defined(__aarch64__)
+#include <arm_neon.h>
+#define ARRAY_BASE "neon"
+#define vnumber float64x2_t
+#define VLANES 2
+#define vset(x) vdupq_n_f64(x)
+#define vload(p) vld1q_f64(p)
+#define vstore(p, v) vst1q_f64(p, v)
+#define vadd(a, b) vaddq_f64(a, b)
+#define vmul(a, b) vmulq_f64(a, b)
+#define vmin(v, m) vminnmq_f64(v, m) /* the number wins over a NaN */
+#define vmax(v, m) vmaxnmq_f64(v, m)
+#else
+#define ARRAY_BASE "scalar"
+#define vnumber lua_Number
+#define VLANES 1
+#define vset(x) ((lua_Number)(x))
+#define vload(p) (*(p))
+#define vstore(p, v) (*(p) = (v))
+#define vadd(a, b) ((a) + (b))
+#define vmul(a, b) ((a) * (b))
+#define vmin(v, m) ((v) < (m) ? (v) : (m))
+#define vmax(v, m) ((v) > (m) ? (v) : (m))
+#endif
+
+#define KERNEL(name) name##_base
+#define KATTR
+#include "larraykern.h"
+#undef KERNEL
+#undef KATTR
+
+#if defined(LUA_NUMBER_DOUBLE) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#undef vnumber
+#undef VLANES
+#undef vset
+#undef vload
+#undef vstore
+#undef vadd
+#undef vmul
+#undef vmin
+#undef vmax
+#define vnumber __m256d
+#define VLANES 4
+#define vset(x) _mm256_set1_pd(x)
+#define vload(p) _mm256_loadu_pd(p)
+#define vstore(p, v) _mm256_storeu_pd(p, v)
+#define vadd(a, b) _mm256_add_pd(a, b)
+#define vmul(a, b) _mm256_mul_pd(a, b)
+#define vmin(v, m) _mm256_min_pd(v, m)
+#define vmax(v, m) _mm256_max_pd(v, m)
+
+#define KERNEL(name) name##_avx2
+#define KATTR __attribute__((target("avx2")))
+#include "larraykern.h"
+
+#define kernel(name) (__builtin_cpu_supports("avx2") ? name##_avx2 : name##_base)
+#define kernelname() (__builtin_cpu_supports("avx2") ? "avx2" : ARRAY_BASE)
+#else
+#define kernel(name) name##_base
+#define kernelname() ARRAY_BASE
+#endif
+
+static lua_Number *checknumbers(lua_State *L, int narg, int *size)
+{
+    int kind;
+    lua_Number *x = (lua_Number *)lua_toarray(L, narg, &kind, size);
+    if (lua_type(L, narg) != LUA_TARRAY || kind != LUA_ARRNUMBER)
+        luaL_typerror(L, narg, "array of numbers");
+    return x;
+}
+
+/* second array of numbers of a binary operation, of the same size as the first */
+static lua_Number *checkother(lua_State *L, int narg, int size)
+{
+    int other;
+    lua_Number *y = checknumbers(L, narg, &other);
+    luaL_argcheck(L, other == size, narg, "arrays of different sizes");
+    return y;
+}
+
+static int array_new(lua_State *L)
+{
+    int n = luaL_checkint(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "negative size");
+    if (lua_type(L, 2) == LUA_TBOOLEAN) {
+        int b = lua_toboolean(L, 2);
+        memset(lua_newarray(L, LUA_ARRBOOLEAN, n), b, n);
+    } else {
+        lua_Number v = luaL_optnumber(L, 2, 0);
+        lua_Number *x = (lua_Number *)lua_newarray(L, LUA_ARRNUMBER, n);
+        if (v != 0)
+            kernel(fill)(x, v, n);
+    }
+    return 1;
+}
+
+static int array_size(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TARRAY);
+    lua_pushinteger(L, lua_objlen(L, 1));
+    return 1;
+}
+
+static int array_sum(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    lua_pushnumber(L, kernel(sum)(x, n));
+    return 1;
+}
+
+static int array_dot(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    lua_Number *y = checkother(L, 2, n);
+    lua_pushnumber(L, kernel(dot)(x, y, n));
+    return 1;
+}
+
+/* NaNs are skipped, the result is nil for an empty array */
+static int array_min(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    if (n == 0)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, kernel(min)(x, n));
+    return 1;
+}
+
+static int array_max(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    if (n == 0)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, kernel(max)(x, n));
+    return 1;
+}
+
+static int array_scale(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    kernel(scale)(x, luaL_checknumber(L, 2), n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int array_add(lua_State *L)
+{
+    int n;
+    lua_Number *x = checknumbers(L, 1, &n);
+    kernel(add)(x, checkother(L, 2, n), n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int array_fill(lua_State *L)
+{
+    int kind, n;
+    void *x = lua_toarray(L, 1, &kind, &n);
+    luaL_checktype(L, 1, LUA_TARRAY);
+    if (kind == LUA_ARRBOOLEAN) {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        memset(x, lua_toboolean(L, 2), n);
+    } else
+        kernel(fill)((lua_Number *)x, luaL_checknumber(L, 2), n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int array_copy(lua_State *L)
+{
+    int kind, n;
+    void *y;
+    luaL_checktype(L, 1, LUA_TARRAY);
+    lua_toarray(L, 1, &kind, &n);
+    y = lua_newarray(L, kind, n); /* may run the collector, the source stays on the stack */
+    if (n > 0)
+        memcpy(y, lua_toarray(L, 1, NULL, NULL),
+               n * (kind == LUA_ARRNUMBER ? sizeof(lua_Number) : 1));
+    return 1;
+}
+
+/*
+** Sorting: NaNs are moved to the end first, so the quicksort of the rest
+** can rely on `<' being a total order.
+*/
+#define SORTCUTOFF 16
+
+#define swapnum(a, b)                                                                              \
+    {                                                                                              \
+        lua_Number t_ = (a);                                                                       \
+        (a) = (b);                                                                                 \
+        (b) = t_;                                                                                  \
+    }
+
+static void insertionsort(lua_Number *x, int lo, int up)
+{
+    int i, j;
+    for (i = lo + 1; i <= up; i++) {
+        lua_Number v = x[i];
+        for (j = i; j > lo && v < x[j - 1]; j--)
+            x[j] = x[j - 1];
+        x[j] = v;
+    }
+}
+
+static void quicksort(lua_Number *x, int lo, int up)
+{
+    while (up - lo >= SORTCUTOFF) {
+        int mid = lo + (up - lo) / 2, i = lo, j = up;
+        lua_Number p;
+        /* median of three, which also puts sentinels at both ends */
+        if (x[mid] < x[lo])
+            swapnum(x[mid], x[lo]);
+        if (x[up] < x[lo])
+            swapnum(x[up], x[lo]);
+        if (x[up] < x[mid])
+            swapnum(x[up], x[mid]);
+        p = x[mid];
+        for (;;) {
+            while (x[++i] < p)
+                ;
+            while (p < x[--j])
+                ;
+            if (i >= j)
+                break;
+            swapnum(x[i], x[j]);
+        }
+        /* recurse into the smaller half, so the stack stays logarithmic */
+        if (j - lo < up - j) {
+            quicksort(x, lo, j);
+            lo = j + 1;
+        } else {
+            quicksort(x, j + 1, up);
+            up = j;
+        }
+    }
+    insertionsort(x, lo, up);
+}
+
+static int array_sort(lua_State *L)
+{
+    int n, i, m = 0;
+    lua_Number *x = checknumbers(L, 1, &n);
+    for (i = 0; i < n; i++) { /* numbers first, NaNs last */
+        if (x[i] == x[i]) {
+            swapnum(x[m], x[i]);
+            m++;
+        }
+    }
+    if (m > 1)
+        quicksort(x, 0, m - 1);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const luaL_Reg arraylib[] = {{"add", array_add},     {"copy", array_copy},
+                                    {"dot", array_dot},     {"fill", array_fill},
+                                    {"max", array_max},     {"min", array_min},
+                                    {"new", array_new},     {"scale", array_scale},
+                                    {"size", array_size},   {"sort", array_sort},
+                                    {"sum", array_sum},     {NULL, NULL}};
+
+/*
+** Open array library
+*/
+LUALIB_API int luaopen_array(lua_State *L)
+{
+    luaL_register(L, LUA_ARRAYLIBNAME, arraylib);
+    lua_pushstring(L, kernelname());
+    lua_setfield(L, -2, "simd");
+    return 1;
+}
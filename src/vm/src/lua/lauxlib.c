@@ -150,6 +150,27 @@ LUALIB_API const char *luaL_checklstring(lua_State *L, int narg, size_t *len)
     return s;
 }
 
+/*
+** like luaL_checklstring, a view (see LUA_VIEWHANDLE) gives the string it
+** shows
+*/
+LUALIB_API const char *luaL_checklview(lua_State *L, int narg, size_t *len)
+{
+    if (lua_type(L, narg) == LUA_TUSERDATA && lua_getmetatable(L, narg)) {
+        int isview;
+        lua_getfield(L, LUA_REGISTRYINDEX, LUA_VIEWHANDLE);
+        isview = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (isview) {
+            luaL_View *v = (luaL_View *)lua_touserdata(L, narg);
+            if (len)
+                *len = v->l;
+            return v->s;
+        }
+    }
+    return luaL_checklstring(L, narg, len);
+}
+
 LUALIB_API const char *luaL_optlstring(lua_State *L, int narg, const char *def, size_t *len)
 {
     if (lua_isnoneornil(L, narg)) {
@@ -27,6 +27,17 @@ LUALIB_API void(luaL_setn)(lua_State *L, int t, int n);
 /* extra error code for `luaL_load' */
 #define LUA_ERRFILE (LUA_ERRERR + 1)
 
+/*
+** Views of strings held outside of Lua (the lines of io.lines(f, "*v")),
+** the string functions accept them where they take the subject
+*/
+#define LUA_VIEWHANDLE "VIEW*"
+
+typedef struct luaL_View {
+    const char *s; /* followed by a '\0' */
+    size_t l;
+} luaL_View;
+
 typedef struct luaL_Reg {
     const char *name;
     lua_CFunction func;
@@ -39,6 +50,7 @@ LUALIB_API int(luaL_callmeta)(lua_State *L, int obj, const char *e);
 LUALIB_API int(luaL_typerror)(lua_State *L, int narg, const char *tname);
 LUALIB_API int(luaL_argerror)(lua_State *L, int numarg, const char *extramsg);
 LUALIB_API const char *(luaL_checklstring)(lua_State *L, int numArg, size_t *l);
+LUALIB_API const char *(luaL_checklview)(lua_State *L, int numArg, size_t *l);
 LUALIB_API const char *(luaL_optlstring)(lua_State *L, int numArg, const char *def, size_t *l);
 LUALIB_API lua_Number(luaL_checknumber)(lua_State *L, int numArg);
 LUALIB_API lua_Number(luaL_optnumber)(lua_State *L, int nArg, lua_Number def);
@@ -18,30 +18,66 @@
 #include "lualib.h"
 
 /*
-** If your system does not support `stdout', you can just remove this function.
-** If you need, you can define your own `print' function, following this
-** model but changing `fputs' to put the strings at a proper place
-** (a console window or a log file, for instance).
+** push what `tostring' gives for the value at `idx'
+*/
+static void pushtostring(lua_State *L, int idx)
+{
+    if (luaL_callmeta(L, idx, "__tostring")) /* is there a metafield? */
+        return;                              /* use its value */
+    switch (lua_type(L, idx)) {
+        case LUA_TNUMBER:
+            lua_pushstring(L, lua_tostring(L, idx));
+            break;
+        case LUA_TSTRING:
+            lua_pushvalue(L, idx);
+            break;
+        case LUA_TBOOLEAN:
+            lua_pushstring(L, (lua_toboolean(L, idx) ? "true" : "false"));
+            break;
+        case LUA_TNIL:
+            lua_pushliteral(L, "nil");
+            break;
+        default:
+            lua_pushfstring(L, "%s: %p", luaL_typename(L, idx), lua_topointer(L, idx));
+            break;
+    }
+}
+
+/*
+** Numbers and strings are written as they are, other values are converted
+** as `tostring' converts them (without calling the global `tostring').
+** The output is gathered in the buffer of the state (see lua_writeoutput).
 */
 static int luaB_print(lua_State *L)
 {
     int n = lua_gettop(L); /* number of arguments */
     int i;
-    lua_getglobal(L, "tostring");
     for (i = 1; i <= n; i++) {
+        char buff[LUAI_MAXNUMBER2STR];
         const char *s;
-        lua_pushvalue(L, -1); /* function to be called */
-        lua_pushvalue(L, i);  /* value to print */
-        lua_call(L, 1, 1);
-        s = lua_tostring(L, -1); /* get result */
-        if (s == NULL)
-            return luaL_error(L, LUA_QL("tostring") " must return a string to " LUA_QL("print"));
+        size_t l;
+        int pushed = 0;
+        if (lua_type(L, i) == LUA_TNUMBER) {
+            l = lua_number2str(buff, lua_tonumber(L, i));
+            s = buff;
+        } else if (lua_type(L, i) == LUA_TSTRING)
+            s = lua_tolstring(L, i, &l);
+        else {
+            pushtostring(L, i);
+            s = lua_tolstring(L, -1, &l);
+            if (s == NULL)
+                return luaL_error(L,
+                                  LUA_QL("tostring") " must return a string to " LUA_QL("print"));
+            pushed = 1;
+        }
         if (i > 1)
-            fputs("\t", stdout);
-        fputs(s, stdout);
-        lua_pop(L, 1); /* pop result */
+            lua_writeoutput(L, "\t", 1);
+        lua_writeoutput(L, s, l);
+        if (pushed)
+            lua_pop(L, 1); /* pop result */
     }
-    fputs("\n", stdout);
+    lua_writeoutput(L, "\n", 1);
+    lua_flushoutput(L, 0);
     return 0;
 }
 
@@ -183,15 +219,116 @@ static int luaB_gcinfo(lua_State *L)
     return 1;
 }
 
+/* collectgarbage("stats") and collectgarbage("usage") are not lua_gc options */
+#define LUAB_GCSTATS (-1)
+#define LUAB_GCUSAGE (-2)
+
+/* upper bound of the bucket of the histogram that holds the given fraction of the steps */
+static lua_Number gcpercentile(const lua_GCStats *st, double fraction)
+{
+    size_t seen = 0;
+    int i;
+    for (i = 0; i < LUA_GCHISTSIZE; i++) {
+        seen += st->histogram[i];
+        if (seen > 0 && seen >= fraction * st->steps)
+            return (lua_Number)((size_t)2 << i);
+    }
+    return 0;
+}
+
+static void setfieldnum(lua_State *L, const char *name, lua_Number n)
+{
+    lua_pushnumber(L, n);
+    lua_setfield(L, -2, name);
+}
+
+static int gcstats(lua_State *L, int reset)
+{
+    static const char *const phases[] = {"pause", "propagate", "sweepstring", "sweep", "finalize"};
+    lua_GCStats st;
+    int i;
+    lua_gcstats(L, &st, reset);
+    lua_createtable(L, 0, 21);
+    setfieldnum(L, "steps", st.steps);
+    setfieldnum(L, "cycles", st.cycles);
+    setfieldnum(L, "fulls", st.fulls);
+    setfieldnum(L, "freed", st.freed);
+    setfieldnum(L, "swept", st.swept);
+    setfieldnum(L, "deferred", st.deferred);
+    setfieldnum(L, "steptime", st.steptime);
+    setfieldnum(L, "stepmax", st.stepmax);
+    setfieldnum(L, "atomics", st.atomics);
+    setfieldnum(L, "atomictime", st.atomictime);
+    setfieldnum(L, "atomicmax", st.atomicmax);
+    setfieldnum(L, "fulltime", st.fulltime);
+    setfieldnum(L, "fullmax", st.fullmax);
+    setfieldnum(L, "emergencies", st.emergencies);
+    setfieldnum(L, "p50", gcpercentile(&st, 0.5));
+    setfieldnum(L, "p90", gcpercentile(&st, 0.9));
+    setfieldnum(L, "p99", gcpercentile(&st, 0.99));
+    setfieldnum(L, "p999", gcpercentile(&st, 0.999));
+    lua_createtable(L, 0, LUA_GCPHASES);
+    for (i = 0; i < LUA_GCPHASES; i++) {
+        lua_createtable(L, 0, 2);
+        setfieldnum(L, "steps", st.phasesteps[i]);
+        setfieldnum(L, "time", st.phasetime[i]);
+        lua_setfield(L, -2, phases[i]);
+    }
+    lua_setfield(L, -2, "phases");
+    /* histogram[i] counts the steps that took [2^(i-1), 2^i) ns */
+    lua_createtable(L, LUA_GCHISTSIZE, 0);
+    for (i = 0; i < LUA_GCHISTSIZE; i++) {
+        lua_pushnumber(L, st.histogram[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "histogram");
+    return 1;
+}
+
+/* bytes held by each kind of object, see lua_gcusage */
+static int gcusage(lua_State *L)
+{
+    lua_GCUsage u;
+    lua_gcusage(L, &u);
+    lua_createtable(L, 0, 9);
+    setfieldnum(L, "strings", u.strings);
+    setfieldnum(L, "tables", u.tables);
+    setfieldnum(L, "closures", u.closures);
+    setfieldnum(L, "protos", u.protos);
+    setfieldnum(L, "upvalues", u.upvalues);
+    setfieldnum(L, "userdata", u.userdata);
+    setfieldnum(L, "threads", u.threads);
+    setfieldnum(L, "arrays", u.arrays);
+    setfieldnum(L, "other", u.other);
+    return 1;
+}
+
 static int luaB_collectgarbage(lua_State *L)
 {
-    static const char *const opts[] = {"stop", "restart",  "collect",    "count",
-                                       "step", "setpause", "setstepmul", NULL};
-    static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART,  LUA_GCCOLLECT,   LUA_GCCOUNT,
-                                  LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL};
+    static const char *const opts[] = {"stop",        "restart",  "collect",    "count",
+                                       "step",        "setpause", "setstepmul", "generational",
+                                       "incremental", "stats",    "sweeper",    "limit",
+                                       "softlimit",   "usage",    NULL};
+    static const int optsnum[] = {LUA_GCSTOP,      LUA_GCRESTART,  LUA_GCCOLLECT,    LUA_GCCOUNT,
+                                  LUA_GCSTEP,      LUA_GCSETPAUSE, LUA_GCSETSTEPMUL, LUA_GCGEN,
+                                  LUA_GCINC,       LUAB_GCSTATS,   LUA_GCSWEEPER,    LUA_GCLIMIT,
+                                  LUA_GCSOFTLIMIT, LUAB_GCUSAGE};
     int o = luaL_checkoption(L, 1, "collect", opts);
-    int ex = luaL_optint(L, 2, 0);
-    int res = lua_gc(L, optsnum[o], ex);
+    int ex, res;
+    if (optsnum[o] == LUA_GCSWEEPER) { /* second argument: whether to run it, true by default */
+        lua_pushboolean(L, lua_gc(L, LUA_GCSWEEPER, lua_isnoneornil(L, 2) || lua_toboolean(L, 2)));
+        return 1;
+    }
+    if (optsnum[o] == LUAB_GCUSAGE)
+        return gcusage(L);
+    if (optsnum[o] == LUA_GCLIMIT || optsnum[o] == LUA_GCSOFTLIMIT) { /* no size reads it */
+        lua_pushnumber(L, lua_gc(L, optsnum[o], luaL_optint(L, 2, -1)));
+        return 1;
+    }
+    ex = luaL_optint(L, 2, 0);
+    if (optsnum[o] == LUAB_GCSTATS) /* second argument: reset the counters after reading them */
+        return gcstats(L, ex);
+    res = lua_gc(L, optsnum[o], ex);
     switch (optsnum[o]) {
         case LUA_GCCOUNT: {
             int b = lua_gc(L, LUA_GCCOUNTB, 0);
@@ -202,6 +339,11 @@ static int luaB_collectgarbage(lua_State *L)
             lua_pushboolean(L, res);
             return 1;
         }
+        case LUA_GCGEN:
+        case LUA_GCINC: { /* previous mode */
+            lua_pushstring(L, res == LUA_GCGEN ? "generational" : "incremental");
+            return 1;
+        }
         default: {
             lua_pushnumber(L, res);
             return 1;
@@ -357,25 +499,7 @@ static int luaB_xpcall(lua_State *L)
 static int luaB_tostring(lua_State *L)
 {
     luaL_checkany(L, 1);
-    if (luaL_callmeta(L, 1, "__tostring")) /* is there a metafield? */
-        return 1;                          /* use its value */
-    switch (lua_type(L, 1)) {
-        case LUA_TNUMBER:
-            lua_pushstring(L, lua_tostring(L, 1));
-            break;
-        case LUA_TSTRING:
-            lua_pushvalue(L, 1);
-            break;
-        case LUA_TBOOLEAN:
-            lua_pushstring(L, (lua_toboolean(L, 1) ? "true" : "false"));
-            break;
-        case LUA_TNIL:
-            lua_pushliteral(L, "nil");
-            break;
-        default:
-            lua_pushfstring(L, "%s: %p", luaL_typename(L, 1), lua_topointer(L, 1));
-            break;
-    }
+    pushtostring(L, 1);
     return 1;
 }
 
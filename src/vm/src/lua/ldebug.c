@@ -41,8 +41,8 @@ static int currentline(lua_State *L, CallInfo *ci)
     int pc = currentpc(L, ci);
     if (pc < 0)
         return -1; /* only active lua functions have current-line information */
-    else
-        return getline(ci_func(ci)->l.p, pc);
+    luaG_loaddebug(L, ci_func(ci)->l.p);
+    return getline(ci_func(ci)->l.p, pc);
 }
 
 /*
@@ -95,6 +95,8 @@ static const char *findlocal(lua_State *L, CallInfo *ci, int n)
 {
     const char *name;
     Proto *fp = getluaproto(ci);
+    if (fp)
+        luaG_loaddebug(L, fp);
     if (fp && (name = luaF_getlocalname(fp, n, currentpc(L, ci))) != NULL)
         return name; /* is a local variable in a Lua function */
     else {
@@ -129,7 +131,7 @@ LUA_API const char *lua_setlocal(lua_State *L, const lua_Debug *ar, int n)
     return name;
 }
 
-static void funcinfo(lua_Debug *ar, Closure *cl)
+static void funcinfo(lua_State *L, lua_Debug *ar, Closure *cl)
 {
     if (cl->c.isC) {
         ar->source = "=[C]";
@@ -137,6 +139,7 @@ static void funcinfo(lua_Debug *ar, Closure *cl)
         ar->lastlinedefined = -1;
         ar->what = "C";
     } else {
+        luaG_loaddebug(L, cl->l.p);
         ar->source = getstr(cl->l.p->source);
         ar->linedefined = cl->l.p->linedefined;
         ar->lastlinedefined = cl->l.p->lastlinedefined;
@@ -161,8 +164,10 @@ static void collectvalidlines(lua_State *L, Closure *f)
         setnilvalue(L->top);
     } else {
         Table *t = luaH_new(L, 0, 0);
-        int *lineinfo = f->l.p->lineinfo;
+        int *lineinfo;
         int i;
+        luaG_loaddebug(L, f->l.p);
+        lineinfo = f->l.p->lineinfo;
         for (i = 0; i < f->l.p->sizelineinfo; i++)
             setbvalue(luaH_setnum(L, t, lineinfo[i]), 1);
         sethvalue(L, L->top, t);
@@ -180,7 +185,7 @@ static int auxgetinfo(lua_State *L, const char *what, lua_Debug *ar, Closure *f,
     for (; *what; what++) {
         switch (*what) {
             case 'S': {
-                funcinfo(ar, f);
+                funcinfo(L, ar, f);
                 break;
             }
             case 'l': {
@@ -491,6 +496,7 @@ static const char *getobjname(lua_State *L, CallInfo *ci, int stackpos, const ch
         Proto *p = ci_func(ci)->l.p;
         int pc = currentpc(L, ci);
         Instruction i;
+        luaG_loaddebug(L, p);
         *name = luaF_getlocalname(p, stackpos + 1, pc);
         if (*name) /* is a local? */
             return "local";
@@ -13,6 +13,21 @@
 
 #define getline(f, pc) (((f)->lineinfo) ? (f)->lineinfo[pc] : 0)
 
+/* Lua++ protos of recent bytecode are stubs until they are first called, and their lines and
+ * names are decoded from the debug section the first time they are needed (see load.c) */
+#define luaG_loadproto(L, p)                                                                       \
+    {                                                                                              \
+        if ((p)->lazy)                                                                             \
+            luapp_loadproto(L, p);                                                                 \
+    }
+
+#define luaG_loaddebug(L, p)                                                                       \
+    {                                                                                              \
+        luaG_loadproto(L, p);                                                                      \
+        if ((p)->debug != NULL)                                                                    \
+            luapp_loaddebug(L, p);                                                                 \
+    }
+
 #define resethookcount(L) (L->hookcount = L->basehookcount)
 
 LUAI_FUNC void luaG_typeerror(lua_State *L, const TValue *o, const char *opname);
@@ -23,6 +38,8 @@ LUAI_FUNC void luaG_runerror(lua_State *L, const char *fmt, ...);
 LUAI_FUNC void luaG_errormsg(lua_State *L);
 LUAI_FUNC int luaG_checkcode(const Proto *pt);
 LUAI_FUNC int luaG_checkopenop(Instruction i);
+LUAI_FUNC void luapp_loaddebug(lua_State *L, Proto *p);
+LUAI_FUNC void luapp_loadproto(lua_State *L, Proto *p);
 
 LUA_API void luaU_print(const Proto *f, int full);
 
@@ -27,6 +27,8 @@
 #include "lvm.h"
 #include "lzio.h"
 
+#include "../jit.h"
+
 /*
 ** {======================================================
 ** Error-recovery functions
@@ -215,6 +217,10 @@ static StkId adjust_varargs(lua_State *L, Proto *p, int actual)
         setnvalue(luaH_setstr(L, htab, luaS_newliteral(L, "n")), cast_num(nvar));
     }
 #endif
+    /* without extra arguments the frame looks like the one of a fixed
+    ** arity function, the fixed parameters stay where they are */
+    if (actual == nfixargs && htab == NULL)
+        return L->top - actual;
     /* move fixed parameters to final position */
     fixed = L->top - actual; /* first fixed argument */
     base = L->top;           /* final position of first argument */
@@ -263,6 +269,7 @@ int luaD_precall(lua_State *L, StkId func, int nresults)
         CallInfo *ci;
         StkId st, base;
         Proto *p = cl->p;
+        luaG_loadproto(L, p);
         luaD_checkstack(L, p->maxstacksize);
         func = restorestack(L, funcr);
         if (!p->is_vararg) { /* no varargs? */
@@ -291,6 +298,11 @@ int luaD_precall(lua_State *L, StkId func, int nresults)
             luaD_callhook(L, LUA_HOOKCALL, -1);
             L->savedpc--; /* correct 'pc' */
         }
+        luapp_jit_count(L, p);
+        if (p->native != NULL) { /* compiled (JIT or ahead of time)? it returns like a C function */
+            (*p->native)(L);
+            return PCRC;
+        }
         return PCRLUA;
     } else { /* if is a C function, call it */
         CallInfo *ci;
@@ -316,56 +328,38 @@ int luaD_precall(lua_State *L, StkId func, int nresults)
     }
 }
 
-int luapp_precall(lua_State *L, StkId func, int nresults)
+/*
+** Fast path of luaD_precall for calls from luapp_execute to a Lua function
+** with a fixed number of parameters: there is no call metamethod to try,
+** no varargs to adjust and no hook to call (the caller checked all of that)
+*/
+void luapp_precall(lua_State *L, StkId func, int nresults)
 {
-    Closure *ccl = clvalue(func);
-
-    /* Create new call info for the current function */
-    CallInfo *ci = inc_ci(L); /* 'enter' the function */
+    Proto *p = clvalue(func)->l.p;
+    CallInfo *ci;
+    StkId st, base;
+    luaG_loadproto(L, p);  /* decoding a stub allocates but never collects, `func' stays put */
+    luapp_jit_count(L, p); /* a proto compiled now runs natively from its next call */
+    if ((char *)L->stack_last - (char *)L->top <= p->maxstacksize * (int)sizeof(TValue)) {
+        ptrdiff_t funcr = savestack(L, func);
+        luaD_growstack(L, p->maxstacksize);
+        func = restorestack(L, funcr);
+    }
+    base = func + 1;
+    if (L->top > base + p->numparams)
+        L->top = base + p->numparams;
+    L->ci->savedpc = L->savedpc;
+    ci = inc_ci(L); /* now `enter' new function */
     ci->func = func;
-    ci->base = func + 1;
-    ci->top = L->top + ccl->stacksize;
-    ci->savedpc = NULL;
-    ci->nresults = nresults;
-
-    /* Update our base */
-    L->base = ci->base;
-
-    /* Make sure we have enough stack space for our func */
-    luaD_checkstack(L, ccl->l.p->maxstacksize);
+    L->base = ci->base = base;
+    ci->top = base + p->maxstacksize;
     lua_assert(ci->top <= L->stack_last);
-
-    /* We have a C function which we can call */
-    if (ccl->l.isC) {
-        /* Call the actual function */
-        lua_lock(L);
-        int32_t ret = ccl->c.f(L);
-        lua_unlock(L);
-
-        if (ret < 0) /* func yeilds */
-            return PCRYIELD;
-
-        /* ci is our callinfo, cip is our parent */
-        CallInfo *ci = L->ci;
-        CallInfo *cip = ci - 1;
-
-        StkId res = ci->func;
-        StkId vali = L->top - ret;
-        StkId valend = L->top;
-
-        int i;
-        for (i = nresults; i != 0 && vali < valend; i--)
-            setobj2s(L, res++, vali++);
-        while (i-- > 0)
-            setnilvalue(res++);
-
-        // pop the stack frame
-        L->ci = cip;
-        L->base = cip->base;
-        L->top = res;
-
-        return PCRC;
-    }
+    L->savedpc = p->code; /* starting point */
+    ci->tailcalls = 0;
+    ci->nresults = nresults;
+    for (st = L->top; st < ci->top; st++)
+        setnilvalue(st);
+    L->top = ci->top;
 }
 
 static StkId callrethooks(lua_State *L, StkId firstResult)
@@ -415,7 +409,7 @@ void luaD_call(lua_State *L, StkId func, int nResults)
             luaD_throw(L, LUA_ERRERR); /* error while handing stack error */
     }
     if (luaD_precall(L, func, nResults) == PCRLUA) /* is a Lua function? */
-        luaV_execute(L, 1);                        /* call it */
+        luapp_execute(L, 1);                       /* call it */
     L->nCcalls--;
     luaC_checkGC(L);
 }
@@ -475,6 +469,8 @@ LUA_API int lua_resume(lua_State *L, int nargs)
         status = L->status;
     }
     --L->nCcalls;
+    if (L == G(L)->mainthread) /* back in the host, write what was printed */
+        luaE_flushoutput(L);
     lua_unlock(L);
     return status;
 }
@@ -491,6 +487,12 @@ LUA_API int lua_yield(lua_State *L, int nresults)
     return -1;
 }
 
+/*
+** whether a C function running in `L' can yield (lua_yield raises an
+** error across metamethods and calls from C)
+*/
+LUA_API int lua_isyieldable(lua_State *L) { return L->nCcalls <= L->baseCcalls; }
+
 int luaD_pcall(lua_State *L, Pfunc func, void *u, ptrdiff_t old_top, ptrdiff_t ef)
 {
     int status;
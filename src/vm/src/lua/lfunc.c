@@ -17,6 +17,8 @@
 #include "lobject.h"
 #include "lstate.h"
 
+#include "../jit.h"
+
 Closure *luaF_newCclosure(lua_State *L, int nelems, Table *e)
 {
     Closure *c = cast(Closure *, luaM_malloc(L, sizeCclosure(nelems)));
@@ -115,11 +117,24 @@ Proto *luaF_newproto(lua_State *L)
     Proto *f = luaM_new(L, Proto);
     luaC_link(L, obj2gco(f), LUA_TPROTO);
     f->k = NULL;
+    f->gcache = NULL;
+    f->fcache = NULL;
     f->sizek = 0;
     f->p = NULL;
     f->sizep = 0;
     f->code = NULL;
     f->sizecode = 0;
+    f->sharedcode = 0;
+    f->native = NULL;
+    f->hotcount = 0;
+    f->mcode = NULL;
+    f->sizemcode = 0;
+    f->debug = NULL;
+    f->debugoffset = 0;
+    f->image = NULL;
+    f->imageindex = 0;
+    f->lazy = 0;
+    f->profile = NULL;
     f->sizelineinfo = 0;
     f->sizeupvalues = 0;
     f->nups = 0;
@@ -136,14 +151,43 @@ Proto *luaF_newproto(lua_State *L)
     return f;
 }
 
+void luaF_newgcache(lua_State *L, Proto *f)
+{
+    int i;
+    f->gcache = luaM_newvector(L, f->sizek, GlobalCache);
+    for (i = 0; i < f->sizek; i++) {
+        f->gcache[i].table = NULL;
+        f->gcache[i].slot = NULL;
+        f->gcache[i].stamp = 0;
+    }
+}
+
+void luaF_newfcache(lua_State *L, Proto *f)
+{
+    int i;
+    f->fcache = luaM_newvector(L, f->sizecode, FieldCache);
+    for (i = 0; i < f->sizecode; i++) {
+        f->fcache[i].shape = 0;
+        f->fcache[i].index = 0;
+        f->fcache[i].next = NULL;
+    }
+}
+
 void luaF_freeproto(lua_State *L, Proto *f)
 {
-    luaM_freearray(L, f->code, f->sizecode, Instruction);
+    if (!f->sharedcode)
+        luaM_freearray(L, f->code, f->sizecode, Instruction);
     luaM_freearray(L, f->p, f->sizep, Proto *);
     luaM_freearray(L, f->k, f->sizek, TValue);
+    luaM_freearray(L, f->gcache, f->gcache != NULL ? f->sizek : 0, GlobalCache);
+    luaM_freearray(L, f->fcache, f->fcache != NULL ? f->sizecode : 0, FieldCache);
     luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
     luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
     luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+    if (f->mcode != NULL)
+        luapp_jit_free(f);
+    if (f->image != NULL)
+        luapp_image_release(f->image);
     luaM_free(L, f);
 }
 
@@ -19,9 +19,18 @@ LUAI_FUNC Closure *luaF_newLclosure(lua_State *L, int nelems, Table *e);
 LUAI_FUNC UpVal *luaF_newupval(lua_State *L);
 LUAI_FUNC UpVal *luaF_findupval(lua_State *L, StkId level);
 LUAI_FUNC void luaF_close(lua_State *L, StkId level);
+LUAI_FUNC void luaF_newgcache(lua_State *L, Proto *f);
+LUAI_FUNC void luaF_newfcache(lua_State *L, Proto *f);
 LUAI_FUNC void luaF_freeproto(lua_State *L, Proto *f);
 LUAI_FUNC void luaF_freeclosure(lua_State *L, Closure *c);
 LUAI_FUNC void luaF_freeupval(lua_State *L, UpVal *uv);
 LUAI_FUNC const char *luaF_getlocalname(const Proto *func, int local_number, int pc);
+LUAI_FUNC void luapp_image_release(struct luapp_image *image);
+LUAI_FUNC const char *luapp_image_bytes(const struct luapp_image *image, size_t *size);
+LUAI_FUNC struct luapp_image *luapp_image_copy(const char *data, size_t size);
+LUAI_FUNC Proto *luapp_image_stub(lua_State *L, struct luapp_image *image, lu_int32 index,
+                                  TString *source, TString *debug);
+LUAI_FUNC TString *luapp_image_debug(lua_State *L, const struct luapp_image *image);
+LUAI_FUNC lu_int32 luapp_image_count(const struct luapp_image *image);
 
 #endif
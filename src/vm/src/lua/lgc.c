@@ -5,12 +5,14 @@
 */
 
 #include <string.h>
+#include <time.h>
 
 #define lgc_c
 #define LUA_CORE
 
 #include "lua.h"
 
+#include "larray.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -22,6 +24,10 @@
 #include "ltable.h"
 #include "ltm.h"
 
+#if defined(LUAI_SWEEPER)
+#include <pthread.h>
+#endif
+
 #define GCSTEPSIZE 1024u
 #define GCSWEEPMAX 40
 #define GCSWEEPCOST 10
@@ -56,6 +62,44 @@
     }
 
 #define setthreshold(g) (g->GCthreshold = (g->estimate / 100) * g->gcpause)
+#define setgenthreshold(g) (g->GCthreshold = (g->estimate / 100) * (100 + g->gcgenminor))
+
+/*
+** Generational mode (KGC_GEN): objects that survive a collection stay
+** marked instead of being turned white by the sweep, they are the old
+** generation and are neither traversed nor swept by the next cycles. Each
+** (minor) collection only marks the young, white objects reachable from
+** the roots and from the remembered set: the objects marked by
+** luaC_barrierf, the tables turned gray by luaC_barrierback, the threads
+** and the weak tables, which the markroot of this mode does not clear. Minor collections run
+** a whole cycle at once. Once the memory in use grew by `gcmajorinc'
+** percent since the last major collection, luaC_fullgc returns every
+** object to white and marks the whole heap again.
+*/
+
+/* monotonic clock of the telemetry, in nanoseconds */
+static lu_mem gcclock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return cast(lu_mem, now.tv_sec) * 1000000000u + cast(lu_mem, now.tv_nsec);
+}
+
+static void recordstep(global_State *g, int phase, lu_mem start)
+{
+    lua_GCStats *st = &g->gcstats;
+    lu_mem t = gcclock() - start;
+    int b = 0;
+    while (b < LUA_GCHISTSIZE - 1 && (t >> (b + 1)) != 0)
+        b++; /* floor(log2(t)) */
+    st->steps++;
+    st->steptime += t;
+    if (t > st->stepmax)
+        st->stepmax = t;
+    st->phasesteps[phase]++;
+    st->phasetime[phase] += t;
+    st->histogram[b]++;
+}
 
 static void removeentry(Node *n)
 {
@@ -72,6 +116,10 @@ static void reallymarkobject(global_State *g, GCObject *o)
         case LUA_TSTRING: {
             return;
         }
+        case LUA_TARRAY: {
+            gray2black(o); /* arrays hold no references */
+            return;
+        }
         case LUA_TUSERDATA: {
             Table *mt = gco2u(o)->metatable;
             gray2black(o); /* udata are never gray */
@@ -194,6 +242,11 @@ static int traversetable(global_State *g, Table *h)
                 markvalue(g, gval(n));
         }
     }
+    if (h->shape != NULL && !weakvalue) { /* keys of a shape are fixed strings */
+        i = h->shape->nkeys;
+        while (i--)
+            markvalue(g, &h->fields[i]);
+    }
     return weakkey || weakvalue;
 }
 
@@ -206,6 +259,8 @@ static void traverseproto(global_State *g, Proto *f)
     int i;
     if (f->source)
         stringmark(f->source);
+    if (f->debug)
+        stringmark(f->debug);
     for (i = 0; i < f->sizek; i++) /* mark literals */
         markvalue(g, &f->k[i]);
     for (i = 0; i < f->sizeupvalues; i++) { /* mark upvalue names */
@@ -285,7 +340,8 @@ static l_mem propagatemark(global_State *g)
             g->gray = h->gclist;
             if (traversetable(g, h)) /* table is weak? */
                 black2gray(o);       /* keep it gray */
-            return sizeof(Table) + sizeof(TValue) * h->sizearray + sizeof(Node) * sizenode(h);
+            return sizeof(Table) + sizeof(TValue) * (h->sizearray + h->sizefields) +
+                   sizeof(Node) * sizenode(h);
         }
         case LUA_TFUNCTION: {
             Closure *cl = gco2cl(o);
@@ -368,6 +424,14 @@ static void cleartable(GCObject *l)
                 removeentry(n);       /* remove entry from table */
             }
         }
+        if (h->shape != NULL && testbit(h->marked, VALUEWEAKBIT)) {
+            i = h->shape->nkeys;
+            while (i--) {
+                TValue *o = &h->fields[i];
+                if (iscleared(o, 0)) /* value was collected? */
+                    setnilvalue(o);  /* remove value */
+            }
+        }
         l = h->gclist;
     }
 }
@@ -387,6 +451,9 @@ static void freeobj(lua_State *L, GCObject *o)
         case LUA_TTABLE:
             luaH_free(L, gco2h(o));
             break;
+        case LUA_TARRAY:
+            luaR_free(L, gco2a(o));
+            break;
         case LUA_TTHREAD: {
             lua_assert(gco2th(o) != L && gco2th(o) != G(L)->mainthread);
             luaE_freethread(L, gco2th(o));
@@ -406,6 +473,253 @@ static void freeobj(lua_State *L, GCObject *o)
     }
 }
 
+/*
+** {======================================================
+** Sweeper: a thread of the state releasing the memory of the dead
+** objects the sweep phases unlink, so that a step only walks the lists.
+** Telling the dead from the living stays on the mutator, the only one
+** touching marks, lists and the string table; the sweeper gets objects
+** nothing reaches any more, already taken off `totalbytes'. Protos,
+** upvalues and threads are still freed by the step: freeing them touches
+** other objects. The allocator is shared, so every call of it holds
+** `alloc' while the sweeper runs.
+** =======================================================
+*/
+
+#if defined(LUAI_SWEEPER)
+
+typedef struct Sweeper {
+    global_State *g;
+    pthread_t thread;
+    pthread_mutex_t alloc; /* held around every call of `frealloc' */
+    pthread_mutex_t lock;  /* protects the fields below */
+    pthread_cond_t wake;   /* objects were queued or the thread has to stop */
+    GCObject *queue;       /* objects to release, linked by `next' */
+    int waiting;           /* the thread waits for `wake' */
+    int stop;
+    GCObject *batch; /* objects not queued yet (only the mutator uses them) */
+    GCObject *last;
+    int nbatch;
+} Sweeper;
+
+/* objects handed over at a time, the thread is woken up once for them */
+#define SWEEPERBATCH 512
+
+/* objects the thread releases in a row, holding `alloc' */
+#define SWEEPERGROUP 32
+
+static void release(Sweeper *s, void *block, size_t size)
+{
+    if (block != NULL)
+        (*s->g->frealloc)(s->g->ud, block, size, 0);
+}
+
+/* the blocks of the objects `deferobj' accepts, the sizes luaM was given */
+static void releaseobj(Sweeper *s, GCObject *o)
+{
+    switch (o->gch.tt) {
+        case LUA_TFUNCTION: {
+            Closure *c = gco2cl(o);
+            release(s, c, c->c.isC ? sizeCclosure(c->c.nupvalues) : sizeLclosure(c->l.nupvalues));
+            break;
+        }
+        case LUA_TTABLE: {
+            Table *t = gco2h(o);
+            if (!luaH_isdummy(t->node))
+                release(s, t->node, sizenode(t) * sizeof(Node));
+            release(s, t->array, t->sizearray * sizeof(TValue));
+            release(s, t->fields, t->sizefields * sizeof(TValue));
+            release(s, t, sizeof(Table));
+            break;
+        }
+        case LUA_TARRAY: {
+            Array *a = gco2a(o);
+            release(s, a->kind == ARRAY_NUMBER ? cast(void *, a->u.n) : cast(void *, a->u.b),
+                    a->space * arrayelemsize(a->kind));
+            release(s, a, sizeof(Array));
+            break;
+        }
+        case LUA_TSTRING:
+            release(s, o, sizestring(gco2ts(o)));
+            break;
+        case LUA_TUSERDATA:
+            release(s, o, sizeudata(gco2u(o)));
+            break;
+        default:
+            lua_assert(0);
+    }
+}
+
+static void *sweeperthread(void *ud)
+{
+    Sweeper *s = cast(Sweeper *, ud);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        GCObject *o = s->queue;
+        if (o == NULL) {
+            if (s->stop)
+                break;
+            s->waiting = 1;
+            pthread_cond_wait(&s->wake, &s->lock);
+            s->waiting = 0;
+            continue;
+        }
+        s->queue = NULL;
+        pthread_mutex_unlock(&s->lock);
+        while (o != NULL) {
+            int n = SWEEPERGROUP;
+            pthread_mutex_lock(&s->alloc);
+            for (; o != NULL && n > 0; n--) {
+                GCObject *next = o->gch.next;
+                releaseobj(s, o);
+                o = next;
+            }
+            pthread_mutex_unlock(&s->alloc);
+        }
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* hands an unlinked dead object over to the sweeper; returns 0 for the
+   kinds of objects freed right away */
+static int deferobj(global_State *g, GCObject *o)
+{
+    Sweeper *s = g->sweeper;
+    lu_mem size;
+    switch (o->gch.tt) {
+        case LUA_TFUNCTION: {
+            Closure *c = gco2cl(o);
+            size = c->c.isC ? sizeCclosure(c->c.nupvalues) : sizeLclosure(c->l.nupvalues);
+            break;
+        }
+        case LUA_TTABLE: {
+            Table *t = gco2h(o);
+            size = sizeof(Table) + (t->sizearray + t->sizefields) * sizeof(TValue);
+            if (!luaH_isdummy(t->node))
+                size += sizenode(t) * sizeof(Node);
+            break;
+        }
+        case LUA_TARRAY: {
+            Array *a = gco2a(o);
+            size = sizeof(Array) + a->space * arrayelemsize(a->kind);
+            break;
+        }
+        case LUA_TSTRING: {
+            g->strt.nuse--;
+            size = sizestring(gco2ts(o));
+            break;
+        }
+        case LUA_TUSERDATA: {
+            size = sizeudata(gco2u(o));
+            break;
+        }
+        default:
+            return 0;
+    }
+    g->totalbytes -= size;
+    g->gcstats.deferred++;
+    o->gch.next = s->batch;
+    if (s->batch == NULL)
+        s->last = o;
+    s->batch = o;
+    s->nbatch++;
+    return 1;
+}
+
+/* queues the objects unlinked so far, once there are enough of them or
+   `all' of them at the end of the sweep */
+static void flushsweeper(global_State *g, int all)
+{
+    Sweeper *s = g->sweeper;
+    if (s == NULL || s->batch == NULL || (!all && s->nbatch < SWEEPERBATCH))
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->last->gch.next = s->queue;
+    s->queue = s->batch;
+    if (s->waiting)
+        pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    s->batch = NULL;
+    s->nbatch = 0;
+}
+
+/*
+** starts or stops the sweeper; stopping it waits for the objects it was
+** given. Returns whether it was running, it stays stopped when the thread
+** can not be created
+*/
+int luaC_setsweeper(lua_State *L, int on)
+{
+    global_State *g = G(L);
+    Sweeper *s = g->sweeper;
+    if ((s != NULL) == (on != 0))
+        return s != NULL;
+    if (on) {
+        s = luaM_new(L, Sweeper);
+        s->g = g;
+        s->queue = s->batch = s->last = NULL;
+        s->waiting = s->stop = s->nbatch = 0;
+        pthread_mutex_init(&s->alloc, NULL);
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->wake, NULL);
+        if (pthread_create(&s->thread, NULL, sweeperthread, s) != 0) {
+            pthread_cond_destroy(&s->wake);
+            pthread_mutex_destroy(&s->lock);
+            pthread_mutex_destroy(&s->alloc);
+            luaM_free(L, s);
+            return 0;
+        }
+        g->sweeper = s;
+        return 0;
+    }
+    flushsweeper(g, 1);
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->alloc);
+    g->sweeper = NULL;
+    luaM_free(L, s);
+    return 1;
+}
+
+void *luaC_sweeperalloc(lua_State *L, void *block, size_t osize, size_t nsize)
+{
+    global_State *g = G(L);
+    Sweeper *s = g->sweeper;
+    pthread_mutex_lock(&s->alloc);
+    block = (*g->frealloc)(g->ud, block, osize, nsize);
+    pthread_mutex_unlock(&s->alloc);
+    return block;
+}
+
+#else
+
+#define deferobj(g, o) 0
+#define flushsweeper(g, all) ((void)0)
+
+int luaC_setsweeper(lua_State *L, int on)
+{
+    UNUSED(L);
+    UNUSED(on);
+    return 0;
+}
+
+void *luaC_sweeperalloc(lua_State *L, void *block, size_t osize, size_t nsize)
+{
+    global_State *g = G(L);
+    return (*g->frealloc)(g->ud, block, osize, nsize);
+}
+
+#endif
+
+/* }====================================================== */
+
 #define sweepwholelist(L, p) sweeplist(L, p, MAX_LUMEM)
 
 static GCObject **sweeplist(lua_State *L, GCObject **p, lu_mem count)
@@ -418,14 +732,17 @@ static GCObject **sweeplist(lua_State *L, GCObject **p, lu_mem count)
             sweepwholelist(L, &gco2th(curr)->openupval);
         if ((curr->gch.marked ^ WHITEBITS) & deadmask) { /* not dead? */
             lua_assert(!isdead(g, curr) || testbit(curr->gch.marked, FIXEDBIT));
-            makewhite(g, curr); /* make it white (for next cycle) */
+            if (!isgenerational(g))
+                makewhite(g, curr); /* make it white (for next cycle) */
             p = &curr->gch.next;
         } else { /* must erase `curr' */
             lua_assert(isdead(g, curr) || deadmask == bitmask(SFIXEDBIT));
+            g->gcstats.freed++;
             *p = curr->gch.next;
             if (curr == g->rootgc)          /* is the first element of the list? */
                 g->rootgc = curr->gch.next; /* adjust first */
-            freeobj(L, curr);
+            if (g->sweeper == NULL || !deferobj(g, curr))
+                freeobj(L, curr);
         }
     }
     return p;
@@ -486,10 +803,11 @@ void luaC_freeall(lua_State *L)
 {
     global_State *g = G(L);
     int i;
+    luaC_setsweeper(L, 0);                            /* the rest is freed right away */
     g->currentwhite = WHITEBITS | bitmask(SFIXEDBIT); /* mask to collect all elements */
     sweepwholelist(L, &g->rootgc);
-    for (i = 0; i < g->strt.size; i++) /* free all string lists */
-        sweepwholelist(L, &g->strt.hash[i]);
+    for (i = 0; i < luaS_nbuckets(&g->strt); i++) /* free all string lists */
+        sweepwholelist(L, luaS_bucket(&g->strt, i));
 }
 
 static void markmt(global_State *g)
@@ -504,8 +822,10 @@ static void markmt(global_State *g)
 static void markroot(lua_State *L)
 {
     global_State *g = G(L);
-    g->gray = NULL;
-    g->grayagain = NULL;
+    if (!isgenerational(g)) { /* they hold the remembered set otherwise */
+        g->gray = NULL;
+        g->grayagain = NULL;
+    }
     g->weak = NULL;
     markobject(g, g->mainthread);
     /* make global table be traversed before main stack */
@@ -529,6 +849,8 @@ static void atomic(lua_State *L)
 {
     global_State *g = G(L);
     size_t udsize; /* total size of userdata to be finalized */
+    lu_mem start = gcclock();
+    lu_mem t;
     /* remark occasional upvalues of (maybe) dead threads */
     remarkupvals(g);
     /* traverse objects cautch by write barrier and by 'remarkupvals' */
@@ -548,12 +870,27 @@ static void atomic(lua_State *L)
     marktmu(g);                        /* mark `preserved' userdata */
     udsize += propagateall(g);         /* remark, to propagate `preserveness' */
     cleartable(g->weak);               /* remove collected objects from weak tables */
+    if (isgenerational(g)) {
+        /* young objects in old weak tables may die, clear them in every cycle like threads */
+        GCObject *o = g->weak;
+        while (o != NULL) {
+            GCObject *next = gco2h(o)->gclist;
+            gco2h(o)->gclist = g->grayagain;
+            g->grayagain = o;
+            o = next;
+        }
+    }
     /* flip current white */
     g->currentwhite = cast_byte(otherwhite(g));
     g->sweepstrgc = 0;
     g->sweepgc = &g->rootgc;
     g->gcstate = GCSsweepstring;
     g->estimate = g->totalbytes - udsize; /* first estimate */
+    t = gcclock() - start;
+    g->gcstats.atomics++;
+    g->gcstats.atomictime += t;
+    if (t > g->gcstats.atomicmax)
+        g->gcstats.atomicmax = t;
 }
 
 static l_mem singlestep(lua_State *L)
@@ -575,22 +912,27 @@ static l_mem singlestep(lua_State *L)
         }
         case GCSsweepstring: {
             lu_mem old = g->totalbytes;
-            sweepwholelist(L, &g->strt.hash[g->sweepstrgc++]);
-            if (g->sweepstrgc >= g->strt.size) /* nothing more to sweep? */
+            sweepwholelist(L, luaS_bucket(&g->strt, g->sweepstrgc));
+            g->sweepstrgc++;
+            flushsweeper(g, 0);
+            if (g->sweepstrgc >= luaS_nbuckets(&g->strt)) /* nothing more to sweep? */
                 g->gcstate = GCSsweep;         /* end sweep-string phase */
             lua_assert(old >= g->totalbytes);
             g->estimate -= old - g->totalbytes;
+            g->gcstats.swept += old - g->totalbytes;
             return GCSWEEPCOST;
         }
         case GCSsweep: {
             lu_mem old = g->totalbytes;
             g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
+            flushsweeper(g, *g->sweepgc == NULL);
             if (*g->sweepgc == NULL) { /* nothing more to sweep? */
                 checkSizes(L);
                 g->gcstate = GCSfinalize; /* end sweep phase */
             }
             lua_assert(old >= g->totalbytes);
             g->estimate -= old - g->totalbytes;
+            g->gcstats.swept += old - g->totalbytes;
             return GCSWEEPMAX * GCSWEEPCOST;
         }
         case GCSfinalize: {
@@ -602,6 +944,7 @@ static l_mem singlestep(lua_State *L)
             } else {
                 g->gcstate = GCSpause; /* end collection */
                 g->gcdept = 0;
+                g->gcstats.cycles++;
                 return 0;
             }
         }
@@ -611,7 +954,20 @@ static l_mem singlestep(lua_State *L)
     }
 }
 
-void luaC_step(lua_State *L)
+static void generationalstep(lua_State *L)
+{
+    global_State *g = G(L);
+    if (g->estimate > (g->gcmajorbase / 100) * (100 + g->gcmajorinc))
+        luaC_fullgc(L); /* the old generation grew too much, major collection */
+    else {
+        do { /* minor collection */
+            singlestep(L);
+        } while (g->gcstate != GCSpause);
+        setgenthreshold(g);
+    }
+}
+
+static void incrementalstep(lua_State *L)
 {
     global_State *g = G(L);
     l_mem lim = (GCSTEPSIZE / 100) * g->gcstepmul;
@@ -635,9 +991,35 @@ void luaC_step(lua_State *L)
     }
 }
 
+void luaC_step(lua_State *L)
+{
+    global_State *g = G(L);
+    int phase = g->gcstate;
+    lu_mem start = gcclock();
+    if (g->memurgent) { /* the heap went past its soft limit (see luaM_realloc_) */
+        g->memurgent = 0;
+        g->gcstats.emergencies++;
+        luaC_fullgc(L);
+        luaM_setlimits(L, g->totalbytes <= g->memsoft);
+        return;
+    }
+    if (g->memsoft > 0 && g->memcheck != g->memsoft && g->totalbytes <= g->memsoft)
+        luaM_setlimits(L, 1); /* below the soft limit again, arm it */
+    if (g->strt.oldhash != NULL && phase != GCSsweepstring)
+        luaS_movebuckets(L, GCSWEEPMAX); /* keep resizing the string table */
+    if (isgenerational(g))
+        generationalstep(L);
+    else
+        incrementalstep(L);
+    recordstep(g, phase, start);
+}
+
 void luaC_fullgc(lua_State *L)
 {
     global_State *g = G(L);
+    lu_byte kind = g->gckind;
+    lu_mem start = gcclock();
+    lu_mem t;
     if (g->gcstate <= GCSpropagate) {
         /* reset sweep marks to sweep all elements (returning them to white) */
         g->sweepstrgc = 0;
@@ -649,26 +1031,133 @@ void luaC_fullgc(lua_State *L)
         g->gcstate = GCSsweepstring;
     }
     lua_assert(g->gcstate != GCSpause && g->gcstate != GCSpropagate);
-    /* finish any pending sweep phase */
+    /* finish any pending sweep phase, returning old objects to white too */
+    g->gckind = KGC_NORMAL;
     while (g->gcstate != GCSfinalize) {
         lua_assert(g->gcstate == GCSsweepstring || g->gcstate == GCSsweep);
         singlestep(L);
     }
+    g->gckind = kind;
     markroot(L);
     while (g->gcstate != GCSpause) {
         singlestep(L);
     }
-    setthreshold(g);
+    if (isgenerational(g)) {
+        g->gcmajorbase = g->estimate;
+        setgenthreshold(g);
+    } else
+        setthreshold(g);
+    t = gcclock() - start;
+    g->gcstats.fulls++;
+    g->gcstats.fulltime += t;
+    if (t > g->gcstats.fullmax)
+        g->gcstats.fullmax = t;
+}
+
+/*
+** bytes held by a live object, what freeing it gives back
+*/
+static lu_mem objsize(GCObject *o)
+{
+    switch (o->gch.tt) {
+        case LUA_TSTRING:
+            return sizestring(gco2ts(o));
+        case LUA_TUSERDATA:
+            return sizeudata(gco2u(o));
+        case LUA_TTABLE: {
+            Table *h = gco2h(o);
+            return sizeof(Table) + sizeof(TValue) * (h->sizearray + h->sizefields) +
+                   (luaH_isdummy(h->node) ? 0 : sizeof(Node) * sizenode(h));
+        }
+        case LUA_TFUNCTION: {
+            Closure *cl = gco2cl(o);
+            return cl->c.isC ? sizeCclosure(cl->c.nupvalues) : sizeLclosure(cl->l.nupvalues);
+        }
+        case LUA_TPROTO: {
+            Proto *f = gco2p(o);
+            return sizeof(Proto) + (f->sharedcode ? 0 : sizeof(Instruction) * f->sizecode) +
+                   sizeof(Proto *) * f->sizep + sizeof(TValue) * f->sizek +
+                   (f->gcache != NULL ? sizeof(GlobalCache) * f->sizek : 0) +
+                   (f->fcache != NULL ? sizeof(FieldCache) * f->sizecode : 0) +
+                   sizeof(int) * f->sizelineinfo + sizeof(struct LocVar) * f->sizelocvars +
+                   sizeof(TString *) * f->sizeupvalues;
+        }
+        case LUA_TUPVAL:
+            return sizeof(UpVal);
+        case LUA_TARRAY: {
+            Array *a = gco2a(o);
+            return sizeof(Array) +
+                   a->space * (a->kind == ARRAY_NUMBER ? sizeof(lua_Number) : sizeof(lu_byte));
+        }
+        case LUA_TTHREAD: {
+            lua_State *th = gco2th(o);
+            return sizeof(lua_State) + sizeof(TValue) * th->stacksize +
+                   sizeof(CallInfo) * th->size_ci;
+        }
+        default:
+            lua_assert(0);
+            return 0;
+    }
+}
+
+static void countlist(GCObject *o, lu_mem *bytes)
+{
+    for (; o != NULL; o = o->gch.next) {
+        bytes[o->gch.tt] += objsize(o);
+        if (o->gch.tt == LUA_TTHREAD) /* open upvalues are on the list of their thread */
+            countlist(gco2th(o)->openupval, bytes);
+    }
+}
+
+/*
+** bytes held by the objects of each type (indexed by tag, up to
+** LUA_TUPVAL): dead objects the collector did not sweep yet count, not the
+** ones handed over to the sweeper thread
+*/
+void luaC_usage(lua_State *L, lu_mem *bytes)
+{
+    global_State *g = G(L);
+    stringtable *tb = &g->strt;
+    GCObject *o;
+    int i;
+    for (i = 0; i <= LUA_TUPVAL; i++)
+        bytes[i] = 0;
+    countlist(g->rootgc, bytes); /* userdata come right after the main thread */
+    for (i = 0; i < tb->size; i++)
+        countlist(tb->hash[i], bytes);
+    for (i = tb->moved; tb->oldhash != NULL && i < tb->oldsize; i++)
+        countlist(tb->oldhash[i], bytes);
+    if ((o = g->tmudata) != NULL) { /* circular list of userdata to be finalized */
+        do {
+            o = o->gch.next;
+            bytes[o->gch.tt] += objsize(o);
+        } while (o != g->tmudata);
+    }
+    for (o = obj2gco(g->threadpool); o != NULL; o = gco2th(o)->gclist)
+        bytes[LUA_TTHREAD] += objsize(o);
+}
+
+void luaC_changemode(lua_State *L, int kind)
+{
+    global_State *g = G(L);
+    if (g->gckind == kind)
+        return;
+    /* finish the current cycle under the rules it started with */
+    while (g->gcstate != GCSpause)
+        singlestep(L);
+    /* a full collection leaves every live object marked (KGC_GEN) or white (KGC_NORMAL) */
+    g->gckind = cast_byte(kind);
+    luaC_fullgc(L);
 }
 
 void luaC_barrierf(lua_State *L, GCObject *o, GCObject *v)
 {
     global_State *g = G(L);
     lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-    lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
-    lua_assert(ttype(&o->gch) != LUA_TTABLE);
-    /* must keep invariant? */
-    if (g->gcstate == GCSpropagate)
+    lua_assert(isgenerational(g) || (g->gcstate != GCSfinalize && g->gcstate != GCSpause));
+    lua_assert(o->gch.tt != LUA_TTABLE);
+    /* must keep invariant? (always in generational mode, `v' joins the remembered set) */
+    if (g->gcstate == GCSpropagate || isgenerational(g))
         reallymarkobject(g, v); /* restore invariant */
     else                        /* don't mind */
         makewhite(g, o);        /* mark as white just to avoid other barriers */
@@ -679,7 +1168,7 @@ void luaC_barrierback(lua_State *L, Table *t)
     global_State *g = G(L);
     GCObject *o = obj2gco(t);
     lua_assert(isblack(o) && !isdead(g, o));
-    lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
+    lua_assert(isgenerational(g) || (g->gcstate != GCSfinalize && g->gcstate != GCSpause));
     black2gray(o); /* make table gray (again) */
     t->gclist = g->grayagain;
     g->grayagain = o;
@@ -701,7 +1190,7 @@ void luaC_linkupval(lua_State *L, UpVal *uv)
     o->gch.next = g->rootgc; /* link upvalue into `rootgc' list */
     g->rootgc = o;
     if (isgray(o)) {
-        if (g->gcstate == GCSpropagate) {
+        if (g->gcstate == GCSpropagate || isgenerational(g)) {
             gray2black(o); /* closed upvalues need barrier */
             luaC_barrier(L, uv, uv->v);
         } else { /* sweep phase: sweep it (turning it into white) */
@@ -69,6 +69,8 @@
 
 #define luaC_white(g) cast(lu_byte, (g)->currentwhite &WHITEBITS)
 
+#define isgenerational(g) ((g)->gckind == KGC_GEN)
+
 #define luaC_checkGC(L)                                                                            \
     {                                                                                              \
         condhardstacktests(luaD_reallocstack(L, L->stacksize - EXTRA_STACK - 1));                  \
@@ -105,9 +107,13 @@ LUAI_FUNC void luaC_callGCTM(lua_State *L);
 LUAI_FUNC void luaC_freeall(lua_State *L);
 LUAI_FUNC void luaC_step(lua_State *L);
 LUAI_FUNC void luaC_fullgc(lua_State *L);
+LUAI_FUNC void luaC_changemode(lua_State *L, int kind);
+LUAI_FUNC void luaC_usage(lua_State *L, lu_mem *bytes);
 LUAI_FUNC void luaC_link(lua_State *L, GCObject *o, lu_byte tt);
 LUAI_FUNC void luaC_linkupval(lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_barrierf(lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback(lua_State *L, Table *t);
+LUAI_FUNC int luaC_setsweeper(lua_State *L, int on);
+LUAI_FUNC void *luaC_sweeperalloc(lua_State *L, void *block, size_t osize, size_t nsize);
 
 #endif
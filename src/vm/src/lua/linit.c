@@ -18,6 +18,9 @@ static const luaL_Reg lualibs[] = {{"", luaopen_base},
                                    {LUA_OSLIBNAME, luaopen_os},
                                    {LUA_STRLIBNAME, luaopen_string},
                                    {LUA_MATHLIBNAME, luaopen_math},
+                                   {LUA_ARRAYLIBNAME, luaopen_array},
+                                   {LUA_SCHEDLIBNAME, luaopen_sched},
+                                   {LUA_PARALLELLIBNAME, luaopen_parallel},
                                    {LUA_DBLIBNAME, luaopen_debug},
                                    {NULL, NULL}};
 
@@ -150,12 +150,24 @@ static int io_tostring(lua_State *L)
     return 1;
 }
 
+/*
+** files opened for reading get a buffer of LUAL_READBUFSIZE, the stdio
+** buffer is set before any other operation on the file
+*/
+static FILE *openfile(const char *filename, const char *mode)
+{
+    FILE *f = fopen(filename, mode);
+    if (f != NULL && mode[0] == 'r')
+        setvbuf(f, NULL, _IOFBF, LUAL_READBUFSIZE);
+    return f;
+}
+
 static int io_open(lua_State *L)
 {
     const char *filename = luaL_checkstring(L, 1);
     const char *mode = luaL_optstring(L, 2, "r");
     FILE **pf = newfile(L);
-    *pf = fopen(filename, mode);
+    *pf = openfile(filename, mode);
     return (*pf == NULL) ? pushresult(L, 0, filename) : 1;
 }
 
@@ -168,6 +180,7 @@ static int io_popen(lua_State *L)
     const char *filename = luaL_checkstring(L, 1);
     const char *mode = luaL_optstring(L, 2, "r");
     FILE **pf = newfile(L);
+    lua_flushoutput(L, 1); /* the command may write to stdout as well */
     *pf = lua_popen(L, filename, mode);
     return (*pf == NULL) ? pushresult(L, 0, filename) : 1;
 }
@@ -195,7 +208,7 @@ static int g_iofile(lua_State *L, int f, const char *mode)
         const char *filename = lua_tostring(L, 1);
         if (filename) {
             FILE **pf = newfile(L);
-            *pf = fopen(filename, mode);
+            *pf = openfile(filename, mode);
             if (*pf == NULL)
                 fileerror(L, 1, filename);
         } else {
@@ -215,17 +228,63 @@ static int io_output(lua_State *L) { return g_iofile(L, IO_OUTPUT, "w"); }
 
 static int io_readline(lua_State *L);
 
-static void aux_lines(lua_State *L, int idx, int toclose)
+/*
+** state of a lines iterator, it is also the view (see LUA_VIEWHANDLE) of
+** the last line it read when the lines are read as views ("*v")
+*/
+typedef struct LineReader {
+    luaL_View view;
+    char *buffer; /* allocated by lua_getline */
+    size_t size;
+} LineReader;
+
+static void reader_free(LineReader *r)
 {
+    free(r->buffer);
+    r->buffer = NULL;
+    r->size = 0;
+    r->view.s = "";
+    r->view.l = 0;
+}
+
+static int reader_gc(lua_State *L)
+{
+    reader_free((LineReader *)luaL_checkudata(L, 1, LUA_VIEWHANDLE));
+    return 0;
+}
+
+/*
+** what print and io.write gathered (see lua_writeoutput) goes out before
+** stdout is used directly, and before reading stdin so prompts show up
+*/
+static void syncoutput(lua_State *L, FILE *f)
+{
+    if (f == stdout || f == stdin)
+        lua_flushoutput(L, 1);
+}
+
+static void aux_lines(lua_State *L, int idx, int toclose, int fmt)
+{
+    static const char *const formats[] = {"*l", "*v", NULL};
+    int view = luaL_checkoption(L, fmt, "*l", formats);
+    LineReader *r;
     lua_pushvalue(L, idx);
     lua_pushboolean(L, toclose); /* close/not close file when finished */
-    lua_pushcclosure(L, io_readline, 2);
+    r = (LineReader *)lua_newuserdata(L, sizeof(LineReader));
+    r->view.s = "";
+    r->view.l = 0;
+    r->buffer = NULL;
+    r->size = 0;
+    luaL_getmetatable(L, LUA_VIEWHANDLE);
+    lua_setmetatable(L, -2);
+    lua_pushboolean(L, view); /* lines as views? */
+    lua_pushcclosure(L, io_readline, 4);
 }
 
 static int f_lines(lua_State *L)
 {
     tofile(L); /* check that it's a valid file handle */
-    aux_lines(L, 1, 0);
+    aux_lines(L, 1, 0, 2);
     return 1;
 }
 
@@ -238,10 +297,10 @@ static int io_lines(lua_State *L)
     } else {
         const char *filename = luaL_checkstring(L, 1);
         FILE **pf = newfile(L);
-        *pf = fopen(filename, "r");
+        *pf = openfile(filename, "r");
         if (*pf == NULL)
             fileerror(L, 1, filename);
-        aux_lines(L, lua_gettop(L), 1);
+        aux_lines(L, lua_gettop(L), 1, 2);
         return 1;
     }
 }
@@ -318,6 +377,7 @@ static int g_read(lua_State *L, FILE *f, int first)
     int nargs = lua_gettop(L) - 1;
     int success;
     int n;
+    syncoutput(L, f);
     clearerr(f);
     if (nargs == 0) { /* no arguments? */
         success = read_line(L, f);
@@ -362,18 +422,54 @@ static int io_read(lua_State *L) { return g_read(L, getiofile(L, IO_INPUT), 1);
 
 static int f_read(lua_State *L) { return g_read(L, tofile(L), 2); }
 
+#if !defined(lua_getline)
+/* lua_getline with fgets */
+static long fgetline(char **buffer, size_t *size, FILE *f)
+{
+    size_t l = 0;
+    for (;;) {
+        if (*size - l < LUAL_BUFFERSIZE) {
+            size_t n = *size + LUAL_BUFFERSIZE;
+            char *b = (char *)realloc(*buffer, n);
+            if (b == NULL)
+                return -1;
+            *buffer = b;
+            *size = n;
+        }
+        if (fgets(*buffer + l, (int)(*size - l), f) == NULL)
+            return (l > 0) ? (long)l : -1;
+        l += strlen(*buffer + l);
+        if (l > 0 && (*buffer)[l - 1] == '\n')
+            return (long)l;
+    }
+}
+#define lua_getline(b, sz, f) fgetline(b, sz, f)
+#endif
+
 static int io_readline(lua_State *L)
 {
     FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
-    int sucess;
+    LineReader *r = (LineReader *)lua_touserdata(L, lua_upvalueindex(3));
+    long l;
     if (f == NULL) /* file is already closed? */
         luaL_error(L, "file is already closed");
-    sucess = read_line(L, f);
+    syncoutput(L, f);
+    l = (long)lua_getline(&r->buffer, &r->size, f);
     if (ferror(f))
         return luaL_error(L, "%s", strerror(errno));
-    if (sucess)
+    if (l >= 0) {
+        if (l > 0 && r->buffer[l - 1] == '\n')
+            r->buffer[--l] = '\0'; /* the newline is not part of the line */
+        if (!lua_toboolean(L, lua_upvalueindex(4))) {
+            lua_pushlstring(L, r->buffer, l);
+            return 1;
+        }
+        r->view.s = r->buffer; /* valid until the next line is read */
+        r->view.l = l;
+        lua_pushvalue(L, lua_upvalueindex(3));
         return 1;
-    else {                                           /* EOF */
+    } else { /* EOF */
+        reader_free(r);
         if (lua_toboolean(L, lua_upvalueindex(2))) { /* generator created file? */
             lua_settop(L, 0);
             lua_pushvalue(L, lua_upvalueindex(1));
@@ -389,10 +485,25 @@ static int g_write(lua_State *L, FILE *f, int arg)
 {
     int nargs = lua_gettop(L) - 1;
     int status = 1;
+    if (f == stdout) { /* gathered with what print writes */
+        for (; nargs--; arg++) {
+            char buff[LUAI_MAXNUMBER2STR];
+            size_t l;
+            const char *s;
+            if (lua_type(L, arg) == LUA_TNUMBER) {
+                l = lua_number2str(buff, lua_tonumber(L, arg));
+                s = buff;
+            } else
+                s = luaL_checklstring(L, arg, &l);
+            lua_writeoutput(L, s, l);
+        }
+        return pushresult(L, lua_flushoutput(L, 0), NULL);
+    }
     for (; nargs--; arg++) {
         if (lua_type(L, arg) == LUA_TNUMBER) {
-            /* optimization: could be done exactly as for strings */
-            status = status && fprintf(f, LUA_NUMBER_FMT, lua_tonumber(L, arg)) > 0;
+            char buff[LUAI_MAXNUMBER2STR];
+            size_t l = lua_number2str(buff, lua_tonumber(L, arg));
+            status = status && (fwrite(buff, sizeof(char), l, f) == l);
         } else {
             size_t l;
             const char *s = luaL_checklstring(L, arg, &l);
@@ -412,6 +523,7 @@ static int f_seek(lua_State *L)
     static const char *const modenames[] = {"set", "cur", "end", NULL};
     FILE *f = tofile(L);
     int op = luaL_checkoption(L, 2, "cur", modenames);
+    syncoutput(L, f);
     long offset = luaL_optlong(L, 3, 0);
     op = fseek(f, offset, mode[op]);
     if (op)
@@ -429,16 +541,21 @@ static int f_setvbuf(lua_State *L)
     FILE *f = tofile(L);
     int op = luaL_checkoption(L, 2, NULL, modenames);
     lua_Integer sz = luaL_optinteger(L, 3, LUAL_BUFFERSIZE);
-    int res = setvbuf(f, NULL, mode[op], sz);
+    int res;
+    syncoutput(L, f);
+    res = setvbuf(f, NULL, mode[op], sz);
     return pushresult(L, res == 0, NULL);
 }
 
-static int io_flush(lua_State *L)
+static int aux_flush(lua_State *L, FILE *f)
 {
-    return pushresult(L, fflush(getiofile(L, IO_OUTPUT)) == 0, NULL);
+    int ok = f != stdout || lua_flushoutput(L, 1);
+    return pushresult(L, fflush(f) == 0 && ok, NULL);
 }
 
-static int f_flush(lua_State *L) { return pushresult(L, fflush(tofile(L)) == 0, NULL); }
+static int io_flush(lua_State *L) { return aux_flush(L, getiofile(L, IO_OUTPUT)); }
+
+static int f_flush(lua_State *L) { return aux_flush(L, tofile(L)); }
 
 static const luaL_Reg iolib[] = {{"close", io_close}, {"flush", io_flush}, {"input", io_input},
                                  {"lines", io_lines}, {"open", io_open},   {"output", io_output},
@@ -453,6 +570,10 @@ static const luaL_Reg flib[] = {
 
 static void createmeta(lua_State *L)
 {
+    luaL_newmetatable(L, LUA_VIEWHANDLE); /* line readers (methods set by lstrlib.c) */
+    lua_pushcfunction(L, reader_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
     luaL_newmetatable(L, LUA_FILEHANDLE); /* create metatable for file handles */
     lua_pushvalue(L, -1);                 /* push metatable */
     lua_setfield(L, -2, "__index");       /* metatable.__index = metatable */
@@ -5,7 +5,6 @@
 */
 
 #include <math.h>
-#include <stdlib.h>
 
 #define lmathlib_c
 #define LUA_LIB
@@ -196,11 +195,10 @@ static int math_max(lua_State *L)
     return 1;
 }
 
+/* the numbers come from the generator of the state, see lua_random */
 static int math_random(lua_State *L)
 {
-    /* the `%' avoids the (rare) case of r==1, and is needed also because on
-       some systems (SunOS!) `rand()' may return a value larger than RAND_MAX */
-    lua_Number r = (lua_Number)(rand() % RAND_MAX) / (lua_Number)RAND_MAX;
+    lua_Number r = lua_random(L);
     switch (lua_gettop(L)) {      /* check number of arguments */
         case 0: {                 /* no arguments */
             lua_pushnumber(L, r); /* Number between 0 and 1 */
@@ -227,10 +225,54 @@ static int math_random(lua_State *L)
 
 static int math_randomseed(lua_State *L)
 {
-    srand(luaL_checkint(L, 1));
+    lua_randomseed(L, luaL_checknumber(L, 1));
     return 0;
 }
 
+/*
+** math.randomfill(a [, n [, [m,] u]]) sets the first n elements of an array
+** of numbers (all of them by default) to what n calls of math.random with
+** the bounds would return, in one pass over the array
+*/
+static int math_randomfill(lua_State *L)
+{
+    int kind, size, n, i;
+    lua_Number *x = (lua_Number *)lua_toarray(L, 1, &kind, &size);
+    lua_Number l = 1, w = 0;
+    if (lua_type(L, 1) != LUA_TARRAY || kind != LUA_ARRNUMBER)
+        luaL_typerror(L, 1, "array of numbers");
+    n = luaL_optint(L, 2, size);
+    luaL_argcheck(L, 0 <= n && n <= size, 2, "out of range");
+    switch (lua_gettop(L)) {
+        case 1:
+        case 2:
+            break;
+        case 3: { /* only upper limit */
+            int u = luaL_checkint(L, 3);
+            luaL_argcheck(L, 1 <= u, 3, "interval is empty");
+            w = u;
+            break;
+        }
+        case 4: { /* lower and upper limits */
+            int m = luaL_checkint(L, 3);
+            int u = luaL_checkint(L, 4);
+            luaL_argcheck(L, m <= u, 4, "interval is empty");
+            l = m;
+            w = (lua_Number)u - m + 1;
+            break;
+        }
+        default:
+            return luaL_error(L, "wrong number of arguments");
+    }
+    lua_randomfill(L, x, n);
+    if (w != 0) {
+        for (i = 0; i < n; i++)
+            x[i] = floor(x[i] * w) + l;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
 static const luaL_Reg mathlib[] = {{"abs", math_abs},
                                    {"acos", math_acos},
                                    {"asin", math_asin},
@@ -253,6 +295,7 @@ static const luaL_Reg mathlib[] = {{"abs", math_abs},
                                    {"pow", math_pow},
                                    {"rad", math_rad},
                                    {"random", math_random},
+                                   {"randomfill", math_randomfill},
                                    {"randomseed", math_randomseed},
                                    {"sinh", math_sinh},
                                    {"sin", math_sin},
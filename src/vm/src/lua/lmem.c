@@ -13,6 +13,7 @@
 
 #include "ldebug.h"
 #include "ldo.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -62,17 +63,53 @@ void *luaM_toobig(lua_State *L)
     return NULL; /* to avoid warnings */
 }
 
+/*
+** limits of the heap (see lua_gc): `memcheck' is the lowest one in effect,
+** the soft limit only counts while it is armed (`soft')
+*/
+void luaM_setlimits(lua_State *L, int soft)
+{
+    global_State *g = G(L);
+    lu_mem hard = g->memlimit > 0 ? g->memlimit : MAX_LUMEM;
+    g->memcheck = (soft && g->memsoft > 0 && g->memsoft < hard) ? g->memsoft : hard;
+}
+
+/*
+** an allocation growing the heap to `total', past `memcheck': past the
+** hard limit it fails as if the allocator did. Past the soft limit it asks
+** for a full collection at the next luaC_checkGC, collecting right here
+** could free what the caller is still building; the soft limit is disarmed
+** until the heap is below it again (see luaC_step).
+*/
+static void overlimit(lua_State *L, lu_mem total)
+{
+    global_State *g = G(L);
+    if (g->memlimit > 0 && total > g->memlimit)
+        luaD_throw(L, LUA_ERRMEM);
+    if (g->memsoft > 0 && total > g->memsoft && g->GCthreshold != MAX_LUMEM) {
+        g->memurgent = 1;
+        g->GCthreshold = 0;
+    }
+    luaM_setlimits(L, 0);
+}
+
 /*
 ** generic allocation routine.
 */
 void *luaM_realloc_(lua_State *L, void *block, size_t osize, size_t nsize)
 {
     global_State *g = G(L);
+    lu_mem total = (g->totalbytes - osize) + nsize;
     lua_assert((osize == 0) == (block == NULL));
-    block = (*g->frealloc)(g->ud, block, osize, nsize);
+    if (total > g->memcheck && nsize > osize)
+        overlimit(L, total);
+    if (g->sweeper == NULL)
+        block = (*g->frealloc)(g->ud, block, osize, nsize);
+    else /* the sweeper calls the allocator too */
+        block = luaC_sweeperalloc(L, block, osize, nsize);
     if (block == NULL && nsize > 0)
         luaD_throw(L, LUA_ERRMEM);
     lua_assert((nsize == 0) == (block == NULL));
-    g->totalbytes = (g->totalbytes - osize) + nsize;
+    g->totalbytes = total;
     return block;
 }
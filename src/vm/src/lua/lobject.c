@@ -5,7 +5,9 @@
 */
 
 #include <ctype.h>
+#include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,7 +24,7 @@
 #include "lstring.h"
 #include "lvm.h"
 
-const TValue luaO_nilobject_ = {{NULL}, LUA_TNIL};
+const TValue luaO_nilobject_ = {NILCONSTANT};
 
 /*
 ** converts an integer to a "floating point byte", represented as
@@ -109,6 +111,319 @@ int luaO_str2d(const char *s, lua_Number *result)
     return 1;
 }
 
+/*
+** shortest digits of a double that read back as the same double, by Grisu2
+** (Florian Loitsch, "Printing floating-point numbers quickly and
+** accurately with integers"): the double and the bounds of the interval of
+** the reals rounding to it are scaled by a cached power of ten into 64-bit
+** fixed point numbers, the digits are generated from the upper bound and
+** cut as soon as the rest falls inside the interval
+*/
+typedef struct DiyFp {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+/* 10^-348, 10^-340, ..., 10^340 as f * 2^e, f normalized */
+static const struct {
+    uint64_t f;
+    short e;
+} cachedpowers[] = {
+    {UINT64_C(0xfa8fd5a0081c0288), -1220}, {UINT64_C(0xbaaee17fa23ebf76), -1193},
+    {UINT64_C(0x8b16fb203055ac76), -1166}, {UINT64_C(0xcf42894a5dce35ea), -1140},
+    {UINT64_C(0x9a6bb0aa55653b2d), -1113}, {UINT64_C(0xe61acf033d1a45df), -1087},
+    {UINT64_C(0xab70fe17c79ac6ca), -1060}, {UINT64_C(0xff77b1fcbebcdc4f), -1034},
+    {UINT64_C(0xbe5691ef416bd60c), -1007}, {UINT64_C(0x8dd01fad907ffc3c), -980},
+    {UINT64_C(0xd3515c2831559a83), -954}, {UINT64_C(0x9d71ac8fada6c9b5), -927},
+    {UINT64_C(0xea9c227723ee8bcb), -901}, {UINT64_C(0xaecc49914078536d), -874},
+    {UINT64_C(0x823c12795db6ce57), -847}, {UINT64_C(0xc21094364dfb5637), -821},
+    {UINT64_C(0x9096ea6f3848984f), -794}, {UINT64_C(0xd77485cb25823ac7), -768},
+    {UINT64_C(0xa086cfcd97bf97f4), -741}, {UINT64_C(0xef340a98172aace5), -715},
+    {UINT64_C(0xb23867fb2a35b28e), -688}, {UINT64_C(0x84c8d4dfd2c63f3b), -661},
+    {UINT64_C(0xc5dd44271ad3cdba), -635}, {UINT64_C(0x936b9fcebb25c996), -608},
+    {UINT64_C(0xdbac6c247d62a584), -582}, {UINT64_C(0xa3ab66580d5fdaf6), -555},
+    {UINT64_C(0xf3e2f893dec3f126), -529}, {UINT64_C(0xb5b5ada8aaff80b8), -502},
+    {UINT64_C(0x87625f056c7c4a8b), -475}, {UINT64_C(0xc9bcff6034c13053), -449},
+    {UINT64_C(0x964e858c91ba2655), -422}, {UINT64_C(0xdff9772470297ebd), -396},
+    {UINT64_C(0xa6dfbd9fb8e5b88f), -369}, {UINT64_C(0xf8a95fcf88747d94), -343},
+    {UINT64_C(0xb94470938fa89bcf), -316}, {UINT64_C(0x8a08f0f8bf0f156b), -289},
+    {UINT64_C(0xcdb02555653131b6), -263}, {UINT64_C(0x993fe2c6d07b7fac), -236},
+    {UINT64_C(0xe45c10c42a2b3b06), -210}, {UINT64_C(0xaa242499697392d3), -183},
+    {UINT64_C(0xfd87b5f28300ca0e), -157}, {UINT64_C(0xbce5086492111aeb), -130},
+    {UINT64_C(0x8cbccc096f5088cc), -103}, {UINT64_C(0xd1b71758e219652c), -77},
+    {UINT64_C(0x9c40000000000000), -50}, {UINT64_C(0xe8d4a51000000000), -24},
+    {UINT64_C(0xad78ebc5ac620000), 3}, {UINT64_C(0x813f3978f8940984), 30},
+    {UINT64_C(0xc097ce7bc90715b3), 56}, {UINT64_C(0x8f7e32ce7bea5c70), 83},
+    {UINT64_C(0xd5d238a4abe98068), 109}, {UINT64_C(0x9f4f2726179a2245), 136},
+    {UINT64_C(0xed63a231d4c4fb27), 162}, {UINT64_C(0xb0de65388cc8ada8), 189},
+    {UINT64_C(0x83c7088e1aab65db), 216}, {UINT64_C(0xc45d1df942711d9a), 242},
+    {UINT64_C(0x924d692ca61be758), 269}, {UINT64_C(0xda01ee641a708dea), 295},
+    {UINT64_C(0xa26da3999aef774a), 322}, {UINT64_C(0xf209787bb47d6b85), 348},
+    {UINT64_C(0xb454e4a179dd1877), 375}, {UINT64_C(0x865b86925b9bc5c2), 402},
+    {UINT64_C(0xc83553c5c8965d3d), 428}, {UINT64_C(0x952ab45cfa97a0b3), 455},
+    {UINT64_C(0xde469fbd99a05fe3), 481}, {UINT64_C(0xa59bc234db398c25), 508},
+    {UINT64_C(0xf6c69a72a3989f5c), 534}, {UINT64_C(0xb7dcbf5354e9bece), 561},
+    {UINT64_C(0x88fcf317f22241e2), 588}, {UINT64_C(0xcc20ce9bd35c78a5), 614},
+    {UINT64_C(0x98165af37b2153df), 641}, {UINT64_C(0xe2a0b5dc971f303a), 667},
+    {UINT64_C(0xa8d9d1535ce3b396), 694}, {UINT64_C(0xfb9b7cd9a4a7443c), 720},
+    {UINT64_C(0xbb764c4ca7a44410), 747}, {UINT64_C(0x8bab8eefb6409c1a), 774},
+    {UINT64_C(0xd01fef10a657842c), 800}, {UINT64_C(0x9b10a4e5e9913129), 827},
+    {UINT64_C(0xe7109bfba19c0c9d), 853}, {UINT64_C(0xac2820d9623bf429), 880},
+    {UINT64_C(0x80444b5e7aa7cf85), 907}, {UINT64_C(0xbf21e44003acdd2d), 933},
+    {UINT64_C(0x8e679c2f5e44ff8f), 960}, {UINT64_C(0xd433179d9c8cb841), 986},
+    {UINT64_C(0x9e19db92b4e31ba9), 1013}, {UINT64_C(0xeb96bf6ebadf77d9), 1039},
+    {UINT64_C(0xaf87023b9bf0ee6b), 1066},
+};
+
+static const uint64_t powersof10[] = {UINT64_C(1),
+                                      UINT64_C(10),
+                                      UINT64_C(100),
+                                      UINT64_C(1000),
+                                      UINT64_C(10000),
+                                      UINT64_C(100000),
+                                      UINT64_C(1000000),
+                                      UINT64_C(10000000),
+                                      UINT64_C(100000000),
+                                      UINT64_C(1000000000),
+                                      UINT64_C(10000000000),
+                                      UINT64_C(100000000000),
+                                      UINT64_C(1000000000000),
+                                      UINT64_C(10000000000000),
+                                      UINT64_C(100000000000000),
+                                      UINT64_C(1000000000000000),
+                                      UINT64_C(10000000000000000),
+                                      UINT64_C(100000000000000000),
+                                      UINT64_C(1000000000000000000),
+                                      UINT64_C(10000000000000000000)};
+
+#define DP_HIDDEN (UINT64_C(1) << 52)
+
+static DiyFp diynormalize(DiyFp x)
+{
+#if defined(__GNUC__)
+    int s = __builtin_clzll(x.f);
+    x.f <<= s;
+    x.e -= s;
+#else
+    while (!(x.f & (UINT64_C(1) << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+#endif
+    return x;
+}
+
+/* upper 64 bits of the product, rounded */
+static DiyFp diymul(DiyFp x, DiyFp y)
+{
+    uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+    uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t t = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (UINT64_C(1) << 31);
+    DiyFp r;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (t >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+/*
+** moves the last digit down while that brings it closer to the double;
+** the digits are only known to be the shortest and closest ones when the
+** imprecision of the products (`unit') can not change the choice
+*/
+static int roundweed(char *digits, int n, uint64_t distance, uint64_t unsafe, uint64_t rest,
+                     uint64_t tenkappa, uint64_t unit)
+{
+    uint64_t small = distance - unit, big = distance + unit;
+    while (rest < small && unsafe - rest >= tenkappa &&
+           (rest + tenkappa < small || small - rest >= rest + tenkappa - small)) {
+        digits[n - 1]--;
+        rest += tenkappa;
+    }
+    if (rest < big && unsafe - rest >= tenkappa &&
+        (rest + tenkappa < big || big - rest > rest + tenkappa - big))
+        return 0;
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/*
+** digits of a positive finite double by Grisu3, the number is digits *
+** 10^*k; returns their count, 0 in the rare cases it can not prove them
+** to be the shortest
+*/
+static int grisu3(double d, char *digits, int *k)
+{
+    uint64_t bits, unsafe, fraction, distance, unit = 1;
+    DiyFp v, plus, minus, c, w, high, low, one;
+    int biased, kappa, n = 0, index;
+    uint32_t integral, divisor;
+    double dk;
+    memcpy(&bits, &d, sizeof(bits));
+    biased = (int)((bits >> 52) & 0x7ff);
+    v.f = bits & (DP_HIDDEN - 1);
+    v.e = -1074;
+    if (biased != 0) {
+        v.f |= DP_HIDDEN;
+        v.e = biased - 1075;
+    }
+    /* the bounds are halfway to the neighbours, closer below a power of 2 */
+    plus.f = (v.f << 1) + 1;
+    plus.e = v.e - 1;
+    plus = diynormalize(plus);
+    minus.f = v.f == DP_HIDDEN ? (v.f << 2) - 1 : (v.f << 1) - 1;
+    minus.e = v.f == DP_HIDDEN ? v.e - 2 : v.e - 1;
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    /* a power of ten that brings the exponent of the products into [-60, -32] */
+    dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    index = (int)dk;
+    if (dk - index > 0.0)
+        index++;
+    index = (index >> 3) + 1;
+    *k = -(-348 + index * 8);
+    c.f = cachedpowers[index].f;
+    c.e = cachedpowers[index].e;
+    w = diymul(diynormalize(v), c);
+    /* every product may be off by one unit, widen the interval by as much */
+    high = diymul(plus, c);
+    low = diymul(minus, c);
+    high.f += unit;
+    low.f -= unit;
+    unsafe = high.f - low.f;
+    distance = high.f - w.f;
+    one.f = UINT64_C(1) << -high.e;
+    one.e = high.e;
+    integral = (uint32_t)(high.f >> -one.e);
+    fraction = high.f & (one.f - 1);
+    for (kappa = 1; kappa < 10 && integral >= powersof10[kappa]; kappa++)
+        ;
+    divisor = (uint32_t)powersof10[kappa - 1];
+    while (kappa > 0) { /* the integral part */
+        uint64_t rest;
+        digits[n++] = (char)('0' + integral / divisor);
+        integral %= divisor;
+        kappa--;
+        rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest < unsafe) {
+            *k += kappa;
+            return roundweed(digits, n, distance, unsafe, rest, (uint64_t)divisor << -one.e,
+                             unit)
+                       ? n
+                       : 0;
+        }
+        divisor /= 10;
+    }
+    for (;;) { /* the fraction */
+        fraction *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        digits[n++] = (char)('0' + (fraction >> -one.e));
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < unsafe) {
+            *k += kappa;
+            return roundweed(digits, n, distance * unit, unsafe, fraction, one.f, unit) ? n : 0;
+        }
+    }
+}
+
+/* the shortest of "%.14e" to "%.16e" that reads back as the double, or "%.16e" */
+static int shortest(double d, char *digits, int *k)
+{
+    char buff[32];
+    int precision, n = 0;
+    char *p = buff;
+    for (precision = 14; precision < 16; precision++) {
+        sprintf(buff, "%.*e", precision, d);
+        if (strtod(buff, NULL) == d)
+            break;
+    }
+    if (precision == 16)
+        sprintf(buff, "%.16e", d);
+    for (; *p != 'e'; p++) {
+        if (*p != '.')
+            digits[n++] = *p;
+    }
+    while (n > 1 && digits[n - 1] == '0')
+        n--;
+    *k = atoi(p + 1) - n + 1;
+    return n;
+}
+
+/*
+** formats a number like "%.17g" would with the fewest digits that read back
+** as it: whole numbers below 2^53 are written as integers right away, the
+** others with the shortest digits (grisu3), in exponent form when the
+** exponent is below -4 or above 16; returns the length
+*/
+int luaO_number2str(char *s, double d)
+{
+    char digits[20];
+    char *p = s;
+    int n, k, exponent;
+    if (signbit(d)) {
+        *p++ = '-';
+        d = -d;
+    }
+    if (d != d || d == HUGE_VAL) {
+        memcpy(p, d != d ? "nan" : "inf", 4);
+        return (int)(p - s) + 3;
+    }
+    if (d < 9007199254740992.0 && d == (double)(uint64_t)d) {
+        uint64_t u = (uint64_t)d;
+        n = 0;
+        do {
+            digits[n++] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u != 0);
+        while (n > 0)
+            *p++ = digits[--n];
+        *p = '\0';
+        return (int)(p - s);
+    }
+    n = grisu3(d, digits, &k);
+    if (n == 0)
+        n = shortest(d, digits, &k);
+    exponent = n + k - 1; /* of the first digit */
+    if (exponent < -4 || exponent > 16) {
+        *p++ = digits[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = exponent < 0 ? '-' : '+';
+        if (exponent < 0)
+            exponent = -exponent;
+        if (exponent >= 100)
+            *p++ = (char)('0' + exponent / 100);
+        *p++ = (char)('0' + exponent / 10 % 10);
+        *p++ = (char)('0' + exponent % 10);
+        *p = '\0';
+        return (int)(p - s);
+    }
+    if (k >= 0) { /* no fraction */
+        memcpy(p, digits, n);
+        memset(p + n, '0', k);
+        p += n + k;
+    } else if (exponent >= 0) {
+        memcpy(p, digits, exponent + 1);
+        p[exponent + 1] = '.';
+        memcpy(p + exponent + 2, digits + exponent + 1, n - exponent - 1);
+        p += n + 1;
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -exponent - 1);
+        p += -exponent - 1;
+        memcpy(p, digits, n);
+        p += n;
+    }
+    *p = '\0';
+    return (int)(p - s);
+}
+
 static void pushstr(lua_State *L, const char *str)
 {
     setsvalue2s(L, L->top, luaS_new(L, str));
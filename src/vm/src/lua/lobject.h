@@ -13,7 +13,7 @@
 #include "lua.h"
 
 /* tags for values visible from Lua */
-#define LAST_TAG LUA_TTHREAD
+#define LAST_TAG LUA_TARRAY
 
 #define NUM_TAGS (LAST_TAG + 1)
 
@@ -45,6 +45,134 @@ typedef struct GCheader {
     CommonHeader;
 } GCheader;
 
+#if defined(LUA_NANBOX)
+
+#include <stdint.h>
+
+/*
+** NaN-boxed values (LUA_NANBOX): a value is one 64-bit word. A value that
+** is not a number keeps its tag (below 16) in bits 47..50 and its pointer
+** or boolean in bits 0..46, so these words are below NB_NUMBER and nil is
+** the word 0, as a zeroed stock TValue is nil. A number is the bits of its
+** double plus NB_NUMBER, which puts every double above the other values;
+** only the NaNs with the sign set would wrap, they are stored as NB_NAN.
+*/
+#define NB_TAGSHIFT 47
+#define NB_PAYLOAD ((UINT64_C(1) << NB_TAGSHIFT) - 1)
+#define NB_NUMBER (UINT64_C(1) << 51)
+#define NB_NAN UINT64_C(0x7ff8000000000000)
+
+#define nbox_tag(t) (cast(uint64_t, (t)) << NB_TAGSHIFT)
+
+static inline uint64_t nbox_fromnumber(lua_Number n)
+{
+    union {
+        lua_Number n;
+        uint64_t u;
+    } v;
+    v.n = n;
+    v.u += NB_NUMBER;
+    return v.u >= NB_NUMBER ? v.u : NB_NAN + NB_NUMBER; /* a NaN with the sign set wrapped */
+}
+
+static inline lua_Number nbox_tonumber(uint64_t u)
+{
+    union {
+        lua_Number n;
+        uint64_t u;
+    } v;
+    v.u = u - NB_NUMBER;
+    return v.n;
+}
+
+#define nbox_pointer(p, t)                                                                         \
+    check_exp((cast(uint64_t, cast(uintptr_t, (p))) & ~NB_PAYLOAD) == 0,                           \
+              cast(uint64_t, cast(uintptr_t, (p))) | nbox_tag(t))
+
+#define TValuefields uint64_t u
+
+typedef struct lua_TValue {
+    TValuefields;
+} TValue;
+
+#define NILCONSTANT 0
+
+/* Macros to test type */
+#define ttisnil(o) ((o)->u == 0)
+#define ttisnumber(o) ((o)->u >= NB_NUMBER)
+#define ttisstring(o) (((o)->u >> NB_TAGSHIFT) == LUA_TSTRING)
+#define ttistable(o) (((o)->u >> NB_TAGSHIFT) == LUA_TTABLE)
+#define ttisfunction(o) (((o)->u >> NB_TAGSHIFT) == LUA_TFUNCTION)
+#define ttisboolean(o) (((o)->u >> NB_TAGSHIFT) == LUA_TBOOLEAN)
+#define ttisuserdata(o) (((o)->u >> NB_TAGSHIFT) == LUA_TUSERDATA)
+#define ttisthread(o) (((o)->u >> NB_TAGSHIFT) == LUA_TTHREAD)
+#define ttislightuserdata(o) (((o)->u >> NB_TAGSHIFT) == LUA_TLIGHTUSERDATA)
+#define ttisarray(o) (((o)->u >> NB_TAGSHIFT) == LUA_TARRAY)
+
+/* Macros to access values */
+#define ttype(o) (ttisnumber(o) ? LUA_TNUMBER : cast_int((o)->u >> NB_TAGSHIFT))
+#define nbox_payload(o) cast(uintptr_t, (o)->u & NB_PAYLOAD)
+#define rawgcvalue(o) cast(GCObject *, nbox_payload(o))
+#define gcvalue(o) check_exp(iscollectable(o), rawgcvalue(o))
+#define pvalue(o) check_exp(ttislightuserdata(o), cast(void *, nbox_payload(o)))
+#define nvalue(o) check_exp(ttisnumber(o), nbox_tonumber((o)->u))
+#define rawtsvalue(o) check_exp(ttisstring(o), &rawgcvalue(o)->ts)
+#define tsvalue(o) (&rawtsvalue(o)->tsv)
+#define rawuvalue(o) check_exp(ttisuserdata(o), &rawgcvalue(o)->u)
+#define uvalue(o) (&rawuvalue(o)->uv)
+#define clvalue(o) check_exp(ttisfunction(o), &rawgcvalue(o)->cl)
+#define hvalue(o) check_exp(ttistable(o), &rawgcvalue(o)->h)
+#define bvalue(o) check_exp(ttisboolean(o), cast_int((o)->u & 1))
+#define thvalue(o) check_exp(ttisthread(o), &rawgcvalue(o)->th)
+#define arrvalue(o) check_exp(ttisarray(o), &rawgcvalue(o)->a)
+
+#define l_isfalse(o) ((o)->u == 0 || (o)->u == nbox_tag(LUA_TBOOLEAN))
+
+/* Macros to set values */
+#define setnilvalue(obj) ((obj)->u = 0)
+
+#define setnvalue(obj, x)                                                                          \
+    {                                                                                              \
+        TValue *i_o = (obj);                                                                       \
+        i_o->u = nbox_fromnumber(x);                                                               \
+    }
+
+#define setpvalue(obj, x)                                                                          \
+    {                                                                                              \
+        TValue *i_o = (obj);                                                                       \
+        i_o->u = nbox_pointer(x, LUA_TLIGHTUSERDATA);                                              \
+    }
+
+#define setbvalue(obj, x)                                                                          \
+    {                                                                                              \
+        TValue *i_o = (obj);                                                                       \
+        i_o->u = nbox_tag(LUA_TBOOLEAN) | ((x) != 0);                                              \
+    }
+
+#define setgcovalue(L, obj, x, t)                                                                  \
+    {                                                                                              \
+        TValue *i_o = (obj);                                                                       \
+        i_o->u = nbox_pointer(x, t);                                                               \
+        checkliveness(G(L), i_o);                                                                  \
+    }
+
+#define setsvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TSTRING)
+#define setuvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TUSERDATA)
+#define setthvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TTHREAD)
+#define setclvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TFUNCTION)
+#define sethvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TTABLE)
+#define setarrvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TARRAY)
+#define setptvalue(L, obj, x) setgcovalue(L, obj, x, LUA_TPROTO)
+
+/* only for keys of collectable objects, the payload stays */
+#define setttype(obj, tt) ((obj)->u = ((obj)->u & NB_PAYLOAD) | nbox_tag(tt))
+
+#define setnodekey(k, obj) ((k)->u = (obj)->u)
+
+#define iscollectable(o) ((o)->u >= nbox_tag(LUA_TSTRING) && (o)->u < NB_NUMBER)
+
+#else
+
 /*
 ** Union of all Lua values
 */
@@ -67,6 +195,8 @@ typedef struct lua_TValue {
     TValuefields;
 } TValue;
 
+#define NILCONSTANT {NULL}, LUA_TNIL
+
 /* Macros to test type */
 #define ttisnil(o) (ttype(o) == LUA_TNIL)
 #define ttisnumber(o) (ttype(o) == LUA_TNUMBER)
@@ -77,6 +207,7 @@ typedef struct lua_TValue {
 #define ttisuserdata(o) (ttype(o) == LUA_TUSERDATA)
 #define ttisthread(o) (ttype(o) == LUA_TTHREAD)
 #define ttislightuserdata(o) (ttype(o) == LUA_TLIGHTUSERDATA)
+#define ttisarray(o) (ttype(o) == LUA_TARRAY)
 
 /* Macros to access values */
 #define ttype(o) ((o)->tt)
@@ -91,19 +222,10 @@ typedef struct lua_TValue {
 #define hvalue(o) check_exp(ttistable(o), &(o)->value.gc->h)
 #define bvalue(o) check_exp(ttisboolean(o), (o)->value.b)
 #define thvalue(o) check_exp(ttisthread(o), &(o)->value.gc->th)
+#define arrvalue(o) check_exp(ttisarray(o), &(o)->value.gc->a)
 
 #define l_isfalse(o) (ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
 
-/*
-** for internal debug only
-*/
-#define checkconsistency(obj)                                                                      \
-    lua_assert(!iscollectable(obj) || (ttype(obj) == (obj)->value.gc->gch.tt))
-
-#define checkliveness(g, obj)                                                                      \
-    lua_assert(!iscollectable(obj) ||                                                              \
-               ((ttype(obj) == (obj)->value.gc->gch.tt) && !isdead(g, (obj)->value.gc)))
-
 /* Macros to set values */
 #define setnilvalue(obj) ((obj)->tt = LUA_TNIL)
 
@@ -168,6 +290,14 @@ typedef struct lua_TValue {
         checkliveness(G(L), i_o);                                                                  \
     }
 
+#define setarrvalue(L, obj, x)                                                                     \
+    {                                                                                              \
+        TValue *i_o = (obj);                                                                       \
+        i_o->value.gc = cast(GCObject *, (x));                                                     \
+        i_o->tt = LUA_TARRAY;                                                                      \
+        checkliveness(G(L), i_o);                                                                  \
+    }
+
 #define setptvalue(L, obj, x)                                                                      \
     {                                                                                              \
         TValue *i_o = (obj);                                                                       \
@@ -176,6 +306,30 @@ typedef struct lua_TValue {
         checkliveness(G(L), i_o);                                                                  \
     }
 
+#define setttype(obj, tt) (ttype(obj) = (tt))
+
+/* copies a value into the key of a node, which keeps `next' next to it */
+#define setnodekey(k, obj)                                                                         \
+    {                                                                                              \
+        const TValue *i_o = (obj);                                                                 \
+        (k)->value = i_o->value;                                                                   \
+        (k)->tt = i_o->tt;                                                                         \
+    }
+
+#define iscollectable(o) (ttype(o) >= LUA_TSTRING)
+
+#endif
+
+/*
+** for internal debug only
+*/
+#define checkconsistency(obj)                                                                      \
+    lua_assert(!iscollectable(obj) || (ttype(obj) == gcvalue(obj)->gch.tt))
+
+#define checkliveness(g, obj)                                                                      \
+    lua_assert(!iscollectable(obj) ||                                                              \
+               ((ttype(obj) == gcvalue(obj)->gch.tt) && !isdead(g, gcvalue(obj))))
+
 #define setobj(L, obj1, obj2)                                                                      \
     {                                                                                              \
         const TValue *o2 = (obj2);                                                                 \
@@ -203,9 +357,6 @@ typedef struct lua_TValue {
 #define setobj2n setobj
 #define setsvalue2n setsvalue
 
-#define setttype(obj, tt) (ttype(obj) = (tt))
-
-#define iscollectable(o) (ttype(o) >= LUA_TSTRING)
 
 typedef TValue *StkId; /* index to stack elements */
 
@@ -238,9 +389,34 @@ typedef union Udata {
 /*
 ** Function Prototypes
 */
+/*
+** Inline cache of OP_GETENV.
+** `slot' points into the node array of `table' and stays valid as long as the table keeps the
+** `stamp' it had when the cache was filled (see Table).
+*/
+typedef struct GlobalCache {
+    struct Table *table;
+    const TValue *slot;
+    lu_int32 stamp;
+} GlobalCache;
+
+/*
+** Inline cache of OP_GETFIELD and OP_SETFIELD, one per instruction.
+** A table of shape `shape' keeps the key in fields[index]. When `next' is
+** set, the key is missing from that shape instead: storing it moves the
+** table to `next' and puts the value in fields[index].
+*/
+typedef struct FieldCache {
+    lu_int32 shape;
+    int index;
+    struct Shape *next;
+} FieldCache;
+
 typedef struct Proto {
     CommonHeader;
-    TValue *k; /* constants used by the function */
+    TValue *k;           /* constants used by the function */
+    GlobalCache *gcache; /* inline caches of OP_GETENV, indexed like `k' */
+    FieldCache *fcache;  /* inline caches of field accesses, indexed like `code' (or NULL) */
     Instruction *code;
     struct Proto **p;       /* functions defined inside the function */
     int *lineinfo;          /* map from opcodes to source lines */
@@ -260,6 +436,17 @@ typedef struct Proto {
     lu_byte numparams;
     lu_byte is_vararg;
     lu_byte maxstacksize;
+    lu_byte sharedcode; /* `code' belongs to a luapp_code shared by several states or to `image' */
+    void (*native)(struct lua_State *L); /* translated ahead of time (see aot.h), or NULL */
+    int hotcount; /* calls and iterations left until the JIT compiles it (see jit.h), 0 if never */
+    void *mcode;  /* machine code the JIT compiled, `native' points to it (or NULL) */
+    size_t sizemcode;
+    TString *debug;       /* debug section of the program until the part of the proto is decoded */
+    lu_int32 debugoffset; /* where that part starts in `debug', plus one */
+    struct luapp_image *image;     /* bytecode `code' points into (see load.c), or NULL */
+    lu_int32 imageindex;           /* position of the proto in the index of `image' */
+    lu_byte lazy;                  /* a stub, only decoded by luapp_loadproto when first called */
+    struct profile_sites *profile; /* counters of its instructions (see profile.h), or NULL */
 } Proto;
 
 /* masks for new-style vararg */
@@ -339,18 +526,56 @@ typedef struct Node {
     TKey i_key;
 } Node;
 
+/*
+** Shapes (hidden classes) of string-keyed tables.
+** A shape is the ordered list of the keys of a table; tables that got the
+** same keys in the same order share it and keep their values in a flat
+** `fields' array. Shapes form a tree rooted at G(L)->rootshape, each child
+** adds one key to its parent. They live as long as the state and their
+** keys are fixed strings, so `id' names one layout for the whole run.
+*/
+typedef struct Shape {
+    struct Shape *parent;
+    struct Shape *child;   /* first shape adding a key to this one */
+    struct Shape *sibling; /* next child of `parent' */
+    lu_int32 id;           /* unique, inline caches compare it */
+    int nkeys;
+    TString *keys[1]; /* value of keys[i] is in fields[i] */
+} Shape;
+
 typedef struct Table {
     CommonHeader;
-    lu_byte flags;     /* 1<<p means tagmethod(p) is not present */
     lu_byte lsizenode; /* log2 of size of `node' array */
+    lu_int32 flags;    /* 1<<p means tagmethod(p) is not present, for every TM */
     struct Table *metatable;
     TValue *array; /* array part */
     Node *node;
     Node *lastfree; /* any free position is before this position */
     GCObject *gclist;
-    int sizearray; /* size of `array' array */
+    int sizearray;  /* size of `array' array */
+    lu_int32 stamp; /* changes whenever a node may move (new key or resize), unique per table */
+    Shape *shape;   /* NULL for hash tables, the node part of a shaped table is empty */
+    TValue *fields; /* values of the keys of `shape' */
+    int sizefields; /* size of `fields' array */
 } Table;
 
+/*
+** Typed arrays: dense arrays of unboxed values of a single type, indexed from 1 to `size'
+*/
+#define ARRAY_NUMBER LUA_ARRNUMBER
+#define ARRAY_BOOLEAN LUA_ARRBOOLEAN
+
+typedef struct Array {
+    CommonHeader;
+    lu_byte kind; /* ARRAY_NUMBER or ARRAY_BOOLEAN */
+    int size;     /* number of elements */
+    int space;    /* number of allocated elements */
+    union {
+        lua_Number *n;
+        lu_byte *b;
+    } u;
+} Array;
+
 /*
 ** `module' operation for hashing (size is always a power of 2)
 */
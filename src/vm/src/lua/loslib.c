@@ -34,6 +34,7 @@ static int os_pushresult(lua_State *L, int i, const char *filename)
 
 static int os_execute(lua_State *L)
 {
+    lua_flushoutput(L, 1); /* the command may write to stdout as well */
     lua_pushinteger(L, system(luaL_optstring(L, 1, NULL)));
     return 1;
 }
@@ -210,7 +211,12 @@ static int os_setlocale(lua_State *L)
     return 1;
 }
 
-static int os_exit(lua_State *L) { exit(luaL_optint(L, 1, EXIT_SUCCESS)); }
+static int os_exit(lua_State *L)
+{
+    int status = luaL_optint(L, 1, EXIT_SUCCESS);
+    lua_flushoutput(L, 1); /* the state is not closed */
+    exit(status);
+}
 
 static const luaL_Reg syslib[] = {
     {"clock", os_clock},     {"date", os_date},       {"difftime", os_difftime},
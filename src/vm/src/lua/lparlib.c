@@ -0,0 +1,639 @@
+/*
+** Data-parallel map and reduce over worker states
+** See Copyright Notice in lua.h
+*/
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define lparlib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+/*
+** `parallel.map' and `parallel.reduce' split an array into chunks and run
+** a Lua function over them in worker states, each opened with the standard
+** libraries and driven by a thread of its own (the calling thread drives
+** the first one).  Protos belong to a single state, so a worker makes its
+** own closure of the function from the program it was loaded from (see
+** lua_pushimage), once, and sets its upvalues for every call.  The calling
+** state is blocked until every chunk is done, so the workers read its
+** typed arrays and strings in place, and a map over a typed array writes
+** its results straight into the new one; other results are copied out.
+** Only nil, booleans, numbers and strings cross to another state, as
+** elements, upvalues or results.
+**
+** Every worker starts with a contiguous run of the chunks, takes them from
+** its front and, once it has none left, steals from the back of the runs
+** of the others.
+*/
+
+#if defined(LUAI_PARALLEL)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define PARALLELHANDLE "parallel.pool"
+#define PARALLELRESULTS "parallel.results"
+#define PARALLELWORKER "parallel.worker" /* registry field marking a worker */
+#define PARALLELCACHE "parallel.cache"   /* closures of a worker, by program */
+
+/* chunks per worker when the size of a chunk is not given */
+#define PARALLEL_SPLIT 4
+
+/* a value crossing states */
+typedef struct Value {
+    int type;
+    lua_Number n;  /* number, or boolean */
+    const char *s; /* string, of the calling state, or one a worker copied */
+    size_t len;
+    int owned;     /* `s' is a copy, freed with the results */
+} Value;
+
+/* what the calling state gets back, freed by the collector like any other
+** object even when the call raises an error */
+typedef struct Results {
+    int n;
+    char *error; /* first error of a worker */
+    Value v[1];
+} Results;
+
+typedef struct Job {
+    int reduce;
+    const void *image; /* program of the function, see lua_toimage */
+    int index;
+    const char *source;
+    const Value *upvals;
+    int nups;
+    const Value *elems; /* elements of a table, or NULL */
+    const void *array;  /* elements of a typed array, or NULL */
+    int kind;           /* of `array' */
+    void *out;          /* typed array a map stores its results in, or NULL */
+    const Value *init;  /* first accumulator of a reduce, or NULL */
+    Results *results;   /* of a map over a table, of every chunk of a reduce */
+    int n;              /* elements */
+    int chunk;          /* elements per chunk */
+    int nchunks;
+    atomic_int failed;
+} Job;
+
+typedef struct Worker {
+    lua_State *L;
+    struct Pool *pool;
+    int first, last; /* chunks of its run left, [first, last) */
+#if defined(LUAI_PARALLEL)
+    pthread_mutex_t lock; /* protects `first' and `last' */
+    pthread_t thread;
+#endif
+} Worker;
+
+typedef struct Pool {
+    Worker *workers;
+    int size;   /* workers running, 0 until the first call */
+    int wanted; /* workers of the next call */
+    Job *job;
+#if defined(LUAI_PARALLEL)
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t wake;  /* a job was posted or the threads have to stop */
+    pthread_cond_t done;  /* the last thread finished the job */
+    unsigned generation;  /* of the job posted last */
+    int busy;             /* threads still working on it */
+    int stop;
+#endif
+} Pool;
+
+typedef struct Task {
+    Pool *pool;
+    Worker *w;
+    Job *job;
+} Task;
+
+#if defined(LUAI_PARALLEL)
+#define lockworker(w) pthread_mutex_lock(&(w)->lock)
+#define unlockworker(w) pthread_mutex_unlock(&(w)->lock)
+#else
+#define lockworker(w) ((void)0)
+#define unlockworker(w) ((void)0)
+#endif
+
+/*
+** {======================================================
+** Values
+** =======================================================
+*/
+
+/* reads the value at `idx', without copying a string; 0 if it can not
+** cross to another state */
+static int tovalue(lua_State *L, int idx, Value *v)
+{
+    v->type = lua_type(L, idx);
+    v->owned = 0;
+    switch (v->type) {
+        case LUA_TNIL:
+            return 1;
+        case LUA_TBOOLEAN:
+            v->n = lua_toboolean(L, idx);
+            return 1;
+        case LUA_TNUMBER:
+            v->n = lua_tonumber(L, idx);
+            return 1;
+        case LUA_TSTRING:
+            v->s = lua_tolstring(L, idx, &v->len);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* like tovalue, but copies a string so that it outlives the state */
+static void copyvalue(lua_State *L, int idx, Value *v, const char *what)
+{
+    if (!tovalue(L, idx, v))
+        luaL_error(L, "%s is a %s, only nil, booleans, numbers and strings can be returned", what,
+                   luaL_typename(L, idx));
+    if (v->type == LUA_TSTRING) {
+        char *s = (char *)malloc(v->len + 1);
+        if (s == NULL)
+            luaL_error(L, "not enough memory");
+        memcpy(s, v->s, v->len + 1);
+        v->s = s;
+        v->owned = 1;
+    }
+}
+
+static void pushvalue(lua_State *L, const Value *v)
+{
+    switch (v->type) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(L, v->n != 0);
+            break;
+        case LUA_TNUMBER:
+            lua_pushnumber(L, v->n);
+            break;
+        case LUA_TSTRING:
+            lua_pushlstring(L, v->s, v->len);
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+}
+
+static Results *newresults(lua_State *L, int n)
+{
+    Results *r = (Results *)lua_newuserdata(L, offsetof(Results, v) + (n + 1) * sizeof(Value));
+    memset(r, 0, offsetof(Results, v) + (n + 1) * sizeof(Value));
+    r->n = n + 1; /* one more for the result of a reduce */
+    luaL_getmetatable(L, PARALLELRESULTS);
+    lua_setmetatable(L, -2);
+    return r;
+}
+
+static int results_gc(lua_State *L)
+{
+    Results *r = (Results *)luaL_checkudata(L, 1, PARALLELRESULTS);
+    int i;
+    for (i = 0; i < r->n; i++) {
+        if (r->v[i].owned)
+            free((void *)r->v[i].s);
+    }
+    free(r->error);
+    r->n = 0;
+    r->error = NULL;
+    return 0;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Workers
+** =======================================================
+*/
+
+/* records the first error of a job, the others stop at their next element */
+static void fail(Job *job, lua_State *L)
+{
+    const char *msg = lua_tostring(L, -1);
+    if (atomic_exchange(&job->failed, 1) == 0) {
+        if (msg == NULL)
+            msg = "error object is not a string";
+        if ((job->results->error = (char *)malloc(strlen(msg) + 1)) != NULL)
+            strcpy(job->results->error, msg);
+    }
+}
+
+/* next chunk for a worker: the front of its run, or the back of another's */
+static int take(Pool *pool, Worker *w)
+{
+    int c = -1, i;
+    lockworker(w);
+    if (w->first < w->last)
+        c = w->first++;
+    unlockworker(w);
+    for (i = 1; c < 0 && i < pool->size; i++) {
+        Worker *victim = &pool->workers[(w - pool->workers + i) % pool->size];
+        lockworker(victim);
+        if (victim->first < victim->last)
+            c = --victim->last;
+        unlockworker(victim);
+    }
+    return c;
+}
+
+/* pushes the closure of the function of a job, made once by every worker */
+static void pushfunction(lua_State *L, Job *job)
+{
+    int i;
+    lua_getfield(L, LUA_REGISTRYINDEX, PARALLELCACHE);
+    lua_pushlightuserdata(L, (void *)job->image); /* the closures keep the image alive */
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) { /* first function of the program */
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void *)job->image);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_rawgeti(L, -1, job->index + 1);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        if (lua_pushimage(L, job->image, job->index, job->source))
+            luaL_error(L, "the function is missing from its program");
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, job->index + 1);
+    }
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    for (i = 0; i < job->nups; i++) {
+        pushvalue(L, &job->upvals[i]);
+        lua_setupvalue(L, -2, i + 1);
+    }
+}
+
+static void pushelement(lua_State *L, const Job *job, int i)
+{
+    if (job->elems != NULL)
+        pushvalue(L, &job->elems[i]);
+    else if (job->kind == LUA_ARRNUMBER)
+        lua_pushnumber(L, ((const lua_Number *)job->array)[i]);
+    else
+        lua_pushboolean(L, ((const unsigned char *)job->array)[i]);
+}
+
+/* stores the result of a map on top of the stack */
+static void storeresult(lua_State *L, Job *job, int i)
+{
+    if (job->out == NULL)
+        copyvalue(L, -1, &job->results->v[i], "a result");
+    else if (job->kind == LUA_ARRNUMBER && lua_type(L, -1) == LUA_TNUMBER)
+        ((lua_Number *)job->out)[i] = lua_tonumber(L, -1);
+    else if (job->kind == LUA_ARRBOOLEAN && lua_type(L, -1) == LUA_TBOOLEAN)
+        ((unsigned char *)job->out)[i] = (unsigned char)lua_toboolean(L, -1);
+    else
+        luaL_error(L, "the result for element %d is a %s, the array holds %s", i + 1,
+                   luaL_typename(L, -1), job->kind == LUA_ARRNUMBER ? "numbers" : "booleans");
+}
+
+/* runs the function over a chunk, the function is at index `fn' */
+static void runchunk(lua_State *L, Job *job, int c, int fn)
+{
+    int i = c * job->chunk;
+    int end = job->n - i < job->chunk ? job->n : i + job->chunk;
+    if (job->reduce) {
+        pushelement(L, job, i); /* accumulator */
+        for (i++; i < end && !atomic_load_explicit(&job->failed, memory_order_relaxed); i++) {
+            lua_pushvalue(L, fn);
+            lua_insert(L, -2);
+            pushelement(L, job, i);
+            lua_call(L, 2, 1);
+        }
+        copyvalue(L, -1, &job->results->v[c], "the accumulator");
+        lua_pop(L, 1);
+    } else {
+        for (; i < end && !atomic_load_explicit(&job->failed, memory_order_relaxed); i++) {
+            lua_pushvalue(L, fn);
+            pushelement(L, job, i);
+            lua_call(L, 1, 1);
+            storeresult(L, job, i);
+            lua_pop(L, 1);
+        }
+    }
+}
+
+static int dowork(lua_State *L)
+{
+    Task *t = (Task *)lua_touserdata(L, 1);
+    int c;
+    pushfunction(L, t->job);
+    while (!atomic_load(&t->job->failed) && (c = take(t->pool, t->w)) >= 0)
+        runchunk(L, t->job, c, 2);
+    return 0;
+}
+
+/* combines the results of the chunks of a reduce, in order */
+static int docombine(lua_State *L)
+{
+    Job *job = ((Task *)lua_touserdata(L, 1))->job;
+    Value *v = job->results->v;
+    int c = 0;
+    pushfunction(L, job);
+    if (job->init != NULL)
+        pushvalue(L, job->init);
+    else
+        pushvalue(L, &v[c++]);
+    for (; c < job->nchunks; c++) {
+        lua_pushvalue(L, 2);
+        lua_insert(L, -2);
+        pushvalue(L, &v[c]);
+        lua_call(L, 2, 1);
+    }
+    copyvalue(L, -1, &v[job->nchunks], "the accumulator");
+    return 0;
+}
+
+/* runs `f' in the state of a worker, errors are those of the job */
+static void protect(Pool *pool, Worker *w, Job *job, lua_CFunction f)
+{
+    Task t;
+    t.pool = pool;
+    t.w = w;
+    t.job = job;
+    if (lua_cpcall(w->L, f, &t) != 0)
+        fail(job, w->L);
+    lua_settop(w->L, 0);
+}
+
+#if defined(LUAI_PARALLEL)
+
+static void *worker_main(void *arg)
+{
+    Worker *w = (Worker *)arg;
+    Pool *pool = w->pool;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        protect(pool, w, pool->job, dowork);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+#endif
+
+static void stoppool(Pool *pool)
+{
+    int i;
+#if defined(LUAI_PARALLEL)
+    if (pool->size > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 1; i < pool->size; i++)
+            pthread_join(pool->workers[i].thread, NULL);
+        for (i = 0; i < pool->size; i++)
+            pthread_mutex_destroy(&pool->workers[i].lock);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->wake);
+        pthread_cond_destroy(&pool->done);
+    }
+#endif
+    for (i = 0; i < pool->size; i++)
+        lua_close(pool->workers[i].L);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->size = 0;
+}
+
+static lua_State *newworker(void)
+{
+    lua_State *L = luaL_newstate();
+    if (L != NULL) {
+        luaL_openlibs(L);
+        lua_pushboolean(L, 1);
+        lua_setfield(L, LUA_REGISTRYINDEX, PARALLELWORKER);
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, PARALLELCACHE);
+    }
+    return L;
+}
+
+/* creates the states of the workers and starts their threads, 0 on failure */
+static int startpool(Pool *pool)
+{
+    if ((pool->workers = (Worker *)calloc(pool->wanted, sizeof(Worker))) == NULL)
+        return 0;
+#if defined(LUAI_PARALLEL)
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->stop = 0;
+    pool->generation = 0;
+#endif
+    for (pool->size = 0; pool->size < pool->wanted; pool->size++) {
+        Worker *w = &pool->workers[pool->size];
+        w->pool = pool;
+        if ((w->L = newworker()) == NULL)
+            break;
+#if defined(LUAI_PARALLEL)
+        pthread_mutex_init(&w->lock, NULL);
+        if (pool->size > 0 && pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            pthread_mutex_destroy(&w->lock);
+            lua_close(w->L);
+            break;
+        }
+#endif
+    }
+    if (pool->size < pool->wanted) {
+        stoppool(pool);
+        return 0;
+    }
+    return 1;
+}
+
+/* deals the chunks of a job to the workers and waits for all of them */
+static void runjob(Pool *pool, Job *job)
+{
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        pool->workers[i].first = (int)((long long)job->nchunks * i / pool->size);
+        pool->workers[i].last = (int)((long long)job->nchunks * (i + 1) / pool->size);
+    }
+    pool->job = job;
+#if defined(LUAI_PARALLEL)
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->busy = pool->size - 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    protect(pool, &pool->workers[0], job, dowork);
+#if defined(LUAI_PARALLEL)
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    pool->job = NULL;
+}
+
+/* }====================================================== */
+
+static int run(lua_State *L, int reduce)
+{
+    Pool *pool = (Pool *)lua_touserdata(L, lua_upvalueindex(1));
+    int chunkarg = reduce ? 4 : 3;
+    int i, chunk;
+    Value *upvals, init;
+    lua_Debug ar;
+    Job job;
+    memset(&job, 0, sizeof(job));
+    atomic_init(&job.failed, 0);
+    job.reduce = reduce;
+    init.type = LUA_TNIL;
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    job.image = lua_toimage(L, 1, &job.index);
+    luaL_argcheck(L, job.image != NULL, 1, "Lua function of bytecode of version 7 or later expected");
+    chunk = luaL_optint(L, chunkarg, 0);
+    luaL_argcheck(L, chunk >= 0, chunkarg, "negative chunk size");
+    lua_settop(L, chunkarg);
+    lua_pushvalue(L, 1);
+    lua_getinfo(L, ">Su", &ar);
+    job.source = ar.source;
+    /* upvalues, kept alive by the function */
+    job.nups = ar.nups;
+    upvals = (Value *)lua_newuserdata(L, ar.nups * sizeof(Value));
+    job.upvals = upvals;
+    for (i = 0; i < ar.nups; i++) {
+        const char *name = lua_getupvalue(L, 1, i + 1);
+        if (!tovalue(L, -1, &upvals[i]))
+            luaL_error(L, "upvalue " LUA_QS " of the function is a %s, only nil, booleans, "
+                       "numbers and strings cross to the workers", name, luaL_typename(L, -1));
+        lua_pop(L, 1);
+    }
+    if (reduce && !lua_isnil(L, 3)) {
+        if (!tovalue(L, 3, &init))
+            luaL_typerror(L, 3, "nil, boolean, number or string");
+        job.init = &init;
+    }
+    /* elements, kept alive by the table */
+    if (lua_type(L, 2) == LUA_TARRAY) {
+        job.array = lua_toarray(L, 2, &job.kind, &job.n);
+    } else {
+        Value *elems;
+        luaL_checktype(L, 2, LUA_TTABLE);
+        job.n = (int)lua_objlen(L, 2);
+        elems = (Value *)lua_newuserdata(L, job.n * sizeof(Value));
+        job.elems = elems;
+        for (i = 0; i < job.n; i++) {
+            lua_rawgeti(L, 2, i + 1);
+            if (!tovalue(L, -1, &elems[i]))
+                luaL_error(L, "element %d is a %s, only nil, booleans, numbers and strings cross to "
+                           "the workers", i + 1, luaL_typename(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    if (pool->size == 0 && !startpool(pool))
+        return luaL_error(L, "unable to start %d workers", pool->wanted);
+    if (chunk == 0)
+        chunk = (job.n + pool->size * PARALLEL_SPLIT - 1) / (pool->size * PARALLEL_SPLIT);
+    job.chunk = chunk > 0 ? chunk : 1;
+    job.nchunks = (int)(((long long)job.n + job.chunk - 1) / job.chunk);
+    job.results = newresults(L, reduce ? job.nchunks : (job.array != NULL ? 0 : job.n));
+    if (!reduce && job.array != NULL)
+        job.out = lua_newarray(L, job.kind, job.n);
+    if (job.n > 0)
+        runjob(pool, &job);
+    if (reduce && job.nchunks > 0 && !atomic_load(&job.failed))
+        protect(pool, &pool->workers[0], &job, docombine);
+    if (atomic_load(&job.failed))
+        return luaL_error(L, "%s", job.results->error != NULL ? job.results->error
+                                                               : "not enough memory");
+    if (reduce) { /* the reduce of no element is its init */
+        pushvalue(L, job.nchunks > 0 ? &job.results->v[job.nchunks] : &init);
+    } else if (job.out == NULL) {
+        lua_createtable(L, job.n, 0);
+        for (i = 0; i < job.n; i++) {
+            pushvalue(L, &job.results->v[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+    return 1;
+}
+
+static int par_map(lua_State *L) { return run(L, 0); }
+
+static int par_reduce(lua_State *L) { return run(L, 1); }
+
+static int par_workers(lua_State *L)
+{
+    Pool *pool = (Pool *)lua_touserdata(L, lua_upvalueindex(1));
+    int n = luaL_optint(L, 1, 0);
+    lua_pushinteger(L, pool->size > 0 ? pool->size : pool->wanted);
+    if (n != 0) {
+        luaL_argcheck(L, n > 0, 1, "the number of workers must be positive");
+#if !defined(LUAI_PARALLEL)
+        n = 1; /* no threads to run more */
+#endif
+        if (n != pool->size)
+            stoppool(pool); /* the next call starts them again */
+        pool->wanted = n;
+    }
+    return 1;
+}
+
+static int pool_gc(lua_State *L)
+{
+    stoppool((Pool *)luaL_checkudata(L, 1, PARALLELHANDLE));
+    return 0;
+}
+
+static const luaL_Reg parallellib[] = {{"map", par_map},
+                                       {"reduce", par_reduce},
+                                       {"workers", par_workers},
+                                       {NULL, NULL}};
+
+/*
+** Open parallel library
+*/
+LUALIB_API int luaopen_parallel(lua_State *L)
+{
+    Pool *pool;
+    luaL_newmetatable(L, PARALLELRESULTS);
+    lua_pushcfunction(L, results_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    pool = (Pool *)lua_newuserdata(L, sizeof(Pool));
+    memset(pool, 0, sizeof(Pool));
+    pool->wanted = 1;
+#if defined(LUAI_PARALLEL)
+    lua_getfield(L, LUA_REGISTRYINDEX, PARALLELWORKER);
+    if (!lua_toboolean(L, -1)) { /* a worker runs the calls of its functions itself */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool->wanted = cpus > 0 ? (int)cpus : 1;
+    }
+    lua_pop(L, 1);
+#endif
+    luaL_newmetatable(L, PARALLELHANDLE);
+    lua_pushcfunction(L, pool_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    luaI_openlib(L, LUA_PARALLELLIBNAME, parallellib, 1);
+    return 1;
+}
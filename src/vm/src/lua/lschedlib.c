@@ -0,0 +1,769 @@
+/*
+** Scheduler of coroutines over an event loop
+** See Copyright Notice in lua.h
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#define lschedlib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+/*
+** Tasks are coroutines run by `sched.run'.  A task that has nothing to do
+** parks itself on a timer (`sched.sleep') or on the readiness of a
+** descriptor (`sched.wait', `sched.read', `sched.write') and yields; the
+** loop resumes the tasks of its run queue in turn and, once it is empty
+** (or once per round while descriptors are watched), waits for the
+** earliest timer or for a descriptor to get ready, with epoll on Linux,
+** kqueue on the BSDs and macOS, poll elsewhere.  Every waiting task costs
+** a few words, so one state can serve thousands of connections.
+** Outside of a task the same functions simply block.
+*/
+
+#if defined(LUA_USE_POSIX)
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#if defined(LUA_USE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(LUA_USE_KQUEUE)
+#include <sys/event.h>
+#endif
+
+/* readiness events taken by one wait */
+#define SCHED_EVENTS 64
+
+#define SCHED_READ 1
+#define SCHED_WRITE 2
+
+/* states of a task */
+#define TASK_FREE 0
+#define TASK_READY 1   /* in the run queue */
+#define TASK_RUNNING 2 /* resumed by sched.run */
+#define TASK_SLEEP 3   /* parked on a timer */
+#define TASK_WAIT 4    /* parked on a descriptor, and maybe on a timer */
+
+/* what a task waiting for a descriptor does once it is ready */
+#define OP_WAIT 0
+#define OP_READ 1
+#define OP_WRITE 2
+
+typedef struct Task {
+    lua_State *co;    /* its coroutine, anchored in the table of tasks */
+    unsigned gen;     /* bumped whenever it stops waiting, drops its timer */
+    int state;
+    int nres;         /* values pushed on `co' for its next resume */
+    int op, fd;
+    const char *data; /* string sched.write writes, see sched_write */
+    size_t size;      /* bytes to read, or size of `data' */
+    size_t done;      /* bytes of `data' written already */
+} Task;
+
+typedef struct Timer {
+    lua_Number when;
+    int task;
+    unsigned gen; /* the timer is stale unless it matches the task's */
+} Timer;
+
+typedef struct Watch {
+    int reader, writer; /* tasks waiting on the descriptor, 0 for none */
+    int events;         /* events the backend is told about */
+} Watch;
+
+typedef struct Sched {
+    Task *task;         /* indexed by the references of the table of tasks */
+    int ntask, alive;
+    int *queue;         /* ring of ready tasks */
+    int qhead, qsize, qcap;
+    Timer *timer;       /* binary heap on `when' */
+    int ntimer, timercap;
+    Watch *watch;       /* indexed by descriptor */
+    int watchcap;
+    int nwatch;         /* descriptors the backend watches */
+    lua_State *current; /* coroutine of the task being resumed */
+    int currentid;
+    int backend;        /* epoll or kqueue descriptor, -1 with poll */
+#if !defined(LUA_USE_EPOLL) && !defined(LUA_USE_KQUEUE)
+    struct pollfd *pollfd;
+    int npollfd;
+#endif
+} Sched;
+
+#define SCHEDHANDLE "SCHED*"
+#define tosched(L) ((Sched *)lua_touserdata(L, lua_upvalueindex(1)))
+#define TASKS lua_upvalueindex(2)
+
+/* slots of the vectors in the environment of the scheduler */
+#define VEC_TASK 1
+#define VEC_QUEUE 2
+#define VEC_TIMER 3
+#define VEC_WATCH 4
+#define VEC_POLLFD 5
+
+/*
+** grow vector `v' of `*cap' elements to hold `min' of them: the vectors are
+** userdata anchored in the environment of the scheduler, so they count in the
+** heap of the state (and its limits), the old block is left to the collector
+*/
+static void *growvector(lua_State *L, int slot, void *v, int *cap, int min, size_t size)
+{
+    int n = *cap > 0 ? *cap * 2 : 16;
+    void *nv;
+    while (n < min)
+        n *= 2;
+    lua_getfenv(L, lua_upvalueindex(1));
+    nv = lua_newuserdata(L, n * size);
+    if (*cap > 0)
+        memcpy(nv, v, *cap * size);
+    memset((char *)nv + *cap * size, 0, (n - *cap) * size);
+    lua_rawseti(L, -2, slot);
+    lua_pop(L, 1);
+    *cap = n;
+    return nv;
+}
+
+/* write what print and io.write gathered, before blocking or writing to stdout directly */
+static void syncoutput(lua_State *L)
+{
+    lua_flushoutput(L, 1);
+    fflush(stdout);
+}
+
+static lua_Number now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Number)ts.tv_sec + (lua_Number)ts.tv_nsec / 1e9;
+}
+
+/*
+** {======================================================
+** Run queue and timers
+** =======================================================
+*/
+
+static void enqueue(lua_State *L, Sched *s, int id)
+{
+    if (s->qsize == s->qcap) { /* the part of the full ring before its head moves after it */
+        int cap = s->qcap;
+        s->queue = (int *)growvector(L, VEC_QUEUE, s->queue, &s->qcap, cap + 1, sizeof(int));
+        memcpy(s->queue + cap, s->queue, s->qhead * sizeof(int));
+    }
+    s->queue[(s->qhead + s->qsize++) % s->qcap] = id;
+    s->task[id].state = TASK_READY;
+}
+
+static int dequeue(Sched *s)
+{
+    int id = s->queue[s->qhead];
+    s->qhead = (s->qhead + 1) % s->qcap;
+    s->qsize--;
+    return id;
+}
+
+/* make room for a timer, so a task can be parked without raising errors */
+static void reservetimer(lua_State *L, Sched *s)
+{
+    if (s->ntimer == s->timercap)
+        s->timer = (Timer *)growvector(L, VEC_TIMER, s->timer, &s->timercap, s->ntimer + 1,
+                                       sizeof(Timer));
+}
+
+static void addtimer(Sched *s, int id, lua_Number when)
+{
+    int i = s->ntimer++;
+    while (i > 0 && s->timer[(i - 1) / 2].when > when) { /* sift up */
+        s->timer[i] = s->timer[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->timer[i].when = when;
+    s->timer[i].task = id;
+    s->timer[i].gen = s->task[id].gen;
+}
+
+static void poptimer(Sched *s)
+{
+    Timer last = s->timer[--s->ntimer];
+    int i = 0, child;
+    while ((child = 2 * i + 1) < s->ntimer) { /* sift down */
+        if (child + 1 < s->ntimer && s->timer[child + 1].when < s->timer[child].when)
+            child++;
+        if (last.when <= s->timer[child].when)
+            break;
+        s->timer[i] = s->timer[child];
+        i = child;
+    }
+    s->timer[i] = last;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Descriptors
+** =======================================================
+*/
+
+static int checkfd(lua_State *L, int narg)
+{
+    if (lua_type(L, narg) == LUA_TNUMBER) {
+        int fd = (int)lua_tointeger(L, narg);
+        luaL_argcheck(L, fd >= 0, narg, "invalid descriptor");
+        return fd;
+    } else {
+        FILE **f = (FILE **)luaL_checkudata(L, narg, LUA_FILEHANDLE);
+        if (*f == NULL)
+            luaL_error(L, "attempt to use a closed file");
+        return fileno(*f);
+    }
+}
+
+static void setnonblock(lua_State *L, int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1))
+        luaL_error(L, "descriptor %d: %s", fd, strerror(errno));
+}
+
+/*
+** tell the backend which events of `fd' are waited for; returns 0 if it
+** can not watch `fd' because it is always ready (a regular file), -1 on
+** errors
+*/
+static int syncwatch(Sched *s, int fd)
+{
+    Watch *w = &s->watch[fd];
+    int events = (w->reader ? SCHED_READ : 0) | (w->writer ? SCHED_WRITE : 0);
+    if (events == w->events)
+        return 1;
+#if defined(LUA_USE_EPOLL)
+    {
+        struct epoll_event ev;
+        int op = w->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = ((events & SCHED_READ) ? EPOLLIN : 0) | ((events & SCHED_WRITE) ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        if (epoll_ctl(s->backend, op, fd, &ev) == -1 &&
+            (op != EPOLL_CTL_MOD || errno != ENOENT || /* closed and opened again? */
+             epoll_ctl(s->backend, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+            if (errno == EPERM)
+                return 0;
+            if (op != EPOLL_CTL_DEL) /* a closed descriptor left the set by itself */
+                return -1;
+        }
+    }
+#elif defined(LUA_USE_KQUEUE)
+    {
+        struct kevent ev[2];
+        int n = 0, changed = events ^ w->events;
+        if (changed & SCHED_READ)
+            EV_SET(&ev[n++], fd, EVFILT_READ, (events & SCHED_READ) ? EV_ADD : EV_DELETE, 0, 0, 0);
+        if (changed & SCHED_WRITE)
+            EV_SET(&ev[n++], fd, EVFILT_WRITE, (events & SCHED_WRITE) ? EV_ADD : EV_DELETE, 0, 0,
+                   0);
+        if (kevent(s->backend, ev, n, NULL, 0, NULL) == -1 && (changed & events))
+            return -1;
+    }
+#endif
+    s->nwatch += (events != 0) - (w->events != 0);
+    w->events = events;
+    return 1;
+}
+
+/* stop waiting on the descriptor of task `id' */
+static void unwatch(Sched *s, int id)
+{
+    Task *t = &s->task[id];
+    Watch *w = &s->watch[t->fd];
+    if (w->reader == id)
+        w->reader = 0;
+    if (w->writer == id)
+        w->writer = 0;
+    syncwatch(s, t->fd);
+}
+
+/* read at most `n' bytes that are there; pushes the results, -1 if it would block */
+static int doread(lua_State *L, int fd, size_t n)
+{
+    char buff[LUAL_BUFFERSIZE];
+    char *b = n <= sizeof(buff) ? buff : (char *)lua_newuserdata(L, n);
+    ssize_t r;
+    while ((r = read(fd, b, n)) == -1 && errno == EINTR)
+        ;
+    if (r > 0) {
+        lua_pushlstring(L, b, (size_t)r);
+        if (b != buff)
+            lua_remove(L, -2);
+        return 1;
+    }
+    if (b != buff)
+        lua_pop(L, 1);
+    if (r == 0)
+        lua_pushnil(L); /* end of file */
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return -1;
+    else {
+        int en = errno;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(en));
+        lua_pushinteger(L, en);
+        return 3;
+    }
+    return 1;
+}
+
+/* write what is left of `s'; pushes the results, -1 if it would block */
+static int dowrite(lua_State *L, int fd, const char *s, size_t l, size_t *done)
+{
+    while (*done < l) {
+        ssize_t r = write(fd, s + *done, l - *done);
+        if (r >= 0)
+            *done += (size_t)r;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        else if (errno != EINTR) {
+            int en = errno;
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(en));
+            lua_pushinteger(L, en);
+            return 3;
+        }
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* wait for a descriptor outside of a task; returns 0 on timeout */
+static int waitone(lua_State *L, int fd, int events, lua_Number timeout)
+{
+    struct pollfd p;
+    lua_Number deadline = now() + timeout;
+    p.fd = fd;
+    p.events = ((events & SCHED_READ) ? POLLIN : 0) | ((events & SCHED_WRITE) ? POLLOUT : 0);
+    for (;;) {
+        int ms = -1, r;
+        if (timeout >= 0) {
+            lua_Number left = deadline - now();
+            ms = left <= 0 ? 0 : left >= INT_MAX / 1000 ? INT_MAX : (int)(left * 1000 + 0.999);
+        }
+        r = poll(&p, 1, ms);
+        if (r > 0)
+            return 1;
+        if (r == 0)
+            return 0;
+        if (errno != EINTR)
+            luaL_error(L, "descriptor %d: %s", fd, strerror(errno));
+    }
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Waking tasks
+** =======================================================
+*/
+
+/* move the `n' values on top of `L' to the task, for its next resume */
+static void wake(lua_State *L, Sched *s, int id, int n)
+{
+    Task *t = &s->task[id];
+    if (!lua_checkstack(t->co, n))
+        luaL_error(L, "stack overflow");
+    lua_xmove(L, t->co, n);
+    t->nres = n;
+    t->gen++;
+    enqueue(L, s, id);
+}
+
+static void ready(lua_State *L, Sched *s, int fd, int events)
+{
+    Watch *w = &s->watch[fd];
+    int i;
+    for (i = 0; i < 2; i++) {
+        int id = i == 0 ? ((events & SCHED_READ) ? w->reader : 0)
+                        : ((events & SCHED_WRITE) ? w->writer : 0);
+        Task *t = &s->task[id];
+        int n = 1;
+        if (id == 0)
+            continue;
+        if (t->op == OP_READ)
+            n = doread(L, fd, t->size);
+        else if (t->op == OP_WRITE)
+            n = dowrite(L, fd, t->data, t->size, &t->done);
+        else
+            lua_pushboolean(L, 1);
+        if (n < 0)
+            continue; /* not ready after all, keep waiting */
+        unwatch(s, id);
+        wake(L, s, id, n);
+    }
+}
+
+static void expire(lua_State *L, Sched *s)
+{
+    lua_Number t0 = now();
+    while (s->ntimer > 0 && s->timer[0].when <= t0) {
+        Timer tm = s->timer[0];
+        Task *t = &s->task[tm.task];
+        poptimer(s);
+        if (t->gen != tm.gen)
+            continue; /* the task stopped waiting already */
+        if (t->state == TASK_SLEEP)
+            wake(L, s, tm.task, 0);
+        else if (t->state == TASK_WAIT) { /* timed out */
+            unwatch(s, tm.task);
+            lua_pushboolean(L, 0);
+            wake(L, s, tm.task, 1);
+        }
+    }
+}
+
+/* wait at most `timeout' seconds (forever if negative) for descriptors */
+static void poll_events(lua_State *L, Sched *s, lua_Number timeout)
+{
+    int ms = timeout < 0 ? -1 : timeout >= INT_MAX / 1000 ? INT_MAX : (int)(timeout * 1000 + 0.999);
+    int i, n;
+#if defined(LUA_USE_EPOLL)
+    struct epoll_event ev[SCHED_EVENTS];
+    n = epoll_wait(s->backend, ev, SCHED_EVENTS, ms);
+    for (i = 0; i < n; i++) {
+        unsigned e = ev[i].events;
+        int hup = (e & (EPOLLERR | EPOLLHUP)) ? SCHED_READ | SCHED_WRITE : 0;
+        ready(L, s, ev[i].data.fd,
+              hup | ((e & EPOLLIN) ? SCHED_READ : 0) | ((e & EPOLLOUT) ? SCHED_WRITE : 0));
+    }
+#elif defined(LUA_USE_KQUEUE)
+    struct kevent ev[SCHED_EVENTS];
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    n = kevent(s->backend, NULL, 0, ev, SCHED_EVENTS, ms < 0 ? NULL : &ts);
+    for (i = 0; i < n; i++)
+        ready(L, s, (int)ev[i].ident, ev[i].filter == EVFILT_READ ? SCHED_READ : SCHED_WRITE);
+#else
+    int fd, m = 0;
+    if (s->nwatch > s->npollfd)
+        s->pollfd = (struct pollfd *)growvector(L, VEC_POLLFD, s->pollfd, &s->npollfd,
+                                                s->nwatch, sizeof(struct pollfd));
+    for (fd = 0; m < s->nwatch; fd++) {
+        if (s->watch[fd].events != 0) {
+            s->pollfd[m].fd = fd;
+            s->pollfd[m].events = ((s->watch[fd].events & SCHED_READ) ? POLLIN : 0) |
+                                  ((s->watch[fd].events & SCHED_WRITE) ? POLLOUT : 0);
+            m++;
+        }
+    }
+    n = poll(s->pollfd, m, ms);
+    for (i = 0; i < m && n > 0; i++) {
+        short e = s->pollfd[i].revents;
+        int hup = (e & (POLLERR | POLLHUP | POLLNVAL)) ? SCHED_READ | SCHED_WRITE : 0;
+        if (e != 0)
+            ready(L, s, s->pollfd[i].fd,
+                  hup | ((e & POLLIN) ? SCHED_READ : 0) | ((e & POLLOUT) ? SCHED_WRITE : 0));
+    }
+#endif
+    if (n == -1 && errno != EINTR)
+        luaL_error(L, "sched: %s", strerror(errno));
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Library functions
+** =======================================================
+*/
+
+#define taskid(s, t) ((int)((t) - (s)->task))
+
+/* the task running in `L', NULL outside of a task */
+static Task *parkable(Sched *s, lua_State *L)
+{
+    if (s->current != L)
+        return NULL;
+    if (!lua_isyieldable(L)) /* parking must not fail once it is done */
+        luaL_error(L, "attempt to yield across metamethod/C-call boundary");
+    return &s->task[s->currentid];
+}
+
+/* park the running task `t' on `fd'; returns 0 if the descriptor is always ready */
+static int parkfd(lua_State *L, Sched *s, Task *t, int fd, int events, int op)
+{
+    int *slot, r;
+    if (fd >= s->watchcap)
+        s->watch =
+            (Watch *)growvector(L, VEC_WATCH, s->watch, &s->watchcap, fd + 1, sizeof(Watch));
+    slot = events == SCHED_READ ? &s->watch[fd].reader : &s->watch[fd].writer;
+    if (*slot != 0)
+        luaL_error(L, "descriptor %d is waited for by another task", fd);
+    *slot = taskid(s, t);
+    if ((r = syncwatch(s, fd)) <= 0) {
+        int en = errno;
+        *slot = 0;
+        if (r < 0)
+            luaL_error(L, "descriptor %d: %s", fd, strerror(en));
+        return 0;
+    }
+    t->state = TASK_WAIT;
+    t->op = op;
+    t->fd = fd;
+    return 1;
+}
+
+static int sched_spawn(lua_State *L)
+{
+    Sched *s = tosched(L);
+    int n = lua_gettop(L), id;
+    lua_State *co;
+    Task *t;
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    co = lua_newthread(L);
+    if (!lua_checkstack(co, n))
+        return luaL_error(L, "too many arguments to spawn");
+    lua_insert(L, 1);
+    lua_xmove(L, co, n); /* the function and its arguments */
+    lua_pushvalue(L, 1);
+    id = luaL_ref(L, TASKS);
+    if (id >= s->ntask)
+        s->task = (Task *)growvector(L, VEC_TASK, s->task, &s->ntask, id + 1, sizeof(Task));
+    t = &s->task[id];
+    t->co = co;
+    t->nres = n - 1;
+    s->alive++;
+    enqueue(L, s, id);
+    return 1;
+}
+
+static int sched_yield(lua_State *L)
+{
+    if (parkable(tosched(L), L) == NULL)
+        return 0;
+    return lua_yield(L, 0); /* a running task that yields goes back to the queue */
+}
+
+static int sched_sleep(lua_State *L)
+{
+    Sched *s = tosched(L);
+    lua_Number d = luaL_optnumber(L, 1, 0);
+    Task *t = parkable(s, L);
+    struct timespec ts;
+    if (t != NULL) {
+        reservetimer(L, s);
+        addtimer(s, taskid(s, t), now() + d);
+        t->state = TASK_SLEEP;
+        return lua_yield(L, 0);
+    }
+    if (d <= 0)
+        return 0;
+    ts.tv_sec = (time_t)d;
+    ts.tv_nsec = (long)((d - (lua_Number)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+    return 0;
+}
+
+static int sched_wait(lua_State *L)
+{
+    static const char *const modes[] = {"r", "w", NULL};
+    Sched *s = tosched(L);
+    int fd = checkfd(L, 1);
+    int events = luaL_checkoption(L, 2, "r", modes) == 0 ? SCHED_READ : SCHED_WRITE;
+    lua_Number timeout = luaL_optnumber(L, 3, -1);
+    Task *t = parkable(s, L);
+    if (t == NULL)
+        lua_pushboolean(L, waitone(L, fd, events, timeout));
+    else {
+        reservetimer(L, s);
+        if (!parkfd(L, s, t, fd, events, OP_WAIT))
+            lua_pushboolean(L, 1); /* always ready */
+        else {
+            if (timeout >= 0)
+                addtimer(s, taskid(s, t), now() + timeout);
+            return lua_yield(L, 0);
+        }
+    }
+    return 1;
+}
+
+static int sched_read(lua_State *L)
+{
+    Sched *s = tosched(L);
+    int fd = checkfd(L, 1), n;
+    lua_Integer size = luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
+    Task *t;
+    luaL_argcheck(L, size > 0, 2, "size must be positive");
+    setnonblock(L, fd);
+    t = parkable(s, L);
+    while ((n = doread(L, fd, (size_t)size)) < 0) {
+        if (t != NULL && parkfd(L, s, t, fd, SCHED_READ, OP_READ)) {
+            t->size = (size_t)size;
+            return lua_yield(L, 0);
+        }
+        waitone(L, fd, SCHED_READ, -1);
+    }
+    return n;
+}
+
+static int sched_write(lua_State *L)
+{
+    Sched *s = tosched(L);
+    int fd = checkfd(L, 1), n;
+    size_t l, done = 0;
+    const char *data = luaL_checklstring(L, 2, &l);
+    Task *t;
+    if (fd == STDOUT_FILENO)
+        syncoutput(L);
+    setnonblock(L, fd);
+    t = parkable(s, L);
+    while ((n = dowrite(L, fd, data, l, &done)) < 0) {
+        if (t != NULL && parkfd(L, s, t, fd, SCHED_WRITE, OP_WRITE)) {
+            /* the string stays in the frame of this call, below what it yields */
+            t->data = data;
+            t->size = l;
+            t->done = done;
+            return lua_yield(L, 0);
+        }
+        waitone(L, fd, SCHED_WRITE, -1);
+    }
+    return n;
+}
+
+static int sched_now(lua_State *L)
+{
+    lua_pushnumber(L, now());
+    return 1;
+}
+
+/* resume task `id'; returns its status, with the error on top of `L' if it failed */
+static int step(lua_State *L, Sched *s, int id)
+{
+    lua_State *co = s->task[id].co;
+    int status, nres = s->task[id].nres;
+    s->task[id].state = TASK_RUNNING;
+    s->task[id].nres = 0;
+    s->current = co;
+    s->currentid = id;
+    status = lua_resume(co, nres);
+    s->current = NULL;
+    if (status == LUA_YIELD) {
+        lua_settop(co, 0); /* drop what a coroutine.yield passed */
+        if (s->task[id].state == TASK_RUNNING)
+            enqueue(L, s, id);
+        return 0;
+    }
+    s->task[id].gen++;
+    s->task[id].state = TASK_FREE;
+    s->task[id].co = NULL;
+    s->alive--;
+    if (status != 0)
+        lua_xmove(co, L, 1); /* the error */
+    luaL_unref(L, TASKS, id);
+    return status;
+}
+
+static int sched_run(lua_State *L)
+{
+    Sched *s = tosched(L);
+    if (s->current != NULL)
+        return luaL_error(L, LUA_QL("sched.run") " called from a task");
+    lua_settop(L, 0);
+    while (s->alive > 0) {
+        int n;
+        expire(L, s);
+        if (s->qsize == 0) { /* nothing to run, block until a task is woken */
+            lua_Number timeout = s->ntimer > 0 ? s->timer[0].when - now() : -1;
+            if (s->ntimer > 0 && timeout < 0)
+                timeout = 0;
+            else if (timeout < 0 && s->nwatch == 0)
+                break; /* nothing could wake them */
+            syncoutput(L);
+            poll_events(L, s, timeout);
+        } else if (s->nwatch > 0)
+            poll_events(L, s, 0); /* ready descriptors join the queue every round */
+        for (n = s->qsize; n > 0; n--) {
+            if (step(L, s, dequeue(s)) != 0)
+                return lua_error(L);
+        }
+    }
+    return 0;
+}
+
+static int sched_gc(lua_State *L)
+{
+    Sched *s = (Sched *)luaL_checkudata(L, 1, SCHEDHANDLE);
+    if (s->backend != -1)
+        close(s->backend);
+    return 0;
+}
+
+static const luaL_Reg schedlib[] = {{"now", sched_now},     {"read", sched_read},
+                                    {"run", sched_run},     {"sleep", sched_sleep},
+                                    {"spawn", sched_spawn}, {"wait", sched_wait},
+                                    {"write", sched_write}, {"yield", sched_yield},
+                                    {NULL, NULL}};
+
+/* }====================================================== */
+
+/*
+** Open sched library
+*/
+LUALIB_API int luaopen_sched(lua_State *L)
+{
+    Sched *s = (Sched *)lua_newuserdata(L, sizeof(Sched));
+    memset(s, 0, sizeof(Sched));
+#if defined(LUA_USE_EPOLL)
+    s->backend = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(LUA_USE_KQUEUE)
+    s->backend = kqueue();
+#else
+    s->backend = -1;
+#endif
+    luaL_newmetatable(L, SCHEDHANDLE);
+    lua_pushcfunction(L, sched_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_newtable(L); /* vectors */
+    lua_setfenv(L, -2);
+#if defined(LUA_USE_EPOLL) || defined(LUA_USE_KQUEUE)
+    if (s->backend == -1)
+        return luaL_error(L, "sched: %s", strerror(errno));
+#endif
+    lua_newtable(L); /* tasks */
+    luaI_openlib(L, LUA_SCHEDLIBNAME, schedlib, 2);
+#if defined(LUA_USE_EPOLL)
+    lua_pushliteral(L, "epoll");
+#elif defined(LUA_USE_KQUEUE)
+    lua_pushliteral(L, "kqueue");
+#else
+    lua_pushliteral(L, "poll");
+#endif
+    lua_setfield(L, -2, "backend");
+    return 1;
+}
+
+#else
+
+static const luaL_Reg schedlib[] = {{NULL, NULL}};
+
+/*
+** Open sched library, empty without POSIX
+*/
+LUALIB_API int luaopen_sched(lua_State *L)
+{
+    luaL_register(L, LUA_SCHEDLIBNAME, schedlib);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+** Kernels of table.sort
+** See Copyright Notice in lua.h
+*/
+
+/*
+** Included by ltable.c once for every kind of elements, with
+**   SORTLESS(i, j)  whether t->array[i] goes before t->array[j], it may
+**                   call Lua (order functions, __lt) for the generic kind
+**   KERNEL(name)    name of a kernel for the kind
+** The kernels only swap elements of t->array and read it again after
+** every comparison, so Lua code run by a comparison may move the array.
+** Ranges are 0-based and inclusive.
+*/
+
+static void KERNEL(insertion)(lua_State *L, Table *t, int n, const TValue *f, int lo, int up)
+{
+    int i, j;
+    for (i = lo + 1; i <= up; i++)
+        for (j = i; j > lo && SORTLESS(j, j - 1); j--)
+            sortswap(t, j, j - 1);
+}
+
+static void KERNEL(siftdown)(lua_State *L, Table *t, int n, const TValue *f, int lo, int root,
+                             int up)
+{
+    for (;;) {
+        int child = lo + 2 * (root - lo) + 1;
+        if (child > up)
+            return;
+        if (child < up && SORTLESS(child, child + 1))
+            child++;
+        if (!SORTLESS(root, child))
+            return;
+        sortswap(t, root, child);
+        root = child;
+    }
+}
+
+static void KERNEL(heap)(lua_State *L, Table *t, int n, const TValue *f, int lo, int up)
+{
+    int i;
+    for (i = lo + (up - lo - 1) / 2; i >= lo; i--)
+        KERNEL(siftdown)(L, t, n, f, lo, i, up);
+    for (i = up; i > lo; i--) {
+        sortswap(t, lo, i);
+        KERNEL(siftdown)(L, t, n, f, lo, lo, i - 1);
+    }
+}
+
+/* quicksort with a median of three, heapsort once `depth' partitions did not halve the range */
+static void KERNEL(intro)(lua_State *L, Table *t, int n, const TValue *f, int lo, int up,
+                          int depth)
+{
+    while (up - lo >= SORTCUTOFF) {
+        int mid = lo + (up - lo) / 2, p = up - 1, i = lo, j = up - 1;
+        if (depth-- == 0) {
+            KERNEL(heap)(L, t, n, f, lo, up);
+            return;
+        }
+        if (SORTLESS(mid, lo))
+            sortswap(t, mid, lo);
+        if (SORTLESS(up, lo))
+            sortswap(t, up, lo);
+        if (SORTLESS(up, mid))
+            sortswap(t, up, mid);
+        sortswap(t, mid, p); /* a[lo] <= P == a[up-1] <= a[up] */
+        for (;;) {           /* invariant: a[lo..i] <= P <= a[j..up] */
+            while (SORTLESS(++i, p))
+                if (i >= p)
+                    luaG_runerror(L, "invalid order function for sorting");
+            while (SORTLESS(p, --j))
+                if (j <= lo)
+                    luaG_runerror(L, "invalid order function for sorting");
+            if (j < i)
+                break;
+            sortswap(t, i, j);
+        }
+        sortswap(t, p, i); /* a[lo..i-1] <= a[i] == P <= a[i+1..up] */
+        /* recurse into the smaller half, so the stack stays logarithmic */
+        if (i - lo < up - i) {
+            KERNEL(intro)(L, t, n, f, lo, i - 1, depth);
+            lo = i + 1;
+        } else {
+            KERNEL(intro)(L, t, n, f, i + 1, up, depth);
+            up = i - 1;
+        }
+    }
+    KERNEL(insertion)(L, t, n, f, lo, up);
+}
+
+static void KERNEL(sort)(lua_State *L, Table *t, int n, const TValue *f, int up)
+{
+    int i, depth = 0;
+    for (i = 1; i <= up && !SORTLESS(i, i - 1); i++)
+        ;
+    if (i > up)
+        return; /* sorted already */
+    for (i = up + 1; i > 1; i >>= 1)
+        depth += 2;
+    KERNEL(intro)(L, t, n, f, 0, up, depth);
+}
@@ -5,6 +5,8 @@
 */
 
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 
 #define lstate_c
 #define LUA_CORE
@@ -25,6 +27,9 @@
 #define fromstate(l) (cast(lu_byte *, (l)) - LUAI_EXTRASPACE)
 #define tostate(l) (cast(lua_State *, cast(lu_byte *, l) + LUAI_EXTRASPACE))
 
+/* the pool of dead coroutines is linked through `gclist' (the union may be NULL) */
+#define nextpooled(l) cast(lua_State *, (l)->gclist)
+
 /*
 ** Main thread combines a thread state and the global state
 */
@@ -33,16 +38,10 @@ typedef struct LG {
     global_State g;
 } LG;
 
-static void stack_init(lua_State *L1, lua_State *L)
+static void stack_reset(lua_State *L1)
 {
-    /* initialize CallInfo array */
-    L1->base_ci = luaM_newvector(L, BASIC_CI_SIZE, CallInfo);
     L1->ci = L1->base_ci;
-    L1->size_ci = BASIC_CI_SIZE;
     L1->end_ci = L1->base_ci + L1->size_ci - 1;
-    /* initialize stack array */
-    L1->stack = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, TValue);
-    L1->stacksize = BASIC_STACK_SIZE + EXTRA_STACK;
     L1->top = L1->stack;
     L1->stack_last = L1->stack + (L1->stacksize - EXTRA_STACK) - 1;
     /* initialize first ci */
@@ -52,6 +51,18 @@ static void stack_init(lua_State *L1, lua_State *L)
     L1->ci->top = L1->top + LUA_MINSTACK;
 }
 
+static void stack_init(lua_State *L1, lua_State *L, int nci, int nstack)
+{
+    lua_assert(nstack >= LUA_MINSTACK + 2);
+    /* initialize CallInfo array */
+    L1->base_ci = luaM_newvector(L, nci, CallInfo);
+    L1->size_ci = nci;
+    /* initialize stack array */
+    L1->stack = luaM_newvector(L, nstack + EXTRA_STACK, TValue);
+    L1->stacksize = nstack + EXTRA_STACK;
+    stack_reset(L1);
+}
+
 static void freestack(lua_State *L, lua_State *L1)
 {
     luaM_freearray(L, L1->base_ci, L1->size_ci, CallInfo);
@@ -65,7 +76,7 @@ static void f_luaopen(lua_State *L, void *ud)
 {
     global_State *g = G(L);
     UNUSED(ud);
-    stack_init(L, L);                             /* init stack */
+    stack_init(L, L, BASIC_CI_SIZE, BASIC_STACK_SIZE); /* init stack */
     sethvalue(L, gt(L), luaH_new(L, 0, 2));       /* table of globals */
     sethvalue(L, registry(L), luaH_new(L, 0, 2)); /* registry */
     luaS_resize(L, MINSTRTABSIZE);                /* initial size of string table */
@@ -74,6 +85,36 @@ static void f_luaopen(lua_State *L, void *ud)
     g->GCthreshold = 4 * g->totalbytes;
 }
 
+/*
+** a seed that changes with every run makes the string hashes (and with them
+** the collisions in tables) unpredictable; define luai_makeseed to a
+** constant for reproducible traversal orders
+*/
+#if !defined(luai_makeseed)
+#include <time.h>
+#define luai_makeseed() cast(unsigned int, time(NULL))
+#endif
+
+#define addbuff(b, p, e)                                                                           \
+    {                                                                                              \
+        size_t t = cast(size_t, e);                                                                \
+        memcpy(b + p, &t, sizeof(t));                                                              \
+        p += sizeof(t);                                                                            \
+    }
+
+static unsigned int makeseed(lua_State *L)
+{
+    char buff[4 * sizeof(size_t)];
+    unsigned int h = luai_makeseed();
+    int p = 0;
+    addbuff(buff, p, L);  /* heap variable */
+    addbuff(buff, p, &h); /* local variable */
+    addbuff(buff, p, luaO_nilobject); /* global variable */
+    addbuff(buff, p, &lua_newstate);  /* public function */
+    lua_assert(p == sizeof(buff));
+    return luaS_hash(buff, p, h);
+}
+
 static void preinit_state(lua_State *L, global_State *g)
 {
     G(L) = g;
@@ -100,21 +141,84 @@ static void close_state(lua_State *L)
     global_State *g = G(L);
     luaF_close(L, L->stack); /* close all upvalues for this thread */
     luaC_freeall(L);         /* collect all objects */
+    luaH_freeshapes(L);
     lua_assert(g->rootgc == obj2gco(L));
     lua_assert(g->strt.nuse == 0);
     luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
+    luaM_freearray(L, G(L)->strt.oldhash, G(L)->strt.oldsize, TString *);
     luaZ_freebuffer(L, &g->buff);
+    luaE_flushoutput(L);
+    luaZ_freebuffer(L, &g->output);
+    while (g->threadpool != NULL) {
+        lua_State *L1 = g->threadpool;
+        g->threadpool = nextpooled(L1);
+        freestack(L, L1);
+        luaM_freemem(L, fromstate(L1), state_size(lua_State));
+    }
     freestack(L, L);
     lua_assert(g->totalbytes == sizeof(LG));
     (*g->frealloc)(g->ud, fromstate(L), state_size(LG), 0);
 }
 
+/*
+** write what lua_writeoutput gathered to the standard output; returns 0
+** if writing failed
+*/
+int luaE_flushoutput(lua_State *L)
+{
+    Mbuffer *b = &G(L)->output;
+    size_t n = luaZ_bufflen(b);
+    luaZ_resetbuffer(b);
+    return n == 0 || fwrite(luaZ_buffer(b), 1, n, stdout) == n;
+}
+
+/*
+** the generator state is expanded from the bits of the seed by splitmix64,
+** which never gives xoshiro256** the all-zero state; every new state starts
+** from the seed 0, so its random numbers are the same from run to run
+*/
+void luaE_seedrandom(global_State *g, lua_Number seed)
+{
+    uint64_t x = 0;
+    int i;
+    memcpy(&x, &seed, sizeof(seed) < sizeof(x) ? sizeof(seed) : sizeof(x));
+    for (i = 0; i < 4; i++) {
+        uint64_t z = (x += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        g->random[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+** coroutines come from the pool of dead ones when it is not empty: their
+** stacks and CallInfo arrays are reused as they are, with the size they
+** grew to, so a program creating and dropping generators at a high rate
+** neither allocates nor grows stacks
+*/
 lua_State *luaE_newthread(lua_State *L)
 {
-    lua_State *L1 = tostate(luaM_malloc(L, state_size(lua_State)));
-    luaC_link(L, obj2gco(L1), LUA_TTHREAD);
-    preinit_state(L1, G(L));
-    stack_init(L1, L);          /* init stack */
+    global_State *g = G(L);
+    lua_State *L1 = g->threadpool;
+    if (L1 != NULL) {
+        StkId stack = L1->stack;
+        CallInfo *base_ci = L1->base_ci;
+        int stacksize = L1->stacksize, size_ci = L1->size_ci;
+        g->threadpool = nextpooled(L1);
+        g->nthreadpool--;
+        luaC_link(L, obj2gco(L1), LUA_TTHREAD);
+        preinit_state(L1, g);
+        L1->stack = stack;
+        L1->stacksize = stacksize;
+        L1->base_ci = base_ci;
+        L1->size_ci = size_ci;
+        stack_reset(L1);
+    } else {
+        L1 = tostate(luaM_malloc(L, state_size(lua_State)));
+        luaC_link(L, obj2gco(L1), LUA_TTHREAD);
+        preinit_state(L1, g);
+        stack_init(L1, L, THREAD_CI_SIZE, THREAD_STACK_SIZE); /* init stack */
+    }
     setobj2n(L, gt(L1), gt(L)); /* share table of globals */
     L1->hookmask = L->hookmask;
     L1->basehookcount = L->basehookcount;
@@ -126,9 +230,17 @@ lua_State *luaE_newthread(lua_State *L)
 
 void luaE_freethread(lua_State *L, lua_State *L1)
 {
+    global_State *g = G(L);
     luaF_close(L1, L1->stack); /* close all upvalues for this thread */
     lua_assert(L1->openupval == NULL);
     luai_userstatefree(L1);
+    if (g->nthreadpool < LUAI_THREADPOOL && L1->stack != NULL &&
+        L1->stacksize <= LUAI_THREADPOOLSTACK && L1->size_ci <= LUAI_THREADPOOLSTACK) {
+        L1->gclist = obj2gco(g->threadpool); /* keep it for luaE_newthread */
+        g->threadpool = L1;
+        g->nthreadpool++;
+        return;
+    }
     freestack(L, L1);
     luaM_freemem(L, fromstate(L1), state_size(lua_State));
 }
@@ -152,16 +264,27 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud)
     g->frealloc = f;
     g->ud = ud;
     g->mainthread = L;
+    g->threadpool = NULL;
+    g->nthreadpool = 0;
     g->uvhead.u.l.prev = &g->uvhead;
     g->uvhead.u.l.next = &g->uvhead;
     g->GCthreshold = 0; /* mark it as unfinished state */
     g->strt.size = 0;
     g->strt.nuse = 0;
     g->strt.hash = NULL;
+    g->strt.oldhash = NULL;
+    g->strt.oldsize = 0;
+    g->strt.moved = 0;
+    g->seed = makeseed(L);
     setnilvalue(registry(L));
     luaZ_initbuffer(L, &g->buff);
+    luaZ_initbuffer(L, &g->output);
+    luaZ_resetbuffer(&g->output);
+    g->outputtty = cast_byte(lua_stdout_is_tty());
+    luaE_seedrandom(g, 0);
     g->panic = NULL;
     g->gcstate = GCSpause;
+    g->gckind = KGC_NORMAL;
     g->rootgc = obj2gco(L);
     g->sweepstrgc = 0;
     g->sweepgc = &g->rootgc;
@@ -172,7 +295,20 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud)
     g->totalbytes = sizeof(LG);
     g->gcpause = LUAI_GCPAUSE;
     g->gcstepmul = LUAI_GCMUL;
+    g->gcgenminor = LUAI_GCGENMINOR;
+    g->gcmajorinc = LUAI_GCMAJORINC;
+    g->gcmajorbase = 0;
+    g->sweeper = NULL;
+    memset(&g->gcstats, 0, sizeof(g->gcstats));
     g->gcdept = 0;
+    g->memlimit = g->memsoft = 0;
+    g->memcheck = MAX_LUMEM;
+    g->memurgent = 0;
+    g->tablestamp = 0;
+    g->rootshape.parent = g->rootshape.child = g->rootshape.sibling = NULL;
+    g->rootshape.id = g->shapeid = 1; /* 0 is the id of empty inline caches */
+    g->rootshape.nkeys = 0;
+    g->nshapes = 0;
     for (i = 0; i < NUM_TAGS; i++)
         g->mt[i] = NULL;
     if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
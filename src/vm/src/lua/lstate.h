@@ -7,6 +7,8 @@
 #ifndef lstate_h
 #define lstate_h
 
+#include <stdint.h>
+
 #include "lua.h"
 
 #include "lobject.h"
@@ -28,10 +30,22 @@ struct lua_longjmp; /* defined in ldo.c */
 
 #define BASIC_STACK_SIZE (2 * LUA_MINSTACK)
 
+/* coroutines start smaller, their arrays grow on demand or come from the pool */
+#define THREAD_CI_SIZE 4
+
+#define THREAD_STACK_SIZE (LUA_MINSTACK + 2)
+
+/* kinds of Garbage Collection */
+#define KGC_NORMAL 0
+#define KGC_GEN 1 /* generational collection */
+
 typedef struct stringtable {
     GCObject **hash;
     lu_int32 nuse; /* number of elements */
     int size;
+    GCObject **oldhash; /* buckets still being moved into `hash' (see luaS_resize) */
+    int oldsize;
+    int moved; /* buckets of `oldhash' already moved */
 } stringtable;
 
 /*
@@ -56,10 +70,12 @@ typedef struct CallInfo {
 */
 typedef struct global_State {
     stringtable strt;   /* hash table for strings */
+    unsigned int seed;  /* randomized seed of the string hashes */
     lua_Alloc frealloc; /* function to reallocate memory */
     void *ud;           /* auxiliary data to `frealloc' */
     lu_byte currentwhite;
     lu_byte gcstate;     /* state of garbage collector */
+    lu_byte gckind;      /* kind of collections (KGC_NORMAL or KGC_GEN) */
     int sweepstrgc;      /* position of sweep in `strt' */
     GCObject *rootgc;    /* list of all collectable objects */
     GCObject **sweepgc;  /* position of sweep in `rootgc' */
@@ -68,15 +84,33 @@ typedef struct global_State {
     GCObject *weak;      /* list of weak tables (to be cleared) */
     GCObject *tmudata;   /* last element of list of userdata to be GC */
     Mbuffer buff;        /* temporary buffer for string concatentation */
+    Mbuffer output;      /* standard output not written yet (see lua_writeoutput) */
+    lu_byte outputtty;   /* true if the standard output is a terminal */
+    uint64_t random[4];  /* xoshiro256** state of lua_random (see luaE_seedrandom) */
     lu_mem GCthreshold;
     lu_mem totalbytes;   /* number of bytes currently allocated */
     lu_mem estimate;     /* an estimate of number of bytes actually in use */
     lu_mem gcdept;       /* how much GC is `behind schedule' */
+    lu_mem memlimit;     /* heap size allocations can not go past, 0 for none (see lua_gc) */
+    lu_mem memsoft;      /* heap size past which a full collection runs, 0 for none */
+    lu_mem memcheck;     /* the lowest limit in effect, all luaM_realloc_ compares with */
+    lu_byte memurgent;   /* the soft limit asked for a full collection (see luaC_step) */
+    lu_int32 tablestamp; /* last stamp handed out to a table (see Table) */
+    Shape rootshape;     /* shape of the tables without keys, root of the shape tree */
+    lu_int32 shapeid;    /* last id handed out to a shape */
+    int nshapes;         /* number of shapes besides the root */
     int gcpause;         /* size of pause between successive GCs */
     int gcstepmul;       /* GC `granularity' */
+    int gcgenminor;      /* allocation between minor collections (generational) */
+    int gcmajorinc;      /* growth of the heap between major collections */
+    lu_mem gcmajorbase;  /* memory in use after the last major collection */
+    lua_GCStats gcstats; /* telemetry of the collector (see lua_gcstats) */
     lua_CFunction panic; /* to be called in unprotected errors */
     TValue l_registry;
     struct lua_State *mainthread;
+    struct lua_State *threadpool; /* dead coroutines kept for their stacks (see luaE_newthread) */
+    int nthreadpool;
+    struct Sweeper *sweeper;    /* thread releasing dead objects (see luaC_setsweeper) */
     UpVal uvhead;               /* head of double-linked list of all open upvalues */
     struct Table *mt[NUM_TAGS]; /* metatables for basic types */
     TString *tmname[TM_N];      /* array with tag-method names */
@@ -127,6 +161,7 @@ union GCObject {
     struct Table h;
     struct Proto p;
     struct UpVal uv;
+    struct Array a;
     struct lua_State th; /* thread */
 };
 
@@ -138,6 +173,7 @@ union GCObject {
 #define gco2cl(o) check_exp((o)->gch.tt == LUA_TFUNCTION, &((o)->cl))
 #define gco2h(o) check_exp((o)->gch.tt == LUA_TTABLE, &((o)->h))
 #define gco2p(o) check_exp((o)->gch.tt == LUA_TPROTO, &((o)->p))
+#define gco2a(o) check_exp((o)->gch.tt == LUA_TARRAY, &((o)->a))
 #define gco2uv(o) check_exp((o)->gch.tt == LUA_TUPVAL, &((o)->uv))
 #define ngcotouv(o) check_exp((o) == NULL || (o)->gch.tt == LUA_TUPVAL, &((o)->uv))
 #define gco2th(o) check_exp((o)->gch.tt == LUA_TTHREAD, &((o)->th))
@@ -147,5 +183,7 @@ union GCObject {
 
 LUAI_FUNC lua_State *luaE_newthread(lua_State *L);
 LUAI_FUNC void luaE_freethread(lua_State *L, lua_State *L1);
+LUAI_FUNC int luaE_flushoutput(lua_State *L);
+LUAI_FUNC void luaE_seedrandom(global_State *g, lua_Number seed);
 
 #endif
@@ -16,6 +16,43 @@
 #include "lstate.h"
 #include "lstring.h"
 
+/*
+** buckets of the old table moved by every new string while the table is
+** resized; a table only grows again after `size' more strings, by then
+** all of its old buckets have been moved (GC steps move some more)
+*/
+#define MOVESTEP 2
+
+void luaS_movebuckets(lua_State *L, int n)
+{
+    stringtable *tb = &G(L)->strt;
+    while (n-- > 0 && tb->moved < tb->oldsize) {
+        GCObject *p = tb->oldhash[tb->moved];
+        tb->oldhash[tb->moved++] = NULL;
+        while (p) {                       /* for each node in the list */
+            GCObject *next = p->gch.next; /* save next */
+            unsigned int h = gco2ts(p)->hash;
+            int h1 = lmod(h, tb->size); /* new position */
+            lua_assert(cast_int(h % tb->size) == lmod(h, tb->size));
+            p->gch.next = tb->hash[h1]; /* chain it */
+            tb->hash[h1] = p;
+            p = next;
+        }
+    }
+    if (tb->moved == tb->oldsize) { /* all moved? */
+        luaM_freearray(L, tb->oldhash, tb->oldsize, TString *);
+        tb->oldhash = NULL;
+        tb->oldsize = 0;
+        tb->moved = 0;
+    }
+}
+
+/*
+** the strings are moved to the new buckets a few at a time (see newlstr),
+** until then they are looked up in both tables; a table shrinks from
+** checkSizes, inside a GC step that must not leave the heap larger, so
+** its few strings are moved and the old buckets freed at once
+*/
 void luaS_resize(lua_State *L, int newsize)
 {
     GCObject **newhash;
@@ -23,26 +60,63 @@ void luaS_resize(lua_State *L, int newsize)
     int i;
     if (G(L)->gcstate == GCSsweepstring)
         return; /* cannot resize during GC traverse */
-    newhash = luaM_newvector(L, newsize, GCObject *);
     tb = &G(L)->strt;
+    if (tb->oldhash != NULL) /* previous resize still going on? */
+        luaS_movebuckets(L, tb->oldsize);
+    newhash = luaM_newvector(L, newsize, GCObject *);
     for (i = 0; i < newsize; i++)
         newhash[i] = NULL;
-    /* rehash */
-    for (i = 0; i < tb->size; i++) {
-        GCObject *p = tb->hash[i];
-        while (p) {                       /* for each node in the list */
-            GCObject *next = p->gch.next; /* save next */
-            unsigned int h = gco2ts(p)->hash;
-            int h1 = lmod(h, newsize); /* new position */
-            lua_assert(cast_int(h % newsize) == lmod(h, newsize));
-            p->gch.next = newhash[h1]; /* chain it */
-            newhash[h1] = p;
-            p = next;
-        }
-    }
-    luaM_freearray(L, tb->hash, tb->size, TString *);
+    tb->oldhash = tb->hash;
+    tb->oldsize = tb->size;
+    tb->moved = 0;
     tb->size = newsize;
     tb->hash = newhash;
+    if (tb->oldsize == 0 || newsize < tb->oldsize) /* nothing to move, or shrinking? */
+        luaS_movebuckets(L, tb->oldsize);
+}
+
+#define rotl(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+** MurmurHash3 (x86, 32 bits) of the whole string
+*/
+unsigned int luaS_hash(const char *str, size_t l, unsigned int seed)
+{
+    const unsigned char *p = cast(const unsigned char *, str);
+    lu_int32 h = seed;
+    lu_int32 k;
+    size_t i;
+    for (i = 0; i + 4 <= l; i += 4) {
+        memcpy(&k, p + i, sizeof(k));
+        k *= 0xcc9e2d51;
+        k = rotl(k, 15);
+        k *= 0x1b873593;
+        h ^= k;
+        h = rotl(h, 13);
+        h = h * 5 + 0xe6546b64;
+    }
+    k = 0;
+    switch (l & 3) { /* remaining bytes */
+        case 3:
+            k ^= cast(lu_int32, p[i + 2]) << 16;
+            /* FALLTHROUGH */
+        case 2:
+            k ^= cast(lu_int32, p[i + 1]) << 8;
+            /* FALLTHROUGH */
+        case 1:
+            k ^= p[i];
+            k *= 0xcc9e2d51;
+            k = rotl(k, 15);
+            k *= 0x1b873593;
+            h ^= k;
+    }
+    h ^= cast(lu_int32, l);
+    h ^= h >> 16; /* final mix */
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
 }
 
 static TString *newlstr(lua_State *L, const char *str, size_t l, unsigned int h)
@@ -64,20 +138,17 @@ static TString *newlstr(lua_State *L, const char *str, size_t l, unsigned int h)
     ts->tsv.next = tb->hash[h]; /* chain new entry */
     tb->hash[h] = obj2gco(ts);
     tb->nuse++;
-    if (tb->nuse > cast(lu_int32, tb->size) && tb->size <= MAX_INT / 2)
+    if (tb->oldhash != NULL) { /* resizing? */
+        if (G(L)->gcstate != GCSsweepstring) /* buckets can not move while they are swept */
+            luaS_movebuckets(L, MOVESTEP);
+    } else if (tb->nuse > cast(lu_int32, tb->size) && tb->size <= MAX_INT / 2)
         luaS_resize(L, tb->size * 2); /* too crowded */
     return ts;
 }
 
-TString *luaS_newlstr(lua_State *L, const char *str, size_t l)
+static TString *findlstr(lua_State *L, GCObject *o, const char *str, size_t l)
 {
-    GCObject *o;
-    unsigned int h = cast(unsigned int, l); /* seed */
-    size_t step = (l >> 5) + 1;             /* if string is too long, don't hash all its chars */
-    size_t l1;
-    for (l1 = l; l1 >= step; l1 -= step) /* compute hash */
-        h = h ^ ((h << 5) + (h >> 2) + cast(unsigned char, str[l1 - 1]));
-    for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)]; o != NULL; o = o->gch.next) {
+    for (; o != NULL; o = o->gch.next) {
         TString *ts = rawgco2ts(o);
         if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
             /* string may be dead */
@@ -86,6 +157,18 @@ TString *luaS_newlstr(lua_State *L, const char *str, size_t l)
             return ts;
         }
     }
+    return NULL;
+}
+
+TString *luaS_newlstr(lua_State *L, const char *str, size_t l)
+{
+    stringtable *tb = &G(L)->strt;
+    unsigned int h = luaS_hash(str, l, G(L)->seed);
+    TString *ts = findlstr(L, tb->hash[lmod(h, tb->size)], str, l);
+    if (ts == NULL && tb->oldhash != NULL) /* maybe not moved yet */
+        ts = findlstr(L, tb->oldhash[lmod(h, tb->oldsize)], str, l);
+    if (ts != NULL)
+        return ts;
     return newlstr(L, str, l, h); /* not found */
 }
 
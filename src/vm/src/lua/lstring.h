@@ -20,7 +20,14 @@
 
 #define luaS_fix(s) l_setbit((s)->tsv.marked, FIXEDBIT)
 
+/* buckets of the string table, the old ones come first while it is resized */
+#define luaS_nbuckets(tb) ((tb)->oldsize + (tb)->size)
+#define luaS_bucket(tb, i)                                                                         \
+    ((i) < (tb)->oldsize ? &(tb)->oldhash[i] : &(tb)->hash[(i) - (tb)->oldsize])
+
 LUAI_FUNC void luaS_resize(lua_State *L, int newsize);
+LUAI_FUNC void luaS_movebuckets(lua_State *L, int n);
+LUAI_FUNC unsigned int luaS_hash(const char *str, size_t l, unsigned int seed);
 LUAI_FUNC Udata *luaS_newudata(lua_State *L, size_t s, Table *e);
 LUAI_FUNC TString *luaS_newlstr(lua_State *L, const char *str, size_t l);
 
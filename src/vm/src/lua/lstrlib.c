@@ -5,6 +5,7 @@
 */
 
 #include <ctype.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,7 +25,7 @@
 static int str_len(lua_State *L)
 {
     size_t l;
-    luaL_checklstring(L, 1, &l);
+    luaL_checklview(L, 1, &l);
     lua_pushinteger(L, l);
     return 1;
 }
@@ -40,7 +41,7 @@ static ptrdiff_t posrelat(ptrdiff_t pos, size_t len)
 static int str_sub(lua_State *L)
 {
     size_t l;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     ptrdiff_t start = posrelat(luaL_checkinteger(L, 2), l);
     ptrdiff_t end = posrelat(luaL_optinteger(L, 3, -1), l);
     if (start < 1)
@@ -58,7 +59,7 @@ static int str_reverse(lua_State *L)
 {
     size_t l;
     luaL_Buffer b;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     luaL_buffinit(L, &b);
     while (l--)
         luaL_addchar(&b, s[l]);
@@ -71,7 +72,7 @@ static int str_lower(lua_State *L)
     size_t l;
     size_t i;
     luaL_Buffer b;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     luaL_buffinit(L, &b);
     for (i = 0; i < l; i++)
         luaL_addchar(&b, tolower(uchar(s[i])));
@@ -84,7 +85,7 @@ static int str_upper(lua_State *L)
     size_t l;
     size_t i;
     luaL_Buffer b;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     luaL_buffinit(L, &b);
     for (i = 0; i < l; i++)
         luaL_addchar(&b, toupper(uchar(s[i])));
@@ -96,7 +97,7 @@ static int str_rep(lua_State *L)
 {
     size_t l;
     luaL_Buffer b;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     int n = luaL_checkint(L, 2);
     luaL_buffinit(L, &b);
     while (n-- > 0)
@@ -108,7 +109,7 @@ static int str_rep(lua_State *L)
 static int str_byte(lua_State *L)
 {
     size_t l;
-    const char *s = luaL_checklstring(L, 1, &l);
+    const char *s = luaL_checklview(L, 1, &l);
     ptrdiff_t posi = posrelat(luaL_optinteger(L, 2, 1), l);
     ptrdiff_t pose = posrelat(luaL_optinteger(L, 3, posi), l);
     int n, i;
@@ -479,12 +480,39 @@ init: /* using goto's to optimize tail recursion */
     }
 }
 
+/*
+** Horspool search, used for needles of at least MINSKIPLEN characters in
+** subjects of at least MINSKIPSUBJECT characters (it has to fill its table)
+*/
+#define MINSKIPLEN 4
+#define MINSKIPSUBJECT 256
+
+static const char *skipfind(const char *s1, size_t l1, const char *s2, size_t l2)
+{
+    size_t skip[UCHAR_MAX + 1];
+    size_t i;
+    const char *last = s1 + l1 - l2; /* last position where `s2' fits */
+    for (i = 0; i <= UCHAR_MAX; i++)
+        skip[i] = l2;
+    for (i = 0; i < l2 - 1; i++)
+        skip[uchar(s2[i])] = l2 - 1 - i;
+    while (s1 <= last) {
+        unsigned char c = uchar(s1[l2 - 1]);
+        if (c == uchar(s2[l2 - 1]) && memcmp(s1, s2, l2 - 1) == 0)
+            return s1;
+        s1 += skip[c];
+    }
+    return NULL; /* not found */
+}
+
 static const char *lmemfind(const char *s1, size_t l1, const char *s2, size_t l2)
 {
     if (l2 == 0)
         return s1; /* empty strings are everywhere */
     else if (l2 > l1)
         return NULL; /* avoids a negative `l1' */
+    else if (l2 >= MINSKIPLEN && l1 >= MINSKIPSUBJECT)
+        return skipfind(s1, l1, s2, l2);
     else {
         const char *init; /* to search for a `*s2' inside `s1' */
         l2--;             /* 1st char will be checked by `memchr' */
@@ -502,6 +530,360 @@ static const char *lmemfind(const char *s1, size_t l1, const char *s2, size_t l2
     }
 }
 
+/*
+** {======================================================
+** COMPILED PATTERNS
+** Every item of a pattern is decoded once. A single character class
+** (`x', `.', `%a', `[a-z]'...) becomes a bitmap of the characters it
+** matches, computed with singlematch so it agrees with match(). The
+** compiled patterns of a state are cached by pattern string in the
+** environment of the library; a malformed pattern is left to match(),
+** which reports the error where it finds it.
+** =======================================================
+*/
+
+/* kinds of items */
+enum { PI_CHAR, PI_SET, PI_OPEN, PI_POSITION, PI_CLOSE, PI_BALANCE, PI_FRONTIER, PI_BACKREF,
+       PI_EOS, PI_END };
+
+/* repetitions of PI_CHAR and PI_SET items */
+enum { PR_ONE, PR_OPT, PR_STAR, PR_PLUS, PR_MIN };
+
+typedef struct PatternItem {
+    unsigned char kind;
+    unsigned char rep;
+    unsigned char c;  /* character (PI_CHAR), opening one (PI_BALANCE), capture (PI_BACKREF) */
+    unsigned char c2; /* closing character (PI_BALANCE) */
+    unsigned char set[(UCHAR_MAX + 1) / CHAR_BIT]; /* PI_SET and PI_FRONTIER */
+} PatternItem;
+
+#define PATT_MAXPREFIX 32
+
+typedef struct Pattern {
+    int anchor;     /* pattern starts with `^' */
+    size_t nprefix; /* characters every match starts with */
+    char prefix[PATT_MAXPREFIX];
+    PatternItem item[1]; /* ends with a PI_END item */
+} Pattern;
+
+/* slots of the environment of the library */
+#define PATT_CACHE 1 /* table of the compiled patterns (false if malformed) */
+#define PATT_COUNT 2 /* number of entries of that table */
+
+/* entries of the cache, it is started over when full */
+#define PATT_CACHESIZE 64
+
+#define inset(pi, c) ((pi)->set[(c) / CHAR_BIT] & (1 << ((c) % CHAR_BIT)))
+
+/* classend without errors, NULL if the class is malformed */
+static const char *pclassend(const char *p)
+{
+    switch (*p++) {
+        case L_ESC:
+            return (*p == '\0') ? NULL : p + 1;
+        case '[':
+            if (*p == '^')
+                p++;
+            do { /* look for a `]' */
+                if (*p == '\0')
+                    return NULL;
+                if (*(p++) == L_ESC && *p != '\0')
+                    p++; /* skip escapes (e.g. `%]') */
+            } while (*p != ']');
+            return p + 1;
+        default:
+            return p;
+    }
+}
+
+/* fill the set of `pi' with the class at `p' (frontier: the bracket class) */
+static void fillset(PatternItem *pi, const char *p, const char *ep, int frontier)
+{
+    int c, n = 0;
+    for (c = 0; c <= UCHAR_MAX; c++) {
+        if (frontier ? matchbracketclass(c, p, ep - 1) : singlematch(c, p, ep)) {
+            pi->set[c / CHAR_BIT] |= 1 << (c % CHAR_BIT);
+            pi->c = (unsigned char)c;
+            n++;
+        }
+    }
+    if (!frontier && n == 1) /* a single character? */
+        pi->kind = PI_CHAR;
+}
+
+/* compile `p' into `pt', which has room for strlen(p) + 1 items; 0 if malformed */
+static int compile(const char *p, Pattern *pt)
+{
+    PatternItem *pi = pt->item;
+    size_t i;
+    pt->anchor = (*p == '^') ? (p++, 1) : 0;
+    for (;; pi++) {
+        const char *ep;
+        memset(pi, 0, sizeof(*pi));
+        switch (*p) {
+            case '\0':
+                pi->kind = PI_END;
+                goto prefix;
+            case '(':
+                pi->kind = (*(p + 1) == ')') ? PI_POSITION : PI_OPEN;
+                p += (pi->kind == PI_POSITION) ? 2 : 1;
+                continue;
+            case ')':
+                pi->kind = PI_CLOSE;
+                p++;
+                continue;
+            case '$':
+                if (*(p + 1) != '\0')
+                    break;
+                pi->kind = PI_EOS;
+                p++;
+                continue;
+            case L_ESC:
+                if (*(p + 1) == 'b') {
+                    if (*(p + 2) == '\0' || *(p + 3) == '\0')
+                        return 0;
+                    pi->kind = PI_BALANCE;
+                    pi->c = uchar(*(p + 2));
+                    pi->c2 = uchar(*(p + 3));
+                    p += 4;
+                    continue;
+                } else if (*(p + 1) == 'f') {
+                    p += 2;
+                    if (*p != '[' || (ep = pclassend(p)) == NULL)
+                        return 0;
+                    pi->kind = PI_FRONTIER;
+                    fillset(pi, p, ep, 1);
+                    p = ep;
+                    continue;
+                } else if (isdigit(uchar(*(p + 1)))) {
+                    pi->kind = PI_BACKREF;
+                    pi->c = uchar(*(p + 1));
+                    p += 2;
+                    continue;
+                }
+                break;
+        }
+        if ((ep = pclassend(p)) == NULL)
+            return 0;
+        pi->kind = PI_SET;
+        fillset(pi, p, ep, 0);
+        switch (*ep) {
+            case '?':
+                pi->rep = PR_OPT;
+                break;
+            case '*':
+                pi->rep = PR_STAR;
+                break;
+            case '+':
+                pi->rep = PR_PLUS;
+                break;
+            case '-':
+                pi->rep = PR_MIN;
+                break;
+            default:
+                pi->rep = PR_ONE;
+                ep--;
+                break;
+        }
+        p = ep + 1;
+    }
+prefix: /* the single characters every match starts with (after its captures) */
+    pt->nprefix = 0;
+    for (pi = pt->item; pi->kind == PI_OPEN || pi->kind == PI_POSITION; pi++)
+        ;
+    for (i = 0; i < PATT_MAXPREFIX && pi[i].kind == PI_CHAR && pi[i].rep == PR_ONE; i++)
+        pt->prefix[i] = (char)pi[i].c;
+    pt->nprefix = i;
+    return 1;
+}
+
+/*
+** push the compiled pattern of the string at `idx' (it has to stay on the
+** stack while it is used); returns NULL if the pattern is malformed
+*/
+static const Pattern *getpattern(lua_State *L, int idx)
+{
+    lua_rawgeti(L, LUA_ENVIRONINDEX, PATT_CACHE);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) { /* not compiled yet? */
+        size_t l;
+        const char *p = lua_tolstring(L, idx, &l);
+        int n;
+        lua_pop(L, 1);
+        if (!compile(p, (Pattern *)lua_newuserdata(L, sizeof(Pattern) + l * sizeof(PatternItem)))) {
+            lua_pop(L, 1);
+            lua_pushboolean(L, 0);
+        }
+        lua_rawgeti(L, LUA_ENVIRONINDEX, PATT_COUNT);
+        n = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (n >= PATT_CACHESIZE) { /* start over */
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, LUA_ENVIRONINDEX, PATT_CACHE);
+            lua_replace(L, -3);
+            n = 0;
+        }
+        lua_pushvalue(L, idx);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        lua_pushinteger(L, n + 1);
+        lua_rawseti(L, LUA_ENVIRONINDEX, PATT_COUNT);
+    }
+    lua_remove(L, -2); /* cache */
+    return (const Pattern *)lua_touserdata(L, -1);
+}
+
+/* first position from `s' on where a match may start, NULL if there is none */
+static const char *nextstart(const Pattern *pt, const char *s, const char *e)
+{
+    if (pt == NULL || pt->nprefix == 0)
+        return s;
+    return lmemfind(s, e - s, pt->prefix, pt->nprefix);
+}
+
+static const char *pmatch(MatchState *ms, const char *s, const PatternItem *pi);
+
+static int psinglematch(int c, const PatternItem *pi)
+{
+    return (pi->kind == PI_CHAR) ? (c == pi->c) : inset(pi, c);
+}
+
+static const char *pmax_expand(MatchState *ms, const char *s, const PatternItem *pi)
+{
+    ptrdiff_t i = 0; /* counts maximum expand for item */
+    while ((s + i) < ms->src_end && psinglematch(uchar(*(s + i)), pi))
+        i++;
+    /* keeps trying to match with the maximum repetitions */
+    while (i >= 0) {
+        const char *res = pmatch(ms, (s + i), pi + 1);
+        if (res)
+            return res;
+        i--; /* else didn't match; reduce 1 repetition to try again */
+    }
+    return NULL;
+}
+
+static const char *pmin_expand(MatchState *ms, const char *s, const PatternItem *pi)
+{
+    for (;;) {
+        const char *res = pmatch(ms, s, pi + 1);
+        if (res != NULL)
+            return res;
+        else if (s < ms->src_end && psinglematch(uchar(*s), pi))
+            s++; /* try with one more repetition */
+        else
+            return NULL;
+    }
+}
+
+static const char *pstart_capture(MatchState *ms, const char *s, const PatternItem *pi, int what)
+{
+    const char *res;
+    int level = ms->level;
+    if (level >= LUA_MAXCAPTURES)
+        luaL_error(ms->L, "too many captures");
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    if ((res = pmatch(ms, s, pi)) == NULL) /* match failed? */
+        ms->level--;                       /* undo capture */
+    return res;
+}
+
+static const char *pend_capture(MatchState *ms, const char *s, const PatternItem *pi)
+{
+    int l = capture_to_close(ms);
+    const char *res;
+    ms->capture[l].len = s - ms->capture[l].init; /* close capture */
+    if ((res = pmatch(ms, s, pi)) == NULL)        /* match failed? */
+        ms->capture[l].len = CAP_UNFINISHED;      /* undo capture */
+    return res;
+}
+
+static const char *pmatchbalance(MatchState *ms, const char *s, const PatternItem *pi)
+{
+    int cont = 1;
+    if (s >= ms->src_end || uchar(*s) != pi->c)
+        return NULL;
+    while (++s < ms->src_end) {
+        if (uchar(*s) == pi->c2) {
+            if (--cont == 0)
+                return s + 1;
+        } else if (uchar(*s) == pi->c)
+            cont++;
+    }
+    return NULL; /* string ends out of balance */
+}
+
+/* match() on a compiled pattern */
+static const char *pmatch(MatchState *ms, const char *s, const PatternItem *pi)
+{
+init: /* using goto's to optimize tail recursion */
+    switch (pi->kind) {
+        case PI_OPEN:
+            return pstart_capture(ms, s, pi + 1, CAP_UNFINISHED);
+        case PI_POSITION:
+            return pstart_capture(ms, s, pi + 1, CAP_POSITION);
+        case PI_CLOSE:
+            return pend_capture(ms, s, pi + 1);
+        case PI_BALANCE:
+            if ((s = pmatchbalance(ms, s, pi)) == NULL)
+                return NULL;
+            pi++;
+            goto init;
+        case PI_FRONTIER: {
+            int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+            if (inset(pi, previous) || !inset(pi, uchar(*s)))
+                return NULL;
+            pi++;
+            goto init;
+        }
+        case PI_BACKREF:
+            if ((s = match_capture(ms, s, pi->c)) == NULL)
+                return NULL;
+            pi++;
+            goto init;
+        case PI_EOS:
+            return (s == ms->src_end) ? s : NULL;
+        case PI_END:
+            return s; /* match succeeded */
+        default: {    /* PI_CHAR or PI_SET */
+            int m = s < ms->src_end && psinglematch(uchar(*s), pi);
+            switch (pi->rep) {
+                case PR_OPT: {
+                    const char *res;
+                    if (m && ((res = pmatch(ms, s + 1, pi + 1)) != NULL))
+                        return res;
+                    pi++;
+                    goto init;
+                }
+                case PR_STAR:
+                    return pmax_expand(ms, s, pi);
+                case PR_PLUS:
+                    return (m ? pmax_expand(ms, s + 1, pi) : NULL);
+                case PR_MIN:
+                    return pmin_expand(ms, s, pi);
+                default:
+                    if (!m)
+                        return NULL;
+                    s++;
+                    pi++;
+                    goto init;
+            }
+        }
+    }
+}
+
+/* match with the compiled pattern if there is one */
+static const char *domatch(MatchState *ms, const char *s, const char *p, const Pattern *pt)
+{
+    return (pt != NULL) ? pmatch(ms, s, pt->item) : match(ms, s, p);
+}
+
+/* }====================================================== */
+
 static void push_onecapture(MatchState *ms, int i, const char *s, const char *e)
 {
     if (i >= ms->level) {
@@ -533,7 +915,7 @@ static int push_captures(MatchState *ms, const char *s, const char *e)
 static int str_find_aux(lua_State *L, int find)
 {
     size_t l1, l2;
-    const char *s = luaL_checklstring(L, 1, &l1);
+    const char *s = luaL_checklview(L, 1, &l1);
     const char *p = luaL_checklstring(L, 2, &l2);
     ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
     if (init < 0)
@@ -551,6 +933,7 @@ static int str_find_aux(lua_State *L, int find)
         }
     } else {
         MatchState ms;
+        const Pattern *pt = getpattern(L, 2);
         int anchor = (*p == '^') ? (p++, 1) : 0;
         const char *s1 = s + init;
         ms.L = L;
@@ -558,8 +941,10 @@ static int str_find_aux(lua_State *L, int find)
         ms.src_end = s + l1;
         do {
             const char *res;
+            if (!anchor && (s1 = nextstart(pt, s1, ms.src_end)) == NULL)
+                break; /* the literal prefix is nowhere */
             ms.level = 0;
-            if ((res = match(&ms, s1, p)) != NULL) {
+            if ((res = domatch(&ms, s1, p, pt)) != NULL) {
                 if (find) {
                     lua_pushinteger(L, s1 - s + 1); /* start */
                     lua_pushinteger(L, res - s);    /* end */
@@ -581,16 +966,21 @@ static int gmatch_aux(lua_State *L)
 {
     MatchState ms;
     size_t ls;
-    const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+    const char *s = luaL_checklview(L, lua_upvalueindex(1), &ls);
     const char *p = lua_tostring(L, lua_upvalueindex(2));
+    const Pattern *pt = (const Pattern *)lua_touserdata(L, lua_upvalueindex(4));
     const char *src;
+    if (pt != NULL && pt->anchor) /* `^' is not an anchor in gmatch */
+        pt = NULL;
     ms.L = L;
     ms.src_init = s;
     ms.src_end = s + ls;
     for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3)); src <= ms.src_end; src++) {
         const char *e;
+        if ((src = nextstart(pt, src, ms.src_end)) == NULL)
+            break; /* the literal prefix is nowhere */
         ms.level = 0;
-        if ((e = match(&ms, src, p)) != NULL) {
+        if ((e = domatch(&ms, src, p, pt)) != NULL) {
             lua_Integer newstart = e - s;
             if (e == src)
                 newstart++; /* empty match? go at least one position */
@@ -604,11 +994,12 @@ static int gmatch_aux(lua_State *L)
 
 static int gmatch(lua_State *L)
 {
-    luaL_checkstring(L, 1);
+    luaL_checklview(L, 1, NULL);
     luaL_checkstring(L, 2);
     lua_settop(L, 2);
     lua_pushinteger(L, 0);
-    lua_pushcclosure(L, gmatch_aux, 3);
+    getpattern(L, 2); /* compiled once for all the iterations */
+    lua_pushcclosure(L, gmatch_aux, 4);
     return 1;
 }
 
@@ -671,10 +1062,11 @@ static void add_value(MatchState *ms, luaL_Buffer *b, const char *s, const char
 static int str_gsub(lua_State *L)
 {
     size_t srcl;
-    const char *src = luaL_checklstring(L, 1, &srcl);
+    const char *src = luaL_checklview(L, 1, &srcl);
     const char *p = luaL_checkstring(L, 2);
     int tr = lua_type(L, 3);
     int max_s = luaL_optint(L, 4, srcl + 1);
+    const Pattern *pt = getpattern(L, 2); /* stays below the buffer */
     int anchor = (*p == '^') ? (p++, 1) : 0;
     int n = 0;
     MatchState ms;
@@ -682,14 +1074,26 @@ static int str_gsub(lua_State *L)
     luaL_argcheck(L,
                   tr == LUA_TNUMBER || tr == LUA_TSTRING || tr == LUA_TFUNCTION || tr == LUA_TTABLE,
                   3, "string/function/table expected");
+    if (lua_type(L, 1) == LUA_TUSERDATA && (tr == LUA_TFUNCTION || tr == LUA_TTABLE)) {
+        lua_pushlstring(L, src, srcl); /* the replacements may move on to the next line */
+        lua_replace(L, 1);
+        src = lua_tolstring(L, 1, &srcl);
+    }
     luaL_buffinit(L, &b);
     ms.L = L;
     ms.src_init = src;
     ms.src_end = src + srcl;
     while (n < max_s) {
         const char *e;
+        if (!anchor) { /* copy what comes before the literal prefix */
+            const char *next = nextstart(pt, src, ms.src_end);
+            if (next == NULL)
+                break;
+            luaL_addlstring(&b, src, next - src);
+            src = next;
+        }
         ms.level = 0;
-        e = match(&ms, src, p);
+        e = domatch(&ms, src, p, pt);
         if (e) {
             n++;
             add_value(&ms, &b, src, e);
@@ -884,16 +1288,43 @@ static void createmetatable(lua_State *L)
     lua_pop(L, 1);                  /* pop metatable */
 }
 
+static int view_tostring(lua_State *L)
+{
+    size_t l;
+    const char *s = luaL_checklview(L, 1, &l);
+    lua_pushlstring(L, s, l);
+    return 1;
+}
+
+static void createviewmeta(lua_State *L)
+{
+    luaL_newmetatable(L, LUA_VIEWHANDLE); /* views (liolib.c sets __gc) */
+    lua_pushvalue(L, -2);                 /* string library... */
+    lua_setfield(L, -2, "__index");       /* ...gives their methods */
+    lua_pushcfunction(L, view_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, str_len);
+    lua_setfield(L, -2, "__len");
+    lua_pop(L, 1);
+}
+
 /*
 ** Open string library
 */
 LUALIB_API int luaopen_string(lua_State *L)
 {
+    lua_createtable(L, 2, 0); /* environment: the pattern cache */
+    lua_newtable(L);
+    lua_rawseti(L, -2, PATT_CACHE);
+    lua_pushinteger(L, 0);
+    lua_rawseti(L, -2, PATT_COUNT);
+    lua_replace(L, LUA_ENVIRONINDEX);
     luaL_register(L, LUA_STRLIBNAME, strlib);
 #if defined(LUA_COMPAT_GFIND)
     lua_getfield(L, -1, "gmatch");
     lua_setfield(L, -2, "gfind");
 #endif
     createmetatable(L);
+    createviewmeta(L);
     return 1;
 }
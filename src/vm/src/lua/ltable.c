@@ -15,6 +15,10 @@
 ** in its main position (i.e. the `original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** Tables created by luaH_newrecord start with a shape instead of a hash
+** part: string keys go to a flat array of fields laid out by the shape,
+** and the first key of another kind (or too many keys) turns the table
+** into a regular hash table for good.
 */
 
 #include <math.h>
@@ -31,7 +35,9 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
+#include "lstring.h"
 #include "ltable.h"
+#include "lvm.h"
 
 /*
 ** max size of array part is 2^MAXBITS
@@ -65,8 +71,8 @@
 #define dummynode (&dummynode_)
 
 static const Node dummynode_ = {
-    {{NULL}, LUA_TNIL},        /* value */
-    {{{NULL}, LUA_TNIL, NULL}} /* key */
+    {NILCONSTANT},        /* value */
+    {{NILCONSTANT, NULL}} /* key */
 };
 
 /*
@@ -104,6 +110,130 @@ static Node *mainposition(const Table *t, const TValue *key)
     }
 }
 
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+#define sizeshape(n) (sizeof(Shape) + sizeof(TString *) * ((n)-1))
+
+static void setnodevector(lua_State *L, Table *t, int size);
+
+/*
+** returns the field of `key' in tables of shape `s', -1 if it has none
+*/
+static int shapeindex(const Shape *s, const TString *key)
+{
+    int i;
+    for (i = 0; i < s->nkeys; i++) {
+        if (s->keys[i] == key)
+            return i;
+    }
+    return -1;
+}
+
+/*
+** returns the shape adding `key' to `s', creating it if needed; NULL when
+** `s' is full or the state has too many shapes
+*/
+static Shape *addshape(lua_State *L, Shape *s, TString *key)
+{
+    global_State *g = G(L);
+    Shape *c;
+    for (c = s->child; c != NULL; c = c->sibling) {
+        if (c->keys[s->nkeys] == key)
+            return c;
+    }
+    if (s->nkeys >= LUAI_MAXSHAPEKEYS || g->nshapes >= LUAI_MAXSHAPES)
+        return NULL;
+    c = cast(Shape *, luaM_malloc(L, sizeshape(s->nkeys + 1)));
+    memcpy(c->keys, s->keys, s->nkeys * sizeof(TString *));
+    c->keys[s->nkeys] = key;
+    c->nkeys = s->nkeys + 1;
+    c->id = ++g->shapeid;
+    c->parent = s;
+    c->child = NULL;
+    c->sibling = s->child;
+    s->child = c;
+    g->nshapes++;
+    luaS_fix(key); /* shapes outlive the tables using them */
+    return c;
+}
+
+static void setfieldvector(lua_State *L, Table *t, int size)
+{
+    int i;
+    luaM_reallocvector(L, t->fields, t->sizefields, size, TValue);
+    for (i = t->sizefields; i < size; i++)
+        setnilvalue(&t->fields[i]);
+    t->sizefields = size;
+    t->stamp = ++G(L)->tablestamp; /* invalidate cached slots */
+}
+
+/*
+** adds the field of a new string key to a shaped table, NULL if the table
+** can not keep it
+*/
+static TValue *newfield(lua_State *L, Table *t, TString *key)
+{
+    Shape *s = addshape(L, t->shape, key);
+    if (s == NULL)
+        return NULL;
+    if (s->nkeys > t->sizefields) { /* grow fields */
+        int size = t->sizefields < 2 ? 4 : 2 * t->sizefields;
+        setfieldvector(L, t, size > LUAI_MAXSHAPEKEYS ? LUAI_MAXSHAPEKEYS : size);
+    }
+    t->shape = s;
+    return &t->fields[s->nkeys - 1];
+}
+
+/*
+** turns a shaped table into a hash table, keeps room for one more key
+*/
+static void unshape(lua_State *L, Table *t)
+{
+    Shape *s = t->shape;
+    TValue *fields = t->fields;
+    int size = t->sizefields;
+    int i, n = 1;
+    for (i = 0; i < s->nkeys; i++) {
+        if (!ttisnil(&fields[i]))
+            n++;
+    }
+    setnodevector(L, t, n);
+    t->shape = NULL;
+    t->fields = NULL;
+    t->sizefields = 0;
+    for (i = 0; i < s->nkeys; i++) {
+        if (!ttisnil(&fields[i]))
+            setobjt2t(L, luaH_setstr(L, t, s->keys[i]), &fields[i]);
+    }
+    luaM_freearray(L, fields, size, TValue);
+}
+
+static void freeshapes(lua_State *L, Shape *s)
+{
+    while (s != NULL) {
+        Shape *next = s->sibling;
+        freeshapes(L, s->child); /* depth is at most LUAI_MAXSHAPEKEYS */
+        luaM_freemem(L, s, sizeshape(s->nkeys));
+        s = next;
+    }
+}
+
+void luaH_freeshapes(lua_State *L)
+{
+    global_State *g = G(L);
+    freeshapes(L, g->rootshape.child);
+    g->rootshape.child = NULL;
+    g->nshapes = 0;
+}
+
+/*
+** }=============================================================
+*/
+
 /*
 ** returns the index for `key' if `key' is an appropriate key to live in
 ** the array part of the table, -1 otherwise.
@@ -133,7 +263,12 @@ static int findindex(lua_State *L, Table *t, StkId key)
     i = arrayindex(key);
     if (0 < i && i <= t->sizearray) /* is `key' inside array part? */
         return i - 1;               /* yes; that's the index (corrected to C) */
-    else {
+    else if (t->shape != NULL) {    /* fields are numbered after array elements */
+        if (ttisstring(key) && (i = shapeindex(t->shape, rawtsvalue(key))) >= 0)
+            return i + t->sizearray;
+        luaG_runerror(L, "invalid key to " LUA_QL("next"));
+        return 0;
+    } else {
         Node *n = mainposition(t, key);
         do { /* check whether `key' is somewhere in the chain */
             /* key may be dead already, but it is ok to use it in `next' */
@@ -161,6 +296,16 @@ int luaH_next(lua_State *L, Table *t, StkId key)
             return 1;
         }
     }
+    if (t->shape != NULL) { /* then fields */
+        for (i -= t->sizearray; i < t->shape->nkeys; i++) {
+            if (!ttisnil(&t->fields[i])) {
+                setsvalue2s(L, key, t->shape->keys[i]);
+                setobj2s(L, key + 1, &t->fields[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
     for (i -= t->sizearray; i < sizenode(t); i++) { /* then hash part */
         if (!ttisnil(gval(gnode(t, i)))) {          /* a non-nil value? */
             setobj2s(L, key, key2tval(gnode(t, i)));
@@ -282,6 +427,7 @@ static void setnodevector(lua_State *L, Table *t, int size)
     }
     t->lsizenode = cast_byte(lsize);
     t->lastfree = gnode(t, size); /* all positions are free */
+    t->stamp = ++G(L)->tablestamp; /* invalidate cached slots */
 }
 
 static void resize(lua_State *L, Table *t, int nasize, int nhsize)
@@ -349,22 +495,35 @@ Table *luaH_new(lua_State *L, int narray, int nhash)
     Table *t = luaM_new(L, Table);
     luaC_link(L, obj2gco(t), LUA_TTABLE);
     t->metatable = NULL;
-    t->flags = cast_byte(~0);
+    t->flags = ~cast(lu_int32, 0);
     /* temporary values (kept only if some malloc fails) */
     t->array = NULL;
     t->sizearray = 0;
     t->lsizenode = 0;
     t->node = cast(Node *, dummynode);
+    t->shape = NULL;
+    t->fields = NULL;
+    t->sizefields = 0;
     setarrayvector(L, t, narray);
     setnodevector(L, t, nhash);
     return t;
 }
 
+Table *luaH_newrecord(lua_State *L, int narray, int nfields)
+{
+    Table *t = luaH_new(L, narray, 0);
+    t->shape = &G(L)->rootshape;
+    if (nfields > 0)
+        setfieldvector(L, t, nfields > LUAI_MAXSHAPEKEYS ? LUAI_MAXSHAPEKEYS : nfields);
+    return t;
+}
+
 void luaH_free(lua_State *L, Table *t)
 {
     if (t->node != dummynode)
         luaM_freearray(L, t->node, sizenode(t), Node);
     luaM_freearray(L, t->array, t->sizearray, TValue);
+    luaM_freearray(L, t->fields, t->sizefields, TValue);
     luaM_free(L, t);
 }
 
@@ -386,7 +545,14 @@ static Node *getfreepos(Table *t)
 */
 static TValue *newkey(lua_State *L, Table *t, const TValue *key)
 {
-    Node *mp = mainposition(t, key);
+    Node *mp;
+    if (t->shape != NULL) { /* shaped table? */
+        TValue *f;
+        if (ttisstring(key) && (f = newfield(L, t, rawtsvalue(key))) != NULL)
+            return f;
+        unshape(L, t); /* any other key makes it a hash table */
+    }
+    mp = mainposition(t, key);
     if (!ttisnil(gval(mp)) || mp == dummynode) {
         Node *othern;
         Node *n = getfreepos(t);        /* get a free place */
@@ -411,8 +577,8 @@ static TValue *newkey(lua_State *L, Table *t, const TValue *key)
             mp = n;
         }
     }
-    gkey(mp)->value = key->value;
-    gkey(mp)->tt = key->tt;
+    setnodekey(gkey(mp), key);
+    t->stamp = ++G(L)->tablestamp; /* a colliding node may have moved */
     luaC_barriert(L, t, key);
     lua_assert(ttisnil(gval(mp)));
     return gval(mp);
@@ -444,7 +610,12 @@ const TValue *luaH_getnum(Table *t, int key)
 */
 const TValue *luaH_getstr(Table *t, TString *key)
 {
-    Node *n = hashstr(t, key);
+    Node *n;
+    if (t->shape != NULL) {
+        int i = shapeindex(t->shape, key);
+        return i >= 0 ? &t->fields[i] : luaO_nilobject;
+    }
+    n = hashstr(t, key);
     do { /* check whether `key' is somewhere in the chain */
         if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
             return gval(n); /* that's it */
@@ -577,10 +748,110 @@ int luaH_getn(Table *t)
         return unbound_search(t, j);
 }
 
-#if defined(LUA_DEBUG)
+/*
+** {======================================================
+** Sorting of the array part (table.sort)
+** =======================================================
+*/
 
-Node *luaH_mainposition(const Table *t, const TValue *key) { return mainposition(t, key); }
+#define SORTCUTOFF 16
+
+#define sortswap(t, i, j)                                                                          \
+    {                                                                                              \
+        TValue t_;                                                                                 \
+        setobj(L, &t_, &(t)->array[i]);                                                            \
+        setobj(L, &(t)->array[i], &(t)->array[j]);                                                 \
+        setobj(L, &(t)->array[j], &t_);                                                            \
+    }
+
+/* `a[i] < a[j]' with the order function `f' (or `<' if it is NULL), which may run Lua */
+static int sortless(lua_State *L, Table *t, int n, const TValue *f, int i, int j)
+{
+    int res;
+    if (f == NULL)
+        res = luaV_lessthan(L, &t->array[i], &t->array[j]);
+    else {
+        luaD_checkstack(L, 3);
+        setobj2s(L, L->top, f);
+        setobj2s(L, L->top + 1, &t->array[i]);
+        setobj2s(L, L->top + 2, &t->array[j]);
+        L->top += 3;
+        luaD_call(L, L->top - 3, 1);
+        res = !l_isfalse(L->top - 1);
+        L->top--;
+    }
+    if (t->sizearray < n)
+        luaG_runerror(L, "table modified during sorting");
+    return res;
+}
+
+#define KERNEL(name) name##_any
+#define SORTLESS(i, j) sortless(L, t, n, f, i, j)
+#include "lsortkern.h"
+#undef KERNEL
+#undef SORTLESS
+
+#define KERNEL(name) name##_number
+#define SORTLESS(i, j) (nvalue(&t->array[i]) < nvalue(&t->array[j]))
+#include "lsortkern.h"
+#undef KERNEL
+#undef SORTLESS
+
+/* strings cannot have __lt, luaV_lessthan compares them with strcoll */
+static int sortlessstring(lua_State *L, Table *t, int i, int j)
+{
+    return rawtsvalue(&t->array[i]) != rawtsvalue(&t->array[j]) &&
+           luaV_lessthan(L, &t->array[i], &t->array[j]);
+}
+
+#define KERNEL(name) name##_string
+#define SORTLESS(i, j) sortlessstring(L, t, i, j)
+#include "lsortkern.h"
+#undef KERNEL
+#undef SORTLESS
+
+/*
+** sort t[1..n] in place with the order function `f' (NULL for `<'); returns
+** 0 if some of them are not in the array part. Numbers and strings without
+** an order function are compared directly, NaNs are moved to the end.
+*/
+int luaH_sort(lua_State *L, Table *t, int n, const TValue *f)
+{
+    int i, m = 0, numbers = 1, strings = 1;
+    if (n > t->sizearray)
+        return 0;
+    for (i = 0; i < n && f == NULL && (numbers || strings); i++) {
+        numbers = numbers && ttisnumber(&t->array[i]);
+        strings = strings && ttisstring(&t->array[i]);
+    }
+    if (n < 2)
+        return 1;
+    if (f == NULL && numbers) {
+        for (i = 0; i < n; i++) { /* numbers first, NaNs last */
+            lua_Number x = nvalue(&t->array[i]);
+            if (luai_numeq(x, x)) {
+                sortswap(t, m, i);
+                m++;
+            }
+        }
+        sort_number(L, t, n, NULL, m - 1);
+    } else if (f == NULL && strings)
+        sort_string(L, t, n, NULL, n - 1);
+    else {
+        TValue comp; /* the function stays on the stack of the caller */
+        if (f != NULL)
+            setobj(L, &comp, f);
+        sort_any(L, t, n, f != NULL ? &comp : NULL, n - 1);
+    }
+    return 1;
+}
+
+/* }====================================================== */
 
 int luaH_isdummy(Node *n) { return n == dummynode; }
 
+#if defined(LUA_DEBUG)
+
+Node *luaH_mainposition(const Table *t, const TValue *key) { return mainposition(t, key); }
+
 #endif
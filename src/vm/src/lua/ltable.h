@@ -23,14 +23,17 @@ LUAI_FUNC TValue *luaH_setstr(lua_State *L, Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_get(Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set(lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC Table *luaH_new(lua_State *L, int narray, int lnhash);
+LUAI_FUNC Table *luaH_newrecord(lua_State *L, int narray, int nfields);
+LUAI_FUNC void luaH_freeshapes(lua_State *L);
 LUAI_FUNC void luaH_resizearray(lua_State *L, Table *t, int nasize);
 LUAI_FUNC void luaH_free(lua_State *L, Table *t);
 LUAI_FUNC int luaH_next(lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn(Table *t);
+LUAI_FUNC int luaH_sort(lua_State *L, Table *t, int n, const TValue *f);
+LUAI_FUNC int luaH_isdummy(Node *n);
 
 #if defined(LUA_DEBUG)
 LUAI_FUNC Node *luaH_mainposition(const Table *t, const TValue *key);
-LUAI_FUNC int luaH_isdummy(Node *n);
 #endif
 
 #endif
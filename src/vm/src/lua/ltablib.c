@@ -267,7 +267,8 @@ static int sort(lua_State *L)
     if (!lua_isnoneornil(L, 2)) /* is there a 2nd argument? */
         luaL_checktype(L, 2, LUA_TFUNCTION);
     lua_settop(L, 2); /* make sure there is two arguments */
-    auxsort(L, 1, n);
+    if (!lua_sort(L, 1, n, lua_isnil(L, 2) ? 0 : 2)) /* not all in the array part? */
+        auxsort(L, 1, n);
     return 0;
 }
 
@@ -19,7 +19,7 @@
 
 const char *const luaT_typenames[] = {"nil",    "boolean", "userdata", "number",
                                       "string", "table",   "function", "userdata",
-                                      "thread", "proto",   "upval"};
+                                      "thread", "array",   "proto",    "upval"};
 
 void luaT_init(lua_State *L)
 {
@@ -36,14 +36,14 @@ void luaT_init(lua_State *L)
 
 /*
 ** function to be used with macro "fasttm": optimized for absence of
-** tag methods
+** tag methods. The absence of every event is cached in `flags', any
+** write of a key into the table clears them (luaH_set)
 */
 const TValue *luaT_gettm(Table *events, TMS event, TString *ename)
 {
     const TValue *tm = luaH_getstr(events, ename);
-    lua_assert(event <= TM_EQ);
-    if (ttisnil(tm)) {                           /* no tag method? */
-        events->flags |= cast_byte(1u << event); /* cache this fact */
+    if (ttisnil(tm)) {                /* no tag method? */
+        events->flags |= 1u << event; /* cache this fact */
         return NULL;
     } else
         return tm;
@@ -52,6 +52,7 @@ const TValue *luaT_gettm(Table *events, TMS event, TString *ename)
 const TValue *luaT_gettmbyobj(lua_State *L, const TValue *o, TMS event)
 {
     Table *mt;
+    const TValue *tm;
     switch (ttype(o)) {
         case LUA_TTABLE:
             mt = hvalue(o)->metatable;
@@ -62,5 +63,6 @@ const TValue *luaT_gettmbyobj(lua_State *L, const TValue *o, TMS event)
         default:
             mt = G(L)->mt[ttype(o)];
     }
-    return (mt ? luaH_getstr(mt, G(L)->tmname[event]) : luaO_nilobject);
+    tm = fasttm(L, mt, event);
+    return (tm ? tm : luaO_nilobject);
 }
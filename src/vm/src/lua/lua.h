@@ -71,6 +71,11 @@ typedef void *(*lua_Alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
 #define LUA_TFUNCTION 6
 #define LUA_TUSERDATA 7
 #define LUA_TTHREAD 8
+#define LUA_TARRAY 9
+
+/* element kinds of typed arrays */
+#define LUA_ARRNUMBER 0
+#define LUA_ARRBOOLEAN 1
 
 /* minimum Lua stack available to a C function */
 #define LUA_MINSTACK 20
@@ -134,6 +139,7 @@ LUA_API lua_CFunction(lua_tocfunction)(lua_State *L, int idx);
 LUA_API void *(lua_touserdata)(lua_State *L, int idx);
 LUA_API lua_State *(lua_tothread)(lua_State *L, int idx);
 LUA_API const void *(lua_topointer)(lua_State *L, int idx);
+LUA_API void *(lua_toarray)(lua_State *L, int idx, int *kind, int *size);
 
 /*
 ** push functions (C -> stack)
@@ -159,6 +165,7 @@ LUA_API void(lua_rawget)(lua_State *L, int idx);
 LUA_API void(lua_rawgeti)(lua_State *L, int idx, int n);
 LUA_API void(lua_createtable)(lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata)(lua_State *L, size_t sz);
+LUA_API void *(lua_newarray)(lua_State *L, int kind, int size);
 LUA_API int(lua_getmetatable)(lua_State *L, int objindex);
 LUA_API void(lua_getfenv)(lua_State *L, int idx);
 
@@ -181,6 +188,20 @@ LUA_API int(lua_cpcall)(lua_State *L, lua_CFunction func, void *ud);
 
 /* load.c */
 LUA_API int(luapp_loadfile)(lua_State *L, const char *chunkname, FILE *input);
+LUA_API int(luapp_loadbuffer)(lua_State *L, const char *chunkname, const char *buffer, size_t size);
+LUA_API int(luapp_loadpath)(lua_State *L, const char *chunkname, const char *path);
+
+struct luapp_code;
+LUA_API int(luapp_code_init)(struct luapp_code *shared, const char *buffer, size_t size);
+LUA_API void(luapp_code_free)(struct luapp_code *shared);
+LUA_API int(luapp_loadshared)(lua_State *L, const char *chunkname, const char *buffer, size_t size,
+                              const struct luapp_code *shared);
+
+/* the program a Lua function of bytecode of version 7 or later comes from (valid as long as the
+   function is) and the index of its proto in it; lua_pushimage creates a closure of the same
+   proto in any state, with closed upvalues holding nil, and returns 1 if there is no such proto */
+LUA_API const void *(lua_toimage)(lua_State *L, int idx, int *index);
+LUA_API int(lua_pushimage)(lua_State *L, const void *image, int index, const char *chunkname);
 
 LUA_API int(lua_dump)(lua_State *L, lua_Writer writer, void *data);
 
@@ -190,6 +211,7 @@ LUA_API int(lua_dump)(lua_State *L, lua_Writer writer, void *data);
 LUA_API int(lua_yield)(lua_State *L, int nresults);
 LUA_API int(lua_resume)(lua_State *L, int narg);
 LUA_API int(lua_status)(lua_State *L);
+LUA_API int(lua_isyieldable)(lua_State *L);
 
 /*
 ** garbage-collection function and options
@@ -203,9 +225,70 @@ LUA_API int(lua_status)(lua_State *L);
 #define LUA_GCSTEP 5
 #define LUA_GCSETPAUSE 6
 #define LUA_GCSETSTEPMUL 7
+#define LUA_GCGEN 8
+#define LUA_GCINC 9
+#define LUA_GCSWEEPER 10 /* data 1 starts the sweeper thread, 0 stops it; the allocator of the */
+                         /* state is then called from that thread too, never at the same time */
+#define LUA_GCLIMIT 11     /* data is the limit of the heap in Kbytes (0 for none, < 0 */
+                           /* keeps it), allocations past it fail with LUA_ERRMEM */
+#define LUA_GCSOFTLIMIT 12 /* same for the heap size past which a full collection runs */
 
 LUA_API int(lua_gc)(lua_State *L, int what, int data);
 
+/*
+** garbage-collection statistics, times are in nanoseconds
+*/
+
+#define LUA_GCPHASES 5    /* pause, propagate, sweepstring, sweep, finalize */
+#define LUA_GCHISTSIZE 32 /* bucket i counts steps that took [2^i, 2^(i+1)) ns */
+
+typedef struct lua_GCStats {
+    size_t steps;    /* incremental steps (whole minor collections in generational mode) */
+    size_t cycles;   /* collections that were finished */
+    size_t fulls;    /* full collections (collectgarbage("collect"), major collections) */
+    size_t freed;    /* objects freed by the sweeps */
+    size_t swept;    /* bytes freed by the sweeps */
+    size_t deferred; /* objects of `freed' released by the sweeper thread */
+    size_t steptime; /* time spent in steps */
+    size_t stepmax;  /* longest step */
+    size_t atomics;  /* atomic phases, the only part of a cycle that is not incremental */
+    size_t atomictime;
+    size_t atomicmax;
+    size_t fulltime;
+    size_t fullmax;
+    size_t emergencies; /* full collections the soft limit of the heap ran (LUA_GCSOFTLIMIT) */
+    size_t phasesteps[LUA_GCPHASES]; /* steps by the phase they started in */
+    size_t phasetime[LUA_GCPHASES];
+    size_t histogram[LUA_GCHISTSIZE]; /* step durations */
+} lua_GCStats;
+
+LUA_API void(lua_gcstats)(lua_State *L, lua_GCStats *stats, int reset);
+
+/*
+** bytes of the heap held by each kind of object, counted by walking it
+*/
+typedef struct lua_GCUsage {
+    size_t strings;
+    size_t tables;   /* with their array, hash and field parts */
+    size_t closures; /* Lua and C functions */
+    size_t protos;   /* with their code, constants and debug information */
+    size_t upvalues;
+    size_t userdata;
+    size_t threads; /* with their stacks */
+    size_t arrays;  /* typed arrays with their elements */
+    size_t other;   /* the rest: string table, buffers, caches, shapes ... */
+} lua_GCUsage;
+
+LUA_API void(lua_gcusage)(lua_State *L, lua_GCUsage *usage);
+
+/*
+** pseudo-random numbers in [0, 1) of a state (xoshiro256**), shared by its
+** coroutines; a new state starts from the seed 0
+*/
+LUA_API void(lua_randomseed)(lua_State *L, lua_Number seed);
+LUA_API lua_Number(lua_random)(lua_State *L);
+LUA_API void(lua_randomfill)(lua_State *L, lua_Number *v, size_t n);
+
 /*
 ** miscellaneous functions
 */
@@ -213,12 +296,21 @@ LUA_API int(lua_gc)(lua_State *L, int what, int data);
 LUA_API int(lua_error)(lua_State *L);
 
 LUA_API int(lua_next)(lua_State *L, int idx);
+LUA_API int(lua_sort)(lua_State *L, int idx, int n, int comp);
 
 LUA_API void(lua_concat)(lua_State *L, int n);
 
 LUA_API lua_Alloc(lua_getallocf)(lua_State *L, void **ud);
 LUA_API void lua_setallocf(lua_State *L, lua_Alloc f, void *ud);
 
+/*
+** buffered standard output (print, io.write), written once LUAI_OUTPUTSIZE
+** bytes were gathered, after every line if stdout is a terminal, when a
+** resume of the main thread ends, and when the state is closed
+*/
+LUA_API void(lua_writeoutput)(lua_State *L, const char *s, size_t l);
+LUA_API int(lua_flushoutput)(lua_State *L, int force);
+
 /*
 ** ===============================================================
 ** some useful macros
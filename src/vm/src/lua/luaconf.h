@@ -35,11 +35,13 @@
 #define LUA_USE_POSIX
 #define LUA_USE_DLOPEN   /* needs an extra library: -ldl */
 #define LUA_USE_READLINE /* needs some extra libraries */
+#define LUA_USE_EPOLL
 #endif
 
 #if defined(LUA_USE_MACOSX)
 #define LUA_USE_POSIX
 #define LUA_DL_DYLD /* does not need extra library */
+#define LUA_USE_KQUEUE
 #endif
 
 /*
@@ -48,12 +50,18 @@
 ** CHANGE it (define it) if your system is XSI compatible.
 */
 #if defined(LUA_USE_POSIX)
+#define LUA_USE_GETLINE
 #define LUA_USE_MKSTEMP
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
 #endif
 
+/*
+@@ LUA_USE_EPOLL / LUA_USE_KQUEUE select how the sched library waits for
+@* descriptors (the platforms above pick one); it uses poll without them.
+*/
+
 /*
 @@ LUA_PATH and LUA_CPATH are the names of the environment variables that
 @* Lua check to set its paths.
@@ -294,6 +302,41 @@
 */
 #define LUAI_GCMUL 200 /* GC runs 'twice the speed' of memory allocation */
 
+/*
+@@ LUAI_GCGENMINOR defines how much memory may be allocated between two
+@* minor collections of the generational mode, as a percentage of the
+@* memory in use after the previous one.
+@@ LUAI_GCMAJORINC defines how much the memory in use may grow after a
+@* major collection of the generational mode before the next one, as a
+@* percentage.
+** CHANGE them if you want the young generation to be larger or the old
+** one to be collected more often. The first one can also be changed
+** dynamically.
+*/
+#define LUAI_GCGENMINOR 50  /* minor collection after 50% more memory */
+#define LUAI_GCMAJORINC 100 /* major collection once the heap doubled */
+
+/*
+@@ LUAI_SWEEPER makes collectgarbage("sweeper") available: the memory of the
+@* dead objects found by the sweep phases is released by a thread of the
+@* state instead of the step that found them (see lgc.c). It needs POSIX
+@* threads.
+** CHANGE it (undefine it) if your system does not have them.
+*/
+#if !defined(LUA_ANSI) && !defined(_WIN32)
+#define LUAI_SWEEPER
+#endif
+
+/*
+@@ LUAI_PARALLEL lets the parallel library run its workers on threads, one
+@* per processor by default. It needs POSIX threads.
+** CHANGE it (undefine it) if your system does not have them: the calls of
+** the library then run all of their chunks in a single worker state.
+*/
+#if !defined(LUA_ANSI) && !defined(_WIN32)
+#define LUAI_PARALLEL
+#endif
+
 /*
 @@ LUA_COMPAT_GETN controls compatibility with old getn behavior.
 ** CHANGE it (define it) if you want exact compatibility with the
@@ -426,6 +469,16 @@
 */
 #define LUAI_MAXCSTACK 8000
 
+/*
+@@ LUAI_THREADPOOL is the number of dead coroutines a state keeps, with
+@* their stacks and CallInfo arrays, for the next coroutines it creates.
+@@ LUAI_THREADPOOLSTACK is the largest stack (and CallInfo array) kept.
+** CHANGE them if your program keeps many more generators alive at once
+** (0 disables the pool).
+*/
+#define LUAI_THREADPOOL 64
+#define LUAI_THREADPOOLSTACK 1024
+
 /*
 ** {==================================================================
 ** CHANGE (to smaller values) the following definitions if your system
@@ -457,11 +510,45 @@
 */
 #define LUAI_MAXUPVALUES 60
 
+/*
+@@ LUAI_MAXSHAPEKEYS is the maximum number of keys a shaped table keeps
+@* in its flat field array; adding one more turns it into a hash table.
+@@ LUAI_MAXSHAPES is the maximum number of shapes per state (see ltable.c).
+*/
+#define LUAI_MAXSHAPEKEYS 16
+#define LUAI_MAXSHAPES 4096
+
 /*
 @@ LUAL_BUFFERSIZE is the buffer size used by the lauxlib buffer system.
 */
 #define LUAL_BUFFERSIZE BUFSIZ
 
+/*
+@@ LUAI_OUTPUTSIZE is how much of what print and io.write send to the
+@* standard output is gathered before it is written (see lua_writeoutput).
+@@ lua_stdout_is_tty detects whether the standard output is a 'tty', the
+@* output is then written after every line.
+** CHANGE them if you want the output written sooner or later.
+*/
+#define LUAI_OUTPUTSIZE 8192
+
+/*
+@@ LUAL_READBUFSIZE is the size of the stdio buffer of the files the io
+@* library opens for reading, io.lines reads its lines straight out of it.
+*/
+#define LUAL_READBUFSIZE 65536
+
+#if defined(LUA_USE_ISATTY)
+#include <unistd.h>
+#define lua_stdout_is_tty() isatty(1)
+#elif defined(LUA_WIN)
+#include <io.h>
+#include <stdio.h>
+#define lua_stdout_is_tty() _isatty(_fileno(stdout))
+#else
+#define lua_stdout_is_tty() 1 /* assume stdout is a tty */
+#endif
+
 /* }================================================================== */
 
 /*
@@ -476,6 +563,21 @@
 #define LUA_NUMBER_DOUBLE
 #define LUA_NUMBER double
 
+/*
+@@ LUA_NANBOX keeps every value in 8 bytes instead of 16.
+** CHANGE it (define it, e.g. with -DLUA_NANBOX) to store numbers as
+** plain doubles and the other values in the unused NaN space. That halves
+** stacks, array parts, nodes and constants, at the price of a few more
+** instructions to read a number and of native code: the JIT is left out.
+** It needs double numbers and pointers of at most 47 bits, which is what
+** the user space of x86_64 gives.
+*/
+/* #define LUA_NANBOX */
+
+#if defined(LUA_NANBOX) && !defined(__x86_64__)
+#error "LUA_NANBOX needs the 47-bit user space of x86_64"
+#endif
+
 /*
 @@ LUAI_UACNUMBER is the result of an 'usual argument conversion'
 @* over a number.
@@ -491,8 +593,14 @@
 */
 #define LUA_NUMBER_SCAN "%lf"
 #define LUA_NUMBER_FMT "%.14g"
+#define LUAI_MAXNUMBER2STR 32 /* 17 digits, sign, point, exponent and \0 */
+#if defined(LUA_NUMBER_DOUBLE)
+/* the shortest digits that read back as the same number (see lobject.c) */
+#define lua_number2str(s, n) luaO_number2str((s), (n))
+LUAI_FUNC int luaO_number2str(char *s, double n);
+#else
 #define lua_number2str(s, n) sprintf((s), LUA_NUMBER_FMT, (n))
-#define LUAI_MAXNUMBER2STR 32 /* 16 digits, sign, point, and \0 */
+#endif
 #define lua_str2number(s, p) strtod((s), (p))
 
 /*
@@ -675,6 +783,17 @@ union luai_Cast {
 
 #endif
 
+/*
+@@ lua_getline reads a line (with its newline) into a buffer allocated with
+@* malloc and grown with realloc as needed, like POSIX getline; it returns
+@* the number of characters read, -1 at the end of the file.
+** CHANGE it if your system has another way to read lines (without
+** LUA_USE_GETLINE liolib.c reads them with fgets).
+*/
+#if defined(LUA_USE_GETLINE)
+#define lua_getline(b, sz, f) getline(b, sz, f)
+#endif
+
 /*
 @@ LUA_DL_* define which dynamic-library system Lua should use.
 ** CHANGE here if Lua has problems choosing the appropriate
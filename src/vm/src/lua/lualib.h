@@ -30,6 +30,15 @@ LUALIB_API int(luaopen_string)(lua_State *L);
 #define LUA_MATHLIBNAME "math"
 LUALIB_API int(luaopen_math)(lua_State *L);
 
+#define LUA_ARRAYLIBNAME "array"
+LUALIB_API int(luaopen_array)(lua_State *L);
+
+#define LUA_SCHEDLIBNAME "sched"
+LUALIB_API int(luaopen_sched)(lua_State *L);
+
+#define LUA_PARALLELLIBNAME "parallel"
+LUALIB_API int(luaopen_parallel)(lua_State *L);
+
 #define LUA_DBLIBNAME "debug"
 LUALIB_API int(luaopen_debug)(lua_State *L);
 
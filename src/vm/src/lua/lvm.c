@@ -13,6 +13,7 @@
 
 #include "lua.h"
 
+#include "larray.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -47,8 +48,8 @@ int luaV_tostring(lua_State *L, StkId obj)
     else {
         char s[LUAI_MAXNUMBER2STR];
         lua_Number n = nvalue(obj);
-        lua_number2str(s, n);
-        setsvalue2s(L, obj, luaS_new(L, s));
+        size_t l = lua_number2str(s, n);
+        setsvalue2s(L, obj, luaS_newlstr(L, s, l));
         return 1;
     }
 }
@@ -65,7 +66,9 @@ static void traceexec(lua_State *L, const Instruction *pc)
     if (mask & LUA_MASKLINE) {
         Proto *p = ci_func(L->ci)->l.p;
         int npc = pcRel(pc, p);
-        int newline = getline(p, npc);
+        int newline;
+        luaG_loaddebug(L, p);
+        newline = getline(p, npc);
         /* call linehook when enter a new function, when jump back (loop),
            or when enter a new line */
         if (npc == 0 || pc <= oldpc || newline != getline(p, pcRel(oldpc, p)))
@@ -114,6 +117,9 @@ void luaV_gettable(lua_State *L, const TValue *t, TValue *key, StkId val)
                 return;
             }
             /* else will try the tag method */
+        } else if (ttisarray(t)) { /* typed arrays have no metamethods */
+            luaR_get(L, arrvalue(t), key, val);
+            return;
         } else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_INDEX)))
             luaG_typeerror(L, t, "index");
         if (ttisfunction(tm)) {
@@ -142,6 +148,9 @@ void luaV_settable(lua_State *L, const TValue *t, TValue *key, StkId val)
                 return;
             }
             /* else will try the tag method */
+        } else if (ttisarray(t)) {
+            luaR_set(L, arrvalue(t), key, val);
+            return;
         } else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_NEWINDEX)))
             luaG_typeerror(L, t, "index");
         if (ttisfunction(tm)) {
@@ -235,7 +244,7 @@ int luaV_lessthan(lua_State *L, const TValue *l, const TValue *r)
     return luaG_ordererror(L, l, r);
 }
 
-static int lessequal(lua_State *L, const TValue *l, const TValue *r)
+int luaV_lessequal(lua_State *L, const TValue *l, const TValue *r)
 {
     int res;
     if (ttype(l) != ttype(r))
@@ -321,17 +330,66 @@ void luaV_concat(lua_State *L, int total, int last)
     } while (total > 1); /* repeat until only 1 result left */
 }
 
-void luaV_getenv(lua_State *L, Table *env, TValue *k)
+void luaV_getenv(lua_State *L, Table *env, TValue *key, GlobalCache *c, StkId ra)
 {
-    /* Allocate a stack slot for gettable */
-    luaD_checkstack(L, 1);
-    setnilvalue(L->top);
-    L->top++;
-
-    /* Find the object associated with `k` and save in L->top - 1 */
-    TValue g;
-    sethvalue(L, &g, env);
-    luaV_gettable(L, &g, k, L->top - 1);
+    const TValue *v = luaH_get(env, key);
+
+    /* Only string keys are cached, they always live in the node array */
+    if (!ttisnil(v) && ttisstring(key)) {
+        /* Remember where the value lives, it stays there until a node of the table moves */
+        c->table = env;
+        c->slot = v;
+        c->stamp = env->stamp;
+        setobj2s(L, ra, v);
+    } else {
+        /* Missing globals are not cached, so __index on the environment keeps working */
+        TValue g;
+        sethvalue(L, &g, env);
+        luaV_gettable(L, &g, key, ra);
+    }
+}
+
+void luaV_getfield(lua_State *L, const TValue *t, TValue *key, FieldCache *c, StkId ra)
+{
+    if (ttistable(t) && hvalue(t)->shape != NULL) {
+        Table *h = hvalue(t);
+        const TValue *v = luaH_getstr(h, rawtsvalue(key));
+
+        /* The field of a key is the same in every table of the shape */
+        if (v != luaO_nilobject) {
+            c->shape = h->shape->id;
+            c->index = cast_int(v - h->fields);
+            c->next = NULL;
+        }
+    }
+    luaV_gettable(L, t, key, ra);
+}
+
+void luaV_setfield(lua_State *L, const TValue *t, TValue *key, StkId val, FieldCache *c)
+{
+    Table *h = ttistable(t) ? hvalue(t) : NULL;
+    Shape *s = h != NULL ? h->shape : NULL;
+
+    luaV_settable(L, t, key, val);
+
+    /* Only a table that kept its shape or got this key added is cached (__newindex may have
+     * stored the value elsewhere), `t' and `val' may have moved with the stack by now */
+    if (s == NULL || h->shape == NULL)
+        return;
+
+    if (h->shape == s) {
+        const TValue *v = luaH_getstr(h, rawtsvalue(key));
+
+        if (v != luaO_nilobject) {
+            c->shape = s->id;
+            c->index = cast_int(v - h->fields);
+            c->next = NULL;
+        }
+    } else if (h->shape->parent == s && h->shape->keys[s->nkeys] == rawtsvalue(key)) {
+        c->shape = s->id;
+        c->index = s->nkeys;
+        c->next = h->shape;
+    }
 }
 
 void luaV_arith(lua_State *L, StkId ra, const TValue *rb, const TValue *rc, TMS op)
@@ -370,6 +428,107 @@ void luaV_arith(lua_State *L, StkId ra, const TValue *rb, const TValue *rc, TMS
         luaG_aritherror(L, rb, rc);
 }
 
+/* length of any value, what OP_LEN does for other values than strings and tables */
+void luaV_objlen(lua_State *L, StkId ra, const TValue *rb)
+{
+    switch (ttype(rb)) {
+        case LUA_TTABLE:
+            setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
+            break;
+        case LUA_TSTRING:
+            setnvalue(ra, cast_num(tsvalue(rb)->len));
+            break;
+        case LUA_TARRAY:
+            setnvalue(ra, cast_num(arrvalue(rb)->size));
+            break;
+        default: /* try metamethod */
+            if (!call_binTM(L, rb, luaO_nilobject, ra, TM_LEN))
+                luaG_typeerror(L, rb, "get length of");
+    }
+}
+
+/*
+** String builders of OP_APPEND: full userdata whose environment is the
+** registry (Lua code can not create those) holding the length of the string
+** followed by its bytes.  The space at least doubles whenever it runs out, so
+** appending n bytes piece by piece copies O(n) bytes overall.  A builder is
+** garbage like any userdata once OP_BUILDSTRING turned it into a string.
+*/
+typedef struct Builder {
+    size_t len;
+    char s[1];
+} Builder;
+
+#define MINBUILDERSIZE 64
+
+#define isbuilder(L, o) (ttisuserdata(o) && uvalue(o)->env == hvalue(registry(L)))
+#define tobuilder(o) cast(Builder *, rawuvalue(o) + 1)
+#define builderspace(o) (uvalue(o)->len - offsetof(Builder, s))
+
+static Builder *newbuilder(lua_State *L, StkId ra, size_t space, const char *s, size_t l)
+{
+    Udata *u = luaS_newudata(L, offsetof(Builder, s) + space, hvalue(registry(L)));
+    Builder *b = cast(Builder *, u + 1);
+    memcpy(b->s, s, l);
+    b->len = l;
+    setuvalue(L, ra, u);
+    return b;
+}
+
+void luaV_append(lua_State *L, StkId ra, StkId rb)
+{
+    char num[2][LUAI_MAXNUMBER2STR];
+    const char *s;
+    size_t l;
+    Builder *b;
+    if (ttisstring(rb)) {
+        s = svalue(rb);
+        l = tsvalue(rb)->len;
+    } else if (ttisnumber(rb)) {
+        l = lua_number2str(num[0], nvalue(rb));
+        s = num[0];
+    } else { /* only a metamethod can concatenate it */
+        luaV_buildstring(L, ra, ra);
+        if (!call_binTM(L, ra, rb, ra, TM_CONCAT))
+            luaG_concaterror(L, ra, rb);
+        return;
+    }
+    if (isbuilder(L, ra))
+        b = tobuilder(ra);
+    else if (ttisstring(ra) || ttisnumber(ra)) { /* first append */
+        const char *s0 = num[1];
+        size_t l0;
+        if (ttisstring(ra)) {
+            s0 = svalue(ra);
+            l0 = tsvalue(ra)->len;
+        } else
+            l0 = lua_number2str(num[1], nvalue(ra));
+        if (l >= MAX_SIZET / 2 - l0)
+            luaG_runerror(L, "string length overflow");
+        b = newbuilder(L, ra, MINBUILDERSIZE + 2 * (l0 + l), s0, l0);
+    } else {
+        if (!call_binTM(L, ra, rb, ra, TM_CONCAT))
+            luaG_concaterror(L, ra, rb);
+        return;
+    }
+    if (l > builderspace(ra) - b->len) { /* grow it */
+        if (l >= MAX_SIZET / 2 - b->len)
+            luaG_runerror(L, "string length overflow");
+        b = newbuilder(L, ra, 2 * (b->len + l), b->s, b->len);
+    }
+    memcpy(b->s + b->len, s, l);
+    b->len += l;
+}
+
+void luaV_buildstring(lua_State *L, StkId ra, const TValue *rb)
+{
+    if (isbuilder(L, rb)) {
+        Builder *b = tobuilder(rb);
+        setsvalue2s(L, ra, luaS_newlstr(L, b->s, b->len));
+    } else
+        setobj2s(L, ra, rb);
+}
+
 /*
 ** some macros for common tasks in `luaV_execute'
 */
@@ -597,7 +756,7 @@ reentry: /* entry point */
                 continue;
             }
             case OP_LE: {
-                Protect(if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
+                Protect(if (luaV_lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
                             dojump(L, pc, GETARG_D(*pc));) pc++;
                 continue;
             }
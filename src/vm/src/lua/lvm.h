@@ -18,6 +18,7 @@
 #define equalobj(L, o1, o2) (ttype(o1) == ttype(o2) && luaV_equalval(L, o1, o2))
 
 LUAI_FUNC int luaV_lessthan(lua_State *L, const TValue *l, const TValue *r);
+LUAI_FUNC int luaV_lessequal(lua_State *L, const TValue *l, const TValue *r);
 LUAI_FUNC int luaV_equalval(lua_State *L, const TValue *t1, const TValue *t2);
 LUAI_FUNC const TValue *luaV_tonumber(const TValue *obj, TValue *n);
 LUAI_FUNC int luaV_tostring(lua_State *L, StkId obj);
@@ -27,8 +28,13 @@ LUAI_FUNC void luaV_execute(lua_State *L, int nexeccalls);
 LUAI_FUNC void luaV_concat(lua_State *L, int total, int last);
 
 /* Lua++ additions */
-LUAI_FUNC void luaV_getenv(lua_State *L, Table *env, TValue *k);
+LUAI_FUNC void luaV_getenv(lua_State *L, Table *env, TValue *key, GlobalCache *c, StkId ra);
+LUAI_FUNC void luaV_getfield(lua_State *L, const TValue *t, TValue *key, FieldCache *c, StkId ra);
+LUAI_FUNC void luaV_setfield(lua_State *L, const TValue *t, TValue *key, StkId val, FieldCache *c);
 LUAI_FUNC void luaV_arith(lua_State *L, StkId ra, const TValue *rb, const TValue *rc, TMS op);
+LUAI_FUNC void luaV_objlen(lua_State *L, StkId ra, const TValue *rb);
+LUAI_FUNC void luaV_append(lua_State *L, StkId ra, StkId rb);
+LUAI_FUNC void luaV_buildstring(lua_State *L, StkId ra, const TValue *rb);
 LUAI_FUNC void luapp_execute(lua_State *L, int nexeccalls);
 
 #endif
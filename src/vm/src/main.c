@@ -4,50 +4,449 @@
 
 #include <assert.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lua/lauxlib.h"
 #include "lua/lua.h"
 #include "lua/lualib.h"
 
-/* main() -- entry point for the VM */
+#include "alloc.h"
+#include "aot.h"
+#include "jit.h"
+#include "pool.h"
+#include "profile.h"
+#include "sample.h"
+#include "snapshot.h"
+
+/* dump_profile() -- writes a profile of the run to a file ("-" for stdout)
+ *      args: path of the file, function writing the profile
+ *      rets: 0 on success, 1 otherwise
+ */
+static int dump_profile(const char *path, int (*dump)(FILE *output))
+{
+    FILE *output = strcmp(path, "-") ? fopen(path, "w") : stdout;
+
+    if (output == NULL) {
+        printf("Error: unable to open profile output %s\n", path);
+        return 1;
+    }
+
+    int status = dump(output);
+
+    if (output != stdout)
+        status |= fclose(output);
+
+    if (status) {
+        printf("Error: unable to write profile output %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* dump_samples() -- stops the sampling profiler and writes the stacks it took to a file
+ *      args: path of the file
+ *      rets: 0 on success, 1 otherwise
+ */
+static int dump_samples(const char *path)
+{
+    luapp_sample_stop();
+
+    FILE *output = fopen(path, "w");
+
+    if (output == NULL) {
+        printf("Error: unable to open sample output %s\n", path);
+        return 1;
+    }
+
+    int status = luapp_sample_dump(output);
+    status |= fclose(output);
+
+    if (status) {
+        printf("Error: unable to write sample output %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Runs shared by the worker threads of a host */
+struct host {
+    const struct luapp_program *program;
+    enum luapp_alloc_kind allocator;
+    bool alloc_stats;
+    bool sweeper;
+    int limit, softlimit; /* Heap limits of the states in Kbytes, 0 for none */
+    long runs;
+    atomic_long next;
+    atomic_int failed;
+};
+
+/* host_worker() -- runs the program on a pooled state until all runs of the host were taken
+ *      args: host
+ *      rets: NULL
+ */
+static void *host_worker(void *arg)
+{
+    struct host *host = arg;
+    struct luapp_pool pool;
+
+    /* Every thread has its own state, only the program is shared */
+    if (luapp_pool_init(&pool, host->program, host->allocator, 1, 1)) {
+        printf("Error: unable to load the program\n");
+        atomic_store(&host->failed, 1);
+        return NULL;
+    }
+
+    while (!atomic_load(&host->failed) && atomic_fetch_add(&host->next, 1) < host->runs) {
+        lua_State *L = luapp_pool_acquire(&pool);
+
+        /* A pooled state keeps its sweeper, starting it again does nothing */
+        if (L != NULL && host->sweeper)
+            lua_gc(L, LUA_GCSWEEPER, 1);
+
+        if (L != NULL) {
+            lua_gc(L, LUA_GCLIMIT, host->limit);
+            lua_gc(L, LUA_GCSOFTLIMIT, host->softlimit);
+        }
+
+        if (L == NULL || lua_resume(L, 0)) {
+            printf("Error: %s\n", L != NULL ? lua_tostring(L, -1) : "unable to create a state");
+            atomic_store(&host->failed, 1);
+        }
+
+        if (L != NULL)
+            luapp_pool_release(&pool, L);
+    }
+
+    if (host->alloc_stats) {
+        for (int i = 0; i < pool.size; i++)
+            luapp_alloc_print(stderr, pool.states[i]);
+    }
+
+    luapp_pool_free(&pool);
+    return NULL;
+}
+
+/* run_host() -- runs a program several times on pooled states of worker threads, the way an
+ * embedder would, and reports the mean time of a run on stderr
+ *      args: path of the bytecode file, number of runs, number of threads, allocator of the
+ *            states, whether to print the allocator counters of each thread, whether the states
+ *            sweep with a thread of their own, hard and soft heap limits of the states in Kbytes
+ *      rets: 0 if every run succeeded, 1 otherwise
+ */
+static int run_host(const char *path, long runs, int threads, enum luapp_alloc_kind allocator,
+                    bool alloc_stats, bool sweeper, int limit, int softlimit)
+{
+    struct luapp_program *program = luapp_program_open("=lua++", path);
+    struct timespec start, end;
+
+    if (program == NULL) {
+        printf("Error: unable to load %s\n", path);
+        return 1;
+    }
+
+    struct host host = {program, allocator, alloc_stats, sweeper, limit, softlimit, runs};
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* The main thread is a worker as well */
+    while (workers != NULL && started < threads - 1 &&
+           !pthread_create(&workers[started], NULL, host_worker, &host))
+        started++;
+
+    host_worker(&host);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    fprintf(stderr, "%ld runs on %d threads, %.2f us per run\n", runs, started + 1,
+            elapsed / runs);
+
+    free(workers);
+    luapp_program_free(program);
+    return atomic_load(&host.failed);
+}
+
+/* main() -- entry point for the VM
+ *
+ * luappvm -p [profile.json] -P [out.profile] -n [runs] -t [threads] -a [allocator] -m -G
+ *      -M [limit] -N [module.so] -J [threshold] -s [out.folded] [inputfile...]
+ *
+ * -p : writes the opcode profile as JSON to the given file ("-" for stdout) once the program
+ *      finished. Only available in profiling builds (make runtime-profile).
+ * -P : writes how often each instruction ran and the types its operands had to the given file
+ *      once the program finished, luappc --profile compiles the program again with it (see
+ *      common/feedback.h). Only available in profiling builds, for a single input.
+ * -n : runs the program the given number of times on a reused state (see pool.h) and reports
+ *      the mean time of a run on stderr.
+ * -t : spreads the runs over the given number of threads, each with its own state. The
+ *      instructions of the program are loaded once and shared by all of them. Defaults to one
+ *      run per thread without -n.
+ * -a : allocator of the states: system (the default), pool or arena (see alloc.h).
+ * -m : writes the counters of the allocator as JSON to stderr once the program finished.
+ * -G : the memory of the dead objects is released by a thread of each state instead of the
+ *      steps of the collector (collectgarbage("sweeper")).
+ * -M : limits the heap of each state to the given number of Kbytes, allocations past it fail with
+ *      "not enough memory". A second number after a comma is the soft limit, past it the
+ *      collector runs a full collection (collectgarbage("limit") and collectgarbage("softlimit")).
+ * -N : registers a native module written by luappc -s aot (see aot.h), the protos it was
+ *      translated from run natively. Can be given several times.
+ * -J : compiles the protos to machine code once they ran the given number of times (calls and
+ *      loop iterations), see jit.h. Only on x86-64 and AArch64.
+ * -s : samples the stacks of the interpreted functions about a thousand times per second of CPU
+ *      time and writes them to the given file in the folded format of flamegraph.pl once the
+ *      program finished, see sample.h.
+ * -S : writes an image of the heap the globals reach to the given file once the inputs ran, see
+ *      snapshot.h.
+ * -R : restores the globals of an image written by -S before the inputs run, instead of running
+ *      the programs that initialized them.
+ *
+ * Several inputs are run one after the other on the same state, so the globals a program defines
+ * are seen by the programs after it (luappc --incremental checks their types across files).
+ */
 int main(int argc, char **argv)
 {
-    char *dot;
-    FILE *input;
+    char *dot, *profile = NULL, *feedback = NULL, *samples = NULL, *save = NULL, *restore = NULL;
+    long runs = 0, threads = 0;
+    enum luapp_alloc_kind allocator = LUAPP_ALLOC_SYSTEM;
+    bool alloc_stats = false, sweeper = false;
+    int opt, limit = 0, softlimit = 0;
+
+    while ((opt = getopt(argc, argv, "p:P:n:t:a:mGM:N:J:s:S:R:")) != -1) {
+        switch (opt) {
+            case 'p':
+            case 'P':
+                if (!LUAPP_PROFILE) {
+                    printf("Error: the VM was built without the profiler (make runtime-profile)\n");
+                    return 1;
+                }
+                if (opt == 'p')
+                    profile = optarg;
+                else
+                    feedback = optarg;
+                break;
+            case 'n': {
+                char *end;
+                runs = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || runs < 1) {
+                    printf("Error: invalid number of runs %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 't': {
+                char *end;
+                threads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || threads < 1 || threads > 1024) {
+                    printf("Error: invalid number of threads %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'a':
+                if (luapp_alloc_kind(optarg, &allocator)) {
+                    printf("Error: unknown allocator %s (system, pool or arena)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                alloc_stats = true;
+                break;
+            case 'G':
+                sweeper = true;
+                break;
+            case 'M': {
+                char *end;
+                long hard = strtol(optarg, &end, 10), soft = 0;
+
+                if (*end == ',')
+                    soft = strtol(end + 1, &end, 10);
+
+                if (*end != '\0' || hard < 0 || soft < 0 || hard > INT_MAX || soft > INT_MAX) {
+                    printf("Error: invalid memory limit %s\n", optarg);
+                    return 1;
+                }
+                limit = (int)hard;
+                softlimit = (int)soft;
+                break;
+            }
+            case 'N':
+                if (luapp_aot_open(optarg)) {
+                    printf("Error: unable to register the native module %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'J': {
+                char *end;
+                long threshold = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || threshold < 1 || threshold > INT_MAX) {
+                    printf("Error: invalid JIT threshold %s\n", optarg);
+                    return 1;
+                }
+                if (luapp_jit_enable((int)threshold)) {
+                    printf("Error: the JIT is not available on this platform\n");
+                    return 1;
+                }
+                break;
+            }
+            case 's':
+                samples = optarg;
+                break;
+            case 'S':
+                save = optarg;
+                break;
+            case 'R':
+                restore = optarg;
+                break;
+            default:
+                printf("usage: luappvm [-p profile.json] [-P out.profile] [-n runs] [-t threads] "
+                       "[-a allocator] [-m] [-G] [-M limit[,soft]] [-N module.so] [-J threshold] "
+                       "[-s out.folded] [-S out.snap] [-R image.snap] file.bin...\n");
+                return 1;
+        }
+    }
+
+    /* Make sure we were given bytecode files */
+    if (optind == argc) {
+        printf("Error: expected an input file.\n");
+        return 1;
+    }
 
-    /* Determine if we are using stdin or file in. */
-    if (optind == argc - 1) {
-        dot = strrchr(argv[optind], '.');
+    for (int i = optind; i < argc; i++) {
+        dot = strrchr(argv[i], '.');
 
-        /* If the given file is of the correct type, init the reader */
-        if (dot && (!strcmp(dot, ".out") || !strcmp(dot, ".bin")))
-            input = fopen(argv[optind], "r");
-        else {
+        /* If the given file is of the correct type, it can be loaded */
+        if (!dot || (strcmp(dot, ".out") && strcmp(dot, ".bin"))) {
             printf("Error: incorrect file type.\n");
             return 1;
         }
-    } else {
-        printf("Error: expected one input file, found %d files.\n", argc - optind);
+    }
+
+    /* Repeated runs start from a fresh state every time, a single program is loaded for them */
+    if ((runs > 0 || threads > 0) && optind != argc - 1) {
+        printf("Error: -n and -t need a single input file.\n");
+        return 1;
+    }
+
+    /* An image is the heap of the single state the inputs run on */
+    if ((runs > 0 || threads > 0) && (save != NULL || restore != NULL)) {
+        printf("Error: -S and -R can not be used with -n and -t\n");
+        return 1;
+    }
+
+    /* The profile is a single set of counters, it can not follow several threads */
+    if ((profile != NULL || feedback != NULL) && threads > 1) {
+        printf("Error: the profiler can not be used with several threads\n");
+        return 1;
+    }
+
+    /* Sites are told apart by their lines, which the inputs would share */
+    if (feedback != NULL && optind != argc - 1) {
+        printf("Error: -P needs a single input file.\n");
         return 1;
     }
 
-    lua_State *L = luaL_newstate();
+    luapp_profile.feedback = feedback != NULL;
+
+    if (samples != NULL && luapp_sample_start(LUAPP_SAMPLE_HZ)) {
+        printf("Error: unable to start the sampling profiler\n");
+        return 1;
+    }
+
+    if (runs > 0 || threads > 0) {
+        if (threads == 0)
+            threads = 1;
+
+        int status =
+            run_host(argv[optind], runs > 0 ? runs : threads, threads, allocator, alloc_stats,
+                     sweeper, limit, softlimit);
+
+        if (profile != NULL)
+            status |= dump_profile(profile, luapp_profile_dump);
+        if (feedback != NULL)
+            status |= dump_profile(feedback, luapp_profile_feedback);
+        if (samples != NULL)
+            status |= dump_samples(samples);
+
+        return status;
+    }
+
+    lua_State *L = luapp_newstate(allocator);
     luaL_openlibs(L);
 
-    if (luapp_loadfile(L, "=lua++", input)) {
-        /* An error occured, display it and pop it from the stack */
-        printf("Error: %s\n", lua_tostring(L, -1));
-        lua_pop(L, 1);
+    if (sweeper)
+        lua_gc(L, LUA_GCSWEEPER, 1);
 
-        /* Close everything and return */
-        lua_close(L);
+    lua_gc(L, LUA_GCLIMIT, limit);
+    lua_gc(L, LUA_GCSOFTLIMIT, softlimit);
+    int failed = 0, status = 0;
+
+    if (restore != NULL && luapp_snapshot_restore(L, restore)) {
+        printf("Error: %s\n", lua_tostring(L, -1));
+        luapp_close(L);
         return 1;
     }
 
-    /* Run the closure at L->top + 0 */
-    lua_resume(L, 0);
-    lua_close(L);
-    return 0;
+    for (int i = optind; i < argc && !failed; i++) {
+        if (luapp_loadpath(L, "=lua++", argv[i])) {
+            /* An error occured, display it and pop it from the stack */
+            printf("Error: %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+
+            /* Close everything and return */
+            luapp_close(L);
+            return 1;
+        }
+
+        /* Run the closure at L->top + 0, runtime errors are reported like load errors */
+        status = lua_resume(L, 0);
+        failed = status != 0 && status != LUA_YIELD;
+
+        if (failed)
+            printf("Error: %s\n", lua_tostring(L, -1));
+
+        /* A program that yielded is left suspended, the state can not start the next one */
+        if (status == LUA_YIELD)
+            break;
+
+        lua_settop(L, 0);
+    }
+
+    /* A suspended program still holds open upvalues, its state can not be saved */
+    if (save != NULL && !failed && status != LUA_YIELD &&
+        luapp_snapshot_save(L, save, luaL_openlibs)) {
+        printf("Error: %s\n", lua_tostring(L, -1));
+        failed = 1;
+    }
+
+    if (alloc_stats)
+        luapp_alloc_print(stderr, L);
+
+    luapp_close(L);
+
+    if (samples != NULL)
+        failed |= dump_samples(samples);
+
+    if (feedback != NULL)
+        failed |= dump_profile(feedback, luapp_profile_feedback);
+
+    if (profile != NULL)
+        return dump_profile(profile, luapp_profile_dump) || failed;
+
+    return failed;
 }
\ No newline at end of file
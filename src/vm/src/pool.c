@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../common/bytecode.h"
+
+#include "lua/lauxlib.h"
+#include "lua/lfunc.h"
+#include "lua/lstate.h"
+#include "lua/lualib.h"
+
+#include "pool.h"
+
+/* Registry keys of the values every pooled state keeps, their addresses are unique */
+static const char main_key = 'm';
+static const char snapshot_key = 's';
+
+/* luapp_program_new() -- copies a bytecode program so it can be shared by pools
+ *      args: chunk name, bytecode, size of the bytecode
+ *      rets: program or NULL if the bytecode has an unsupported version or memory ran out
+ */
+struct luapp_program *luapp_program_new(const char *name, const char *bytecode, size_t size)
+{
+    if (size == 0 || !VERSION_ACCEPTABLE((version_t)bytecode[0]))
+        return NULL;
+
+    struct luapp_program *program = malloc(sizeof(struct luapp_program));
+    char *copy = malloc(size);
+
+    if (program == NULL || copy == NULL) {
+        free(program);
+        free(copy);
+        return NULL;
+    }
+
+    /* The instructions of recent versions are used in place, so they are taken from the copy */
+    memcpy(copy, bytecode, size);
+
+    if (luapp_code_init(&program->code, copy, size)) {
+        free(program);
+        free(copy);
+        return NULL;
+    }
+
+    program->name = name;
+    program->bytecode = copy;
+    program->size = size;
+    return program;
+}
+
+/* luapp_program_open() -- reads a bytecode file into a program
+ *      args: chunk name, path of the file
+ *      rets: program or NULL if the file can not be read or has an unsupported version
+ */
+struct luapp_program *luapp_program_open(const char *name, const char *path)
+{
+    FILE *input = fopen(path, "rb");
+    char *bytecode = NULL;
+    size_t size = 0, space = 0, count;
+
+    if (input == NULL)
+        return NULL;
+
+    do {
+        if (size == space) {
+            space = space ? space * 2 : LUAL_BUFFERSIZE;
+            char *grown = realloc(bytecode, space);
+
+            if (grown == NULL) {
+                free(bytecode);
+                fclose(input);
+                return NULL;
+            }
+            bytecode = grown;
+        }
+
+        count = fread(bytecode + size, 1, space - size, input);
+        size += count;
+    } while (count > 0);
+
+    int failed = ferror(input);
+    fclose(input);
+
+    struct luapp_program *program = failed ? NULL : luapp_program_new(name, bytecode, size);
+    free(bytecode);
+    return program;
+}
+
+/* luapp_program_free() -- releases a program, no pool or state may use it anymore
+ *      args: program
+ *      rets: none
+ */
+void luapp_program_free(struct luapp_program *program)
+{
+    if (program == NULL)
+        return;
+
+    luapp_code_free(&program->code);
+    free(program->bytecode);
+    free(program);
+}
+
+/* pool_newstate() -- creates a state with the standard libraries that loaded the program, the
+ * main closure and a copy of the globals are kept in the registry
+ *      args: pool
+ *      rets: state or NULL if the program could not be loaded
+ */
+static lua_State *pool_newstate(const struct luapp_pool *pool)
+{
+    const struct luapp_program *program = pool->program;
+    lua_State *L = luapp_newstate(pool->allocator);
+
+    if (L == NULL)
+        return NULL;
+
+    luaL_openlibs(L);
+
+    if (luapp_loadshared(L, program->name, program->bytecode, program->size, &program->code)) {
+        luapp_close(L);
+        return NULL;
+    }
+
+    lua_pushlightuserdata(L, (void *)&main_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Remember the environment before the first run, releasing the state restores it */
+    lua_pushlightuserdata(L, (void *)&snapshot_key);
+    lua_newtable(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return L;
+}
+
+/* pool_reset() -- restores the globals of a state to the copy taken when it was created
+ *      args: state
+ *      rets: none
+ */
+static void pool_reset(lua_State *L)
+{
+    /* OP_RETURN popped the frame of the main closure, make sure no other frame is left either */
+    luaF_close(L, L->stack);
+    L->ci = L->base_ci;
+    L->base = L->top = L->ci->base;
+
+    lua_pushlightuserdata(L, (void *)&snapshot_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    /* Drop the globals the run added, clearing a field while traversing the table is allowed */
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 1);
+
+        if (lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, LUA_GLOBALSINDEX);
+        }
+        lua_pop(L, 1);
+    }
+
+    /* Put back the ones it changed or removed */
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_GLOBALSINDEX);
+    }
+
+    /* Every run draws the random numbers a new state would */
+    lua_randomseed(L, 0);
+    lua_settop(L, 0);
+}
+
+/* luapp_pool_init() -- initializes a pool of states running a program
+ *      args: pool, program (has to outlive the pool), allocator of the states, number of states to
+ *            create right away, number of idle states kept at most
+ *      rets: 0 on success, -1 if the program could not be loaded
+ */
+int luapp_pool_init(struct luapp_pool *pool, const struct luapp_program *program,
+                    enum luapp_alloc_kind allocator, int prewarm, int max_idle)
+{
+    pool->program = program;
+    pool->allocator = allocator;
+    pool->max_idle = max_idle > prewarm ? max_idle : prewarm;
+    pool->size = 0;
+    pool->space = pool->max_idle;
+    pool->states = NULL;
+
+    if (pool->space > 0 && !(pool->states = malloc(pool->space * sizeof(lua_State *))))
+        return -1;
+
+    while (pool->size < prewarm) {
+        lua_State *L = pool_newstate(pool);
+
+        if (L == NULL) {
+            luapp_pool_free(pool);
+            return -1;
+        }
+
+        pool->states[pool->size++] = L;
+    }
+
+    return 0;
+}
+
+/* luapp_pool_free() -- closes every idle state of a pool, acquired states have to be closed by
+ * their owner with luapp_close()
+ *      args: pool
+ *      rets: none
+ */
+void luapp_pool_free(struct luapp_pool *pool)
+{
+    for (int i = 0; i < pool->size; i++)
+        luapp_close(pool->states[i]);
+
+    free(pool->states);
+    pool->states = NULL;
+    pool->size = pool->space = 0;
+}
+
+/* luapp_pool_acquire() -- takes an idle state from the pool (or creates one) and pushes the main
+ * closure of the program onto its stack
+ *      args: pool
+ *      rets: state or NULL if no state could be created
+ */
+lua_State *luapp_pool_acquire(struct luapp_pool *pool)
+{
+    lua_State *L = pool->size > 0 ? pool->states[--pool->size] : pool_newstate(pool);
+
+    if (L == NULL)
+        return NULL;
+
+    lua_pushlightuserdata(L, (void *)&main_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    return L;
+}
+
+/* luapp_pool_release() -- resets a state and hands it back to the pool
+ *      args: pool, state returned by luapp_pool_acquire
+ *      rets: none
+ */
+void luapp_pool_release(struct luapp_pool *pool, lua_State *L)
+{
+    /* A suspended or broken thread can not be reused, neither can states beyond the limit */
+    if (lua_status(L) != 0 || pool->size >= pool->space) {
+        luapp_close(L);
+        return;
+    }
+
+    pool_reset(L);
+    pool->states[pool->size++] = L;
+}
@@ -0,0 +1,65 @@
+/*  pool.h - only version
+ *      embedding API: compile once, run many times
+ *
+ *  A luapp_program holds a bytecode blob that was read and checked once, it is never modified
+ *  afterwards so any number of pools (and threads) can share it. A pool keeps lua_States that
+ *  already opened the standard libraries and loaded the program, acquiring one pushes the main
+ *  closure of the program (run it with lua_resume, like luappvm does) and releasing it resets the
+ *  stack and the globals to what they were before the first run, so every run starts from the
+ *  same environment.
+ *
+ *  Protos are garbage collected objects of a single state in this VM, so every pooled state owns
+ *  its own proto headers, constants and inline caches. The instructions, the bulk of a program,
+ *  are copied once when the program is created and shared read-only by every state, in every
+ *  thread, that loads it.
+ *
+ *  A pool is not locked, each thread has to use its own pool.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+#include "lua/lua.h"
+
+/* Instructions of every proto of a program, allocated outside of any state (see luapp_code_init) */
+struct luapp_code {
+    uint32_t **code;
+    uint32_t *sizes;
+    uint32_t count;
+    int aliased; /* The instructions point into the bytecode instead of being copies */
+};
+
+struct luapp_program {
+    const char *name; /* Chunk name of the closures */
+    char *bytecode;
+    size_t size;
+    struct luapp_code code; /* Shared by all states that load the program */
+};
+
+struct luapp_pool {
+    const struct luapp_program *program;
+    enum luapp_alloc_kind allocator; /* Of every state of the pool */
+
+    lua_State **states; /* Idle states, ready to be acquired */
+    int size, space;
+    int max_idle; /* Released states beyond this are closed */
+};
+
+/* Programs */
+struct luapp_program *luapp_program_new(const char *name, const char *bytecode, size_t size);
+struct luapp_program *luapp_program_open(const char *name, const char *path);
+void luapp_program_free(struct luapp_program *program);
+
+/* Pools of states running a program */
+int luapp_pool_init(struct luapp_pool *pool, const struct luapp_program *program,
+                    enum luapp_alloc_kind allocator, int prewarm, int max_idle);
+void luapp_pool_free(struct luapp_pool *pool);
+
+lua_State *luapp_pool_acquire(struct luapp_pool *pool);
+void luapp_pool_release(struct luapp_pool *pool, lua_State *L);
+
+#endif
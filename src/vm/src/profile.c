@@ -0,0 +1,334 @@
+/*  profile.c - only version
+ *      collected opcode statistics and their JSON dump, counters of the sites of every proto and
+ *      the profile luappc reads back
+ */
+
+#define LUA_CORE
+#include <stdlib.h>
+
+#include "lua/ldebug.h"
+#include "lua/lobject.h"
+#include "lua/ltable.h"
+
+#include "profile.h"
+
+/* Counters of the instructions of a proto, copied out of it so they outlive it */
+struct profile_sites {
+    int32_t linedefined; /* Line the function is defined on, 0 for the main function */
+    int32_t size;        /* Number of instructions */
+    int32_t *lines;      /* Line of every instruction, 0 without debug information */
+    uint8_t *kinds;      /* feedback_kind() of every instruction */
+    uint64_t *counts;    /* Times every instruction ran */
+    uint8_t (*types)[2]; /* Types of its operands, see feedback_kind() for which ones */
+    struct profile_sites *next;
+};
+
+struct luapp_profile luapp_profile = {.current = PROFILE_NONE};
+
+/* luapp_profile_pause() -- stops charging time to the running instruction, called whenever
+ * luapp_execute returns
+ *      args: none
+ *      rets: none
+ */
+void luapp_profile_pause(void)
+{
+    if (luapp_profile.current == PROFILE_NONE)
+        return;
+
+    luapp_profile.cycles[luapp_profile.current] +=
+        luapp_profile_clock() - luapp_profile.started;
+    luapp_profile.current = PROFILE_NONE;
+}
+
+/* luapp_profile_dump() -- writes the statistics as a JSON object
+ *      args: output stream
+ *      rets: 0 on success, EOF if writing failed
+ *
+ *  {
+ *      "clock": "tsc" | "ns",
+ *      "opcodes": {"MOVE": {"count": 1, "cycles": 20}, ...},
+ *      "pairs": [{"first": "GETENV", "second": "LOADK", "count": 1}, ...]
+ *  }
+ *
+ *  Opcodes that never ran are left out, pairs are sorted by count (most frequent first).
+ */
+int luapp_profile_dump(FILE *output)
+{
+    luapp_profile_pause();
+
+#if defined(__x86_64__) || defined(__i386__)
+    fputs("{\n    \"clock\": \"tsc\",\n    \"opcodes\": {", output);
+#else
+    fputs("{\n    \"clock\": \"ns\",\n    \"opcodes\": {", output);
+#endif
+
+    const char *separator = "\n";
+
+    for (int32_t op = 0; op < NUM_OPCODES; op++) {
+        if (luapp_profile.count[op] == 0)
+            continue;
+
+        fprintf(output, "%s        \"%s\": {\"count\": %llu, \"cycles\": %llu}", separator,
+                opcode_names[op], (unsigned long long)luapp_profile.count[op],
+                (unsigned long long)luapp_profile.cycles[op]);
+        separator = ",\n";
+    }
+
+    fputs("\n    },\n    \"pairs\": [", output);
+    separator = "\n";
+
+    /* Selection by descending count, the table is small and this only runs once */
+    uint64_t bound = UINT64_MAX;
+
+    for (;;) {
+        uint64_t best = 0;
+
+        for (int32_t first = 0; first < NUM_OPCODES; first++)
+            for (int32_t second = 0; second < NUM_OPCODES; second++) {
+                uint64_t count = luapp_profile.pairs[first][second];
+
+                if (count > best && count < bound)
+                    best = count;
+            }
+
+        if (best == 0)
+            break;
+
+        for (int32_t first = 0; first < NUM_OPCODES; first++)
+            for (int32_t second = 0; second < NUM_OPCODES; second++) {
+                if (luapp_profile.pairs[first][second] != best)
+                    continue;
+
+                fprintf(output, "%s        {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+                        separator, opcode_names[first], opcode_names[second],
+                        (unsigned long long)best);
+                separator = ",\n";
+            }
+
+        bound = best;
+    }
+
+    fputs("\n    ]\n}\n", output);
+    return ferror(output) ? EOF : 0;
+}
+
+/* profile_free() -- releases the counters of a proto
+ *      args: counters (may be partly allocated)
+ *      rets: none
+ */
+static void profile_free(struct profile_sites *sites)
+{
+    free(sites->lines);
+    free(sites->kinds);
+    free(sites->counts);
+    free(sites->types);
+    free(sites);
+}
+
+/* profile_new() -- sets up the counters of a proto the first time it runs
+ *      args: state, proto
+ *      rets: counters, NULL if memory ran out (the sites are no longer recorded then)
+ */
+static struct profile_sites *profile_new(lua_State *L, Proto *p)
+{
+    struct profile_sites *sites = calloc(1, sizeof(struct profile_sites));
+    size_t size = p->sizecode;
+
+    if (sites != NULL) {
+        sites->lines = malloc(size * sizeof(int32_t));
+        sites->kinds = malloc(size);
+        sites->counts = calloc(size, sizeof(uint64_t));
+        sites->types = calloc(size, sizeof(*sites->types));
+    }
+
+    if (sites == NULL || sites->lines == NULL || sites->kinds == NULL || sites->counts == NULL ||
+        sites->types == NULL) {
+        if (sites != NULL)
+            profile_free(sites);
+
+        luapp_profile.feedback = 0;
+        return NULL;
+    }
+
+    luaG_loaddebug(L, p);
+    sites->linedefined = p->linedefined;
+    sites->size = p->sizecode;
+
+    /* Sub instructions hold values and not opcodes, they are of no kind (the same as verify_sub) */
+    for (int32_t pc = 0, subs = 0; pc < p->sizecode; pc++) {
+        Instruction i = p->code[pc];
+
+        sites->lines[pc] = getline(p, pc);
+        sites->kinds[pc] = subs > 0 ? FEEDBACK_NONE : feedback_kind(GET_OPCODE(i));
+
+        if (subs > 0)
+            subs--;
+        else if (GET_OPCODE(i) == OP_LOADKX)
+            subs = 1;
+        else if (GET_OPCODE(i) == OP_CLOSURE)
+            subs = p->p[GETARG_Du(i)]->nups;
+    }
+
+    sites->next = luapp_profile.sites;
+    luapp_profile.sites = sites;
+    return sites;
+}
+
+/* profile_type() -- classifies an operand for the profile
+ *      args: value
+ *      rets: one of FEEDBACK_INTEGER ... FEEDBACK_OTHER
+ */
+static uint8_t profile_type(const TValue *o)
+{
+    switch (ttype(o)) {
+        case LUA_TNUMBER: {
+            lua_Number n = nvalue(o);
+            int whole;
+
+            /* Whole numbers that fit an int, the ones OP_GETARRAY reads without a call */
+            lua_number2int(whole, n);
+            return cast_num(whole) == n ? FEEDBACK_INTEGER : FEEDBACK_NUMBER;
+        }
+        case LUA_TSTRING:
+            return FEEDBACK_STRING;
+        case LUA_TTABLE:
+            return FEEDBACK_TABLE;
+        case LUA_TARRAY:
+            return FEEDBACK_ARRAY;
+        case LUA_TFUNCTION: {
+            Closure *c = clvalue(o);
+
+            /* The functions OP_CALLDIRECT calls without luaD_precall */
+            if (!c->c.isC && !c->l.p->is_vararg && c->l.p->native == NULL)
+                return FEEDBACK_FIXED;
+            return FEEDBACK_FUNCTION;
+        }
+        default:
+            return FEEDBACK_OTHER;
+    }
+}
+
+/* luapp_profile_record() -- counts an instruction and the types of its operands, called by
+ * luapp_profile_site() before the instruction runs
+ *      args: state, closure running, instruction, base of its frame
+ *      rets: none
+ */
+void luapp_profile_record(lua_State *L, LClosure *cl, const Instruction *pc, StkId base)
+{
+    Proto *p = cl->p;
+
+    if (p->profile == NULL && (p->profile = profile_new(L, p)) == NULL)
+        return;
+
+    Instruction i = *pc;
+    int32_t index = pc - p->code;
+    uint8_t *types = p->profile->types[index];
+
+    p->profile->counts[index]++;
+
+    switch (GET_OPCODE(i)) {
+        case OP_ADD ... OP_POW:
+        case OP_ADDNN ... OP_POWNN:
+        case OP_GETTABLE:
+        case OP_GETARRAY:
+        case OP_GETARRAYI:
+        case OP_GETINDEX:
+            types[0] |= profile_type(base + GETARG_B(i));
+            types[1] |= profile_type(base + GETARG_C(i));
+            break;
+        case OP_ADDK ... OP_POWK:
+        case OP_ADDNK ... OP_POWNK:
+        case OP_GETFIELD:
+            types[0] |= profile_type(base + GETARG_B(i));
+            break;
+        case OP_SETTABLE:
+        case OP_SETARRAY:
+        case OP_SETARRAYI:
+        case OP_SETINDEX:
+            types[1] |= profile_type(base + GETARG_B(i));
+            /* fallthrough */
+        case OP_SETFIELD:
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_CALLDIRECT:
+            types[0] |= profile_type(base + GETARG_A(i));
+            break;
+        case OP_CALLENVK:
+            /* The global is only looked up by the instruction, without __index */
+            types[0] |= profile_type(luaH_get(cl->env, &p->k[GETARG_B(i)]));
+            break;
+        default:
+            break;
+    }
+}
+
+/* profile_compare() -- orders the keys of luapp_profile_feedback()
+ *      args: two keys
+ *      rets: their difference
+ */
+static int profile_compare(const void *first, const void *second)
+{
+    uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+
+    return (a > b) - (a < b);
+}
+
+/* luapp_profile_feedback() -- writes the counters of the sites as a profile for luappc --profile
+ *      args: output stream
+ *      rets: 0 on success, EOF if writing failed or memory ran out
+ *
+ * Note: The format is described in common/feedback.h, one proto after the other.
+ */
+int luapp_profile_feedback(FILE *output)
+{
+    fprintf(output, "luapp-profile %d\n", FEEDBACK_VERSION);
+
+    for (struct profile_sites *sites = luapp_profile.sites; sites != NULL; sites = sites->next) {
+        uint64_t *keys = malloc(sites->size * sizeof(uint64_t)), total = 0;
+
+        if (keys == NULL)
+            return EOF;
+
+        /* The line, the kind and the position in one key, sorted the instructions of a line come
+         * together and those of a kind in order */
+        for (int32_t pc = 0; pc < sites->size; pc++) {
+            keys[pc] = (uint64_t)(uint32_t)sites->lines[pc] << 35 |
+                       (uint64_t)sites->kinds[pc] << 32 | (uint32_t)pc;
+            total += sites->counts[pc];
+        }
+
+        qsort(keys, sites->size, sizeof(uint64_t), profile_compare);
+        fprintf(output, "proto %d %llu\n", sites->linedefined, (unsigned long long)total);
+
+        for (int32_t first = 0, next; first < sites->size; first = next) {
+            uint64_t count = 0;
+
+            for (next = first; next < sites->size && keys[next] >> 35 == keys[first] >> 35; next++)
+                count += sites->counts[(uint32_t)keys[next]];
+
+            if (count > 0)
+                fprintf(output, "line %d %llu\n", (int32_t)(keys[first] >> 35),
+                        (unsigned long long)count);
+        }
+
+        /* Sites that never ran are left out, they still take their place among the others */
+        for (int32_t j = 0, ordinal = 0; j < sites->size; j++) {
+            uint32_t pc = (uint32_t)keys[j];
+            enum feedback_kind kind = sites->kinds[pc];
+
+            ordinal = j > 0 && keys[j] >> 32 == keys[j - 1] >> 32 ? ordinal + 1 : 0;
+
+            if (kind == FEEDBACK_NONE || sites->counts[pc] == 0)
+                continue;
+
+            fprintf(output, "site %d %d %s %d %llu %02x %02x\n", sites->linedefined,
+                    sites->lines[pc], feedback_kind_names[kind], ordinal,
+                    (unsigned long long)sites->counts[pc], sites->types[pc][0],
+                    sites->types[pc][1]);
+        }
+
+        free(keys);
+    }
+
+    return ferror(output) ? EOF : 0;
+}
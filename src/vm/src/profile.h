@@ -0,0 +1,106 @@
+/*  profile.h - only version
+ *      opcode profiler for luapp_execute
+ *
+ *  Only active in builds with -DLUAPP_PROFILE=1 (see `make runtime-profile`). Every dispatched
+ *  instruction is counted, the time until the next dispatch is charged to it and the pair of it
+ *  and the instruction before it is counted, so sequences worth fusing into a superinstruction
+ *  show up. Time is measured in TSC cycles on x86 and in nanoseconds elsewhere.
+ *
+ *  With luappvm -P the instructions of every proto are counted as well, together with the types
+ *  of the operands of arithmetic, table accesses and calls, and written as a profile for luappc
+ *  --profile (see common/feedback.h). Each proto gets its counters the first time it runs, they
+ *  outlive it so sites of the protos the collector freed are still written.
+ */
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../../common/feedback.h"
+#include "../../common/opcodes.h"
+
+#if !defined(LUAPP_PROFILE)
+#define LUAPP_PROFILE 0
+#endif
+
+/* No instruction is running (before the first dispatch or outside of luapp_execute) */
+#define PROFILE_NONE NUM_OPCODES
+
+struct luapp_profile {
+    uint64_t count[NUM_OPCODES];
+    uint64_t cycles[NUM_OPCODES];
+    uint64_t pairs[NUM_OPCODES][NUM_OPCODES]; /* pairs[first][second] */
+
+    int32_t current;  /* Opcode that is running, PROFILE_NONE if there is none */
+    uint64_t started; /* Timestamp of its dispatch */
+
+    int32_t feedback;            /* Whether the sites are recorded (luappvm -P) */
+    struct profile_sites *sites; /* Counters of every proto that ran, the last one first */
+};
+
+extern struct luapp_profile luapp_profile;
+
+struct lua_State;
+struct LClosure;
+struct lua_TValue;
+
+void luapp_profile_pause(void);
+int luapp_profile_dump(FILE *output);
+void luapp_profile_record(struct lua_State *L, struct LClosure *cl, const uint32_t *pc,
+                          struct lua_TValue *base);
+int luapp_profile_feedback(FILE *output);
+
+/* luapp_profile_clock() -- reads the clock the profiler measures with
+ *      args: none
+ *      rets: current timestamp
+ */
+static inline uint64_t luapp_profile_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/* luapp_profile_step() -- records the dispatch of an instruction
+ *      args: opcode
+ *      rets: none
+ */
+static inline void luapp_profile_step(int32_t op)
+{
+    uint64_t now = luapp_profile_clock();
+    int32_t previous = luapp_profile.current;
+
+    if (previous != PROFILE_NONE) {
+        luapp_profile.cycles[previous] += now - luapp_profile.started;
+        luapp_profile.pairs[previous][op]++;
+    }
+
+    luapp_profile.count[op]++;
+    luapp_profile.current = op;
+    luapp_profile.started = now;
+}
+
+/* luapp_profile_site() -- records the dispatch of an instruction of a proto with luappvm -P
+ *      args: state, closure running, instruction, base of its frame
+ *      rets: none
+ */
+static inline void luapp_profile_site(struct lua_State *L, struct LClosure *cl,
+                                      const uint32_t *pc, struct lua_TValue *base)
+{
+    if (luapp_profile.feedback)
+        luapp_profile_record(L, cl, pc, base);
+}
+
+#endif
@@ -0,0 +1,248 @@
+/*  sample.c - only version
+ *      timer, stack walk and folded output of the sampling profiler
+ */
+
+#define LUA_CORE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "lua/ldebug.h"
+#include "lua/lobject.h"
+
+#include "sample.h"
+
+/* Initial amount of slots of the stack table, it doubles whenever it is half full */
+#define SAMPLE_TABLE_SIZE 256
+
+/* Longest stack kept, deeper stacks lose their outermost frames */
+#define SAMPLE_STACK_MAX 4096
+
+struct sample_entry {
+    char *stack; /* NULL if the slot is empty */
+    uint32_t hash;
+    uint64_t count;
+};
+
+/* Distinct stacks and their counts, shared by the states of every thread */
+static struct {
+    struct sample_entry *entries;
+    uint32_t size, used;
+    pthread_mutex_t lock;
+} sample_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+volatile sig_atomic_t luapp_sample_pending = 0;
+
+static void sample_signal(int signal)
+{
+    (void)signal;
+    luapp_sample_pending = 1;
+}
+
+/* luapp_sample_start() -- starts the profiling timer
+ *      args: samples per second of CPU time
+ *      rets: 0 on success, -1 if the timer could not be set
+ */
+int luapp_sample_start(int hz)
+{
+    struct sigaction action;
+    struct itimerval timer;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (hz < 1 || hz > 1000000 || sigaction(SIGPROF, &action, NULL))
+        return -1;
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+
+    return setitimer(ITIMER_PROF, &timer, NULL) ? -1 : 0;
+}
+
+/* luapp_sample_stop() -- stops the profiling timer, the samples taken are kept
+ *      args: none
+ *      rets: none
+ */
+void luapp_sample_stop(void)
+{
+    struct itimerval timer;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    luapp_sample_pending = 0;
+}
+
+/* sample_hash() -- FNV-1a hash of a stack
+ *      args: folded stack
+ *      rets: hash
+ */
+static uint32_t sample_hash(const char *stack)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*stack != '\0')
+        hash = (hash ^ (unsigned char)*stack++) * 16777619u;
+
+    return hash;
+}
+
+/* sample_slot() -- finds the slot of a stack in a table, or the empty slot it goes into
+ *      args: entries, number of slots (a power of two), stack, its hash
+ *      rets: slot
+ */
+static struct sample_entry *sample_slot(struct sample_entry *entries, uint32_t size,
+                                        const char *stack, uint32_t hash)
+{
+    uint32_t i = hash & (size - 1);
+
+    while (entries[i].stack != NULL &&
+           (entries[i].hash != hash || strcmp(entries[i].stack, stack) != 0))
+        i = (i + 1) & (size - 1);
+
+    return &entries[i];
+}
+
+/* sample_grow() -- doubles the stack table, called with the lock held
+ *      args: none
+ *      rets: 0 on success, -1 if memory ran out
+ */
+static int sample_grow(void)
+{
+    uint32_t size = sample_table.size > 0 ? sample_table.size * 2 : SAMPLE_TABLE_SIZE;
+    struct sample_entry *entries = calloc(size, sizeof(struct sample_entry));
+
+    if (entries == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < sample_table.size; i++) {
+        struct sample_entry *entry = &sample_table.entries[i];
+
+        if (entry->stack != NULL)
+            *sample_slot(entries, size, entry->stack, entry->hash) = *entry;
+    }
+
+    free(sample_table.entries);
+    sample_table.entries = entries;
+    sample_table.size = size;
+    return 0;
+}
+
+/* sample_record() -- counts a sample of a stack
+ *      args: folded stack
+ *      rets: none
+ */
+static void sample_record(const char *stack)
+{
+    uint32_t hash = sample_hash(stack);
+
+    pthread_mutex_lock(&sample_table.lock);
+
+    if (2 * (sample_table.used + 1) > sample_table.size && sample_grow()) {
+        pthread_mutex_unlock(&sample_table.lock);
+        return;
+    }
+
+    struct sample_entry *entry = sample_slot(sample_table.entries, sample_table.size, stack, hash);
+
+    if (entry->stack == NULL) {
+        entry->stack = strdup(stack);
+        entry->hash = hash;
+
+        if (entry->stack == NULL) {
+            pthread_mutex_unlock(&sample_table.lock);
+            return;
+        }
+        sample_table.used++;
+    }
+
+    entry->count++;
+    pthread_mutex_unlock(&sample_table.lock);
+}
+
+/* sample_frame() -- writes the name of a frame
+ *      args: buffer, its size, state, frame, instruction after the one running in it
+ *      rets: number of characters the name needs
+ */
+static int sample_frame(char *buffer, size_t size, lua_State *L, CallInfo *ci,
+                        const Instruction *pc)
+{
+    if (!isLua(ci))
+        return snprintf(buffer, size, "[C]");
+
+    Proto *p = ci_func(ci)->l.p;
+    int index = pc != NULL ? pcRel(pc, p) : 0;
+    const char *source = getstr(p->source);
+
+    /* Chunk names start with '=' or '@' (see luaO_chunkid) */
+    if (*source == '=' || *source == '@')
+        source++;
+
+    if (index < 0 || index >= p->sizecode)
+        index = 0;
+
+    luaG_loaddebug(L, p);
+    return snprintf(buffer, size, "%s:%d", source, getline(p, index));
+}
+
+/* luapp_sample() -- records the stack of a state, called by luapp_execute once the timer fired
+ *      args: state, instruction after the one running in the innermost frame
+ *      rets: none
+ */
+void luapp_sample(lua_State *L, const Instruction *pc)
+{
+    char stack[SAMPLE_STACK_MAX];
+    size_t length = 0;
+
+    luapp_sample_pending = 0;
+
+    /* From the innermost frame outwards, the frames are prepended */
+    stack[SAMPLE_STACK_MAX - 1] = '\0';
+    size_t start = SAMPLE_STACK_MAX - 1;
+
+    for (CallInfo *ci = L->ci; ci > L->base_ci; ci--) {
+        char frame[256];
+        int size = sample_frame(frame, sizeof(frame), L, ci, ci == L->ci ? pc : ci->savedpc);
+
+        if (size < 0 || (size_t)size >= sizeof(frame))
+            size = sizeof(frame) - 1;
+
+        /* The name and the separator before the frame it calls */
+        if (start < (size_t)size + (length > 0))
+            break;
+
+        if (length > 0)
+            stack[--start] = ';';
+
+        start -= size;
+        memcpy(&stack[start], frame, size);
+        length += size;
+    }
+
+    if (length > 0)
+        sample_record(&stack[start]);
+}
+
+/* luapp_sample_dump() -- writes the stacks sampled so far in the folded format
+ *      args: output stream
+ *      rets: 0 on success, EOF if writing failed
+ */
+int luapp_sample_dump(FILE *output)
+{
+    pthread_mutex_lock(&sample_table.lock);
+
+    for (uint32_t i = 0; i < sample_table.size; i++) {
+        struct sample_entry *entry = &sample_table.entries[i];
+
+        if (entry->stack != NULL)
+            fprintf(output, "%s %llu\n", entry->stack, (unsigned long long)entry->count);
+    }
+
+    pthread_mutex_unlock(&sample_table.lock);
+    return ferror(output) ? EOF : 0;
+}
@@ -0,0 +1,41 @@
+/*  sample.h - only version
+ *      sampling profiler attributing time to the source lines of Lua++ functions
+ *
+ *  Off unless luapp_sample_start() (luappvm -s out.folded) was called. A profiling timer raises
+ *  SIGPROF at the given rate, the handler only sets luapp_sample_pending, luapp_execute checks it
+ *  whenever it enters a function and at the backward jumps of loops and records the stack of the
+ *  running state there. Time spent in C functions, the collector or native code is charged to the
+ *  next check, so it lands on the closest interpreted line.
+ *
+ *  Stacks are written in the folded format of flamegraph.pl, one line per distinct stack: the
+ *  frames from the outermost one, separated by ';', then the number of samples. Lua frames read
+ *  "source:line" (the line running in it, from Proto.lineinfo), C functions read "[C]".
+ */
+
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "lua/lstate.h"
+
+/* Samples per second of CPU time taken by luappvm -s */
+#define LUAPP_SAMPLE_HZ 997
+
+/* Set by the timer, cleared by luapp_sample() */
+extern volatile sig_atomic_t luapp_sample_pending;
+
+int luapp_sample_start(int hz);
+void luapp_sample_stop(void);
+void luapp_sample(lua_State *L, const Instruction *pc);
+int luapp_sample_dump(FILE *output);
+
+/* Records the stack if the timer fired since the last sample, pc is the running instruction */
+#define luapp_sample_check(L, pc)                                                                  \
+    {                                                                                              \
+        if (luapp_sample_pending)                                                                  \
+            luapp_sample(L, pc);                                                                   \
+    }
+
+#endif
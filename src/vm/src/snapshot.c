@@ -0,0 +1,1365 @@
+/*  snapshot.c - only version
+ *      writing and restoring images of the heap (see snapshot.h)
+ */
+
+#define LUA_CORE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/larray.h"
+#include "lua/lauxlib.h"
+#include "lua/lfunc.h"
+#include "lua/lgc.h"
+#include "lua/lstate.h"
+#include "lua/lstring.h"
+#include "lua/ltable.h"
+
+#include "snapshot.h"
+
+/* Images are mapped into memory whenever the platform supports it, like bytecode files. Build with
+ * -DLUAPP_USE_MMAP=0 to read them into a buffer instead. */
+#if !defined(LUAPP_USE_MMAP)
+#if defined(LUA_USE_POSIX)
+#define LUAPP_USE_MMAP 1
+#else
+#define LUAPP_USE_MMAP 0
+#endif
+#endif
+
+#if LUAPP_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * An image is laid out as
+ *      SNAPSHOT_MAGIC, SNAPSHOT_VERSION
+ *      strings     their count, then the size and the bytes of each one
+ *      programs    their count, then the source (a string id), the size and the bytecode of
+ *                  each one
+ *      objects     their count, the id of the globals, then how each one is created: its kind and
+ *                  what is needed before any object can refer to it
+ *      contents    what the tables, closures, upvalues and arrays hold, in the order of the objects
+ *
+ * Counts, sizes and ids are uint32, an object only refers to objects with a lower id when it is
+ * created, so the libraries are looked up parents first.
+ */
+
+#define SNAPSHOT_NONE UINT32_MAX
+
+/* Objects of an image */
+enum snapshot_kind {
+    SNAPSHOT_LIBRARY, /* Parent object (SNAPSHOT_NONE for package.loaded), key and type */
+    SNAPSHOT_TABLE,   /* Size of the array part, number of other entries, whether it is a record */
+    SNAPSHOT_CLOSURE, /* Program, index of the proto in it and number of upvalues */
+    SNAPSHOT_UPVAL,
+    SNAPSHOT_ARRAY /* Kind of the elements and their number */
+};
+
+/* Values are a tag byte and its payload */
+enum snapshot_tag {
+    SNAPSHOT_NIL,
+    SNAPSHOT_FALSE,
+    SNAPSHOT_TRUE,
+    SNAPSHOT_NUMBER, /* A lua_Number */
+    SNAPSHOT_STRING, /* The id of the string */
+    SNAPSHOT_OBJECT  /* The id of the object */
+};
+
+/* Library object of the saved state, the keys of its path lead to `fresh' in a state that only
+ * opened the libraries */
+struct snapshot_path {
+    GCObject *live;
+    GCObject *fresh;
+    uint32_t parent; /* Path of the table holding it, SNAPSHOT_NONE for package.loaded */
+    TValue key;      /* Its key in that table, a number or a string of the saved state */
+    int changed;     /* Tables: their contents differ from the fresh one, they are written whole */
+};
+
+struct snapshot_object {
+    GCObject *o;
+    enum snapshot_kind kind;
+    uint32_t path;    /* Libraries: their path */
+    uint32_t program; /* Closures: the program of their proto */
+};
+
+struct snapshot_writer {
+    lua_State *L;
+    lua_State *fresh; /* Opened the libraries only */
+
+    Table *ids;     /* Object (an upvalue as light userdata) -> its id */
+    Table *strings; /* String -> its id */
+    Table *paths;   /* Library object -> its path */
+    Table *claimed; /* Of `fresh': object -> the path that leads to it */
+
+    struct snapshot_path *path;
+    uint32_t path_count, path_space;
+    struct snapshot_object *objects;
+    uint32_t count, space;
+    TString **string_list;
+    uint32_t string_count, string_space;
+    struct luapp_image **programs;
+    uint32_t program_count, program_space;
+    uint32_t *sources; /* String id of the source of each program */
+
+    const char *error; /* Why the heap can not be saved, NULL while it can */
+};
+
+struct snapshot_reader {
+    lua_State *L;
+    const char *p, *end;
+    int malformed;
+
+    TString **strings;
+    uint32_t string_count;
+    struct luapp_image **programs;
+    TString **debug; /* Debug section of each program, shared by its stubs */
+    TString **sources;
+    Proto ***protos; /* Stubs of each program by index, created once */
+    uint32_t program_count;
+    GCObject **objects;
+    lu_byte *kinds;
+    uint32_t count;
+    UpVal *empty; /* Upvalue of the closures until their own ones are set */
+
+    const char *error; /* Why the image can not be restored, NULL while it can */
+};
+
+/* reserve() -- grows an array of the writer to have room for one more element
+ *      args: writer, array, its space, number of elements, size of an element
+ *      rets: 0 on success, 1 if memory ran out
+ */
+static int reserve(struct snapshot_writer *w, void *array, uint32_t *space, uint32_t count,
+                   size_t size)
+{
+    void **elements = array;
+
+    if (count < *space)
+        return 0;
+
+    uint32_t grown = *space < 16 ? 16 : 2 * *space;
+    void *larger = realloc(*elements, grown * size);
+
+    if (larger == NULL) {
+        w->error = "not enough memory";
+        return 1;
+    }
+
+    *elements = larger;
+    *space = grown;
+    return 0;
+}
+
+/* map_get() -- reads the index a table of the writer maps a key to
+ *      args: table, key
+ *      rets: index or SNAPSHOT_NONE if there is none
+ */
+static uint32_t map_get(Table *map, const TValue *key)
+{
+    const TValue *index = luaH_get(map, key);
+    return ttisnumber(index) ? (uint32_t)nvalue(index) : SNAPSHOT_NONE;
+}
+
+/* map_set() -- maps a key to an index in a table of the writer
+ *      args: state of the table, table, key, index
+ *      rets: none
+ */
+static void map_set(lua_State *L, Table *map, const TValue *key, uint32_t index)
+{
+    setnvalue(luaH_set(L, map, key), cast_num(index));
+}
+
+/* set_object() -- makes a value of an object, upvalues are no values and become light userdata
+ *      args: state, value (set), object
+ *      rets: none
+ */
+static void set_object(lua_State *L, TValue *value, GCObject *o)
+{
+    switch (o->gch.tt) {
+        case LUA_TTABLE:
+            sethvalue(L, value, gco2h(o));
+            break;
+        case LUA_TFUNCTION:
+            setclvalue(L, value, gco2cl(o));
+            break;
+        case LUA_TUSERDATA:
+            setuvalue(L, value, rawgco2u(o));
+            break;
+        case LUA_TARRAY:
+            setarrvalue(L, value, gco2a(o));
+            break;
+        case LUA_TTHREAD:
+            setthvalue(L, value, gco2th(o));
+            break;
+        default:
+            setpvalue(value, o);
+            break;
+    }
+}
+
+/* table_next() -- steps through the entries of a table in place: its array part, then the fields
+ * of its shape or its nodes
+ *      args: state, table, position (0 for the first entry), key (set), value (set)
+ *      rets: position after the entry, 0 once there is none
+ */
+static int table_next(lua_State *L, Table *t, int i, TValue *key, TValue **value)
+{
+    int size = t->sizearray + (t->shape != NULL ? t->shape->nkeys : sizenode(t));
+
+    for (; i < size; i++) {
+        TValue *v;
+
+        if (i < t->sizearray) {
+            v = &t->array[i];
+            setnvalue(key, cast_num(i + 1));
+        } else if (t->shape != NULL) {
+            v = &t->fields[i - t->sizearray];
+            setsvalue(L, key, t->shape->keys[i - t->sizearray]);
+        } else {
+            Node *n = gnode(t, i - t->sizearray);
+            v = gval(n);
+            setobj(L, key, key2tval(n));
+        }
+
+        if (!ttisnil(v)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* loaded() -- finds package.loaded of a state
+ *      args: state
+ *      rets: the table or NULL if the state has none
+ */
+static Table *loaded(lua_State *L)
+{
+    const TValue *t = luaH_getstr(hvalue(registry(L)), luaS_newliteral(L, "_LOADED"));
+    return ttistable(t) ? hvalue(t) : NULL;
+}
+
+/* move_key() -- makes a key of a table of one state a key of another one
+ *      args: state of the key (set), key (set), key to move
+ *      rets: 0 on success, 1 if the key is neither a string nor a number
+ */
+static int move_key(lua_State *L, TValue *key, const TValue *from)
+{
+    if (ttisstring(from)) {
+        setsvalue(L, key, luaS_newlstr(L, svalue(from), tsvalue(from)->len));
+    } else if (ttisnumber(from)) {
+        setnvalue(key, nvalue(from));
+    } else
+        return 1;
+
+    return 0;
+}
+
+/* path_add() -- gives a library object of the saved state the path of its fresh counterpart
+ *      args: writer, object, its fresh counterpart, path of the table holding it, key in it
+ *      rets: none
+ */
+static void path_add(struct snapshot_writer *w, const TValue *live, const TValue *fresh,
+                     uint32_t parent, const TValue *key)
+{
+    if (reserve(w, &w->path, &w->path_space, w->path_count, sizeof(*w->path)))
+        return;
+
+    struct snapshot_path *path = &w->path[w->path_count];
+
+    path->live = gcvalue(live);
+    path->fresh = gcvalue(fresh);
+    path->parent = parent;
+    setobj(w->L, &path->key, key);
+    path->changed = 0;
+
+    map_set(w->L, w->paths, live, w->path_count);
+    map_set(w->fresh, w->claimed, fresh, w->path_count);
+    w->path_count++;
+}
+
+/* same_library() -- whether a value of the saved state stands for the object the libraries of the
+ * fresh state have at the same place: the same C function, a table or a userdata
+ *      args: value of the saved state, value of the fresh state
+ *      rets: 1 if it does, 0 otherwise
+ */
+static int same_library(const TValue *live, const TValue *fresh)
+{
+    if (ttisfunction(fresh)) {
+        Closure *f = clvalue(fresh);
+
+        if (!ttisfunction(live) || !f->c.isC || !clvalue(live)->c.isC)
+            return 0;
+
+        return clvalue(live)->c.f == f->c.f && clvalue(live)->c.nupvalues == f->c.nupvalues;
+    }
+
+    return (ttistable(fresh) && ttistable(live)) || (ttisuserdata(fresh) && ttisuserdata(live));
+}
+
+/* find_paths() -- walks what the libraries of the fresh state reach from package.loaded, breadth
+ * first, and follows the same keys in the saved state. Every object is claimed by one path only.
+ *      args: writer, package.loaded of the saved state, package.loaded of the fresh state
+ *      rets: none
+ */
+static void find_paths(struct snapshot_writer *w, Table *live_loaded, Table *fresh_loaded)
+{
+    TValue live, fresh, key;
+
+    sethvalue(w->L, &live, live_loaded);
+    sethvalue(w->fresh, &fresh, fresh_loaded);
+    setnilvalue(&key);
+    path_add(w, &live, &fresh, SNAPSHOT_NONE, &key);
+
+    for (uint32_t i = 0; i < w->path_count && w->error == NULL; i++) {
+        if (w->path[i].fresh->gch.tt != LUA_TTABLE)
+            continue;
+
+        Table *l = gco2h(w->path[i].live), *f = gco2h(w->path[i].fresh);
+        TValue *value;
+
+        for (int n = table_next(w->fresh, f, 0, &fresh, &value); n != 0;
+             n = table_next(w->fresh, f, n, &fresh, &value)) {
+            if (!iscollectable(value) || move_key(w->L, &key, &fresh))
+                continue;
+
+            const TValue *v = luaH_get(l, &key);
+
+            if (!same_library(v, value) || map_get(w->paths, v) != SNAPSHOT_NONE ||
+                map_get(w->claimed, value) != SNAPSHOT_NONE)
+                continue;
+
+            path_add(w, v, value, i, &key);
+        }
+    }
+}
+
+/* same_value() -- whether an entry of a library table of the saved state is the one of the fresh
+ * state
+ *      args: writer, value of the saved state, value of the fresh state
+ *      rets: 1 if it is, 0 otherwise
+ */
+static int same_value(struct snapshot_writer *w, const TValue *live, const TValue *fresh)
+{
+    switch (ttype(live)) {
+        case LUA_TNUMBER:
+            return ttisnumber(fresh) && nvalue(live) == nvalue(fresh);
+        case LUA_TBOOLEAN:
+            return ttisboolean(fresh) && bvalue(live) == bvalue(fresh);
+        case LUA_TSTRING:
+            return ttisstring(fresh) && tsvalue(live)->len == tsvalue(fresh)->len &&
+                   memcmp(svalue(live), svalue(fresh), tsvalue(live)->len) == 0;
+        default: {
+            uint32_t path = map_get(w->paths, live);
+            return iscollectable(fresh) && path != SNAPSHOT_NONE &&
+                   w->path[path].fresh == gcvalue(fresh);
+        }
+    }
+}
+
+/* library_changed() -- whether a library table of the saved state holds something else than its
+ * fresh counterpart
+ *      args: writer, path of the table
+ *      rets: 1 if it does, 0 otherwise
+ */
+static int library_changed(struct snapshot_writer *w, const struct snapshot_path *path)
+{
+    Table *l = gco2h(path->live), *f = gco2h(path->fresh);
+    TValue key, fresh, *value;
+    int entries = 0;
+
+    if (l->metatable != NULL || f->metatable != NULL)
+        return 1;
+
+    for (int n = table_next(w->fresh, f, 0, &key, &value); n != 0;
+         n = table_next(w->fresh, f, n, &key, &value))
+        entries++;
+
+    for (int n = table_next(w->L, l, 0, &key, &value); n != 0;
+         n = table_next(w->L, l, n, &key, &value)) {
+        if (move_key(w->fresh, &fresh, &key) || !same_value(w, value, luaH_get(f, &fresh)))
+            return 1;
+
+        entries--;
+    }
+
+    return entries != 0;
+}
+
+/* string_id() -- gives a string an id
+ *      args: writer, string
+ *      rets: id
+ */
+static uint32_t string_id(struct snapshot_writer *w, TString *s)
+{
+    TValue key;
+
+    setsvalue(w->L, &key, s);
+    uint32_t id = map_get(w->strings, &key);
+
+    if (id != SNAPSHOT_NONE)
+        return id;
+
+    if (reserve(w, &w->string_list, &w->string_space, w->string_count, sizeof(TString *)))
+        return 0;
+
+    w->string_list[w->string_count] = s;
+    map_set(w->L, w->strings, &key, w->string_count);
+    return w->string_count++;
+}
+
+/* program_id() -- gives the program of a proto an id, its bytecode is written into the image
+ *      args: writer, proto
+ *      rets: id
+ */
+static uint32_t program_id(struct snapshot_writer *w, Proto *p)
+{
+    for (uint32_t i = 0; i < w->program_count; i++) {
+        if (w->programs[i] == p->image)
+            return i;
+    }
+
+    uint32_t space = w->program_space;
+
+    if (p->source == NULL)
+        w->error = "a proto without a source can not be saved";
+    else if (!reserve(w, &w->programs, &w->program_space, w->program_count, sizeof(*w->programs)))
+        w->program_space = space;
+
+    /* Both arrays grow together */
+    if (w->error != NULL ||
+        reserve(w, &w->sources, &w->program_space, w->program_count, sizeof(*w->sources)))
+        return 0;
+
+    w->programs[w->program_count] = p->image;
+    w->sources[w->program_count] = string_id(w, p->source);
+    return w->program_count++;
+}
+
+/* object_id() -- gives an object an id, the tables holding a library object get theirs first
+ *      args: writer, object
+ *      rets: id
+ */
+static uint32_t object_id(struct snapshot_writer *w, GCObject *o)
+{
+    struct snapshot_object object = {o, SNAPSHOT_TABLE, SNAPSHOT_NONE, SNAPSHOT_NONE};
+    TValue key;
+
+    set_object(w->L, &key, o);
+    uint32_t id = map_get(w->ids, &key);
+
+    if (id != SNAPSHOT_NONE || w->error != NULL)
+        return id;
+
+    uint32_t path = o->gch.tt != LUA_TUPVAL ? map_get(w->paths, &key) : SNAPSHOT_NONE;
+
+    if (path != SNAPSHOT_NONE) {
+        object.kind = SNAPSHOT_LIBRARY;
+        object.path = path;
+
+        if (w->path[path].parent != SNAPSHOT_NONE)
+            object_id(w, w->path[w->path[path].parent].live);
+        if (ttisstring(&w->path[path].key))
+            string_id(w, rawtsvalue(&w->path[path].key));
+    } else {
+        switch (o->gch.tt) {
+            case LUA_TTABLE:
+                break;
+            case LUA_TFUNCTION:
+                if (gco2cl(o)->c.isC)
+                    w->error = "a C function the libraries do not have can not be saved";
+                else if (gco2cl(o)->l.p->image == NULL)
+                    w->error = "a proto of bytecode before version 7 can not be saved";
+                else {
+                    object.kind = SNAPSHOT_CLOSURE;
+                    object.program = program_id(w, gco2cl(o)->l.p);
+                }
+                break;
+            case LUA_TUPVAL:
+                object.kind = SNAPSHOT_UPVAL;
+                break;
+            case LUA_TARRAY:
+                object.kind = SNAPSHOT_ARRAY;
+                break;
+            case LUA_TUSERDATA:
+                w->error = "a userdata the libraries do not have can not be saved";
+                break;
+            default:
+                w->error = "a coroutine can not be saved";
+                break;
+        }
+    }
+
+    if (w->error != NULL || reserve(w, &w->objects, &w->space, w->count, sizeof(*w->objects)))
+        return 0;
+
+    w->objects[w->count] = object;
+    map_set(w->L, w->ids, &key, w->count);
+    return w->count++;
+}
+
+/* visit_value() -- gives the string or the object of a value an id
+ *      args: writer, value
+ *      rets: none
+ */
+static void visit_value(struct snapshot_writer *w, const TValue *value)
+{
+    switch (ttype(value)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+            break;
+        case LUA_TSTRING:
+            string_id(w, rawtsvalue(value));
+            break;
+        case LUA_TLIGHTUSERDATA:
+            w->error = "a light userdata can not be saved";
+            break;
+        default:
+            object_id(w, gcvalue(value));
+            break;
+    }
+}
+
+/* visit_objects() -- gives everything the objects refer to an id, until every object was visited
+ *      args: writer
+ *      rets: none
+ */
+static void visit_objects(struct snapshot_writer *w)
+{
+    TValue key, *value;
+
+    for (uint32_t i = 0; i < w->count && w->error == NULL; i++) {
+        GCObject *o = w->objects[i].o;
+
+        switch (w->objects[i].kind) {
+            case SNAPSHOT_LIBRARY:
+                /* The others are looked up as they are */
+                if (o->gch.tt != LUA_TTABLE || !w->path[w->objects[i].path].changed)
+                    break;
+                /* fall through */
+            case SNAPSHOT_TABLE: {
+                Table *t = gco2h(o);
+
+                if (t->metatable != NULL)
+                    object_id(w, obj2gco(t->metatable));
+
+                for (int n = table_next(w->L, t, 0, &key, &value); n != 0;
+                     n = table_next(w->L, t, n, &key, &value)) {
+                    visit_value(w, &key);
+                    visit_value(w, value);
+                }
+                break;
+            }
+            case SNAPSHOT_CLOSURE: {
+                LClosure *cl = &gco2cl(o)->l;
+
+                object_id(w, obj2gco(cl->env));
+                for (int j = 0; j < cl->nupvalues; j++)
+                    object_id(w, obj2gco(cl->upvals[j]));
+                break;
+            }
+            case SNAPSHOT_UPVAL: {
+                UpVal *uv = gco2uv(o);
+
+                if (uv->v != &uv->u.value)
+                    w->error = "an upvalue that is still open can not be saved";
+                else
+                    visit_value(w, uv->v);
+                break;
+            }
+            case SNAPSHOT_ARRAY:
+                break;
+        }
+    }
+}
+
+static void write_u32(FILE *output, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, output);
+}
+
+/* write_value() -- writes a value, its string or object has an id
+ *      args: writer, output, value
+ *      rets: none
+ */
+static void write_value(struct snapshot_writer *w, FILE *output, const TValue *value)
+{
+    switch (ttype(value)) {
+        case LUA_TNIL:
+            putc(SNAPSHOT_NIL, output);
+            break;
+        case LUA_TBOOLEAN:
+            putc(bvalue(value) ? SNAPSHOT_TRUE : SNAPSHOT_FALSE, output);
+            break;
+        case LUA_TNUMBER: {
+            lua_Number n = nvalue(value);
+
+            putc(SNAPSHOT_NUMBER, output);
+            fwrite(&n, sizeof(n), 1, output);
+            break;
+        }
+        case LUA_TSTRING:
+            putc(SNAPSHOT_STRING, output);
+            write_u32(output, map_get(w->strings, value));
+            break;
+        default:
+            putc(SNAPSHOT_OBJECT, output);
+            write_u32(output, map_get(w->ids, value));
+            break;
+    }
+}
+
+/* write_table() -- writes the metatable and the entries of a table
+ *      args: writer, output, table
+ *      rets: none
+ */
+static void write_table(struct snapshot_writer *w, FILE *output, Table *t)
+{
+    TValue key, *value;
+    uint32_t entries = 0;
+
+    if (t->metatable != NULL) {
+        sethvalue(w->L, &key, t->metatable);
+        write_value(w, output, &key);
+    } else
+        putc(SNAPSHOT_NIL, output);
+
+    for (int n = table_next(w->L, t, 0, &key, &value); n != 0;
+         n = table_next(w->L, t, n, &key, &value))
+        entries++;
+
+    write_u32(output, entries);
+
+    for (int n = table_next(w->L, t, 0, &key, &value); n != 0;
+         n = table_next(w->L, t, n, &key, &value)) {
+        write_value(w, output, &key);
+        write_value(w, output, value);
+    }
+}
+
+/* write_object() -- writes how an object is created
+ *      args: writer, output, object
+ *      rets: none
+ */
+static void write_object(struct snapshot_writer *w, FILE *output, const struct snapshot_object *o)
+{
+    TValue key, *value;
+
+    putc(o->kind, output);
+
+    switch (o->kind) {
+        case SNAPSHOT_LIBRARY: {
+            const struct snapshot_path *path = &w->path[o->path];
+            TValue parent;
+
+            if (path->parent != SNAPSHOT_NONE) {
+                set_object(w->L, &parent, w->path[path->parent].live);
+                write_u32(output, map_get(w->ids, &parent));
+            } else
+                write_u32(output, SNAPSHOT_NONE);
+
+            write_value(w, output, &path->key);
+            putc(o->o->gch.tt, output);
+            break;
+        }
+        case SNAPSHOT_TABLE: {
+            Table *t = gco2h(o->o);
+            uint32_t entries = 0;
+
+            for (int n = table_next(w->L, t, t->sizearray, &key, &value); n != 0;
+                 n = table_next(w->L, t, n, &key, &value))
+                entries++;
+
+            write_u32(output, t->sizearray);
+            write_u32(output, entries);
+            putc(t->shape != NULL, output);
+            break;
+        }
+        case SNAPSHOT_CLOSURE: {
+            LClosure *cl = &gco2cl(o->o)->l;
+
+            write_u32(output, o->program);
+            write_u32(output, cl->p->imageindex);
+            putc(cl->nupvalues, output);
+            break;
+        }
+        case SNAPSHOT_UPVAL:
+            break;
+        case SNAPSHOT_ARRAY:
+            putc(gco2a(o->o)->kind, output);
+            write_u32(output, gco2a(o->o)->size);
+            break;
+    }
+}
+
+/* write_contents() -- writes what an object holds
+ *      args: writer, output, object
+ *      rets: none
+ */
+static void write_contents(struct snapshot_writer *w, FILE *output,
+                           const struct snapshot_object *o)
+{
+    TValue value;
+
+    switch (o->kind) {
+        case SNAPSHOT_LIBRARY: {
+            int changed = o->o->gch.tt == LUA_TTABLE && w->path[o->path].changed;
+
+            putc(changed, output);
+            if (changed)
+                write_table(w, output, gco2h(o->o));
+            break;
+        }
+        case SNAPSHOT_TABLE:
+            write_table(w, output, gco2h(o->o));
+            break;
+        case SNAPSHOT_CLOSURE: {
+            LClosure *cl = &gco2cl(o->o)->l;
+
+            sethvalue(w->L, &value, cl->env);
+            write_u32(output, map_get(w->ids, &value));
+
+            for (int j = 0; j < cl->nupvalues; j++) {
+                set_object(w->L, &value, obj2gco(cl->upvals[j]));
+                write_u32(output, map_get(w->ids, &value));
+            }
+            break;
+        }
+        case SNAPSHOT_UPVAL:
+            write_value(w, output, gco2uv(o->o)->v);
+            break;
+        case SNAPSHOT_ARRAY: {
+            Array *a = gco2a(o->o);
+
+            if (a->kind == ARRAY_NUMBER)
+                fwrite(a->u.n, sizeof(lua_Number), a->size, output);
+            else
+                fwrite(a->u.b, sizeof(lu_byte), a->size, output);
+            break;
+        }
+    }
+}
+
+/* write_image() -- writes the image once every object has an id
+ *      args: writer, path of the image, id of the globals
+ *      rets: 0 on success, 1 otherwise
+ */
+static int write_image(struct snapshot_writer *w, const char *path, uint32_t globals)
+{
+    FILE *output = fopen(path, "wb");
+
+    if (output == NULL)
+        return 1;
+
+    fwrite(SNAPSHOT_MAGIC, 1, 4, output);
+    write_u32(output, SNAPSHOT_VERSION);
+
+    write_u32(output, w->string_count);
+    for (uint32_t i = 0; i < w->string_count; i++) {
+        write_u32(output, w->string_list[i]->tsv.len);
+        fwrite(getstr(w->string_list[i]), 1, w->string_list[i]->tsv.len, output);
+    }
+
+    write_u32(output, w->program_count);
+    for (uint32_t i = 0; i < w->program_count; i++) {
+        size_t size;
+        const char *bytecode = luapp_image_bytes(w->programs[i], &size);
+
+        write_u32(output, w->sources[i]);
+        write_u32(output, size);
+        fwrite(bytecode, 1, size, output);
+    }
+
+    write_u32(output, w->count);
+    write_u32(output, globals);
+
+    for (uint32_t i = 0; i < w->count; i++)
+        write_object(w, output, &w->objects[i]);
+    for (uint32_t i = 0; i < w->count; i++)
+        write_contents(w, output, &w->objects[i]);
+
+    int status = ferror(output);
+    return fclose(output) != 0 || status;
+}
+
+/* luapp_snapshot_save() -- writes an image of what the globals of a state reach
+ *      args: state, path of the image, function that opened the libraries of the state
+ *      rets: 0 on success, 1 with an error message pushed otherwise
+ */
+int luapp_snapshot_save(lua_State *L, const char *path, void (*openlibs)(lua_State *L))
+{
+    struct snapshot_writer w;
+    global_State *g = G(L);
+    lu_mem threshold = g->GCthreshold;
+
+    memset(&w, 0, sizeof(w));
+    w.L = L;
+
+    if ((w.fresh = luaL_newstate()) == NULL) {
+        lua_pushliteral(L, "not enough memory");
+        return 1;
+    }
+
+    openlibs(w.fresh);
+
+    /* Nothing the writer creates is anchored, both collectors wait until it is done */
+    g->GCthreshold = MAX_LUMEM;
+    G(w.fresh)->GCthreshold = MAX_LUMEM;
+
+    w.ids = luaH_new(L, 0, 0);
+    w.strings = luaH_new(L, 0, 0);
+    w.paths = luaH_new(L, 0, 0);
+    w.claimed = luaH_new(w.fresh, 0, 0);
+
+    Table *live = loaded(L), *fresh = loaded(w.fresh);
+    TValue globals;
+
+    if (live == NULL || fresh == NULL)
+        w.error = "the state did not open the libraries";
+    else
+        find_paths(&w, live, fresh);
+
+    for (uint32_t i = 0; i < w.path_count && w.error == NULL; i++) {
+        if (w.path[i].fresh->gch.tt == LUA_TTABLE)
+            w.path[i].changed = library_changed(&w, &w.path[i]);
+    }
+
+    sethvalue(L, &globals, hvalue(gt(L)));
+    visit_value(&w, &globals);
+    visit_objects(&w);
+
+    int status = w.error != NULL || write_image(&w, path, map_get(w.ids, &globals));
+
+    g->GCthreshold = threshold;
+    lua_close(w.fresh);
+
+    free(w.path);
+    free(w.objects);
+    free(w.string_list);
+    free(w.programs);
+    free(w.sources);
+
+    if (w.error != NULL)
+        lua_pushstring(L, w.error);
+    else if (status)
+        lua_pushfstring(L, "cannot write %s", path);
+
+    return status;
+}
+
+/* read_bytes() -- consumes bytes of an image
+ *      args: reader, number of bytes
+ *      rets: the bytes, or NULL if the image ends before them
+ */
+static const char *read_bytes(struct snapshot_reader *r, size_t size)
+{
+    if (r->malformed || (size_t)(r->end - r->p) < size) {
+        r->malformed = 1;
+        return NULL;
+    }
+
+    const char *bytes = r->p;
+    r->p += size;
+    return bytes;
+}
+
+static uint32_t read_u32(struct snapshot_reader *r)
+{
+    const char *bytes = read_bytes(r, sizeof(uint32_t));
+    uint32_t value = 0;
+
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static lu_byte read_u8(struct snapshot_reader *r)
+{
+    const char *bytes = read_bytes(r, 1);
+    return bytes != NULL ? (lu_byte)*bytes : 0;
+}
+
+/* read_count() -- reads a count of elements that take at least a number of bytes each
+ *      args: reader, bytes of an element
+ *      rets: the count, 0 if the rest of the image can not hold that many elements
+ */
+static uint32_t read_count(struct snapshot_reader *r, size_t size)
+{
+    uint32_t count = read_u32(r);
+
+    if (count > (size_t)(r->end - r->p) / size) {
+        r->malformed = 1;
+        return 0;
+    }
+    return count;
+}
+
+/* read_value() -- reads a value, every object it may refer to was created
+ *      args: reader, value (set)
+ *      rets: 0 on success, 1 if the value is malformed
+ */
+static int read_value(struct snapshot_reader *r, TValue *value)
+{
+    switch (read_u8(r)) {
+        case SNAPSHOT_NIL:
+            setnilvalue(value);
+            break;
+        case SNAPSHOT_FALSE:
+            setbvalue(value, 0);
+            break;
+        case SNAPSHOT_TRUE:
+            setbvalue(value, 1);
+            break;
+        case SNAPSHOT_NUMBER: {
+            const char *bytes = read_bytes(r, sizeof(lua_Number));
+            lua_Number n = 0;
+
+            if (bytes != NULL)
+                memcpy(&n, bytes, sizeof(n));
+            setnvalue(value, n);
+            break;
+        }
+        case SNAPSHOT_STRING: {
+            uint32_t id = read_u32(r);
+
+            if (id >= r->string_count)
+                return 1;
+            setsvalue(r->L, value, r->strings[id]);
+            break;
+        }
+        case SNAPSHOT_OBJECT: {
+            uint32_t id = read_u32(r);
+
+            if (id >= r->count || r->objects[id] == NULL || r->kinds[id] == SNAPSHOT_UPVAL)
+                return 1;
+            set_object(r->L, value, r->objects[id]);
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return r->malformed;
+}
+
+/* read_table() -- refills a table with its metatable and entries
+ *      args: reader, table
+ *      rets: 0 on success, 1 if the table is malformed
+ */
+static int read_table(struct snapshot_reader *r, Table *t)
+{
+    lua_State *L = r->L;
+    TValue key, value;
+
+    if (read_value(r, &value) || (!ttisnil(&value) && !ttistable(&value)))
+        return 1;
+
+    t->metatable = ttisnil(&value) ? NULL : hvalue(&value);
+    if (t->metatable != NULL)
+        luaC_objbarriert(L, t, t->metatable);
+
+    /* A key and a value take two bytes at least */
+    uint32_t entries = read_count(r, 2);
+
+    for (uint32_t i = 0; i < entries; i++) {
+        if (read_value(r, &key) || read_value(r, &value) || ttisnil(&key) ||
+            (ttisnumber(&key) && luai_numisnan(nvalue(&key))))
+            return 1;
+
+        setobj2t(L, luaH_set(L, t, &key), &value);
+        luaC_barriert(L, t, &value);
+    }
+
+    return r->malformed;
+}
+
+/* clear_table() -- removes the entries of a library table that is refilled
+ *      args: reader, table
+ *      rets: none
+ */
+static void clear_table(struct snapshot_reader *r, Table *t)
+{
+    TValue key, *value;
+
+    for (int n = table_next(r->L, t, 0, &key, &value); n != 0;
+         n = table_next(r->L, t, n, &key, &value))
+        setnilvalue(value);
+
+    t->metatable = NULL;
+    t->flags = 0;
+}
+
+/* read_programs() -- makes images of the programs of the closures, their protos are created once
+ *      args: reader
+ *      rets: 0 on success, 1 otherwise
+ */
+static int read_programs(struct snapshot_reader *r)
+{
+    uint32_t count = read_count(r, 2 * sizeof(uint32_t));
+
+    r->programs = calloc(count + 1, sizeof(*r->programs));
+    r->sources = calloc(count + 1, sizeof(*r->sources));
+    r->debug = calloc(count + 1, sizeof(*r->debug));
+    r->protos = calloc(count + 1, sizeof(*r->protos));
+
+    if (r->programs == NULL || r->sources == NULL || r->debug == NULL || r->protos == NULL) {
+        r->error = "not enough memory";
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t source = read_u32(r), size = read_u32(r);
+        const char *bytecode = read_bytes(r, size);
+
+        if (bytecode == NULL || source >= r->string_count)
+            return 1;
+
+        if ((r->programs[i] = luapp_image_copy(bytecode, size)) == NULL) {
+            r->error = "the image holds malformed bytecode";
+            return 1;
+        }
+
+        r->program_count++;
+        r->sources[i] = r->strings[source];
+        r->debug[i] = luapp_image_debug(r->L, r->programs[i]);
+
+        if ((r->protos[i] = calloc(luapp_image_count(r->programs[i]), sizeof(Proto *))) == NULL) {
+            r->error = "not enough memory";
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* read_object() -- creates an object
+ *      args: reader, id of the object
+ *      rets: 0 on success, 1 otherwise
+ */
+static int read_object(struct snapshot_reader *r, uint32_t id)
+{
+    lua_State *L = r->L;
+    lu_byte kind = read_u8(r);
+
+    r->kinds[id] = kind;
+
+    switch (kind) {
+        case SNAPSHOT_LIBRARY: {
+            uint32_t parent = read_u32(r);
+            TValue key;
+
+            if (read_value(r, &key))
+                return 1;
+
+            lu_byte type = read_u8(r);
+            const TValue *value;
+            TValue root;
+
+            if (parent == SNAPSHOT_NONE) {
+                sethvalue(L, &root, loaded(L));
+                value = &root;
+            } else if (parent < id && r->objects[parent]->gch.tt == LUA_TTABLE &&
+                       (ttisstring(&key) || ttisnumber(&key)))
+                value = luaH_get(gco2h(r->objects[parent]), &key);
+            else
+                return 1;
+
+            if (!iscollectable(value) || ttype(value) != type) {
+                r->error = "the image needs libraries the state did not open";
+                return 1;
+            }
+
+            r->objects[id] = gcvalue(value);
+            break;
+        }
+        case SNAPSHOT_TABLE: {
+            uint32_t narray = read_count(r, 1), entries = read_count(r, 2);
+
+            if (read_u8(r))
+                r->objects[id] = obj2gco(luaH_newrecord(L, narray, entries));
+            else
+                r->objects[id] = obj2gco(luaH_new(L, narray, entries));
+            break;
+        }
+        case SNAPSHOT_CLOSURE: {
+            uint32_t program = read_u32(r), index = read_u32(r);
+            lu_byte nups = read_u8(r);
+
+            if (program >= r->program_count || index >= luapp_image_count(r->programs[program]))
+                return 1;
+
+            Proto **stub = &r->protos[program][index];
+
+            if (*stub == NULL)
+                *stub = luapp_image_stub(L, r->programs[program], index, r->sources[program],
+                                         r->debug[program]);
+
+            if ((*stub)->nups != nups)
+                return 1;
+
+            Closure *cl = luaF_newLclosure(L, nups, hvalue(gt(L)));
+            cl->l.p = *stub;
+
+            /* The collector may see it before its contents are read if the image is malformed */
+            for (int j = 0; j < nups; j++)
+                cl->l.upvals[j] = r->empty;
+            r->objects[id] = obj2gco(cl);
+            break;
+        }
+        case SNAPSHOT_UPVAL:
+            r->objects[id] = obj2gco(luaF_newupval(L));
+            break;
+        case SNAPSHOT_ARRAY: {
+            lu_byte type = read_u8(r);
+
+            if (type != ARRAY_NUMBER && type != ARRAY_BOOLEAN)
+                return 1;
+
+            uint32_t size = read_count(r, arrayelemsize(type));
+            r->objects[id] = obj2gco(luaR_new(L, type, size));
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return r->malformed;
+}
+
+/* read_contents() -- fills an object
+ *      args: reader, id of the object
+ *      rets: 0 on success, 1 otherwise
+ */
+static int read_contents(struct snapshot_reader *r, uint32_t id)
+{
+    lua_State *L = r->L;
+    GCObject *o = r->objects[id];
+
+    switch (r->kinds[id]) {
+        case SNAPSHOT_LIBRARY:
+            if (!read_u8(r))
+                break;
+            if (o->gch.tt != LUA_TTABLE)
+                return 1;
+
+            clear_table(r, gco2h(o));
+            return read_table(r, gco2h(o));
+        case SNAPSHOT_TABLE:
+            return read_table(r, gco2h(o));
+        case SNAPSHOT_CLOSURE: {
+            LClosure *cl = &gco2cl(o)->l;
+            uint32_t env = read_u32(r);
+
+            if (env >= r->count || r->objects[env]->gch.tt != LUA_TTABLE)
+                return 1;
+            cl->env = gco2h(r->objects[env]);
+
+            for (int j = 0; j < cl->nupvalues; j++) {
+                uint32_t upval = read_u32(r);
+
+                if (upval >= r->count || r->kinds[upval] != SNAPSHOT_UPVAL)
+                    return 1;
+                cl->upvals[j] = gco2uv(r->objects[upval]);
+            }
+            break;
+        }
+        case SNAPSHOT_UPVAL: {
+            UpVal *uv = gco2uv(o);
+            TValue value;
+
+            if (read_value(r, &value))
+                return 1;
+
+            setobj(L, uv->v, &value);
+            luaC_barrier(L, uv, &value);
+            break;
+        }
+        case SNAPSHOT_ARRAY: {
+            Array *a = gco2a(o);
+            const char *elements = read_bytes(r, a->space * arrayelemsize(a->kind));
+
+            if (elements == NULL)
+                return 1;
+
+            if (a->kind == ARRAY_NUMBER)
+                memcpy(a->u.n, elements, a->space * sizeof(lua_Number));
+            else
+                memcpy(a->u.b, elements, a->space * sizeof(lu_byte));
+            a->size = a->space;
+            break;
+        }
+    }
+
+    return r->malformed;
+}
+
+/* read_image() -- rebuilds the objects of an image
+ *      args: reader
+ *      rets: 0 on success, 1 otherwise
+ */
+static int read_image(struct snapshot_reader *r)
+{
+    const char *magic = read_bytes(r, 4);
+
+    if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        read_u32(r) != SNAPSHOT_VERSION) {
+        r->error = "not a snapshot of this version";
+        return 1;
+    }
+
+    if (loaded(r->L) == NULL) {
+        r->error = "the state did not open the libraries";
+        return 1;
+    }
+
+    /* The strings are interned straight from the image */
+    r->string_count = read_count(r, sizeof(uint32_t));
+    if ((r->strings = calloc(r->string_count + 1, sizeof(TString *))) == NULL) {
+        r->error = "not enough memory";
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < r->string_count; i++) {
+        uint32_t size = read_u32(r);
+        const char *bytes = read_bytes(r, size);
+
+        if (bytes == NULL)
+            return 1;
+        r->strings[i] = luaS_newlstr(r->L, bytes, size);
+    }
+
+    if (read_programs(r))
+        return 1;
+
+    /* Every object takes a byte at least */
+    r->count = read_count(r, 1);
+    uint32_t globals = read_u32(r);
+
+    r->empty = luaF_newupval(r->L);
+    r->objects = calloc(r->count + 1, sizeof(GCObject *));
+    r->kinds = calloc(r->count + 1, sizeof(lu_byte));
+
+    if (r->objects == NULL || r->kinds == NULL) {
+        r->error = "not enough memory";
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < r->count; i++) {
+        if (read_object(r, i))
+            return 1;
+    }
+
+    for (uint32_t i = 0; i < r->count; i++) {
+        if (read_contents(r, i))
+            return 1;
+    }
+
+    if (globals >= r->count || r->objects[globals]->gch.tt != LUA_TTABLE)
+        return 1;
+
+    sethvalue(r->L, gt(r->L), gco2h(r->objects[globals]));
+    return 0;
+}
+
+/* map_image() -- maps an image into memory, or reads it whole where it can not be mapped
+ *      args: path of the image, size (set)
+ *      rets: the bytes or NULL if the image can not be read
+ */
+static const char *map_image(const char *path, size_t *size)
+{
+#if LUAPP_USE_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+
+    *size = map != MAP_FAILED ? (size_t)st.st_size : 0;
+    return map != MAP_FAILED ? map : NULL;
+#else
+    FILE *input = fopen(path, "rb");
+    char *data = NULL;
+    long length;
+
+    if (input != NULL && fseek(input, 0, SEEK_END) == 0 && (length = ftell(input)) > 0 &&
+        fseek(input, 0, SEEK_SET) == 0 && (data = malloc(length)) != NULL &&
+        fread(data, 1, length, input) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+
+    if (input != NULL)
+        fclose(input);
+
+    *size = data != NULL ? (size_t)length : 0;
+    return data;
+#endif
+}
+
+static void unmap_image(const char *data, size_t size)
+{
+#if LUAPP_USE_MMAP
+    munmap((void *)data, size);
+#else
+    free((void *)data);
+#endif
+}
+
+/* luapp_snapshot_restore() -- rebuilds the globals of an image in a state that opened the same
+ * libraries as the one it was saved from. After a failure the globals may be partially restored,
+ * the state should be closed.
+ *      args: state, path of the image
+ *      rets: 0 on success, 1 with an error message pushed otherwise
+ */
+int luapp_snapshot_restore(lua_State *L, const char *path)
+{
+    struct snapshot_reader r;
+    global_State *g = G(L);
+    lu_mem threshold = g->GCthreshold;
+    size_t size;
+    const char *data = map_image(path, &size);
+
+    if (data == NULL) {
+        lua_pushfstring(L, "cannot open %s", path);
+        return 1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.L = L;
+    r.p = data;
+    r.end = data + size;
+
+    /* The objects are only anchored by each other until the globals are set */
+    g->GCthreshold = MAX_LUMEM;
+    int status = read_image(&r);
+    g->GCthreshold = threshold;
+
+    /* The stubs keep the images they need */
+    for (uint32_t i = 0; i < r.program_count; i++) {
+        luapp_image_release(r.programs[i]);
+        free(r.protos[i]);
+    }
+
+    free(r.strings);
+    free(r.programs);
+    free(r.sources);
+    free(r.debug);
+    free(r.protos);
+    free(r.objects);
+    free(r.kinds);
+    unmap_image(data, size);
+
+    if (status)
+        lua_pushstring(L, r.error != NULL ? r.error : "malformed snapshot");
+
+    return status;
+}
@@ -0,0 +1,35 @@
+/*  snapshot.h - only version
+ *      images of an initialized heap, restored instead of running the programs that built it
+ *
+ *  luapp_snapshot_save() writes what the globals of a state reach once its programs ran: tables,
+ *  Lua closures and their upvalues, typed arrays and strings, along with the bytecode of every
+ *  program a closure comes from. luapp_snapshot_restore() rebuilds them in a state that opened the
+ *  same libraries, so a worker starts out with the globals its initialization would have left
+ *  without running it. Closures get stubs of the embedded programs, decoded the first time they
+ *  are called like the protos of a loaded program; inline caches, JIT counters and the lookup of
+ *  native code (luapp_aot_open) start over.
+ *
+ *  The objects of the libraries (their tables, C functions and the files of io) are not written.
+ *  They are found by the keys leading to them from package.loaded, compared with a state that only
+ *  opened the libraries, and looked up by the same keys when the image is restored. A library table
+ *  a program changed is refilled with what it held. Saving fails on what can not be rebuilt: C
+ *  functions and userdata the libraries do not have, coroutines, light userdata, upvalues that are
+ *  still open and protos of bytecode before version 7.
+ *
+ *  The GC heap is not mapped as it is, its objects are allocated by the state restoring them and
+ *  their references, the ids of the image, are relocated in a single pass over the mapped file.
+ *  Numbers are written in the byte order of the host.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "lua/lua.h"
+
+#define SNAPSHOT_MAGIC "\033LPS"
+#define SNAPSHOT_VERSION 1
+
+int luapp_snapshot_save(lua_State *L, const char *path, void (*openlibs)(lua_State *L));
+int luapp_snapshot_restore(lua_State *L, const char *path);
+
+#endif